@@ -19,6 +19,8 @@ import ctypes
 import collections
 import os
 import re
+import sys
+import threading
 import numpy
 import cv2
 
@@ -75,18 +77,84 @@ class _ApriltagDetection(ctypes.Structure):
     ]
 
 class _ApriltagDetector(ctypes.Structure):
-    '''Wraps apriltag_detector C struct.'''
+    '''Wraps (the leading fields of) apriltag_detector C struct.'''
     _fields_ = [
         ('nthreads', ctypes.c_int),
         ('quad_decimate', ctypes.c_float),
+        ('auto_decimate', ctypes.c_float),
+        ('auto_decimate_edge', ctypes.c_float),
+        ('quad_pyramid_levels', ctypes.c_int),
         ('quad_sigma', ctypes.c_float),
+        ('min_tag_size', ctypes.c_int),
+        ('max_tag_size', ctypes.c_int),
         ('refine_edges', ctypes.c_int),
         ('refine_decode', ctypes.c_int),
         ('refine_pose', ctypes.c_int),
+        ('goodness_samples', ctypes.c_int),
+        ('decode_bilinear', ctypes.c_int),
+        ('decode_min_border_contrast', ctypes.c_float),
+        ('max_detections', ctypes.c_int),
+        ('expected_ids', ctypes.POINTER(ctypes.c_int)),
+        ('nexpected_ids', ctypes.c_int),
+        ('budget_utime', ctypes.c_int64),
         ('debug', ctypes.c_int),
+        ('capture', ctypes.c_void_p),
         ('quad_contours', ctypes.c_int),
     ]
 
+# The layout of apriltag_detection_record C struct, as filled in (many
+# at a time) by apriltag_detector_detect_buffer.
+DETECTION_DTYPE = numpy.dtype([
+    ('family', numpy.uintp),
+    ('id', numpy.int32),
+    ('hamming', numpy.int32),
+    ('goodness', numpy.float32),
+    ('decision_margin', numpy.float32),
+    ('homography', numpy.float64, (3, 3)),
+    ('center', numpy.float64, (2,)),
+    ('corners', numpy.float64, (4, 2)),
+], align=True)
+
+# The layouts of apriltag_log_record C struct, the records of a binary
+# detection log (see apriltag_log.h, LogWriter and read_log): the
+# fields common to every record, and then those of each type.
+LOG_FAMILY, LOG_FRAME, LOG_DETECTION = 1, 2, 3
+
+_LOG_RECORD_FIELDS = [
+    ('utime', numpy.int64),
+    ('frame', numpy.uint32),
+    ('type', numpy.uint16),
+    ('family', numpy.uint16),
+]
+
+LOG_DETECTION_DTYPE = numpy.dtype(_LOG_RECORD_FIELDS + [
+    ('id', numpy.int32),
+    ('hamming', numpy.int32),
+    ('goodness', numpy.float32),
+    ('decision_margin', numpy.float32),
+    ('homography', numpy.float32, (3, 3)),
+    ('center', numpy.float32, (2,)),
+    ('corners', numpy.float32, (4, 2)),
+    ('reserved', numpy.uint8, (20,)),
+])
+
+LOG_FRAME_DTYPE = numpy.dtype(_LOG_RECORD_FIELDS + [
+    ('ndetections', numpy.uint32),
+    ('degraded', numpy.int32),
+    ('detect_utime', numpy.int64),
+    ('stage_utime', numpy.int64, (12,)),
+])
+
+LOG_FAMILY_DTYPE = numpy.dtype(_LOG_RECORD_FIELDS + [
+    ('d', numpy.uint32),
+    ('h', numpy.uint32),
+    ('ncodes', numpy.uint32),
+    ('name', 'S100'),
+])
+
+_LOG_MAGIC = b'ATAGLOG1'
+_LOG_HEADER_SIZE = 64
+
 ######################################################################
 
 def _ptr_to_array2d(datatype, ptr, rows, cols):
@@ -271,6 +339,7 @@ class Detector(object):
 
         self.libc = None
         self.tag_detector = None
+        self._pose_workerpool = None
 
         for path in searchpath:
             relpath = os.path.join(path, filename)
@@ -295,15 +364,22 @@ class Detector(object):
         self.tag_detector.contents.nthreads = int(options.nthreads)
         self.tag_detector.contents.quad_decimate = float(options.quad_decimate)
         self.tag_detector.contents.quad_sigma = float(options.quad_sigma)
-        self.tag_detector.refine_edges = int(options.refine_edges)
-        self.tag_detector.refine_decode = int(options.refine_decode)
-        self.tag_detector.refine_pose = int(options.refine_pose)
+        self.tag_detector.contents.refine_edges = int(options.refine_edges)
+        self.tag_detector.contents.refine_decode = int(options.refine_decode)
+        self.tag_detector.contents.refine_pose = int(options.refine_pose)
 
         if options.quad_contours:
             self.libc.apriltag_detector_enable_quad_contours(self.tag_detector, 1)
 
         self.families = []
 
+        # the names of the families added, by address of the C struct
+        # (the family field of DETECTION_DTYPE).
+        self._family_names = {}
+
+        # records filled in by detect, grown as needed.
+        self._records = numpy.zeros(64, dtype=DETECTION_DTYPE)
+
         flist = self.libc.apriltag_family_list()
 
         for i in range(flist.contents.size):
@@ -327,6 +403,8 @@ class Detector(object):
     def __del__(self):
         if self.tag_detector is not None:
             self.libc.apriltag_detector_destroy(self.tag_detector)
+        if self._pose_workerpool is not None:
+            self.libc.workerpool_destroy(self._pose_workerpool)
 
     def detect(self, img, return_image=False):
 
@@ -335,15 +413,20 @@ class Detector(object):
         image of type numpy.uint8.
         '''
 
-        assert len(img.shape) == 2
-        assert img.dtype == numpy.uint8
+        if not return_image:
+            records = self.detect_records(img, self._records)
+            if records.base is not self._records:
+                self._records = records.base
+            return [self._detection_from_record(r) for r in records]
 
-        c_img = self._convert_image(img)
+        img = self._image_for_detection(img)
+        c_img = self._image_view(img)
 
         return_info = []
 
         #detect apriltags in the image
-        detections = self.libc.apriltag_detector_detect(self.tag_detector, c_img)
+        detections = self.libc.apriltag_detector_detect(self.tag_detector,
+                                                        ctypes.byref(c_img))
 
         apriltag = ctypes.POINTER(_ApriltagDetection)()
 
@@ -371,8 +454,6 @@ class Detector(object):
             #Append this dict to the tag data array
             return_info.append(detection)
 
-        self.libc.image_u8_destroy(c_img)
-
         if return_image:
 
             dimg = self._vis_detections(img.shape, detections)
@@ -387,6 +468,45 @@ class Detector(object):
         return rval
 
 
+    def detect_records(self, img, out=None):
+
+        '''
+        Run detections on the provided grayscale numpy.uint8 image,
+        which is used in place (without copying) whenever possible,
+        and return them as an array of DETECTION_DTYPE, in a single
+        call into the C library, with no Python object per detection
+        (the fields are arrays: records['id'], records['center'],
+        ...). out, if given, is an array of DETECTION_DTYPE to fill
+        in, and the result is a view of its first elements; if it is
+        too small, a larger array is allocated (and the frame is
+        detected again) instead. The 'family' field is the address of
+        the family (see family_name).
+        '''
+
+        img = self._image_for_detection(img)
+
+        if out is None:
+            out = numpy.zeros(64, dtype=DETECTION_DTYPE)
+
+        assert out.dtype == DETECTION_DTYPE and out.flags['C_CONTIGUOUS']
+
+        while True:
+            n = self.libc.apriltag_detector_detect_buffer(
+                self.tag_detector, img.ctypes.data,
+                img.shape[1], img.shape[0], img.strides[0],
+                out.ctypes.data, len(out))
+
+            if n <= len(out):
+                return out[:n]
+
+            out = numpy.zeros(2 * n, dtype=DETECTION_DTYPE)
+
+    def family_name(self, family):
+
+        '''The name of the family of a record from detect_records.'''
+
+        return self._family_names.get(int(family))
+
     def add_tag_family(self, name):
 
         '''
@@ -396,8 +516,10 @@ class Detector(object):
         family = self.libc.apriltag_family_create(name.encode('ascii'))
 
         if family:
-            family.contents.border = self.options.border
+            family.contents.black_border = self.options.border
             self.libc.apriltag_detector_add_family(self.tag_detector, family)
+            self._family_names[ctypes.addressof(family.contents)] = \
+                ctypes.string_at(family.contents.name)
         else:
             print('Unrecognized tag family name. Try e.g. tag36h11')
 
@@ -430,6 +552,37 @@ class Detector(object):
 
         return M, init_error.value, final_error.value
 
+    def detection_poses(self, records, camera_params, tag_size=1, z_sign=1):
+
+        '''
+        The poses of all the records from detect_records at once, in a
+        single call into the C library (which spreads them over the
+        detector's nthreads threads): returns an array of their 4x4
+        pose matrices, and arrays of their initial and final errors,
+        as detection_pose gives them for each.
+        '''
+
+        assert records.dtype == DETECTION_DTYPE
+        records = numpy.ascontiguousarray(records)
+
+        n = len(records)
+        poses = numpy.zeros((n, 4, 4))
+        init_errors = numpy.zeros(n)
+        final_errors = numpy.zeros(n)
+
+        nthreads = self.tag_detector.contents.nthreads
+        if self._pose_workerpool is None and nthreads > 1:
+            self._pose_workerpool = self.libc.workerpool_create(nthreads)
+
+        fx, fy, cx, cy = camera_params
+
+        self.libc.pose_from_detection_records(
+            records.ctypes.data, n, fx, fy, cx, cy, tag_size, z_sign, 1,
+            self._pose_workerpool, poses.ctypes.data,
+            init_errors.ctypes.data, final_errors.ctypes.data)
+
+        return poses, init_errors, final_errors
+
     def _vis_detections(self, shape, detections):
 
         height, width = shape
@@ -456,21 +609,316 @@ class Detector(object):
         self.libc.pose_from_homography.restype = ctypes.POINTER(_Matd)
         self.libc.matd_create.restype = ctypes.POINTER(_Matd)
 
-    def _convert_image(self, img):
+        self.libc.workerpool_create.restype = ctypes.c_void_p
+        self.libc.workerpool_destroy.argtypes = [ctypes.c_void_p]
+
+        self.libc.pose_from_detection_records.restype = None
+        self.libc.pose_from_detection_records.argtypes = [
+            ctypes.c_void_p, ctypes.c_int,
+            ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double,
+            ctypes.c_double, ctypes.c_double, ctypes.c_int,
+            ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+
+        self.libc.apriltag_detector_stats.restype = ctypes.c_void_p
+        self.libc.apriltag_detector_stats.argtypes = [ctypes.POINTER(_ApriltagDetector)]
+
+        self.libc.apriltag_log_writer_create.restype = ctypes.c_void_p
+        self.libc.apriltag_log_writer_create.argtypes = [ctypes.c_char_p]
+        self.libc.apriltag_log_writer_destroy.restype = ctypes.c_int
+        self.libc.apriltag_log_writer_destroy.argtypes = [ctypes.c_void_p]
+        self.libc.apriltag_log_write_records.restype = ctypes.c_int
+        self.libc.apriltag_log_write_records.argtypes = [
+            ctypes.c_void_p, ctypes.c_int64, ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p]
+
+        self.libc.apriltag_detector_detect_buffer.restype = ctypes.c_int
+        self.libc.apriltag_detector_detect_buffer.argtypes = [
+            ctypes.POINTER(_ApriltagDetector), ctypes.c_void_p,
+            ctypes.c_int, ctypes.c_int, ctypes.c_int,
+            ctypes.c_void_p, ctypes.c_int]
+
+    def _image_for_detection(self, img):
+
+        '''
+        img itself, if the detector can use its buffer as it is (any
+        row stride will do, so long as the pixels of a row are
+        consecutive); otherwise a copy. (A copy is also made when
+        quad_sigma is set, since the detector blurs its image in
+        place.)
+        '''
+
+        assert len(img.shape) == 2
+        assert img.dtype == numpy.uint8
+
+        if self.tag_detector.contents.quad_sigma != 0:
+            return img.copy()
+
+        if img.strides[1] != 1 or img.strides[0] < img.shape[1]:
+            return numpy.ascontiguousarray(img)
+
+        return img
+
+    def _image_view(self, img):
+
+        '''An image_u8 struct sharing the pixels of img.'''
+
+        return _ImageU8(img.shape[1], img.shape[0], img.strides[0],
+                        img.ctypes.data_as(ctypes.POINTER(ctypes.c_uint8)))
+
+    def _detection_from_record(self, record):
+
+        return Detection(
+            self._family_names.get(int(record['family'])),
+            int(record['id']),
+            int(record['hamming']),
+            float(record['goodness']),
+            float(record['decision_margin']),
+            record['homography'].copy(),
+            record['center'].copy(),
+            record['corners'].copy())
+
+
+######################################################################
+
+class LogWriter(object):
+
+    '''
+    Writes the detections of a Detector's frames (as from
+    detect_records) to a binary log (see apriltag_log.h), to be read
+    back with read_log.
+    '''
+
+    def __init__(self, detector, path):
+
+        self.detector = detector
+        self.libc = detector.libc
+        self.writer = self.libc.apriltag_log_writer_create(path.encode())
+        if not self.writer:
+            raise IOError('Could not create ' + path)
+
+    def __del__(self):
+        self.close()
+
+    def write(self, records, utime, timings=True):
+
+        '''
+        Log the records (of DETECTION_DTYPE, as returned by
+        detect_records) of the frame taken at utime (an integer, e.g.
+        microseconds), and with timings, the times of the stages of
+        the detector's last frame.
+        '''
+
+        assert records.dtype == DETECTION_DTYPE and records.flags['C_CONTIGUOUS']
+
+        stats = None
+        if timings:
+            stats = self.libc.apriltag_detector_stats(self.detector.tag_detector)
+
+        if self.libc.apriltag_log_write_records(self.writer, int(utime), records.ctypes.data,
+                                                len(records), stats) != 0:
+            raise IOError('Could not write the log')
+
+    def close(self):
+
+        if self.writer:
+            res = self.libc.apriltag_log_writer_destroy(self.writer)
+            self.writer = None
+            if res != 0:
+                raise IOError('Could not write the log')
+
+def read_log(path):
+
+    '''
+    Map the binary detection log at path (see apriltag_log.h, and
+    apriltag_demo --log), which may still be being written, and return
+    its detection records (an array of LOG_DETECTION_DTYPE), its frame
+    records (of LOG_FRAME_DTYPE) and the names of its families, by
+    their number (the 'family' field).
+    '''
+
+    raw = numpy.memmap(path, dtype=numpy.uint8, mode='r')
+    if len(raw) < _LOG_HEADER_SIZE or bytes(raw[:8]) != _LOG_MAGIC:
+        raise ValueError(path + ' is not a detection log')
+
+    byte_order, record_size = numpy.frombuffer(raw[8:16], dtype=numpy.uint32)
+    if byte_order != 0x01020304 or record_size != LOG_DETECTION_DTYPE.itemsize:
+        raise ValueError(path + ' is a detection log of another layout')
+
+    n = (len(raw) - _LOG_HEADER_SIZE) // record_size
+    body = raw[_LOG_HEADER_SIZE:_LOG_HEADER_SIZE + n * record_size]
+
+    records = body.view(LOG_DETECTION_DTYPE)
+    types = records['type']
+
+    families = body.view(LOG_FAMILY_DTYPE)[types == LOG_FAMILY]
+    names = dict((int(f['family']), f['name'].decode()) for f in families)
+
+    return records[types == LOG_DETECTION], body.view(LOG_FRAME_DTYPE)[types == LOG_FRAME], names
+
+######################################################################
+
+def _import_native(searchpath=[]):
+
+    '''
+    The native module (_apriltag, built next to the C library, see
+    src/python), from the first of searchpath that has it, or from
+    sys.path.
+    '''
+
+    for path in searchpath:
+        if os.path.isdir(path) and path not in sys.path:
+            sys.path.insert(0, path)
+            try:
+                import _apriltag
+                return _apriltag
+            except ImportError:
+                pass
+            finally:
+                sys.path.remove(path)
+
+    import _apriltag
+    return _apriltag
+
+class VideoDetector(object):
+
+    '''
+    Detects the frames of a video in the background: a capture thread
+    reads each frame (from capture, e.g. a cv2.VideoCapture, or
+    anything with its read()) and converts it to gray, and the native
+    module's worker detects the newest of them with the GIL released,
+    with a detector of its own (set up from options, as for Detector).
+    Frames that come while the worker is busy replace the one waiting,
+    unless keep_up is set (e.g. for a video file), in which case each
+    frame waits for the one before it to be detected. latest() returns
+    the newest frame detected, and its detections, without waiting on
+    the capture or the detection of the frames after it.
+    '''
+
+    def __init__(self, capture, options=None, searchpath=[], keep_up=False):
+
+        if options is None:
+            options = DetectorOptions()
+
+        if isinstance(options.families, list):
+            families = ','.join(options.families)
+        else:
+            families = options.families
+
+        native = _import_native(searchpath)
+
+        self.detector = native.Detector(
+            families=families, border=int(options.border),
+            nthreads=int(options.nthreads),
+            quad_decimate=float(options.quad_decimate),
+            quad_sigma=float(options.quad_sigma),
+            refine_edges=int(options.refine_edges),
+            refine_decode=int(options.refine_decode),
+            refine_pose=int(options.refine_pose))
+
+        self.worker = native.VideoWorker(self.detector)
+
+        self.capture = capture
+        self.keep_up = keep_up
+
+        # the frames submitted (by sequence number) whose detections
+        # haven't been returned, and the last one returned.
+        self._frames = {}
+        self._frames_lock = threading.Lock()
+        self._last = 0
+
+        self._stop = False
+        self._thread = threading.Thread(target=self._capture)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def __del__(self):
+        if hasattr(self, '_thread'):
+            self.close()
+
+    def _capture(self):
+
+        seq = 0
+
+        while not self._stop:
+            success, frame = self.capture.read()
+            if not success:
+                break
+
+            gray = frame
+            if len(frame.shape) == 3:
+                gray = cv2.cvtColor(frame, cv2.COLOR_BGR2GRAY)
+
+            # (the worker detected the last frame, or is closed.)
+            while self.keep_up and seq and not self._stop and self.worker.pending:
+                self.worker.latest(seq - 1, 0.1)
+
+            if self._stop:
+                break
+
+            with self._frames_lock:
+                seq = self.worker.submit(gray)
+                self._frames[seq] = frame
+
+    @property
+    def running(self):
+
+        '''Whether there are frames still to be read or detected.'''
+
+        return self._thread.is_alive() or self.worker.pending
+
+    def latest(self, timeout=0):
+
+        '''
+        The newest frame detected since the last call, and its
+        detections (an array of DETECTION_DTYPE, as from
+        Detector.detect_records), waiting up to timeout seconds for
+        one; or None.
+        '''
+
+        result = self.worker.latest(self._last, timeout)
+        if result is None:
+            return None
+
+        seq, buf = result
+        self._last = seq
+
+        with self._frames_lock:
+            frame = self._frames.pop(seq, None)
+            for old in [s for s in self._frames if s < seq]:
+                del self._frames[old]
+
+        return frame, numpy.frombuffer(buf, dtype=DETECTION_DTYPE)
+
+    def family_name(self, family):
+
+        '''The name of the family of a record from latest.'''
+
+        return self.detector.family_name(int(family))
+
+    def detections(self, records):
+
+        '''The records from latest as Detection objects.'''
+
+        return [Detection(self.family_name(r['family']), int(r['id']),
+                          int(r['hamming']), float(r['goodness']),
+                          float(r['decision_margin']), r['homography'].copy(),
+                          r['center'].copy(), r['corners'].copy())
+                for r in records]
+
+    @property
+    def ndropped(self):
+
+        '''The number of frames read but never detected.'''
 
-        height = img.shape[0]
-        width = img.shape[1]
-        c_img = self.libc.image_u8_create(width, height)
+        return self.worker.ndropped
 
-        tmp = _image_u8_get_array(c_img)
+    def close(self):
 
-        # copy the opencv image into the destination array, accounting for the
-        # difference between stride & width.
-        tmp[:, :width] = img
+        '''Stop reading frames, and stop the worker.'''
 
-        # tmp goes out of scope here but we don't care because
-        # the underlying data is still in c_img.
-        return c_img
+        self._stop = True
+        if self._thread.is_alive() and self._thread is not threading.current_thread():
+            self._thread.join()
+        self.worker.close()
 
 ######################################################################
 
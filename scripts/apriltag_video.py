@@ -32,7 +32,14 @@ def apriltag_video(input_streams=['../media/input/single_tag.mp4', '../media/inp
     location, or specify your own search paths as needed.
     '''
 
-    detector = apriltag.Detector(options, searchpath=apriltag._get_dll_path())
+    # (the frames are detected by the native module, in the background;
+    # this detector, without families, only computes their poses.)
+    searchpath = apriltag._get_dll_path()
+    pose_detector = apriltag.Detector(apriltag.DetectorOptions(families='', nthreads=options.nthreads),
+                                      searchpath=searchpath)
+
+    camera_params = (3156.71852, 3129.52243, 359.097908, 239.736909)
+    tag_size = 0.0762
 
     for stream in input_streams:
 
@@ -52,20 +59,30 @@ def apriltag_video(input_streams=['../media/input/single_tag.mp4', '../media/inp
                 output_path = '../media/output/'+'camera_'+str(stream)+'.avi'
             output = cv2.VideoWriter(output_path, codec, fps, (width, height))
 
-        while(video.isOpened()):
+        # a camera's frames are detected as they come, skipping those
+        # that come while one is detected; a file's are all detected.
+        detector = apriltag.VideoDetector(video, options, searchpath=searchpath,
+                                          keep_up=type(stream) != int)
+
+        while detector.running:
+
+            result = detector.latest(timeout=0.1)
+            if result is None:
+                continue
+
+            frame, records = result
+            overlay = frame.copy()
 
-            success, frame = video.read()
-            if not success:
-                break
+            detections = detector.detections(records)
+            poses, _, _ = pose_detector.detection_poses(records, camera_params, tag_size)
+
+            print('Detected {} tags'.format(len(detections)))
+
+            for detection, pose in zip(detections, poses):
+                apriltag._draw_pose_box(overlay, camera_params, tag_size, pose)
+                apriltag._draw_pose_axes(overlay, camera_params, tag_size, pose, detection.center)
+                apriltag._annotate_detection(overlay, detection, tag_size)
 
-            result, overlay = apriltag.detect_tags(frame,
-                                                   detector,
-                                                   camera_params=(3156.71852, 3129.52243, 359.097908, 239.736909),
-                                                   tag_size=0.0762,
-                                                   vizualization=3,
-                                                   verbose=3,
-                                                   annotation=True
-                                                  )
             if output_stream:
                 output.write(overlay)
 
@@ -74,6 +91,11 @@ def apriltag_video(input_streams=['../media/input/single_tag.mp4', '../media/inp
                 if cv2.waitKey(1) & 0xFF == ord(' '): # Press space bar to terminate
                     break
 
+        if detector.ndropped:
+            print('Skipped {} frames that came while detecting'.format(detector.ndropped))
+
+        detector.close()
+
 ################################################################################
 
 if __name__ == '__main__':
@@ -30,7 +30,11 @@ either expressed or implied, of the FreeBSD Project.
  */
 
 #include "apriltag.h"
+#include "apriltag_capture.h"
 #include "apriltag_quad_contour.h"
+#include "apriltag_scratch.h"
+#include "apriltag_gpu.h"
+#include "apriltag_decode_tables.h"
 
 #include <math.h>
 #include <assert.h>
@@ -39,6 +43,10 @@ either expressed or implied, of the FreeBSD Project.
 #include <stdio.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "common/image_u8.h"
 #include "common/image_u32.h"
@@ -46,8 +54,11 @@ either expressed or implied, of the FreeBSD Project.
 #include "common/zarray.h"
 #include "common/matd.h"
 #include "common/homography.h"
+#include "common/simd.h"
 #include "common/timeprofile.h"
+#include "common/trace.h"
 #include "common/math_util.h"
+#include "contrib/lm.h"
 #include "g2d.h"
 
 #include "common/postscript_utils.h"
@@ -56,8 +67,25 @@ either expressed or implied, of the FreeBSD Project.
 # define M_PI 3.141592653589793238462643383279502884196
 #endif
 
-extern zarray_t *apriltag_quad_gradient(apriltag_detector_t *td, image_u8_t *im);
-extern zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im);
+// size (in pixels) of the cells in which the pyramid search tracks
+// which parts of the image are already covered by tags.
+#define APRILTAG_PYRAMID_CELL 32
+
+// the reduction of the copies of the frames that motion gating
+// compares (in tiles of APRILTAG_PYRAMID_CELL pixels).
+#define APRILTAG_MOTION_FACTOR 4
+
+// the most points that quad_goodness, quad_decode and edge_search
+// project or sample at once.
+#define QUAD_SAMPLE_CHUNK 64
+
+// the most points refine_edges samples at once, for as many of the
+// searches along the edge as fit.
+#define REFINE_EDGES_CHUNK 1024
+
+extern void apriltag_quad_gradient_defaults(struct apriltag_quad_gradient_params *qgp);
+extern zarray_t *apriltag_quad_gradient(apriltag_detect_context_t *ctx, image_u8_t *im, float decimate);
+extern zarray_t *apriltag_quad_thresh(apriltag_detect_context_t *ctx, image_u8_t *im, float decimate);
 
 struct quick_decode_entry
 {
@@ -67,12 +95,113 @@ struct quick_decode_entry
     uint8_t rotation; // number of rotations [0, 3]
 };
 
+// The decode table is an open-addressed hash table whose size is a
+// power of two, so that a code is hashed with one multiply and the
+// table is probed by masking. The codes and the (id, hamming) of each
+// slot are kept in separate arrays, so that a probe sequence only
+// reads the codes: eight slots to a cache line.
+struct quick_decode_value
+{
+    uint16_t id;
+    uint8_t hamming;
+};
+
+// A decode table, which is shared by every family object with the
+// same name and codes (and restriction to ids, see
+// apriltag_family_restrict_ids) that asks to correct the same number
+// of errors (see quick_decode_table_acquire).
+struct quick_decode_table
+{
+    char *name;
+    uint32_t ncodes, d;
+    uint64_t codes_hash;  // see quick_decode_codes_hash
+    int maxhamming;
+
+    // the ids whose codes the table holds (NULL for all of them).
+    int *ids;
+    int nids;
+
+    int shift;            // 64 - log2(nentries)
+    uint64_t mask;        // nentries - 1
+    uint64_t *rcodes;     // UINT64_MAX marks an empty slot
+    struct quick_decode_value *values;
+
+    // a table loaded by apriltag_family_load_decode_table: rcodes and
+    // values point into this (read only) mapping of the file.
+    void *map;
+    size_t maplen;
+
+    // a table compiled into the library (apriltag_decode_tables):
+    // rcodes and values point into it, and are not freed.
+    int builtin;
+
+    // set while the table is being built (see
+    // quick_decode_table_acquire), leaving it empty.
+    int building;
+
+    // the number of families using the table; it is freed when the
+    // last one lets go of it.
+    int refcount;
+    struct quick_decode_table *next;
+};
+
+// the tables in use, and the lock on them (and on the family objects'
+// struct quick_decode), which is signalled whenever a table has been
+// built.
+static struct quick_decode_table *quick_decode_tables;
+static pthread_mutex_t quick_decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t quick_decode_built = PTHREAD_COND_INITIALIZER;
+
+// The decoder of a family object, in its impl.
 struct quick_decode
 {
-    int nentries;
-    struct quick_decode_entry *entries;
+    int maxhamming;
+
+    // if set, there is no table: codes are decoded by comparing them
+    // with every code of the family (see quick_decode_scan).
+    int scan;
+
+    // NULL until the family is first used (see quick_decode_prepare).
+    struct quick_decode_table *table;
+
+    // the ids to decode, sorted (NULL for all of them; see
+    // apriltag_family_restrict_ids).
+    int *ids;
+    int nids;
+
+    // the detectors the family has been added to. It gives up its
+    // decoder when it is removed from the last of them.
+    int nusers;
+
+    // (see quad_decoder_select.)
+    struct quad_decoder *decoder;
+};
+
+// The header of a saved decode table. It is followed by the rcodes
+// and then the values of every slot, exactly as they are laid out in
+// memory, so that the file can be used in place once it is mapped.
+#define QUICK_DECODE_MAGIC "ATQDTBL1"
+#define QUICK_DECODE_BYTE_ORDER 0x01020304
+
+struct quick_decode_header
+{
+    char magic[8];
+    uint32_t byte_order;  // QUICK_DECODE_BYTE_ORDER, as written
+    uint32_t value_size;  // sizeof(struct quick_decode_value)
+    uint32_t ncodes, d;
+    uint32_t maxhamming;
+    uint32_t logsize;
+    uint64_t codes_hash;  // see quick_decode_codes_hash
+    uint8_t reserved[24]; // (keeps rcodes 64-byte aligned)
 };
 
+static inline uint64_t quick_decode_bucket(const struct quick_decode_table *qt, uint64_t code)
+{
+    // Fibonacci hashing: the high bits of the product depend on every
+    // bit of the code.
+    return (code * UINT64_C(0x9e3779b97f4a7c15)) >> qt->shift;
+}
+
 /** if the bits in w were arranged in a d*d grid and that grid was
  * rotated, what would the new bits in w be?
  * The bits are organized like this (for d = 3):
@@ -99,13 +228,50 @@ static uint64_t rotate90(uint64_t w, uint32_t d)
     return wr;
 }
 
-void quad_destroy(struct quad *quad)
+// A decoder for one geometry (d and black_border) of tag, which
+// apriltag_detector_add_family chooses for each family (see
+// quad_decoder_select): the tag coordinates of the points that
+// quad_sample_bits samples, worked out in advance, the version of
+// quad_sample_bits compiled for the geometry, and tables which rotate
+// codes of width d.
+struct quad_decoder
 {
-    if (!quad)
-        return;
+    uint32_t d, black_border;
+
+    // the eight lines of border samples, of 2*black_border + d points
+    // each: { x0, y0, dx, dy } in tag coordinates, and which of the
+    // threshold's sums (1 for white) the line adds to.
+    double border_lines[8][4];
+    int border_sums[8];
+
+    // the centre of the first bit cell (of each row), and the distance
+    // between the centres.
+    double bits_x0, bits_y0[8];
+    double bit_size;
+
+    float (*sample_bits)(const struct quad_decoder *dec, image_u8_t *im, struct quad *quad,
+                         int bilinear, float min_border_contrast, uint64_t *prcode);
+
+    // rotate90(w, d) is the OR of rotate_tables[i][byte i of w] over
+    // the nbytes bytes of a code. (NULL if not built.)
+    int nbytes;
+    uint64_t (*rotate_tables)[256];
+};
+
+static inline uint64_t quad_decoder_rotate90(const struct quad_decoder *dec, uint64_t w)
+{
+    uint64_t wr = 0;
+
+    for (int i = 0; i < dec->nbytes; i++)
+        wr |= dec->rotate_tables[i][(w >> (8*i)) & 0xff];
+
+    return wr;
+}
+
+static void quad_decoder_select(apriltag_family_t *fam);
 
-    matd_destroy(quad->H);
-    matd_destroy(quad->Hinv);
+void quad_destroy(struct quad *quad)
+{
     free(quad);
 }
 
@@ -113,87 +279,87 @@ struct quad *quad_copy(struct quad *quad)
 {
     struct quad *q = calloc(1, sizeof(struct quad));
     memcpy(q, quad, sizeof(struct quad));
-    if (quad->H)
-        q->H = matd_copy(quad->H);
-    if (quad->Hinv)
-        q->Hinv = matd_copy(quad->Hinv);
     return q;
 }
 
-void quick_decode_add(struct quick_decode *qd, uint64_t code, int id, int hamming)
+void quick_decode_add(struct quick_decode_table *qt, uint64_t code, int id, int hamming)
 {
-    uint32_t bucket = code % qd->nentries;
+    uint64_t bucket = quick_decode_bucket(qt, code);
 
-    while (qd->entries[bucket].rcode != UINT64_MAX) {
-        bucket = (bucket + 1) % qd->nentries;
+    while (qt->rcodes[bucket] != UINT64_MAX) {
+        bucket = (bucket + 1) & qt->mask;
     }
 
-    qd->entries[bucket].rcode = code;
-    qd->entries[bucket].id = id;
-    qd->entries[bucket].hamming = hamming;
-}
-
-void quick_decode_uninit(apriltag_family_t *fam)
-{
-    if (!fam->impl)
-        return;
-
-    struct quick_decode *qd = (struct quick_decode*) fam->impl;
-    free(qd->entries);
-    free(qd);
-    fam->impl = NULL;
+    qt->rcodes[bucket] = code;
+    qt->values[bucket].id = id;
+    qt->values[bucket].hamming = hamming;
 }
 
-void quick_decode_init(apriltag_family_t *family, int maxhamming)
+// (of the codes of ids, or of every code if ids is NULL.)
+static struct quick_decode_table *quick_decode_table_build(const apriltag_family_t *family,
+                                                           const int *ids, int nids,
+                                                           int maxhamming)
 {
-    assert(family->impl == NULL);
     assert(family->ncodes < 65535);
 
-    struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
-    int capacity = family->ncodes;
+    int ncodes = ids ? nids : (int) family->ncodes;
+
+    struct quick_decode_table *qt = calloc(1, sizeof(struct quick_decode_table));
+    uint64_t capacity = ncodes;
 
     int nbits = family->d * family->d;
 
+    // the number of codes within each hamming distance (the number of
+    // ways of choosing the bits to flip.)
     if (maxhamming >= 1)
-        capacity += family->ncodes * nbits;
+        capacity += (uint64_t) ncodes * nbits;
 
     if (maxhamming >= 2)
-        capacity += family->ncodes * nbits * (nbits-1);
+        capacity += (uint64_t) ncodes * nbits * (nbits-1) / 2;
 
     if (maxhamming >= 3)
-        capacity += family->ncodes * nbits * (nbits-1) * (nbits-2);
+        capacity += (uint64_t) ncodes * nbits * (nbits-1) * (nbits-2) / 6;
+
+    // keep the table at most half full
+    int logsize = 1;
+    while ((UINT64_C(1) << logsize) < 2 * capacity)
+        logsize++;
 
-    qd->nentries = capacity * 3;
+    uint64_t nentries = UINT64_C(1) << logsize;
+    qt->maxhamming = maxhamming;
+    qt->shift = 64 - logsize;
+    qt->mask = nentries - 1;
 
 //    printf("capacity %d, size: %.0f kB\n",
-//           capacity, qd->nentries * sizeof(struct quick_decode_entry) / 1024.0);
+//           (int) capacity, nentries * (sizeof(uint64_t) + sizeof(struct quick_decode_value)) / 1024.0);
 
-    qd->entries = calloc(qd->nentries, sizeof(struct quick_decode_entry));
-    if (qd->entries == NULL) {
+    qt->rcodes = malloc(nentries * sizeof(uint64_t));
+    qt->values = calloc(nentries, sizeof(struct quick_decode_value));
+    if (qt->rcodes == NULL || qt->values == NULL) {
         printf("apriltag.c: failed to allocate hamming decode table. Reduce max hamming size.\n");
         exit(-1);
     }
 
-    for (int i = 0; i < qd->nentries; i++)
-        qd->entries[i].rcode = UINT64_MAX;
+    memset(qt->rcodes, 0xff, nentries * sizeof(uint64_t));
 
-    for (int i = 0; i < family->ncodes; i++) {
+    for (int idx = 0; idx < ncodes; idx++) {
+        int i = ids ? ids[idx] : idx;
         uint64_t code = family->codes[i];
 
         // add exact code (hamming = 0)
-        quick_decode_add(qd, code, i, 0);
+        quick_decode_add(qt, code, i, 0);
 
         if (maxhamming >= 1) {
             // add hamming 1
             for (int j = 0; j < nbits; j++)
-                quick_decode_add(qd, code ^ (1L << j), i, 1);
+                quick_decode_add(qt, code ^ (1L << j), i, 1);
         }
 
         if (maxhamming >= 2) {
             // add hamming 2
             for (int j = 0; j < nbits; j++)
                 for (int k = 0; k < j; k++)
-                    quick_decode_add(qd, code ^ (1L << j) ^ (1L << k), i, 2);
+                    quick_decode_add(qt, code ^ (1L << j) ^ (1L << k), i, 2);
         }
 
         if (maxhamming >= 3) {
@@ -201,7 +367,7 @@ void quick_decode_init(apriltag_family_t *family, int maxhamming)
             for (int j = 0; j < nbits; j++)
                 for (int k = 0; k < j; k++)
                     for (int m = 0; m < k; m++)
-                        quick_decode_add(qd, code ^ (1L << j) ^ (1L << k) ^ (1L << m), i, 3);
+                        quick_decode_add(qt, code ^ (1L << j) ^ (1L << k) ^ (1L << m), i, 3);
         }
 
         if (maxhamming > 3) {
@@ -209,8 +375,6 @@ void quick_decode_init(apriltag_family_t *family, int maxhamming)
         }
     }
 
-    family->impl = qd;
-
     if (0) {
         int longest_run = 0;
         int run = 0;
@@ -219,8 +383,8 @@ void quick_decode_init(apriltag_family_t *family, int maxhamming)
 
         // This accounting code doesn't check the last possible run that
         // occurs at the wrap-around. That's pretty insignificant.
-        for (int i = 0; i < qd->nentries; i++) {
-            if (qd->entries[i].rcode == UINT64_MAX) {
+        for (uint64_t i = 0; i <= qt->mask; i++) {
+            if (qt->rcodes[i] == UINT64_MAX) {
                 if (run > 0) {
                     run_sum += run;
                     run_count ++;
@@ -234,1156 +398,4279 @@ void quick_decode_init(apriltag_family_t *family, int maxhamming)
 
         printf("quick decode: longest run: %d, average run %.3f\n", longest_run, 1.0 * run_sum / run_count);
     }
+
+    return qt;
 }
 
-// returns an entry with hamming set to 255 if no decode was found.
-static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
-                                  struct quick_decode_entry *entry)
+static void quick_decode_table_destroy(struct quick_decode_table *qt)
 {
-    struct quick_decode *qd = (struct quick_decode*) tf->impl;
+    if (qt->map) {
+        munmap(qt->map, qt->maplen);
+    } else if (!qt->builtin) {
+        free(qt->rcodes);
+        free(qt->values);
+    }
+    free(qt->name);
+    free(qt->ids);
+    free(qt);
+}
 
-    for (int ridx = 0; ridx < 4; ridx++) {
+// a hash (FNV-1a) of the codes of a family, so that a saved table is
+// not used with a family other than the one it was built for. (If ids
+// is not NULL, of the ids and the codes of the ids.)
+static uint64_t quick_decode_codes_hash(const apriltag_family_t *fam, const int *ids, int nids)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
 
-        for (int bucket = rcode % qd->nentries;
-             qd->entries[bucket].rcode != UINT64_MAX;
-             bucket = (bucket + 1) % qd->nentries) {
+    int ncodes = ids ? nids : (int) fam->ncodes;
 
-            if (qd->entries[bucket].rcode == rcode) {
-                *entry = qd->entries[bucket];
-                entry->rotation = ridx;
-                return;
+    for (int idx = 0; idx < ncodes; idx++) {
+        int i = ids ? ids[idx] : idx;
+
+        if (ids) {
+            for (int b = 0; b < 32; b += 8) {
+                h ^= (i >> b) & 0xff;
+                h *= UINT64_C(0x100000001b3);
             }
         }
 
-        rcode = rotate90(rcode, tf->d);
+        for (int b = 0; b < 64; b += 8) {
+            h ^= (fam->codes[i] >> b) & 0xff;
+            h *= UINT64_C(0x100000001b3);
+        }
     }
 
-    entry->rcode = 0;
-    entry->id = 65535;
-    entry->hamming = 255;
-    entry->rotation = 0;
+    return h;
 }
 
-static inline int detection_compare_function(const void *_a, const void *_b)
+// A table using the saved table at data (of len bytes) in place, or
+// NULL if it is not a table saved from fam restricted to ids (or, if
+// maxhamming >= 0, does not correct maxhamming errors).
+static struct quick_decode_table *quick_decode_table_use(const apriltag_family_t *fam,
+                                                         const int *ids, int nids,
+                                                         const void *data, size_t len,
+                                                         int maxhamming)
 {
-    apriltag_detection_t *a = *(apriltag_detection_t**) _a;
-    apriltag_detection_t *b = *(apriltag_detection_t**) _b;
-
-    return a->id - b->id;
+    if (len < sizeof(struct quick_decode_header))
+        return NULL;
+
+    const struct quick_decode_header *hdr = (const struct quick_decode_header*) data;
+    uint64_t nentries = UINT64_C(1) << (hdr->logsize & 63);
+
+    if (memcmp(hdr->magic, QUICK_DECODE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->byte_order != QUICK_DECODE_BYTE_ORDER ||
+        hdr->value_size != sizeof(struct quick_decode_value) ||
+        hdr->ncodes != fam->ncodes || hdr->d != fam->d ||
+        (maxhamming >= 0 && hdr->maxhamming != (uint32_t) maxhamming) ||
+        hdr->logsize < 1 || hdr->logsize > 40 ||
+        len != sizeof(*hdr) + nentries * (sizeof(uint64_t) + sizeof(struct quick_decode_value)) ||
+        hdr->codes_hash != quick_decode_codes_hash(fam, ids, nids))
+        return NULL;
+
+    struct quick_decode_table *qt = calloc(1, sizeof(struct quick_decode_table));
+    qt->maxhamming = hdr->maxhamming;
+    qt->shift = 64 - hdr->logsize;
+    qt->mask = nentries - 1;
+    qt->rcodes = (uint64_t*) ((uint8_t*) data + sizeof(*hdr));
+    qt->values = (struct quick_decode_value*) (qt->rcodes + nentries);
+
+    return qt;
 }
 
-static uint32_t rgb_scale(uint32_t rgb, float a)
+// The table in use for fam restricted to ids, correcting maxhamming
+// errors, or NULL. (Call with quick_decode_mutex held.)
+static struct quick_decode_table *quick_decode_table_find(const apriltag_family_t *fam,
+                                                          const int *ids, int nids,
+                                                          uint64_t codes_hash, int maxhamming)
 {
-    int r = (rgb >> 16)&0xff;
-    int g = (rgb >> 8)&0xff;
-    int b = (rgb >> 0)&0xff;
-
-    r *= a;
-    g *= a;
-    b *= a;
+    for (struct quick_decode_table *qt = quick_decode_tables; qt; qt = qt->next) {
+        if (qt->maxhamming == maxhamming && qt->ncodes == fam->ncodes && qt->d == fam->d &&
+            qt->codes_hash == codes_hash && !strcmp(qt->name, fam->name) &&
+            (qt->ids != NULL) == (ids != NULL) && qt->nids == nids &&
+            (!ids || !memcmp(qt->ids, ids, nids * sizeof(int))))
+            return qt;
+    }
 
-    return (r<<16) | (g<<8) | b;
+    return NULL;
 }
 
-void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
+// Add qt, a new table for fam restricted to ids, to the tables in
+// use, with one reference. (Call with quick_decode_mutex held.)
+static void quick_decode_table_insert(const apriltag_family_t *fam,
+                                      const int *ids, int nids,
+                                      uint64_t codes_hash, struct quick_decode_table *qt)
 {
-    quick_decode_uninit(fam);
-    zarray_remove_value(td->tag_families, &fam, 0);
+    qt->name = strdup(fam->name);
+    qt->ncodes = fam->ncodes;
+    qt->d = fam->d;
+    qt->codes_hash = codes_hash;
+    if (ids) {
+        qt->ids = malloc(nids * sizeof(int));
+        memcpy(qt->ids, ids, nids * sizeof(int));
+        qt->nids = nids;
+    }
+    qt->refcount = 1;
+    qt->next = quick_decode_tables;
+    quick_decode_tables = qt;
 }
 
-void apriltag_detector_add_family(apriltag_detector_t *td, apriltag_family_t *fam)
+// A reference to the table for fam correcting maxhamming errors (of
+// the ids of fam's struct quick_decode): the one in use already, if
+// any, or else the one compiled into the library, or else a new one.
+// (Call with quick_decode_mutex held. The lock is let go while a table
+// is built, so that the detectors using other tables, and the calls
+// which only need the lock for a moment, don't wait for it; fam's
+// decoder must not be changed meanwhile. The table is in use, marked
+// as building, from the start, so that another thread asking for the
+// same one waits for it rather than building it again.)
+static struct quick_decode_table *quick_decode_table_acquire(const apriltag_family_t *fam,
+                                                             int maxhamming)
 {
-    zarray_add(td->tag_families, &fam);
+    const struct quick_decode *qd = (const struct quick_decode*) fam->impl;
+    const int *ids = qd ? qd->ids : NULL;
+    int nids = qd ? qd->nids : 0;
+
+    uint64_t codes_hash = quick_decode_codes_hash(fam, ids, nids);
+
+    struct quick_decode_table *qt = quick_decode_table_find(fam, ids, nids, codes_hash, maxhamming);
+    if (qt) {
+        qt->refcount++;
+        while (qt->building)
+            pthread_cond_wait(&quick_decode_built, &quick_decode_mutex);
+        return qt;
+    }
 
-    // XXX Tunable, but really, 2 is a good choice. Values of >=3
-    // consume prohibitively large amounts of memory, and otherwise
-    // you want the largest value possible.
-    if (!fam->impl)
-        quick_decode_init(fam, 2);
-}
+    // (those are of every id.)
+    for (int i = 0; apriltag_decode_tables[i].data && !qt && !ids; i++) {
+        qt = quick_decode_table_use(fam, NULL, 0, apriltag_decode_tables[i].data,
+                                    apriltag_decode_tables[i].len, maxhamming);
+        if (qt)
+            qt->builtin = 1;
+    }
 
-void apriltag_detector_clear_families(apriltag_detector_t *td)
-{
-    for (int i = 0; i < zarray_size(td->tag_families); i++) {
-        apriltag_family_t *fam;
-        zarray_get(td->tag_families, i, &fam);
-        quick_decode_uninit(fam);
+    if (qt) {
+        quick_decode_table_insert(fam, ids, nids, codes_hash, qt);
+        return qt;
     }
-    zarray_clear(td->tag_families);
-}
 
-void apriltag_quad_thresh_defaults(struct apriltag_quad_thresh_params* qtp) {
+    qt = calloc(1, sizeof(struct quick_decode_table));
+    qt->maxhamming = maxhamming;
+    qt->building = 1;
+    quick_decode_table_insert(fam, ids, nids, codes_hash, qt);
 
-  qtp->max_nmaxima = 10;
-  qtp->min_cluster_pixels = 5;
-  
-  qtp->max_line_fit_mse = 1.0;
-  qtp->critical_rad = 10 * M_PI / 180;
-  qtp->deglitch = 0;
-  qtp->min_white_black_diff = 15;
+    pthread_mutex_unlock(&quick_decode_mutex);
+    struct quick_decode_table *built = quick_decode_table_build(fam, ids, nids, maxhamming);
+    pthread_mutex_lock(&quick_decode_mutex);
 
+    qt->shift = built->shift;
+    qt->mask = built->mask;
+    qt->rcodes = built->rcodes;
+    qt->values = built->values;
+    free(built);
+
+    qt->building = 0;
+    pthread_cond_broadcast(&quick_decode_built);
+    return qt;
 }
 
-void apriltag_detector_enable_quad_contours(apriltag_detector_t* td,
-                                            int enable) {
+// (Call with quick_decode_mutex held.)
+static void quick_decode_table_release(struct quick_decode_table *qt)
+{
+    if (--qt->refcount > 0)
+        return;
 
-  td->quad_contours = enable;
+    struct quick_decode_table **p = &quick_decode_tables;
+    while (*p != qt)
+        p = &(*p)->next;
+    *p = qt->next;
 
-  if (enable) {
-    apriltag_quad_contour_defaults(&td->qcp);
-  } else {
-    apriltag_quad_thresh_defaults(&td->qtp);
-  }
-  
+    quick_decode_table_destroy(qt);
 }
 
-apriltag_detector_t *apriltag_detector_create()
+// Give fam a decoder correcting maxhamming errors (or change the one
+// it has), with the table qt (a reference to which it takes), or, if
+// qt is NULL, with a table to be acquired when fam is first used
+// (unless scan is set, in which case it has no table). (Call with
+// quick_decode_mutex held.)
+static void quick_decode_set(apriltag_family_t *fam, int maxhamming, int scan,
+                             struct quick_decode_table *qt)
 {
-    apriltag_detector_t *td = (apriltag_detector_t*) calloc(1, sizeof(apriltag_detector_t));
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
 
-    td->nthreads = 1;
+    if (!qd) {
+        qd = calloc(1, sizeof(struct quick_decode));
+        fam->impl = qd;
+    }
 
+    if (qd->table)
+        quick_decode_table_release(qd->table);
 
-    td->quad_contours = 0;
-    apriltag_quad_thresh_defaults(&td->qtp);
+    qd->maxhamming = maxhamming;
+    qd->scan = scan;
+    qd->table = qt;
+}
 
-    td->tag_families = zarray_create(sizeof(apriltag_family_t*));
+// Acquire the table of fam, if it is yet to be.
+static void quick_decode_prepare(const apriltag_family_t *fam)
+{
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
 
-    pthread_mutex_init(&td->mutex, NULL);
+    if (!qd || qd->scan || __atomic_load_n(&qd->table, __ATOMIC_ACQUIRE))
+        return;
 
-    td->tp = timeprofile_create();
+    pthread_mutex_lock(&quick_decode_mutex);
+    if (!qd->table) {
+        struct quick_decode_table *qt = quick_decode_table_acquire(fam, qd->maxhamming);
 
-    td->refine_edges = 1;
-    td->refine_pose = 0;
-    td->refine_decode = 0;
+        // (another thread may have prepared fam while the table was
+        // built.)
+        if (qd->table)
+            quick_decode_table_release(qt);
+        else
+            __atomic_store_n(&qd->table, qt, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&quick_decode_mutex);
+}
 
-    td->debug = 0;
+void quick_decode_uninit(apriltag_family_t *fam)
+{
+    if (!fam->impl)
+        return;
 
-    // NB: defer initialization of td->wp so that the user can
-    // override td->nthreads.
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
 
-    return td;
+    if (qd->table) {
+        pthread_mutex_lock(&quick_decode_mutex);
+        quick_decode_table_release(qd->table);
+        pthread_mutex_unlock(&quick_decode_mutex);
+    }
+    if (qd->decoder) {
+        free(qd->decoder->rotate_tables);
+        free(qd->decoder);
+    }
+    free(qd->ids);
+    free(qd);
+    fam->impl = NULL;
 }
 
-void apriltag_detector_destroy(apriltag_detector_t *td)
+void apriltag_family_build_decode_table(apriltag_family_t *fam, int maxhamming)
 {
-    timeprofile_destroy(td->tp);
-    workerpool_destroy(td->wp);
-
-    apriltag_detector_clear_families(td);
+    pthread_mutex_lock(&quick_decode_mutex);
+    quick_decode_set(fam, maxhamming, 0, quick_decode_table_acquire(fam, maxhamming));
+    pthread_mutex_unlock(&quick_decode_mutex);
+}
 
-    zarray_destroy(td->tag_families);
-    free(td);
+int apriltag_family_save_decode_table(const apriltag_family_t *fam, const char *path)
+{
+    quick_decode_prepare(fam);
+
+    const struct quick_decode *qd = (const struct quick_decode*) fam->impl;
+    if (!qd || qd->scan)
+        return -1;
+
+    const struct quick_decode_table *qt = qd->table;
+    uint64_t nentries = qt->mask + 1;
+
+    struct quick_decode_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, QUICK_DECODE_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = QUICK_DECODE_BYTE_ORDER;
+    hdr.value_size = sizeof(struct quick_decode_value);
+    hdr.ncodes = fam->ncodes;
+    hdr.d = fam->d;
+    hdr.maxhamming = qt->maxhamming;
+    hdr.logsize = 64 - qt->shift;
+    hdr.codes_hash = qt->codes_hash;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+
+    int res = 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(qt->rcodes, sizeof(uint64_t), nentries, f) != nentries ||
+        fwrite(qt->values, sizeof(struct quick_decode_value), nentries, f) != nentries)
+        res = -2;
+
+    if (fclose(f) != 0)
+        res = -2;
+
+    return res;
 }
 
-struct quad_decode_task
+int apriltag_family_load_decode_table(apriltag_family_t *fam, const char *path)
 {
-    int i0, i1;
-    zarray_t *quads;
-    apriltag_detector_t *td;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct quick_decode_header)) {
+        close(fd);
+        return -2;
+    }
 
-    image_u8_t *im;
-    zarray_t *detections;
+    size_t maplen = st.st_size;
+    void *map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -2;
 
-    image_u8_t *im_gray_samples;
-    image_u8_t *im_decision;
-};
+    const struct quick_decode *qd = (const struct quick_decode*) fam->impl;
+    const int *ids = qd ? qd->ids : NULL;
+    int nids = qd ? qd->nids : 0;
 
-struct evaluate_quad_ret
+    struct quick_decode_table *qt = quick_decode_table_use(fam, ids, nids, map, maplen, -1);
+    if (qt == NULL) {
+        munmap(map, maplen);
+        return -3;
+    }
+
+    qt->map = map;
+    qt->maplen = maplen;
+
+    // (a table already in use for the family does just as well.)
+    pthread_mutex_lock(&quick_decode_mutex);
+    uint64_t codes_hash = quick_decode_codes_hash(fam, ids, nids);
+    struct quick_decode_table *existing = quick_decode_table_find(fam, ids, nids, codes_hash,
+                                                                  qt->maxhamming);
+    if (existing) {
+        quick_decode_table_destroy(qt);
+        existing->refcount++;
+        qt = existing;
+    } else {
+        quick_decode_table_insert(fam, ids, nids, codes_hash, qt);
+    }
+    quick_decode_set(fam, qt->maxhamming, 0, qt);
+    pthread_mutex_unlock(&quick_decode_mutex);
+
+    return 0;
+}
+
+void apriltag_family_use_scan_decoder(apriltag_family_t *fam, int maxhamming)
 {
-    int64_t rcode;
-    double  score;
-    matd_t  *H, *Hinv;
+    pthread_mutex_lock(&quick_decode_mutex);
+    quick_decode_set(fam, maxhamming, 1, NULL);
+    pthread_mutex_unlock(&quick_decode_mutex);
+}
 
-    int decode_status;
-    struct quick_decode_entry e;
-};
+static int int_compare(const void *_a, const void *_b)
+{
+    int a = *(const int*) _a, b = *(const int*) _b;
+
+    return (a > b) - (a < b);
+}
 
-void quad_update_homographies(struct quad *quad)
+int apriltag_family_restrict_ids(apriltag_family_t *fam, const int *ids, int nids)
 {
-    zarray_t *correspondences = zarray_create(sizeof(float[4]));
+    for (int i = 0; i < nids; i++) {
+        if (ids[i] < 0 || ids[i] >= (int) fam->ncodes)
+            return -1;
+    }
 
-    for (int i = 0; i < 4; i++) {
-        float corr[4];
+    int *sorted = NULL;
+    int n = 0;
 
-        corr[0] = (i==0 || i==3) ? -1 : 1;
-        corr[1] = (i==0 || i==1) ? -1 : 1;
-        corr[2] = quad->p[i][0];
-        corr[3] = quad->p[i][1];
+    if (ids && nids > 0) {
+        sorted = malloc(nids * sizeof(int));
+        memcpy(sorted, ids, nids * sizeof(int));
+        qsort(sorted, nids, sizeof(int), int_compare);
 
-        zarray_add(correspondences, &corr);
+        for (int i = 0; i < nids; i++) {
+            if (n == 0 || sorted[i] != sorted[n-1])
+                sorted[n++] = sorted[i];
+        }
     }
 
-    if (quad->H)
-        matd_destroy(quad->H);
-    if (quad->Hinv)
-        matd_destroy(quad->Hinv);
+    pthread_mutex_lock(&quick_decode_mutex);
 
-    // XXX Tunable
-    quad->H = homography_compute(correspondences, HOMOGRAPHY_COMPUTE_FLAG_SVD);
-    quad->Hinv = matd_inverse(quad->H);
+    // (the same as add_family's, for a family which has no decoder.)
+    if (!fam->impl)
+        quick_decode_set(fam, 2, 0, NULL);
 
-    zarray_destroy(correspondences);
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+
+    free(qd->ids);
+    qd->ids = sorted;
+    qd->nids = n;
+
+    // a table of the new ids is acquired when the family is next used.
+    quick_decode_set(fam, qd->maxhamming, qd->scan, NULL);
+
+    pthread_mutex_unlock(&quick_decode_mutex);
+
+    return 0;
 }
 
-// compute a "score" for a quad that is independent of tag family
-// encoding (but dependent upon the tag geometry) by considering the
-// contrast around the exterior of the tag.
-double quad_goodness(apriltag_family_t *family, image_u8_t *im, struct quad *quad)
+// Decode by finding the code of the family (and the rotation) nearest
+// to rcode. Each code is compared with the four rotations of rcode at
+// once, so the cost is one pass over family->codes. Ties go to the
+// lowest hamming distance, then the lowest id, then the first
+// rotation; they can only arise if maxhamming is at least half the
+// family's minimum distance.
+static void quick_decode_scan(apriltag_family_t *tf, const struct quick_decode *qd,
+                              uint64_t rcode, struct quick_decode_entry *entry)
 {
-    // when sampling from the white border, how much white border do
-    // we actually consider valid, measured in bit-cell units? (the
-    // outside portions are often intruded upon, so it could be advantageous to use
-    // less than the "nominal" 1.0. (Less than 1.0 not well tested.)
+    uint64_t rcodes[4];
 
-    // XXX Tunable
-    float white_border = 1;
+    const struct quad_decoder *dec = qd->decoder && qd->decoder->d == tf->d ? qd->decoder : NULL;
 
-    // in tag coordinates, how big is each bit cell?
-    double bit_size = 2.0 / (2*family->black_border + family->d);
-//    double inv_bit_size = 1.0 / bit_size;
+    for (int ridx = 0; ridx < 4; ridx++) {
+        rcodes[ridx] = rcode;
+        rcode = dec ? quad_decoder_rotate90(dec, rcode) : rotate90(rcode, tf->d);
+    }
 
-    int32_t xmin = INT32_MAX, xmax = 0, ymin = INT32_MAX, ymax = 0;
+    int besthamming = qd->maxhamming + 1;
+    int bestid = -1, bestrotation = 0;
 
-    for (int i = 0; i < 4; i++) {
-        double tx = (i == 0 || i == 3) ? -1 - bit_size : 1 + bit_size;
-        double ty = (i == 0 || i == 1) ? -1 - bit_size : 1 + bit_size;
-        double x, y;
+    int ncodes = qd->ids ? qd->nids : (int) tf->ncodes;
 
-        homography_project(quad->H, tx, ty, &x, &y);
-        xmin = imin(xmin, x);
-        xmax = imax(xmax, x);
-        ymin = imin(ymin, y);
-        ymax = imax(ymax, y);
+    for (int idx = 0; idx < ncodes && besthamming > 0; idx++) {
+        int i = qd->ids ? qd->ids[idx] : idx;
+        uint64_t code = tf->codes[i];
+
+        for (int ridx = 0; ridx < 4; ridx++) {
+            int hamming = __builtin_popcountll(code ^ rcodes[ridx]);
+
+            if (hamming < besthamming) {
+                besthamming = hamming;
+                bestid = i;
+                bestrotation = ridx;
+            }
+        }
     }
 
-    // clamp bounding box to image dimensions
-    xmin = imax(0, xmin);
-    xmax = imin(im->width-1, xmax);
-    ymin = imax(0, ymin);
-    ymax = imin(im->height-1, ymax);
+    if (bestid < 0) {
+        entry->rcode = 0;
+        entry->id = 65535;
+        entry->hamming = 255;
+        entry->rotation = 0;
+        return;
+    }
 
-//    int nbits = family->d * family->d;
+    entry->rcode = rcodes[bestrotation];
+    entry->id = bestid;
+    entry->hamming = besthamming;
+    entry->rotation = bestrotation;
+}
 
-    int64_t W1 = 0, B1 = 0, Wn = 0, Bn = 0;
+// returns an entry with hamming set to 255 if no decode was found.
+//
+// The four rotations of the code are looked up together: their
+// buckets are computed (and prefetched) up front, so that the cache
+// misses of the four probe sequences overlap rather than follow one
+// another. A rotation that matches takes precedence over the
+// rotations after it.
+static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
+                                  struct quick_decode_entry *entry)
+{
+    struct quick_decode *qd = (struct quick_decode*) tf->impl;
 
-    float wsz = bit_size*white_border;
-    float bsz = bit_size*family->black_border;
+    if (qd->scan) {
+        quick_decode_scan(tf, qd, rcode, entry);
+        return;
+    }
 
-    matd_t *Hinv = quad->Hinv;
-//    matd_t *H = quad->H;
+    const struct quick_decode_table *qt = qd->table;
 
-    // iterate over all the pixels in the tag. (Iterating in pixel space)
-    for (int y = ymin; y <= ymax; y++) {
+    uint64_t rcodes[4];
+    uint64_t buckets[4];
 
-        // we'll incrementally compute the homography
-        // projections. Begin by evaluating the homogeneous position
-        // [(xmin - .5f), y, 1]. Then, we'll update as we stride in
-        // the +x direction.
-        double Hx = MATD_EL(Hinv, 0, 0) * (.5 + (int) xmin) +
-            MATD_EL(Hinv, 0, 1) * (y + .5) + MATD_EL(Hinv, 0, 2);
-        double Hy = MATD_EL(Hinv, 1, 0) * (.5 + (int) xmin) +
-            MATD_EL(Hinv, 1, 1) * (y + .5) + MATD_EL(Hinv, 1, 2);
-        double Hh = MATD_EL(Hinv, 2, 0) * (.5 + (int) xmin) +
-            MATD_EL(Hinv, 2, 1) * (y + .5) + MATD_EL(Hinv, 2, 2);
-
-        for (int x = xmin; x <= xmax;  x++) {
-            // project the pixel center.
-            double tx, ty;
-
-            // divide by homogeneous coordinate
-            tx = Hx / Hh;
-            ty = Hy / Hh;
-
-            // if we move x one pixel to the right, here's what
-            // happens to our three pre-normalized coordinates.
-            Hx += MATD_EL(Hinv, 0, 0);
-            Hy += MATD_EL(Hinv, 1, 0);
-            Hh += MATD_EL(Hinv, 2, 0);
-
-            float txa = fabsf((float) tx), tya = fabsf((float) ty);
-            float xymax = fmaxf(txa, tya);
-
-//            if (txa >= 1 + wsz || tya >= 1 + wsz)
-            if (xymax >= 1 + wsz)
-                continue;
+    const struct quad_decoder *dec = qd->decoder && qd->decoder->d == tf->d ? qd->decoder : NULL;
 
-            uint8_t v = im->buf[y*im->stride + x];
+    for (int ridx = 0; ridx < 4; ridx++) {
+        rcodes[ridx] = rcode;
+        buckets[ridx] = quick_decode_bucket(qt, rcode);
+        __builtin_prefetch(&qt->rcodes[buckets[ridx]]);
 
-            // it's within the white border?
-//            if (txa >= 1 || tya >= 1) {
-            if (xymax >= 1) {
-                W1 += v;
-                Wn ++;
-                continue;
-            }
+        rcode = dec ? quad_decoder_rotate90(dec, rcode) : rotate90(rcode, tf->d);
+    }
 
-            // it's within the black border?
-//            if (txa >= 1 - bsz || tya >= 1 - bsz) {
-            if (xymax >= 1 - bsz) {
-                B1 += v;
-                Bn ++;
-                continue;
-            }
+    for (int ridx = 0; ridx < 4; ridx++) {
 
-            // it must be a data bit. We don't do anything with these.
-            continue;
+        for (uint64_t bucket = buckets[ridx];
+             qt->rcodes[bucket] != UINT64_MAX;
+             bucket = (bucket + 1) & qt->mask) {
+
+            if (qt->rcodes[bucket] == rcodes[ridx]) {
+                entry->rcode = rcodes[ridx];
+                entry->id = qt->values[bucket].id;
+                entry->hamming = qt->values[bucket].hamming;
+                entry->rotation = ridx;
+                return;
+            }
         }
     }
 
-    // score = average margin between white and black pixels near border.
-    return 1.0 * W1 / Wn - 1.0 * B1 / Bn;
+    entry->rcode = 0;
+    entry->id = 65535;
+    entry->hamming = 255;
+    entry->rotation = 0;
 }
 
-// returns the decision margin.
-float quad_decode(apriltag_family_t *family, image_u8_t *im, struct quad *quad, struct quick_decode_entry *entry)
+int apriltag_family_decode(apriltag_family_t *fam, uint64_t rcode, int *hamming, int *rotation)
 {
-    // decode the tag binary contents by sampling the pixel
+    quick_decode_prepare(fam);
+
+    struct quick_decode_entry entry;
+    quick_decode_codeword(fam, rcode, &entry);
+
+    if (entry.hamming == 255)
+        return -1;
+
+    *hamming = entry.hamming;
+    *rotation = entry.rotation;
+    return entry.id;
+}
+
+static inline int detection_compare_function(const void *_a, const void *_b)
+{
+    const apriltag_detection_record_t *a = (const apriltag_detection_record_t*) _a;
+    const apriltag_detection_record_t *b = (const apriltag_detection_record_t*) _b;
+
+    return a->id - b->id;
+}
+
+// project (x, y) through the homography of a detection.
+static void detection_project(const apriltag_detection_record_t *det, double x, double y,
+                              double *ox, double *oy)
+{
+    const double *H = det->H;
+
+    double xx = H[0]*x + H[1]*y + H[2];
+    double yy = H[3]*x + H[4]*y + H[5];
+    double zz = H[6]*x + H[7]*y + H[8];
+
+    *ox = xx / zz;
+    *oy = yy / zz;
+}
+
+static uint32_t rgb_scale(uint32_t rgb, float a)
+{
+    int r = (rgb >> 16)&0xff;
+    int g = (rgb >> 8)&0xff;
+    int b = (rgb >> 0)&0xff;
+
+    r *= a;
+    g *= a;
+    b *= a;
+
+    return (r<<16) | (g<<8) | b;
+}
+
+// Let go of fam on behalf of a detector it was added to: once no
+// detector has it, it gives up its decoder (and its reference to the
+// table).
+static void quick_decode_remove_user(apriltag_family_t *fam)
+{
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+    if (!qd)
+        return;
+
+    pthread_mutex_lock(&quick_decode_mutex);
+    int nusers = --qd->nusers;
+    pthread_mutex_unlock(&quick_decode_mutex);
+
+    if (nusers <= 0)
+        quick_decode_uninit(fam);
+}
+
+void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
+{
+    quick_decode_remove_user(fam);
+    zarray_remove_value(td->tag_families, &fam, 0);
+}
+
+// Take fam on behalf of a detector it is added to, giving it a
+// decoder if it has none.
+static void quick_decode_add_user(apriltag_family_t *fam)
+{
+    pthread_mutex_lock(&quick_decode_mutex);
+
+    // XXX Tunable, but really, 2 is a good choice. Values of >=3
+    // consume prohibitively large amounts of memory, and otherwise
+    // you want the largest value possible. (The table is acquired
+    // when the detector is first used.)
+    if (!fam->impl)
+        quick_decode_set(fam, 2, 0, NULL);
+
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+    qd->nusers++;
+
+    quad_decoder_select(fam);
+
+    pthread_mutex_unlock(&quick_decode_mutex);
+}
+
+void apriltag_detector_add_family(apriltag_detector_t *td, apriltag_family_t *fam)
+{
+    zarray_add(td->tag_families, &fam);
+    quick_decode_add_user(fam);
+}
+
+// (and destroy families.)
+static void families_remove_users(zarray_t *families)
+{
+    for (int i = 0; i < zarray_size(families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(families, i, &fam);
+        quick_decode_remove_user(fam);
+    }
+    zarray_destroy(families);
+}
+
+void apriltag_detector_clear_families(apriltag_detector_t *td)
+{
+    for (int i = 0; i < zarray_size(td->tag_families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(td->tag_families, i, &fam);
+        quick_decode_remove_user(fam);
+    }
+    zarray_clear(td->tag_families);
+
+    apriltag_detector_reset_tracking(td);
+}
+
+// The families of apriltag_detector_stage_families: staged (each of
+// which has td as a user already) until the thread has acquired their
+// tables and set ready, when the first frame of td to start swaps them
+// with td->tag_families. The families swapped out are retired until
+// no frame of td is running (nframes is zero), since the frames that
+// started before the swap still decode them.
+struct apriltag_family_stage
+{
+    pthread_mutex_t mutex;
+
+    zarray_t *staged;
+    int ready;
+    int nswaps;
+
+    // (not joined until the next stage, or td is destroyed.)
+    pthread_t thread;
+    int thread_running;
+
+    zarray_t *retired; // zarray_t* of families
+    int nframes;
+};
+
+static void *family_stage_thread(void *p)
+{
+    struct apriltag_family_stage *fs = (struct apriltag_family_stage*) p;
+
+    // (staged is not swapped, nor replaced, until ready is set.)
+    for (int i = 0; i < zarray_size(fs->staged); i++) {
+        apriltag_family_t *fam;
+        zarray_get(fs->staged, i, &fam);
+        quick_decode_prepare(fam);
+    }
+
+    __atomic_store_n(&fs->ready, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int apriltag_detector_stage_families(apriltag_detector_t *td, apriltag_family_t **families,
+                                     int nfamilies)
+{
+    if (!td->family_stage) {
+        struct apriltag_family_stage *fs = calloc(1, sizeof(struct apriltag_family_stage));
+        pthread_mutex_init(&fs->mutex, NULL);
+        fs->retired = zarray_create(sizeof(zarray_t*));
+        td->family_stage = fs;
+    }
+
+    struct apriltag_family_stage *fs = td->family_stage;
+
+    if (fs->thread_running) {
+        pthread_join(fs->thread, NULL);
+        fs->thread_running = 0;
+    }
+
+    // a set staged before, and not swapped in (so that no frame has
+    // it), is let go of at once.
+    pthread_mutex_lock(&fs->mutex);
+    zarray_t *replaced = fs->staged;
+    fs->staged = NULL;
+    __atomic_store_n(&fs->ready, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->mutex);
+
+    if (replaced)
+        families_remove_users(replaced);
+
+    zarray_t *staged = zarray_create(sizeof(apriltag_family_t*));
+    for (int i = 0; i < nfamilies; i++) {
+        zarray_add(staged, &families[i]);
+        quick_decode_add_user(families[i]);
+    }
+
+    pthread_mutex_lock(&fs->mutex);
+    fs->staged = staged;
+    pthread_mutex_unlock(&fs->mutex);
+
+    if (pthread_create(&fs->thread, NULL, family_stage_thread, fs) != 0) {
+        pthread_mutex_lock(&fs->mutex);
+        fs->staged = NULL;
+        pthread_mutex_unlock(&fs->mutex);
+
+        families_remove_users(staged);
+        return -1;
+    }
+
+    fs->thread_running = 1;
+    return 0;
+}
+
+int apriltag_detector_families_staged(apriltag_detector_t *td)
+{
+    struct apriltag_family_stage *fs = td->family_stage;
+    if (!fs)
+        return 0;
+
+    pthread_mutex_lock(&fs->mutex);
+    int staged = !fs->staged ? 0 : __atomic_load_n(&fs->ready, __ATOMIC_ACQUIRE) ? 2 : 1;
+    pthread_mutex_unlock(&fs->mutex);
+
+    return staged;
+}
+
+static void family_stage_destroy(struct apriltag_family_stage *fs)
+{
+    if (fs->thread_running)
+        pthread_join(fs->thread, NULL);
+
+    if (fs->staged)
+        families_remove_users(fs->staged);
+
+    for (int i = 0; i < zarray_size(fs->retired); i++) {
+        zarray_t *families;
+        zarray_get(fs->retired, i, &families);
+        families_remove_users(families);
+    }
+
+    zarray_destroy(fs->retired);
+    pthread_mutex_destroy(&fs->mutex);
+    free(fs);
+}
+
+// Take the families of a frame of td into ctx->families, swapping in
+// the staged families first if they are ready. (The frame is then
+// running until detect_families_end.)
+static void detect_families_begin(apriltag_detector_t *td, apriltag_detect_context_t *ctx)
+{
+    struct apriltag_family_stage *fs = td->family_stage;
+
+    if (!fs) {
+        ctx->families = td->tag_families;
+        return;
+    }
+
+    pthread_mutex_lock(&fs->mutex);
+
+    if (fs->staged && __atomic_load_n(&fs->ready, __ATOMIC_ACQUIRE)) {
+        zarray_add(fs->retired, &td->tag_families);
+        td->tag_families = fs->staged;
+        fs->staged = NULL;
+        fs->ready = 0;
+        fs->nswaps++;
+    }
+
+    ctx->families = td->tag_families;
+    fs->nframes++;
+
+    // (the tracks hold the indices of their families.)
+    if (ctx->families_swaps != fs->nswaps) {
+        apriltag_detect_context_reset_tracking(ctx);
+        ctx->families_swaps = fs->nswaps;
+    }
+
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+// The frame of ctx is over: the last frame to finish lets go of the
+// families retired by the swaps.
+static void detect_families_end(apriltag_detect_context_t *ctx)
+{
+    struct apriltag_family_stage *fs = ctx->td->family_stage;
+    if (!fs)
+        return;
+
+    pthread_mutex_lock(&fs->mutex);
+
+    if (--fs->nframes == 0) {
+        for (int i = 0; i < zarray_size(fs->retired); i++) {
+            zarray_t *families;
+            zarray_get(fs->retired, i, &families);
+            families_remove_users(families);
+        }
+        zarray_clear(fs->retired);
+    }
+
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+void apriltag_quad_thresh_defaults(struct apriltag_quad_thresh_params* qtp) {
+
+  qtp->max_nmaxima = 10;
+  qtp->min_cluster_pixels = 5;
+  
+  qtp->max_line_fit_mse = 1.0;
+  qtp->critical_rad = 10 * M_PI / 180;
+  qtp->deglitch = 0;
+  qtp->min_white_black_diff = 15;
+  qtp->run_components = 1;
+  qtp->fixed_line_fit = 0;
+  qtp->tile_tolerance = -1;
+
+}
+
+void apriltag_detector_enable_quad_contours(apriltag_detector_t* td,
+                                            int enable) {
+
+  td->quad_contours = enable;
+  td->quad_gradient = 0;
+
+  if (enable) {
+    apriltag_quad_contour_defaults(&td->qcp);
+  } else {
+    apriltag_quad_thresh_defaults(&td->qtp);
+  }
+  
+}
+
+void apriltag_detector_enable_quad_gradient(apriltag_detector_t* td,
+                                            int enable) {
+
+  td->quad_gradient = enable;
+  td->quad_contours = 0;
+
+  if (enable) {
+    apriltag_quad_gradient_defaults(&td->qgp);
+  } else {
+    apriltag_quad_thresh_defaults(&td->qtp);
+  }
+
+}
+
+// A tag tracked by apriltag_detector_detect (see td->track_interval).
+struct track
+{
+    apriltag_family_t *family;
+    int id;
+
+    double c[2];    // center in the previous frame
+    double v[2];    // motion of the center per frame
+    double p[4][2]; // corners in the previous frame
+
+    // the tag's code, rotated 0 to 3 times (see track_verify).
+    uint64_t rcodes[4];
+};
+
+apriltag_detect_context_t *apriltag_detect_context_create()
+{
+    apriltag_detect_context_t *ctx = calloc(1, sizeof(apriltag_detect_context_t));
+
+    pthread_mutex_init(&ctx->mutex, NULL);
+
+    ctx->tp = timeprofile_create();
+
+    ctx->scratch = apriltag_scratch_create();
+
+    ctx->tracks = zarray_create(sizeof(struct track));
+
+    ctx->motion_detections = zarray_create(sizeof(apriltag_detection_record_t));
+    ctx->motion_ref = -1;
+
+    // NB: the workerpool is created by the first call, with the
+    // detector's nthreads.
+
+    return ctx;
+}
+
+void apriltag_detect_context_destroy(apriltag_detect_context_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    timeprofile_destroy(ctx->tp);
+    if (ctx->wp_owned)
+        workerpool_destroy(ctx->wp);
+
+    pthread_mutex_destroy(&ctx->mutex);
+    zarray_destroy(ctx->tracks);
+    zarray_destroy(ctx->motion_detections);
+    free(ctx->history);
+
+    apriltag_gpu_destroy(ctx->gpu);
+    apriltag_scratch_destroy(ctx->scratch);
+    free(ctx);
+}
+
+apriltag_detector_t *apriltag_detector_create()
+{
+    apriltag_detector_t *td = (apriltag_detector_t*) calloc(1, sizeof(apriltag_detector_t));
+
+    td->nthreads = 1;
+
+    // (picks the kernels for this CPU, once per process.)
+    simd_probe();
+
+    td->quad_contours = 0;
+    td->quad_gradient = 0;
+    apriltag_quad_thresh_defaults(&td->qtp);
+
+    td->tag_families = zarray_create(sizeof(apriltag_family_t*));
+
+    td->ctx = apriltag_detect_context_create();
+    td->tp = td->ctx->tp;
+
+    td->quad_pyramid_levels = 1;
+
+    td->auto_decimate = 0;
+    td->auto_decimate_edge = 12;
+
+    td->roi_margin = 16;
+
+    td->track_interval = 0;
+
+    td->motion_interval = 0;
+    td->motion_threshold = 4;
+
+    td->refine_edges = 1;
+    td->refine_pose = 0;
+    td->goodness_samples = 0;
+    td->refine_decode = 0;
+    td->decode_bilinear = 0;
+    td->decode_min_border_contrast = 0;
+
+    td->max_detections = 0;
+    td->expected_ids = NULL;
+    td->nexpected_ids = 0;
+
+    td->budget_utime = 0;
+
+    td->debug = 0;
+
+    return td;
+}
+
+void apriltag_detector_set_workerpool(apriltag_detector_t *td, workerpool_t *wp)
+{
+    td->wp = wp;
+
+    if (wp)
+        td->nthreads = workerpool_get_nthreads(wp);
+}
+
+void apriltag_detector_destroy(apriltag_detector_t *td)
+{
+    if (td->family_stage)
+        family_stage_destroy(td->family_stage);
+
+    apriltag_detector_clear_families(td);
+
+    zarray_destroy(td->tag_families);
+
+    apriltag_detect_context_destroy(td->ctx);
+    free(td);
+}
+
+struct decimate_task
+{
+    image_u8_t *im, *decim;
+    float factor;
+    int sy0, sy1; // [sy0, sy1), output rows
+};
+
+struct luma_task
+{
+    image_u8_t *im, *luma;
+    int format; // enum apriltag_image_format: a bayer mosaic, or color
+    int y0, y1; // [y0, y1)
+};
+
+struct blur_task
+{
+    image_u8_t *im, *tmp;
+    const uint8_t *k;
+    int ksz, sharpen;
+    int y0, y1;
+};
+
+struct quad_decode_task
+{
+    int i0, i1;
+    zarray_t *quads;
+    float decimate; // at which the quads were found
+    apriltag_detect_context_t *ctx;
+
+    image_u8_t *im;
+
+    // the task's detections (nresults of them), and the number of
+    // detections of the frame so far (see detection_expected).
+    apriltag_scratch_buffer_t *results;
+    int nresults;
+    int *ndetections;
+
+    image_u8_t *im_gray_samples;
+    image_u8_t *im_decision;
+
+    // for each family, the first family with the same geometry, whose
+    // samples it shares. (See decode_quads.)
+    const int *geometry;
+
+    // the number of quads not yet started by any task (under a
+    // deadline, see quad_decode_task).
+    int *nquads_left;
+
+    // how many quads each stage of quad_decode rejected, how many
+    // were skipped (see td->max_detections), and how many were decoded
+    // by track_verify.
+    uint32_t nborder_rejected, ncode_rejected, nskipped, nverified;
+};
+
+struct evaluate_quad_ret
+{
+    int64_t rcode;
+    double  score;
+    matd_t  *H, *Hinv;
+
+    int decode_status;
+    struct quick_decode_entry e;
+};
+
+// returns 0, or -1 if the quad is degenerate (in which case its
+// homographies are zeroed).
+int quad_update_homographies(struct quad *quad)
+{
+    if (homography33_compute_quad(quad->H, quad->p) == 0 &&
+        homography33_inverse(quad->Hinv, quad->H) == 0)
+        return 0;
+
+    memset(quad->H, 0, sizeof(quad->H));
+    memset(quad->Hinv, 0, sizeof(quad->Hinv));
+    return -1;
+}
+
+// quad_goodness from samples x samples points in every bit cell of
+// the white and black borders, projected a row of cells at a time:
+// the work is in proportion to the number of border cells, however
+// big the quad is in the image. Each point reads the pixel that
+// contains it.
+static double quad_goodness_sampled(apriltag_family_t *family, image_u8_t *im, struct quad *quad,
+                                    int samples)
+{
+    // in bit cells: the tag (with its black border) is [0, n) across,
+    // within the white border [-1, n + 1).
+    int bb = family->black_border;
+    int n = 2*bb + family->d;
+
+    // (a chunk of samples is at least one cell's row of them.)
+    samples = imin(samples, QUAD_SAMPLE_CHUNK);
+
+    // in tag coordinates, how big is each bit cell? And each step
+    // between samples?
+    double bit_size = 2.0 / n;
+    double step = bit_size / samples;
+
+    int64_t W1 = 0, B1 = 0, Wn = 0, Bn = 0;
+
+    for (int cy = -1; cy <= n; cy++) {
+
+        // in the rows of the data bits, only the cells either side
+        // (the left and right borders) are sampled.
+        int data_row = cy >= bb && cy < n - bb;
+
+        for (int side = 0; side < (data_row ? 2 : 1); side++) {
+
+            // the cells [cx0, cx1) of this row.
+            int cx0 = -1, cx1 = n + 1;
+            if (data_row) {
+                if (side == 0)
+                    cx1 = bb;
+                else
+                    cx0 = n - bb;
+            }
+
+            for (int sy = 0; sy < samples; sy++) {
+                double ty = -1 + (cy + (sy + 0.5) / samples) * bit_size;
+
+                for (int c0 = cx0; c0 < cx1; ) {
+                    int ncells = imin(cx1 - c0, QUAD_SAMPLE_CHUNK / samples);
+                    int npts = ncells * samples;
+
+                    double xs[QUAD_SAMPLE_CHUNK], ys[QUAD_SAMPLE_CHUNK];
+                    float vals[QUAD_SAMPLE_CHUNK];
+
+                    homography33_project_line(quad->H, -1 + c0 * bit_size + 0.5*step, ty,
+                                              step, 0, npts, xs, ys);
+                    image_u8_sample_points(im, xs, ys, npts, 0, vals);
+
+                    for (int i = 0; i < npts; i++) {
+                        if (vals[i] < 0)
+                            continue;
+
+                        // how many cells in from the white border?
+                        int cx = c0 + i / samples;
+                        int ring = imin(imin(cx + 1, cy + 1), imin(n - cx, n - cy));
+
+                        if (ring == 0) {
+                            W1 += vals[i];
+                            Wn++;
+                        } else if (ring <= bb) {
+                            B1 += vals[i];
+                            Bn++;
+                        }
+                    }
+
+                    c0 += ncells;
+                }
+            }
+        }
+    }
+
+    // score = average margin between white and black pixels near border.
+    return 1.0 * W1 / Wn - 1.0 * B1 / Bn;
+}
+
+// compute a "score" for a quad that is independent of tag family
+// encoding (but dependent upon the tag geometry) by considering the
+// contrast around the exterior of the tag. With samples > 0, from that
+// many samples across each bit cell of the borders (see
+// quad_goodness_sampled); otherwise from every pixel of the borders.
+double quad_goodness(apriltag_family_t *family, image_u8_t *im, struct quad *quad, int samples)
+{
+    if (samples > 0)
+        return quad_goodness_sampled(family, im, quad, samples);
+
+    // when sampling from the white border, how much white border do
+    // we actually consider valid, measured in bit-cell units? (the
+    // outside portions are often intruded upon, so it could be advantageous to use
+    // less than the "nominal" 1.0. (Less than 1.0 not well tested.)
+
+    // XXX Tunable
+    float white_border = 1;
+
+    // in tag coordinates, how big is each bit cell?
+    double bit_size = 2.0 / (2*family->black_border + family->d);
+//    double inv_bit_size = 1.0 / bit_size;
+
+    int32_t xmin = INT32_MAX, xmax = 0, ymin = INT32_MAX, ymax = 0;
+
+    for (int i = 0; i < 4; i++) {
+        double tx = (i == 0 || i == 3) ? -1 - bit_size : 1 + bit_size;
+        double ty = (i == 0 || i == 1) ? -1 - bit_size : 1 + bit_size;
+        double x, y;
+
+        homography33_project(quad->H, tx, ty, &x, &y);
+        xmin = imin(xmin, x);
+        xmax = imax(xmax, x);
+        ymin = imin(ymin, y);
+        ymax = imax(ymax, y);
+    }
+
+    // clamp bounding box to image dimensions
+    xmin = imax(0, xmin);
+    xmax = imin(im->width-1, xmax);
+    ymin = imax(0, ymin);
+    ymax = imin(im->height-1, ymax);
+
+//    int nbits = family->d * family->d;
+
+    int64_t W1 = 0, B1 = 0, Wn = 0, Bn = 0;
+
+    float wsz = bit_size*white_border;
+    float bsz = bit_size*family->black_border;
+
+    const double *Hinv = quad->Hinv;
+
+    // iterate over all the pixels in the tag. (Iterating in pixel space)
+    for (int y = ymin; y <= ymax; y++) {
+
+        // project the pixel centers of the row, a chunk at a time.
+        for (int x0 = xmin; x0 <= xmax; x0 += QUAD_SAMPLE_CHUNK) {
+            int n = imin(QUAD_SAMPLE_CHUNK, xmax - x0 + 1);
+            double txs[QUAD_SAMPLE_CHUNK], tys[QUAD_SAMPLE_CHUNK];
+
+            homography33_project_line(Hinv, x0 + .5, y + .5, 1, 0, n, txs, tys);
+
+            for (int i = 0; i < n; i++) {
+                float txa = fabsf((float) txs[i]), tya = fabsf((float) tys[i]);
+                float xymax = fmaxf(txa, tya);
+
+                if (xymax >= 1 + wsz)
+                    continue;
+
+                uint8_t v = im->buf[y*im->stride + x0 + i];
+
+                // it's within the white border?
+                if (xymax >= 1) {
+                    W1 += v;
+                    Wn ++;
+                    continue;
+                }
+
+                // it's within the black border?
+                if (xymax >= 1 - bsz) {
+                    B1 += v;
+                    Bn ++;
+                    continue;
+                }
+
+                // it must be a data bit. We don't do anything with these.
+            }
+        }
+    }
+
+    // score = average margin between white and black pixels near border.
+    return 1.0 * W1 / Wn - 1.0 * B1 / Bn;
+}
+
+// Work out the sample points of quad_sample_bits for tags of d bits
+// and black_border, in dec. (Not its sample_bits or rotate_tables.)
+static void quad_decoder_init(struct quad_decoder *dec, uint32_t d, uint32_t black_border)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->d = d;
+    dec->black_border = black_border;
+
+    // how wide do we assume the white border is?
+    float white_border = 1.0;
+
+    // We will compute a threshold by sampling known white/black cells around this tag.
+    // This sampling is achieved by considering a set of samples along lines.
+    //
+    // coordinates are given in bit coordinates. ([0, fam->d]).
+    //
+    // { initial x, initial y, delta x, delta y, WHITE=1 }
+    float patterns[] = {
+        // left white column
+        0 - white_border / 2.0, 0.5,
+        0, 1,
+        1,
+
+        // left black column
+        0 + black_border / 2.0, 0.5,
+        0, 1,
+        0,
+
+        // right white column
+        2*black_border + d + white_border / 2.0, .5,
+        0, 1,
+        1,
+
+        // right black column
+        2*black_border + d - black_border / 2.0, .5,
+        0, 1,
+        0,
+
+        // top white row
+        0.5, -white_border / 2.0,
+        1, 0,
+        1,
+
+        // top black row
+        0.5, black_border / 2.0,
+        1, 0,
+        1,
+
+        // bottom white row
+        0.5, 2*black_border + d + white_border / 2.0,
+        1, 0,
+        1,
+
+        // bottom black row
+        0.5, 2*black_border + d - black_border / 2.0,
+        1, 0,
+        0
+
+        // XXX double-counts the corners.
+    };
+
+    // the width of the tag in bit cells, and of a bit cell in tag
+    // coordinates ([-1, 1]).
+    int nedge = 2*black_border + d;
+    double bit_size = 2.0 / nedge;
+
+    for (int pattern_idx = 0; pattern_idx < 8; pattern_idx++) {
+        float *pattern = &patterns[pattern_idx * 5];
+
+        dec->border_lines[pattern_idx][0] = pattern[0]*bit_size - 1;
+        dec->border_lines[pattern_idx][1] = pattern[1]*bit_size - 1;
+        dec->border_lines[pattern_idx][2] = pattern[2]*bit_size;
+        dec->border_lines[pattern_idx][3] = pattern[3]*bit_size;
+        dec->border_sums[pattern_idx] = pattern[4];
+    }
+
+    dec->bits_x0 = (black_border + 0.5)*bit_size - 1;
+    for (uint32_t bity = 0; bity < d && bity < 8; bity++)
+        dec->bits_y0[bity] = (black_border + bity + 0.5)*bit_size - 1;
+    dec->bit_size = bit_size;
+}
+
+// quad_sample_bits, from the sample points of dec. d and black_border
+// are those of dec, passed again so that the versions of this for
+// each geometry (quad_sample_bits_kernels) can be compiled with them
+// as constants: the loops over the bits are then of known length.
+static inline float quad_sample_bits_kernel(const struct quad_decoder *dec, image_u8_t *im,
+                                            struct quad *quad, int bilinear,
+                                            float min_border_contrast, uint64_t *prcode,
+                                            const uint32_t d, const uint32_t black_border)
+{
+    // decode the tag binary contents by sampling the pixel
     // closest to the center of each bit cell.
 
-    int64_t rcode = 0;
+    int64_t rcode = 0;
+
+    float sums[2] = { 0, 0 };
+    float counts[2] = { 0, 0 };
+
+    // the same, for the border check. The patterns alternate white
+    // and black, which (unlike the WHITE flags above, which count the
+    // top black row as white for the threshold) is used here.
+    float border_sums[2] = { 0, 0 };
+    float border_counts[2] = { 0, 0 };
+
+    // the width of the tag in bit cells.
+    const int nedge = 2*black_border + d;
+
+    assert(nedge <= QUAD_SAMPLE_CHUNK);
+    double pxs[QUAD_SAMPLE_CHUNK], pys[QUAD_SAMPLE_CHUNK];
+    float vals[QUAD_SAMPLE_CHUNK];
+
+    for (int pattern_idx = 0; pattern_idx < 8; pattern_idx ++) {
+        const double *line = dec->border_lines[pattern_idx];
+
+        int sumidx = dec->border_sums[pattern_idx];
+
+        homography33_project_line(quad->H, line[0], line[1], line[2], line[3],
+                                  nedge, pxs, pys);
+        image_u8_sample_points(im, pxs, pys, nedge, bilinear, vals);
+
+        for (int i = 0; i < nedge; i++) {
+            if (vals[i] < 0)
+                continue;
+
+            sums[sumidx] += vals[i];
+            counts[sumidx] ++;
+
+            border_sums[pattern_idx & 1] += vals[i];
+            border_counts[pattern_idx & 1] ++;
+        }
+    }
+
+    float contrast = border_sums[0] / border_counts[0] - border_sums[1] / border_counts[1];
+    if (!(contrast >= min_border_contrast))
+        return -1;
+
+    float thresh = ((sums[0] / counts[0]) + (sums[1] / counts[1])) / 2.0;
+
+    // compute the average decision margin (how far was each bit from
+    // the decision boundary?
+    float score = 0;
+    float score_count = 0;
+
+    // sample the bit cell centers a row at a time.
+    for (uint32_t bity = 0; bity < d; bity++) {
+        homography33_project_line(quad->H, dec->bits_x0, dec->bits_y0[bity],
+                                  dec->bit_size, 0, d, pxs, pys);
+        image_u8_sample_points(im, pxs, pys, d, bilinear, vals);
+
+        for (uint32_t bitx = 0; bitx < d; bitx++) {
+            float v = vals[bitx];
+
+            rcode = (rcode << 1);
+
+            if (v < 0)
+                continue;
+
+            if (v > thresh) {
+                score += (v - thresh);
+                score_count ++;
+                rcode |= 1;
+            } else {
+                score += (thresh - v);
+                score_count ++;
+            }
+        }
+    }
+
+    *prcode = rcode;
+    return score / score_count;
+}
+
+#define QUAD_SAMPLE_BITS_KERNEL(D, BB)                                  \
+    static float quad_sample_bits_##D##_##BB(const struct quad_decoder *dec, image_u8_t *im, \
+                                             struct quad *quad, int bilinear, \
+                                             float min_border_contrast, uint64_t *prcode) \
+    {                                                                   \
+        return quad_sample_bits_kernel(dec, im, quad, bilinear, min_border_contrast, \
+                                       prcode, D, BB);                  \
+    }
+
+// the geometries of the families in the tree.
+QUAD_SAMPLE_BITS_KERNEL(4, 1)
+QUAD_SAMPLE_BITS_KERNEL(5, 1)
+QUAD_SAMPLE_BITS_KERNEL(6, 1)
+
+#undef QUAD_SAMPLE_BITS_KERNEL
+
+// (and any other.)
+static float quad_sample_bits_any(const struct quad_decoder *dec, image_u8_t *im,
+                                  struct quad *quad, int bilinear,
+                                  float min_border_contrast, uint64_t *prcode)
+{
+    return quad_sample_bits_kernel(dec, im, quad, bilinear, min_border_contrast,
+                                   prcode, dec->d, dec->black_border);
+}
+
+static const struct
+{
+    uint32_t d, black_border;
+    float (*sample_bits)(const struct quad_decoder *dec, image_u8_t *im, struct quad *quad,
+                         int bilinear, float min_border_contrast, uint64_t *prcode);
+} quad_sample_bits_kernels[] = {
+    { 4, 1, quad_sample_bits_4_1 },
+    { 5, 1, quad_sample_bits_5_1 },
+    { 6, 1, quad_sample_bits_6_1 },
+};
+
+// Choose the decoder of fam (in its quick_decode) for its geometry as
+// it is now, unless it has one already.
+static void quad_decoder_select(apriltag_family_t *fam)
+{
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+
+    if (qd->decoder && qd->decoder->d == fam->d && qd->decoder->black_border == fam->black_border)
+        return;
+
+    if (qd->decoder) {
+        free(qd->decoder->rotate_tables);
+        free(qd->decoder);
+    }
+
+    struct quad_decoder *dec = malloc(sizeof(struct quad_decoder));
+    quad_decoder_init(dec, fam->d, fam->black_border);
+
+    dec->sample_bits = quad_sample_bits_any;
+    int nkernels = sizeof(quad_sample_bits_kernels) / sizeof(quad_sample_bits_kernels[0]);
+    for (int i = 0; i < nkernels; i++) {
+        if (quad_sample_bits_kernels[i].d == fam->d &&
+            quad_sample_bits_kernels[i].black_border == fam->black_border)
+            dec->sample_bits = quad_sample_bits_kernels[i].sample_bits;
+    }
+
+    // rotate90 moves each bit on its own, so it can be done a byte at
+    // a time.
+    dec->nbytes = (fam->d * fam->d + 7) / 8;
+    dec->rotate_tables = malloc(dec->nbytes * sizeof(dec->rotate_tables[0]));
+    for (int i = 0; i < dec->nbytes; i++) {
+        for (int v = 0; v < 256; v++)
+            dec->rotate_tables[i][v] = rotate90((uint64_t) v << (8*i), fam->d);
+    }
+
+    qd->decoder = dec;
+}
+
+// Sample the bits of the quad, reading the code into *prcode. Only
+// the geometry of the family (d and black_border) is used, so families
+// that share it can share the result. Returns the decision margin, or
+// -1 if the quad was rejected by its border.
+//
+// The decode is staged, so that quads that are obviously not tags are
+// cheap: the border is sampled first, and unless the white border is
+// lighter than the black border by at least min_border_contrast, the
+// bits are not sampled at all.
+//
+// bilinear: interpolate the samples, rather than reading the pixel
+// that contains each one.
+float quad_sample_bits(apriltag_family_t *family, image_u8_t *im, struct quad *quad, int bilinear,
+                       float min_border_contrast, uint64_t *prcode)
+{
+    struct quick_decode *qd = (struct quick_decode*) family->impl;
+    const struct quad_decoder *dec = qd ? qd->decoder : NULL;
+
+    // without a decoder for the family's geometry (if it changed after
+    // the family was added, say), the sample points are worked out
+    // here.
+    struct quad_decoder local;
+    if (!dec || dec->d != family->d || dec->black_border != family->black_border) {
+        quad_decoder_init(&local, family->d, family->black_border);
+        local.sample_bits = quad_sample_bits_any;
+        dec = &local;
+    }
+
+    return dec->sample_bits(dec, im, quad, bilinear, min_border_contrast, prcode);
+}
+
+// look up a code read by quad_sample_bits (or, if decision_margin is
+// negative, report the rejection: entry->hamming is 255).
+static void quad_decode_lookup(apriltag_family_t *family, uint64_t rcode, float decision_margin,
+                               struct quick_decode_entry *entry)
+{
+    if (decision_margin < 0) {
+        entry->rcode = 0;
+        entry->id = 65535;
+        entry->hamming = 255;
+        entry->rotation = 0;
+        return;
+    }
+
+    quick_decode_codeword(family, rcode, entry);
+}
+
+// returns the decision margin, or -1 if the quad was rejected by its
+// border (in which case entry->hamming is 255 as well). See
+// quad_sample_bits.
+float quad_decode(apriltag_family_t *family, image_u8_t *im, struct quad *quad, int bilinear,
+                  float min_border_contrast, struct quick_decode_entry *entry)
+{
+    uint64_t rcode = 0;
+    float decision_margin = quad_sample_bits(family, im, quad, bilinear, min_border_contrast, &rcode);
+
+    quad_decode_lookup(family, rcode, decision_margin, entry);
+    return decision_margin;
+}
+
+double score_decodability(apriltag_family_t *family, image_u8_t *im, struct quad *quad, void *user)
+{
+    struct quick_decode_entry entry;
+
+    apriltag_detector_t *td = (apriltag_detector_t*) user;
+    // the border check would make the score flat for the quads it
+    // rejects, leaving the optimizer nothing to climb.
+    float decision_margin = quad_decode(family, im, quad, td->decode_bilinear, -INFINITY, &entry);
+
+    // hamming trumps decision margin; maximum value for decision_margin is 255.
+    return decision_margin - entry.hamming*1000;
+}
+
+// returns score of best quad
+double optimize_quad_generic(apriltag_family_t *family, image_u8_t *im, struct quad *quad0,
+                             float *stepsizes, int nstepsizes,
+                             double (*score)(apriltag_family_t *family, image_u8_t *im, struct quad *quad, void *user),
+                             void *user)
+{
+    // work on three quads (on the stack), swapping pointers rather
+    // than copying a quad per step.
+    struct quad quads[3];
+
+    struct quad *best_quad = &quads[0];
+    struct quad *this_best_quad = &quads[1];
+    struct quad *this_quad = &quads[2];
+
+    *best_quad = *quad0;
+    double best_score = score(family, im, best_quad, user);
+
+    for (int stepsize_idx = 0; stepsize_idx < nstepsizes; stepsize_idx++)  {
+
+        int improved = 1;
+
+        // when we make progress with a particular step size, how many
+        // times will we try to perform that same step size again?
+        // (max_repeat = 0 means ("don't repeat--- just move to the
+        // next step size").
+        // XXX Tunable
+        int max_repeat = 1;
+
+        for (int repeat = 0; repeat <= max_repeat && improved; repeat++) {
+
+            improved = 0;
+
+            // wiggle point i
+            for (int i = 0; i < 4; i++) {
+
+                float stepsize = stepsizes[stepsize_idx];
+
+                // XXX Tunable (really 1 makes the best sense since)
+                int nsteps = 1;
+
+                double this_best_score = best_score;
+
+                for (int sx = -nsteps; sx <= nsteps; sx++) {
+                    for (int sy = -nsteps; sy <= nsteps; sy++) {
+                        if (sx==0 && sy==0)
+                            continue;
+
+                        memcpy(this_quad->p, best_quad->p, sizeof(this_quad->p));
+                        this_quad->p[i][0] = best_quad->p[i][0] + sx*stepsize;
+                        this_quad->p[i][1] = best_quad->p[i][1] + sy*stepsize;
+                        if (quad_update_homographies(this_quad))
+                            continue;
+
+                        double this_score = score(family, im, this_quad, user);
+
+                        if (this_score > this_best_score) {
+                            struct quad *tmp = this_best_quad;
+                            this_best_quad = this_quad;
+                            this_quad = tmp;
+
+                            this_best_score = this_score;
+                        }
+                    }
+                }
+
+                if (this_best_score > best_score) {
+                    struct quad *tmp = best_quad;
+                    best_quad = this_best_quad;
+                    this_best_quad = tmp;
+
+                    best_score = this_best_score;
+                    improved = 1;
+                }
+            }
+        }
+    }
+
+    *quad0 = *best_quad;
+
+    return best_score;
+}
+
+// Search along the normal (nx, ny) of an edge of a quad, within
+// +/- range of (x0, y0), for the edge of the tag: the image gradient
+// there points along +normal. Returns the offset along the normal of
+// the gradient-weighted mean position, or NaN if no gradient pointing
+// the right way was found.
+static double edge_search(image_u8_t *im_orig, double x0, double y0, double nx, double ny,
+                          double range, int bilinear)
+{
+    double Mn = 0;
+    double Mcount = 0;
+
+    // sample to points (x1,y1) and (x2,y2) XXX tunable:
+    // how far +/- to look? Small values compute the
+    // gradient more precisely, but are more sensitive to
+    // noise.
+    double grange = 1;
+
+    // XXX tunable step size.
+    double n = -range;
+    while (n <= range) {
+        // Because of the guaranteed winding order of the
+        // points in the quad, we will start inside the white
+        // portion of the quad and work our way outward.
+        double ns[QUAD_SAMPLE_CHUNK];
+        double x1s[QUAD_SAMPLE_CHUNK], y1s[QUAD_SAMPLE_CHUNK];
+        double x2s[QUAD_SAMPLE_CHUNK], y2s[QUAD_SAMPLE_CHUNK];
+        float g1s[QUAD_SAMPLE_CHUNK], g2s[QUAD_SAMPLE_CHUNK];
+        int nsteps = 0;
+
+        for (; n <= range && nsteps < QUAD_SAMPLE_CHUNK; n += 0.25) {
+            ns[nsteps] = n;
+            x1s[nsteps] = x0 + (n + grange)*nx;
+            y1s[nsteps] = y0 + (n + grange)*ny;
+            x2s[nsteps] = x0 + (n - grange)*nx;
+            y2s[nsteps] = y0 + (n - grange)*ny;
+            nsteps++;
+        }
+
+        image_u8_sample_points(im_orig, x1s, y1s, nsteps, bilinear, g1s);
+        image_u8_sample_points(im_orig, x2s, y2s, nsteps, bilinear, g2s);
+
+        for (int i = 0; i < nsteps; i++) {
+            if (g1s[i] < 0 || g2s[i] < 0)
+                continue;
+
+            float g1 = g1s[i];
+            float g2 = g2s[i];
+
+            if (g1 < g2) // reject points whose gradient is "backwards". They can only hurt us.
+                continue;
+
+            double weight = (g2 - g1)*(g2 - g1); // XXX tunable. What shape for weight=f(g2-g1)?
+
+            // compute weighted average of the gradient at this point.
+            Mn += weight*ns[i];
+            Mcount += weight;
+        }
+    }
+
+    return Mn / Mcount;
+}
+
+// decimate: the decimation at which the quad was found.
+static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct quad *quad,
+                         float decimate)
+{
+    double lines[4][4]; // for each line, [Ex Ey nx ny]
+
+    float xs[REFINE_EDGES_CHUNK], ys[REFINE_EDGES_CHUNK], vals[REFINE_EDGES_CHUNK];
+
+    for (int edge = 0; edge < 4; edge++) {
+        int a = edge, b = (edge + 1) & 3; // indices of the end points.
+
+        // compute the normal to the current line estimate
+        double nx = quad->p[b][1] - quad->p[a][1];
+        double ny = -quad->p[b][0] + quad->p[a][0];
+        double mag = sqrt(nx*nx + ny*ny);
+        nx /= mag;
+        ny /= mag;
+
+        // we will now fit a NEW line by sampling points near
+        // our original line that have large gradients. On really big tags,
+        // we're willing to sample more to get an even better estimate.
+        int nsamples = imax(16, mag / 8); // XXX tunable
+
+        // search along the normal of each sample (a point along the
+        // line) for the edge, within +/- range of it.
+        //
+        // XXX tunable: how far to search?  We want to search far
+        // enough that we find the best edge, but not so far that
+        // we hit other edges that aren't part of the tag. We
+        // shouldn't ever have to search more than quad_decimate,
+        // since otherwise we would (ideally) have started our
+        // search on another pixel in the first place. Likewise,
+        // for very small tags, we don't want the range to be too
+        // big.
+        double range = fmin(decimate + 1, mag / 10);
+
+        // each step (of 0.25 pixels) has the gradient between the
+        // pixels one pixel either side of it, two of the nsteps + 8
+        // values sampled along the normal: step k's are values k + 8
+        // (outwards) and k. (a search fits in a chunk.)
+        int nsteps = 4*2*range + 1;
+        nsteps = imin(nsteps, REFINE_EDGES_CHUNK - 8);
+        int nvals = nsteps + 8;
+        int per_chunk = REFINE_EDGES_CHUNK / nvals;
+
+        // stats for fitting a line, each point weighted by the
+        // strength of the edge found there.
+        double W = 0, Mx = 0, My = 0, Mxx = 0, Mxy = 0, Myy = 0;
+
+        for (int s0 = 0; s0 < nsamples; s0 += per_chunk) {
+            int s1 = imin(nsamples, s0 + per_chunk);
+
+            // Note, we're avoiding sampling *right* at the corners,
+            // since those points are the least reliable.
+            for (int s = s0; s < s1; s++) {
+                double alpha = (1.0 + s) / (nsamples + 1);
+                float x0 = alpha*quad->p[a][0] + (1-alpha)*quad->p[b][0] - (range + 1)*nx;
+                float y0 = alpha*quad->p[a][1] + (1-alpha)*quad->p[b][1] - (range + 1)*ny;
+                float dx = 0.25*nx, dy = 0.25*ny;
+
+                float *x = &xs[(s - s0)*nvals], *y = &ys[(s - s0)*nvals];
+                for (int k = 0; k < nvals; k++) {
+                    x[k] = x0 + k*dx;
+                    y[k] = y0 + k*dy;
+                }
+            }
+
+            image_u8_sample_points_f32(im_orig, xs, ys, (s1 - s0)*nvals, vals);
+
+            for (int s = s0; s < s1; s++) {
+                const float *v = &vals[(s - s0)*nvals];
+
+                // Because of the guaranteed winding order of the
+                // points in the quad, we will start inside the white
+                // portion of the quad and work our way outward.
+                float Mk = 0, Mcount = 0;
+                for (int k = 0; k < nsteps; k++) {
+                    float g1 = v[k + 8], g2 = v[k];
+
+                    // (no weight outside the image, or where the
+                    // gradient is "backwards", which can only hurt us.)
+                    float d = g1 > g2 && g2 >= 0 ? g1 - g2 : 0;
+
+                    float weight = d*d; // XXX tunable. What shape for weight=f(g2-g1)?
+                    Mk += weight*k;
+                    Mcount += weight;
+                }
+
+                if (Mcount == 0)
+                    continue;
+
+                // where is the point along the line?
+                double alpha = (1.0 + s) / (nsamples + 1);
+                double n0 = -range + 0.25*Mk / Mcount;
+                double x = alpha*quad->p[a][0] + (1-alpha)*quad->p[b][0] + n0*nx;
+                double y = alpha*quad->p[a][1] + (1-alpha)*quad->p[b][1] + n0*ny;
+
+                W += Mcount;
+                Mx += Mcount*x;
+                My += Mcount*y;
+                Mxx += Mcount*x*x;
+                Mxy += Mcount*x*y;
+                Myy += Mcount*y*y;
+            }
+        }
+
+        // (no edge was found: keep this one.)
+        if (W == 0) {
+            lines[edge][0] = quad->p[a][0];
+            lines[edge][1] = quad->p[a][1];
+            lines[edge][2] = nx;
+            lines[edge][3] = ny;
+            continue;
+        }
+
+        // fit a line
+        double Ex = Mx / W, Ey = My / W;
+        double Cxx = Mxx / W - Ex*Ex;
+        double Cxy = Mxy / W - Ex*Ey;
+        double Cyy = Myy / W - Ey*Ey;
+
+        double normal_theta = .5 * atan2(-2*Cxy, (Cyy - Cxx));
+        lines[edge][0] = Ex;
+        lines[edge][1] = Ey;
+        lines[edge][2] = cos(normal_theta);
+        lines[edge][3] = sin(normal_theta);
+    }
+
+    // now refit the corners of the quad
+    for (int i = 0; i < 4; i++) {
+        // solve for the intersection of lines (i) and (i+1)&3.
+        double A00 =  lines[i][3],  A01 = -lines[(i+1)&3][3];
+        double A10 =  -lines[i][2],  A11 = lines[(i+1)&3][2];
+        double B0 = -lines[i][0] + lines[(i+1)&3][0];
+        double B1 = -lines[i][1] + lines[(i+1)&3][1];
+
+        double det = A00 * A11 - A10 * A01;
+
+        // inverse.
+        double W00 = A11 / det, W01 = -A01 / det;
+        if (fabs(det) > 0.001) {
+            // solve
+            double L0 = W00*B0 + W01*B1;
+
+            // compute intersection
+            quad->p[i][0] = lines[i][0] + L0*A00;
+            quad->p[i][1] = lines[i][1] + L0*A10;
+        }
+    }
+}
+
+// the edge points sampled by refine_corners, and the edge of the quad
+// (the line through corners edge and edge+1) each belongs to.
+struct refine_corners_data
+{
+    int n;
+    const double *xs, *ys;
+    const int *edges;
+};
+
+// lm_der residual function for refine_corners: p holds the corners
+// (x0, y0, ... x3, y3), and residual i is the signed distance of edge
+// point i from its edge.
+static void refine_corners_residual(int m, int n, const double *p, double *x, double *J, void *user)
+{
+    struct refine_corners_data *data = user;
+
+    for (int i = 0; i < n; i++) {
+        int a = data->edges[i], b = (a + 1) & 3;
+
+        double xa = p[2*a + 0], ya = p[2*a + 1];
+        double dx = p[2*b + 0] - xa, dy = p[2*b + 1] - ya;
+        double l = sqrt(dx*dx + dy*dy);
+
+        double px = data->xs[i] - xa, py = data->ys[i] - ya;
+        double d = (px*dy - py*dx) / l;
+
+        x[i] = d;
+
+        if (!J)
+            continue;
+
+        // d = c / l, with c = px*dy - py*dx, so dd = (dc - d dl) / l.
+        double *Ji = &J[m*i];
+        memset(Ji, 0, m * sizeof(double));
+
+        Ji[2*a + 0] = (py - dy + d*dx/l) / l;
+        Ji[2*a + 1] = (dx - px + d*dy/l) / l;
+        Ji[2*b + 0] = (-py - d*dx/l) / l;
+        Ji[2*b + 1] = (px - d*dy/l) / l;
+    }
+}
+
+// Refine the corners of a quad (found in the full-resolution image)
+// for pose estimation: sample the tag's edge along each side of the
+// quad, then fit all four corners at once to the edge points (a
+// robust least-squares problem solved by Levenberg-Marquardt), and
+// repeat from the new corners until they stop moving.
+//
+// Returns 0, or -1 (leaving the quad unchanged) if the edges could not
+// be found.
+static int refine_corners(image_u8_t *im, struct quad *quad)
+{
+    // XXX Tunable
+    int maxiters = 4;
+
+    float p[4][2];
+    memcpy(p, quad->p, sizeof(p));
+
+    // the samples of each side, which is as many as refine_edges takes.
+    int nsamples[4];
+    int n = 0;
+
+    for (int edge = 0; edge < 4; edge++) {
+        int b = (edge + 1) & 3;
+        double mag = sqrt(sq(p[b][0] - p[edge][0]) + sq(p[b][1] - p[edge][1]));
+
+        nsamples[edge] = imax(16, mag / 8); // XXX tunable
+        n += nsamples[edge];
+    }
+
+    double xs[n], ys[n];
+    int edges[n];
+
+    // lm_der's storage, reused by each fit.
+    double work[LM_WORK_SIZE(8, n)];
+
+    lm_opts_t opts;
+    lm_opts_defaults(&opts);
+    opts.lfunc = LM_LOSS_HUBER;
+    opts.lparam = 0.5; // XXX Tunable: in pixels
+    opts.lambda_init = 1e-3;
+
+    for (int iter = 0; iter < maxiters; iter++) {
+        int npts = 0;
+
+        for (int edge = 0; edge < 4; edge++) {
+            int a = edge, b = (edge + 1) & 3;
+
+            double nx = p[b][1] - p[a][1];
+            double ny = -p[b][0] + p[a][0];
+            double mag = sqrt(nx*nx + ny*ny);
+            nx /= mag;
+            ny /= mag;
+
+            // the corners are already close (within a pixel or two),
+            // so search less widely than refine_edges does.
+            // XXX Tunable
+            double range = fmin(2, mag / 10);
+
+            int edge0 = npts;
+
+            for (int s = 0; s < nsamples[edge]; s++) {
+                double alpha = (1.0 + s) / (nsamples[edge] + 1);
+                double x0 = alpha*p[a][0] + (1-alpha)*p[b][0];
+                double y0 = alpha*p[a][1] + (1-alpha)*p[b][1];
+
+                double n0 = edge_search(im, x0, y0, nx, ny, range, 1);
+                if (!isfinite(n0))
+                    continue;
+
+                xs[npts] = x0 + n0*nx;
+                ys[npts] = y0 + n0*ny;
+                edges[npts] = edge;
+                npts++;
+            }
+
+            // too few points to locate this side.
+            if (npts - edge0 < 2)
+                return -1;
+        }
+
+        struct refine_corners_data data = { .n = npts, .xs = xs, .ys = ys, .edges = edges };
+
+        double params[8];
+        for (int i = 0; i < 4; i++) {
+            params[2*i + 0] = p[i][0];
+            params[2*i + 1] = p[i][1];
+        }
+
+        // XXX Tunable
+        lm_der_work(8, npts, params, refine_corners_residual, 10, &opts, NULL, &data, work);
+
+        double maxmove = 0;
+        for (int i = 0; i < 4; i++) {
+            maxmove = fmax(maxmove, fabs(params[2*i + 0] - p[i][0]));
+            maxmove = fmax(maxmove, fabs(params[2*i + 1] - p[i][1]));
+            p[i][0] = params[2*i + 0];
+            p[i][1] = params[2*i + 1];
+        }
+
+        // XXX Tunable
+        if (maxmove < 0.01)
+            break;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (!isfinite(p[i][0]) || !isfinite(p[i][1]))
+            return -1;
+    }
+
+    memcpy(quad->p, p, sizeof(p));
+    return 0;
+}
+
+// Record that the work of degradation (enum apriltag_degradation) was
+// left out of the current frame of ctx.
+static void detect_degrade(apriltag_detect_context_t *ctx, int degradation)
+{
+    __atomic_fetch_or(&ctx->stats.degraded, degradation, __ATOMIC_RELAXED);
+}
+
+int apriltag_detect_context_expired(apriltag_detect_context_t *ctx, int degradation)
+{
+    if (!ctx->deadline || utime_now() < ctx->deadline)
+        return 0;
+
+    detect_degrade(ctx, degradation);
+    return 1;
+}
+
+// Count det, a new detection, towards the tags expected of the frame,
+// setting ctx->complete once they have all been found. *ndetections is
+// the number of detections of the frame so far. (Called by every
+// decoding thread at once.)
+static void detection_expected(apriltag_detect_context_t *ctx, int *ndetections,
+                               const apriltag_detection_record_t *det)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    if (td->max_detections > 0 &&
+        __atomic_add_fetch(ndetections, 1, __ATOMIC_RELAXED) >= td->max_detections)
+        __atomic_store_n(&ctx->complete, 1, __ATOMIC_RELAXED);
+
+    // (only the first detection of an id counts.)
+    for (int i = 0; i < td->nexpected_ids; i++) {
+        if (td->expected_ids[i] != det->id)
+            continue;
+
+        if (!__atomic_exchange_n(&ctx->expected_found[i], 1, __ATOMIC_RELAXED) &&
+            __atomic_add_fetch(&ctx->nexpected_found, 1, __ATOMIC_RELAXED) >= td->nexpected_ids)
+            __atomic_store_n(&ctx->complete, 1, __ATOMIC_RELAXED);
+        break;
+    }
+}
+
+// Reset the count of the tags expected of the frame found so far.
+static void detection_expected_reset(apriltag_detect_context_t *ctx)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    ctx->complete = 0;
+    ctx->nexpected_found = 0;
+
+    ctx->expected_found = apriltag_scratch_buffer(&ctx->scratch->expected_found, imax(td->nexpected_ids, 1));
+    memset(ctx->expected_found, 0, imax(td->nexpected_ids, 1));
+}
+
+// Record that a quad, refined or not, took from utime0 to utime1 to
+// decode (see ctx->quad_utime). refined is -1 if there was no quad.
+static void quad_decode_timed(apriltag_detect_context_t *ctx, int refined, int64_t utime0, int64_t utime1)
+{
+    if (refined >= 0)
+        __atomic_store_n(&ctx->quad_utime[refined], utime1 - utime0, __ATOMIC_RELAXED);
+}
+
+// The tracked tag (see td->track_interval) predicted to be where quad
+// is, if any: the nearest one whose center, moved by its velocity, is
+// within a quarter of its size of the quad's. *famidx is the index of
+// its family in ctx->families.
+static const struct track *track_near(apriltag_detect_context_t *ctx, const struct quad *quad, int *famidx)
+{
+    double qx = 0, qy = 0;
+    for (int i = 0; i < 4; i++) {
+        qx += 0.25 * quad->p[i][0];
+        qy += 0.25 * quad->p[i][1];
+    }
+
+    const struct track *best = NULL;
+    double bestd2 = INFINITY;
+
+    for (int i = 0; i < zarray_size(ctx->tracks); i++) {
+        struct track *t;
+        zarray_get_volatile(ctx->tracks, i, &t);
+
+        double x0 = t->p[0][0], x1 = t->p[0][0];
+        double y0 = t->p[0][1], y1 = t->p[0][1];
+        for (int j = 1; j < 4; j++) {
+            x0 = fmin(x0, t->p[j][0]);
+            x1 = fmax(x1, t->p[j][0]);
+            y0 = fmin(y0, t->p[j][1]);
+            y1 = fmax(y1, t->p[j][1]);
+        }
+
+        double r = 0.25 * fmax(x1 - x0, y1 - y0);
+        double dx = qx - (t->c[0] + t->v[0]), dy = qy - (t->c[1] + t->v[1]);
+        double d2 = dx*dx + dy*dy;
+
+        if (d2 < r*r && d2 < bestd2) {
+            best = t;
+            bestd2 = d2;
+        }
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    // (the family may have been removed since.)
+    for (int i = 0; i < zarray_size(ctx->families); i++) {
+        apriltag_family_t *family;
+        zarray_get(ctx->families, i, &family);
+
+        if (family == best->family) {
+            *famidx = i;
+            return best;
+        }
+    }
+
+    return NULL;
+}
+
+// Does rcode, read from a quad near the tracked tag t, read as t's
+// code? If so, fills in entry as quick_decode_codeword would have,
+// without the table: a code within maxhamming of t's, and less than
+// half the family's minimum distance from it, can decode to nothing
+// else.
+static int track_verify(const struct track *t, uint64_t rcode, struct quick_decode_entry *entry)
+{
+    apriltag_family_t *family = t->family;
+    struct quick_decode *qd = (struct quick_decode*) family->impl;
+
+    if (qd->ids && !bsearch(&t->id, qd->ids, qd->nids, sizeof(int), int_compare))
+        return 0;
+
+    for (int k = 0; k < 4; k++) {
+        int hamming = __builtin_popcountll(rcode ^ t->rcodes[k]);
+        if (hamming > qd->maxhamming || 2*hamming >= (int) family->h)
+            continue;
+
+        // rcode is t's code rotated k times, so rotating it 4 - k
+        // times reads t's code.
+        entry->rotation = (4 - k) & 3;
+        for (int i = 0; i < entry->rotation; i++)
+            rcode = rotate90(rcode, family->d);
+
+        entry->rcode = rcode;
+        entry->id = t->id;
+        entry->hamming = hamming;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void quad_decode_task(void *_u)
+{
+    struct quad_decode_task *task = (struct quad_decode_task*) _u;
+    apriltag_detect_context_t *ctx = task->ctx;
+    apriltag_detector_t *td = ctx->td;
+    image_u8_t *im = task->im;
+
+    // working copy of the quad for each family.
+    struct quad quad_storage;
+    struct quad *quad = &quad_storage;
+
+    // what quad_sample_bits found for each family (only filled in for
+    // the first family of each geometry).
+    int nfamilies = zarray_size(ctx->families);
+    uint64_t rcodes[nfamilies];
+    float margins[nfamilies];
+    double goodnesses[nfamilies];
+    uint8_t sampled[nfamilies];
+
+    // when the frame has a deadline, the time at which the previous
+    // quad started, and whether it was refined (or -1 if there is no
+    // previous quad), from which the time quads take in each case is
+    // measured.
+    int64_t utime_last = 0;
+    int last_refined = -1;
+
+    for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
+        // (the other tasks stop early too, see detection_expected.)
+        if (__atomic_load_n(&ctx->complete, __ATOMIC_RELAXED)) {
+            task->nskipped += task->i1 - quadidx;
+            break;
+        }
+
+        // the refinements are the first to go when time is short, and
+        // then the quads themselves.
+        int refine_pose = td->refine_pose, refine_decode = td->refine_decode;
+
+        if (ctx->deadline) {
+            int64_t now = utime_now();
+            quad_decode_timed(ctx, last_refined, utime_last, now);
+            last_refined = -1;
+
+            if (now >= ctx->deadline) {
+                detect_degrade(ctx, APRILTAG_DEGRADED_QUADS);
+                task->nskipped += task->i1 - quadidx;
+                break;
+            }
+
+            // refine this quad only if the quads left after it can
+            // still be decoded, unrefined, in time (by every thread).
+            int nleft = __atomic_sub_fetch(task->nquads_left, 1, __ATOMIC_RELAXED);
+            int64_t refined_utime = __atomic_load_n(&ctx->quad_utime[1], __ATOMIC_RELAXED);
+            int64_t unrefined_utime = __atomic_load_n(&ctx->quad_utime[0], __ATOMIC_RELAXED);
+            if (unrefined_utime == 0)
+                unrefined_utime = refined_utime; // (until it has been measured.)
+
+            if ((refine_pose || refine_decode) &&
+                now + refined_utime + unrefined_utime * nleft / ctx->nthreads > ctx->deadline) {
+                detect_degrade(ctx, APRILTAG_DEGRADED_REFINE);
+                refine_pose = refine_decode = 0;
+            }
+
+            utime_last = now;
+            last_refined = refine_pose || refine_decode;
+        }
+
+        struct quad *quad_original;
+        zarray_get_volatile(task->quads, quadidx, &quad_original);
+
+        // refine edges is not dependent upon the tag family, thus
+        // apply this optimization BEFORE the other work.
+        if (td->refine_edges > 1 || (td->refine_edges && task->decimate > 1)) {
+            refine_edges(td, im, quad_original, task->decimate);
+        }
+
+        // make sure the homographies are computed...
+        if (quad_update_homographies(quad_original))
+            continue;
+
+        // improve the quad corner positions by fitting them to the
+        // edges of the tag. Like refine_edges, this does not depend
+        // upon the tag family.
+        if (refine_pose) {
+            *quad = *quad_original;
+
+            if (refine_corners(im, quad) == 0 && quad_update_homographies(quad) == 0)
+                *quad_original = *quad;
+        }
+
+        // a quad where a tracked tag should be is tried first with the
+        // tracked tag's family, and if it reads as the tracked tag, the
+        // other families are not tried at all.
+        int verify = -1;
+        const struct track *track = track_near(ctx, quad_original, &verify);
+
+        memset(sampled, 0, nfamilies);
+
+        for (int i = 0; i < nfamilies; i++) {
+            int famidx = i;
+            if (verify >= 0)
+                famidx = i == 0 ? verify : i <= verify ? i - 1 : i;
+
+            apriltag_family_t *family;
+            zarray_get(ctx->families, famidx, &family);
+
+            // since the geometry of tag families can vary, start any
+            // optimization process over with the original quad.
+            *quad = *quad_original;
+
+            int g = task->geometry[famidx];
+            if (!sampled[g]) {
+                // (as the first family of the geometry.)
+                apriltag_family_t *gfamily;
+                zarray_get(ctx->families, g, &gfamily);
+
+                sampled[g] = 1;
+                goodnesses[g] = 0;
+
+                // how well does the (refined) quad fit this family's
+                // border?
+                if (refine_pose)
+                    goodnesses[g] = quad_goodness(gfamily, im, quad, td->goodness_samples);
+
+                if (refine_decode) {
+                    // this optimizes decodability, but we don't report
+                    // that value to the user.  (so discard return value.)
+                    // XXX Tunable
+                    float stepsizes[] = { .4 };
+                    int nstepsizes = sizeof(stepsizes)/sizeof(float);
+
+                    optimize_quad_generic(gfamily, im, quad, stepsizes, nstepsizes, score_decodability, td);
+                }
+
+                margins[g] = quad_sample_bits(gfamily, im, quad, td->decode_bilinear,
+                                              td->decode_min_border_contrast, &rcodes[g]);
+            }
+
+            double goodness = goodnesses[g];
+            float decision_margin = margins[g];
+
+            // only the codeword lookup depends on the family's codes.
+            struct quick_decode_entry entry;
+            int verified = famidx == verify && decision_margin >= 0 &&
+                track_verify(track, rcodes[g], &entry);
+
+            if (verified)
+                task->nverified++;
+            else
+                quad_decode_lookup(family, rcodes[g], decision_margin, &entry);
+
+            if (decision_margin < 0)
+                task->nborder_rejected++;
+            else if (entry.hamming == 255)
+                task->ncode_rejected++;
+
+            if (entry.hamming < 255) {
+                apriltag_detection_record_t det_storage;
+                apriltag_detection_record_t *det = &det_storage;
+
+                det->family = family;
+                det->id = entry.id;
+                det->hamming = entry.hamming;
+                det->goodness = goodness;
+                det->decision_margin = decision_margin;
+
+                double theta = -entry.rotation * M_PI / 2.0;
+                double c = cos(theta), s = sin(theta);
+
+                // H = quad->H * R, where R rotates by theta about
+                // the center of the tag.
+                for (int i = 0; i < 3; i++) {
+                    double h0 = quad->H[3*i + 0], h1 = quad->H[3*i + 1];
+
+                    det->H[3*i + 0] = h0*c + h1*s;
+                    det->H[3*i + 1] = -h0*s + h1*c;
+                    det->H[3*i + 2] = quad->H[3*i + 2];
+                }
+
+                detection_project(det, 0, 0, &det->c[0], &det->c[1]);
+
+                // adjust the points in det->p so that they correspond to
+                // counter-clockwise around the quad, starting at -1,-1.
+                for (int i = 0; i < 4; i++) {
+                    int tcx = (i == 0 || i == 3) ? -1 : 1;
+                    int tcy = (i < 2) ? -1 : 1;
+
+                    double p[2];
+
+                    detection_project(det, tcx, tcy, &p[0], &p[1]);
+
+                    det->p[i][0] = p[0];
+                    det->p[i][1] = p[1];
+                }
+
+                detection_expected(ctx, task->ndetections, det);
+
+                // (gathered into detections once every task is done.)
+                apriltag_detection_record_t *results =
+                    apriltag_scratch_buffer(task->results, (task->nresults + 1) * sizeof(*results));
+                results[task->nresults++] = *det;
+
+                if (verified)
+                    break;
+            }
+        }
+    }
+
+    if (ctx->deadline)
+        quad_decode_timed(ctx, last_refined, utime_last, utime_now());
+}
+
+static void decimate_task(void *_u)
+{
+    struct decimate_task *task = (struct decimate_task*) _u;
+
+    image_u8_decimate_rows(task->im, task->factor, task->decim, task->sy0, task->sy1);
+}
+
+// decimate im by factor into decim, splitting the rows between ctx's
+// threads.
+static void decimate_mt(apriltag_detect_context_t *ctx, image_u8_t *im, float factor, image_u8_t *decim)
+{
+    if (ctx->nthreads <= 1) {
+        image_u8_decimate_into(im, factor, decim);
+        return;
+    }
+
+    int sz = decim->height;
+    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+
+    // factor 1.5 produces output rows in pairs.
+    chunksize = (chunksize + 1) & ~1;
+
+    struct decimate_task tasks[sz / chunksize + 1];
+
+    int ntasks = 0;
+    for (int i = 0; i < sz; i += chunksize) {
+        tasks[ntasks].im = im;
+        tasks[ntasks].decim = decim;
+        tasks[ntasks].factor = factor;
+        tasks[ntasks].sy0 = i;
+        tasks[ntasks].sy1 = imin(sz, i + chunksize);
+
+        workerpool_add_task(ctx->wp, decimate_task, &tasks[ntasks]);
+        ntasks++;
+    }
+
+    workerpool_run(ctx->wp);
+}
+
+// The image_u8_color_t of a color format, or -1.
+static int image_color(int format)
+{
+    switch (format) {
+        case APRILTAG_FORMAT_RGB: return IMAGE_U8_COLOR_RGB;
+        case APRILTAG_FORMAT_BGR: return IMAGE_U8_COLOR_BGR;
+        case APRILTAG_FORMAT_RGBA: return IMAGE_U8_COLOR_RGBA;
+        case APRILTAG_FORMAT_BGRA: return IMAGE_U8_COLOR_BGRA;
+    }
+    return -1;
+}
+
+static void luma_task(void *_u)
+{
+    struct luma_task *task = (struct luma_task*) _u;
+
+    if (task->format == APRILTAG_FORMAT_BAYER)
+        image_u8_bayer_luma_rows(task->im, task->luma, task->y0, task->y1);
+    else
+        image_u8_color_gray_rows(task->im->buf, task->im->stride, image_color(task->format),
+                                 task->luma, task->y0, task->y1);
+}
+
+// the luma of im, a bayer mosaic or the pixels of a color frame (of
+// the given format), into luma, splitting the rows between ctx's
+// threads.
+static void luma_mt(apriltag_detect_context_t *ctx, image_u8_t *im, int format, image_u8_t *luma)
+{
+    int sz = im->height;
+    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+
+    struct luma_task tasks[sz / chunksize + 1];
+
+    int ntasks = 0;
+    for (int i = 0; i < sz; i += chunksize) {
+        tasks[ntasks].im = im;
+        tasks[ntasks].luma = luma;
+        tasks[ntasks].format = format;
+        tasks[ntasks].y0 = i;
+        tasks[ntasks].y1 = imin(sz, i + chunksize);
+        ntasks++;
+    }
+
+    if (ctx->nthreads <= 1) {
+        for (int i = 0; i < ntasks; i++)
+            luma_task(&tasks[i]);
+        return;
+    }
+
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(ctx->wp, luma_task, &tasks[i]);
+    workerpool_run(ctx->wp);
+}
+
+static void blur_rows_task(void *_u)
+{
+    struct blur_task *task = (struct blur_task*) _u;
+
+    image_u8_convolve_rows(task->im, task->tmp, task->k, task->ksz, task->y0, task->y1);
+}
+
+static void blur_cols_task(void *_u)
+{
+    struct blur_task *task = (struct blur_task*) _u;
+
+    image_u8_convolve_cols(task->tmp, task->im, task->k, task->ksz, task->sharpen,
+                           task->y0, task->y1);
+}
+
+// gaussian blur (or unsharp mask) im in place, splitting the rows
+// between ctx's threads. Equivalent to image_u8_gaussian_blur (plus
+// 2*orig - blur when sharpening).
+static void blur_mt(apriltag_detect_context_t *ctx, image_u8_t *im, float sigma, int ksz, int sharpen)
+{
+    uint8_t k[ksz];
+    image_u8_gaussian_kernel(sigma, ksz, k);
+
+    image_u8_t *tmp = apriltag_scratch_image(&ctx->scratch->blur, im->width, im->height);
+
+    int sz = im->height;
+    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+    struct blur_task tasks[sz / chunksize + 1];
+
+    int ntasks = 0;
+    for (int i = 0; i < sz; i += chunksize) {
+        tasks[ntasks].im = im;
+        tasks[ntasks].tmp = tmp;
+        tasks[ntasks].k = k;
+        tasks[ntasks].ksz = ksz;
+        tasks[ntasks].sharpen = sharpen;
+        tasks[ntasks].y0 = i;
+        tasks[ntasks].y1 = imin(sz, i + chunksize);
+        ntasks++;
+    }
+
+    // the vertical pass reads neighboring rows of tmp, so the
+    // horizontal pass must be complete first.
+    if (ctx->nthreads <= 1) {
+        for (int i = 0; i < ntasks; i++)
+            blur_rows_task(&tasks[i]);
+        for (int i = 0; i < ntasks; i++)
+            blur_cols_task(&tasks[i]);
+    } else {
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, blur_rows_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, blur_cols_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+    }
+}
+
+void apriltag_detection_destroy(apriltag_detection_t *det)
+{
+    if (det == NULL)
+        return;
+
+    matd_destroy(det->H);
+    free(det);
+}
+
+// Prepare ctx for a new frame of td. Returns zero if no tag families
+// are enabled.
+static int detect_init(apriltag_detector_t *td, apriltag_detect_context_t *ctx)
+{
+    ctx->td = td;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->whole_frame = 1;
+    ctx->capture = NULL;
+    detection_expected_reset(ctx);
+
+    detect_families_begin(td, ctx);
+
+    if (zarray_size(ctx->families) == 0) {
+        detect_families_end(ctx);
+        printf("apriltag.c: No tag families enabled.");
+        return 0;
+    }
+
+    for (int i = 0; i < zarray_size(ctx->families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(ctx->families, i, &fam);
+        quick_decode_prepare(fam);
+    }
+
+    if (td->wp) {
+        if (ctx->wp_owned)
+            workerpool_destroy(ctx->wp);
+        ctx->wp = td->wp;
+        ctx->wp_owned = 0;
+    } else if (!ctx->wp_owned) {
+        ctx->wp = workerpool_create(td->nthreads);
+        ctx->wp_owned = 1;
+    } else if (td->nthreads != workerpool_get_nthreads(ctx->wp)) {
+        // (parks or unparks threads, rather than starting over.)
+        workerpool_set_nthreads(ctx->wp, td->nthreads);
+    }
+
+    // the work is divided up for the pool's threads.
+    ctx->nthreads = workerpool_get_nthreads(ctx->wp);
+
+    // (the blur is given at td->quad_decimate.)
+    ctx->decimate = td->quad_decimate;
+    ctx->sigma = td->quad_sigma;
+    if (td->auto_decimate > td->quad_decimate && ctx->auto_decimate > 0) {
+        ctx->decimate = ctx->auto_decimate;
+        ctx->sigma = td->quad_sigma * fmaxf(td->quad_decimate, 1) / ctx->auto_decimate;
+    }
+    ctx->stats.decimate = ctx->decimate > 1 ? ctx->decimate : 1;
+
+    timeprofile_clear(ctx->tp);
+    trace_mark_reset();
+
+    if (td->perf_counters) {
+        ctx->stats.perf_counted = perfcount_read(ctx->perf_last) == 0;
+        memset(ctx->perf_sink, 0, sizeof(ctx->perf_sink));
+        perfcount_sink_set(ctx->stats.perf_counted ? ctx->perf_sink : NULL);
+    }
+    ctx->deadline = td->budget_utime > 0 ? ctx->tp->utime + td->budget_utime : 0;
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_INIT, "init");
+
+    return 1;
+}
+
+void apriltag_detect_context_stamp(apriltag_detect_context_t *ctx, int stage, const char *name)
+{
+    timeprofile_t *tp = ctx->tp;
+
+    int64_t last = tp->utime;
+    if (zarray_size(tp->stamps) > 0) {
+        struct timeprofile_entry *e;
+        zarray_get_volatile(tp->stamps, zarray_size(tp->stamps) - 1, &e);
+        last = e->utime;
+    }
+
+    timeprofile_stamp(tp, name);
+    trace_mark(name);
+
+    if (ctx->stats.perf_counted) {
+        uint64_t now[PERFCOUNT_N];
+        perfcount_read(now);
+
+        for (int i = 0; i < PERFCOUNT_N; i++) {
+            uint64_t tasks = __atomic_exchange_n(&ctx->perf_sink[i], 0, __ATOMIC_RELAXED);
+            ctx->stats.stage_counts[stage][i] += now[i] - ctx->perf_last[i] + tasks;
+            ctx->perf_last[i] = now[i];
+        }
+    }
+
+    struct timeprofile_entry *e;
+    zarray_get_volatile(tp->stamps, zarray_size(tp->stamps) - 1, &e);
+    ctx->stats.stage_utime[stage] += e->utime - last;
+}
+
+// Complete the statistics of a frame, whose detections are those of
+// detections, and add the frame to the history.
+static void detect_finish(apriltag_detect_context_t *ctx, const zarray_t *detections)
+{
+    apriltag_stats_t *stats = &ctx->stats;
+    int window = ctx->td->stats_window;
+
+    stats->ndetections = zarray_size(detections);
+
+    // (the pool's tasks after this aren't the detection's.)
+    if (stats->perf_counted)
+        perfcount_sink_set(NULL);
+
+    stats->utime = 0;
+    for (int i = 0; i < APRILTAG_NSTAGES; i++)
+        stats->utime += stats->stage_utime[i];
+
+    if (ctx->capture) {
+        apriltag_capture_end(ctx->td->capture, ctx->capture, detections, stats);
+        ctx->capture = NULL;
+    }
+
+    detect_families_end(ctx);
+
+    if (window <= 0)
+        return;
+
+    const int rowsz = APRILTAG_NSTAGES + 1;
+
+    if (window != ctx->history_alloc) {
+        // the history is started again when the window changes.
+        ctx->history = realloc(ctx->history, (size_t) window * rowsz * sizeof(int64_t));
+        ctx->history_alloc = window;
+        ctx->nhistory = 0;
+        ctx->history_next = 0;
+    }
+
+    int64_t *row = &ctx->history[ctx->history_next * rowsz];
+    memcpy(row, stats->stage_utime, sizeof(stats->stage_utime));
+    row[APRILTAG_NSTAGES] = stats->utime;
+
+    ctx->history_next = (ctx->history_next + 1) % window;
+    ctx->nhistory = imin(ctx->nhistory + 1, window);
+}
+
+static int int64_compare(const void *_a, const void *_b)
+{
+    int64_t a = *(const int64_t*) _a, b = *(const int64_t*) _b;
+
+    return (a > b) - (a < b);
+}
+
+int64_t apriltag_detect_context_percentile_utime(const apriltag_detect_context_t *ctx,
+                                                 int stage, double p)
+{
+    int n = ctx->nhistory;
+    if (n == 0 || stage < 0 || stage > APRILTAG_NSTAGES)
+        return -1;
+
+    // the order of the rows doesn't matter.
+    int64_t v[n];
+    for (int i = 0; i < n; i++)
+        v[i] = ctx->history[i * (APRILTAG_NSTAGES + 1) + stage];
+
+    qsort(v, n, sizeof(int64_t), int64_compare);
+
+    // nearest rank
+    int rank = (int) ceil(p / 100 * n);
+    return v[iclamp(rank - 1, 0, n - 1)];
+}
+
+int64_t apriltag_detector_percentile_utime(const apriltag_detector_t *td, int stage, double p)
+{
+    return apriltag_detect_context_percentile_utime(td->ctx, stage, p);
+}
+
+const apriltag_stats_t *apriltag_detect_context_stats(const apriltag_detect_context_t *ctx)
+{
+    return &ctx->stats;
+}
+
+const apriltag_stats_t *apriltag_detector_stats(const apriltag_detector_t *td)
+{
+    return &td->ctx->stats;
+}
+
+const char *apriltag_stage_name(int stage)
+{
+    static const char *names[APRILTAG_NSTAGES] = {
+        [APRILTAG_STAGE_INIT] = "init",
+        [APRILTAG_STAGE_PREPROCESS] = "preprocess",
+        [APRILTAG_STAGE_THRESHOLD] = "threshold",
+        [APRILTAG_STAGE_SEGMENT] = "segment",
+        [APRILTAG_STAGE_CLUSTER] = "cluster",
+        [APRILTAG_STAGE_QUAD_FIT] = "quad fit",
+        [APRILTAG_STAGE_DECODE] = "decode",
+        [APRILTAG_STAGE_RECONCILE] = "reconcile",
+        [APRILTAG_STAGE_OTHER] = "other",
+    };
+
+    if (stage < 0 || stage >= APRILTAG_NSTAGES)
+        return NULL;
+
+    return names[stage];
+}
+
+const char *apriltag_memory_name(int category)
+{
+    static const char *names[APRILTAG_NMEMORY] = {
+        [APRILTAG_MEMORY_DECODE_TABLES] = "decode tables",
+        [APRILTAG_MEMORY_IMAGES] = "images",
+        [APRILTAG_MEMORY_UNIONFIND] = "unionfind",
+        [APRILTAG_MEMORY_BUFFERS] = "buffers",
+        [APRILTAG_MEMORY_WORKERPOOL] = "workerpool",
+    };
 
-    // how wide do we assume the white border is?
-    float white_border = 1.0;
+    if (category < 0 || category >= APRILTAG_NMEMORY)
+        return NULL;
 
-    // We will compute a threshold by sampling known white/black cells around this tag.
-    // This sampling is achieved by considering a set of samples along lines.
-    //
-    // coordinates are given in bit coordinates. ([0, fam->d]).
+    return names[category];
+}
+
+void apriltag_detect_context_memory(const apriltag_detector_t *td, const apriltag_detect_context_t *ctx,
+                                    memstat_t mem[APRILTAG_NMEMORY])
+{
+    for (int i = 0; i < APRILTAG_NMEMORY; i++) {
+        mem[i].bytes = __atomic_load_n(&ctx->memory[i].bytes, __ATOMIC_RELAXED);
+        mem[i].peak = __atomic_load_n(&ctx->memory[i].peak, __ATOMIC_RELAXED);
+    }
+
+    int64_t tables = 0;
+
+    pthread_mutex_lock(&quick_decode_mutex);
+    for (int i = 0; i < zarray_size(td->tag_families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(td->tag_families, i, &fam);
+
+        const struct quick_decode *qd = fam->impl;
+        if (!qd || !qd->table)
+            continue;
+
+        const struct quick_decode_table *qt = qd->table;
+        tables += sizeof(*qt) + qt->nids * sizeof(int) +
+            (qt->mask + 1) * (sizeof(uint64_t) + sizeof(struct quick_decode_value));
+    }
+    pthread_mutex_unlock(&quick_decode_mutex);
+
+    mem[APRILTAG_MEMORY_DECODE_TABLES].bytes = mem[APRILTAG_MEMORY_DECODE_TABLES].peak = tables;
+
+    // (td's pool, or ctx's own once it has one.)
+    workerpool_t *wp = td->wp ? td->wp : ctx->wp_owned ? ctx->wp : NULL;
+    int64_t pool = wp ? workerpool_get_memory(wp) : 0;
+    mem[APRILTAG_MEMORY_WORKERPOOL].bytes = mem[APRILTAG_MEMORY_WORKERPOOL].peak = pool;
+}
+
+void apriltag_detector_memory(const apriltag_detector_t *td, memstat_t mem[APRILTAG_NMEMORY])
+{
+    apriltag_detect_context_memory(td, td->ctx, mem);
+}
+
+const char *apriltag_reject_name(int reject)
+{
+    static const char *names[APRILTAG_NREJECTS] = {
+        [APRILTAG_REJECT_CLUSTER_PIXELS] = "cluster pixels",
+        [APRILTAG_REJECT_CLUSTER_SIZE] = "cluster size",
+        [APRILTAG_REJECT_CORNERS] = "corners",
+        [APRILTAG_REJECT_LINE_FIT] = "line fit",
+        [APRILTAG_REJECT_SHAPE] = "shape",
+        [APRILTAG_REJECT_BORDER] = "border",
+        [APRILTAG_REJECT_CODE] = "code",
+    };
+
+    if (reject < 0 || reject >= APRILTAG_NREJECTS)
+        return NULL;
+
+    return names[reject];
+}
+
+// Segment im_orig, decimated by decimate and blurred with the ksz
+// taps of sigma (sharpened when negative), on the GPU (see td->gpu),
+// into frame. Returns the (decimated, blurred) image the quads are to
+// be fit in, or NULL if the frame is to be segmented on the CPU.
+static image_u8_t *segment_gpu(apriltag_detect_context_t *ctx, image_u8_t *im_orig, float decimate,
+                               float sigma, int ksz, apriltag_gpu_frame_t *frame)
+{
+    apriltag_detector_t *td = ctx->td;
+    int factor = decimate > 1 ? (int) decimate : 1;
+
+    // the bayer mosaic is thresholded by element, on the CPU (see
+    // apriltag_quad_thresh).
+    if (!td->gpu || ctx->gpu_failed || td->quad_contours || td->quad_gradient ||
+        (decimate > 1 && factor != decimate) ||
+        (ctx->bayer && factor == 1 && im_orig == &ctx->scratch->luma.im))
+        return NULL;
+
+    if (ctx->gpu == NULL) {
+        ctx->gpu = apriltag_gpu_create();
+        if (ctx->gpu == NULL) {
+            ctx->gpu_failed = 1;
+            return NULL;
+        }
+    }
+
+    uint8_t k[ksz > 1 ? ksz : 1];
+    if (ksz > 1)
+        image_u8_gaussian_kernel(fabsf(sigma), ksz, k);
+
+    if (apriltag_gpu_segment(ctx->gpu, im_orig, factor, k, ksz, sigma < 0, &td->qtp, frame)) {
+        ctx->gpu_failed = 1;
+        return NULL;
+    }
+
+    // the image is blurred in place when it isn't decimated, and the
+    // tags are then decoded from it.
+    if (factor == 1 && ksz > 1) {
+        for (int y = 0; y < im_orig->height; y++)
+            memcpy(&im_orig->buf[y*im_orig->stride], &frame->im->buf[y*frame->im->stride], im_orig->width);
+    }
+
+    ctx->stats.gpu = 1;
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_SEGMENT, "gpu segment");
+
+    return frame->im;
+}
+
+// Find the quads in im_orig, decimated by decimate, in the
+// coordinates of im_orig. (im_orig may be blurred in place.) The quads
+// belong to ctx->scratch.
+static zarray_t *detect_quads(apriltag_detect_context_t *ctx, image_u8_t *im_orig, float decimate)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    // compute a reasonable kernel width by figuring that the
+    // kernel should go out 2 std devs.
     //
-    // { initial x, initial y, delta x, delta y, WHITE=1 }
-    float patterns[] = {
-        // left white column
-        0 - white_border / 2.0, 0.5,
-        0, 1,
-        1,
+    // max sigma          ksz
+    // 0.499              1  (disabled)
+    // 0.999              3
+    // 1.499              5
+    // 1.999              7
+    float sigma = fabsf(ctx->sigma);
 
-        // left black column
-        0 + family->black_border / 2.0, 0.5,
-        0, 1,
-        0,
+    int ksz = 4 * sigma; // 2 std devs in each direction
+    if ((ksz & 1) == 0)
+        ksz++;
 
-        // right white column
-        2*family->black_border + family->d + white_border / 2.0, .5,
-        0, 1,
-        1,
+    ///////////////////////////////////////////////////////////
+    // Step 1. Detect quads according to requested image decimation
+    // and blurring parameters.
+    apriltag_gpu_frame_t gpu_frame;
+    image_u8_t *quad_im = segment_gpu(ctx, im_orig, decimate, ctx->sigma, ksz, &gpu_frame);
 
-        // right black column
-        2*family->black_border + family->d - family->black_border / 2.0, .5,
-        0, 1,
-        0,
+    if (quad_im) {
+        ctx->gpu_frame = &gpu_frame;
+    } else {
+        quad_im = im_orig;
+        if (decimate > 1) {
+            int swidth, sheight;
+            image_u8_decimate_dims(im_orig, decimate, &swidth, &sheight);
 
-        // top white row
-        0.5, -white_border / 2.0,
-        1, 0,
-        1,
+            quad_im = apriltag_scratch_image(&ctx->scratch->decimate, swidth, sheight);
+            decimate_mt(ctx, im_orig, decimate, quad_im);
 
-        // top black row
-        0.5, family->black_border / 2.0,
-        1, 0,
-        1,
+            apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_PREPROCESS, "decimate");
+        }
+
+        if (ksz > 1) {
+            // Apply a blur, or SHARPEN the image by subtracting the
+            // low frequency components.
+            blur_mt(ctx, quad_im, sigma, ksz, ctx->sigma < 0);
+        }
+
+        apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_PREPROCESS, "blur/sharp");
+    }
+
+    if (td->debug)
+        image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+
+    zarray_t* quads = 0;
+
+    if (td->quad_contours) {
+      quads = apriltag_quad_contour(ctx, quad_im, decimate);
+    } else if (td->quad_gradient) {
+      quads = apriltag_quad_gradient(ctx, quad_im, decimate);
+    } else {
+      quads = apriltag_quad_thresh(ctx, quad_im, decimate);
+    }
+
+    ctx->gpu_frame = NULL;
+
+    // adjust centers of pixels so that they correspond to the
+    // original full-resolution image.
+    if (decimate > 1) {
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *q;
+            zarray_get_volatile(quads, i, &q);
+
+            for (int i = 0; i < 4; i++) {
+                q->p[i][0] *= decimate;
+                q->p[i][1] *= decimate;
+            }
+        }
+    }
+
+    return quads;
+}
+
+// a detection, and its bounding box, while detections are reconciled.
+struct reconcile_det
+{
+    apriltag_detection_record_t *det;
+    int idx; // in the detections array
+    int convex, removed;
+    double xmin, xmax, ymin, ymax;
+};
+
+static int reconcile_det_compare(const void *_a, const void *_b)
+{
+    const struct reconcile_det *a = _a, *b = _b;
+
+    if (a->det->family != b->det->family)
+        return (uintptr_t) a->det->family < (uintptr_t) b->det->family ? -1 : 1;
+    if (a->det->id != b->det->id)
+        return a->det->id - b->det->id;
+    return a->idx - b->idx;
+}
+
+static int reconcile_dets_overlap(const struct reconcile_det *a, const struct reconcile_det *b)
+{
+    if (a->xmax < b->xmin || b->xmax < a->xmin || a->ymax < b->ymin || b->ymax < a->ymin)
+        return 0;
+
+    if (a->convex && b->convex)
+        return g2d_convex_quad_overlaps_quad(a->det->p, b->det->p);
+
+    // (a degenerate quad)
+    zarray_t *poly0 = g2d_polygon_create_zeros(4);
+    zarray_t *poly1 = g2d_polygon_create_zeros(4);
+
+    for (int k = 0; k < 4; k++) {
+        zarray_set(poly0, k, a->det->p[k], NULL);
+        zarray_set(poly1, k, b->det->p[k], NULL);
+    }
+
+    int overlaps = g2d_polygon_overlaps_polygon(poly0, poly1);
+
+    zarray_destroy(poly0);
+    zarray_destroy(poly1);
+
+    return overlaps;
+}
+
+// Don't report the same tag more than once. (Allow non-overlapping
+// duplicate detections.)
+//
+// Of every set of overlapping detections of the same tag, keep only
+// the best (fewest errors, then most goodness).
+//
+// Only detections of the same tag can conflict, so they are grouped by
+// family and id (by sorting), and only the detections within a group
+// whose bounding boxes intersect are tested for overlap. Within a
+// group, the detections are compared in the order in which they were
+// found, and of two equally good detections the later one is kept.
+//
+// Only the detections from index i0 on are reconciled.
+static void reconcile_detections(zarray_t *detections, int i0)
+{
+    int n = zarray_size(detections) - i0;
+    if (n < 2)
+        return;
+
+    apriltag_detection_record_t *ds = (apriltag_detection_record_t*) detections->data + i0;
+    struct reconcile_det *dets = malloc(n * sizeof(struct reconcile_det));
+
+    for (int i = 0; i < n; i++) {
+        struct reconcile_det *rd = &dets[i];
+        rd->det = &ds[i];
+
+        rd->idx = i;
+        rd->removed = 0;
+        rd->convex = g2d_quad_is_convex(rd->det->p);
+        rd->xmin = rd->xmax = rd->det->p[0][0];
+        rd->ymin = rd->ymax = rd->det->p[0][1];
+        for (int k = 1; k < 4; k++) {
+            rd->xmin = fmin(rd->xmin, rd->det->p[k][0]);
+            rd->xmax = fmax(rd->xmax, rd->det->p[k][0]);
+            rd->ymin = fmin(rd->ymin, rd->det->p[k][1]);
+            rd->ymax = fmax(rd->ymax, rd->det->p[k][1]);
+        }
+    }
+
+    qsort(dets, n, sizeof(struct reconcile_det), reconcile_det_compare);
+
+    int nremoved = 0;
+
+    for (int g0 = 0, g1; g0 < n; g0 = g1) {
+        // the group of detections of the same tag
+        for (g1 = g0 + 1; g1 < n && dets[g1].det->family == dets[g0].det->family &&
+                 dets[g1].det->id == dets[g0].det->id; g1++)
+            ;
+
+        for (int i0 = g0; i0 < g1; i0++) {
+            struct reconcile_det *rd0 = &dets[i0];
+            if (rd0->removed)
+                continue;
+
+            for (int i1 = i0 + 1; i1 < g1; i1++) {
+                struct reconcile_det *rd1 = &dets[i1];
+                if (rd1->removed || !reconcile_dets_overlap(rd0, rd1))
+                    continue;
+
+                // the tags overlap. Delete one, keep the other.
+                apriltag_detection_record_t *det0 = rd0->det, *det1 = rd1->det;
+
+                nremoved++;
+                if (det0->hamming < det1->hamming ||
+                    (det0->hamming == det1->hamming && det0->goodness > det1->goodness)) {
+                    // keep det0, destroy det1
+                    rd1->removed = 1;
+                } else {
+                    // keep det1, destroy det0
+                    rd0->removed = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (nremoved > 0) {
+        // remove the losers, keeping the survivors in their order.
+        uint8_t removed[n];
+        for (int i = 0; i < n; i++)
+            removed[dets[i].idx] = dets[i].removed;
+
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (!removed[i])
+                ds[m++] = ds[i];
+        }
+        zarray_truncate(detections, i0 + m);
+    }
+
+    free(dets);
+}
+
+static double quad_area(const struct quad *q)
+{
+    // (the shoelace formula.)
+    double a = 0;
+    for (int i = 0; i < 4; i++) {
+        const float *p0 = q->p[i], *p1 = q->p[(i + 1) & 3];
+        a += p0[0]*p1[1] - p1[0]*p0[1];
+    }
+
+    return fabs(a) / 2;
+}
+
+static int quad_area_compare_descending(const void *_a, const void *_b)
+{
+    double a = quad_area((const struct quad*) _a), b = quad_area((const struct quad*) _b);
+
+    return (a < b) - (a > b);
+}
+
+// (roughly) how long a quad takes to decode: refine_edges and
+// refine_corners work along its edges, and the bits are sampled in a
+// fixed time.
+static uint32_t quad_decode_cost(const struct quad *q)
+{
+    double perimeter = 0;
+    for (int i = 0; i < 4; i++) {
+        const float *p0 = q->p[i], *p1 = q->p[(i + 1) & 3];
+        perimeter += hypot(p1[0] - p0[0], p1[1] - p0[1]);
+    }
+
+    return 64 + (uint32_t) perimeter;
+}
+
+// Decode the quads found in im_orig (at the given decimation), and
+// append the detections (apriltag_detection_record_t) to detections.
+static void decode_quads(apriltag_detect_context_t *ctx, image_u8_t *im_orig, zarray_t *quads,
+                         float decimate, zarray_t *detections)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    // the first of this call's detections
+    int det0 = zarray_size(detections);
+
+    ctx->stats.nquads += zarray_size(quads);
+
+    if (ctx->capture) {
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *q;
+            zarray_get_volatile(quads, i, &q);
+
+            struct apriltag_capture_quad cq;
+            memcpy(cq.p, q->p, sizeof(cq.p));
+            zarray_add(ctx->capture->quads, &cq);
+        }
+    }
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_QUAD_FIT, "quads");
+
+    if (td->debug) {
+        image_u8_t *im_quads = image_u8_copy(im_orig);
+        image_u8_darken(im_quads);
+        image_u8_darken(im_quads);
+
+        srandom(0);
+
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *quad;
+            zarray_get_volatile(quads, i, &quad);
+
+            const int bias = 100;
+            int color = bias + (random() % (255-bias));
+
+            image_u8_draw_line(im_quads, quad->p[0][0], quad->p[0][1], quad->p[1][0], quad->p[1][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[1][0], quad->p[1][1], quad->p[2][0], quad->p[2][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[2][0], quad->p[2][1], quad->p[3][0], quad->p[3][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[3][0], quad->p[3][1], quad->p[0][0], quad->p[0][1], color, 1);
+        }
+
+        image_u8_write_pnm(im_quads, "debug_quads_raw.pnm");
+        image_u8_destroy(im_quads);
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // Step 2. Decode tags from each quad.
+    if (1) {
+        image_u8_t *im_gray_samples = td->debug ? image_u8_copy(im_orig) : NULL;
+
+        // im_decision debugging output is slow.
+        image_u8_t *im_decision = td->debug ? image_u8_copy(im_orig) : NULL;
+
+        // families with the same geometry (d and black_border) see the
+        // same bits in a quad, so the bits are sampled (and the
+        // threshold computed) once per geometry. Not when refine_decode
+        // is enabled, since that moves the corners to suit each
+        // family's codes.
+        int nfamilies = zarray_size(ctx->families);
+        int geometry[nfamilies];
+
+        for (int i = 0; i < nfamilies; i++) {
+            apriltag_family_t *fi;
+            zarray_get(ctx->families, i, &fi);
+
+            geometry[i] = i;
+
+            for (int j = 0; j < i && !td->refine_decode; j++) {
+                apriltag_family_t *fj;
+                zarray_get(ctx->families, j, &fj);
+
+                if (fj->d == fi->d && fj->black_border == fi->black_border) {
+                    geometry[i] = j;
+                    break;
+                }
+            }
+        }
+
+        // the largest quads go first: they take the longest, and when
+        // tags are expected, or time is limited, they are the likeliest
+        // to be tags, so that the rest can be skipped.
+        zarray_sort(quads, quad_area_compare_descending);
+
+        int nquads = zarray_size(quads);
+        int nquads_left = nquads;
+
+        // the quads are divided among the tasks by their cost, so that
+        // no task is left with many large quads.
+        uint32_t *costs = apriltag_scratch_buffer(&ctx->scratch->decode_costs, (nquads + 1) * sizeof(uint32_t));
+        for (int i = 0; i < nquads; i++) {
+            struct quad *q;
+            zarray_get_volatile(quads, i, &q);
+            costs[i] = quad_decode_cost(q);
+        }
+
+        int maxtasks = APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads + 1;
+        int first[maxtasks + 1], order[maxtasks];
+        int ntasks = workerpool_cost_chunks(ctx->nthreads, costs, nquads, APRILTAG_TASKS_PER_THREAD_TARGET,
+                                            first, order);
+
+        struct quad_decode_task tasks[maxtasks];
+
+        // each task keeps its own detections, so that the tasks need
+        // not take turns to add them.
+        apriltag_scratch_buffer_t *results = apriltag_scratch_buffers(&ctx->scratch->decode_results, maxtasks);
+        int ndetections = zarray_size(detections);
+
+        for (int i = 0; i < ntasks; i++) {
+            tasks[i].i0 = first[i];
+            tasks[i].i1 = first[i + 1];
+            tasks[i].quads = quads;
+            tasks[i].decimate = decimate;
+            tasks[i].ctx = ctx;
+            tasks[i].im = im_orig;
+            tasks[i].results = &results[i];
+            tasks[i].nresults = 0;
+            tasks[i].ndetections = &ndetections;
+
+            tasks[i].im_gray_samples = im_gray_samples;
+            tasks[i].im_decision = im_decision;
+            tasks[i].geometry = geometry;
+            tasks[i].nquads_left = &nquads_left;
+            tasks[i].nborder_rejected = 0;
+            tasks[i].ncode_rejected = 0;
+            tasks[i].nskipped = 0;
+            tasks[i].nverified = 0;
+        }
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, quad_decode_task, &tasks[order[i]]);
+
+        workerpool_run(ctx->wp);
+
+        // (in the order of the quads, whichever thread decoded them.)
+        for (int i = 0; i < ntasks; i++) {
+            const apriltag_detection_record_t *dets = tasks[i].results->buf;
+            for (int j = 0; j < tasks[i].nresults; j++)
+                zarray_add(detections, &dets[j]);
+
+            ctx->stats.nborder_rejected += tasks[i].nborder_rejected;
+            ctx->stats.ncode_rejected += tasks[i].ncode_rejected;
+            ctx->stats.nrejected[APRILTAG_REJECT_BORDER] += tasks[i].nborder_rejected;
+            ctx->stats.nrejected[APRILTAG_REJECT_CODE] += tasks[i].ncode_rejected;
+            ctx->stats.nquads_skipped += tasks[i].nskipped;
+            ctx->stats.nverified += tasks[i].nverified;
+        }
+
+        if (im_gray_samples != NULL) {
+            image_u8_write_pnm(im_gray_samples, "debug_gray_samples.pnm");
+            image_u8_destroy(im_gray_samples);
+        }
+
+        if (im_decision != NULL) {
+            image_u8_write_pnm(im_decision, "debug_decision.pnm");
+            image_u8_destroy(im_decision);
+        }
+    }
+
+    if (td->debug) {
+        image_u8_t *im_quads = image_u8_copy(im_orig);
+        image_u8_darken(im_quads);
+        image_u8_darken(im_quads);
+
+        srandom(0);
+
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *quad;
+            zarray_get_volatile(quads, i, &quad);
+
+            const int bias = 100;
+            int color = bias + (random() % (255-bias));
+
+            image_u8_draw_line(im_quads, quad->p[0][0], quad->p[0][1], quad->p[1][0], quad->p[1][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[1][0], quad->p[1][1], quad->p[2][0], quad->p[2][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[2][0], quad->p[2][1], quad->p[3][0], quad->p[3][1], color, 1);
+            image_u8_draw_line(im_quads, quad->p[3][0], quad->p[3][1], quad->p[0][0], quad->p[0][1], color, 1);
 
-        // bottom white row
-        0.5, 2*family->black_border + family->d + white_border / 2.0,
-        1, 0,
-        1,
+        }
 
-        // bottom black row
-        0.5, 2*family->black_border + family->d - family->black_border / 2.0,
-        1, 0,
-        0
+        image_u8_write_pnm(im_quads, "debug_quads_fixed.pnm");
+        image_u8_destroy(im_quads);
+    }
 
-        // XXX double-counts the corners.
-    };
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_DECODE, "decode+refinement");
 
-    float sums[2] = { 0, 0 };
-    float counts[2] = { 0, 0 };
+    ////////////////////////////////////////////////////////////////
+    // Step 3. Reconcile detections--- don't report the same tag more
+    // than once. (Allow non-overlapping duplicate detections.)
+    int ndecoded = zarray_size(detections);
+    reconcile_detections(detections, det0);
+    ctx->stats.nreconcile_rejected += ndecoded - zarray_size(detections);
 
-    for (int pattern_idx = 0; pattern_idx < sizeof(patterns)/(5*sizeof(float)); pattern_idx ++) {
-        float *pattern = &patterns[pattern_idx * 5];
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_RECONCILE, "reconcile");
 
-        int sumidx = pattern[4];
+    ////////////////////////////////////////////////////////////////
+    // Produce final debug output
+    if (td->debug) {
 
-        for (int i = 0; i < 2*family->black_border + family->d; i++) {
-            double tagx01 = (pattern[0] + i*pattern[2]) / (2*family->black_border + family->d);
-            double tagy01 = (pattern[1] + i*pattern[3]) / (2*family->black_border + family->d);
+        image_u8_t *darker = image_u8_copy(im_orig);
+        image_u8_darken(darker);
+        image_u8_darken(darker);
 
-            double tagx = 2*(tagx01-0.5);
-            double tagy = 2*(tagy01-0.5);
+        // assume letter, which is 612x792 points.
+        FILE *f = fopen("debug_output.ps", "w");
+        fprintf(f, "%%!PS\n\n");
+        double scale = fmin(612.0/darker->width, 792.0/darker->height);
+        fprintf(f, "%f %f scale\n", scale, scale);
+        fprintf(f, "0 %d translate\n", darker->height);
+        fprintf(f, "1 -1 scale\n");
+        postscript_image(f, darker);
 
-            double px, py;
-            homography_project(quad->H, tagx, tagy, &px, &py);
+        image_u32_t *out = image_u32_create_from_u8(darker);
+        for (int detidx = det0; detidx < zarray_size(detections); detidx++) {
+            apriltag_detection_record_t *det;
+            zarray_get_volatile(detections, detidx, &det);
 
-            // don't round
-            int ix = px;
-            int iy = py;
-            if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
+            if (det->hamming > 3)
                 continue;
 
-            int v = im->buf[iy*im->stride + ix];
+            // d |----| c
+            //   |    |
+            //   |    |
+            // a |----| b
 
-            sums[sumidx] += v;
-            counts[sumidx] ++;
+            double a[2], b[2], c[2], d[2];
+
+            detection_project(det, -1, -1, &a[0], &a[1]);
+            detection_project(det,  1, -1, &b[0], &b[1]);
+            detection_project(det,  1,  1, &c[0], &c[1]);
+            detection_project(det, -1,  1, &d[0], &d[1]);
+
+            float scale = ((float[]) {1.0, 0.6, 0.3, 0.1 })[det->hamming];
+
+            image_u32_draw_line(out, a[0], a[1], b[0], b[1], rgb_scale(0xff0000, scale), 3);
+            image_u32_draw_line(out, a[0], a[1], d[0], d[1], rgb_scale(0x00ff00, scale), 3);
+            image_u32_draw_line(out, b[0], b[1], c[0], c[1], rgb_scale(0xff88ff, scale), 3);
+            image_u32_draw_line(out, d[0], d[1], c[0], c[1], rgb_scale(0x88ffff, scale), 3);
+
+            fprintf(f, "1 0 0 setrgbcolor %f %f moveto %f %f lineto stroke\n", a[0], a[1], b[0], b[1]);
+            fprintf(f, "0 1 0 setrgbcolor %f %f moveto %f %f lineto stroke\n", a[0], a[1], d[0], d[1]);
+            fprintf(f, "1 .5 1 setrgbcolor %f %f moveto %f %f lineto stroke\n", b[0], b[1], c[0], c[1]);
+            fprintf(f, ".5 1 1 setrgbcolor %f %f moveto %f %f lineto stroke\n", d[0], d[1], c[0], c[1]);
         }
-    }
 
-    float thresh = ((sums[0] / counts[0]) + (sums[1] / counts[1])) / 2.0;
+        image_u32_write_pnm(out, "debug_output.pnm");
 
-    // compute the average decision margin (how far was each bit from
-    // the decision boundary?
-    float score = 0;
-    float score_count = 0;
+        image_u8_destroy(darker);
+        image_u32_destroy(out);
 
-    for (int bitidx = 0; bitidx < family->d * family->d; bitidx++) {
-        int bitx = bitidx % family->d;
-        int bity = bitidx / family->d;
+        fclose(f);
+    }
 
-        double tagx01 = (family->black_border + bitx + 0.5) / (2*family->black_border + family->d);
-        double tagy01 = (family->black_border + bity + 0.5) / (2*family->black_border + family->d);
+    // deallocate
+    if (td->debug) {
+        FILE *f = fopen("debug_quads.ps", "w");
+        fprintf(f, "%%!PS\n\n");
 
-        // scale to [-1, 1]
-        double tagx = 2*(tagx01-0.5);
-        double tagy = 2*(tagy01-0.5);
+        image_u8_t *im = image_u8_copy(im_orig);
+        image_u8_darken(im);
+        image_u8_darken(im);
 
-        double px, py;
-        homography_project(quad->H, tagx, tagy, &px, &py);
+        // assume letter, which is 612x792 points.
+        double scale = fmin(612.0/im->width, 792.0/im->height);
+        fprintf(f, "%f %f scale\n", scale, scale);
+        fprintf(f, "0 %d translate\n", im->height);
+        fprintf(f, "1 -1 scale\n");
 
-        rcode = (rcode << 1);
+        postscript_image(f, im);
 
-        // don't round.
-        int ix = px;
-        int iy = py;
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *q;
+            zarray_get_volatile(quads, i, &q);
 
-        if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
-            continue;
+            float rgb[3];
+            int bias = 100;
 
-        int v = im->buf[iy*im->stride + ix];
+            for (int i = 0; i < 3; i++)
+                rgb[i] = bias + (random() % (255-bias));
 
-        if (v > thresh) {
-            score += (v - thresh);
-            score_count ++;
-            rcode |= 1;
-        } else {
-            score += (thresh - v);
-            score_count ++;
+            fprintf(f, "%f %f %f setrgbcolor\n", rgb[0]/255.0f, rgb[1]/255.0f, rgb[2]/255.0f);
+            fprintf(f, "%f %f moveto %f %f lineto %f %f lineto %f %f lineto %f %f lineto stroke\n",
+                    q->p[0][0], q->p[0][1],
+                    q->p[1][0], q->p[1][1],
+                    q->p[2][0], q->p[2][1],
+                    q->p[3][0], q->p[3][1],
+                    q->p[0][0], q->p[0][1]);
         }
-    }
-
-    quick_decode_codeword(family, rcode, entry);
-    return score / score_count;
-}
 
-double score_goodness(apriltag_family_t *family, image_u8_t *im, struct quad *quad, void *user)
-{
-    return quad_goodness(family, im, quad);
-}
+        fclose(f);
+    }
 
-double score_decodability(apriltag_family_t *family, image_u8_t *im, struct quad *quad, void *user)
-{
-    struct quick_decode_entry entry;
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_OTHER, "debug output");
 
-    float decision_margin = quad_decode(family, im, quad, &entry);
+    // NB: quads (and their homographies) belong to ctx->scratch, and
+    // are recycled by the next call.
 
-    // hamming trumps decision margin; maximum value for decision_margin is 255.
-    return decision_margin - entry.hamming*1000;
+    // (detections->data is NULL until a detection has been added.)
+    if (zarray_size(detections) > det0)
+        qsort((apriltag_detection_record_t*) detections->data + det0, zarray_size(detections) - det0,
+              sizeof(apriltag_detection_record_t), detection_compare_function);
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_OTHER, "cleanup");
 }
 
-// returns score of best quad
-double optimize_quad_generic(apriltag_family_t *family, image_u8_t *im, struct quad *quad0,
-                             float *stepsizes, int nstepsizes,
-                             double (*score)(apriltag_family_t *family, image_u8_t *im, struct quad *quad, void *user),
-                             void *user)
+// Find the quads within the given regions of im_orig, decimated by
+// decimate. The quads belong to ctx->scratch.
+static zarray_t *detect_roi_quads(apriltag_detect_context_t *ctx, image_u8_t *im_orig,
+                                  const apriltag_roi_t *rois, int nrois, float decimate)
 {
-    struct quad *best_quad = quad_copy(quad0);
-    double best_score = score(family, im, best_quad, user);
-
-    for (int stepsize_idx = 0; stepsize_idx < nstepsizes; stepsize_idx++)  {
-
-        int improved = 1;
+    apriltag_detector_t *td = ctx->td;
 
-        // when we make progress with a particular step size, how many
-        // times will we try to perform that same step size again?
-        // (max_repeat = 0 means ("don't repeat--- just move to the
-        // next step size").
-        // XXX Tunable
-        int max_repeat = 1;
+    // align regions to the decimation grid, so that a region sees the
+    // same pixels as it would in a full-frame detection.
+    int align = 1;
+    if (decimate == 1.5)
+        align = 3;
+    else if (decimate > 1)
+        align = (int) decimate;
 
-        for (int repeat = 0; repeat <= max_repeat && improved; repeat++) {
+    zarray_t *quads = apriltag_scratch_roi_quads(ctx->scratch, sizeof(struct quad));
 
-            improved = 0;
+    ctx->whole_frame = 0;
 
-            // wiggle point i
-            for (int i = 0; i < 4; i++) {
+    for (int roiidx = 0; roiidx < nrois; roiidx++) {
+        const apriltag_roi_t *roi = &rois[roiidx];
 
-                float stepsize = stepsizes[stepsize_idx];
+        int x0 = imax(0, roi->x - td->roi_margin);
+        int y0 = imax(0, roi->y - td->roi_margin);
+        int x1 = imin(im_orig->width, roi->x + roi->width + td->roi_margin);
+        int y1 = imin(im_orig->height, roi->y + roi->height + td->roi_margin);
 
-                // XXX Tunable (really 1 makes the best sense since)
-                int nsteps = 1;
+        x0 -= x0 % align;
+        y0 -= y0 % align;
 
-                struct quad *this_best_quad = NULL;
-                double this_best_score = best_score;
+        if (x1 <= x0 || y1 <= y0)
+            continue;
 
-                for (int sx = -nsteps; sx <= nsteps; sx++) {
-                    for (int sy = -nsteps; sy <= nsteps; sy++) {
-                        if (sx==0 && sy==0)
-                            continue;
+        image_u8_t view = image_u8_view(im_orig, x0, y0, x1 - x0, y1 - y0);
 
-                        struct quad *this_quad = quad_copy(best_quad);
-                        this_quad->p[i][0] = best_quad->p[i][0] + sx*stepsize;
-                        this_quad->p[i][1] = best_quad->p[i][1] + sy*stepsize;
-                        quad_update_homographies(this_quad);
+        image_u8_t *roi_im = &view;
 
-                        double this_score = score(family, im, this_quad, user);
+        // Decimation copies the region anyway. Otherwise, detect the
+        // view itself, unless it is to be blurred in place: the
+        // regions may overlap, and im_orig is decoded afterwards.
+        if (!(decimate > 1) && ctx->sigma != 0) {
+            roi_im = apriltag_scratch_image(&ctx->scratch->roi, view.width, view.height);
+            for (int y = 0; y < view.height; y++)
+                memcpy(&roi_im->buf[y*roi_im->stride], &view.buf[y*view.stride], view.width);
+        }
 
-                        if (this_score > this_best_score) {
-                            quad_destroy(this_best_quad);
+        zarray_t *roi_quads = detect_quads(ctx, roi_im, decimate);
 
-                            this_best_quad = this_quad;
-                            this_best_score = this_score;
-                        } else {
-                            quad_destroy(this_quad);
-                        }
-                    }
-                }
+        for (int i = 0; i < zarray_size(roi_quads); i++) {
+            struct quad *q;
+            zarray_get_volatile(roi_quads, i, &q);
 
-                if (this_best_score > best_score) {
-                    quad_destroy(best_quad);
-                    best_quad = this_best_quad;
-                    best_score = this_best_score;
-                    improved = 1;
-                }
+            for (int j = 0; j < 4; j++) {
+                q->p[j][0] += x0;
+                q->p[j][1] += y0;
             }
+
+            zarray_add(quads, q);
         }
     }
 
-    matd_destroy(quad0->H);
-    matd_destroy(quad0->Hinv);
-    memcpy(quad0, best_quad, sizeof(struct quad)); // copy pointers
-    free(best_quad);
-    return best_score;
+    ctx->whole_frame = 1;
+
+    return quads;
 }
 
-static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct quad *quad)
+static void detect_rois(apriltag_detect_context_t *ctx, image_u8_t *im_orig,
+                        const apriltag_roi_t *rois, int nrois, zarray_t *detections)
 {
-    double lines[4][4]; // for each line, [Ex Ey nx ny]
-
-    for (int edge = 0; edge < 4; edge++) {
-        int a = edge, b = (edge + 1) & 3; // indices of the end points.
-
-        // compute the normal to the current line estimate
-        double nx = quad->p[b][1] - quad->p[a][1];
-        double ny = -quad->p[b][0] + quad->p[a][0];
-        double mag = sqrt(nx*nx + ny*ny);
-        nx /= mag;
-        ny /= mag;
+    zarray_t *quads = detect_roi_quads(ctx, im_orig, rois, nrois, ctx->decimate);
 
-        // we will now fit a NEW line by sampling points near
-        // our original line that have large gradients. On really big tags,
-        // we're willing to sample more to get an even better estimate.
-        int nsamples = imax(16, mag / 8); // XXX tunable
+    // NB: duplicates found in overlapping regions are removed along
+    // with other overlapping detections.
+    decode_quads(ctx, im_orig, quads, ctx->decimate, detections);
+}
 
-        // stats for fitting a line...
-        double Mx = 0, My = 0, Mxx = 0, Mxy = 0, Myy = 0, N = 0;
-
-        for (int s = 0; s < nsamples; s++) {
-            // compute a point along the line... Note, we're avoiding
-            // sampling *right* at the corners, since those points are
-            // the least reliable.
-            double alpha = (1.0 + s) / (nsamples + 1);
-            double x0 = alpha*quad->p[a][0] + (1-alpha)*quad->p[b][0];
-            double y0 = alpha*quad->p[a][1] + (1-alpha)*quad->p[b][1];
-
-            // search along the normal to this line, looking at the
-            // gradients along the way. We're looking for a strong
-            // response.
-            double Mn = 0;
-            double Mcount = 0;
-
-            // XXX tunable: how far to search?  We want to search far
-            // enough that we find the best edge, but not so far that
-            // we hit other edges that aren't part of the tag. We
-            // shouldn't ever have to search more than quad_decimate,
-            // since otherwise we would (ideally) have started our
-            // search on another pixel in the first place. Likewise,
-            // for very small tags, we don't want the range to be too
-            // big.
-            double range = fmin(td->quad_decimate + 1, mag / 10);
-
-            // XXX tunable step size.
-            for (double n = -range; n <= range; n +=  0.25) {
-                // Because of the guaranteed winding order of the
-                // points in the quad, we will start inside the white
-                // portion of the quad and work our way outward.
-                //
-                // sample to points (x1,y1) and (x2,y2) XXX tunable:
-                // how far +/- to look? Small values compute the
-                // gradient more precisely, but are more sensitive to
-                // noise.
-                double grange = 1;
-                int x1 = x0 + (n + grange)*nx;
-                int y1 = y0 + (n + grange)*ny;
-                if (x1 < 0 || x1 >= im_orig->width || y1 < 0 || y1 >= im_orig->height)
-                    continue;
+// Compute, in rois, rectangles that cover the non-zero cells of the
+// ncx x ncy cells (of cs x cs pixels).
+static void cells_rois(const uint8_t *cells, int ncx, int ncy, int cs, zarray_t *rois)
+{
+    // runs of cells in each row, merged with an identical run ending
+    // in the row above.
+    zarray_clear(rois);
 
-                int x2 = x0 + (n - grange)*nx;
-                int y2 = y0 + (n - grange)*ny;
-                if (x2 < 0 || x2 >= im_orig->width || y2 < 0 || y2 >= im_orig->height)
-                    continue;
+    for (int cy = 0; cy < ncy; cy++) {
+        for (int cx = 0; cx < ncx; cx++) {
+            if (!cells[cy*ncx + cx])
+                continue;
 
-                int g1 = im_orig->buf[y1*im_orig->stride + x1];
-                int g2 = im_orig->buf[y2*im_orig->stride + x2];
+            int cx1 = cx;
+            while (cx1 < ncx && cells[cy*ncx + cx1])
+                cx1++;
 
-                if (g1 < g2) // reject points whose gradient is "backwards". They can only hurt us.
-                    continue;
+            apriltag_roi_t roi = { .x = cx * cs, .y = cy * cs,
+                                   .width = (cx1 - cx) * cs, .height = cs };
 
-                double weight = (g2 - g1)*(g2 - g1); // XXX tunable. What shape for weight=f(g2-g1)?
+            int merged = 0;
+            for (int i = 0; i < zarray_size(rois) && !merged; i++) {
+                apriltag_roi_t *r;
+                zarray_get_volatile(rois, i, &r);
 
-                // compute weighted average of the gradient at this point.
-                Mn += weight*n;
-                Mcount += weight;
+                if (r->x == roi.x && r->width == roi.width && r->y + r->height == roi.y) {
+                    r->height += cs;
+                    merged = 1;
+                }
             }
 
-            // what was the average point along the line?
-            double n0 = Mn / Mcount;
-
-            // where is the point along the line?
-            double bestx = x0 + n0*nx;
-            double besty = y0 + n0*ny;
-
-            // update our line fit statistics
-            Mx += bestx;
-            My += besty;
-            Mxx += bestx*bestx;
-            Mxy += bestx*besty;
-            Myy += besty*besty;
-            N++;
-        }
-
-        // fit a line
-        double Ex = Mx / N, Ey = My / N;
-        double Cxx = Mxx / N - Ex*Ex;
-        double Cxy = Mxy / N - Ex*Ey;
-        double Cyy = Myy / N - Ey*Ey;
-
-        double normal_theta = .5 * atan2f(-2*Cxy, (Cyy - Cxx));
-        nx = cosf(normal_theta);
-        ny = sinf(normal_theta);
-        lines[edge][0] = Ex;
-        lines[edge][1] = Ey;
-        lines[edge][2] = nx;
-        lines[edge][3] = ny;
-    }
-
-    // now refit the corners of the quad
-    for (int i = 0; i < 4; i++) {
-        // solve for the intersection of lines (i) and (i+1)&3.
-        double A00 =  lines[i][3],  A01 = -lines[(i+1)&3][3];
-        double A10 =  -lines[i][2],  A11 = lines[(i+1)&3][2];
-        double B0 = -lines[i][0] + lines[(i+1)&3][0];
-        double B1 = -lines[i][1] + lines[(i+1)&3][1];
-
-        double det = A00 * A11 - A10 * A01;
-
-        // inverse.
-        double W00 = A11 / det, W01 = -A01 / det;
-        if (fabs(det) > 0.001) {
-            // solve
-            double L0 = W00*B0 + W01*B1;
+            if (!merged)
+                zarray_add(rois, &roi);
 
-            // compute intersection
-            quad->p[i][0] = lines[i][0] + L0*A00;
-            quad->p[i][1] = lines[i][1] + L0*A10;
+            cx = cx1;
         }
     }
 }
 
-static void quad_decode_task(void *_u)
+// Compute, in rois, rectangles that cover the parts of im_orig which
+// are not inside any of the detections, in cells of cs x cs pixels.
+static void pyramid_uncovered(image_u8_t *im_orig, zarray_t *detections, int cs, zarray_t *rois)
 {
-    struct quad_decode_task *task = (struct quad_decode_task*) _u;
-    apriltag_detector_t *td = task->td;
-    image_u8_t *im = task->im;
-
-    for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
-        struct quad *quad_original;
-        zarray_get_volatile(task->quads, quadidx, &quad_original);
-
-        // refine edges is not dependent upon the tag family, thus
-        // apply this optimization BEFORE the other work.
-        if (td->quad_decimate > 1 && td->refine_edges) {
-            refine_edges(td, im, quad_original);
-        }
-
-        // make sure the homographies are computed...
-        quad_update_homographies(quad_original);
+    int ncx = (im_orig->width + cs - 1) / cs;
+    int ncy = (im_orig->height + cs - 1) / cs;
 
-        for (int famidx = 0; famidx < zarray_size(td->tag_families); famidx++) {
-            apriltag_family_t *family;
-            zarray_get(td->tag_families, famidx, &family);
+    uint8_t covered[ncy][ncx];
+    memset(covered, 0, sizeof(covered));
 
-            double goodness = 0;
+    zarray_t *poly = g2d_polygon_create_zeros(4);
 
-            // since the geometry of tag families can vary, start any
-            // optimization process over with the original quad.
-            struct quad *quad = quad_copy(quad_original);
-
-            // improve the quad corner positions by minimizing the
-            // variance within each intra-bit area.
-            if (td->refine_pose) {
-                // NB: We potentially step an integer
-                // number of times in each direction. To make each
-                // sample as useful as possible, the step sizes should
-                // not be integer multiples of each other. (I.e.,
-                // probably don't use 1, 0.5, 0.25, etc.)
-
-                // XXX Tunable
-                float stepsizes[] = { 1, .4, .16, .064 };
-                int nstepsizes = sizeof(stepsizes)/sizeof(float);
-
-                goodness = optimize_quad_generic(family, im, quad, stepsizes, nstepsizes, score_goodness, NULL);
-            }
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
+
+        double x0 = det->p[0][0], x1 = det->p[0][0];
+        double y0 = det->p[0][1], y1 = det->p[0][1];
+        for (int k = 0; k < 4; k++) {
+            zarray_set(poly, k, det->p[k], NULL);
+            x0 = fmin(x0, det->p[k][0]);
+            x1 = fmax(x1, det->p[k][0]);
+            y0 = fmin(y0, det->p[k][1]);
+            y1 = fmax(y1, det->p[k][1]);
+        }
 
-            if (td->refine_decode) {
-                // this optimizes decodability, but we don't report
-                // that value to the user.  (so discard return value.)
-                // XXX Tunable
-                float stepsizes[] = { .4 };
-                int nstepsizes = sizeof(stepsizes)/sizeof(float);
+        // a cell is covered only if all of its corners are inside the
+        // tag.
+        for (int cy = imax(0, y0 / cs); cy <= imin(ncy - 1, y1 / cs); cy++) {
+            for (int cx = imax(0, x0 / cs); cx <= imin(ncx - 1, x1 / cs); cx++) {
+                if (covered[cy][cx])
+                    continue;
 
-                optimize_quad_generic(family, im, quad, stepsizes, nstepsizes, score_decodability, NULL);
+                int inside = 1;
+                for (int k = 0; k < 4 && inside; k++) {
+                    double q[2] = { (cx + (k & 1)) * cs, (cy + (k >> 1)) * cs };
+                    inside = g2d_polygon_contains_point(poly, q);
+                }
+                covered[cy][cx] = inside;
             }
+        }
+    }
 
-            struct quick_decode_entry entry;
-
-            float decision_margin = quad_decode(family, im, quad, &entry);
-            if (entry.hamming < 255) {
-                apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
-
-                det->family = family;
-                det->id = entry.id;
-                det->hamming = entry.hamming;
-                det->goodness = goodness;
-                det->decision_margin = decision_margin;
-
-                double theta = -entry.rotation * M_PI / 2.0;
-                double c = cos(theta), s = sin(theta);
-
-                matd_t *R = matd_create(3,3);
-                MATD_EL(R, 0, 0) = c;
-                MATD_EL(R, 0, 1) = -s;
-                MATD_EL(R, 1, 0) = s;
-                MATD_EL(R, 1, 1) = c;
-                MATD_EL(R, 2, 2) = 1;
+    zarray_destroy(poly);
 
-                det->H = matd_op("M*M", quad->H, R);
+    // (now the cells not covered.)
+    for (int cy = 0; cy < ncy; cy++)
+        for (int cx = 0; cx < ncx; cx++)
+            covered[cy][cx] = !covered[cy][cx];
 
-                matd_destroy(R);
+    cells_rois(&covered[0][0], ncx, ncy, cs, rois);
+}
 
-                homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
+// Search im_orig at each level of the decimation pyramid, from the
+// coarsest to the finest (ctx->decimate), skipping the parts of
+// the image already covered by tags found at coarser levels.
+static void detect_pyramid(apriltag_detect_context_t *ctx, image_u8_t *im_orig, zarray_t *detections)
+{
+    apriltag_detector_t *td = ctx->td;
 
-                // adjust the points in det->p so that they correspond to
-                // counter-clockwise around the quad, starting at -1,-1.
-                for (int i = 0; i < 4; i++) {
-                    int tcx = (i == 0 || i == 3) ? -1 : 1;
-                    int tcy = (i < 2) ? -1 : 1;
+    float finest = ctx->decimate > 1 ? ctx->decimate : 1;
 
-                    double p[2];
+    zarray_t *rois = apriltag_scratch_pyramid_rois(ctx->scratch, sizeof(apriltag_roi_t));
 
-                    homography_project(det->H, tcx, tcy, &p[0], &p[1]);
+    for (int level = td->quad_pyramid_levels - 1; level >= 0 && !ctx->complete; level--) {
+        float decimate = finest * (1 << level);
 
-                    det->p[i][0] = p[0];
-                    det->p[i][1] = p[1];
-                }
+        if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+            break;
 
-                pthread_mutex_lock(&td->mutex);
-                zarray_add(task->detections, &det);
-                pthread_mutex_unlock(&td->mutex);
-            }
+        zarray_t *quads;
+        if (zarray_size(detections) == 0) {
+            quads = detect_quads(ctx, im_orig, decimate);
+        } else {
+            pyramid_uncovered(im_orig, detections, APRILTAG_PYRAMID_CELL, rois);
+            if (zarray_size(rois) == 0)
+                break;
 
-            quad_destroy(quad);
+            quads = detect_roi_quads(ctx, im_orig, (apriltag_roi_t*) rois->data,
+                                     zarray_size(rois), decimate);
         }
+
+        decode_quads(ctx, im_orig, quads, decimate, detections);
     }
+
+    // a tag may be found again at a finer level if it was only
+    // partly covered.
+    int ndecoded = zarray_size(detections);
+    reconcile_detections(detections, 0);
+    ctx->stats.nreconcile_rejected += ndecoded - zarray_size(detections);
+    zarray_sort(detections, detection_compare_function);
 }
 
-void apriltag_detection_destroy(apriltag_detection_t *det)
+// Search im_orig in overlapping tiles that can each be searched
+// within td->tile_memory, or return 0 (without searching) if the whole
+// image can be.
+static int detect_tiled(apriltag_detect_context_t *ctx, image_u8_t *im_orig, zarray_t *detections)
 {
-    if (det == NULL)
-        return;
+    apriltag_detector_t *td = ctx->td;
+
+    // the side of the tiles, in pixels of im_orig.
+    double npixels = (double) td->tile_memory / APRILTAG_TILE_BYTES_PER_PIXEL;
+    int side = (int) (fmax(ctx->decimate, 1) * sqrt(npixels));
+
+    if (im_orig->width <= side && im_orig->height <= side)
+        return 0;
+
+    // the tiles overlap by as much as a tag may span, so that every
+    // tag is wholly within one of them; a tile is at least twice that,
+    // so that the tiles still advance by at least the overlap.
+    int overlap = td->max_tag_size > 0 ? td->max_tag_size : side / 4;
+    overlap = imax(overlap, 2*td->roi_margin);
+    side = imax(side, 2*overlap);
+
+    // (detect_roi_quads grows each region by roi_margin, so the
+    // regions are the tiles less that.)
+    side = imax(side, 2*td->roi_margin + 2);
+    int step = side - overlap;
+
+    int ntx = imax(1, (im_orig->width - overlap + step - 1) / step);
+    int nty = imax(1, (im_orig->height - overlap + step - 1) / step);
+
+    zarray_t *tiles = apriltag_scratch_pyramid_rois(ctx->scratch, sizeof(apriltag_roi_t));
+
+    for (int ty = 0; ty < nty; ty++) {
+        for (int tx = 0; tx < ntx; tx++) {
+            // (the last row and column of tiles end at the image's
+            // edges.)
+            int x = imax(0, imin(tx*step, im_orig->width - side));
+            int y = imax(0, imin(ty*step, im_orig->height - side));
+
+            apriltag_roi_t roi = { .x = x + td->roi_margin, .y = y + td->roi_margin,
+                                   .width = side - 2*td->roi_margin,
+                                   .height = side - 2*td->roi_margin };
+            zarray_add(tiles, &roi);
+        }
+    }
 
-    matd_destroy(det->H);
-    free(det);
+    detect_rois(ctx, im_orig, (apriltag_roi_t*) tiles->data, zarray_size(tiles), detections);
+    return 1;
 }
 
-zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+static void detect_quads_and_decode(apriltag_detect_context_t *ctx, image_u8_t *im_orig,
+                                    zarray_t *detections)
 {
-    if (zarray_size(td->tag_families) == 0) {
-        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
-        printf("apriltag.c: No tag families enabled.");
-        return s;
-    }
+    apriltag_detector_t *td = ctx->td;
 
-    if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp)) {
-        workerpool_destroy(td->wp);
-        td->wp = workerpool_create(td->nthreads);
+    if (td->quad_pyramid_levels > 1) {
+        detect_pyramid(ctx, im_orig, detections);
+        return;
     }
 
-    timeprofile_clear(td->tp);
-    timeprofile_stamp(td->tp, "init");
+    if (td->tile_memory > 0 && detect_tiled(ctx, im_orig, detections))
+        return;
 
-    ///////////////////////////////////////////////////////////
-    // Step 1. Detect quads according to requested image decimation
-    // and blurring parameters.
-    image_u8_t *quad_im = im_orig;
-    if (td->quad_decimate > 1) {
-        quad_im = image_u8_decimate(im_orig, td->quad_decimate);
+    zarray_t *quads = detect_quads(ctx, im_orig, ctx->decimate);
+
+    decode_quads(ctx, im_orig, quads, ctx->decimate, detections);
+}
 
-        timeprofile_stamp(td->tp, "decimate");
+// Is the tracked tag t among detections?
+static int track_find(zarray_t *detections, const struct track *t)
+{
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
+
+        if (det->family == t->family && det->id == t->id)
+            return 1;
     }
 
-    if (td->quad_sigma != 0) {
-        // compute a reasonable kernel width by figuring that the
-        // kernel should go out 2 std devs.
-        //
-        // max sigma          ksz
-        // 0.499              1  (disabled)
-        // 0.999              3
-        // 1.499              5
-        // 1.999              7
+    return 0;
+}
 
-        float sigma = fabsf((float) td->quad_sigma);
+// Search im_orig near where the tracked tags should be, falling back
+// to a full-frame search periodically or when a tag is lost.
+static void detect_tracked(apriltag_detect_context_t *ctx, image_u8_t *im_orig, zarray_t *detections)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    int ntracks = zarray_size(ctx->tracks);
+    int found = 0;
+
+    if (ntracks > 0 && ctx->track_frames < td->track_interval) {
+        apriltag_roi_t rois[ntracks];
+
+        for (int i = 0; i < ntracks; i++) {
+            struct track *t;
+            zarray_get_volatile(ctx->tracks, i, &t);
+
+            // the tag's previous bounding box, moved by its previous
+            // velocity, and grown to allow for changes in speed and
+            // scale.
+            double x0 = t->p[0][0], x1 = t->p[0][0];
+            double y0 = t->p[0][1], y1 = t->p[0][1];
+            for (int j = 1; j < 4; j++) {
+                x0 = fmin(x0, t->p[j][0]);
+                x1 = fmax(x1, t->p[j][0]);
+                y0 = fmin(y0, t->p[j][1]);
+                y1 = fmax(y1, t->p[j][1]);
+            }
 
-        int ksz = 4 * sigma; // 2 std devs in each direction
-        if ((ksz & 1) == 0)
-            ksz++;
+            double grow = 0.25 * fmax(x1 - x0, y1 - y0) + fmax(fabs(t->v[0]), fabs(t->v[1]));
 
-        if (ksz > 1) {
+            rois[i].x = (int) floor(x0 + t->v[0] - grow);
+            rois[i].y = (int) floor(y0 + t->v[1] - grow);
+            rois[i].width = (int) ceil(x1 + t->v[0] + grow) - rois[i].x;
+            rois[i].height = (int) ceil(y1 + t->v[1] + grow) - rois[i].y;
+        }
 
-            if (td->quad_sigma > 0) {
-                // Apply a blur
-                image_u8_gaussian_blur(quad_im, sigma, ksz);
-            } else {
-                // SHARPEN the image by subtracting the low frequency components.
-                image_u8_t *orig = image_u8_copy(quad_im);
-                image_u8_gaussian_blur(quad_im, sigma, ksz);
-
-                for (int y = 0; y < orig->height; y++) {
-                    for (int x = 0; x < orig->width; x++) {
-                        int vorig = orig->buf[y*orig->stride + x];
-                        int vblur = quad_im->buf[y*quad_im->stride + x];
-
-                        int v = 2*vorig - vblur;
-                        if (v < 0)
-                            v = 0;
-                        if (v > 255)
-                            v = 255;
-
-                        quad_im->buf[y*quad_im->stride + x] = (uint8_t) v;
-                    }
-                }
-                image_u8_destroy(orig);
-            }
+        detect_rois(ctx, im_orig, rois, ntracks, detections);
+
+        found = 1;
+        for (int i = 0; i < ntracks && found; i++) {
+            struct track *t;
+            zarray_get_volatile(ctx->tracks, i, &t);
+
+            found = track_find(detections, t);
         }
     }
 
-    timeprofile_stamp(td->tp, "blur/sharp");
-
-    if (td->debug)
-        image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+    // (if the tags expected are there, it doesn't matter that a
+    // tracked one is not, and if there is no time left, the tags of
+    // the tracked regions will have to do.)
+    found |= ctx->complete;
+    if (!found && ntracks > 0 && apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        found = 1;
 
-    zarray_t* quads = 0;
+    ctx->stats.tracked = found;
 
-    if (td->quad_contours) {
-      quads = apriltag_quad_contour(td, quad_im);
-    } else {
-      quads = apriltag_quad_thresh(td, quad_im);
-      //quads = apriltag_quad_gradient(td, im_orig);
+    if (!found) {
+        zarray_clear(detections);
+        detection_expected_reset(ctx);
+        detect_quads_and_decode(ctx, im_orig, detections);
+        ctx->track_frames = 0;
     }
+    ctx->track_frames++;
 
-    // adjust centers of pixels so that they correspond to the
-    // original full-resolution image.
-    if (td->quad_decimate > 1) {
-        for (int i = 0; i < zarray_size(quads); i++) {
-            struct quad *q;
-            zarray_get_volatile(quads, i, &q);
+    // replace the tracks with this frame's detections.
+    struct track old[ntracks + 1];
+    if (ntracks > 0)
+        memcpy(old, ctx->tracks->data, ntracks * sizeof(struct track));
+    zarray_clear(ctx->tracks);
 
-            for (int i = 0; i < 4; i++) {
-                q->p[i][0] *= td->quad_decimate;
-                q->p[i][1] *= td->quad_decimate;
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
+
+        struct track t = { .family = det->family, .id = det->id };
+        memcpy(t.c, det->c, sizeof(t.c));
+        memcpy(t.p, det->p, sizeof(t.p));
+
+        uint64_t code = det->family->codes[det->id];
+        for (int k = 0; k < 4; k++) {
+            t.rcodes[k] = code;
+            code = rotate90(code, det->family->d);
+        }
+
+        for (int j = 0; j < ntracks; j++) {
+            if (old[j].family == t.family && old[j].id == t.id) {
+                t.v[0] = t.c[0] - old[j].c[0];
+                t.v[1] = t.c[1] - old[j].c[1];
+                break;
             }
         }
+
+        zarray_add(ctx->tracks, &t);
     }
+}
 
-    if (quad_im != im_orig)
-        image_u8_destroy(quad_im);
+// The cells (of cs x cs pixels, ncx across) of the bounding box of
+// det, which are within [0, ncx) x [0, ncy).
+static void detection_cells(const apriltag_detection_record_t *det, int cs, int ncx, int ncy,
+                            int *cx0, int *cy0, int *cx1, int *cy1)
+{
+    double x0 = det->p[0][0], x1 = det->p[0][0];
+    double y0 = det->p[0][1], y1 = det->p[0][1];
+    for (int k = 1; k < 4; k++) {
+        x0 = fmin(x0, det->p[k][0]);
+        x1 = fmax(x1, det->p[k][0]);
+        y0 = fmin(y0, det->p[k][1]);
+        y1 = fmax(y1, det->p[k][1]);
+    }
 
-    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+    *cx0 = imax(0, floor(x0 / cs));
+    *cy0 = imax(0, floor(y0 / cs));
+    *cx1 = imin(ncx - 1, floor(x1 / cs));
+    *cy1 = imin(ncy - 1, floor(y1 / cs));
+}
 
-    td->nquads = zarray_size(quads);
+// Search im_orig only where it changed since the previous frame,
+// carrying forward the previous frame's tags elsewhere, and in full
+// every td->motion_interval frames.
+static void detect_motion(apriltag_detect_context_t *ctx, image_u8_t *im_orig, zarray_t *detections)
+{
+    apriltag_detector_t *td = ctx->td;
+    const int cs = APRILTAG_PYRAMID_CELL, ts = cs / APRILTAG_MOTION_FACTOR;
+
+    // the reduced copy of this frame (in the slot the previous frame's
+    // isn't in), and the previous frame's if it is comparable.
+    int rw, rh;
+    image_u8_decimate_dims(im_orig, APRILTAG_MOTION_FACTOR, &rw, &rh);
+
+    int cur = ctx->motion_ref == 0;
+    image_u8_t *reduced = NULL;
+    if (rw > 0 && rh > 0) {
+        reduced = apriltag_scratch_image(&ctx->scratch->motion[cur], rw, rh);
+        decimate_mt(ctx, im_orig, APRILTAG_MOTION_FACTOR, reduced);
+    }
 
-    timeprofile_stamp(td->tp, "quads");
+    image_u8_t *ref = NULL;
+    if (reduced && ctx->motion_ref >= 0) {
+        ref = &ctx->scratch->motion[ctx->motion_ref].im;
+        if (ref->width != rw || ref->height != rh)
+            ref = NULL;
+    }
 
-    if (td->debug) {
-        image_u8_t *im_quads = image_u8_copy(im_orig);
-        image_u8_darken(im_quads);
-        image_u8_darken(im_quads);
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_PREPROCESS, "motion");
 
-        srandom(0);
+    if (ref == NULL || ctx->motion_frames >= td->motion_interval) {
+        detect_quads_and_decode(ctx, im_orig, detections);
+        ctx->motion_frames = 0;
+    } else {
+        int ncx = (im_orig->width + cs - 1) / cs, ncy = (im_orig->height + cs - 1) / cs;
+        int ntx = (rw + ts - 1) / ts, nty = (rh + ts - 1) / ts;
+
+        uint32_t *sads = apriltag_scratch_buffer(&ctx->scratch->motion_sads,
+                                                 (size_t) ntx * nty * sizeof(uint32_t));
+        image_u8_sad_tiles(reduced, ref, ts, sads);
+
+        // the changed tiles, and their neighbors (for the tags across
+        // tiles), are searched. (The last row and column of tiles may
+        // lie past the reduced copy, and are judged by the tiles next
+        // to them.)
+        uint8_t search[ncy][ncx];
+        memset(search, 0, sizeof(search));
+
+        for (int cy = 0; cy < ncy; cy++) {
+            for (int cx = 0; cx < ncx; cx++) {
+                int tx = imin(cx, ntx - 1), ty = imin(cy, nty - 1);
+                int npixels = imin(ts, rw - tx*ts) * imin(ts, rh - ty*ts);
+
+                if (sads[ty*ntx + tx] <= td->motion_threshold * npixels)
+                    continue;
 
-        for (int i = 0; i < zarray_size(quads); i++) {
-            struct quad *quad;
-            zarray_get_volatile(quads, i, &quad);
+                ctx->stats.ntiles_changed++;
+                for (int y = imax(0, cy - 1); y <= imin(ncy - 1, cy + 1); y++)
+                    for (int x = imax(0, cx - 1); x <= imin(ncx - 1, cx + 1); x++)
+                        search[y][x] = 1;
+            }
+        }
 
-            const int bias = 100;
-            int color = bias + (random() % (255-bias));
+        ctx->stats.ntiles = ncx * ncy;
 
-            image_u8_draw_line(im_quads, quad->p[0][0], quad->p[0][1], quad->p[1][0], quad->p[1][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[1][0], quad->p[1][1], quad->p[2][0], quad->p[2][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[2][0], quad->p[2][1], quad->p[3][0], quad->p[3][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[3][0], quad->p[3][1], quad->p[0][0], quad->p[0][1], color, 1);
-        }
+        // a previous tag touching the search is searched for in full,
+        // which may bring in others.
+        int nprev = zarray_size(ctx->motion_detections);
+        uint8_t dropped[nprev + 1];
+        memset(dropped, 0, sizeof(dropped));
 
-        image_u8_write_pnm(im_quads, "debug_quads_raw.pnm");
-        image_u8_destroy(im_quads);
-    }
+        for (int more = 1; more; ) {
+            more = 0;
 
-    ////////////////////////////////////////////////////////////////
-    // Step 2. Decode tags from each quad.
-    if (1) {
-        image_u8_t *im_gray_samples = td->debug ? image_u8_copy(im_orig) : NULL;
+            for (int i = 0; i < nprev; i++) {
+                if (dropped[i])
+                    continue;
 
-        // im_decision debugging output is slow.
-        image_u8_t *im_decision = td->debug ? image_u8_copy(im_orig) : NULL;
+                apriltag_detection_record_t *det;
+                zarray_get_volatile(ctx->motion_detections, i, &det);
 
-        int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+                int cx0, cy0, cx1, cy1;
+                detection_cells(det, cs, ncx, ncy, &cx0, &cy0, &cx1, &cy1);
 
-        struct quad_decode_task tasks[zarray_size(quads) / chunksize + 1];
+                int touched = 0;
+                for (int cy = cy0; cy <= cy1 && !touched; cy++)
+                    for (int cx = cx0; cx <= cx1 && !touched; cx++)
+                        touched = search[cy][cx];
 
-        int ntasks = 0;
-        for (int i = 0; i < zarray_size(quads); i+= chunksize) {
-            tasks[ntasks].i0 = i;
-            tasks[ntasks].i1 = imin(zarray_size(quads), i + chunksize);
-            tasks[ntasks].quads = quads;
-            tasks[ntasks].td = td;
-            tasks[ntasks].im = im_orig;
-            tasks[ntasks].detections = detections;
+                if (!touched)
+                    continue;
 
-            tasks[ntasks].im_gray_samples = im_gray_samples;
-            tasks[ntasks].im_decision = im_decision;
+                for (int cy = cy0; cy <= cy1; cy++)
+                    for (int cx = cx0; cx <= cx1; cx++)
+                        search[cy][cx] = 1;
 
-            workerpool_add_task(td->wp, quad_decode_task, &tasks[ntasks]);
-            ntasks++;
+                dropped[i] = 1;
+                more = 1;
+            }
         }
 
-        workerpool_run(td->wp);
+        for (int i = 0; i < nprev; i++) {
+            if (dropped[i])
+                continue;
 
-        if (im_gray_samples != NULL) {
-            image_u8_write_pnm(im_gray_samples, "debug_gray_samples.pnm");
-            image_u8_destroy(im_gray_samples);
+            apriltag_detection_record_t *det;
+            zarray_get_volatile(ctx->motion_detections, i, &det);
+            zarray_add(detections, det);
+            ctx->stats.ncarried++;
         }
 
-        if (im_decision != NULL) {
-            image_u8_write_pnm(im_decision, "debug_decision.pnm");
-            image_u8_destroy(im_decision);
-        }
+        zarray_t *rois = apriltag_scratch_pyramid_rois(ctx->scratch, sizeof(apriltag_roi_t));
+        cells_rois(&search[0][0], ncx, ncy, cs, rois);
+
+        if (zarray_size(rois) > 0)
+            detect_rois(ctx, im_orig, (apriltag_roi_t*) rois->data, zarray_size(rois), detections);
+
+        // (a tag carried forward may be found again near the search.)
+        int ndetections = zarray_size(detections);
+        reconcile_detections(detections, 0);
+        ctx->stats.nreconcile_rejected += ndetections - zarray_size(detections);
+        zarray_sort(detections, detection_compare_function);
     }
 
-    if (td->debug) {
-        image_u8_t *im_quads = image_u8_copy(im_orig);
-        image_u8_darken(im_quads);
-        image_u8_darken(im_quads);
+    ctx->motion_frames++;
+    ctx->motion_ref = reduced ? cur : -1;
 
-        srandom(0);
+    zarray_clear(ctx->motion_detections);
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
+        zarray_add(ctx->motion_detections, det);
+    }
+}
 
-        for (int i = 0; i < zarray_size(quads); i++) {
-            struct quad *quad;
-            zarray_get_volatile(quads, i, &quad);
+// The step of td->auto_decimate after decimate.
+static float auto_decimate_step(float decimate)
+{
+    if (decimate < 1.5f)
+        return 1.5f;
+    if (decimate < 2)
+        return 2;
+    return floorf(decimate) + 1;
+}
 
-            const int bias = 100;
-            int color = bias + (random() % (255-bias));
+// Choose the decimation of the next frame of ctx from detections, the
+// tags of the current one (see td->auto_decimate).
+static void auto_decimate_update(apriltag_detect_context_t *ctx, const zarray_t *detections)
+{
+    apriltag_detector_t *td = ctx->td;
 
-            image_u8_draw_line(im_quads, quad->p[0][0], quad->p[0][1], quad->p[1][0], quad->p[1][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[1][0], quad->p[1][1], quad->p[2][0], quad->p[2][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[2][0], quad->p[2][1], quad->p[3][0], quad->p[3][1], color, 1);
-            image_u8_draw_line(im_quads, quad->p[3][0], quad->p[3][1], quad->p[0][0], quad->p[0][1], color, 1);
+    float edge = 0;
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
 
+        for (int j = 0; j < 4; j++) {
+            float len = hypotf(det->p[(j+1)&3][0] - det->p[j][0], det->p[(j+1)&3][1] - det->p[j][1]);
+            if (edge == 0 || len < edge)
+                edge = len;
         }
+    }
 
-        image_u8_write_pnm(im_quads, "debug_quads_fixed.pnm");
-        image_u8_destroy(im_quads);
+    // a tag lost may have been too small for the decimation: start
+    // again from the tags of the frames to come.
+    int lost = zarray_size(detections) < ctx->auto_ndetections;
+    ctx->auto_ndetections = zarray_size(detections);
+
+    if (lost)
+        ctx->nauto_edges = 0;
+
+    ctx->auto_edges[ctx->auto_edges_next] = edge;
+    ctx->auto_edges_next = (ctx->auto_edges_next + 1) % APRILTAG_AUTO_DECIMATE_FRAMES;
+    if (ctx->nauto_edges < APRILTAG_AUTO_DECIMATE_FRAMES)
+        ctx->nauto_edges++;
+
+    float shortest = 0;
+    for (int i = 0; i < ctx->nauto_edges; i++) {
+        float e = ctx->auto_edges[(ctx->auto_edges_next - 1 - i + APRILTAG_AUTO_DECIMATE_FRAMES) %
+                                  APRILTAG_AUTO_DECIMATE_FRAMES];
+        if (e > 0 && (shortest == 0 || e < shortest))
+            shortest = e;
+    }
+
+    if (lost || shortest == 0) {
+        ctx->auto_decimate = 0;
+        return;
     }
 
-    timeprofile_stamp(td->tp, "decode+refinement");
+    float lowest = fmaxf(td->quad_decimate, 1);
 
-    ////////////////////////////////////////////////////////////////
-    // Step 3. Reconcile detections--- don't report the same tag more
-    // than once. (Allow non-overlapping duplicate detections.)
-    if (1) {
-        zarray_t *poly0 = g2d_polygon_create_zeros(4);
-        zarray_t *poly1 = g2d_polygon_create_zeros(4);
+    // the largest decimation at which the shortest edge is long
+    // enough.
+    float safe = shortest / td->auto_decimate_edge;
 
-        for (int i0 = 0; i0 < zarray_size(detections); i0++) {
+    float decimate = ctx->auto_decimate > 0 ? ctx->auto_decimate : lowest;
 
-            apriltag_detection_t *det0;
-            zarray_get(detections, i0, &det0);
+    // fall to the largest step that is safe, or rise to it only if the
+    // step after that would be safe too.
+    if (decimate > safe) {
+        decimate = lowest;
+        for (float d = auto_decimate_step(lowest); d <= safe && d <= td->auto_decimate; d = auto_decimate_step(d))
+            decimate = d;
+    } else {
+        for (float d = auto_decimate_step(decimate); auto_decimate_step(d) <= safe && d <= td->auto_decimate;
+             d = auto_decimate_step(d))
+            decimate = d;
+    }
 
-            for (int k = 0; k < 4; k++)
-                zarray_set(poly0, k, det0->p[k], NULL);
+    ctx->auto_decimate = decimate > lowest ? decimate : 0;
+}
 
-            for (int i1 = i0+1; i1 < zarray_size(detections); i1++) {
+// The detections by td of im_orig, as apriltag_detection_record_t:
+// of its pixels if format is APRILTAG_FORMAT_GRAY8, or else of those
+// of the bayer mosaic, or of the color frame, of that format which it
+// holds (in its width x height pixels, stride bytes apart). They
+// belong to ctx->scratch, and are replaced by the next call.
+static zarray_t *detect_records(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                image_u8_t *im_orig, int format)
+{
+    zarray_t *detections = apriltag_scratch_detections(ctx->scratch,
+                                                       sizeof(apriltag_detection_record_t));
+
+    if (!detect_init(td, ctx))
+        return detections;
+
+    // a mosaic is detected in its luma, except for the threshold (see
+    // apriltag_quad_thresh), and a color frame in its gray, which are
+    // written straight into the scratch.
+    ctx->bayer = NULL;
+    if (format != APRILTAG_FORMAT_GRAY8) {
+        image_u8_t *luma = apriltag_scratch_image(&ctx->scratch->luma, im_orig->width, im_orig->height);
+        luma_mt(ctx, im_orig, format, luma);
+
+        if (format == APRILTAG_FORMAT_BAYER)
+            ctx->bayer = im_orig;
+        im_orig = luma;
+
+        apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_PREPROCESS,
+                                      format == APRILTAG_FORMAT_BAYER ? "bayer luma" : "color gray");
+    }
 
-                apriltag_detection_t *det1;
-                zarray_get(detections, i1, &det1);
+    if (td->capture)
+        ctx->capture = apriltag_capture_begin(td->capture, im_orig);
 
-                if (det0->id != det1->id || det0->family != det1->family)
-                    continue;
+    if (td->track_interval > 0) {
+        detect_tracked(ctx, im_orig, detections);
+    } else if (td->motion_interval > 0) {
+        ctx->stats.tracked = 0;
+        detect_motion(ctx, im_orig, detections);
+    } else {
+        ctx->stats.tracked = 0;
+        detect_quads_and_decode(ctx, im_orig, detections);
+    }
 
-                for (int k = 0; k < 4; k++)
-                    zarray_set(poly1, k, det1->p[k], NULL);
-
-                if (g2d_polygon_overlaps_polygon(poly0, poly1)) {
-                    // the tags overlap. Delete one, keep the other.
-
-                    if (det0->hamming < det1->hamming ||
-                        (det0->hamming == det1->hamming && det0->goodness > det1->goodness)) {
-                        // keep det0, destroy det1
-                        apriltag_detection_destroy(det1);
-                        zarray_remove_index(detections, i1, 1);
-                        i1--; // retry the same index
-                        goto retry1;
-                    } else {
-                        // keep det1, destroy det0
-                        apriltag_detection_destroy(det0);
-                        zarray_remove_index(detections, i0, 1);
-                        i0--; // retry the same index.
-                        goto retry0;
-                    }
-                }
+    if (td->auto_decimate > td->quad_decimate)
+        auto_decimate_update(ctx, detections);
 
-              retry1: ;
-            }
+    detect_finish(ctx, detections);
+    return detections;
+}
 
-          retry0: ;
-        }
+// Copy records into a new array of apriltag_detection_t*.
+static zarray_t *detections_from_records(const zarray_t *records)
+{
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
 
-        zarray_destroy(poly0);
-        zarray_destroy(poly1);
+    for (int i = 0; i < zarray_size(records); i++) {
+        apriltag_detection_record_t *rec;
+        zarray_get_volatile(records, i, &rec);
+
+        apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+        det->family = rec->family;
+        det->id = rec->id;
+        det->hamming = rec->hamming;
+        det->goodness = rec->goodness;
+        det->decision_margin = rec->decision_margin;
+        det->H = matd_create_data(3, 3, rec->H);
+        memcpy(det->c, rec->c, sizeof(det->c));
+        memcpy(det->p, rec->p, sizeof(det->p));
+
+        zarray_add(detections, &det);
     }
 
-    timeprofile_stamp(td->tp, "reconcile");
+    return detections;
+}
 
-    ////////////////////////////////////////////////////////////////
-    // Produce final debug output
-    if (td->debug) {
+int apriltag_detector_detect_into_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                      image_u8_t *im_orig,
+                                      apriltag_detection_record_t *dets, int maxdets)
+{
+    memstat_t *scope = memstat_scope_set(ctx->memory);
+    zarray_t *records = detect_records(td, ctx, im_orig, APRILTAG_FORMAT_GRAY8);
+    memstat_scope_set(scope);
 
-        image_u8_t *darker = image_u8_copy(im_orig);
-        image_u8_darken(darker);
-        image_u8_darken(darker);
+    int n = zarray_size(records);
+    if (n > 0 && maxdets > 0)
+        memcpy(dets, records->data, imin(n, maxdets) * sizeof(apriltag_detection_record_t));
 
-        // assume letter, which is 612x792 points.
-        FILE *f = fopen("debug_output.ps", "w");
-        fprintf(f, "%%!PS\n\n");
-        double scale = fmin(612.0/darker->width, 792.0/darker->height);
-        fprintf(f, "%f %f scale\n", scale, scale);
-        fprintf(f, "0 %d translate\n", darker->height);
-        fprintf(f, "1 -1 scale\n");
-        postscript_image(f, darker);
+    return n;
+}
 
-        image_u32_t *out = image_u32_create_from_u8(darker);
-        for (int detidx = 0; detidx < zarray_size(detections); detidx++) {
-            apriltag_detection_t *det;
-            zarray_get(detections, detidx, &det);
+zarray_t *apriltag_detector_detect_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                       image_u8_t *im_orig)
+{
+    memstat_t *scope = memstat_scope_set(ctx->memory);
+    zarray_t *records = detect_records(td, ctx, im_orig, APRILTAG_FORMAT_GRAY8);
+    memstat_scope_set(scope);
 
-            if (det->hamming > 3)
-                continue;
+    return detections_from_records(records);
+}
 
-            // d |----| c
-            //   |    |
-            //   |    |
-            // a |----| b
+zarray_t *apriltag_detector_detect_rois_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                            image_u8_t *im_orig,
+                                            const apriltag_roi_t *rois, int nrois)
+{
+    memstat_t *scope = memstat_scope_set(ctx->memory);
+    zarray_t *records = apriltag_scratch_detections(ctx->scratch,
+                                                    sizeof(apriltag_detection_record_t));
+
+    if (detect_init(td, ctx)) {
+        if (td->capture)
+            ctx->capture = apriltag_capture_begin(td->capture, im_orig);
+
+        ctx->bayer = NULL;
+        ctx->stats.tracked = 0;
+        detect_rois(ctx, im_orig, rois, nrois, records);
+        detect_finish(ctx, records);
+    }
+    memstat_scope_set(scope);
 
-            double a[2], b[2], c[2], d[2];
+    return detections_from_records(records);
+}
 
-            homography_project(det->H, -1, -1, &a[0], &a[1]);
-            homography_project(det->H,  1, -1, &b[0], &b[1]);
-            homography_project(det->H,  1,  1, &c[0], &c[1]);
-            homography_project(det->H, -1,  1, &d[0], &d[1]);
+// The luma of img: for the planar formats, the Y plane itself, as
+// *plane; for the packed ones, the Y samples gathered into
+// ctx->scratch. For a bayer mosaic and for the color formats, the
+// pixels as they are, as *plane, which detect_records converts.
+// Returns NULL if the format is unknown.
+static image_u8_t *image_luma(apriltag_detect_context_t *ctx, const apriltag_image_t *img,
+                              image_u8_t *plane)
+{
+    int w = img->width, h = img->height;
+
+    switch (img->format) {
+        case APRILTAG_FORMAT_GRAY8:
+        case APRILTAG_FORMAT_NV12:
+        case APRILTAG_FORMAT_I420:
+        case APRILTAG_FORMAT_BAYER:
+        case APRILTAG_FORMAT_RGB:
+        case APRILTAG_FORMAT_BGR:
+        case APRILTAG_FORMAT_RGBA:
+        case APRILTAG_FORMAT_BGRA: {
+            image_u8_t tmp = { .width = w, .height = h, .stride = img->stride, .buf = img->buf };
+            memcpy(plane, &tmp, sizeof(image_u8_t));
+            return plane;
+        }
 
-            float scale = ((float[]) {1.0, 0.6, 0.3, 0.1 })[det->hamming];
+        case APRILTAG_FORMAT_YUYV:
+        case APRILTAG_FORMAT_UYVY: {
+            // (image_u8_t has no pixel step, so the Ys can't be used
+            // where they are.)
+            image_u8_t *luma = apriltag_scratch_image(&ctx->scratch->luma, w, h);
+            int offset = img->format == APRILTAG_FORMAT_UYVY;
 
-            image_u32_draw_line(out, a[0], a[1], b[0], b[1], rgb_scale(0xff0000, scale), 3);
-            image_u32_draw_line(out, a[0], a[1], d[0], d[1], rgb_scale(0x00ff00, scale), 3);
-            image_u32_draw_line(out, b[0], b[1], c[0], c[1], rgb_scale(0xff88ff, scale), 3);
-            image_u32_draw_line(out, d[0], d[1], c[0], c[1], rgb_scale(0x88ffff, scale), 3);
+            for (int y = 0; y < h; y++) {
+                const uint8_t *src = &img->buf[y*img->stride + offset];
+                uint8_t *dst = &luma->buf[y*luma->stride];
 
-            fprintf(f, "1 0 0 setrgbcolor %f %f moveto %f %f lineto stroke\n", a[0], a[1], b[0], b[1]);
-            fprintf(f, "0 1 0 setrgbcolor %f %f moveto %f %f lineto stroke\n", a[0], a[1], d[0], d[1]);
-            fprintf(f, "1 .5 1 setrgbcolor %f %f moveto %f %f lineto stroke\n", b[0], b[1], c[0], c[1]);
-            fprintf(f, ".5 1 1 setrgbcolor %f %f moveto %f %f lineto stroke\n", d[0], d[1], c[0], c[1]);
+                for (int x = 0; x < w; x++)
+                    dst[x] = src[2*x];
+            }
+
+            return luma;
         }
+    }
 
-        image_u32_write_pnm(out, "debug_output.pnm");
+    return NULL;
+}
 
-        image_u8_destroy(darker);
-        image_u32_destroy(out);
+zarray_t *apriltag_detector_detect_image_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                             const apriltag_image_t *img)
+{
+    memstat_t *scope = memstat_scope_set(ctx->memory);
 
-        fclose(f);
+    image_u8_t plane;
+    image_u8_t *im = image_luma(ctx, img, &plane);
+
+    if (im == NULL) {
+        memstat_scope_set(scope);
+        printf("apriltag.c: Unknown image format %d.\n", img->format);
+        return zarray_create(sizeof(apriltag_detection_t*));
     }
 
-    // deallocate
-    if (td->debug) {
-        FILE *f = fopen("debug_quads.ps", "w");
-        fprintf(f, "%%!PS\n\n");
+    int format = APRILTAG_FORMAT_GRAY8;
+    if (img->format == APRILTAG_FORMAT_BAYER || image_color(img->format) >= 0)
+        format = img->format;
 
-        image_u8_t *im = image_u8_copy(im_orig);
-        image_u8_darken(im);
-        image_u8_darken(im);
+    zarray_t *records = detect_records(td, ctx, im, format);
+    memstat_scope_set(scope);
 
-        // assume letter, which is 612x792 points.
-        double scale = fmin(612.0/im->width, 792.0/im->height);
-        fprintf(f, "%f %f scale\n", scale, scale);
-        fprintf(f, "0 %d translate\n", im->height);
-        fprintf(f, "1 -1 scale\n");
+    return detections_from_records(records);
+}
 
-        postscript_image(f, im);
+void apriltag_detect_context_reset_tracking(apriltag_detect_context_t *ctx)
+{
+    zarray_clear(ctx->tracks);
+    ctx->track_frames = 0;
 
-        for (int i = 0; i < zarray_size(quads); i++) {
-            struct quad *q;
-            zarray_get_volatile(quads, i, &q);
+    ctx->nauto_edges = 0;
+    ctx->auto_ndetections = 0;
+    ctx->auto_decimate = 0;
 
-            float rgb[3];
-            int bias = 100;
+    zarray_clear(ctx->motion_detections);
+    ctx->motion_ref = -1;
+    ctx->motion_frames = 0;
+}
 
-            for (int i = 0; i < 3; i++)
-                rgb[i] = bias + (random() % (255-bias));
+// The statistics of the last frame detected with td's own context are
+// also left in td.
+static void detector_copy_stats(apriltag_detector_t *td)
+{
+    td->nquads = td->ctx->stats.nquads;
+    td->nborder_rejected = td->ctx->stats.nborder_rejected;
+    td->ncode_rejected = td->ctx->stats.ncode_rejected;
+    td->tracked = td->ctx->stats.tracked;
+}
 
-            fprintf(f, "%f %f %f setrgbcolor\n", rgb[0]/255.0f, rgb[1]/255.0f, rgb[2]/255.0f);
-            fprintf(f, "%f %f moveto %f %f lineto %f %f lineto %f %f lineto %f %f lineto stroke\n",
-                    q->p[0][0], q->p[0][1],
-                    q->p[1][0], q->p[1][1],
-                    q->p[2][0], q->p[2][1],
-                    q->p[3][0], q->p[3][1],
-                    q->p[0][0], q->p[0][1]);
-        }
+int apriltag_detector_detect_into(apriltag_detector_t *td, image_u8_t *im_orig,
+                                  apriltag_detection_record_t *dets, int maxdets)
+{
+    int n = apriltag_detector_detect_into_ctx(td, td->ctx, im_orig, dets, maxdets);
+    detector_copy_stats(td);
 
-        fclose(f);
-    }
+    return n;
+}
 
-    timeprofile_stamp(td->tp, "debug output");
+int apriltag_detector_detect_buffer(apriltag_detector_t *td, uint8_t *buf,
+                                    int width, int height, int stride,
+                                    apriltag_detection_record_t *dets, int maxdets)
+{
+    image_u8_t im = { .width = width, .height = height, .stride = stride, .buf = buf };
 
-    for (int i = 0; i < zarray_size(quads); i++) {
-        struct quad *quad;
-        zarray_get_volatile(quads, i, &quad);
-        matd_destroy(quad->H);
-        matd_destroy(quad->Hinv);
-    }
+    return apriltag_detector_detect_into(td, &im, dets, maxdets);
+}
 
-    zarray_destroy(quads);
+zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+    zarray_t *detections = apriltag_detector_detect_ctx(td, td->ctx, im_orig);
+    detector_copy_stats(td);
 
-    zarray_sort(detections, detection_compare_function);
-    timeprofile_stamp(td->tp, "cleanup");
+    return detections;
+}
+
+zarray_t *apriltag_detector_detect_rois(apriltag_detector_t *td, image_u8_t *im_orig,
+                                        const apriltag_roi_t *rois, int nrois)
+{
+    zarray_t *detections = apriltag_detector_detect_rois_ctx(td, td->ctx, im_orig, rois, nrois);
+    detector_copy_stats(td);
 
     return detections;
 }
 
+zarray_t *apriltag_detector_detect_image(apriltag_detector_t *td, const apriltag_image_t *img)
+{
+    zarray_t *detections = apriltag_detector_detect_image_ctx(td, td->ctx, img);
+    detector_copy_stats(td);
+
+    return detections;
+}
+
+void apriltag_detector_reset_tracking(apriltag_detector_t *td)
+{
+    apriltag_detect_context_reset_tracking(td->ctx);
+}
+
 
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detections_destroy(zarray_t *detections)
@@ -44,17 +44,30 @@ extern "C" {
 #include "common/zarray.h"
 #include "common/workerpool.h"
 #include "common/timeprofile.h"
+#include "common/memstat.h"
+#include "common/perfcount.h"
 #include <pthread.h>
 
 #define APRILTAG_TASKS_PER_THREAD_TARGET 10
 
+// the number of recent frames whose tags choose the decimation (see
+// auto_decimate).
+#define APRILTAG_AUTO_DECIMATE_FRAMES 8
+
+// the working memory needed to search a pixel (after decimation), by
+// which td->tile_memory is divided into tiles. (The media images peak
+// at about 43; the rest is headroom for images with more clusters, so
+// that a tile doesn't exceed td->tile_memory.)
+#define APRILTAG_TILE_BYTES_PER_PIXEL 48
+
 struct quad
 {
     float p[4][2]; // corners
 
     // H: tag coordinates ([-1,1] at the black corners) to pixels
     // Hinv: pixels to tag
-    matd_t *H, *Hinv;
+    // (row-major 3x3; see homography33_compute_quad.)
+    double H[9], Hinv[9];
 };
 
 // Represents a tag family. Every tag belongs to a tag family. Tag
@@ -117,6 +130,30 @@ struct apriltag_quad_thresh_params
 
     // should the thresholded image be deglitched? This
     int deglitch;
+
+    // Find connected components over horizontal runs of edge pixels,
+    // rather than over individual pixels? The components are the
+    // same, but the memory and time needed scale with the number of
+    // runs rather than with the image size.
+    int run_components;
+
+    // Fit lines to the windows of points around each candidate corner
+    // with integer moments and single precision, rather than in
+    // double precision. The windows only rank the candidates; the
+    // edges of the quads are still fit in double precision.
+    int fixed_line_fit;
+
+    // When zero or more, the threshold's tile statistics (and
+    // binarized pixels) are kept from one frame to the next, and only
+    // the tiles with a pixel that changed by more than tile_tolerance
+    // (in pixel values, up to 255) are recomputed, and only the pixels
+    // near them rebinarized. A change within the tolerance is then
+    // not seen until the tile changes by more. They are reused only
+    // when each frame is searched whole, once (not with
+    // quad_pyramid_levels, regions of interest, tracking, motion
+    // gating or bayer mosaics), and at the same size. -1 (the default)
+    // recomputes every tile.
+    int tile_tolerance;
 };
 
 struct apriltag_quad_contour_params
@@ -150,9 +187,192 @@ struct apriltag_quad_contour_params
 
   // how many pixels to skip near corners (affine offset)
   float corner_skip_bias;
+
+  // find the contours with contour_detect_sweep_u1 (default) rather
+  // than contour_detect_u1. The quads are the same, but the holes and
+  // the contours too small to be quads are dropped during the sweep.
+  int line_sweep;
+
+  // with line_sweep, threshold each row as the sweep reaches it
+  // (default), rather than the whole image first, so that the
+  // thresholded image is never held (its time is then counted in
+  // APRILTAG_STAGE_SEGMENT's). Not in debug mode, which writes the
+  // thresholded image.
+  int stream_threshold;
   
 };
 
+struct apriltag_quad_gradient_params
+{
+    // edge pixels have a gradient of at least this much (the
+    // difference of their neighbours on either side, in pixel values).
+    int min_magnitude;
+
+    // neighbouring edge pixels are joined into one segment as long as
+    // their gradient directions span no more than this (in radians).
+    float max_angle_range;
+
+    // segments shorter than this (in pixels), or further from a
+    // straight line than max_line_fit_mse (mean squared error, in
+    // pixels squared), are rejected.
+    int min_segment_length;
+    float max_line_fit_mse;
+
+    // how far the end of one side may be from the start of the next
+    // at a corner: corner_gap_bias pixels plus corner_gap_scl times
+    // the length of the shorter of them.
+    float corner_gap_scl;
+    float corner_gap_bias;
+
+    // Reject corners whose angle is within this of straight or of 180
+    // degrees (in radians).
+    float critical_rad;
+
+    // minimum length of side, and minimum aspect ratio of
+    // quadrilateral (as for quad_contours).
+    int min_side_length;
+    float min_aspect;
+
+    // every side must be covered by a segment at least this fraction
+    // of its length.
+    float min_side_coverage;
+};
+
+// The stages of a detection, whose times are recorded in
+// apriltag_stats_t.
+enum apriltag_stage
+{
+    APRILTAG_STAGE_INIT,
+    APRILTAG_STAGE_PREPROCESS, // decimation and blur
+    APRILTAG_STAGE_THRESHOLD,  // (and deglitching)
+    APRILTAG_STAGE_SEGMENT,    // edges and connected components, or contours
+    APRILTAG_STAGE_CLUSTER,    // gathering the boundary points of each component
+    APRILTAG_STAGE_QUAD_FIT,
+    APRILTAG_STAGE_DECODE,     // (and refinement)
+    APRILTAG_STAGE_RECONCILE,
+    APRILTAG_STAGE_OTHER,      // debug output and cleanup
+    APRILTAG_NSTAGES
+};
+
+// What was left out of a frame to keep to td->budget_utime (see
+// apriltag_stats_t).
+enum apriltag_degradation
+{
+    APRILTAG_DEGRADED_REFINE = 1, // quads decoded without refine_pose and refine_decode
+    APRILTAG_DEGRADED_QUADS = 2,  // quads left undecoded
+    APRILTAG_DEGRADED_SEARCH = 4, // parts of the search skipped: clusters, pyramid levels, ...
+};
+
+// The name of a stage (e.g. "threshold"), or NULL if there is no such
+// stage.
+const char *apriltag_stage_name(int stage);
+
+// Why candidates were rejected, whichever quad detector found them
+// (see apriltag_stats_t.nrejected).
+enum apriltag_reject
+{
+    APRILTAG_REJECT_CLUSTER_PIXELS, // too few points (min_cluster_pixels, a contour's perimeter), or too many
+    APRILTAG_REJECT_CLUSTER_SIZE,   // smaller than min_tag_size, or larger than max_tag_size
+    APRILTAG_REJECT_CORNERS,        // no four corners could be chosen
+    APRILTAG_REJECT_LINE_FIT,       // an edge too far from a line (max_line_fit_mse), or not found
+    APRILTAG_REJECT_SHAPE,          // sides too short or uneven, corners too sharp, not convex
+    APRILTAG_REJECT_BORDER,         // border contrast below decode_min_border_contrast
+    APRILTAG_REJECT_CODE,           // no code within the hamming distance of the bits
+    APRILTAG_NREJECTS
+};
+
+// The name of a reason for rejection (e.g. "line fit"), or NULL.
+const char *apriltag_reject_name(int reject);
+
+// What the memory of a detector holds (see apriltag_detector_memory).
+enum apriltag_memory
+{
+    APRILTAG_MEMORY_DECODE_TABLES, // the decode tables of its families (shared by the detectors using them)
+    APRILTAG_MEMORY_IMAGES,        // the images of a frame: decimated, blurred, thresholded, edges, ...
+    APRILTAG_MEMORY_UNIONFIND,     // the connected components of a frame
+    APRILTAG_MEMORY_BUFFERS,       // the other buffers of a frame: tiles, runs, clusters, quads, ...
+    APRILTAG_MEMORY_WORKERPOOL,    // its thread pool (not its threads' stacks)
+    APRILTAG_NMEMORY
+};
+
+// The name of a category of memory (e.g. "images"), or NULL.
+const char *apriltag_memory_name(int category);
+
+// Statistics of a frame. Counts are summed over every search of the
+// frame (e.g. each level of the pyramid search).
+typedef struct apriltag_stats apriltag_stats_t;
+struct apriltag_stats
+{
+    // microseconds spent in each stage, and in all of them.
+    int64_t stage_utime[APRILTAG_NSTAGES];
+    int64_t utime;
+
+    // the candidates (connected components, or contours) considered
+    // for quads, and how many were rejected by their size before a
+    // quad was fit to them.
+    uint32_t nclusters;
+    uint32_t ncluster_rejected;
+
+    // the quads fit to the remaining candidates, and those which were
+    // not quads (fit_quad failed, or the contour wasn't a
+    // quadrilateral).
+    uint32_t nquad_fit_rejected;
+    uint32_t nquads;
+
+    // of the quads (times the number of families), how many were
+    // rejected by their border, and how many passed the border check
+    // but did not decode.
+    uint32_t nborder_rejected;
+    uint32_t ncode_rejected;
+
+    // the same rejections, by reason: of the clusters (the first
+    // two), of the quads fit (the next three; those of the gradient
+    // detector that didn't fit for want of room are not counted), and
+    // of the quads decoded (the last two).
+    uint32_t nrejected[APRILTAG_NREJECTS];
+
+    // the quads not decoded at all, because the tags expected (see
+    // max_detections and expected_ids) had been found already.
+    uint32_t nquads_skipped;
+
+    // the detections removed as duplicates of others, and those
+    // reported.
+    uint32_t nreconcile_rejected;
+    uint32_t ndetections;
+
+    // Non-zero if the frame was only searched near tracked tags, and
+    // the quads near where a tracked tag was predicted to be that read
+    // as its code (and so were not looked up in the decode tables).
+    int tracked;
+    uint32_t nverified;
+
+    // When the frame was compared to the previous one (see
+    // motion_interval), the number of tiles, and of those that had
+    // changed (otherwise zero), and the tags carried forward.
+    uint32_t ntiles, ntiles_changed;
+    uint32_t ncarried;
+
+    // The decimation the frame was searched at (the finest, see
+    // quad_pyramid_levels): quad_decimate, or as chosen by
+    // auto_decimate.
+    float decimate;
+
+    // Non-zero (the enum apriltag_degradation flags of what was left
+    // out) if the frame ran out of time (see td->budget_utime), in
+    // which case its detections are only those found in time.
+    int degraded;
+
+    // Non-zero if the frame was segmented on the GPU (see td->gpu).
+    int gpu;
+
+    // With td->perf_counters, and if the hardware counters could be
+    // read (perf_counted), what each stage cost (enum perfcount_event,
+    // see perfcount.h), summed over the threads it ran on: e.g. its
+    // instructions per cycle, and its cache misses per instruction.
+    int perf_counted;
+    uint64_t stage_counts[APRILTAG_NSTAGES][PERFCOUNT_N];
+};
+
 // Represents a detector object. Upon creating a detector, all fields
 // are set to reasonable values, but can be overridden by accessing
 // these fields.
@@ -162,7 +382,10 @@ struct apriltag_detector
     ///////////////////////////////////////////////////////////////
     // User-configurable parameters.
 
-    // How many threads should be used?
+    // How many threads should be used? It may be changed between
+    // frames: the threads of td's pools are parked or unparked (see
+    // workerpool_set_nthreads) by the next frame, rather than started
+    // over.
     int nthreads;
 
     // detection of quads can be done on a lower-resolution image,
@@ -171,19 +394,53 @@ struct apriltag_detector
     // still done at full resolution. .
     float quad_decimate;
 
+    // When greater than quad_decimate, the decimation is chosen for
+    // each frame, between quad_decimate and auto_decimate, from the
+    // tags found in the last APRILTAG_AUTO_DECIMATE_FRAMES frames: the
+    // largest step (1.5, 2, 3, 4, ...) at which the shortest edge of
+    // any of them would still be auto_decimate_edge decimated pixels
+    // long. It only rises once there is a step's worth of margin to
+    // spare, and falls back to quad_decimate as soon as a frame finds
+    // fewer tags than the one before (or none have been seen). The
+    // blur (quad_sigma, in decimated pixels) is scaled with it, so as
+    // to be the same in the input image. Zero (the default) always
+    // uses quad_decimate.
+    float auto_decimate;
+    float auto_decimate_edge;
+
+    // When greater than one, quads are first searched for at a
+    // coarse decimation (quad_decimate * 2^(quad_pyramid_levels-1)),
+    // and then at each finer level down to quad_decimate, but only in
+    // the parts of the image not already covered by a tag found at a
+    // coarser level. Large (near) tags are then found cheaply at the
+    // coarse levels, and small (far) tags at the fine levels. Quads
+    // from every level are refined at full resolution (see
+    // refine_edges).
+    int quad_pyramid_levels;
+
     // What Gaussian blur should be applied to the segmented image
     // (used for quad detection?)  Parameter is the standard deviation
     // in pixels.  Very noisy images benefit from non-zero values
     // (e.g. 0.8).
     float quad_sigma;
 
+    // Tags are expected to be between min_tag_size and max_tag_size
+    // pixels across (the larger side of the bounding box of their
+    // border, in the input image). Clusters and contours outside of
+    // these bounds are rejected before any quad fitting. Zero (the
+    // default) means no bound.
+    int min_tag_size, max_tag_size;
+
     // When non-zero, the edges of the each quad are adjusted to "snap
     // to" strong gradients nearby. This is useful when decimation is
     // employed, as it can increase the quality of the initial quad
     // estimate substantially. Generally recommended to be on (1).
     //
     // Very computationally inexpensive. Option is ignored if
-    // quad_decimate = 1.
+    // quad_decimate = 1, unless it is 2: then the edges are refined
+    // at every decimation, which makes corners more accurate (to a
+    // few hundredths of a pixel on clean edges) at a small part of
+    // the cost of decoding.
     int refine_edges;
 
     // when non-zero, detections are refined in a way intended to
@@ -194,35 +451,167 @@ struct apriltag_detector
 
     // when non-zero, detections are refined in a way intended to
     // increase the accuracy of the extracted pose. This is done by
-    // maximizing the contrast around the black and white border of
-    // the tag. This generally increases the number of successfully
-    // detected tags, though not as effectively (or quickly) as
-    // refine_decode.
+    // fitting the corners to the edge of the tag (sampled along the
+    // image gradient) with a few Gauss-Newton (Levenberg-Marquardt)
+    // iterations. This generally increases the number of successfully
+    // detected tags, though not as effectively as refine_decode.
     //
     // This option must be enabled in order for "goodness" to be
     // computed.
     int refine_pose;
 
+    // When greater than zero, "goodness" is computed from this many
+    // samples across each bit cell of the tag's white and black
+    // borders, rather than from every pixel in them: it then costs
+    // about as much for a near tag as for a far one. Zero (the
+    // default) uses every pixel.
+    int goodness_samples;
+
+    // when non-zero, the bits of a tag are decoded from bilinearly
+    // interpolated samples rather than from the pixel that contains
+    // each sample point. Somewhat more robust for small or blurry
+    // tags.
+    int decode_bilinear;
+
+    // quads whose white border is not lighter than their black border
+    // by at least this much (in pixel values) are rejected before
+    // their bits are decoded. The default of 0 rejects only borders
+    // of reversed polarity (white darker than black); flat borders
+    // still pass. Raising it makes cluttered frames cheaper to
+    // decode, at the risk of losing low-contrast tags.
+    float decode_min_border_contrast;
+
+    // When the tags in view are known in advance, detection can stop
+    // as soon as they have been found: once max_detections tags have
+    // been decoded (when it is greater than zero), or once every one
+    // of the nexpected_ids ids in expected_ids (of any family) has
+    // been, the remaining quads are neither refined nor decoded, and
+    // no finer pyramid level (see quad_pyramid_levels) is searched.
+    // The quads are then decoded largest first, since near tags are
+    // the likeliest to be real. expected_ids belongs to the caller.
+    // Zero and NULL (the defaults) decode every quad.
+    int max_detections;
+    const int *expected_ids;
+    int nexpected_ids;
+
+    // When greater than zero, the time allowed for each frame, in
+    // microseconds. Once the decoding of the quads looks like it will
+    // overrun it, they are decoded without refine_pose and
+    // refine_decode; once it has run out, the remaining quads are not
+    // decoded, and no more of the image is searched for quads (the
+    // thresholded, contour and gradient quad detectors each check
+    // between their stages, and between the clusters, contours or
+    // segments they fit quads to). The quads are decoded largest
+    // first. The frame then returns what it found in time, with
+    // stats.degraded set. A frame can still overrun by as much as a
+    // stage, or a single fit, in progress takes. Zero (the default) takes as long as it
+    // takes.
+    int64_t budget_utime;
+
     // When non-zero, write a variety of debugging images to the
     // current working directory at various stages through the
     // detection process. (Somewhat slow).
     int debug;
 
+    // When set (see apriltag_capture.h), the frames the capture samples
+    // are copied into its ring, with their threshold image, clusters,
+    // quads and detections, and drawn and written by its own thread:
+    // a cheap td->debug for live systems, which costs a copy of each
+    // frame sampled, and an atomic increment for the others. The
+    // caller still "owns" the capture, which must outlive td.
+    struct apriltag_capture *capture;
+
     int quad_contours;
 
+    // use the gradient-based quad detector (see
+    // apriltag_quad_gradient.c) instead? Set with
+    // apriltag_detector_enable_quad_gradient.
+    int quad_gradient;
+
     union { 
       struct apriltag_quad_thresh_params qtp;
       struct apriltag_quad_contour_params qcp;
+      struct apriltag_quad_gradient_params qgp;
     };
 
+    // apriltag_detector_detect_rois grows each region of interest by
+    // this many pixels (of the original image) on every side, so that
+    // tags near its boundary are still found.
+    int roi_margin;
+
+    // When greater than zero, apriltag_detector_detect tracks tags
+    // from one frame to the next: it only searches near where the
+    // tags of the previous frame are predicted to be, and searches
+    // the whole frame every track_interval frames, or as soon as a
+    // tracked tag is lost. Zero (the default) searches every frame
+    // in full.
+    int track_interval;
+
+    // When greater than zero (and track_interval is zero),
+    // apriltag_detector_detect only searches the parts of each frame
+    // that changed since the previous one, for cameras that see a
+    // mostly static scene: the frames are compared in tiles (of 32
+    // pixels, by the sums of the absolute differences of 4x reduced
+    // copies), and the tiles whose mean difference is more than
+    // motion_threshold (in pixel values), and their neighbors, are
+    // searched (grown by roi_margin). The tags of the previous frame
+    // clear of them are carried forward as they were. The whole frame
+    // is searched every motion_interval frames. Zero (the default)
+    // searches every frame in full.
+    int motion_interval;
+    float motion_threshold;
+
+    // When greater than zero, apriltag_detector_detect searches
+    // images too large to be searched within this many bytes of
+    // working memory (at about APRILTAG_TILE_BYTES_PER_PIXEL bytes per
+    // pixel searched, i.e. after decimation) in overlapping tiles that
+    // can be, so that the memory needed besides the image itself does
+    // not grow with it. The tiles overlap by max_tag_size (or by a
+    // quarter of a tile, if that is not set), so that every tag small
+    // enough lies wholly within one; tags found in more than one are
+    // reported once. Not used by the pyramid search
+    // (quad_pyramid_levels). Zero (the default) searches the whole
+    // image at once.
+    size_t tile_memory;
+
+    // When greater than zero, the statistics of the last stats_window
+    // frames of each context are kept, for
+    // apriltag_detect_context_percentile_utime.
+    int stats_window;
+
+    // When non-zero, apriltag_quad_thresh's segmentation of each
+    // image (its decimation and blur, threshold, deglitching, edges
+    // and connected components, over pixels) runs on the GPU, with
+    // OpenCL (see apriltag_gpu.h), and the quads are then fit and
+    // decoded on the CPU as usual. The detections are the same, but
+    // that every tile is thresholded (see qtp.tile_tolerance). Not for
+    // quad_contours or quad_gradient, a quad_decimate of 1.5, or an
+    // undecimated bayer frame, which are segmented on the CPU, as is
+    // every frame when there is no OpenCL GPU (see stats.gpu). Zero
+    // (the default) uses the CPU.
+    int gpu;
+
+    // If set, count the cycles, instructions, cache misses and branch
+    // misses of each stage, on every thread (see
+    // stats.stage_counts). Costs a read of the counters at each stage,
+    // and on each worker thread around each task.
+    int perf_counters;
+
     ///////////////////////////////////////////////////////////////
-    // Statistics relating to last processed frame
+    // Statistics relating to the last frame processed by
+    // apriltag_detector_detect (or _detect_into, _detect_rois). See
+    // apriltag_stats_t, and apriltag_detector_stats.
     timeprofile_t *tp;
 
     uint32_t nedges;
     uint32_t nsegments;
     uint32_t nquads;
 
+    uint32_t nborder_rejected;
+    uint32_t ncode_rejected;
+
+    int tracked;
+
     ///////////////////////////////////////////////////////////////
     // Internal variables below
 
@@ -231,11 +620,188 @@ struct apriltag_detector
     // tag family passed into the constructor.
     zarray_t *tag_families;
 
-    // Used to manage multi-threading.
+    // The workerpool given by apriltag_detector_set_workerpool (which
+    // is not ours to destroy), or NULL.
     workerpool_t *wp;
 
+    // The context used by apriltag_detector_detect (and _detect_into,
+    // _detect_rois).
+    struct apriltag_detect_context *ctx;
+
+    // The families given to apriltag_detector_stage_families, and
+    // those they replaced (see apriltag.c), or NULL if it was never
+    // called.
+    struct apriltag_family_stage *family_stage;
+};
+
+// The state of the calls of a detector which is used by several
+// threads at once: the statistics, threads, reused buffers and
+// tracked tags of one call at a time. A detector (and the decode
+// tables of its families) can serve any number of threads
+// concurrently, each calling apriltag_detector_detect_ctx with a
+// context of its own. (apriltag_detector_detect uses a context of the
+// detector's own, and so may only be called by one thread at a time.)
+//
+// The parameters and families of the detector must not be changed
+// while it is in use, except through apriltag_detector_stage_families.
+typedef struct apriltag_detect_context apriltag_detect_context_t;
+struct apriltag_detect_context
+{
+    ///////////////////////////////////////////////////////////////
+    // Statistics relating to last processed frame
+    timeprofile_t *tp;
+    apriltag_stats_t stats;
+
+    ///////////////////////////////////////////////////////////////
+    // Internal variables below
+
+    // The utime (see apriltag_stats_t) of each stage and of the whole
+    // frame, for the last nhistory (up to td->stats_window) frames:
+    // history[i * (APRILTAG_NSTAGES + 1) + stage], a ring of rows
+    // starting at history_next - nhistory.
+    int64_t *history;
+    int history_alloc, nhistory, history_next;
+
+    // The detector of the current call.
+    apriltag_detector_t *td;
+
+    // The families of the current call (td->tag_families as it
+    // starts), and the number of times td's staged families had been
+    // swapped in then, which tells the context's tracks are of
+    // families it no longer has.
+    zarray_t *families;
+    int families_swaps;
+
+    // Used to manage multi-threading: the detector's workerpool if it
+    // has one, and otherwise one of our own (wp_owned) of the
+    // detector's nthreads threads. nthreads is the number of threads
+    // of wp.
+    workerpool_t *wp;
+    int wp_owned;
+    int nthreads;
+
     // Used for thread safety.
     pthread_mutex_t mutex;
+
+    // Buffers reused from one call to the next. See
+    // apriltag_scratch.h.
+    struct apriltag_scratch *scratch;
+
+    // The bytes of the buffers, by enum apriltag_memory (see
+    // memstat.h); the calls using ctx are its scope.
+    memstat_t memory[APRILTAG_NMEMORY];
+
+    // With td->perf_counters: the counts of the calling thread at the
+    // last stamp, and those of the worker threads' tasks since (see
+    // perfcount.h), which is the calling thread's sink while
+    // detecting.
+    uint64_t perf_last[PERFCOUNT_N];
+    uint64_t perf_sink[PERFCOUNT_N];
+
+    // Tracking state: the tags of the previous frame (see
+    // apriltag.c), and the number of frames since the last
+    // full-frame search.
+    zarray_t *tracks;
+    int track_frames;
+
+    // Motion gating state (see td->motion_interval): the tags of the
+    // previous frame (apriltag_detection_record_t), which of
+    // scratch->motion holds its reduced copy (or -1 if there isn't
+    // one), and the number of frames since the last full-frame
+    // search.
+    zarray_t *motion_detections;
+    int motion_ref;
+    int motion_frames;
+
+    // The current frame, if it is a bayer mosaic (see
+    // apriltag_image_t), in which case the image detected is its luma
+    // (scratch->luma).
+    image_u8_t *bayer;
+
+    // Set once the tags expected of the current frame have been found
+    // (see td->max_detections), the number of td->expected_ids found
+    // so far, and whether each of them has been (all atomically, in
+    // the scratch).
+    int complete;
+    int nexpected_found;
+    uint8_t *expected_found;
+
+    // The utime (see utime_now) by which the current frame is to be
+    // done, or zero (see td->budget_utime).
+    int64_t deadline;
+
+    // The time the last quad decoded under a deadline took, without
+    // and with refinement (td->refine_pose, td->refine_decode), from
+    // which the time left quads will take is predicted. Kept from
+    // frame to frame.
+    int64_t quad_utime[2];
+
+    // Set while the image searched for quads is the whole frame
+    // (rather than a region of it).
+    int whole_frame;
+
+    // The decimation and blur of the current frame (td->quad_decimate
+    // and td->quad_sigma, unless td->auto_decimate chose them).
+    float decimate, sigma;
+
+    // The state of td->auto_decimate: the shortest tag edge (in
+    // pixels, or zero if there was no tag) of each of the last
+    // nauto_edges frames, a ring ending before auto_edges_next; the
+    // number of tags of the last frame; and the decimation chosen for
+    // the next (or zero for td->quad_decimate).
+    float auto_edges[APRILTAG_AUTO_DECIMATE_FRAMES];
+    int nauto_edges, auto_edges_next;
+    int auto_ndetections;
+    float auto_decimate;
+
+    // The GPU of td->gpu (see apriltag_gpu.h), created on first use;
+    // gpu_failed once there turned out to be none, or it failed, after
+    // which the CPU is used. gpu_frame is the segmentation of the image
+    // being searched, while it was segmented there (otherwise NULL).
+    struct apriltag_gpu *gpu;
+    int gpu_failed;
+    struct apriltag_gpu_frame *gpu_frame;
+
+    // The capture of the current frame (see td->capture), while it is
+    // sampled (otherwise NULL).
+    struct apriltag_capture_frame *capture;
+};
+
+// A rectangular region of an image, in pixels.
+typedef struct apriltag_roi apriltag_roi_t;
+struct apriltag_roi
+{
+    int x, y;
+    int width, height;
+};
+
+// The layouts of the frames accepted by apriltag_detector_detect_image.
+enum apriltag_image_format
+{
+    APRILTAG_FORMAT_GRAY8, // 8 bit gray
+    APRILTAG_FORMAT_NV12,  // (or NV21): Y plane, then interleaved chroma
+    APRILTAG_FORMAT_I420,  // (or YV12): Y plane, then the chroma planes
+    APRILTAG_FORMAT_YUYV,  // packed 4:2:2, Y first (YUY2)
+    APRILTAG_FORMAT_UYVY,  // packed 4:2:2, U first
+    APRILTAG_FORMAT_BAYER, // 8 bit raw bayer mosaic, of any 2x2 pattern
+    APRILTAG_FORMAT_RGB,   // 8 bit color, 3 bytes a pixel
+    APRILTAG_FORMAT_BGR,   // (e.g. of OpenCV)
+    APRILTAG_FORMAT_RGBA,  // 8 bit color, 4 bytes a pixel (alpha ignored)
+    APRILTAG_FORMAT_BGRA,
+};
+
+// A frame as it comes from a camera, which is detected without first
+// being converted to gray. Only the luma is used: for the planar
+// formats, the first height rows of buf (stride bytes apart) are the
+// Y plane, and the chroma planes that follow are never read; for the
+// color formats, the gray of the pixels.
+typedef struct apriltag_image apriltag_image_t;
+struct apriltag_image
+{
+    int format; // enum apriltag_image_format
+    int width, height;
+    int stride; // bytes from one row to the next (of the Y plane)
+    uint8_t *buf;
 };
 
 // Represents the detection of a tag. These are returned to the user
@@ -283,6 +849,22 @@ struct apriltag_detection
     double p[4][2];
 };
 
+// The same as apriltag_detection_t, but with the homography stored
+// inline (row major), so that a detection is plain data which needs
+// no freeing. See apriltag_detector_detect_into.
+typedef struct apriltag_detection_record apriltag_detection_record_t;
+struct apriltag_detection_record
+{
+    apriltag_family_t *family;
+    int id;
+    int hamming;
+    float goodness;
+    float decision_margin;
+    double H[9];
+    double c[2];
+    double p[4][2];
+};
+
 // don't forget to add a family!
 apriltag_detector_t *apriltag_detector_create();
 
@@ -291,16 +873,107 @@ apriltag_detector_t *apriltag_detector_create();
 void apriltag_detector_enable_quad_contours(apriltag_detector_t* td,
                                             int enable);
 
+// use quad_gradient (a fast path for clean, high-contrast images) or
+// quad_thresh (default)? As for apriltag_detector_enable_quad_contours,
+// resets the quad params to the defaults of the specified algorithm.
+void apriltag_detector_enable_quad_gradient(apriltag_detector_t* td,
+                                            int enable);
+
+// Run td's threaded work on wp, which the caller still "owns" and may
+// share between several detectors (see workerpool.h), rather than on
+// threads of td's own (or, for each apriltag_detect_context_t, of the
+// context's own). td->nthreads is set to the number of threads of wp,
+// which is then resized with workerpool_set_nthreads (td->nthreads is
+// not looked at again): each frame is divided up for the threads wp
+// has when it starts. Pass NULL to go back to pools of td's own.
+void apriltag_detector_set_workerpool(apriltag_detector_t *td, workerpool_t *wp);
+
 // add a family to the apriltag detector. caller still "owns" the family.
-// a single instance should only be provided to one apriltag detector instance.
+// The same instance may be added to several detectors (and those may
+// be used from different threads).
 void apriltag_detector_add_family(apriltag_detector_t *td, apriltag_family_t *fam);
 
+// Build the table used to decode fam's tags, correcting up to
+// maxhamming bit errors (replacing any table fam already has). For a
+// family that does not have one, apriltag_detector_add_family asks for
+// a table with maxhamming = 2, which is built when the detector is
+// first used.
+//
+// Tables are shared: every family object with the same name and codes
+// which asks for the same maxhamming uses the same one, which is freed
+// when the last of them is done with it (i.e. is removed from the last
+// detector it was added to). If the table was compiled into the
+// library (see APRILTAG_DECODE_TABLES in src/CMakeLists.txt), it is
+// used in place and there is nothing to build.
+void apriltag_family_build_decode_table(apriltag_family_t *fam, int maxhamming);
+
+// Decode fam's tags without a table, correcting up to maxhamming bit
+// errors (replacing any table fam already has). Each quad is compared
+// with every code of the family, which takes no memory beyond the
+// codes themselves; use this for the large families and maxhamming
+// values (beyond 3, say) whose tables would be too big.
+void apriltag_family_use_scan_decoder(apriltag_family_t *fam, int maxhamming);
+
+// Decode only the tags of fam with the given ids (of its codes),
+// rejecting quads which are any other tag as if they were no tag at
+// all. The table of fam then holds only the neighbours of those ids'
+// codes, so that for a few ids it is small enough to stay in cache.
+// This replaces any restriction fam had; pass nids = 0 to decode every
+// id again. It takes effect (with a table of the ids, or a scan of
+// just their codes, as fam decodes now) once fam is next used, so call
+// it while no detector is using fam. Returns 0, or -1 (leaving fam
+// unchanged) if an id is not one of fam's.
+int apriltag_family_restrict_ids(apriltag_family_t *fam, const int *ids, int nids);
+
+// Write fam's decode table to a file, which
+// apriltag_family_load_decode_table can map back into memory instead
+// of rebuilding it. The file is only usable on machines of the same
+// byte order. Returns 0 on success (and fails for a family using the
+// scan decoder, which has no table).
+int apriltag_family_save_decode_table(const apriltag_family_t *fam, const char *path);
+
+// Use the decode table saved in a file, which is mapped read only (so
+// that processes using the same file share its pages). Call this
+// before apriltag_detector_add_family. Returns 0 on success, or a
+// negative value (leaving fam unchanged) if the file cannot be read
+// or was not saved from this family (restricted to the same ids, if
+// it is: see apriltag_family_restrict_ids).
+int apriltag_family_load_decode_table(apriltag_family_t *fam, const char *path);
+
+// Decode rcode (the bits of a quad, in the order of fam->codes, in any
+// of the four rotations) as the detector does, with fam's decode table
+// or scan decoder. Returns the id, setting *hamming to the number of
+// bits corrected and *rotation to the number of 90 degree rotations,
+// or -1 if no code is within the decoder's maxhamming. fam must have
+// a decoder (see apriltag_family_build_decode_table).
+int apriltag_family_decode(apriltag_family_t *fam, uint64_t rcode, int *hamming, int *rotation);
+
 // does not deallocate the family.
 void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam);
 
 // unregister all families, but does not deallocate the underlying tag family objects.
 void apriltag_detector_clear_families(apriltag_detector_t *td);
 
+// Replace the families of td with the nfamilies families, without
+// holding up the frames being detected. The decode tables that the
+// families need are acquired (built, if no other family has them) by
+// a thread of td's own, while td goes on detecting the families it
+// has; the first frame to start once they are ready swaps the new
+// families in, and the old ones are let go (as by
+// apriltag_detector_remove_family) once no frame is using them. The
+// tracks of every context are reset by its first frame of the new
+// families. A set staged before, and not yet swapped in, is replaced
+// (after waiting for its tables). Unlike the other changes to the
+// families, this may be called while td is in use (by one thread at a
+// time). Returns 0, or -1 if the thread could not be started.
+int apriltag_detector_stage_families(apriltag_detector_t *td, apriltag_family_t **families,
+                                     int nfamilies);
+
+// Whether families staged by apriltag_detector_stage_families are yet
+// to be swapped in: 1 while their tables are acquired, 2 once they are
+// ready for the next frame, or 0.
+int apriltag_detector_families_staged(apriltag_detector_t *td);
+
 // Destroy the april tag detector (but not the underlying
 // apriltag_family_t used to initialize it.)
 void apriltag_detector_destroy(apriltag_detector_t *td);
@@ -309,8 +982,117 @@ void apriltag_detector_destroy(apriltag_detector_t *td);
 // apriltag_detection_t*. You can use apriltag_detections_destroy to
 // free the array and the detections it contains, or call
 // _detection_destroy and zarray_destroy yourself.
+//
+// im_orig may have any stride, and may be a view into a bigger buffer
+// (see image_u8_view, e.g. a region of a frame, or a padded camera
+// buffer): it is never copied for its layout. Detections are in the
+// coordinates of im_orig.
 zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig);
 
+// Like apriltag_detector_detect, but writes the detections into the
+// caller's array dets, which holds maxdets records, and allocates
+// nothing once the detector has warmed up. Returns the number of
+// detections, which may be more than maxdets (in which case only the
+// first maxdets are written).
+int apriltag_detector_detect_into(apriltag_detector_t *td, image_u8_t *im_orig,
+                                  apriltag_detection_record_t *dets, int maxdets);
+
+// The same as apriltag_detector_detect_into, for the 8 bit gray image
+// of width x height pixels whose rows are stride bytes apart starting
+// at buf (e.g. the data of a numpy array, which is detected in place),
+// for callers such as ctypes that can't readily build an image_u8_t.
+int apriltag_detector_detect_buffer(apriltag_detector_t *td, uint8_t *buf,
+                                    int width, int height, int stride,
+                                    apriltag_detection_record_t *dets, int maxdets);
+
+// Like apriltag_detector_detect, but only looks for tags within the
+// nrois given regions (each grown by td->roi_margin, and clipped to the
+// image). Detections are in the coordinates of im_orig; a tag found in
+// overlapping regions is reported once.
+zarray_t *apriltag_detector_detect_rois(apriltag_detector_t *td, image_u8_t *im_orig,
+                                        const apriltag_roi_t *rois, int nrois);
+
+// Like apriltag_detector_detect, but for a frame in one of the camera
+// formats of apriltag_image_t. The Y plane of a planar frame is
+// detected in place, just as an image_u8_t of it would be (and may
+// likewise be blurred in place, see quad_sigma); the Y samples of a
+// packed YUYV or UYVY frame are gathered into the detector's own
+// buffer first. A bayer mosaic is detected in its luma (see
+// image_u8_bayer_luma_rows, which is written into the detector's own
+// buffer, leaving the mosaic as it is), except that when the whole
+// frame is searched without decimation, quad_thresh thresholds the
+// mosaic itself, separately for each element of the 2x2 pattern, so
+// as to keep its full resolution without mistaking the differences
+// between the color channels for edges. Detections are in the pixels
+// of the frame. A color frame is detected in its gray (see
+// image_u8_color_gray_rows), which is likewise written into the
+// detector's own buffer, by its threads, rather than converted first.
+zarray_t *apriltag_detector_detect_image(apriltag_detector_t *td, const apriltag_image_t *img);
+
+// Forget the tracked tags, so that the next call to
+// apriltag_detector_detect searches the whole frame (and the tags
+// which chose its decimation, see auto_decimate, and the frame that
+// motion_interval compares with). Call this when
+// starting a new image sequence.
+void apriltag_detector_reset_tracking(apriltag_detector_t *td);
+
+// A context for calls of any detector (see apriltag_detect_context_t).
+apriltag_detect_context_t *apriltag_detect_context_create();
+void apriltag_detect_context_destroy(apriltag_detect_context_t *ctx);
+
+// The same as apriltag_detector_detect, _detect_into, _detect_rois,
+// _reset_tracking and _detect_image, but using (and leaving the
+// statistics of the frame in) ctx rather than the detector's own
+// context, so that several threads can use td at once. Each context
+// may only be used by one call at a time.
+zarray_t *apriltag_detector_detect_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                       image_u8_t *im_orig);
+int apriltag_detector_detect_into_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                      image_u8_t *im_orig,
+                                      apriltag_detection_record_t *dets, int maxdets);
+zarray_t *apriltag_detector_detect_rois_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                            image_u8_t *im_orig,
+                                            const apriltag_roi_t *rois, int nrois);
+void apriltag_detect_context_reset_tracking(apriltag_detect_context_t *ctx);
+zarray_t *apriltag_detector_detect_image_ctx(apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                             const apriltag_image_t *img);
+
+// The statistics of the last frame detected with ctx (or, for
+// apriltag_detector_stats, by apriltag_detector_detect and friends).
+const apriltag_stats_t *apriltag_detect_context_stats(const apriltag_detect_context_t *ctx);
+const apriltag_stats_t *apriltag_detector_stats(const apriltag_detector_t *td);
+
+// The p-th percentile (0 <= p <= 100, e.g. 50 or 99) of the time, in
+// microseconds, spent in the given stage by the frames detected with
+// ctx, over the last td->stats_window frames; or of the whole frame,
+// for stage APRILTAG_NSTAGES. Returns -1 if no frame has been
+// recorded (stats_window is zero).
+int64_t apriltag_detect_context_percentile_utime(const apriltag_detect_context_t *ctx,
+                                                 int stage, double p);
+int64_t apriltag_detector_percentile_utime(const apriltag_detector_t *td, int stage, double p);
+
+// The bytes that td holds (with ctx, or its own context), now and at
+// most, of each enum apriltag_memory: mem[category]. The buffers of
+// the frames are counted as they are allocated; the decode tables
+// (whether built, mapped from a file or compiled in) and the pool,
+// which don't change while detecting, as they are now, which is also
+// their peak. A shared pool (see apriltag_detector_set_workerpool) is
+// counted by every detector using it.
+void apriltag_detect_context_memory(const apriltag_detector_t *td, const apriltag_detect_context_t *ctx,
+                                    memstat_t mem[APRILTAG_NMEMORY]);
+void apriltag_detector_memory(const apriltag_detector_t *td, memstat_t mem[APRILTAG_NMEMORY]);
+
+// Record the time since the last stamp of ctx->tp as (some of) the
+// time of stage, and stamp the profile with name. Used by the quad
+// detectors.
+void apriltag_detect_context_stamp(apriltag_detect_context_t *ctx, int stage, const char *name);
+
+// Has the current frame of ctx run out of time (see td->budget_utime)?
+// If so, record that the work which the caller is about to skip
+// (enum apriltag_degradation) was left out. Used by the quad
+// detectors. Safe to call from any of ctx's threads.
+int apriltag_detect_context_expired(apriltag_detect_context_t *ctx, int degradation);
+
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detection_destroy(apriltag_detection_t *det);
 
@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "apriltag.h"
+#include "apriltag_family.h"
+#include "apriltag_vis.h"
+#include "image_u8.h"
+#include "time_util.h"
+
+#include "zarray.h"
+#include "getopt.h"
+#include "string_util.h"
+
+// Times the whole detector on synthetic scenes of tags (rendered with
+// apriltag_vis_texture2), for every combination of the scene
+// parameters (tag size, rotation, blur, noise, tags per frame) and of
+// the detector settings (quad_thresh, quad_contours or quad_gradient, threads,
+// decimation), and reports the time of each stage, the recall and the
+// throughput of each combination as JSON. The "thresh-fixed" runs use
+// quad_thresh's fixed_line_fit, and check its detections against those
+// of the double precision fits.
+
+#define BACKGROUND 128
+
+// The position of a tag in a scene.
+struct truth
+{
+    int id;
+    double c[2];
+};
+
+struct scene_params
+{
+    double size;     // pixels across the black border of each tag
+    double rotation; // degrees
+    double blur;     // sigma of a gaussian blur
+    double noise;    // standard deviation of gaussian noise
+    int ntags;
+};
+
+struct scene
+{
+    image_u8_t *im;
+    struct truth *tags;
+    int ntags;
+};
+
+// The quad detectors.
+enum { QUADS_THRESH, QUADS_THRESH_FIXED, QUADS_CONTOUR, QUADS_GRADIENT, NQUADS };
+static const char *quads_names[NQUADS] = { "thresh", "thresh-fixed", "contour", "gradient" };
+
+struct detector_params
+{
+    int quads; // QUADS_*
+    int nthreads;
+    double decimate;
+};
+
+static uint32_t rand_state;
+
+static double urand()
+{
+    rand_state = rand_state * 1103515245u + 12345u;
+    return ((rand_state >> 8) & 0xffffff) / 16777216.0;
+}
+
+// standard normal (Box-Muller)
+static double nrand()
+{
+    double u = urand(), v = urand();
+    return sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v);
+}
+
+// Parse a comma-separated list of numbers into an array of doubles.
+static zarray_t *parse_list(const char *name, const char *s)
+{
+    zarray_t *values = zarray_create(sizeof(double));
+    zarray_t *words = str_split(s, ",");
+
+    for (int i = 0; i < zarray_size(words); i++) {
+        char *word, *end;
+        zarray_get(words, i, &word);
+
+        double v = strtod(word, &end);
+        if (end == word || *end) {
+            fprintf(stderr, "bad value \"%s\" for --%s\n", word, name);
+            exit(-1);
+        }
+
+        zarray_add(values, &v);
+    }
+
+    zarray_vmap(words, free);
+    zarray_destroy(words);
+
+    if (zarray_size(values) == 0) {
+        fprintf(stderr, "no values for --%s\n", name);
+        exit(-1);
+    }
+
+    return values;
+}
+
+static double list_get(const zarray_t *values, int i)
+{
+    double v;
+    zarray_get(values, i, &v);
+    return v;
+}
+
+// The radius of the circle around a tag (including its white border)
+// rendered with sp.
+static double tag_radius(const apriltag_family_t *tf, const struct scene_params *sp)
+{
+    double scale = sp->size / (tf->d + 2 * tf->black_border);
+    return sqrt(2) / 2 * scale * (tf->d + 2 * tf->black_border + 2);
+}
+
+// The tags of a scene are laid out on a grid of cols x rows cells.
+static void scene_grid(int width, int height, int ntags, int *cols, int *rows)
+{
+    *cols = (int) ceil(sqrt((double) ntags * width / height));
+    *rows = (ntags + *cols - 1) / *cols;
+}
+
+// Does every tag fit in its cell?
+static int scene_fits(const apriltag_family_t *tf, const struct scene_params *sp,
+                      int width, int height)
+{
+    int cols, rows;
+    scene_grid(width, height, sp->ntags, &cols, &rows);
+
+    double r = tag_radius(tf, sp);
+    return 2 * r <= width / cols && 2 * r <= height / rows;
+}
+
+// Draw tex, scaled by scale and rotated by theta, centered at (cx, cy),
+// supersampling each pixel 4x4.
+static void draw_texture(image_u8_t *im, const image_u8_t *tex, double scale,
+                         double theta, double cx, double cy, double r)
+{
+    double c = cos(theta), s = sin(theta);
+    double half = tex->width / 2.0;
+
+    int x0 = (int) floor(cx - r), x1 = (int) ceil(cx + r);
+    int y0 = (int) floor(cy - r), y1 = (int) ceil(cy + r);
+
+    for (int y = y0; y < y1; y++) {
+        if (y < 0 || y >= im->height)
+            continue;
+
+        for (int x = x0; x < x1; x++) {
+            if (x < 0 || x >= im->width)
+                continue;
+
+            int acc = 0;
+            for (int sy = 0; sy < 4; sy++) {
+                for (int sx = 0; sx < 4; sx++) {
+                    double dx = x + (sx + 0.5) / 4 - cx, dy = y + (sy + 0.5) / 4 - cy;
+
+                    // into the texture, rotating back by theta
+                    double tx = (c * dx + s * dy) / scale + half;
+                    double ty = (-s * dx + c * dy) / scale + half;
+
+                    if (tx >= 0 && ty >= 0 && tx < tex->width && ty < tex->height)
+                        acc += tex->buf[(int) ty * tex->stride + (int) tx];
+                    else
+                        acc += im->buf[y * im->stride + x];
+                }
+            }
+
+            im->buf[y * im->stride + x] = (acc + 8) / 16;
+        }
+    }
+}
+
+// Render frame number frame of the scene described by sp.
+static struct scene render_scene(const apriltag_family_t *tf, const struct scene_params *sp,
+                                 int width, int height, int frame)
+{
+    struct scene sc;
+    sc.im = image_u8_create(width, height);
+    sc.ntags = sp->ntags;
+    sc.tags = calloc(sp->ntags, sizeof(struct truth));
+
+    for (int y = 0; y < height; y++)
+        memset(&sc.im->buf[y * sc.im->stride], BACKGROUND, width);
+
+    int cols, rows;
+    scene_grid(width, height, sp->ntags, &cols, &rows);
+    double cellw = width / cols, cellh = height / rows;
+
+    double scale = sp->size / (tf->d + 2 * tf->black_border);
+    double r = tag_radius(tf, sp);
+
+    for (int i = 0; i < sp->ntags; i++) {
+        struct truth *t = &sc.tags[i];
+        t->id = (frame * sp->ntags + i) % tf->ncodes;
+
+        // somewhere in its cell
+        t->c[0] = (i % cols + 0.5) * cellw + (cellw - 2 * r) * (urand() - 0.5);
+        t->c[1] = (i / cols + 0.5) * cellh + (cellh - 2 * r) * (urand() - 0.5);
+
+        image_u8_t *tex = apriltag_vis_texture2(tf, tf->codes[t->id], 1, 255, 0);
+        draw_texture(sc.im, tex, scale, sp->rotation * M_PI / 180, t->c[0], t->c[1], r);
+        image_u8_destroy(tex);
+    }
+
+    if (sp->blur > 0) {
+        int ksz = 4 * sp->blur;
+        if ((ksz & 1) == 0)
+            ksz++;
+        image_u8_gaussian_blur(sc.im, sp->blur, ksz);
+    }
+
+    if (sp->noise > 0) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                double v = sc.im->buf[y * sc.im->stride + x] + sp->noise * nrand();
+                sc.im->buf[y * sc.im->stride + x] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t) (v + 0.5);
+            }
+        }
+    }
+
+    return sc;
+}
+
+// Count the tags of sc found by detections (with the right id, near
+// the right place), and the detections which aren't tags of sc.
+static void score_detections(const struct scene *sc, const zarray_t *detections, double size,
+                             int *nfound, int *nfalse)
+{
+    int ndet = zarray_size(detections);
+    int matched[ndet + 1];
+    memset(matched, 0, sizeof(matched));
+
+    for (int i = 0; i < sc->ntags; i++) {
+        const struct truth *t = &sc->tags[i];
+
+        for (int j = 0; j < ndet; j++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, j, &det);
+
+            if (!matched[j] && det->id == t->id &&
+                hypot(det->c[0] - t->c[0], det->c[1] - t->c[1]) < size / 4) {
+                matched[j] = 1;
+                (*nfound)++;
+                break;
+            }
+        }
+    }
+
+    for (int j = 0; j < ndet; j++) {
+        if (!matched[j])
+            (*nfalse)++;
+    }
+}
+
+// Compare the detections of a frame with those of a reference
+// detector: count the detections of each which the other lacks (by
+// id, and centre within size / 4), and keep the largest distance
+// between the corners of those they have in common.
+static void compare_detections(const zarray_t *detections, const zarray_t *reference,
+                               double size, int *nmissing, int *nextra, double *max_corner_diff)
+{
+    int ndet = zarray_size(detections);
+    int matched[ndet + 1];
+    memset(matched, 0, sizeof(matched));
+
+    for (int i = 0; i < zarray_size(reference); i++) {
+        apriltag_detection_t *ref;
+        zarray_get(reference, i, &ref);
+
+        int j;
+        for (j = 0; j < ndet; j++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, j, &det);
+
+            if (!matched[j] && det->id == ref->id &&
+                hypot(det->c[0] - ref->c[0], det->c[1] - ref->c[1]) < size / 4) {
+                matched[j] = 1;
+                for (int k = 0; k < 4; k++) {
+                    double d = hypot(det->p[k][0] - ref->p[k][0], det->p[k][1] - ref->p[k][1]);
+                    if (d > *max_corner_diff)
+                        *max_corner_diff = d;
+                }
+                break;
+            }
+        }
+        if (j == ndet)
+            (*nmissing)++;
+    }
+
+    for (int j = 0; j < ndet; j++) {
+        if (!matched[j])
+            (*nextra)++;
+    }
+}
+
+// Print the mean, median and 99th percentile of the time of stage
+// (or of the whole frame, for APRILTAG_NSTAGES) over the frames of a
+// run, total being the sum of the times.
+static void print_times(FILE *f, const apriltag_detect_context_t *ctx, int stage,
+                        int64_t total, int nframes)
+{
+    fprintf(f, "{ \"mean\": %.1f, \"p50\": %" PRId64 ", \"p99\": %" PRId64 " }",
+            (double) total / nframes,
+            apriltag_detect_context_percentile_utime(ctx, stage, 50),
+            apriltag_detect_context_percentile_utime(ctx, stage, 99));
+}
+
+// Detect the tags of the nframes scenes with td, set up as dp, and
+// print the results (the members of a JSON object).
+static void run(FILE *f, apriltag_detector_t *td, const struct detector_params *dp,
+                const struct scene_params *sp, const struct scene *scenes, int nframes)
+{
+    apriltag_detector_enable_quad_contours(td, dp->quads == QUADS_CONTOUR);
+    if (dp->quads == QUADS_GRADIENT)
+        apriltag_detector_enable_quad_gradient(td, 1);
+    if (dp->quads == QUADS_THRESH || dp->quads == QUADS_THRESH_FIXED)
+        td->qtp.fixed_line_fit = dp->quads == QUADS_THRESH_FIXED;
+    td->nthreads = dp->nthreads;
+    td->quad_decimate = dp->decimate;
+    td->stats_window = nframes;
+
+    // a context of its own, so that the percentiles are of this run
+    // only.
+    apriltag_detect_context_t *ctx = apriltag_detect_context_create();
+
+    // detection may modify the image (see quad_sigma), so each frame
+    // is detected in a copy.
+    image_u8_t *im = image_u8_create(scenes[0].im->width, scenes[0].im->height);
+
+    int64_t stage_utime[APRILTAG_NSTAGES + 1];
+    memset(stage_utime, 0, sizeof(stage_utime));
+    uint64_t nquads = 0;
+    int nfound = 0, nfalse = 0, ntags = 0;
+    int64_t elapsed = 0;
+
+    // (for thresh-fixed, whose reference detections have a context of
+    // their own, to keep them out of the percentiles.)
+    apriltag_detect_context_t *reference_ctx = NULL;
+    if (dp->quads == QUADS_THRESH_FIXED)
+        reference_ctx = apriltag_detect_context_create();
+    int nmissing = 0, nextra = 0;
+    double max_corner_diff = 0;
+
+    // the first frame, which allocates the context's buffers and
+    // starts its threads, is not counted (and is pushed out of the
+    // history by the frames which are).
+    for (int i = -1; i < nframes; i++) {
+        const struct scene *sc = &scenes[i < 0 ? 0 : i];
+        for (int y = 0; y < im->height; y++)
+            memcpy(&im->buf[y * im->stride], &sc->im->buf[y * sc->im->stride], im->width);
+
+        int64_t t0 = utime_now();
+        zarray_t *detections = apriltag_detector_detect_ctx(td, ctx, im);
+        int64_t t1 = utime_now();
+
+        if (i >= 0) {
+            const apriltag_stats_t *stats = apriltag_detect_context_stats(ctx);
+            for (int s = 0; s < APRILTAG_NSTAGES; s++)
+                stage_utime[s] += stats->stage_utime[s];
+            stage_utime[APRILTAG_NSTAGES] += stats->utime;
+            nquads += stats->nquads;
+
+            score_detections(sc, detections, sp->size, &nfound, &nfalse);
+            ntags += sc->ntags;
+            elapsed += t1 - t0;
+
+            if (dp->quads == QUADS_THRESH_FIXED) {
+                for (int y = 0; y < im->height; y++)
+                    memcpy(&im->buf[y * im->stride], &sc->im->buf[y * sc->im->stride], im->width);
+
+                td->qtp.fixed_line_fit = 0;
+                zarray_t *reference = apriltag_detector_detect_ctx(td, reference_ctx, im);
+                td->qtp.fixed_line_fit = 1;
+
+                compare_detections(detections, reference, sp->size,
+                                   &nmissing, &nextra, &max_corner_diff);
+                apriltag_detections_destroy(reference);
+            }
+        }
+
+        apriltag_detections_destroy(detections);
+    }
+
+    fprintf(f, "      \"quads\": \"%s\", \"threads\": %d, \"decimate\": %g,\n",
+            quads_names[dp->quads], dp->nthreads, dp->decimate);
+    fprintf(f, "      \"size\": %g, \"rotation\": %g, \"blur\": %g, \"noise\": %g, \"ntags\": %d,\n",
+            sp->size, sp->rotation, sp->blur, sp->noise, sp->ntags);
+    fprintf(f, "      \"tags\": %d, \"found\": %d, \"false_positives\": %d, \"recall\": %.4f,\n",
+            ntags, nfound, nfalse, ntags ? (double) nfound / ntags : 0.0);
+    fprintf(f, "      \"quads_per_frame\": %.1f, \"frames_per_sec\": %.2f,\n",
+            (double) nquads / nframes, elapsed ? 1.0e6 * nframes / elapsed : 0.0);
+    if (dp->quads == QUADS_THRESH_FIXED)
+        fprintf(f, "      \"vs_double\": { \"missing\": %d, \"extra\": %d, \"max_corner_diff\": %.4f },\n",
+                nmissing, nextra, max_corner_diff);
+
+    fprintf(f, "      \"utime\": ");
+    print_times(f, ctx, APRILTAG_NSTAGES, stage_utime[APRILTAG_NSTAGES], nframes);
+    fprintf(f, ",\n      \"stages\": {\n");
+    for (int s = 0; s < APRILTAG_NSTAGES; s++) {
+        fprintf(f, "        \"%s\": ", apriltag_stage_name(s));
+        print_times(f, ctx, s, stage_utime[s], nframes);
+        fprintf(f, "%s\n", s + 1 < APRILTAG_NSTAGES ? "," : "");
+    }
+    fprintf(f, "      }\n");
+
+    image_u8_destroy(im);
+    apriltag_detect_context_destroy(ctx);
+    if (reference_ctx)
+        apriltag_detect_context_destroy(reference_ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag family to use");
+    getopt_add_int(getopt, '\0', "max-hamming", "2", "Correct up to this many bit errors");
+    getopt_add_int(getopt, 'W', "width", "640", "Width of the scenes");
+    getopt_add_int(getopt, 'H', "height", "480", "Height of the scenes");
+    getopt_add_int(getopt, 'n', "frames", "10", "Frames of each scene");
+    getopt_add_int(getopt, '\0', "seed", "1", "Seed for the tag placement and noise");
+    getopt_add_string(getopt, '\0', "sizes", "24,48,96", "Tag sizes (pixels across the black border)");
+    getopt_add_string(getopt, '\0', "rotations", "0,30", "Tag rotations (degrees)");
+    getopt_add_string(getopt, '\0', "blurs", "0", "Blur sigmas");
+    getopt_add_string(getopt, '\0', "noises", "0,10", "Noise standard deviations");
+    getopt_add_string(getopt, '\0', "ntags", "4", "Tags per frame");
+    getopt_add_string(getopt, '\0', "quads", "thresh,contour,gradient", "Quad detectors (thresh, thresh-fixed, contour, gradient)");
+    getopt_add_string(getopt, 't', "threads", "1,4", "Thread counts");
+    getopt_add_string(getopt, 'x', "decimates", "1,2", "Decimation factors");
+    getopt_add_string(getopt, 'o', "output", "", "Write the JSON here rather than to stdout");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    const char *famname = getopt_get_string(getopt, "family");
+    apriltag_family_t *tf = apriltag_family_create(famname);
+
+    if (!tf) {
+        printf("Unrecognized tag family name. Use e.g. \"tag36h11\".\n");
+        exit(-1);
+    }
+
+    apriltag_family_build_decode_table(tf, getopt_get_int(getopt, "max-hamming"));
+
+    apriltag_detector_t *td = apriltag_detector_create();
+    apriltag_detector_add_family(td, tf);
+
+    int width = getopt_get_int(getopt, "width");
+    int height = getopt_get_int(getopt, "height");
+    int nframes = getopt_get_int(getopt, "frames");
+    if (width <= 0 || height <= 0 || nframes <= 0) {
+        fprintf(stderr, "--width, --height and --frames must be positive\n");
+        exit(-1);
+    }
+
+    rand_state = getopt_get_int(getopt, "seed");
+
+    zarray_t *sizes = parse_list("sizes", getopt_get_string(getopt, "sizes"));
+    zarray_t *rotations = parse_list("rotations", getopt_get_string(getopt, "rotations"));
+    zarray_t *blurs = parse_list("blurs", getopt_get_string(getopt, "blurs"));
+    zarray_t *noises = parse_list("noises", getopt_get_string(getopt, "noises"));
+    zarray_t *ntags = parse_list("ntags", getopt_get_string(getopt, "ntags"));
+    zarray_t *threads = parse_list("threads", getopt_get_string(getopt, "threads"));
+    zarray_t *decimates = parse_list("decimates", getopt_get_string(getopt, "decimates"));
+
+    // the detector settings
+    zarray_t *dps = zarray_create(sizeof(struct detector_params));
+    zarray_t *quads = str_split(getopt_get_string(getopt, "quads"), ",");
+    for (int q = 0; q < zarray_size(quads); q++) {
+        char *name;
+        zarray_get(quads, q, &name);
+
+        struct detector_params dp;
+        for (dp.quads = 0; dp.quads < NQUADS; dp.quads++) {
+            if (!strcmp(name, quads_names[dp.quads]))
+                break;
+        }
+        if (dp.quads == NQUADS) {
+            fprintf(stderr, "unknown quad detector \"%s\"\n", name);
+            exit(-1);
+        }
+
+        for (int t = 0; t < zarray_size(threads); t++) {
+            for (int x = 0; x < zarray_size(decimates); x++) {
+                dp.nthreads = (int) list_get(threads, t);
+                dp.decimate = list_get(decimates, x);
+                if (dp.nthreads < 1 || dp.decimate < 1) {
+                    fprintf(stderr, "threads and decimation factors must be at least 1\n");
+                    exit(-1);
+                }
+                zarray_add(dps, &dp);
+            }
+        }
+    }
+    zarray_vmap(quads, free);
+    zarray_destroy(quads);
+
+    // the scenes, every one of which must fit before anything is run.
+    zarray_t *sps = zarray_create(sizeof(struct scene_params));
+    for (int a = 0; a < zarray_size(sizes); a++) {
+        for (int b = 0; b < zarray_size(rotations); b++) {
+            for (int c = 0; c < zarray_size(blurs); c++) {
+                for (int d = 0; d < zarray_size(noises); d++) {
+                    for (int e = 0; e < zarray_size(ntags); e++) {
+                        struct scene_params sp = {
+                            .size = list_get(sizes, a), .rotation = list_get(rotations, b),
+                            .blur = list_get(blurs, c), .noise = list_get(noises, d),
+                            .ntags = (int) list_get(ntags, e) };
+
+                        if (sp.size <= 0 || sp.ntags < 1 || !scene_fits(tf, &sp, width, height)) {
+                            fprintf(stderr, "%d tags of size %g don't fit in %dx%d\n",
+                                    sp.ntags, sp.size, width, height);
+                            exit(-1);
+                        }
+                        zarray_add(sps, &sp);
+                    }
+                }
+            }
+        }
+    }
+
+    const char *output = getopt_get_string(getopt, "output");
+    FILE *f = stdout;
+    if (output[0]) {
+        f = fopen(output, "w");
+        if (f == NULL) {
+            perror(output);
+            exit(-1);
+        }
+    }
+
+    fprintf(f, "{\n  \"family\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d,\n",
+            famname, width, height, nframes);
+    fprintf(f, "  \"runs\": [\n");
+
+    struct scene scenes[nframes];
+    for (int s = 0; s < zarray_size(sps); s++) {
+        struct scene_params *sp;
+        zarray_get_volatile(sps, s, &sp);
+
+        for (int i = 0; i < nframes; i++)
+            scenes[i] = render_scene(tf, sp, width, height, i);
+
+        for (int k = 0; k < zarray_size(dps); k++) {
+            struct detector_params *dp;
+            zarray_get_volatile(dps, k, &dp);
+
+            fprintf(f, "    {\n");
+            run(f, td, dp, sp, scenes, nframes);
+            int last = s + 1 == zarray_size(sps) && k + 1 == zarray_size(dps);
+            fprintf(f, "    }%s\n", last ? "" : ",");
+            fflush(f);
+        }
+
+        for (int i = 0; i < nframes; i++) {
+            image_u8_destroy(scenes[i].im);
+            free(scenes[i].tags);
+        }
+    }
+
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout)
+        fclose(f);
+
+    zarray_destroy(sps);
+    zarray_destroy(dps);
+    zarray_destroy(sizes);
+    zarray_destroy(rotations);
+    zarray_destroy(blurs);
+    zarray_destroy(noises);
+    zarray_destroy(ntags);
+    zarray_destroy(threads);
+    zarray_destroy(decimates);
+
+    apriltag_detector_destroy(td);
+    apriltag_family_destroy(tf);
+    getopt_destroy(getopt);
+
+    return 0;
+}
@@ -0,0 +1,406 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag_capture.h"
+#include "common/image_u32.h"
+#include "common/memstat.h"
+#include "common/time_util.h"
+
+// The states of a slot: free, being filled by a detector, waiting for
+// the writer, and being written.
+enum
+{
+    SLOT_FREE,
+    SLOT_FILLING,
+    SLOT_READY,
+    SLOT_WRITING,
+};
+
+struct apriltag_capture
+{
+    char *prefix;
+    int interval;
+
+    apriltag_capture_frame_t *slots;
+    int capacity;
+
+    // (atomic.)
+    uint64_t noffered;
+
+    // the rest, and the slots' states, under mutex.
+    uint64_t ncaptured, nwritten, ndropped, nfailed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int closing;
+
+    // the writer's images.
+    apriltag_scratch_image_t threshim8;
+    apriltag_scratch_image_t candidates;
+};
+
+// The READY slot with the lowest seq, or NULL.
+static apriltag_capture_frame_t *oldest_ready(apriltag_capture_t *cap)
+{
+    apriltag_capture_frame_t *oldest = NULL;
+    for (int i = 0; i < cap->capacity; i++) {
+        apriltag_capture_frame_t *f = &cap->slots[i];
+        if (f->state == SLOT_READY && (!oldest || f->seq < oldest->seq))
+            oldest = f;
+    }
+    return oldest;
+}
+
+// (a spread of gray levels, for telling neighbouring quads apart.)
+static int quad_color(int i)
+{
+    const int bias = 100;
+    return bias + (int) (((uint32_t) i * 2654435761u) >> 24) % (255 - bias);
+}
+
+static void write_text(apriltag_capture_frame_t *f, const char *path, int *failed)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        *failed = 1;
+        return;
+    }
+
+    const apriltag_stats_t *s = &f->stats;
+
+    fprintf(file, "frame %" PRIu64 " utime %" PRId64 " size %dx%d decimate %.2f\n",
+            f->seq, f->utime, f->im.im.width, f->im.im.height, s->decimate);
+    fprintf(file, "utime %" PRId64 ":", s->utime);
+    for (int i = 0; i < APRILTAG_NSTAGES; i++)
+        fprintf(file, " %s %" PRId64, apriltag_stage_name(i), s->stage_utime[i]);
+    fprintf(file, "\n");
+    fprintf(file, "clusters %u quads %u detections %u tracked %d degraded %d\n",
+            s->nclusters, s->nquads, s->ndetections, s->tracked, s->degraded);
+    fprintf(file, "rejected:");
+    for (int i = 0; i < APRILTAG_NREJECTS; i++)
+        fprintf(file, " %s %u,", apriltag_reject_name(i), s->nrejected[i]);
+    fprintf(file, " reconcile %u\n", s->nreconcile_rejected);
+
+    for (int i = 0; i < zarray_size(f->clusters); i++) {
+        struct apriltag_capture_cluster *c;
+        zarray_get_volatile(f->clusters, i, &c);
+        fprintf(file, "cluster %d: %d points, %.1f %.1f - %.1f %.1f\n",
+                i, c->npoints, c->x0, c->y0, c->x1, c->y1);
+    }
+
+    for (int i = 0; i < zarray_size(f->quads); i++) {
+        struct apriltag_capture_quad *q;
+        zarray_get_volatile(f->quads, i, &q);
+        fprintf(file, "quad %d: %.2f %.2f, %.2f %.2f, %.2f %.2f, %.2f %.2f\n", i,
+                q->p[0][0], q->p[0][1], q->p[1][0], q->p[1][1],
+                q->p[2][0], q->p[2][1], q->p[3][0], q->p[3][1]);
+    }
+
+    for (int i = 0; i < zarray_size(f->detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(f->detections, i, &det);
+        fprintf(file, "detection %d: %s id %d hamming %d margin %.2f center %.2f %.2f\n", i,
+                det->family->name, det->id, det->hamming, det->decision_margin, det->c[0], det->c[1]);
+    }
+
+    if (ferror(file))
+        *failed = 1;
+    if (fclose(file) != 0)
+        *failed = 1;
+}
+
+static void write_images(apriltag_capture_t *cap, apriltag_capture_frame_t *f, const char *path, int *failed)
+{
+    image_u8_t *im = &f->im.im;
+    char name[strlen(path) + 32];
+
+    sprintf(name, "%s_frame.pnm", path);
+    if (image_u8_write_pnm(im, name) != 0)
+        *failed = 1;
+
+    if (f->has_threshim) {
+        const image_u1_t *t = &f->threshim.im;
+        image_u8_t *t8 = apriltag_scratch_image(&cap->threshim8, t->width, t->height);
+        image_u1_to_u8(t, t8, 255);
+
+        sprintf(name, "%s_threshold.pnm", path);
+        if (image_u8_write_pnm(t8, name) != 0)
+            *failed = 1;
+    }
+
+    image_u8_t *c = apriltag_scratch_image(&cap->candidates, im->width, im->height);
+    for (int y = 0; y < im->height; y++)
+        memcpy(&c->buf[y*c->stride], &im->buf[y*im->stride], im->width);
+    image_u8_darken(c);
+    image_u8_darken(c);
+
+    for (int i = 0; i < zarray_size(f->clusters); i++) {
+        struct apriltag_capture_cluster *cl;
+        zarray_get_volatile(f->clusters, i, &cl);
+
+        image_u8_draw_line(c, cl->x0, cl->y0, cl->x1, cl->y0, 80, 1);
+        image_u8_draw_line(c, cl->x1, cl->y0, cl->x1, cl->y1, 80, 1);
+        image_u8_draw_line(c, cl->x1, cl->y1, cl->x0, cl->y1, 80, 1);
+        image_u8_draw_line(c, cl->x0, cl->y1, cl->x0, cl->y0, 80, 1);
+    }
+
+    for (int i = 0; i < zarray_size(f->quads); i++) {
+        struct apriltag_capture_quad *q;
+        zarray_get_volatile(f->quads, i, &q);
+
+        for (int j = 0; j < 4; j++) {
+            const float *p0 = q->p[j], *p1 = q->p[(j + 1) & 3];
+            image_u8_draw_line(c, p0[0], p0[1], p1[0], p1[1], quad_color(i), 1);
+        }
+    }
+
+    sprintf(name, "%s_candidates.pnm", path);
+    if (image_u8_write_pnm(c, name) != 0)
+        *failed = 1;
+
+    // (c is darkened still, under the clusters and quads.)
+    for (int y = 0; y < im->height; y++)
+        memcpy(&c->buf[y*c->stride], &im->buf[y*im->stride], im->width);
+    image_u8_darken(c);
+    image_u8_darken(c);
+
+    image_u32_t *out = image_u32_create_from_u8(c);
+    const uint32_t colors[4] = { 0xff0000, 0xff88ff, 0x88ffff, 0x00ff00 };
+
+    for (int i = 0; i < zarray_size(f->detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(f->detections, i, &det);
+
+        for (int j = 0; j < 4; j++) {
+            const double *p0 = det->p[j], *p1 = det->p[(j + 1) & 3];
+            image_u32_draw_line(out, p0[0], p0[1], p1[0], p1[1], colors[j], 2);
+        }
+    }
+
+    sprintf(name, "%s_detections.pnm", path);
+    if (image_u32_write_pnm(out, name) != 0)
+        *failed = 1;
+    image_u32_destroy(out);
+}
+
+static void *writer_thread(void *arg)
+{
+    apriltag_capture_t *cap = arg;
+
+    pthread_mutex_lock(&cap->mutex);
+
+    while (1) {
+        apriltag_capture_frame_t *f = oldest_ready(cap);
+        if (!f) {
+            if (cap->closing)
+                break;
+            pthread_cond_wait(&cap->cond, &cap->mutex);
+            continue;
+        }
+
+        f->state = SLOT_WRITING;
+        pthread_mutex_unlock(&cap->mutex);
+
+        char path[strlen(cap->prefix) + 32];
+        sprintf(path, "%s%06" PRIu64, cap->prefix, f->seq);
+
+        int failed = 0;
+        write_images(cap, f, path, &failed);
+
+        strcat(path, ".txt");
+        write_text(f, path, &failed);
+
+        pthread_mutex_lock(&cap->mutex);
+        f->state = SLOT_FREE;
+        if (failed) {
+            cap->nfailed++;
+            cap->ndropped++;
+        } else {
+            cap->nwritten++;
+        }
+        pthread_cond_broadcast(&cap->cond);
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+    return NULL;
+}
+
+apriltag_capture_t *apriltag_capture_create(const char *prefix, int interval, int capacity)
+{
+    apriltag_capture_t *cap = calloc(1, sizeof(apriltag_capture_t));
+
+    cap->prefix = strdup(prefix);
+    cap->interval = interval > 1 ? interval : 1;
+    cap->capacity = capacity > 1 ? capacity : 1;
+    cap->slots = calloc(cap->capacity, sizeof(apriltag_capture_frame_t));
+
+    for (int i = 0; i < cap->capacity; i++) {
+        apriltag_capture_frame_t *f = &cap->slots[i];
+        f->clusters = zarray_create(sizeof(struct apriltag_capture_cluster));
+        f->quads = zarray_create(sizeof(struct apriltag_capture_quad));
+        f->detections = zarray_create(sizeof(apriltag_detection_record_t));
+    }
+
+    pthread_mutex_init(&cap->mutex, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+
+    if (pthread_create(&cap->thread, NULL, writer_thread, cap) != 0) {
+        perror("pthread_create");
+        cap->thread = pthread_self();
+        apriltag_capture_destroy(cap);
+        return NULL;
+    }
+
+    return cap;
+}
+
+void apriltag_capture_destroy(apriltag_capture_t *cap)
+{
+    if (!cap)
+        return;
+
+    pthread_mutex_lock(&cap->mutex);
+    cap->closing = 1;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (!pthread_equal(cap->thread, pthread_self()))
+        pthread_join(cap->thread, NULL);
+
+    for (int i = 0; i < cap->capacity; i++) {
+        apriltag_capture_frame_t *f = &cap->slots[i];
+        free(f->im.im.buf);
+        free(f->threshim.im.buf);
+        zarray_destroy(f->clusters);
+        zarray_destroy(f->quads);
+        zarray_destroy(f->detections);
+    }
+
+    free(cap->threshim8.im.buf);
+    free(cap->candidates.im.buf);
+
+    pthread_mutex_destroy(&cap->mutex);
+    pthread_cond_destroy(&cap->cond);
+
+    free(cap->slots);
+    free(cap->prefix);
+    free(cap);
+}
+
+void apriltag_capture_flush(apriltag_capture_t *cap)
+{
+    pthread_mutex_lock(&cap->mutex);
+
+    // (the frames being filled now are captured after this.)
+    uint64_t last = 0;
+    for (int i = 0; i < cap->capacity; i++) {
+        apriltag_capture_frame_t *f = &cap->slots[i];
+        if ((f->state == SLOT_READY || f->state == SLOT_WRITING) && f->seq > last)
+            last = f->seq;
+    }
+
+    while (1) {
+        int pending = 0;
+        for (int i = 0; i < cap->capacity; i++) {
+            apriltag_capture_frame_t *f = &cap->slots[i];
+            if ((f->state == SLOT_READY || f->state == SLOT_WRITING) && f->seq <= last)
+                pending = 1;
+        }
+
+        if (!pending)
+            break;
+        pthread_cond_wait(&cap->cond, &cap->mutex);
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+void apriltag_capture_get_counts(apriltag_capture_t *cap, apriltag_capture_counts_t *counts)
+{
+    pthread_mutex_lock(&cap->mutex);
+    counts->noffered = __atomic_load_n(&cap->noffered, __ATOMIC_RELAXED);
+    counts->ncaptured = cap->ncaptured;
+    counts->nwritten = cap->nwritten;
+    counts->ndropped = cap->ndropped;
+    counts->nfailed = cap->nfailed;
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+apriltag_capture_frame_t *apriltag_capture_begin(apriltag_capture_t *cap, const image_u8_t *im)
+{
+    uint64_t seq = __atomic_add_fetch(&cap->noffered, 1, __ATOMIC_RELAXED);
+    if ((seq - 1) % cap->interval != 0)
+        return NULL;
+
+    pthread_mutex_lock(&cap->mutex);
+
+    apriltag_capture_frame_t *f = NULL;
+    for (int i = 0; i < cap->capacity && !f; i++) {
+        if (cap->slots[i].state == SLOT_FREE)
+            f = &cap->slots[i];
+    }
+
+    // the writer is behind: the newest frames are the ones to keep.
+    if (!f) {
+        f = oldest_ready(cap);
+        cap->ndropped++;
+    }
+
+    if (f) {
+        f->state = SLOT_FILLING;
+        cap->ncaptured++;
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (!f)
+        return NULL;
+
+    f->seq = seq;
+    f->utime = utime_now();
+    f->has_threshim = 0;
+    zarray_clear(f->clusters);
+    zarray_clear(f->quads);
+    zarray_clear(f->detections);
+
+    // (the ring's memory isn't the detector's.)
+    memstat_t *scope = memstat_scope_set(NULL);
+    image_u8_t *copy = apriltag_scratch_image(&f->im, im->width, im->height);
+    memstat_scope_set(scope);
+
+    for (int y = 0; y < im->height; y++)
+        memcpy(&copy->buf[y*copy->stride], &im->buf[y*im->stride], im->width);
+
+    return f;
+}
+
+void apriltag_capture_threshold(apriltag_capture_frame_t *f, const image_u1_t *threshim)
+{
+    memstat_t *scope = memstat_scope_set(NULL);
+    image_u1_t *copy = apriltag_scratch_image_u1(&f->threshim, threshim->width, threshim->height);
+    memstat_scope_set(scope);
+
+    for (int y = 0; y < threshim->height; y++)
+        memcpy(image_u1_row(copy, y), image_u1_row(threshim, y), copy->stride * sizeof(uint64_t));
+    f->has_threshim = 1;
+}
+
+void apriltag_capture_end(apriltag_capture_t *cap, apriltag_capture_frame_t *f,
+                          const zarray_t *detections, const apriltag_stats_t *stats)
+{
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_record_t *det;
+        zarray_get_volatile(detections, i, &det);
+        zarray_add(f->detections, det);
+    }
+    f->stats = *stats;
+
+    pthread_mutex_lock(&cap->mutex);
+    f->state = SLOT_READY;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->mutex);
+}
@@ -0,0 +1,120 @@
+#ifndef _APRILTAG_CAPTURE_H
+#define _APRILTAG_CAPTURE_H
+
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "apriltag_scratch.h"
+#include "common/image_u1.h"
+#include "common/image_u8.h"
+#include "common/zarray.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A sampled, asynchronous alternative to td->debug, cheap enough to
+// leave on in a live system: every interval'th frame detected by the
+// detectors it is set on (see td->capture), the detector copies the
+// frame (before any blur), the threshold image and clusters of
+// apriltag_quad_thresh (of the whole-frame searches), the quads it
+// decoded and its detections and statistics into a slot of a ring,
+// and draws nothing. A thread of the capture's own then writes each
+// captured frame, oldest first, as
+//
+//   <prefix><seq>_frame.pnm       the frame, as detected (to replay it)
+//   <prefix><seq>_threshold.pnm   the threshold image (decimated)
+//   <prefix><seq>_candidates.pnm  the clusters' boxes and the quads
+//   <prefix><seq>_detections.pnm  the detections, in color
+//   <prefix><seq>.txt             the same, and the statistics, as text
+//
+// where seq is the frame's number among those offered to the capture
+// (from 1). When every slot is taken (the writer has fallen behind),
+// the oldest capture not yet being written is dropped for the new one.
+// A capture may be shared by several detectors and contexts, used by
+// any number of threads at once.
+
+// A cluster of apriltag_quad_thresh: the bounding box of its boundary
+// points, and their number, in the pixels of the frame.
+struct apriltag_capture_cluster
+{
+    float x0, y0, x1, y1;
+    int npoints;
+};
+
+// A quad decoded (or not), in the pixels of the frame.
+struct apriltag_capture_quad
+{
+    float p[4][2];
+};
+
+typedef struct apriltag_capture apriltag_capture_t;
+
+// What is captured of a frame, filled in by the detector.
+typedef struct apriltag_capture_frame apriltag_capture_frame_t;
+struct apriltag_capture_frame
+{
+    uint64_t seq;
+    int64_t utime; // when it was captured (see utime_now)
+
+    apriltag_scratch_image_t im;
+    apriltag_scratch_image_u1_t threshim;
+    int has_threshim;
+
+    zarray_t *clusters;   // struct apriltag_capture_cluster
+    zarray_t *quads;      // struct apriltag_capture_quad
+    zarray_t *detections; // apriltag_detection_record_t
+    apriltag_stats_t stats;
+
+    int state; // (of the ring, see apriltag_capture.c)
+};
+
+// Capture every interval'th frame offered into a ring of capacity
+// slots, whose frames are written to files whose names start with
+// prefix (e.g. "/tmp/capture/"; its directories must exist). Returns
+// NULL if the writer's thread can't be started.
+apriltag_capture_t *apriltag_capture_create(const char *prefix, int interval, int capacity);
+
+// Write the captures not yet written, and destroy cap. No detector may
+// be using it.
+void apriltag_capture_destroy(apriltag_capture_t *cap);
+
+// Wait until every frame captured so far has been written (or dropped).
+void apriltag_capture_flush(apriltag_capture_t *cap);
+
+// The number of frames offered, captured, written, and dropped (of
+// which failed, if their files couldn't be written), since cap was
+// created.
+typedef struct apriltag_capture_counts apriltag_capture_counts_t;
+struct apriltag_capture_counts
+{
+    uint64_t noffered;
+    uint64_t ncaptured;
+    uint64_t nwritten;
+    uint64_t ndropped;
+    uint64_t nfailed;
+};
+
+void apriltag_capture_get_counts(apriltag_capture_t *cap, apriltag_capture_counts_t *counts);
+
+// Used by the detector: offer a frame whose gray pixels are im. Returns
+// the slot to fill in (with im copied into it), or NULL if the frame
+// isn't sampled, or there is no slot for it. Only the calling thread
+// may touch the slot until apriltag_capture_end hands it to the
+// writer.
+apriltag_capture_frame_t *apriltag_capture_begin(apriltag_capture_t *cap, const image_u8_t *im);
+
+// Used by the detector: keep a copy of the threshold image.
+void apriltag_capture_threshold(apriltag_capture_frame_t *f, const image_u1_t *threshim);
+
+// Used by the detector: complete f with the frame's detections
+// (apriltag_detection_record_t) and statistics, and queue it for
+// writing.
+void apriltag_capture_end(apriltag_capture_t *cap, apriltag_capture_frame_t *f,
+                          const zarray_t *detections, const apriltag_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _APRILTAG_DECODE_TABLES_H
+#define _APRILTAG_DECODE_TABLES_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The decode tables compiled into the library (see
+// APRILTAG_DECODE_TABLES in CMakeLists.txt). Each is a table as
+// apriltag_family_save_decode_table writes it, header and all, which
+// the build generates (with contrib/make_decode_tables) and embeds in
+// read only data, so that apriltag_family_build_decode_table can use
+// it in place. Whether a table belongs to a family, and corrects the
+// number of errors asked for, is read from its header.
+typedef struct apriltag_decode_table apriltag_decode_table_t;
+struct apriltag_decode_table
+{
+    const void *data;
+    size_t len;
+};
+
+// terminated by an entry whose data is NULL.
+extern const apriltag_decode_table_t apriltag_decode_tables[];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
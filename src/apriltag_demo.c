@@ -1,16 +1,224 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "apriltag.h"
 #include "apriltag_family.h"
+#include "apriltag_capture.h"
+#include "apriltag_log.h"
+#include "apriltag_pipeline.h"
 #include "image_u8.h"
+#include "simd.h"
+#include "time_util.h"
+#include "trace.h"
 
 #include "zarray.h"
 #include "getopt.h"
 
+#define HAMM_HIST_MAX 10
+
+// Print the detections of a frame (unless quiet), and count them by
+// their number of bit errors.
+static void print_detections(const zarray_t *detections, int benchmark, int quiet, int *hamm_hist)
+{
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+
+        if (benchmark) {
+            printf(" %d", det->id);
+        } else if (!quiet) {
+            printf("Detection %3d: ID (%2dh%2d)-%-4d, Hamming %d, Goodness %8.3f, Margin %8.3f\n",
+                   i, det->family->d*det->family->d, det->family->h, det->id, det->hamming, det->goodness, det->decision_margin);
+        }
+
+        hamm_hist[det->hamming]++;
+    }
+}
+
+// An input image, loaded (or with --mmap, mapped if it can be: see
+// image_u8_map_pnm), or NULL if it couldn't be.
+struct image
+{
+    image_u8_t *im;
+    int mapped;
+};
+
+static struct image load_image(const char *path, int use_mmap, int touch)
+{
+    struct image img = { NULL, 0 };
+
+    if (use_mmap) {
+        img.im = image_u8_map_pnm(path);
+        img.mapped = img.im != NULL;
+
+        // read the pages in now, rather than while detecting.
+        if (img.im && touch) {
+            volatile uint8_t sum = 0;
+            size_t sz = (size_t) img.im->stride * img.im->height;
+            for (size_t i = 0; i < sz; i += 4096)
+                sum += img.im->buf[i];
+        }
+    }
+
+    if (img.im == NULL)
+        img.im = image_u8_create_from_pnm(path);
+
+    return img;
+}
+
+static void image_destroy(struct image img)
+{
+    if (img.mapped)
+        image_u8_unmap(img.im);
+    else
+        image_u8_destroy(img.im);
+}
+
+// Loads the inputs, in the order they are detected (each of them,
+// iters times over), on a thread of its own, up to depth images ahead
+// of the one being detected.
+struct prefetch
+{
+    const zarray_t *inputs;
+    int use_mmap;
+
+    // image i (of total) is loaded into ring[i % depth] once fewer
+    // than depth are waiting; nloaded have been loaded, and ntaken
+    // taken to be detected.
+    int depth, total;
+    struct image *ring;
+    int nloaded, ntaken;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void *prefetch_thread(void *p)
+{
+    struct prefetch *pf = p;
+
+    for (int i = 0; i < pf->total; i++) {
+        pthread_mutex_lock(&pf->mutex);
+        while (i - pf->ntaken >= pf->depth)
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        pthread_mutex_unlock(&pf->mutex);
+
+        char *path;
+        zarray_get(pf->inputs, i % zarray_size(pf->inputs), &path);
+        struct image img = load_image(path, pf->use_mmap, 1);
+
+        pthread_mutex_lock(&pf->mutex);
+        pf->ring[i % pf->depth] = img;
+        pf->nloaded++;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+    }
+
+    return NULL;
+}
+
+static struct prefetch *prefetch_create(const zarray_t *inputs, int iters, int depth, int use_mmap)
+{
+    struct prefetch *pf = calloc(1, sizeof(struct prefetch));
+    pf->inputs = inputs;
+    pf->use_mmap = use_mmap;
+    pf->depth = depth;
+    pf->total = iters * zarray_size(inputs);
+    pf->ring = calloc(depth, sizeof(struct image));
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pthread_create(&pf->thread, NULL, prefetch_thread, pf);
+    return pf;
+}
+
+// Every image must have been taken.
+static void prefetch_destroy(struct prefetch *pf)
+{
+    if (!pf)
+        return;
+
+    pthread_join(pf->thread, NULL);
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->cond);
+    free(pf->ring);
+    free(pf);
+}
+
+// The next image (of path), from pf if there is one.
+static struct image next_image(struct prefetch *pf, const char *path, int use_mmap)
+{
+    if (!pf)
+        return load_image(path, use_mmap, 0);
+
+    pthread_mutex_lock(&pf->mutex);
+    while (pf->nloaded == pf->ntaken)
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+
+    struct image img = pf->ring[pf->ntaken % pf->depth];
+    pf->ntaken++;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+
+    return img;
+}
+
+// A frame submitted to the pipeline.
+struct frame
+{
+    const char *path;
+    struct image img;
+    int64_t utime;
+};
+
+// Print (and log, if log isn't NULL) the detections of the oldest
+// frame in the pipeline (waiting for them), and free the frame.
+// Returns the number of detections.
+static int pipeline_print(apriltag_pipeline_t *pl, int benchmark, int quiet, apriltag_log_writer_t *log)
+{
+    struct frame *f;
+    zarray_t *detections = apriltag_pipeline_wait(pl, (void**) &f);
+
+    if (log)
+        apriltag_log_write_detections(log, f->utime, detections, NULL);
+
+    int hamm_hist[HAMM_HIST_MAX];
+    memset(hamm_hist, 0, sizeof(hamm_hist));
+
+    if (benchmark) {
+        int l=strlen(f->path);
+        while (l && f->path[l-1] != '/') { --l; }
+        printf("%s", f->path+l);
+    } else if (!quiet) {
+        printf("Detections of %s\n", f->path);
+    }
+
+    print_detections(detections, benchmark, quiet, hamm_hist);
+
+    if (!benchmark) {
+        if (!quiet)
+            printf("Hamming histogram: ");
+
+        for (int i = 0; i < HAMM_HIST_MAX; i++)
+            printf("%5d", hamm_hist[i]);
+    }
+
+    printf("\n");
+
+    int n = zarray_size(detections);
+    apriltag_detections_destroy(detections);
+    image_destroy(f->img);
+    free(f);
+
+    return n;
+}
+
 int main(int argc, char *argv[])
 {
     getopt_t *getopt = getopt_create();
@@ -20,15 +228,46 @@ int main(int argc, char *argv[])
     getopt_add_bool(getopt, 'q', "quiet", 0, "Reduce output");
     getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag family to use");
     getopt_add_int(getopt, '\0', "border", "1", "Set tag family border size");
+    getopt_add_int(getopt, '\0', "max-hamming", "2", "Correct up to this many bit errors");
+    getopt_add_bool(getopt, '\0', "scan-decode", 0, "Decode without a table, by comparing with every code");
+    getopt_add_string(getopt, '\0', "decode-table", "", "Map the decode table from this file (saving it there first if necessary)");
+    getopt_add_string(getopt, '\0', "ids", "", "Decode only the tags with these ids (e.g. 0,3,17)");
     getopt_add_int(getopt, 'i', "iters", "1", "Repeat processing this many times");
     getopt_add_int(getopt, 't', "threads", "4", "Use this many CPU threads");
+    getopt_add_int(getopt, 'P', "pipeline", "1", "Detect this many frames at once");
+    getopt_add_int(getopt, '\0', "batch", "0", "Detect this many frames at once, each on one thread of its own");
+    getopt_add_int(getopt, '\0', "prefetch", "0", "Load this many images ahead of the one being detected, on a thread of their own");
+    getopt_add_bool(getopt, '\0', "mmap", 0, "Map binary PGM images into memory rather than reading them");
+    getopt_add_string(getopt, '\0', "cpus", "", "Run the worker threads on these CPUs (e.g. 2,3,5)");
     getopt_add_double(getopt, 'x', "decimate", "1.0", "Decimate input image by this factor");
+    getopt_add_double(getopt, '\0', "auto-decimate", "0", "Choose the decimation of each image, up to this factor, from the tags of the last ones");
     getopt_add_double(getopt, 'b', "blur", "0.0", "Apply low-pass blur to input");
+    getopt_add_int(getopt, '\0', "pyramid", "1", "Search for quads at this many decimation levels");
+    getopt_add_int(getopt, '\0', "min-tag-size", "0", "Reject tags smaller than this many pixels across");
+    getopt_add_int(getopt, '\0', "max-tag-size", "0", "Reject tags larger than this many pixels across");
+    getopt_add_int(getopt, '\0', "max-detections", "0", "Stop decoding once this many tags have been found");
+    getopt_add_int(getopt, '\0', "track", "0", "Search only near the tags of the previous image, and all of every this many");
+    getopt_add_int(getopt, '\0', "motion", "0", "Search only what changed since the previous image, and all of every this many");
+    getopt_add_double(getopt, '\0', "tile-memory", "0", "Search large images in tiles that need no more than this many MB each");
+    getopt_add_int(getopt, '\0', "tile-tolerance", "-1", "Reuse the threshold of the tiles of an image that changed less than this since the last");
+    getopt_add_double(getopt, '\0', "budget", "0", "Degrade detection to finish each image within this many ms");
     getopt_add_bool(getopt, '0', "refine-edges", 1, "Spend more time aligning edges of tags");
+    getopt_add_bool(getopt, '\0', "refine-edges-full", 0, "Align the edges of tags at every decimation (including 1)");
     getopt_add_bool(getopt, '1', "refine-decode", 0, "Spend more time decoding tags");
     getopt_add_bool(getopt, '2', "refine-pose", 0, "Spend more time computing pose of tags");
+    getopt_add_bool(getopt, '\0', "decode-bilinear", 0, "Decode tags from interpolated samples");
+    getopt_add_double(getopt, '\0', "min-border-contrast", "0", "Reject quads with less border contrast than this");
     getopt_add_bool(getopt, 'c', "contours", 0, "Use new contour-based quad detection");
     getopt_add_bool(getopt, 'B', "benchmark", 0, "Benchmark mode");
+    getopt_add_string(getopt, '\0', "log", "", "Log the detections (and times) of every image to this file, in binary (see apriltag_log.h)");
+    getopt_add_string(getopt, '\0', "trace", "", "Write what each thread did when to this file, as a Chrome trace (see trace.h)");
+    getopt_add_int(getopt, '\0', "trace-events", "65536", "Trace the last this many events of each thread");
+    getopt_add_string(getopt, '\0', "capture", "", "Capture sampled frames, and what was found in them, to files starting with this (see apriltag_capture.h)");
+    getopt_add_int(getopt, '\0', "capture-interval", "1", "Capture every this many'th frame");
+    getopt_add_bool(getopt, '\0', "stats", 0, "Show the median and 99th percentile time of each stage");
+    getopt_add_bool(getopt, '\0', "gpu", 0, "Segment the images on the GPU (with OpenCL)");
+    getopt_add_bool(getopt, '\0', "perf", 0, "Count the cycles, instructions and cache and branch misses of each stage (see perfcount.h)");
+    getopt_add_string(getopt, '\0', "simd", "", "Use the kernels for this instruction set (scalar, sse2, ssse3, avx2, neon)");
 
     if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
         printf("Usage: %s [options] <input files>\n", argv[0]);
@@ -36,6 +275,12 @@ int main(int argc, char *argv[])
         exit(0);
     }
 
+    const char *simd = getopt_get_string(getopt, "simd");
+    if (simd[0] && simd_set_isa((simd_isa_t) simd_isa_from_name(simd)) != 0) {
+        printf("Instruction set %s is not supported here.\n", simd);
+        exit(-1);
+    }
+
     const zarray_t *inputs = getopt_get_extra_args(getopt);
 
     const char* famname = getopt_get_string(getopt, "family");
@@ -48,15 +293,82 @@ int main(int argc, char *argv[])
 
     tf->black_border = getopt_get_int(getopt, "border");
 
+    const char *idlist = getopt_get_string(getopt, "ids");
+    if (idlist[0]) {
+        int ids[1024], nids = 0;
+        for (const char *c = idlist; *c && nids < 1024; ) {
+            char *end;
+            ids[nids++] = strtol(c, &end, 10);
+            c = (*end == ',') ? end + 1 : end + strlen(end);
+        }
+
+        if (apriltag_family_restrict_ids(tf, ids, nids) != 0) {
+            printf("%s is not a list of ids of %s\n", idlist, famname);
+            exit(-1);
+        }
+    }
+
+    const char *decode_table = getopt_get_string(getopt, "decode-table");
+    int maxhamming = getopt_get_int(getopt, "max-hamming");
+
+    if (getopt_get_bool(getopt, "scan-decode")) {
+        apriltag_family_use_scan_decoder(tf, maxhamming);
+    } else {
+        int res = decode_table[0] ? apriltag_family_load_decode_table(tf, decode_table) : -1;
+        if (res != 0) {
+            if (res != -1)
+                printf("%s is not a decode table for %s; ignoring it\n", decode_table, famname);
+
+            apriltag_family_build_decode_table(tf, maxhamming);
+
+            // only create the file if it doesn't exist yet
+            if (decode_table[0] && res == -1 && apriltag_family_save_decode_table(tf, decode_table) != 0)
+                printf("couldn't save decode table to %s\n", decode_table);
+        }
+    }
+
     apriltag_detector_t *td = apriltag_detector_create();
     apriltag_detector_add_family(td, tf);
     td->quad_decimate = getopt_get_double(getopt, "decimate");
+    td->auto_decimate = getopt_get_double(getopt, "auto-decimate");
     td->quad_sigma = getopt_get_double(getopt, "blur");
+    td->quad_pyramid_levels = getopt_get_int(getopt, "pyramid");
+    td->min_tag_size = getopt_get_int(getopt, "min-tag-size");
+    td->max_tag_size = getopt_get_int(getopt, "max-tag-size");
+    td->max_detections = getopt_get_int(getopt, "max-detections");
+    td->tile_memory = (size_t) (getopt_get_double(getopt, "tile-memory") * 1024 * 1024);
+    td->track_interval = getopt_get_int(getopt, "track");
+    td->motion_interval = getopt_get_int(getopt, "motion");
+    td->budget_utime = getopt_get_double(getopt, "budget") * 1e3;
     td->nthreads = getopt_get_int(getopt, "threads");
     td->debug = getopt_get_bool(getopt, "debug");
     td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    if (getopt_get_bool(getopt, "refine-edges-full"))
+        td->refine_edges = 2;
     td->refine_decode = getopt_get_bool(getopt, "refine-decode");
     td->refine_pose = getopt_get_bool(getopt, "refine-pose");
+    td->decode_bilinear = getopt_get_bool(getopt, "decode-bilinear");
+    td->decode_min_border_contrast = getopt_get_double(getopt, "min-border-contrast");
+    td->qtp.tile_tolerance = getopt_get_int(getopt, "tile-tolerance");
+    td->gpu = getopt_get_bool(getopt, "gpu");
+    td->perf_counters = getopt_get_bool(getopt, "perf");
+
+    // pin the worker threads: give the detector a pool of our own.
+    workerpool_t *wp = NULL;
+    const char *cpulist = getopt_get_string(getopt, "cpus");
+    if (cpulist[0]) {
+        int cpus[1024], ncpus = 0;
+        for (const char *c = cpulist; *c && ncpus < 1024; ) {
+            char *end;
+            cpus[ncpus++] = strtol(c, &end, 10);
+            c = (*end == ',') ? end + 1 : end + strlen(end);
+        }
+
+        wp = workerpool_create(td->nthreads);
+        if (workerpool_set_affinity(wp, cpus, ncpus) != 0)
+            printf("couldn't run the worker threads on CPUs %s\n", cpulist);
+        apriltag_detector_set_workerpool(td, wp);
+    }
 
     int quiet = getopt_get_bool(getopt, "quiet");
 
@@ -64,10 +376,78 @@ int main(int argc, char *argv[])
 
     int maxiters = getopt_get_int(getopt, "iters");
 
+    int stats = getopt_get_bool(getopt, "stats");
+    if (stats)
+        td->stats_window = maxiters * zarray_size(inputs);
+
     int total_detections = 0;
     uint64_t total_time = 0;
 
-    const int hamm_hist_max = 10;
+    apriltag_log_writer_t *log = NULL;
+    const char *logpath = getopt_get_string(getopt, "log");
+    if (logpath[0] && (log = apriltag_log_writer_create(logpath)) == NULL) {
+        printf("Couldn't create %s\n", logpath);
+        exit(-1);
+    }
+
+    const char *tracepath = getopt_get_string(getopt, "trace");
+    if (tracepath[0])
+        trace_start(getopt_get_int(getopt, "trace-events"));
+
+    apriltag_capture_t *capture = NULL;
+    const char *capturepath = getopt_get_string(getopt, "capture");
+    if (capturepath[0]) {
+        capture = apriltag_capture_create(capturepath, getopt_get_int(getopt, "capture-interval"), 4);
+        if (!capture) {
+            printf("Couldn't capture to %s\n", capturepath);
+            exit(-1);
+        }
+        td->capture = capture;
+    }
+
+    int use_mmap = getopt_get_bool(getopt, "mmap");
+    int nprefetch = getopt_get_int(getopt, "prefetch");
+    struct prefetch *pf = NULL;
+    if (nprefetch > 0 && maxiters * zarray_size(inputs) > 0)
+        pf = prefetch_create(inputs, maxiters, nprefetch, use_mmap);
+
+    int depth = getopt_get_int(getopt, "pipeline");
+    apriltag_pipeline_t *pl = NULL;
+    int64_t pipeline_start = utime_now();
+    int batch = getopt_get_int(getopt, "batch");
+    if (batch > 0)
+        pl = apriltag_pipeline_create_parallel(td, batch);
+    else if (depth > 1)
+        pl = apriltag_pipeline_create(td, depth);
+
+    for (int iter = 0; pl && iter < maxiters; iter++) {
+        for (int input = 0; input < zarray_size(inputs); input++) {
+            char *path;
+            zarray_get(inputs, input, &path);
+
+            struct image img = next_image(pf, path, use_mmap);
+            if (img.im == NULL) {
+                printf("Couldn't load %s\n", path);
+                continue;
+            }
+
+            struct frame *f = calloc(1, sizeof(struct frame));
+            f->path = path;
+            f->img = img;
+            f->utime = utime_now();
+
+            while (apriltag_pipeline_submit(pl, img.im, f) != 0)
+                total_detections += pipeline_print(pl, benchmark, quiet, log);
+        }
+    }
+
+    if (pl) {
+        while (apriltag_pipeline_pending(pl) > 0)
+            total_detections += pipeline_print(pl, benchmark, quiet, log);
+
+        total_time = utime_now() - pipeline_start;
+        maxiters = 0;
+    }
 
     for (int iter = 0; iter < maxiters; iter++) {
 
@@ -76,7 +456,7 @@ int main(int argc, char *argv[])
 
         for (int input = 0; input < zarray_size(inputs); input++) {
 
-            int hamm_hist[hamm_hist_max];
+            int hamm_hist[HAMM_HIST_MAX];
             memset(hamm_hist, 0, sizeof(hamm_hist));
 
             char *path;
@@ -90,29 +470,22 @@ int main(int argc, char *argv[])
                 printf("Loading %s\n", path);
             }
 
-            image_u8_t *im = image_u8_create_from_pnm(path);
+            struct image img = next_image(pf, path, use_mmap);
+            image_u8_t *im = img.im;
             if (im == NULL) {
                 printf("Couldn't load %s\n", path);
                 continue;
             }
 
+            int64_t utime = utime_now();
             zarray_t *detections = apriltag_detector_detect(td, im);
 
-            total_detections += zarray_size(detections);
+            if (log)
+                apriltag_log_write_detections(log, utime, detections, apriltag_detector_stats(td));
 
-            for (int i = 0; i < zarray_size(detections); i++) {
-                apriltag_detection_t *det;
-                zarray_get(detections, i, &det);
-
-                if (benchmark) {
-                    printf(" %d", det->id);
-                } else if (!quiet) {
-                    printf("Detection %3d: ID (%2dh%2d)-%-4d, Hamming %d, Goodness %8.3f, Margin %8.3f\n",
-                           i, det->family->d*det->family->d, det->family->h, det->id, det->hamming, det->goodness, det->decision_margin);
-                }
+            total_detections += zarray_size(detections);
 
-                hamm_hist[det->hamming]++;
-            }
+            print_detections(detections, benchmark, quiet, hamm_hist);
 
             apriltag_detections_destroy(detections);
 
@@ -121,12 +494,60 @@ int main(int argc, char *argv[])
                 if (!quiet) {
                     timeprofile_display(td->tp);
                     printf("Edges: %d, Segments: %d, Quads: %d\n", td->nedges, td->nsegments, td->nquads);
+                    printf("Rejected quads: %d by border, %d by code\n", td->nborder_rejected, td->ncode_rejected);
+
+                    const apriltag_stats_t *st = apriltag_detector_stats(td);
+                    printf("Decimation: %g, clusters: %d (%d rejected by size, %d by quad fit), duplicates: %d, "
+                           "quads skipped: %d, degraded:%s%s%s%s\n",
+                           st->decimate, st->nclusters, st->ncluster_rejected, st->nquad_fit_rejected,
+                           st->nreconcile_rejected, st->nquads_skipped,
+                           st->degraded ? "" : " no",
+                           st->degraded & APRILTAG_DEGRADED_REFINE ? " refine" : "",
+                           st->degraded & APRILTAG_DEGRADED_QUADS ? " quads" : "",
+                           st->degraded & APRILTAG_DEGRADED_SEARCH ? " search" : "");
+
+                    printf("Rejected by reason:");
+                    for (int r = 0; r < APRILTAG_NREJECTS; r++)
+                        printf("%s %s %d", r ? "," : "", apriltag_reject_name(r), st->nrejected[r]);
+                    printf("\n");
+
+                    memstat_t mem[APRILTAG_NMEMORY];
+                    apriltag_detector_memory(td, mem);
+                    printf("Memory (kB, peak):");
+                    for (int m = 0; m < APRILTAG_NMEMORY; m++)
+                        printf("%s %s %.1f (%.1f)", m ? "," : "", apriltag_memory_name(m),
+                               mem[m].bytes / 1024.0, mem[m].peak / 1024.0);
+                    printf("\n");
+
+                    if (td->perf_counters && !st->perf_counted)
+                        printf("Couldn't read the hardware counters\n");
+                    if (st->perf_counted) {
+                        for (int stage = 0; stage < APRILTAG_NSTAGES; stage++) {
+                            const uint64_t *c = st->stage_counts[stage];
+                            printf("%12s:", apriltag_stage_name(stage));
+                            for (int i = 0; i < PERFCOUNT_N; i++)
+                                printf(" %s %10" PRIu64, perfcount_name(i), c[i]);
+                            printf(", IPC %.2f\n", c[PERFCOUNT_CYCLES] ?
+                                   (double) c[PERFCOUNT_INSTRUCTIONS] / c[PERFCOUNT_CYCLES] : 0.0);
+                        }
+                    }
+
+                    if (td->gpu)
+                        printf("Segmented on the GPU: %s\n", st->gpu ? "yes" : "no");
+
+                    if (td->track_interval > 0)
+                        printf("Tracked: %s, quads verified against tracked tags: %d\n",
+                               st->tracked ? "yes" : "no", st->nverified);
+
+                    if (td->motion_interval > 0)
+                        printf("Tiles changed: %d of %d, tags carried forward: %d\n",
+                               st->ntiles_changed, st->ntiles, st->ncarried);
                 }
     
                 if (!quiet)
                     printf("Hamming histogram: ");
     
-                for (int i = 0; i < hamm_hist_max; i++)
+                for (int i = 0; i < HAMM_HIST_MAX; i++)
                     printf("%5d", hamm_hist[i]);
     
                 if (quiet) {
@@ -137,7 +558,7 @@ int main(int argc, char *argv[])
     
             printf("\n");
 
-            image_u8_destroy(im);
+            image_destroy(img);
             total_time += timeprofile_total_utime(td->tp);
             
         }
@@ -149,8 +570,39 @@ int main(int argc, char *argv[])
                 (total_time*1e-3), (total_time*1e-3)/zarray_size(inputs));
     }
     
+    if (stats && !pl) {
+        for (int stage = 0; stage <= APRILTAG_NSTAGES; stage++) {
+            printf("%12s: p50 %10.3f ms, p99 %10.3f ms\n",
+                   stage < APRILTAG_NSTAGES ? apriltag_stage_name(stage) : "total",
+                   apriltag_detector_percentile_utime(td, stage, 50) / 1.0E3,
+                   apriltag_detector_percentile_utime(td, stage, 99) / 1.0E3);
+        }
+    }
+
+    if (tracepath[0]) {
+        trace_stop();
+        if (trace_write_json(tracepath) != 0)
+            printf("Couldn't write %s\n", tracepath);
+    }
+
+    if (capture) {
+        apriltag_capture_flush(capture);
+
+        apriltag_capture_counts_t counts;
+        apriltag_capture_get_counts(capture, &counts);
+        if (!quiet || counts.nfailed)
+            printf("Captured %" PRIu64 " frames: wrote %" PRIu64 ", dropped %" PRIu64 " (failed %" PRIu64 ")\n",
+                   counts.ncaptured, counts.nwritten, counts.ndropped, counts.nfailed);
+    }
+
     // Don't deallocate contents of inputs; those are the argv
+    prefetch_destroy(pf);
+    if (apriltag_log_writer_destroy(log) != 0)
+        printf("Couldn't write %s\n", logpath);
+    apriltag_pipeline_destroy(pl);
     apriltag_detector_destroy(td);
+    apriltag_capture_destroy(capture);
+    workerpool_destroy(wp);
 
     apriltag_family_destroy(tf);
 
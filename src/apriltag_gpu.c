@@ -0,0 +1,670 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag_gpu.h"
+
+#ifndef APRILTAG_OPENCL
+
+apriltag_gpu_t *apriltag_gpu_create(void)
+{
+    return NULL;
+}
+
+void apriltag_gpu_destroy(apriltag_gpu_t *gpu)
+{
+}
+
+int apriltag_gpu_segment(apriltag_gpu_t *gpu, const image_u8_t *im, int factor,
+                         const uint8_t *k, int ksz, int sharpen,
+                         const struct apriltag_quad_thresh_params *qtp,
+                         apriltag_gpu_frame_t *frame)
+{
+    return -1;
+}
+
+#else
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// The kernels, one work item per pixel, tile or (for the packed
+// images) word, each computing what the scalar code of the CPU does:
+// see the row kernels of image_u8.c (decimate, convolve_rows and
+// convolve_cols), threshold() and do_deglitch_task, do_find_edges_task
+// and do_edges_to_u8_task of apriltag_quad_thresh.c. The components
+// are found by union-find with atomic links to the smaller root
+// (Playne and Hawick's algorithm): the roots differ from the CPU's,
+// but the components don't.
+static const char *gpu_source =
+    "__kernel void decimate(__global const uchar *src, int ss, __global uchar *dst, int ds,\n"
+    "                       int dw, int dh, int factor)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    if (x >= dw || y >= dh)\n"
+    "        return;\n"
+    "\n"
+    "    __global const uchar *p = &src[y*factor*ss + x*factor];\n"
+    "    uint v = 0;\n"
+    "    if (factor == 2) {\n"
+    "        v = (p[0] + p[1] + p[ss] + p[ss+1]) >> 2;\n"
+    "    } else if (factor == 3) {\n"
+    "        v = (p[0] + p[1] + p[2] + p[ss] + p[ss+1] + p[ss+2] + p[2*ss] + p[2*ss+1]) >> 3;\n"
+    "    } else if (factor == 4) {\n"
+    "        v = (p[0] + p[1] + p[2] + p[3] + p[ss] + 2*p[ss+1] + p[ss+2] +\n"
+    "             p[2*ss] + p[2*ss+1] + p[2*ss+2] + p[2*ss+3]) >> 4;\n"
+    "    } else {\n"
+    "        for (int dy = 0; dy < factor; dy++)\n"
+    "            for (int dx = 0; dx < factor; dx++)\n"
+    "                v += p[dy*ss + dx];\n"
+    "        v /= factor*factor;\n"
+    "    }\n"
+    "    dst[y*ds + x] = v;\n"
+    "}\n"
+    "\n"
+    "__kernel void convolve_rows(__global const uchar *src, int ss, __global uchar *dst, int ds,\n"
+    "                            int w, int h, __global const uchar *k, int ksz)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    if (x >= w || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    uint v = src[y*ss + x];\n"
+    "    if (x >= ksz/2 && x < w - ksz + ksz/2) {\n"
+    "        v = 0;\n"
+    "        for (int j = 0; j < ksz; j++)\n"
+    "            v += k[j] * src[y*ss + x - ksz/2 + j];\n"
+    "        v >>= 8;\n"
+    "    }\n"
+    "    dst[y*ds + x] = v;\n"
+    "}\n"
+    "\n"
+    "__kernel void convolve_cols(__global const uchar *src, int ss, __global uchar *dst, int ds,\n"
+    "                            __global const uchar *orig, int os, int w, int h,\n"
+    "                            __global const uchar *k, int ksz, int sharpen)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    if (x >= w || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    int v = src[y*ss + x];\n"
+    "    if (y >= ksz/2 && y < h - ksz + ksz/2) {\n"
+    "        uint acc = 0;\n"
+    "        for (int j = 0; j < ksz; j++)\n"
+    "            acc += k[j] * src[(y - ksz/2 + j)*ss + x];\n"
+    "        v = acc >> 8;\n"
+    "    }\n"
+    "    if (sharpen)\n"
+    "        v = clamp(2*orig[y*os + x] - v, 0, 255);\n"
+    "    dst[y*ds + x] = v;\n"
+    "}\n"
+    "\n"
+    "__kernel void tile_minmax(__global const uchar *im, int s, int w, int h,\n"
+    "                          __global uchar *tmax, __global uchar *tmin, int tw, int th)\n"
+    "{\n"
+    "    int tx = get_global_id(0), ty = get_global_id(1);\n"
+    "    if (tx >= tw || ty >= th)\n"
+    "        return;\n"
+    "\n"
+    "    uchar mx = 0, mn = 255;\n"
+    "    for (int y = 4*ty; y < min(h, 4*ty + 4); y++) {\n"
+    "        for (int x = 4*tx; x < min(w, 4*tx + 4); x++) {\n"
+    "            mx = max(mx, im[y*s + x]);\n"
+    "            mn = min(mn, im[y*s + x]);\n"
+    "        }\n"
+    "    }\n"
+    "    tmax[ty*tw + tx] = mx;\n"
+    "    tmin[ty*tw + tx] = mn;\n"
+    "}\n"
+    "\n"
+    "__kernel void tile_thresh(__global const uchar *tmax, __global const uchar *tmin, int tw, int th,\n"
+    "                          int min_white_black_diff, __global uchar *thresh)\n"
+    "{\n"
+    "    int tx = get_global_id(0), ty = get_global_id(1);\n"
+    "    if (tx >= tw || ty >= th)\n"
+    "        return;\n"
+    "\n"
+    "    int mx = 0, mn = 255;\n"
+    "    for (int y = max(ty - 1, 0); y <= min(ty + 1, th - 1); y++) {\n"
+    "        for (int x = max(tx - 1, 0); x <= min(tx + 1, tw - 1); x++) {\n"
+    "            mx = max(mx, (int) tmax[y*tw + x]);\n"
+    "            mn = min(mn, (int) tmin[y*tw + x]);\n"
+    "        }\n"
+    "    }\n"
+    "    thresh[ty*tw + tx] = mx - mn < min_white_black_diff ? 255 : mn + (mx - mn) / 2;\n"
+    "}\n"
+    "\n"
+    "__kernel void binarize(__global const uchar *im, int s, int w, int h,\n"
+    "                       __global const uchar *thresh, int tw, __global ulong *bits, int nwords)\n"
+    "{\n"
+    "    int i = get_global_id(0), y = get_global_id(1);\n"
+    "    if (i >= nwords || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    __global const uchar *t = &thresh[(y/4)*tw];\n"
+    "    ulong word = 0;\n"
+    "    for (int b = 0; b < min(64, w - 64*i); b++) {\n"
+    "        int x = 64*i + b;\n"
+    "        word |= ((ulong) (im[y*s + x] > t[x/4])) << b;\n"
+    "    }\n"
+    "    bits[y*nwords + i] = word;\n"
+    "}\n"
+    "\n"
+    "ulong interior_mask(int w, int i)\n"
+    "{\n"
+    "    int n = w - 1 - 64*i;\n"
+    "    ulong mask = n >= 64 ? ~(ulong) 0 : n > 0 ? (((ulong) 1) << n) - 1 : 0;\n"
+    "    if (i == 0)\n"
+    "        mask &= ~(ulong) 1;\n"
+    "    return mask;\n"
+    "}\n"
+    "\n"
+    "__kernel void deglitch(__global const ulong *bits, __global ulong *out, int w, int h, int nwords)\n"
+    "{\n"
+    "    int i = get_global_id(0), y = get_global_id(1);\n"
+    "    if (i >= nwords || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    __global const ulong *r1 = &bits[y*nwords];\n"
+    "    if (y == 0 || y + 1 >= h) {\n"
+    "        out[y*nwords + i] = r1[i];\n"
+    "        return;\n"
+    "    }\n"
+    "    __global const ulong *r0 = r1 - nwords, *r2 = r1 + nwords;\n"
+    "\n"
+    "    ulong all = r0[i] & r1[i] & r2[i], none = ~(r0[i] | r1[i] | r2[i]);\n"
+    "    ulong allp = 0, nonep = 0, alln = 0, nonen = 0;\n"
+    "    if (i > 0) {\n"
+    "        allp = r0[i-1] & r1[i-1] & r2[i-1];\n"
+    "        nonep = ~(r0[i-1] | r1[i-1] | r2[i-1]);\n"
+    "    }\n"
+    "    if (i + 1 < nwords) {\n"
+    "        alln = r0[i+1] & r1[i+1] & r2[i+1];\n"
+    "        nonen = ~(r0[i+1] | r1[i+1] | r2[i+1]);\n"
+    "    }\n"
+    "\n"
+    "    ulong white = r0[i] & r2[i] & ((all << 1) | (allp >> 63)) & ((all >> 1) | (alln << 63));\n"
+    "    ulong black = ~(r0[i] | r2[i]) & ((none << 1) | (nonep >> 63)) & ((none >> 1) | (nonen << 63));\n"
+    "    ulong flip = ((~r1[i] & white) | (r1[i] & black)) & interior_mask(w, i);\n"
+    "    out[y*nwords + i] = r1[i] ^ flip;\n"
+    "}\n"
+    "\n"
+    "__kernel void find_edges(__global const ulong *bits, __global ulong *black, __global ulong *white,\n"
+    "                         int w, int h, int nwords)\n"
+    "{\n"
+    "    int i = get_global_id(0), y = get_global_id(1);\n"
+    "    if (i >= nwords || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    if (y == 0 || y + 1 >= h) {\n"
+    "        black[y*nwords + i] = 0;\n"
+    "        white[y*nwords + i] = 0;\n"
+    "        return;\n"
+    "    }\n"
+    "    __global const ulong *r1 = &bits[y*nwords], *r0 = r1 - nwords, *r2 = r1 + nwords;\n"
+    "\n"
+    "    ulong any = r0[i] | r1[i] | r2[i], all = r0[i] & r1[i] & r2[i];\n"
+    "    ulong anyp = 0, allp = ~(ulong) 0, anyn = 0, alln = ~(ulong) 0;\n"
+    "    if (i > 0) {\n"
+    "        anyp = r0[i-1] | r1[i-1] | r2[i-1];\n"
+    "        allp = r0[i-1] & r1[i-1] & r2[i-1];\n"
+    "    }\n"
+    "    if (i + 1 < nwords) {\n"
+    "        anyn = r0[i+1] | r1[i+1] | r2[i+1];\n"
+    "        alln = r0[i+1] & r1[i+1] & r2[i+1];\n"
+    "    }\n"
+    "\n"
+    "    ulong dwhite = any | (any << 1) | (anyp >> 63) | (any >> 1) | (anyn << 63);\n"
+    "    ulong dblack = ~(all & ((all << 1) | (allp >> 63)) & ((all >> 1) | (alln << 63)));\n"
+    "    ulong mask = interior_mask(w, i);\n"
+    "    black[y*nwords + i] = ~r1[i] & dwhite & mask;\n"
+    "    white[y*nwords + i] = r1[i] & dblack & mask;\n"
+    "}\n"
+    "\n"
+    "__kernel void edges_to_u8(__global const ulong *black, __global const ulong *white, int nwords,\n"
+    "                          __global uchar *edgeim, int s, int w, int h)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    if (x >= w || y >= h)\n"
+    "        return;\n"
+    "\n"
+    "    int b = (black[y*nwords + x/64] >> (x & 63)) & 1, wt = (white[y*nwords + x/64] >> (x & 63)) & 1;\n"
+    "    edgeim[y*s + x] = b ? 0xc0 : (wt ? 0x3f : 0);\n"
+    "}\n"
+    "\n"
+    "/* uf is a unionfind's data: (parent, size) per element. Parents\n"
+    "   only ever decrease (and are never greater than their children),\n"
+    "   so that the paths end, and can be halved as they are followed\n"
+    "   whatever else is linked meanwhile. */\n"
+    "uint cc_find(volatile __global uint *uf, uint a)\n"
+    "{\n"
+    "    for (;;) {\n"
+    "        uint p = uf[2*a];\n"
+    "        if (p == a)\n"
+    "            return a;\n"
+    "        uint gp = uf[2*p];\n"
+    "        if (gp != p)\n"
+    "            atomic_min(&uf[2*a], gp);\n"
+    "        a = gp;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "void cc_merge(volatile __global uint *uf, uint a, uint b)\n"
+    "{\n"
+    "    for (;;) {\n"
+    "        a = cc_find(uf, a);\n"
+    "        b = cc_find(uf, b);\n"
+    "        if (a == b)\n"
+    "            return;\n"
+    "        if (a < b) {\n"
+    "            uint t = a;\n"
+    "            a = b;\n"
+    "            b = t;\n"
+    "        }\n"
+    "        /* link the larger root to the smaller; if it was no longer\n"
+    "           a root, join its new parent to b instead. */\n"
+    "        uint old = atomic_min(&uf[2*a], b);\n"
+    "        if (old == a)\n"
+    "            return;\n"
+    "        a = old;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "__kernel void cc_init(__global uint *uf, int n)\n"
+    "{\n"
+    "    int p = get_global_id(0);\n"
+    "    if (p >= n)\n"
+    "        return;\n"
+    "    uf[2*p] = p;\n"
+    "    uf[2*p + 1] = 0;\n"
+    "}\n"
+    "\n"
+    "__kernel void cc_link(__global const uchar *edgeim, int s, int w, int h, volatile __global uint *uf)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    if (x < 1 || x >= w - 1 || y >= h - 1)\n"
+    "        return;\n"
+    "\n"
+    "    uchar v = edgeim[y*s + x];\n"
+    "    if (v == 0)\n"
+    "        return;\n"
+    "\n"
+    "    uint p = y*w + x;\n"
+    "    if (edgeim[y*s + x + 1] == v)\n"
+    "        cc_merge(uf, p, p + 1);\n"
+    "    if (edgeim[(y+1)*s + x - 1] == v)\n"
+    "        cc_merge(uf, p, p + w - 1);\n"
+    "    if (edgeim[(y+1)*s + x] == v)\n"
+    "        cc_merge(uf, p, p + w);\n"
+    "    if (edgeim[(y+1)*s + x + 1] == v)\n"
+    "        cc_merge(uf, p, p + w + 1);\n"
+    "}\n"
+    "\n"
+    "__kernel void cc_flatten(volatile __global uint *uf, int n)\n"
+    "{\n"
+    "    int p = get_global_id(0);\n"
+    "    if (p >= n)\n"
+    "        return;\n"
+    "    uint root = cc_find(uf, p);\n"
+    "    uf[2*p] = root;\n"
+    "    atomic_inc(&uf[2*root + 1]);\n"
+    "}\n";
+
+enum {
+    KERNEL_DECIMATE, KERNEL_CONVOLVE_ROWS, KERNEL_CONVOLVE_COLS,
+    KERNEL_TILE_MINMAX, KERNEL_TILE_THRESH, KERNEL_BINARIZE,
+    KERNEL_DEGLITCH, KERNEL_FIND_EDGES, KERNEL_EDGES_TO_U8,
+    KERNEL_CC_INIT, KERNEL_CC_LINK, KERNEL_CC_FLATTEN,
+    NKERNELS
+};
+
+static const char *const kernel_names[NKERNELS] = {
+    "decimate", "convolve_rows", "convolve_cols",
+    "tile_minmax", "tile_thresh", "binarize",
+    "deglitch", "find_edges", "edges_to_u8",
+    "cc_init", "cc_link", "cc_flatten",
+};
+
+// A buffer of at least alloc bytes, and where it is mapped (for the
+// buffers shared with the host), or NULL.
+struct gpu_buffer
+{
+    cl_mem mem;
+    size_t alloc;
+    void *map;
+};
+
+struct apriltag_gpu
+{
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernels[NKERNELS];
+
+    // shared with the host: the input and the results.
+    struct gpu_buffer in, im, threshbits, black, white, edgeim, uf;
+
+    // the GPU's own.
+    struct gpu_buffer tmp, tmax, tmin, thresh, rawbits, taps;
+
+    // the results, as images (in the mapped buffers).
+    image_u8_t im_view, edgeim_view;
+    image_u1_t threshim_view, black_view, white_view;
+    unionfind_t uf_view;
+};
+
+static int gpu_check(cl_int err, const char *what)
+{
+    if (err == CL_SUCCESS)
+        return 0;
+
+    fprintf(stderr, "apriltag: OpenCL error %d in %s; segmenting on the CPU\n", (int) err, what);
+    return -1;
+}
+
+static void gpu_buffer_release(struct gpu_buffer *b)
+{
+    if (b->mem)
+        clReleaseMemObject(b->mem);
+    memset(b, 0, sizeof(*b));
+}
+
+// (Re)allocate b to hold sz bytes. The shared buffers are allocated by
+// OpenCL in memory the host can map without copying.
+static int gpu_buffer_reserve(apriltag_gpu_t *gpu, struct gpu_buffer *b, size_t sz, int shared)
+{
+    if (sz <= b->alloc)
+        return 0;
+
+    gpu_buffer_release(b);
+
+    cl_int err;
+    cl_mem_flags flags = CL_MEM_READ_WRITE | (shared ? CL_MEM_ALLOC_HOST_PTR : 0);
+    b->mem = clCreateBuffer(gpu->context, flags, sz, NULL, &err);
+    if (gpu_check(err, "clCreateBuffer"))
+        return -1;
+
+    b->alloc = sz;
+    return 0;
+}
+
+static int gpu_map(apriltag_gpu_t *gpu, struct gpu_buffer *b, size_t sz, cl_map_flags flags)
+{
+    cl_int err;
+    b->map = clEnqueueMapBuffer(gpu->queue, b->mem, CL_TRUE, flags, 0, sz, 0, NULL, NULL, &err);
+    return gpu_check(err, "clEnqueueMapBuffer");
+}
+
+static int gpu_unmap(apriltag_gpu_t *gpu, struct gpu_buffer *b)
+{
+    if (!b->map)
+        return 0;
+
+    cl_int err = clEnqueueUnmapMemObject(gpu->queue, b->mem, b->map, 0, NULL, NULL);
+    b->map = NULL;
+    return gpu_check(err, "clEnqueueUnmapMemObject");
+}
+
+// Set the arguments of kernel k, given as (size, pointer) pairs, and
+// run it over a w x h grid.
+static int gpu_run(apriltag_gpu_t *gpu, int k, size_t w, size_t h, int nargs, ...)
+{
+    va_list ap;
+    va_start(ap, nargs);
+    cl_int err = CL_SUCCESS;
+    for (int i = 0; i < nargs && err == CL_SUCCESS; i++) {
+        size_t sz = va_arg(ap, size_t);
+        const void *arg = va_arg(ap, const void*);
+        err = clSetKernelArg(gpu->kernels[k], i, sz, arg);
+    }
+    va_end(ap);
+
+    if (gpu_check(err, kernel_names[k]))
+        return -1;
+
+    size_t global[2] = { w, h };
+    err = clEnqueueNDRangeKernel(gpu->queue, gpu->kernels[k], h > 1 ? 2 : 1, NULL, global, NULL,
+                                 0, NULL, NULL);
+    return gpu_check(err, kernel_names[k]);
+}
+
+#define MEM(b) sizeof(cl_mem), &(b).mem
+#define INT(v) sizeof(cl_int), &(v)
+
+apriltag_gpu_t *apriltag_gpu_create(void)
+{
+    cl_platform_id platforms[16];
+    cl_uint nplatforms = 0;
+    if (clGetPlatformIDs(16, platforms, &nplatforms) != CL_SUCCESS)
+        nplatforms = 0;
+
+    // the first GPU there is.
+    cl_device_id device = NULL;
+    for (cl_uint i = 0; i < nplatforms && device == NULL; i++) {
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS)
+            device = NULL;
+    }
+
+    if (device == NULL) {
+        fprintf(stderr, "apriltag: no OpenCL GPU; segmenting on the CPU\n");
+        return NULL;
+    }
+
+    apriltag_gpu_t *gpu = calloc(1, sizeof(apriltag_gpu_t));
+
+    cl_int err;
+    gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (gpu_check(err, "clCreateContext"))
+        goto fail;
+
+    gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &err);
+    if (gpu_check(err, "clCreateCommandQueue"))
+        goto fail;
+
+    gpu->program = clCreateProgramWithSource(gpu->context, 1, &gpu_source, NULL, &err);
+    if (gpu_check(err, "clCreateProgramWithSource"))
+        goto fail;
+
+    err = clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        char log[4096] = "";
+        clGetProgramBuildInfo(gpu->program, device, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+        fprintf(stderr, "apriltag: couldn't build the OpenCL kernels:\n%s\n", log);
+        goto fail;
+    }
+
+    for (int i = 0; i < NKERNELS; i++) {
+        gpu->kernels[i] = clCreateKernel(gpu->program, kernel_names[i], &err);
+        if (gpu_check(err, "clCreateKernel"))
+            goto fail;
+    }
+
+    return gpu;
+
+  fail:
+    apriltag_gpu_destroy(gpu);
+    return NULL;
+}
+
+void apriltag_gpu_destroy(apriltag_gpu_t *gpu)
+{
+    if (!gpu)
+        return;
+
+    struct gpu_buffer *buffers[] = {
+        &gpu->in, &gpu->im, &gpu->threshbits, &gpu->black, &gpu->white, &gpu->edgeim, &gpu->uf,
+        &gpu->tmp, &gpu->tmax, &gpu->tmin, &gpu->thresh, &gpu->rawbits, &gpu->taps,
+    };
+
+    for (int i = 0; i < (int) (sizeof(buffers) / sizeof(buffers[0])); i++) {
+        if (gpu->queue)
+            gpu_unmap(gpu, buffers[i]);
+        gpu_buffer_release(buffers[i]);
+    }
+
+    if (gpu->queue)
+        clFinish(gpu->queue);
+
+    for (int i = 0; i < NKERNELS; i++) {
+        if (gpu->kernels[i])
+            clReleaseKernel(gpu->kernels[i]);
+    }
+    if (gpu->program)
+        clReleaseProgram(gpu->program);
+    if (gpu->queue)
+        clReleaseCommandQueue(gpu->queue);
+    if (gpu->context)
+        clReleaseContext(gpu->context);
+
+    free(gpu);
+}
+
+int apriltag_gpu_segment(apriltag_gpu_t *gpu, const image_u8_t *im, int factor,
+                         const uint8_t *k, int ksz, int sharpen,
+                         const struct apriltag_quad_thresh_params *qtp,
+                         apriltag_gpu_frame_t *frame)
+{
+    struct gpu_buffer *shared[] = {
+        &gpu->in, &gpu->im, &gpu->threshbits, &gpu->black, &gpu->white, &gpu->edgeim, &gpu->uf,
+    };
+
+    // the last frame's results are the GPU's again.
+    for (int i = 0; i < (int) (sizeof(shared) / sizeof(shared[0])); i++) {
+        if (gpu_unmap(gpu, shared[i]))
+            return -1;
+    }
+
+    cl_int iw = im->width, ih = im->height, is = image_u8_default_stride(iw);
+    cl_int w = iw / factor, h = ih / factor, s = image_u8_default_stride(w);
+    cl_int nwords = image_u1_default_stride(w);
+    cl_int tw = w / 4 + 1, th = h / 4 + 1;
+    cl_int nuf = w * h + 1;
+    cl_int cfactor = factor, cksz = ksz, csharpen = sharpen;
+    cl_int min_diff = qtp->min_white_black_diff;
+
+    size_t insz = (size_t) is * ih, imsz = (size_t) s * h;
+    size_t bitsz = (size_t) nwords * h * sizeof(uint64_t);
+    size_t ufsz = (size_t) nuf * sizeof(struct ufrec);
+
+    if (gpu_buffer_reserve(gpu, &gpu->in, insz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->im, imsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->threshbits, bitsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->black, bitsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->white, bitsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->edgeim, imsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->uf, ufsz, 1) ||
+        gpu_buffer_reserve(gpu, &gpu->tmp, imsz, 0) ||
+        gpu_buffer_reserve(gpu, &gpu->tmax, (size_t) tw * th, 0) ||
+        gpu_buffer_reserve(gpu, &gpu->tmin, (size_t) tw * th, 0) ||
+        gpu_buffer_reserve(gpu, &gpu->thresh, (size_t) tw * th, 0) ||
+        gpu_buffer_reserve(gpu, &gpu->rawbits, bitsz, 0) ||
+        gpu_buffer_reserve(gpu, &gpu->taps, ksz > 1 ? ksz : 1, 0))
+        return -1;
+
+    // the input, written where the GPU reads it.
+    if (gpu_map(gpu, &gpu->in, insz, CL_MAP_WRITE))
+        return -1;
+    for (int y = 0; y < ih; y++)
+        memcpy((uint8_t*) gpu->in.map + (size_t) y*is, &im->buf[y*im->stride], iw);
+    if (gpu_unmap(gpu, &gpu->in))
+        return -1;
+
+    // decimate into im (or copy, unless the blur will), then blur im
+    // in place through tmp.
+    struct gpu_buffer *src = &gpu->in;
+    cl_int ss = is;
+
+    if (factor > 1) {
+        if (gpu_run(gpu, KERNEL_DECIMATE, w, h, 7, MEM(gpu->in), INT(is), MEM(gpu->im), INT(s),
+                    INT(w), INT(h), INT(cfactor)))
+            return -1;
+        src = &gpu->im;
+        ss = s;
+    } else if (ksz <= 1) {
+        // (the strides are the same.)
+        if (gpu_check(clEnqueueCopyBuffer(gpu->queue, gpu->in.mem, gpu->im.mem, 0, 0, imsz, 0, NULL, NULL),
+                      "clEnqueueCopyBuffer"))
+            return -1;
+    }
+
+    if (ksz > 1) {
+        if (gpu_check(clEnqueueWriteBuffer(gpu->queue, gpu->taps.mem, CL_FALSE, 0, ksz, k, 0, NULL, NULL),
+                      "clEnqueueWriteBuffer"))
+            return -1;
+
+        if (gpu_run(gpu, KERNEL_CONVOLVE_ROWS, w, h, 8, MEM(*src), INT(ss), MEM(gpu->tmp), INT(s),
+                    INT(w), INT(h), MEM(gpu->taps), INT(cksz)) ||
+            gpu_run(gpu, KERNEL_CONVOLVE_COLS, w, h, 11, MEM(gpu->tmp), INT(s), MEM(gpu->im), INT(s),
+                    MEM(*src), INT(ss), INT(w), INT(h), MEM(gpu->taps), INT(cksz), INT(csharpen)))
+            return -1;
+    }
+
+    // threshold, deglitch and find the edges.
+    struct gpu_buffer *bits = qtp->deglitch ? &gpu->rawbits : &gpu->threshbits;
+
+    if (gpu_run(gpu, KERNEL_TILE_MINMAX, tw, th, 8, MEM(gpu->im), INT(s), INT(w), INT(h),
+                MEM(gpu->tmax), MEM(gpu->tmin), INT(tw), INT(th)) ||
+        gpu_run(gpu, KERNEL_TILE_THRESH, tw, th, 6, MEM(gpu->tmax), MEM(gpu->tmin), INT(tw), INT(th),
+                INT(min_diff), MEM(gpu->thresh)) ||
+        gpu_run(gpu, KERNEL_BINARIZE, nwords, h, 8, MEM(gpu->im), INT(s), INT(w), INT(h),
+                MEM(gpu->thresh), INT(tw), MEM(*bits), INT(nwords)))
+        return -1;
+
+    if (qtp->deglitch &&
+        gpu_run(gpu, KERNEL_DEGLITCH, nwords, h, 5, MEM(gpu->rawbits), MEM(gpu->threshbits),
+                INT(w), INT(h), INT(nwords)))
+        return -1;
+
+    if (gpu_run(gpu, KERNEL_FIND_EDGES, nwords, h, 6, MEM(gpu->threshbits), MEM(gpu->black),
+                MEM(gpu->white), INT(w), INT(h), INT(nwords)) ||
+        gpu_run(gpu, KERNEL_EDGES_TO_U8, w, h, 7, MEM(gpu->black), MEM(gpu->white), INT(nwords),
+                MEM(gpu->edgeim), INT(s), INT(w), INT(h)))
+        return -1;
+
+    // the connected components of the edges.
+    if (gpu_run(gpu, KERNEL_CC_INIT, nuf, 1, 2, MEM(gpu->uf), INT(nuf)) ||
+        gpu_run(gpu, KERNEL_CC_LINK, w, h, 5, MEM(gpu->edgeim), INT(s), INT(w), INT(h), MEM(gpu->uf)) ||
+        gpu_run(gpu, KERNEL_CC_FLATTEN, nuf, 1, 2, MEM(gpu->uf), INT(nuf)))
+        return -1;
+
+    // map the results (waiting for them). The CPU compresses paths in
+    // the components, and may draw in the edge image.
+    cl_map_flags rw = CL_MAP_READ | CL_MAP_WRITE;
+    if (gpu_map(gpu, &gpu->im, imsz, rw) ||
+        gpu_map(gpu, &gpu->threshbits, bitsz, rw) ||
+        gpu_map(gpu, &gpu->black, bitsz, rw) ||
+        gpu_map(gpu, &gpu->white, bitsz, rw) ||
+        gpu_map(gpu, &gpu->edgeim, imsz, rw) ||
+        gpu_map(gpu, &gpu->uf, ufsz, rw))
+        return -1;
+
+    // const initializers
+    image_u8_t imv = { .width = w, .height = h, .stride = s, .buf = gpu->im.map };
+    image_u8_t edgev = { .width = w, .height = h, .stride = s, .buf = gpu->edgeim.map };
+    image_u1_t threshv = { .width = w, .height = h, .stride = nwords, .buf = gpu->threshbits.map };
+    image_u1_t blackv = { .width = w, .height = h, .stride = nwords, .buf = gpu->black.map };
+    image_u1_t whitev = { .width = w, .height = h, .stride = nwords, .buf = gpu->white.map };
+    memcpy(&gpu->im_view, &imv, sizeof(imv));
+    memcpy(&gpu->edgeim_view, &edgev, sizeof(edgev));
+    memcpy(&gpu->threshim_view, &threshv, sizeof(threshv));
+    memcpy(&gpu->black_view, &blackv, sizeof(blackv));
+    memcpy(&gpu->white_view, &whitev, sizeof(whitev));
+    gpu->uf_view.maxid = nuf - 1;
+    gpu->uf_view.data = gpu->uf.map;
+
+    frame->im = &gpu->im_view;
+    frame->threshim = &gpu->threshim_view;
+    frame->edge_black = &gpu->black_view;
+    frame->edge_white = &gpu->white_view;
+    frame->edgeim = &gpu->edgeim_view;
+    frame->uf = &gpu->uf_view;
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _APRILTAG_GPU_H
+#define _APRILTAG_GPU_H
+
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "common/image_u1.h"
+#include "common/image_u8.h"
+#include "common/unionfind.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The segmentation of apriltag_quad_thresh on the GPU, with OpenCL
+// (see td->gpu): the decimation, blur, threshold, deglitching, edges
+// and connected components of an image, as the CPU would compute them
+// (but for td->qtp.tile_tolerance, which is ignored: every tile is
+// thresholded). The quads are then fit to the components, and
+// decoded, on the CPU as usual.
+//
+// The results are read in place, from buffers the GPU shares with
+// the host (allocated by OpenCL, so that an integrated GPU such as a
+// Jetson's writes them in host memory), mapped until the next frame.
+//
+// Built only if CMake finds OpenCL (APRILTAG_OPENCL); otherwise, and
+// when there is no OpenCL GPU, apriltag_gpu_create returns NULL.
+typedef struct apriltag_gpu apriltag_gpu_t;
+
+typedef struct apriltag_gpu_frame apriltag_gpu_frame_t;
+struct apriltag_gpu_frame
+{
+    // the decimated (and blurred) image, its binarization (deglitched
+    // if qtp.deglitch), its edge pixels (packed, and as in the 8 bit
+    // edge image of apriltag_quad_thresh), and their connected
+    // components, over pixels.
+    image_u8_t *im;
+    image_u1_t *threshim;
+    image_u1_t *edge_black, *edge_white;
+    image_u8_t *edgeim;
+    unionfind_t *uf;
+};
+
+// NULL if there is no OpenCL GPU (or no OpenCL).
+apriltag_gpu_t *apriltag_gpu_create(void);
+void apriltag_gpu_destroy(apriltag_gpu_t *gpu);
+
+// Segment im, decimated by factor (an integer, 1 for none) and
+// convolved with the ksz taps k (see image_u8_gaussian_kernel; ksz <=
+// 1 for none), or sharpened by them, into frame, which stays valid
+// until the next call. Returns 0, or -1 if the GPU failed (having
+// printed why), in which case the frame is to be segmented on the
+// CPU.
+int apriltag_gpu_segment(apriltag_gpu_t *gpu, const image_u8_t *im, int factor,
+                         const uint8_t *k, int ksz, int sharpen,
+                         const struct apriltag_quad_thresh_params *qtp,
+                         apriltag_gpu_frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "apriltag_log.h"
+#include "common/matd.h"
+
+// (the stage times must fit, and the records keep their size.)
+typedef char apriltag_log_nstages_check[APRILTAG_NSTAGES <= APRILTAG_LOG_NSTAGES ? 1 : -1];
+typedef char apriltag_log_record_check[sizeof(apriltag_log_record_t) == 128 ? 1 : -1];
+typedef char apriltag_log_header_check[sizeof(apriltag_log_header_t) == 64 ? 1 : -1];
+
+struct apriltag_log_writer
+{
+    int fd;
+    int error;
+
+    apriltag_log_record_t buf[APRILTAG_LOG_BUFFER_RECORDS];
+    int nbuf;
+
+    uint32_t frame;
+
+    // the families logged so far, numbered by their index.
+    zarray_t *families;
+};
+
+static int write_all(int fd, const void *data, size_t sz)
+{
+    const uint8_t *p = data;
+    while (sz > 0) {
+        ssize_t n = write(fd, p, sz);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+apriltag_log_writer_t *apriltag_log_writer_create(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    apriltag_log_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, APRILTAG_LOG_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = APRILTAG_LOG_BYTE_ORDER;
+    hdr.record_size = sizeof(apriltag_log_record_t);
+    hdr.nstages = APRILTAG_NSTAGES;
+
+    if (write_all(fd, &hdr, sizeof(hdr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    apriltag_log_writer_t *w = calloc(1, sizeof(apriltag_log_writer_t));
+    w->fd = fd;
+    w->families = zarray_create(sizeof(apriltag_family_t*));
+    return w;
+}
+
+int apriltag_log_writer_flush(apriltag_log_writer_t *w)
+{
+    if (w->nbuf > 0 && !w->error)
+        w->error = write_all(w->fd, w->buf, w->nbuf * sizeof(apriltag_log_record_t));
+    w->nbuf = 0;
+
+    return w->error ? -1 : 0;
+}
+
+int apriltag_log_writer_destroy(apriltag_log_writer_t *w)
+{
+    if (!w)
+        return 0;
+
+    int res = apriltag_log_writer_flush(w);
+    if (close(w->fd) != 0)
+        res = -1;
+
+    zarray_destroy(w->families);
+    free(w);
+    return res;
+}
+
+// A new record of the current frame, in the buffer.
+static apriltag_log_record_t *log_record(apriltag_log_writer_t *w, int64_t utime)
+{
+    if (w->nbuf == APRILTAG_LOG_BUFFER_RECORDS)
+        apriltag_log_writer_flush(w);
+
+    apriltag_log_record_t *r = &w->buf[w->nbuf++];
+    memset(r, 0, sizeof(*r));
+    r->utime = utime;
+    r->frame = w->frame;
+    return r;
+}
+
+void apriltag_log_family_record(apriltag_log_record_t *r, int family, const apriltag_family_t *fam)
+{
+    r->type = APRILTAG_LOG_FAMILY;
+    r->family = family;
+    memset(r->payload, 0, sizeof(r->payload));
+    r->fam.d = fam->d;
+    r->fam.h = fam->h;
+    r->fam.ncodes = fam->ncodes;
+    strncpy(r->fam.name, fam->name ? fam->name : "", sizeof(r->fam.name) - 1);
+}
+
+// The number of fam in the log, writing its record first if it is new.
+static int log_family(apriltag_log_writer_t *w, int64_t utime, apriltag_family_t *fam)
+{
+    for (int i = 0; i < zarray_size(w->families); i++) {
+        apriltag_family_t *f;
+        zarray_get(w->families, i, &f);
+        if (f == fam)
+            return i;
+    }
+
+    int idx = zarray_size(w->families);
+    zarray_add(w->families, &fam);
+
+    apriltag_log_family_record(log_record(w, utime), idx, fam);
+    return idx;
+}
+
+void apriltag_log_frame_record(apriltag_log_record_t *r, int ndets, const apriltag_stats_t *stats)
+{
+    r->type = APRILTAG_LOG_FRAME;
+    r->family = 0;
+    memset(r->payload, 0, sizeof(r->payload));
+    r->stats.ndetections = ndets;
+
+    if (stats) {
+        r->stats.degraded = stats->degraded;
+        r->stats.detect_utime = stats->utime;
+        for (int i = 0; i < APRILTAG_NSTAGES; i++)
+            r->stats.stage_utime[i] = stats->stage_utime[i];
+    }
+}
+
+void apriltag_log_detection_record(apriltag_log_record_t *r, int family, const apriltag_detection_record_t *det)
+{
+    r->type = APRILTAG_LOG_DETECTION;
+    r->family = family;
+    memset(r->payload, 0, sizeof(r->payload));
+    r->det.id = det->id;
+    r->det.hamming = det->hamming;
+    r->det.goodness = det->goodness;
+    r->det.decision_margin = det->decision_margin;
+    for (int i = 0; i < 9; i++)
+        r->det.H[i] = det->H[i];
+    for (int i = 0; i < 2; i++)
+        r->det.c[i] = det->c[i];
+    for (int i = 0; i < 4; i++) {
+        r->det.p[i][0] = det->p[i][0];
+        r->det.p[i][1] = det->p[i][1];
+    }
+}
+
+int apriltag_log_write_detections(apriltag_log_writer_t *w, int64_t utime, const zarray_t *detections,
+                                  const apriltag_stats_t *stats)
+{
+    int ndets = zarray_size(detections);
+    int families[ndets + 1];
+
+    for (int i = 0; i < ndets; i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+        families[i] = log_family(w, utime, det->family);
+    }
+
+    apriltag_log_frame_record(log_record(w, utime), ndets, stats);
+
+    for (int i = 0; i < ndets; i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+
+        apriltag_detection_record_t rec;
+        rec.family = det->family;
+        rec.id = det->id;
+        rec.hamming = det->hamming;
+        rec.goodness = det->goodness;
+        rec.decision_margin = det->decision_margin;
+        memcpy(rec.H, det->H->data, sizeof(rec.H));
+        memcpy(rec.c, det->c, sizeof(rec.c));
+        memcpy(rec.p, det->p, sizeof(rec.p));
+
+        apriltag_log_detection_record(log_record(w, utime), families[i], &rec);
+    }
+
+    w->frame++;
+    return w->error ? -1 : 0;
+}
+
+int apriltag_log_write_records(apriltag_log_writer_t *w, int64_t utime,
+                               const apriltag_detection_record_t *dets, int ndets,
+                               const apriltag_stats_t *stats)
+{
+    int families[ndets + 1];
+    for (int i = 0; i < ndets; i++)
+        families[i] = log_family(w, utime, dets[i].family);
+
+    apriltag_log_frame_record(log_record(w, utime), ndets, stats);
+
+    for (int i = 0; i < ndets; i++)
+        apriltag_log_detection_record(log_record(w, utime), families[i], &dets[i]);
+
+    w->frame++;
+    return w->error ? -1 : 0;
+}
+
+apriltag_log_t *apriltag_log_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(apriltag_log_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t maplen = st.st_size;
+    void *map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const apriltag_log_header_t *hdr = map;
+    if (memcmp(hdr->magic, APRILTAG_LOG_MAGIC, sizeof(hdr->magic)) ||
+        hdr->byte_order != APRILTAG_LOG_BYTE_ORDER ||
+        hdr->record_size != sizeof(apriltag_log_record_t) ||
+        hdr->nstages > APRILTAG_LOG_NSTAGES) {
+        munmap(map, maplen);
+        return NULL;
+    }
+
+    apriltag_log_t *log = calloc(1, sizeof(apriltag_log_t));
+    log->header = hdr;
+    log->records = (const apriltag_log_record_t*) &hdr[1];
+    log->nrecords = (maplen - sizeof(*hdr)) / sizeof(apriltag_log_record_t);
+    log->map = map;
+    log->maplen = maplen;
+    return log;
+}
+
+void apriltag_log_close(apriltag_log_t *log)
+{
+    if (!log)
+        return;
+
+    munmap(log->map, log->maplen);
+    free(log);
+}
+
+const apriltag_log_record_t *apriltag_log_family(const apriltag_log_t *log, int family)
+{
+    for (size_t i = 0; i < log->nrecords; i++) {
+        const apriltag_log_record_t *r = &log->records[i];
+        if (r->type == APRILTAG_LOG_FAMILY && r->family == family)
+            return r;
+    }
+    return NULL;
+}
@@ -0,0 +1,147 @@
+#ifndef _APRILTAG_LOG_H
+#define _APRILTAG_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "common/zarray.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A compact binary log of detections, for recording every frame of
+// many cameras: a header, followed by fixed-size records, so that a
+// log (even one still being written) can be mapped and read in place,
+// e.g. as an array of records by numpy (see scripts/apriltag.py).
+//
+// Each frame is written as the records of the families not seen
+// before in the log (APRILTAG_LOG_FAMILY), then its APRILTAG_LOG_FRAME
+// record, then the APRILTAG_LOG_DETECTION record of each of its
+// ndetections detections. Records are in the byte order of the
+// writer (see header.byte_order).
+
+#define APRILTAG_LOG_MAGIC "ATAGLOG1"
+#define APRILTAG_LOG_BYTE_ORDER 0x01020304
+
+// the number of stage times a frame record has room for (of which
+// header.nstages, APRILTAG_NSTAGES of the writer, are used).
+#define APRILTAG_LOG_NSTAGES 12
+
+typedef struct apriltag_log_header apriltag_log_header_t;
+struct apriltag_log_header
+{
+    char magic[8];
+    uint32_t byte_order;  // APRILTAG_LOG_BYTE_ORDER, as written
+    uint32_t record_size; // sizeof(apriltag_log_record_t)
+    uint32_t nstages;
+    uint8_t reserved[44]; // (the records start 64 bytes in)
+};
+
+enum apriltag_log_type
+{
+    APRILTAG_LOG_FAMILY = 1,
+    APRILTAG_LOG_FRAME = 2,
+    APRILTAG_LOG_DETECTION = 3,
+};
+
+// 128 bytes.
+typedef struct apriltag_log_record apriltag_log_record_t;
+struct apriltag_log_record
+{
+    int64_t utime;   // the frame's time, as given to the writer
+    uint32_t frame;  // the frame's number in the log, from 0
+    uint16_t type;   // enum apriltag_log_type
+    uint16_t family; // the number of the family (of a detection, or of a family record)
+
+    union {
+        struct {
+            int32_t id, hamming;
+            float goodness, decision_margin;
+            float H[9]; // row major
+            float c[2];
+            float p[4][2];
+        } det;
+
+        // the frame's statistics (see apriltag_stats_t), if the writer
+        // was given them (otherwise zero but for ndetections).
+        struct {
+            uint32_t ndetections;
+            int32_t degraded;
+            int64_t detect_utime;
+            int64_t stage_utime[APRILTAG_LOG_NSTAGES];
+        } stats;
+
+        struct {
+            uint32_t d, h, ncodes;
+            char name[100]; // (nul terminated)
+        } fam;
+
+        uint8_t payload[112];
+    };
+};
+
+// Writes a log, buffering APRILTAG_LOG_BUFFER_RECORDS records at a
+// time. A writer is meant to be used by one thread.
+#define APRILTAG_LOG_BUFFER_RECORDS 512
+
+typedef struct apriltag_log_writer apriltag_log_writer_t;
+
+// Create (or truncate) the log at path. Returns NULL if it can't be
+// opened.
+apriltag_log_writer_t *apriltag_log_writer_create(const char *path);
+
+// Flush and close the log. Returns 0, or -1 if any write failed.
+int apriltag_log_writer_destroy(apriltag_log_writer_t *w);
+
+// Log a frame taken at utime: its detections (as from
+// apriltag_detector_detect, or from apriltag_detector_detect_into),
+// and, unless stats is NULL, its statistics (e.g.
+// apriltag_detector_stats). The families of the detections must stay
+// alive as long as the writer, which numbers them by address. Returns
+// 0, or -1 if a write failed.
+int apriltag_log_write_detections(apriltag_log_writer_t *w, int64_t utime, const zarray_t *detections,
+                                  const apriltag_stats_t *stats);
+int apriltag_log_write_records(apriltag_log_writer_t *w, int64_t utime,
+                               const apriltag_detection_record_t *dets, int ndets,
+                               const apriltag_stats_t *stats);
+
+// Write the records buffered so far. Returns 0, or -1 on failure.
+int apriltag_log_writer_flush(apriltag_log_writer_t *w);
+
+// Fill in the type, family and payload of r, as the record of the
+// family numbered family, of a frame of ndets detections (with stats,
+// unless NULL), or of a detection of the family numbered family (for
+// records kept elsewhere than a log, e.g. see apriltag_shm.h).
+void apriltag_log_family_record(apriltag_log_record_t *r, int family, const apriltag_family_t *fam);
+void apriltag_log_frame_record(apriltag_log_record_t *r, int ndets, const apriltag_stats_t *stats);
+void apriltag_log_detection_record(apriltag_log_record_t *r, int family, const apriltag_detection_record_t *det);
+
+// A log, mapped for reading: its whole records, as of when it was
+// opened.
+typedef struct apriltag_log apriltag_log_t;
+struct apriltag_log
+{
+    const apriltag_log_header_t *header;
+    const apriltag_log_record_t *records;
+    size_t nrecords;
+
+    void *map;
+    size_t maplen;
+};
+
+// Returns NULL if path can't be mapped, or isn't a log of this byte
+// order and record size.
+apriltag_log_t *apriltag_log_open(const char *path);
+void apriltag_log_close(apriltag_log_t *log);
+
+// The APRILTAG_LOG_FAMILY record of the family numbered family, or
+// NULL.
+const apriltag_log_record_t *apriltag_log_family(const apriltag_log_t *log, int family);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
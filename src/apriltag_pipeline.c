@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag_pipeline.h"
+#include "common/workerpool.h"
+
+enum { SLOT_IDLE, SLOT_QUEUED, SLOT_DONE };
+
+// A frame in flight, detected with a context of its own in its own
+// thread.
+struct slot
+{
+    apriltag_pipeline_t *pl;
+    apriltag_detect_context_t *ctx;
+    pthread_t thread;
+    pthread_cond_t startcond; // signals that a frame has been queued
+
+    int state;
+    image_u8_t *im;
+    void *user;
+    zarray_t *detections;
+};
+
+struct apriltag_pipeline
+{
+    // a copy of the parameters and families of the detector.
+    apriltag_detector_t *td;
+
+    workerpool_t *wp;
+    int wp_owned;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t donecond; // signals that a frame is done
+    int exit;
+
+    // a ring of depth slots: the frames in flight are the count slots
+    // starting at head, oldest first.
+    struct slot *slots;
+    int depth;
+    int head, count;
+};
+
+static void *slot_run(void *p)
+{
+    struct slot *s = p;
+    apriltag_pipeline_t *pl = s->pl;
+
+    pthread_mutex_lock(&pl->mutex);
+
+    while (1) {
+        while (s->state != SLOT_QUEUED && !pl->exit)
+            pthread_cond_wait(&s->startcond, &pl->mutex);
+
+        if (pl->exit)
+            break;
+
+        pthread_mutex_unlock(&pl->mutex);
+        zarray_t *detections = apriltag_detector_detect_ctx(pl->td, s->ctx, s->im);
+        pthread_mutex_lock(&pl->mutex);
+
+        s->detections = detections;
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&pl->donecond);
+    }
+
+    pthread_mutex_unlock(&pl->mutex);
+    return NULL;
+}
+
+// A detector with td's parameters and families, but none of its
+// state, running on wp (or if wp is NULL, on one thread).
+static apriltag_detector_t *detector_copy(const apriltag_detector_t *td, workerpool_t *wp)
+{
+    apriltag_detector_t *copy = apriltag_detector_create();
+
+    // the user-configurable parameters are the leading fields of the
+    // struct.
+    memcpy(copy, td, offsetof(apriltag_detector_t, tp));
+    copy->track_interval = 0;
+
+    // not apriltag_detector_add_family: the families' decode tables
+    // belong to td.
+    for (int i = 0; i < zarray_size(td->tag_families); i++) {
+        apriltag_family_t *fam;
+        zarray_get(td->tag_families, i, &fam);
+        zarray_add(copy->tag_families, &fam);
+    }
+
+    if (wp)
+        apriltag_detector_set_workerpool(copy, wp);
+    else
+        copy->nthreads = 1;
+    return copy;
+}
+
+// With shared, the frames' threaded work runs on td's workerpool (or
+// one of the pipeline's own); otherwise each frame's context runs
+// all of its own work.
+static apriltag_pipeline_t *pipeline_create(apriltag_detector_t *td, int depth, int shared)
+{
+    assert(depth >= 1);
+
+    apriltag_pipeline_t *pl = calloc(1, sizeof(apriltag_pipeline_t));
+
+    if (!shared) {
+        pl->wp = NULL;
+    } else if (td->wp) {
+        pl->wp = td->wp;
+    } else {
+        pl->wp = workerpool_create(td->nthreads);
+        pl->wp_owned = 1;
+    }
+
+    pl->td = detector_copy(td, pl->wp);
+
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->donecond, NULL);
+
+    pl->depth = depth;
+    pl->slots = calloc(depth, sizeof(struct slot));
+
+    for (int i = 0; i < depth; i++) {
+        struct slot *s = &pl->slots[i];
+        s->pl = pl;
+        s->ctx = apriltag_detect_context_create();
+        pthread_cond_init(&s->startcond, NULL);
+
+        int res = pthread_create(&s->thread, NULL, slot_run, s);
+        if (res != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    return pl;
+}
+
+apriltag_pipeline_t *apriltag_pipeline_create(apriltag_detector_t *td, int depth)
+{
+    return pipeline_create(td, depth, 1);
+}
+
+apriltag_pipeline_t *apriltag_pipeline_create_parallel(apriltag_detector_t *td, int depth)
+{
+    return pipeline_create(td, depth, 0);
+}
+
+void apriltag_pipeline_destroy(apriltag_pipeline_t *pl)
+{
+    if (pl == NULL)
+        return;
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->exit = 1;
+    for (int i = 0; i < pl->depth; i++)
+        pthread_cond_signal(&pl->slots[i].startcond);
+    pthread_mutex_unlock(&pl->mutex);
+
+    for (int i = 0; i < pl->depth; i++) {
+        struct slot *s = &pl->slots[i];
+        pthread_join(s->thread, NULL);
+        pthread_cond_destroy(&s->startcond);
+
+        if (s->state == SLOT_DONE)
+            apriltag_detections_destroy(s->detections);
+
+        apriltag_detect_context_destroy(s->ctx);
+    }
+
+    // leave the families' decode tables alone (see detector_copy).
+    zarray_clear(pl->td->tag_families);
+    apriltag_detector_destroy(pl->td);
+
+    free(pl->slots);
+    pthread_cond_destroy(&pl->donecond);
+    pthread_mutex_destroy(&pl->mutex);
+
+    if (pl->wp_owned)
+        workerpool_destroy(pl->wp);
+
+    free(pl);
+}
+
+int apriltag_pipeline_submit(apriltag_pipeline_t *pl, image_u8_t *im, void *user)
+{
+    pthread_mutex_lock(&pl->mutex);
+
+    if (pl->count == pl->depth) {
+        pthread_mutex_unlock(&pl->mutex);
+        return -1;
+    }
+
+    struct slot *s = &pl->slots[(pl->head + pl->count) % pl->depth];
+    assert(s->state == SLOT_IDLE);
+
+    s->im = im;
+    s->user = user;
+    s->state = SLOT_QUEUED;
+    pl->count++;
+    pthread_cond_signal(&s->startcond);
+
+    pthread_mutex_unlock(&pl->mutex);
+    return 0;
+}
+
+// Take the detections of the oldest frame, which is done. Called with
+// the mutex held.
+static zarray_t *take_oldest(apriltag_pipeline_t *pl, void **user)
+{
+    struct slot *s = &pl->slots[pl->head];
+    zarray_t *detections = s->detections;
+
+    if (user)
+        *user = s->user;
+
+    s->state = SLOT_IDLE;
+    s->im = NULL;
+    s->user = NULL;
+    s->detections = NULL;
+
+    pl->head = (pl->head + 1) % pl->depth;
+    pl->count--;
+
+    return detections;
+}
+
+zarray_t *apriltag_pipeline_poll(apriltag_pipeline_t *pl, void **user)
+{
+    zarray_t *detections = NULL;
+
+    pthread_mutex_lock(&pl->mutex);
+    if (pl->count > 0 && pl->slots[pl->head].state == SLOT_DONE)
+        detections = take_oldest(pl, user);
+    pthread_mutex_unlock(&pl->mutex);
+
+    return detections;
+}
+
+zarray_t *apriltag_pipeline_wait(apriltag_pipeline_t *pl, void **user)
+{
+    zarray_t *detections = NULL;
+
+    pthread_mutex_lock(&pl->mutex);
+    if (pl->count > 0) {
+        while (pl->slots[pl->head].state != SLOT_DONE)
+            pthread_cond_wait(&pl->donecond, &pl->mutex);
+
+        detections = take_oldest(pl, user);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+
+    return detections;
+}
+
+int apriltag_pipeline_detect_batch(apriltag_pipeline_t *pl, image_u8_t **ims, int nims,
+                                   zarray_t **detections)
+{
+    if (apriltag_pipeline_pending(pl) != 0)
+        return -1;
+
+    // the frames come back in order, so the next to be returned is
+    // that of ims[ndone].
+    int ndone = 0;
+    for (int i = 0; i < nims; i++) {
+        while (apriltag_pipeline_submit(pl, ims[i], NULL) != 0)
+            detections[ndone++] = apriltag_pipeline_wait(pl, NULL);
+    }
+
+    while (ndone < nims)
+        detections[ndone++] = apriltag_pipeline_wait(pl, NULL);
+
+    return 0;
+}
+
+int apriltag_pipeline_pending(apriltag_pipeline_t *pl)
+{
+    pthread_mutex_lock(&pl->mutex);
+    int count = pl->count;
+    pthread_mutex_unlock(&pl->mutex);
+
+    return count;
+}
@@ -0,0 +1,89 @@
+#ifndef _APRILTAG_PIPELINE_H
+#define _APRILTAG_PIPELINE_H
+
+#include "apriltag.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs apriltag_detector_detect on a stream of frames, several frames
+// at a time, so that the threads are kept busy through the serial
+// parts of each frame (cluster gathering, reconciling the
+// detections, ...): while one frame is in such a part, the threaded
+// work (decimation, thresholding, decoding) of the next frame runs.
+// Detections are returned in the order in which the frames were
+// submitted.
+//
+// Each frame in flight has a context of its own (see
+// apriltag_detect_context_t), and all of the contexts share one
+// workerpool, so a pipeline uses no more worker threads than its
+// detector would (plus one thread per frame in flight, which runs the
+// serial parts).
+//
+// A pipeline is meant to be used by one thread; the frames of one
+// pipeline must not be submitted from several threads at once.
+typedef struct apriltag_pipeline apriltag_pipeline_t;
+
+// Create a pipeline with up to depth frames in flight, detecting
+// tags as td would. The parameters and families of td are copied when
+// the pipeline is created: later changes to td do not affect it. td
+// must not be destroyed (nor its families removed) before the
+// pipeline, but may still be used by itself. The pipeline's frames
+// are not tracked (see track_interval), since each frame starts
+// before the detections of the previous frame are known.
+//
+// The threaded work runs on td's workerpool if it has been given one
+// (see apriltag_detector_set_workerpool), and otherwise on a pool of
+// td->nthreads threads of the pipeline's own.
+apriltag_pipeline_t *apriltag_pipeline_create(apriltag_detector_t *td, int depth);
+
+// Create a pipeline for throughput rather than latency (offline
+// batches): its depth frames in flight are each detected on one
+// thread, their own, as by a single-threaded detector (td->nthreads
+// and td's workerpool are not used), so that none of them waits on
+// the serial parts of another, and depth frames are detected on depth
+// cores at once. The decode tables of td's families are shared, as
+// by apriltag_pipeline_create, and the detections are returned in the
+// order in which the frames were submitted.
+apriltag_pipeline_t *apriltag_pipeline_create_parallel(apriltag_detector_t *td, int depth);
+
+// Frames still in flight are finished (or abandoned, if they haven't
+// started yet), and their detections destroyed.
+void apriltag_pipeline_destroy(apriltag_pipeline_t *pl);
+
+// Start detecting the tags of im. im is used (and may be blurred in
+// place, see quad_sigma) by the pipeline until its detections have
+// been returned, and must not be modified or freed until then. user
+// is returned with the detections. Returns 0, or -1 (without
+// submitting im) if depth frames are already in flight.
+int apriltag_pipeline_submit(apriltag_pipeline_t *pl, image_u8_t *im, void *user);
+
+// The detections (as from apriltag_detector_detect) of the oldest
+// frame in flight, if they are ready, in which case *user (if user is
+// not NULL) is set to the pointer the frame was submitted with.
+// Returns NULL, without waiting, if they aren't ready (or no frame is
+// in flight).
+zarray_t *apriltag_pipeline_poll(apriltag_pipeline_t *pl, void **user);
+
+// The same as apriltag_pipeline_poll, but waits for the detections of
+// the oldest frame. Returns NULL only if no frame is in flight.
+zarray_t *apriltag_pipeline_wait(apriltag_pipeline_t *pl, void **user);
+
+// Detect the tags of the nims images ims (e.g. the synchronized
+// frames of several cameras) together, depth of them at a time, and
+// set detections[i] to the detections of ims[i]. Returns 0, or -1
+// (detecting nothing) if frames submitted by apriltag_pipeline_submit
+// are still in flight.
+int apriltag_pipeline_detect_batch(apriltag_pipeline_t *pl, image_u8_t **ims, int nims,
+                                   zarray_t **detections);
+
+// The number of frames submitted whose detections haven't been
+// returned yet.
+int apriltag_pipeline_pending(apriltag_pipeline_t *pl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1115 @@
+// The gradient-based quad detector (td->quad_gradient): rather than
+// thresholding the image and finding the connected components of its
+// edges, it finds the pixels of strong gradient, joins neighbouring
+// ones of similar direction into straight segments, and looks for
+// four segments which meet head to tail around a quad. On
+// high-contrast images, where there are few strong edges besides those
+// of the tags, this is cheaper than apriltag_quad_thresh, and much
+// cheaper when there is noise (which the threshold turns into a great
+// many components, but makes few strong edges).
+// It needs the black border of a tag to be at least a couple of
+// pixels wide, however (in the decimated image): the 3x3 gradient
+// blurs the two edges of a narrower one together.
+//
+// As for the other detectors, the image is usually the decimated
+// one, and the quads are refined at full resolution afterwards (see
+// refine_edges).
+//
+// The steps:
+//
+// 1. (in bands of rows) the Sobel gradient of every pixel, and the
+//    pixels whose gradient is at least qgp.min_magnitude and is a
+//    local maximum along its direction (non-maximum suppression), with
+//    their gradient direction.
+//
+// 2. (serially, so that the result does not depend on the threads) a
+//    union-find of the neighbouring edge pixels, which joins two
+//    components only if the gradient directions of the union span no
+//    more than qgp.max_angle_range: a component is then one straight
+//    side, which does not run on around a rounded corner.
+//
+// 3. (by components) a line fit to the pixels of each component. Each
+//    segment is directed by its gradient (with the dark side on its
+//    right, in the image), so that the sides of a dark quad run head
+//    to tail around it, turning the same way at every corner. Then
+//    (serially) the segments which carry on along the same line are
+//    joined, since a side is often broken where the edges of the
+//    tag's bits meet it, and those long and straight enough are kept.
+//
+// 4. (by segments) the segments which each segment may turn into at a
+//    corner (which start near where it ends, in a new direction), and
+//    then the cycles of four of them, whose corners are the
+//    intersections of their lines.
+
+#define _GNU_SOURCE // for M_PI
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "apriltag_scratch.h"
+#include "image_u8.h"
+#include "math_util.h"
+#include "workerpool.h"
+#include "zarray.h"
+
+// gradient directions are quantized to this many codes around the
+// circle. (A power of two, so that differences wrap with a mask.)
+#define GRAD_NDIRS 1024
+
+// the direction code of a pixel that is not an edge.
+#define GRAD_NO_EDGE 0xffff
+
+#define GRAD_NONE UINT32_MAX
+
+// a segment keeps up to this many (of the nearest) segments it may
+// turn into.
+#define GRAD_MAX_CHILDREN 8
+
+// up to this many quads start at each segment.
+#define GRAD_MAX_SEED_QUADS 4
+
+struct grad_uf
+{
+    uint32_t parent, size;
+
+    // the directions of the component's gradients span [ref + lo, ref
+    // + hi] (in direction codes, wrapping around).
+    uint16_t ref;
+    int16_t lo, hi;
+};
+
+// the moments of a segment's pixels (each weighted by its gradient),
+// and the sum of their gradients.
+struct grad_moments
+{
+    double W, Sx, Sy, Sxx, Syy, Sxy, Gx, Gy;
+};
+
+struct grad_segment
+{
+    float c[2];         // a point on the line (the centroid)
+    float d[2];         // unit direction, with the dark side on the right
+    float p0[2], p1[2]; // the ends
+    float len;
+    float mse;          // the mean squared distance of the pixels from the line
+
+    struct grad_moments m;
+};
+
+// The segments whose start is in each cell of a grid over the image:
+// segs[offsets[cell]] to segs[offsets[cell+1] - 1].
+struct grad_grid
+{
+    int cellsz, gw, gh;
+    uint32_t *offsets;
+    uint32_t *segs;
+};
+
+void apriltag_quad_gradient_defaults(struct apriltag_quad_gradient_params *qgp)
+{
+    qgp->min_magnitude = 40;
+    qgp->max_angle_range = 30 * M_PI / 180;
+    qgp->min_segment_length = 4;
+    qgp->max_line_fit_mse = 1.0;
+    qgp->corner_gap_scl = 0.25;
+    qgp->corner_gap_bias = 3.0;
+    qgp->critical_rad = 20 * M_PI / 180;
+    qgp->min_side_length = 6;
+    qgp->min_aspect = 0.1;
+    qgp->min_side_coverage = 0.5;
+}
+
+////////////////////////////////////////////////////////////////////
+// 1. gradients and edge pixels
+
+struct grad_task
+{
+    const image_u8_t *im;
+    uint32_t *mag;   // the squared gradient of each pixel (w per row)
+    uint16_t *theta; // the direction of each edge pixel
+    uint32_t thresh;
+    int y0, y1;
+    int nedges;
+};
+
+static inline void sobel(const image_u8_t *im, int x, int y, int *gx, int *gy)
+{
+    const uint8_t *a = &im->buf[(y-1)*im->stride], *b = a + im->stride, *c = b + im->stride;
+
+    *gx = (a[x+1] + 2*b[x+1] + c[x+1]) - (a[x-1] + 2*b[x-1] + c[x-1]);
+    *gy = (c[x-1] + 2*c[x] + c[x+1]) - (a[x-1] + 2*a[x] + a[x+1]);
+}
+
+// atan2f(y, x), to within 1e-5 radians, and rather faster.
+static inline float fast_atan2f(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float a = fminf(ax, ay) / fmaxf(fmaxf(ax, ay), 1e-30f);
+    float s = a*a;
+    float r = ((-0.0464964749f*s + 0.15931422f)*s - 0.327622764f)*s*a + a;
+
+    if (ay > ax)
+        r = (float) (M_PI / 2) - r;
+    if (x < 0)
+        r = (float) M_PI - r;
+    return y < 0 ? -r : r;
+}
+
+static void gradient_task(void *p)
+{
+    struct grad_task *task = p;
+    const image_u8_t *im = task->im;
+    int w = im->width, h = im->height;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        uint32_t *mag = &task->mag[y*w];
+
+        if (y == 0 || y == h - 1) {
+            memset(mag, 0, w * sizeof(uint32_t));
+            continue;
+        }
+
+        mag[0] = mag[w-1] = 0;
+
+        // (as sobel, with the rows at hand, and restrict so that the
+        // loop vectorizes.)
+        const uint8_t *restrict r0 = &im->buf[(y-1)*im->stride];
+        const uint8_t *restrict r1 = r0 + im->stride;
+        const uint8_t *restrict r2 = r1 + im->stride;
+        uint32_t *restrict out = mag;
+
+        for (int x = 1; x < w - 1; x++) {
+            int gx = (r0[x+1] - r0[x-1]) + 2*(r1[x+1] - r1[x-1]) + (r2[x+1] - r2[x-1]);
+            int gy = (r2[x-1] + 2*r2[x] + r2[x+1]) - (r0[x-1] + 2*r0[x] + r0[x+1]);
+            out[x] = gx*gx + gy*gy;
+        }
+    }
+}
+
+// keep the pixels of strong gradient that are not weaker than their
+// neighbours across the edge (ties go to the first of them, so that an
+// edge between two equal pixels is one pixel wide).
+static void edge_task(void *p)
+{
+    struct grad_task *task = p;
+    const image_u8_t *im = task->im;
+    int w = im->width, h = im->height;
+    int nedges = 0;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        uint16_t *theta = &task->theta[y*w];
+
+        // (GRAD_NO_EDGE is all ones.)
+        memset(theta, 0xff, w * sizeof(uint16_t));
+
+        if (y == 0 || y == h - 1)
+            continue;
+
+        const uint32_t *mag = &task->mag[y*w];
+
+        for (int x = 1; x < w - 1; x++) {
+            uint32_t m = mag[x];
+            if (m < task->thresh)
+                continue;
+
+            int gx, gy;
+            sobel(im, x, y, &gx, &gy);
+
+            // the neighbours along the gradient (quantized to 45
+            // degrees: tan(22.5) = 53/128).
+            int ax = abs(gx), ay = abs(gy);
+            int dx, dy;
+            if (128*ay < 53*ax) {
+                dx = 1; dy = 0;
+            } else if (128*ax < 53*ay) {
+                dx = 0; dy = 1;
+            } else {
+                dx = 1; dy = ((gx > 0) == (gy > 0)) ? 1 : -1;
+            }
+
+            uint32_t mprev = mag[x - dx - dy*w], mnext = mag[x + dx + dy*w];
+            if (dy < 0) {
+                uint32_t t = mprev; mprev = mnext; mnext = t;
+            }
+
+            if (m <= mprev || m < mnext)
+                continue;
+
+            int code = (int) floorf(fast_atan2f(gy, gx) * (GRAD_NDIRS / (2 * M_PI)) + 0.5f);
+            theta[x] = code & (GRAD_NDIRS - 1);
+            nedges++;
+        }
+    }
+
+    task->nedges = nedges;
+}
+
+////////////////////////////////////////////////////////////////////
+// 2. components
+
+static inline uint32_t grad_uf_find(struct grad_uf *uf, uint32_t id)
+{
+    while (uf[id].parent != id) {
+        uf[id].parent = uf[uf[id].parent].parent;
+        id = uf[id].parent;
+    }
+    return id;
+}
+
+// join the components of a and b, unless their directions would then
+// span more than max_range.
+static inline void grad_uf_join(struct grad_uf *uf, uint32_t a, uint32_t b, int max_range)
+{
+    uint32_t ra = grad_uf_find(uf, a), rb = grad_uf_find(uf, b);
+    if (ra == rb)
+        return;
+
+    // b's directions, relative to a's reference.
+    int d = ((uf[rb].ref - uf[ra].ref + GRAD_NDIRS/2) & (GRAD_NDIRS - 1)) - GRAD_NDIRS/2;
+    int lo = imin(uf[ra].lo, uf[rb].lo + d), hi = imax(uf[ra].hi, uf[rb].hi + d);
+
+    if (hi - lo > max_range)
+        return;
+
+    if (uf[ra].size >= uf[rb].size) {
+        uf[rb].parent = ra;
+        uf[ra].size += uf[rb].size;
+        uf[ra].lo = lo;
+        uf[ra].hi = hi;
+    } else {
+        uf[ra].parent = rb;
+        uf[rb].size += uf[ra].size;
+        uf[rb].lo = lo - d;
+        uf[rb].hi = hi - d;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// 3. segments
+
+static inline void moments_add(struct grad_moments *m, const struct grad_moments *n)
+{
+    m->W += n->W;
+    m->Sx += n->Sx;
+    m->Sy += n->Sy;
+    m->Sxx += n->Sxx;
+    m->Syy += n->Syy;
+    m->Sxy += n->Sxy;
+    m->Gx += n->Gx;
+    m->Gy += n->Gy;
+}
+
+// the line (c, d and mse) of seg's moments.
+static void segment_line(struct grad_segment *seg)
+{
+    const struct grad_moments *m = &seg->m;
+
+    double cx = m->Sx / m->W, cy = m->Sy / m->W;
+    double Cxx = m->Sxx / m->W - cx*cx, Cyy = m->Syy / m->W - cy*cy, Cxy = m->Sxy / m->W - cx*cy;
+
+    // the mean squared distance from the line is the smaller
+    // eigenvalue of the covariance; the line runs along the
+    // eigenvector of the larger.
+    double hd = 0.5 * (Cxx - Cyy);
+    double phi = 0.5 * atan2(2*Cxy, Cxx - Cyy);
+    double dx = cos(phi), dy = sin(phi);
+
+    // the gradient points from dark to light, and so to the left of
+    // the direction (in the image, whose y axis is down).
+    if (dx*m->Gy - dy*m->Gx > 0) {
+        dx = -dx;
+        dy = -dy;
+    }
+
+    seg->c[0] = cx;
+    seg->c[1] = cy;
+    seg->d[0] = dx;
+    seg->d[1] = dy;
+    seg->mse = fmax(0, 0.5 * (Cxx + Cyy) - sqrt(hd*hd + Cxy*Cxy));
+}
+
+// the ends of seg, between the projections tmin and tmax of its pixels
+// on its line.
+static void segment_ends(struct grad_segment *seg, double tmin, double tmax)
+{
+    seg->p0[0] = seg->c[0] + tmin*seg->d[0];
+    seg->p0[1] = seg->c[1] + tmin*seg->d[1];
+    seg->p1[0] = seg->c[0] + tmax*seg->d[0];
+    seg->p1[1] = seg->c[1] + tmax*seg->d[1];
+    seg->len = tmax - tmin;
+}
+
+static inline double segment_project(const struct grad_segment *seg, double x, double y)
+{
+    return (x - seg->c[0])*seg->d[0] + (y - seg->c[1])*seg->d[1];
+}
+
+struct fit_task
+{
+    int w;
+    const uint32_t *mag;
+    const uint16_t *theta;
+    const uint32_t *members; // the pixels of the components, by component
+    const uint32_t *offsets; // the first member of each component
+    struct grad_segment *segs; // of each component
+    int c0, c1;
+};
+
+static void fit_task(void *p)
+{
+    struct fit_task *task = p;
+    int w = task->w;
+
+    for (int c = task->c0; c < task->c1; c++) {
+        const uint32_t *px = &task->members[task->offsets[c]];
+        int n = task->offsets[c+1] - task->offsets[c];
+
+        struct grad_segment *seg = &task->segs[c];
+        struct grad_moments *m = &seg->m;
+        memset(m, 0, sizeof(*m));
+
+        for (int i = 0; i < n; i++) {
+            double x = px[i] % w + 0.5, y = px[i] / w + 0.5;
+            double wt = sqrt(task->mag[px[i]]);
+            double th = task->theta[px[i]] * (2 * M_PI / GRAD_NDIRS);
+
+            m->W += wt;
+            m->Sx += wt*x;
+            m->Sy += wt*y;
+            m->Sxx += wt*x*x;
+            m->Syy += wt*y*y;
+            m->Sxy += wt*x*y;
+            m->Gx += wt*cos(th);
+            m->Gy += wt*sin(th);
+        }
+
+        segment_line(seg);
+
+        double tmin = HUGE_VAL, tmax = -HUGE_VAL;
+        for (int i = 0; i < n; i++) {
+            double t = segment_project(seg, px[i] % w + 0.5, px[i] / w + 0.5);
+            tmin = fmin(tmin, t);
+            tmax = fmax(tmax, t);
+        }
+
+        segment_ends(seg, tmin, tmax);
+    }
+}
+
+// the gap within which the end of a and the start of b meet (at a
+// corner, or along a side).
+static inline float corner_gap(const struct apriltag_quad_gradient_params *qgp,
+                               const struct grad_segment *a, const struct grad_segment *b)
+{
+    return qgp->corner_gap_bias + qgp->corner_gap_scl * fminf(a->len, b->len);
+}
+
+// index the starts of the n segments in grid (whose cellsz, gw and gh
+// are set), using cell_of (n elements) as working space.
+static void grid_build(struct grad_grid *grid, const struct grad_segment *segs, int n, uint32_t *cell_of)
+{
+    int ncells = grid->gw * grid->gh;
+    memset(grid->offsets, 0, (ncells + 1) * sizeof(uint32_t));
+
+    for (int i = 0; i < n; i++) {
+        int gx = iclamp((int) (segs[i].p0[0] / grid->cellsz), 0, grid->gw - 1);
+        int gy = iclamp((int) (segs[i].p0[1] / grid->cellsz), 0, grid->gh - 1);
+        cell_of[i] = gy*grid->gw + gx;
+        grid->offsets[cell_of[i]]++;
+    }
+
+    uint32_t acc = 0;
+    for (int cell = 0; cell <= ncells; cell++) {
+        uint32_t count = grid->offsets[cell];
+        grid->offsets[cell] = acc;
+        acc += count;
+    }
+
+    // (offsets[cell] advances to the end of the cell's segments,
+    // which is where the next cell's start.)
+    for (int i = 0; i < n; i++)
+        grid->segs[grid->offsets[cell_of[i]]++] = i;
+
+    for (int cell = ncells; cell > 0; cell--)
+        grid->offsets[cell] = grid->offsets[cell-1];
+    grid->offsets[0] = 0;
+}
+
+// the range of cells [*gx0, *gx1] x [*gy0, *gy1] within r of p.
+static inline void grid_range(const struct grad_grid *grid, const float p[2], float r,
+                              int *gx0, int *gx1, int *gy0, int *gy1)
+{
+    *gx0 = imax(0, (int) floorf((p[0] - r) / grid->cellsz));
+    *gx1 = imin(grid->gw - 1, (int) floorf((p[0] + r) / grid->cellsz));
+    *gy0 = imax(0, (int) floorf((p[1] - r) / grid->cellsz));
+    *gy1 = imin(grid->gh - 1, (int) floorf((p[1] + r) / grid->cellsz));
+}
+
+// The segment (of grid) which carries on the line of a from its end:
+// in nearly the same direction, starting within corner_gap of a's end,
+// and straight enough when joined with a. The nearest, or GRAD_NONE.
+static uint32_t segment_continuation(const struct apriltag_quad_gradient_params *qgp,
+                                     const struct grad_segment *segs, const struct grad_grid *grid,
+                                     uint32_t i)
+{
+    const struct grad_segment *a = &segs[i];
+    float min_dot = cosf(qgp->max_angle_range);
+
+    uint32_t best = GRAD_NONE;
+    float best_dist = HUGE_VALF;
+
+    int gx0, gx1, gy0, gy1;
+    grid_range(grid, a->p1, qgp->corner_gap_bias + qgp->corner_gap_scl * a->len, &gx0, &gx1, &gy0, &gy1);
+
+    for (int gy = gy0; gy <= gy1; gy++) {
+        for (int gx = gx0; gx <= gx1; gx++) {
+            int cell = gy*grid->gw + gx;
+
+            for (uint32_t k = grid->offsets[cell]; k < grid->offsets[cell+1]; k++) {
+                uint32_t j = grid->segs[k];
+                const struct grad_segment *b = &segs[j];
+
+                if (j == i || a->d[0]*b->d[0] + a->d[1]*b->d[1] < min_dot)
+                    continue;
+
+                float dx = b->p0[0] - a->p1[0], dy = b->p0[1] - a->p1[1];
+                float dist = sqrtf(dx*dx + dy*dy);
+                if (dist > corner_gap(qgp, a, b) || dist >= best_dist)
+                    continue;
+
+                struct grad_segment joined;
+                joined.m = a->m;
+                moments_add(&joined.m, &b->m);
+                segment_line(&joined);
+
+                if (joined.mse > qgp->max_line_fit_mse)
+                    continue;
+
+                best = j;
+                best_dist = dist;
+            }
+        }
+    }
+
+    return best;
+}
+
+// the segment of the chain of segments first, next[first], ...
+// (stopping before end), whose moments seg already has.
+static void chain_segment(struct grad_segment *seg, const struct grad_segment *segs,
+                          const uint32_t *next, uint32_t first, uint32_t end)
+{
+    segment_line(seg);
+
+    // (the ends of the chain's segments bound its pixels.)
+    double tmin = HUGE_VAL, tmax = -HUGE_VAL;
+    for (uint32_t j = first; j != end; j = next[j]) {
+        const struct grad_segment *b = &segs[j];
+        double t0 = segment_project(seg, b->p0[0], b->p0[1]);
+        double t1 = segment_project(seg, b->p1[0], b->p1[1]);
+        tmin = fmin(tmin, fmin(t0, t1));
+        tmax = fmax(tmax, fmax(t0, t1));
+    }
+
+    segment_ends(seg, tmin, tmax);
+}
+
+// Join the chains of segments which carry on from one another (each
+// segment carries on from at most one, the first, in order, to find
+// it) into out, and return how many there are. A chain is broken
+// wherever it would no longer be straight enough, and segments in a
+// loop of continuations are dropped.
+static int join_segments(const struct apriltag_quad_gradient_params *qgp,
+                         const struct grad_segment *segs, int n, const struct grad_grid *grid,
+                         uint32_t *next, uint32_t *prev, struct grad_segment *out)
+{
+    for (int i = 0; i < n; i++)
+        next[i] = prev[i] = GRAD_NONE;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t j = segment_continuation(qgp, segs, grid, i);
+        if (j != GRAD_NONE && prev[j] == GRAD_NONE) {
+            next[i] = j;
+            prev[j] = i;
+        }
+    }
+
+    int nout = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (prev[i] != GRAD_NONE)
+            continue;
+
+        struct grad_segment *seg = &out[nout++];
+        *seg = segs[i];
+        uint32_t first = i;
+
+        for (uint32_t j = next[i]; j != GRAD_NONE; j = next[j]) {
+            struct grad_segment joined;
+            joined.m = seg->m;
+            moments_add(&joined.m, &segs[j].m);
+            segment_line(&joined);
+
+            if (joined.mse > qgp->max_line_fit_mse) {
+                chain_segment(seg, segs, next, first, j);
+                seg = &out[nout++];
+                *seg = segs[j];
+                first = j;
+            } else {
+                seg->m = joined.m;
+            }
+        }
+
+        if (first != (uint32_t) i || next[i] != GRAD_NONE)
+            chain_segment(seg, segs, next, first, GRAD_NONE);
+    }
+
+    return nout;
+}
+
+////////////////////////////////////////////////////////////////////
+// 4. quads
+
+struct quad_gradient_task
+{
+    apriltag_detect_context_t *ctx;
+    const apriltag_detector_t *td;
+    const struct grad_segment *segs;
+
+    const struct grad_grid *grid;
+
+    uint32_t *children; // GRAD_MAX_CHILDREN per segment
+    uint8_t *nchildren;
+
+    struct quad *quads; // GRAD_MAX_SEED_QUADS per segment
+    uint8_t *nquads;
+
+    float min_size, max_size;
+    int s0, s1;
+
+    // the candidate quads rejected, and (of those that were fit) why.
+    int nrejected;
+    uint32_t rejected[APRILTAG_NREJECTS];
+};
+
+static inline float cross2(const float a[2], const float b[2])
+{
+    return a[0]*b[1] - a[1]*b[0];
+}
+
+static void children_task(void *p)
+{
+    struct quad_gradient_task *task = p;
+    const struct apriltag_quad_gradient_params *qgp = &task->td->qgp;
+    float min_turn = sinf(qgp->critical_rad);
+
+    for (int i = task->s0; i < task->s1; i++) {
+        const struct grad_segment *a = &task->segs[i];
+        uint32_t *children = &task->children[i * GRAD_MAX_CHILDREN];
+        float dists[GRAD_MAX_CHILDREN];
+        int n = 0;
+
+        const struct grad_grid *grid = task->grid;
+        int gx0, gx1, gy0, gy1;
+        grid_range(grid, a->p1, qgp->corner_gap_bias + qgp->corner_gap_scl * a->len, &gx0, &gx1, &gy0, &gy1);
+
+        for (int gy = gy0; gy <= gy1; gy++) {
+            for (int gx = gx0; gx <= gx1; gx++) {
+                int cell = gy*grid->gw + gx;
+
+                for (uint32_t k = grid->offsets[cell]; k < grid->offsets[cell+1]; k++) {
+                    uint32_t j = grid->segs[k];
+                    const struct grad_segment *b = &task->segs[j];
+
+                    // a corner turns (towards the dark side) by more
+                    // than critical_rad and less than 180 -
+                    // critical_rad.
+                    if (j == (uint32_t) i || cross2(a->d, b->d) < min_turn)
+                        continue;
+
+                    float dx = b->p0[0] - a->p1[0], dy = b->p0[1] - a->p1[1];
+                    float dist = sqrtf(dx*dx + dy*dy);
+                    if (dist > corner_gap(qgp, a, b))
+                        continue;
+
+                    // keep the nearest, in order.
+                    int pos = n;
+                    while (pos > 0 && dists[pos-1] > dist)
+                        pos--;
+                    if (pos >= GRAD_MAX_CHILDREN)
+                        continue;
+                    int last = imin(n, GRAD_MAX_CHILDREN - 1);
+                    for (int q = last; q > pos; q--) {
+                        children[q] = children[q-1];
+                        dists[q] = dists[q-1];
+                    }
+                    children[pos] = j;
+                    dists[pos] = dist;
+                    n = imin(n + 1, GRAD_MAX_CHILDREN);
+                }
+            }
+        }
+
+        task->nchildren[i] = n;
+    }
+}
+
+static inline int is_child(const struct quad_gradient_task *task, uint32_t parent, uint32_t child)
+{
+    const uint32_t *children = &task->children[parent * GRAD_MAX_CHILDREN];
+
+    for (int k = 0; k < task->nchildren[parent]; k++) {
+        if (children[k] == child)
+            return 1;
+    }
+    return 0;
+}
+
+// the intersection of the lines of a and b, or 0 if they are parallel.
+static inline int segment_intersect(const struct grad_segment *a, const struct grad_segment *b, float p[2])
+{
+    float denom = cross2(a->d, b->d);
+    if (denom == 0)
+        return 0;
+
+    float dc[2] = { b->c[0] - a->c[0], b->c[1] - a->c[1] };
+    float s = cross2(dc, b->d) / denom;
+
+    p[0] = a->c[0] + s*a->d[0];
+    p[1] = a->c[1] + s*a->d[1];
+    return 1;
+}
+
+static inline float turn(const float p[2], const float q[2], const float r[2])
+{
+    return (q[0] - p[0])*(r[1] - p[1]) - (r[0] - p[0])*(q[1] - p[1]);
+}
+
+// the quad of the sides ids (each the child of the one before, and
+// the first the child of the last), or 0 if it isn't one (and why, in
+// *reject).
+static int quad_from_segments(const struct quad_gradient_task *task, const uint32_t ids[4], struct quad *q,
+                              int *reject)
+{
+    const struct apriltag_quad_gradient_params *qgp = &task->td->qgp;
+    const struct grad_segment *segs[4];
+    for (int i = 0; i < 4; i++)
+        segs[i] = &task->segs[ids[i]];
+
+    // p[i] is where side i starts.
+    float p[4][2];
+    for (int i = 0; i < 4; i++) {
+        if (!segment_intersect(segs[(i+3)&3], segs[i], p[i])) {
+            *reject = APRILTAG_REJECT_SHAPE;
+            return 0;
+        }
+    }
+
+    float lmin = HUGE_VALF, lmax = 0;
+    for (int i = 0; i < 4; i++) {
+        const float *a = p[i], *b = p[(i+1)&3];
+        float l = sqrtf((b[0]-a[0])*(b[0]-a[0]) + (b[1]-a[1])*(b[1]-a[1]));
+
+        // the segment must account for enough of its side.
+        if (segs[i]->len < qgp->min_side_coverage * l) {
+            *reject = APRILTAG_REJECT_LINE_FIT;
+            return 0;
+        }
+
+        lmin = fminf(lmin, l);
+        lmax = fmaxf(lmax, l);
+    }
+
+    if (lmin < qgp->min_side_length || lmin < qgp->min_aspect * lmax) {
+        *reject = APRILTAG_REJECT_SHAPE;
+        return 0;
+    }
+
+    // every corner of a convex quad turns the same way as the sides.
+    for (int i = 0; i < 4; i++) {
+        if (turn(p[i], p[(i+1)&3], p[(i+2)&3]) < 0) {
+            *reject = APRILTAG_REJECT_SHAPE;
+            return 0;
+        }
+    }
+
+    if (task->min_size > 0 || task->max_size > 0) {
+        float xmin = p[0][0], xmax = p[0][0], ymin = p[0][1], ymax = p[0][1];
+        for (int i = 1; i < 4; i++) {
+            xmin = fminf(xmin, p[i][0]);
+            xmax = fmaxf(xmax, p[i][0]);
+            ymin = fminf(ymin, p[i][1]);
+            ymax = fmaxf(ymax, p[i][1]);
+        }
+
+        float size = fmaxf(xmax - xmin, ymax - ymin);
+        if (size < task->min_size || (task->max_size > 0 && size > task->max_size)) {
+            *reject = APRILTAG_REJECT_CLUSTER_SIZE;
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        q->p[i][0] = p[i][0];
+        q->p[i][1] = p[i][1];
+    }
+
+    return 1;
+}
+
+// the quads whose first side (of the lowest index) is each segment.
+static void quads_task(void *p)
+{
+    struct quad_gradient_task *task = p;
+
+    for (uint32_t a = task->s0; a < (uint32_t) task->s1; a++) {
+        // (the quads found so far are still decoded.)
+        if (apriltag_detect_context_expired(task->ctx, APRILTAG_DEGRADED_SEARCH)) {
+            for (; a < (uint32_t) task->s1; a++)
+                task->nquads[a] = 0;
+            break;
+        }
+
+        const uint32_t *ca = &task->children[a * GRAD_MAX_CHILDREN];
+        int nquads = 0;
+
+        for (int ib = 0; ib < task->nchildren[a]; ib++) {
+            uint32_t b = ca[ib];
+            if (b < a)
+                continue;
+
+            const uint32_t *cb = &task->children[b * GRAD_MAX_CHILDREN];
+
+            for (int ic = 0; ic < task->nchildren[b]; ic++) {
+                uint32_t c = cb[ic];
+                if (c < a || c == b)
+                    continue;
+
+                const uint32_t *cc = &task->children[c * GRAD_MAX_CHILDREN];
+
+                for (int id = 0; id < task->nchildren[c]; id++) {
+                    uint32_t d = cc[id];
+                    if (d < a || d == b || d == c || !is_child(task, d, a))
+                        continue;
+
+                    uint32_t ids[4] = { a, b, c, d };
+                    int reject = -1;
+                    if (nquads < GRAD_MAX_SEED_QUADS &&
+                        quad_from_segments(task, ids, &task->quads[a * GRAD_MAX_SEED_QUADS + nquads], &reject)) {
+                        nquads++;
+                    } else {
+                        task->nrejected++;
+                        if (reject >= 0)
+                            task->rejected[reject]++;
+                    }
+                }
+            }
+        }
+
+        task->nquads[a] = nquads;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+zarray_t *apriltag_quad_gradient(apriltag_detect_context_t *ctx, image_u8_t *im, float decimate)
+{
+    apriltag_detector_t *td = ctx->td;
+    const struct apriltag_quad_gradient_params *qgp = &td->qgp;
+    apriltag_scratch_t *s = ctx->scratch;
+
+    zarray_t *quads = apriltag_scratch_quads(s, sizeof(struct quad));
+
+    int w = im->width, h = im->height;
+    if (w < 3 || h < 3)
+        return quads;
+
+    ////////////////////////////////////////////////////////
+    // 1. gradients and edge pixels
+
+    uint32_t *mag = apriltag_scratch_buffer(&s->grad_mag, (size_t) w * h * sizeof(uint32_t));
+    uint16_t *theta = apriltag_scratch_buffer(&s->grad_theta, (size_t) w * h * sizeof(uint16_t));
+
+    uint32_t nedges = 0;
+
+    {
+        int chunksize = 1 + h / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+        struct grad_task tasks[h / chunksize + 1];
+
+        // (the Sobel gradient is 4 times the difference of the
+        // neighbours.)
+        uint32_t thresh = 16 * qgp->min_magnitude * qgp->min_magnitude;
+
+        int ntasks = 0;
+        for (int y = 0; y < h; y += chunksize) {
+            tasks[ntasks].im = im;
+            tasks[ntasks].mag = mag;
+            tasks[ntasks].theta = theta;
+            tasks[ntasks].thresh = thresh;
+            tasks[ntasks].y0 = y;
+            tasks[ntasks].y1 = imin(h, y + chunksize);
+            ntasks++;
+        }
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, gradient_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, edge_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++)
+            nedges += tasks[i].nedges;
+    }
+
+    if (td->debug) {
+        image_u8_t *edges = image_u8_create(w, h);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++)
+                edges->buf[y*edges->stride + x] = theta[y*w + x] == GRAD_NO_EDGE ? 0 : 255;
+        }
+        image_u8_write_pnm(edges, "debug_gradient_edges.pnm");
+        image_u8_destroy(edges);
+    }
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_THRESHOLD, "gradient");
+
+    // out of time, there are no quads to be had from this image.
+    if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        return quads;
+
+    ////////////////////////////////////////////////////////
+    // 2. components
+
+    // the edge pixels' ids in this row and the one above (which is all
+    // that the neighbours need).
+    uint32_t *labels = apriltag_scratch_buffer(&s->grad_labels, 2 * (size_t) w * sizeof(uint32_t));
+    struct grad_uf *uf = apriltag_scratch_buffer(&s->grad_uf, (nedges + 1) * sizeof(struct grad_uf));
+    uint32_t *pixels = apriltag_scratch_buffer(&s->grad_pixels, (nedges + 1) * sizeof(uint32_t));
+
+    int max_range = qgp->max_angle_range * (GRAD_NDIRS / (2 * M_PI));
+
+    uint32_t id = 0;
+    for (int x = 0; x < 2*w; x++)
+        labels[x] = GRAD_NONE;
+
+    for (int y = 1; y < h; y++) {
+        uint32_t *above = &labels[((y-1) & 1) * w], *row = &labels[(y & 1) * w];
+        const uint16_t *th = &theta[y*w];
+
+        for (int x = 0; x < w; x++) {
+            if (th[x] == GRAD_NO_EDGE) {
+                row[x] = GRAD_NONE;
+                continue;
+            }
+
+            row[x] = id;
+            pixels[id] = y*w + x;
+            uf[id].parent = id;
+            uf[id].size = 1;
+            uf[id].ref = th[x];
+            uf[id].lo = uf[id].hi = 0;
+
+            // (edge pixels are never in the first or last column.)
+            const uint32_t neighbours[4] = { row[x-1], above[x-1], above[x], above[x+1] };
+            for (int k = 0; k < 4; k++) {
+                if (neighbours[k] != GRAD_NONE)
+                    grad_uf_join(uf, id, neighbours[k], max_range);
+            }
+
+            id++;
+        }
+    }
+
+    // the components big enough to be segments (numbered in the order
+    // of their first pixels), and their pixels, by component.
+    uint32_t *cluster_of = apriltag_scratch_buffer(&s->grad_clusters, (nedges + 1) * sizeof(uint32_t));
+    uint32_t *offsets = apriltag_scratch_buffer(&s->grad_offsets, (nedges + 2) * sizeof(uint32_t));
+    uint32_t *members = apriltag_scratch_buffer(&s->grad_members, (nedges + 1) * sizeof(uint32_t));
+
+    // (shorter components may still be joined into segments.)
+    uint32_t min_pixels = 2;
+    uint32_t ncomponents = 0, nclusters = 0;
+
+    // (cluster_of is indexed by the root of each component.)
+    for (uint32_t i = 0; i < nedges; i++)
+        cluster_of[i] = GRAD_NONE;
+
+    for (uint32_t i = 0; i < nedges; i++) {
+        uint32_t r = grad_uf_find(uf, i);
+        if (r == i)
+            ncomponents++;
+        if (uf[r].size >= min_pixels && cluster_of[r] == GRAD_NONE) {
+            cluster_of[r] = nclusters;
+            offsets[nclusters++] = 0;
+        }
+        if (cluster_of[r] != GRAD_NONE)
+            offsets[cluster_of[r]]++;
+    }
+
+    uint32_t acc = 0;
+    for (uint32_t c = 0; c < nclusters; c++) {
+        uint32_t n = offsets[c];
+        offsets[c] = acc;
+        acc += n;
+    }
+
+    // (offsets[c] advances to the end of c's members, which is where
+    // c + 1's start.)
+    for (uint32_t i = 0; i < nedges; i++) {
+        uint32_t c = cluster_of[grad_uf_find(uf, i)];
+        if (c != GRAD_NONE)
+            members[offsets[c]++] = pixels[i];
+    }
+
+    for (uint32_t c = nclusters; c > 0; c--)
+        offsets[c] = offsets[c-1];
+    offsets[0] = 0;
+
+    ctx->stats.nclusters += ncomponents;
+    ctx->stats.ncluster_rejected += ncomponents - nclusters;
+    ctx->stats.nrejected[APRILTAG_REJECT_CLUSTER_PIXELS] += ncomponents - nclusters;
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_SEGMENT, "edge components");
+
+    if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        return quads;
+
+    ////////////////////////////////////////////////////////
+    // 3. segments
+
+    struct grad_segment *segs = apriltag_scratch_buffer(&s->grad_segments,
+                                                        (nclusters + 1) * sizeof(struct grad_segment));
+
+    if (nclusters > 0) {
+        int chunksize = 1 + nclusters / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+        struct fit_task tasks[nclusters / chunksize + 1];
+
+        int ntasks = 0;
+        for (uint32_t c = 0; c < nclusters; c += chunksize) {
+            tasks[ntasks].w = w;
+            tasks[ntasks].mag = mag;
+            tasks[ntasks].theta = theta;
+            tasks[ntasks].members = members;
+            tasks[ntasks].offsets = offsets;
+            tasks[ntasks].segs = segs;
+            tasks[ntasks].c0 = c;
+            tasks[ntasks].c1 = imin(nclusters, c + chunksize);
+
+            workerpool_add_task(ctx->wp, fit_task, &tasks[ntasks]);
+            ntasks++;
+        }
+
+        workerpool_run(ctx->wp);
+    }
+
+    // the curved components are not (part of) sides.
+    int nsegs = 0;
+    for (uint32_t c = 0; c < nclusters; c++) {
+        if (segs[c].mse <= qgp->max_line_fit_mse)
+            segs[nsegs++] = segs[c];
+    }
+
+    // a grid of the segments' starts, in which to look for the
+    // segments starting near the end of each.
+    struct grad_grid grid;
+    grid.cellsz = 16;
+    grid.gw = (w + grid.cellsz - 1) / grid.cellsz;
+    grid.gh = (h + grid.cellsz - 1) / grid.cellsz;
+    grid.offsets = apriltag_scratch_buffer(&s->grad_cell_offsets, (grid.gw*grid.gh + 1) * sizeof(uint32_t));
+    grid.segs = apriltag_scratch_buffer(&s->grad_cell_segs, (nsegs + 1) * sizeof(uint32_t));
+
+    uint32_t *cell_of = apriltag_scratch_buffer(&s->grad_cell_of, (nsegs + 1) * sizeof(uint32_t));
+    uint32_t *next = apriltag_scratch_buffer(&s->grad_next, (nsegs + 1) * sizeof(uint32_t));
+    uint32_t *prev = apriltag_scratch_buffer(&s->grad_prev, (nsegs + 1) * sizeof(uint32_t));
+    struct grad_segment *joined = apriltag_scratch_buffer(&s->grad_joined,
+                                                          (nsegs + 1) * sizeof(struct grad_segment));
+
+    grid_build(&grid, segs, nsegs, cell_of);
+    int njoined = join_segments(qgp, segs, nsegs, &grid, next, prev, joined);
+
+    nsegs = 0;
+    for (int i = 0; i < njoined; i++) {
+        if (joined[i].len >= qgp->min_segment_length)
+            joined[nsegs++] = joined[i];
+    }
+    segs = joined;
+
+    ctx->stats.ncluster_rejected += nclusters - nsegs;
+    ctx->stats.nrejected[APRILTAG_REJECT_CLUSTER_PIXELS] += nclusters - nsegs;
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_CLUSTER, "fit segments");
+
+    if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        return quads;
+
+    ////////////////////////////////////////////////////////
+    // 4. quads
+
+    if (nsegs < 4) {
+        apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_QUAD_FIT, "quads from segments");
+        return quads;
+    }
+
+    grid_build(&grid, segs, nsegs, cell_of);
+
+    uint32_t *children = apriltag_scratch_buffer(&s->grad_children,
+                                                 (size_t) nsegs * GRAD_MAX_CHILDREN * sizeof(uint32_t));
+    uint8_t *nchildren = apriltag_scratch_buffer(&s->grad_nchildren, nsegs);
+    struct quad *seed_quads = apriltag_scratch_buffer(&s->grad_quads,
+                                                      (size_t) nsegs * GRAD_MAX_SEED_QUADS * sizeof(struct quad));
+    uint8_t *nseed_quads = apriltag_scratch_buffer(&s->grad_nquads, nsegs);
+
+    float scale = decimate > 1 ? decimate : 1;
+
+    {
+        int chunksize = 1 + nsegs / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+        struct quad_gradient_task tasks[nsegs / chunksize + 1];
+
+        int ntasks = 0;
+        for (int i = 0; i < nsegs; i += chunksize) {
+            struct quad_gradient_task *task = &tasks[ntasks++];
+            task->ctx = ctx;
+            task->td = td;
+            task->segs = segs;
+            task->grid = &grid;
+            task->children = children;
+            task->nchildren = nchildren;
+            task->quads = seed_quads;
+            task->nquads = nseed_quads;
+            task->min_size = td->min_tag_size / scale;
+            task->max_size = td->max_tag_size / scale;
+            task->s0 = i;
+            task->s1 = imin(nsegs, i + chunksize);
+            task->nrejected = 0;
+            memset(task->rejected, 0, sizeof(task->rejected));
+        }
+
+        // (every segment's children are needed before any quads.)
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, children_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, quads_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++) {
+            ctx->stats.nquad_fit_rejected += tasks[i].nrejected;
+            for (int r = 0; r < APRILTAG_NREJECTS; r++)
+                ctx->stats.nrejected[r] += tasks[i].rejected[r];
+        }
+    }
+
+    for (int i = 0; i < nsegs; i++) {
+        for (int k = 0; k < nseed_quads[i]; k++)
+            zarray_add(quads, &seed_quads[i * GRAD_MAX_SEED_QUADS + k]);
+    }
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_QUAD_FIT, "quads from segments");
+
+    return quads;
+}
@@ -39,13 +39,26 @@ either expressed or implied, of the FreeBSD Project.
 
 #include "assert_with_unused.h"
 #include "apriltag.h"
+#include "apriltag_capture.h"
+#include "apriltag_scratch.h"
+#include "apriltag_gpu.h"
+#include "image_u1.h"
 #include "zarray.h"
 #include "zhash.h"
 #include "unionfind.h"
+#include "memstat.h"
 #include "timeprofile.h"
-#include "zmaxheap.h"
 #include "postscript_utils.h"
 
+#include "simd.h"
+
+#if defined(SIMD_X86)
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*
 static inline uint32_t u64hash_1(uint64_t x) {
     x = ((x >> 16) ^ x) * 0x45d9f3b;
@@ -79,23 +92,6 @@ static inline double terrible_atan2(double y, double x)
     }
 }
 
-static inline uint32_t u64hash_2(uint64_t x) {
-    return (2654435761 * x) >> 32;
-    return (uint32_t) x;
-}
-
-#define TNAME uint64_zarray_hash
-#define TKEYTYPE uint64_t
-#define TVALTYPE zarray_t*
-#define TKEYHASH(pk) (u64hash_2(*(pk)))
-#define TKEYEQUAL(pka, pkb) (*(pka) == *(pkb))
-#include "common/thash_impl.h"
-#undef TKEYEQUAL
-#undef TKEYHASH
-#undef TKEYTYPE
-#undef TVALTYPE
-#undef TNAME
-
 #ifndef M_PI
 # define M_PI 3.141592653589793238462643383279502884196
 #endif
@@ -107,6 +103,41 @@ struct pt
     float theta;
 };
 
+// Two boundary points, either side of an edge, tagged with the
+// cluster (the pair of adjacent components) to which they belong.
+struct cluster_pair
+{
+    uint64_t key;
+    uint16_t x0, y0, x1, y1; // as in struct pt
+};
+
+// A cluster: points [start, start + size) of the points sorted by
+// cluster.
+struct cluster_span
+{
+    uint32_t start, size;
+};
+
+// A run: a maximal horizontal segment [x0, x1) of equal, non-zero
+// pixels of one row of the edge image.
+struct edge_run
+{
+    uint16_t x0, x1;
+    uint8_t v;
+};
+
+// The connected components of the edge image. The elements of uf are
+// either its pixels (y*w + x) or, if runs is not NULL, its runs: the
+// runs of row y are runs[row_runs[y]] to runs[row_runs[y+1] - 1].
+struct components
+{
+    unionfind_t *uf;
+    uint32_t n; // number of elements
+
+    struct edge_run *runs;
+    uint32_t *row_runs;
+};
+
 struct unionfind_task
 {
     int y0, y1;
@@ -115,15 +146,75 @@ struct unionfind_task
     image_u8_t *edgeim;
 };
 
+struct run_task
+{
+    int y0, y1; // [y0, y1)
+    image_u1_t *edge_black, *edge_white;
+    struct components *cc;
+
+    apriltag_scratch_buffer_t *runs; // the runs of rows [y0, y1)
+    uint32_t nruns;
+};
+
+struct threshold_task
+{
+    apriltag_detector_t *td;
+    image_u8_t *im;
+    image_u1_t *threshim;
+    uint8_t *im_max, *im_min;
+    int tilesz, tw, th;
+    int ty0, ty1; // [ty0, ty1), in tiles
+
+    // when the tiles of the previous frame are reused (see
+    // qtp.tile_tolerance): the pixels its tiles were computed
+    // from, and whether each tile (changed[ty*tw + tx]), and any tile
+    // of each row (changed[th*tw + ty]), has changed since.
+    image_u8_t *prev;
+    uint8_t *changed;
+};
+
+// the deglitching, edge finding and 8 bit edge image of a band of
+// rows.
+struct edge_task
+{
+    int y0, y1; // [y0, y1)
+    const image_u1_t *threshim;
+    image_u1_t *deglitched;
+    image_u1_t *edge_black, *edge_white;
+    image_u8_t *edgeim;
+};
+
+struct cluster_task
+{
+    int y0, y1; // [y0, y1)
+    struct components *cc;
+    image_u1_t *edge_black, *edge_white;
+    image_u8_t *edgeim; // only for components over pixels
+
+    uint32_t *rowreps; // 2 rows of working space
+    apriltag_scratch_buffer_t *pairs;
+    int npairs;
+};
+
 struct quad_task
 {
-    zarray_t *clusters;
+    struct pt *pts;
+    struct cluster_span *spans;
     int cidx0, cidx1; // [cidx0, cidx1)
     zarray_t *quads;
-    apriltag_detector_t *td;
+    apriltag_detect_context_t *ctx;
     int w, h;
 
+    // the bounds on the size of a tag, in pixels of im (max_size <= 0
+    // for none).
+    float min_size, max_size;
+
     image_u8_t *im;
+
+    // how many clusters were rejected before, and by, fit_quad, and
+    // why (see apriltag_stats_t.nrejected).
+    uint32_t ncluster_rejected, nquad_fit_rejected;
+    uint32_t nrejected[APRILTAG_NREJECTS];
 };
 
 struct remove_vertex
@@ -150,6 +241,29 @@ struct line_fit_pt
     double W; // total weight
 };
 
+// An entry of quad_segment_agg's heap: remove_vertex rv, of error err.
+struct rv_heap_entry
+{
+    float err;
+    int rv;
+};
+
+// Storage for fit_quad, kept from one cluster to the next (and grown
+// as needed), so that fitting a cluster allocates nothing.
+struct fit_quad_buffers
+{
+    int capacity; // points
+    struct line_fit_pt *lfps;
+    int32_t *weights;
+
+    // for quad_segment_agg, which needs 3 remove_vertex (and heap
+    // entries) per point.
+    int agg_capacity;
+    struct remove_vertex *rvs;
+    struct rv_heap_entry *heap;
+    struct segment *segs;
+};
+
 static inline double sq(double v)
 {
     return v*v;
@@ -165,6 +279,41 @@ static inline int imax(int a, int b)
     return a < b ? b : a;
 }
 
+static void fit_quad_buffers_reserve(struct fit_quad_buffers *b, int sz)
+{
+    if (sz <= b->capacity)
+        return;
+
+    b->capacity = imax(sz, 2*b->capacity);
+    free(b->lfps);
+    free(b->weights);
+    b->lfps = malloc(b->capacity * sizeof(struct line_fit_pt));
+    b->weights = malloc(b->capacity * sizeof(int32_t));
+}
+
+static void fit_quad_buffers_reserve_agg(struct fit_quad_buffers *b, int sz)
+{
+    if (sz <= b->agg_capacity)
+        return;
+
+    b->agg_capacity = imax(sz, 2*b->agg_capacity);
+    free(b->rvs);
+    free(b->heap);
+    free(b->segs);
+    b->rvs = malloc(3 * b->agg_capacity * sizeof(struct remove_vertex));
+    b->heap = malloc(3 * b->agg_capacity * sizeof(struct rv_heap_entry));
+    b->segs = malloc(b->agg_capacity * sizeof(struct segment));
+}
+
+static void fit_quad_buffers_destroy(struct fit_quad_buffers *b)
+{
+    free(b->lfps);
+    free(b->weights);
+    free(b->rvs);
+    free(b->heap);
+    free(b->segs);
+}
+
 static inline void ptsort(struct pt *pts, int sz)
 {
 #define MAYBE_SWAP(arr,apos,bpos) \
@@ -403,6 +552,114 @@ void fit_line(struct line_fit_pt *lfps, int sz, int i0, int i1, double *lineparm
         *mse = nx*nx*Cxx + 2*nx*ny*Cxy + ny*ny*Cyy;
 }
 
+// The bits of the pseudo-angle keys of pt_sort_angle within each
+// quadrant, and in all.
+#define PT_ANGLE_FRACTION_BITS 22
+#define PT_ANGLE_BITS (PT_ANGLE_FRACTION_BITS + 2)
+
+// A key which increases with atan2(dy, dx), from -pi: the quadrant,
+// in that order, then the share of the one of |dx| and |dy| which
+// grows through it, |dx| + |dy| being the "diamond" distance from the
+// centre. Neither dx nor dy may be zero.
+static inline uint32_t pt_angle_key(int64_t dx, int64_t dy)
+{
+    uint64_t ax = dx < 0 ? -dx : dx, ay = dy < 0 ? -dy : dy;
+
+    uint32_t q;
+    uint64_t a;
+    if (dy < 0) {
+        if (dx < 0) {
+            q = 0; a = ay;
+        } else {
+            q = 1; a = ax;
+        }
+    } else {
+        if (dx > 0) {
+            q = 2; a = ay;
+        } else {
+            q = 3; a = ax;
+        }
+    }
+
+    return (q << PT_ANGLE_FRACTION_BITS) | (uint32_t) ((a << PT_ANGLE_FRACTION_BITS) / (ax + ay));
+}
+
+// Sorts the sz points pts by their angle about (cx, cy) (in the
+// points' fixed point, in units of 1/256), with a radix sort, over
+// bytes, of their pt_angle_key, and removes the duplicate points
+// which the sort leaves next to each other as it copies them back.
+// Returns the number of points left. (cx, cy) mustn't share a row or
+// column with any of the points.
+static int pt_sort_angle(struct pt *pts, int sz, int64_t cx, int64_t cy)
+{
+    // Use stack storage if it's not too big.
+    int stacksz = sz;
+    if (stacksz > 1024)
+        stacksz = 0;
+
+    struct pt _tmp_stack[stacksz];
+    uint32_t _keys_stack[2*stacksz];
+    struct pt *tmp = _tmp_stack;
+    uint32_t *keys = _keys_stack;
+
+    if (stacksz == 0) {
+        // it was too big, malloc it instead.
+        tmp = malloc(sizeof(struct pt) * sz);
+        keys = malloc(sizeof(uint32_t) * 2 * sz);
+    }
+
+    uint32_t *tmp_keys = &keys[sz];
+
+    const int npasses = PT_ANGLE_BITS / 8;
+    uint32_t counts[PT_ANGLE_BITS / 8][256];
+    memset(counts, 0, sizeof(counts));
+
+    for (int i = 0; i < sz; i++) {
+        uint32_t key = pt_angle_key(256 * pts[i].x - cx, 256 * pts[i].y - cy);
+        keys[i] = key;
+        for (int pass = 0; pass < npasses; pass++)
+            counts[pass][(key >> (8*pass)) & 0xff]++;
+    }
+
+    // the passes go from pts to tmp and back, ending in tmp.
+    struct pt *src = pts, *dst = tmp;
+    uint32_t *src_keys = keys, *dst_keys = tmp_keys;
+
+    for (int pass = 0; pass < npasses; pass++) {
+        uint32_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            uint32_t count = counts[pass][b];
+            counts[pass][b] = offset;
+            offset += count;
+        }
+
+        int last = pass + 1 == npasses;
+        for (int i = 0; i < sz; i++) {
+            uint32_t pos = counts[pass][(src_keys[i] >> (8*pass)) & 0xff]++;
+            dst[pos] = src[i];
+            if (!last)
+                dst_keys[pos] = src_keys[i];
+        }
+
+        struct pt *t = src; src = dst; dst = t;
+        uint32_t *tk = src_keys; src_keys = dst_keys; dst_keys = tk;
+    }
+
+    int outpos = 0;
+    for (int i = 0; i < sz; i++) {
+        if (outpos > 0 && src[i].x == pts[outpos-1].x && src[i].y == pts[outpos-1].y)
+            continue;
+        pts[outpos++] = src[i];
+    }
+
+    if (stacksz == 0) {
+        free(tmp);
+        free(keys);
+    }
+
+    return outpos;
+}
+
 int pt_compare_theta(const void *_a, const void *_b)
 {
     struct pt *a = (struct pt*) _a;
@@ -411,12 +668,80 @@ int pt_compare_theta(const void *_a, const void *_b)
     return (a->theta < b->theta) ? -1 : 1;
 }
 
-int err_compare_descending(const void *_a, const void *_b)
+// The weights of the points given to fit_line_windows are in fixed
+// point, with this many fractional bits.
+#define LINE_FIT_WEIGHT_BITS 4
+
+// errs[i] = the err fit_line gives for the window [i-ksz, i+ksz]
+// (mod sz) of the points, for every i, as quad_segment_maxima wants
+// them, but from cumulative moments kept in integers: the coordinates
+// are the points' own fixed point, relative to (x0, y0), and the
+// weights have LINE_FIT_WEIGHT_BITS fractional bits. The moments of
+// each window are then exact, and only the finish, in single
+// precision, loses any: err is N times the smaller eigenvalue of the
+// covariance, which needs no trig functions. Both loops over the
+// windows are free of branches, so that they can be vectorized.
+static void fit_line_windows(const struct pt *pts, const int32_t *weights, int sz, int ksz,
+                             int x0, int y0, double *errs)
 {
-    const double *a =  _a;
-    const double *b =  _b;
+    // the moments of the points [i-ksz-1, ...) (mod sz) before entry
+    // i, so that those of window i are entry i+2ksz+1 less entry i.
+    int n = sz + 2*ksz + 1;
+
+    int64_t *M = malloc(6 * (n + 1) * sizeof(int64_t));
+    int64_t *MW = M, *Mx = MW + n + 1, *My = Mx + n + 1;
+    int64_t *Mxx = My + n + 1, *Mxy = Mxx + n + 1, *Myy = Mxy + n + 1;
+
+    MW[0] = Mx[0] = My[0] = Mxx[0] = Mxy[0] = Myy[0] = 0;
+
+    for (int j = 0; j < n; j++) {
+        int k = (j + sz - ksz) % sz;
+        int64_t w = weights[k];
+        int64_t x = pts[k].x - x0, y = pts[k].y - y0;
+
+        MW[j+1]  = MW[j]  + w;
+        Mx[j+1]  = Mx[j]  + w * x;
+        My[j+1]  = My[j]  + w * y;
+        Mxx[j+1] = Mxx[j] + w * x * x;
+        Mxy[j+1] = Mxy[j] + w * x * y;
+        Myy[j+1] = Myy[j] + w * y * y;
+    }
+
+    float *C = malloc(3 * sz * sizeof(float));
+    float *Cxx = C, *Cxy = Cxx + sz, *Cyy = Cxy + sz;
+
+    int span = 2*ksz + 1;
 
-    return ((*a) < (*b)) ? 1 : -1;
+    for (int i = 0; i < sz; i++) {
+        int64_t w   = MW[i+span]  - MW[i];
+        int64_t mx  = Mx[i+span]  - Mx[i];
+        int64_t my  = My[i+span]  - My[i];
+        int64_t mxx = Mxx[i+span] - Mxx[i];
+        int64_t mxy = Mxy[i+span] - Mxy[i];
+        int64_t myy = Myy[i+span] - Myy[i];
+
+        // W^2 times the covariance, which is small even when the
+        // terms are not: in unsigned arithmetic it is exact whenever
+        // it fits, however much the terms wrap around.
+        int64_t nxx = (int64_t) ((uint64_t) w * mxx - (uint64_t) mx * mx);
+        int64_t nxy = (int64_t) ((uint64_t) w * mxy - (uint64_t) mx * my);
+        int64_t nyy = (int64_t) ((uint64_t) w * myy - (uint64_t) my * my);
+
+        // (and a quarter, to undo the fixed point of the coordinates.)
+        float s = 0.25f / ((float) w * (float) w);
+        Cxx[i] = nxx * s;
+        Cxy[i] = nxy * s;
+        Cyy[i] = nyy * s;
+    }
+
+    for (int i = 0; i < sz; i++) {
+        float h = 0.5f * (Cxx[i] - Cyy[i]);
+        float lambda = 0.5f * (Cxx[i] + Cyy[i]) - sqrtf(h*h + Cxy[i]*Cxy[i]);
+        errs[i] = span * (lambda > 0 ? lambda : 0);
+    }
+
+    free(C);
+    free(M);
 }
 
 /*
@@ -435,10 +760,13 @@ int err_compare_descending(const void *_a, const void *_b)
   rather than pairs of clusters.) Critically, this helps keep nearby
   edges from becoming connected.
 */
-int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+//
+// weights, if not NULL, are the weights of the points for
+// fit_line_windows, which then fits the candidate corner windows
+// (relative to (x0, y0)) in place of fit_line.
+int quad_segment_maxima(apriltag_detector_t *td, const struct pt *pts, int sz, struct line_fit_pt *lfps,
+                        const int32_t *weights, int x0, int y0, int indices[4])
 {
-    int sz = zarray_size(cluster);
-
     // ksz: when fitting points, how many points on either side do we consider?
     // (actual "kernel" width is 2ksz).
     //
@@ -459,8 +787,12 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
     double errs[sz];
 
-    for (int i = 0; i < sz; i++) {
-        fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
+    if (weights) {
+        fit_line_windows(pts, weights, sz, ksz, x0, y0, errs);
+    } else {
+        for (int i = 0; i < sz; i++) {
+            fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
+        }
     }
 
     // apply a low-pass filter to errs
@@ -510,11 +842,26 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     double maxima_errs[sz];
     int nmaxima = 0;
 
+    // we will keep only the best max_nmaxima maxima: those which err
+    // more than the (max_nmaxima+1)th. So that we needn't sort all of
+    // them to find it, the largest max_nmaxima+1 errors are kept
+    // (descending) as the maxima are found.
+    int max_nmaxima = td->qtp.max_nmaxima;
+    double best_errs[max_nmaxima + 1];
+    int nbest = 0;
+
     for (int i = 0; i < sz; i++) {
         if (errs[i] > errs[(i+1)%sz] && errs[i] > errs[(i+sz-1)%sz]) {
             maxima[nmaxima] = i;
             maxima_errs[nmaxima] = errs[i];
             nmaxima++;
+
+            if (nbest <= max_nmaxima || errs[i] > best_errs[nbest-1]) {
+                int j = nbest <= max_nmaxima ? nbest++ : nbest - 1;
+                for (; j > 0 && best_errs[j-1] < errs[i]; j--)
+                    best_errs[j] = best_errs[j-1];
+                best_errs[j] = errs[i];
+            }
         }
     }
 
@@ -523,16 +870,8 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         return 0;
 
     // select only the best maxima if we have too many
-    int max_nmaxima = td->qtp.max_nmaxima;
-
     if (nmaxima > max_nmaxima) {
-        double maxima_errs_copy[nmaxima];
-        memcpy(maxima_errs_copy, maxima_errs, sizeof(maxima_errs_copy));
-
-        // throw out all but the best handful of maxima. Sorts descending.
-        qsort(maxima_errs_copy, nmaxima, sizeof(double), err_compare_descending);
-
-        double maxima_thresh = maxima_errs_copy[max_nmaxima];
+        double maxima_thresh = best_errs[max_nmaxima];
         int out = 0;
         for (int in = 0; in < nmaxima; in++) {
             if (maxima_errs[in] <= maxima_thresh)
@@ -543,7 +882,13 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     }
 
     int best_indices[4];
-    double best_error = HUGE_VALF;
+    int found = 0;
+
+    // the errors of the sides are never negative, so a quad can't do
+    // better than the best so far if its first sides already err as
+    // much, and nor can one which errs as much as a quad may at all.
+    // Either way, its remaining sides needn't be fit.
+    double best_error = td->qtp.max_line_fit_mse * sz;
 
     double err01, err12, err23, err30;
     double mse01, mse12, mse23, mse30;
@@ -560,14 +905,14 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
             fit_line(lfps, sz, i0, i1, params01, &err01, &mse01);
 
-            if (mse01 > td->qtp.max_line_fit_mse)
+            if (mse01 > td->qtp.max_line_fit_mse || err01 >= best_error)
                 continue;
 
             for (int m2 = m1+1; m2 < nmaxima - 1; m2++) {
                 int i2 = maxima[m2];
 
                 fit_line(lfps, sz, i1, i2, params12, &err12, &mse12);
-                if (mse12 > td->qtp.max_line_fit_mse)
+                if (mse12 > td->qtp.max_line_fit_mse || err01 + err12 >= best_error)
                     continue;
 
                 double dot = params01[2]*params12[2] + params01[3]*params12[3];
@@ -578,7 +923,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
                     int i3 = maxima[m3];
 
                     fit_line(lfps, sz, i2, i3, params23, &err23, &mse23);
-                    if (mse23 > td->qtp.max_line_fit_mse)
+                    if (mse23 > td->qtp.max_line_fit_mse || err01 + err12 + err23 >= best_error)
                         continue;
 
                     fit_line(lfps, sz, i3, i0, params30, &err30, &mse30);
@@ -592,13 +937,14 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
                         best_indices[1] = i1;
                         best_indices[2] = i2;
                         best_indices[3] = i3;
+                        found = 1;
                     }
                 }
             }
         }
     }
 
-    if (best_error == HUGE_VALF)
+    if (!found)
         return 0;
 
     for (int i = 0; i < 4; i++)
@@ -609,28 +955,82 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     return 0;
 }
 
-// returns 0 if the cluster looks bad.
-int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+// Add entry e to the heap of *size entries, whose least err is first.
+// (As zmaxheap_add, with the errors negated.)
+static inline void rv_heap_add(struct rv_heap_entry *heap, int *size, struct rv_heap_entry e)
+{
+    int idx = (*size)++;
+
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+
+        if (heap[parent].err <= e.err)
+            break;
+
+        heap[idx] = heap[parent];
+        idx = parent;
+    }
+
+    heap[idx] = e;
+}
+
+// Remove the entry of least err from the heap into *e, returning 0 if
+// the heap is empty. (As zmaxheap_remove_max.)
+static inline int rv_heap_remove_min(struct rv_heap_entry *heap, int *size, struct rv_heap_entry *e)
 {
-    int sz = zarray_size(cluster);
+    if (*size == 0)
+        return 0;
+
+    *e = heap[0];
 
-    zmaxheap_t *heap = zmaxheap_create(sizeof(struct remove_vertex*));
+    int n = --(*size);
+    if (n == 0)
+        return 1;
+
+    struct rv_heap_entry last = heap[n];
+    int parent = 0;
+
+    while (1) {
+        int left = 2*parent + 1;
+        int right = left + 1;
+
+        float left_err = left < n ? heap[left].err : INFINITY;
+        float right_err = right < n ? heap[right].err : INFINITY;
+
+        if (last.err <= left_err && last.err <= right_err)
+            break;
+
+        int child = left_err <= right_err ? left : right;
+        heap[parent] = heap[child];
+        parent = child;
+    }
+
+    heap[parent] = last;
+    return 1;
+}
 
+// returns 0 if the cluster looks bad.
+int quad_segment_agg(apriltag_detector_t *td, int sz, struct line_fit_pt *lfps,
+                     struct fit_quad_buffers *buffers, int indices[4])
+{
     // We will initially allocate sz rvs. We then have two types of
     // iterations: some iterations that are no-ops in terms of
     // allocations, and those that remove a vertex and allocate two
     // more children.  This will happen at most (sz-4) times.  Thus we
-    // need: sz + 2*(sz-4) entries.
+    // need: sz + 2*(sz-4) entries. (And as many in the heap.)
+    fit_quad_buffers_reserve_agg(buffers, sz);
 
     int rvalloc_pos = 0;
-    int rvalloc_size = 3*sz;
-    struct remove_vertex *rvalloc = calloc(rvalloc_size, sizeof(struct remove_vertex));
+    struct remove_vertex *rvalloc = buffers->rvs;
 
-    struct segment *segs = calloc(sz, sizeof(struct segment));
+    struct rv_heap_entry *heap = buffers->heap;
+    int heap_size = 0;
+
+    struct segment *segs = buffers->segs;
 
     // populate with initial entries
     for (int i = 0; i < sz; i++) {
-        struct remove_vertex *rv = &rvalloc[rvalloc_pos++];
+        struct remove_vertex *rv = &rvalloc[rvalloc_pos];
         rv->i = i;
         if (i == 0) {
             rv->left = sz-1;
@@ -642,7 +1042,7 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
 
         fit_line(lfps, sz, rv->left, rv->right, NULL, NULL, &rv->err);
 
-        zmaxheap_add(heap, &rv, -rv->err);
+        rv_heap_add(heap, &heap_size, (struct rv_heap_entry) { rv->err, rvalloc_pos++ });
 
         segs[i].left = rv->left;
         segs[i].right = rv->right;
@@ -652,15 +1052,12 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
     int nvertices = sz;
 
     while (nvertices > 4) {
-        assert(rvalloc_pos < rvalloc_size);
-
-        struct remove_vertex *rv;
-        float err;
+        struct rv_heap_entry e;
 
-        int res = zmaxheap_remove_max(heap, &rv, &err);
-        if (!res)
+        if (!rv_heap_remove_min(heap, &heap_size, &e))
             return 0;
-        assert(res);
+
+        struct remove_vertex *rv = &rvalloc[e.rv];
 
         // is this remove_vertex valid? (Or has one of the left/right
         // vertices changes since we last looked?)
@@ -679,34 +1076,32 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
 
         // create the join to the left
         if (1) {
-            struct remove_vertex *child = &rvalloc[rvalloc_pos++];
+            struct remove_vertex *child = &rvalloc[rvalloc_pos];
             child->i = rv->left;
             child->left = segs[rv->left].left;
             child->right = rv->right;
 
             fit_line(lfps, sz, child->left, child->right, NULL, NULL, &child->err);
 
-            zmaxheap_add(heap, &child, -child->err);
+            rv_heap_add(heap, &heap_size, (struct rv_heap_entry) { child->err, rvalloc_pos++ });
         }
 
         // create the join to the right
         if (1) {
-            struct remove_vertex *child = &rvalloc[rvalloc_pos++];
+            struct remove_vertex *child = &rvalloc[rvalloc_pos];
             child->i = rv->right;
             child->left = rv->left;
             child->right = segs[rv->right].right;
 
             fit_line(lfps, sz, child->left, child->right, NULL, NULL, &child->err);
 
-            zmaxheap_add(heap, &child, -child->err);
+            rv_heap_add(heap, &heap_size, (struct rv_heap_entry) { child->err, rvalloc_pos++ });
         }
 
         // we now have one less vertex
         nvertices--;
     }
 
-    free(rvalloc);
-
     int idx = 0;
     for (int i = 0; i < sz; i++) {
         if (segs[i].is_vertex) {
@@ -714,17 +1109,20 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
         }
     }
 
-    free(segs);
-
     return 1;
 }
 
-// return 1 if the quad looks okay, 0 if it should be discarded
-int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct quad *quad)
+// return 1 if the quad looks okay, 0 if it should be discarded (and
+// why, an enum apriltag_reject, in *reject). The sz points of the
+// cluster, pts, are sorted (and their duplicates removed) in place.
+int fit_quad(apriltag_detector_t *td, image_u8_t *im, struct pt *pts, int sz, struct quad *quad,
+             struct fit_quad_buffers *buffers, int *reject)
 {
     int res = 0;
 
-    int sz = zarray_size(cluster);
+    // (until the corners are chosen.)
+    *reject = APRILTAG_REJECT_CORNERS;
+
     if (sz < 4) // can't fit a quad to less than 4 points
         return 0;
 
@@ -737,9 +1135,8 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     // according to their angle WRT the center.
     int32_t xmax = 0, xmin = INT32_MAX, ymax = 0, ymin = INT32_MAX;
 
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    for (int pidx = 0; pidx < sz; pidx++) {
+        struct pt *p = &pts[pidx];
 
         xmax = imax(xmax, p->x);
         xmin = imin(xmin, p->x);
@@ -752,106 +1149,18 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     // of theta estimates. This will help us remove more points.
     // (Only helps a small amount. The actual noise values here don't
     // matter much at all, but we want them [-1, 1]. (XXX with
-    // fixed-point, should range be bigger?)
-    double cx = (xmin + xmax) * 0.5 + 0.05118;
-    double cy = (ymin + ymax) * 0.5 + -0.028581; // NOTE: I don't understand the intention here -MZ
-
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
-
-        double dx = p->x - cx;
-        double dy = p->y - cy;
-
-        p->theta = atan2f(dy, dx);
-        UNUSED(terrible_atan2);
-//        p->theta = terrible_atan2(dy, dx);
-    }
-
-    // we now sort the points according to theta. This is a prepatory
-    // step for segmenting them into four lines.
-    if (1) {
-//        zarray_sort(cluster, pt_compare_theta);
-        ptsort((struct pt*) cluster->data, zarray_size(cluster));
-
-        // remove duplicate points. (A byproduct of our segmentation system.)
-        if (1) {
-            int outpos = 1;
-
-            struct pt *last;
-            zarray_get_volatile(cluster, 0, &last);
-
-            for (int i = 1; i < sz; i++) {
-
-                struct pt *p;
-                zarray_get_volatile(cluster, i, &p);
-
-                if (p->x != last->x || p->y != last->y) {
-
-                    if (i != outpos)  {
-                        struct pt *out;
-                        zarray_get_volatile(cluster, outpos, &out);
-                        memcpy(out, p, sizeof(struct pt));
-                    }
-
-                    outpos++;
-                }
-
-                last = p;
-            }
-
-            cluster->size = outpos;
-            sz = outpos;
-        }
-
-   } else {
-        // This is a counting sort in which we retain at most one
-        // point for every bucket; the bucket index is computed from
-        // theta. Since a good quad completes a complete revolution,
-        // there's reason to think that we should get a good
-        // distribution of thetas.  We might "lose" a few points due
-        // to collisions, but this shouldn't affect quality very much.
-
-        // XXX tunable. Increase to reduce the likelihood of "losing"
-        // points due to collisions.
-        int nbuckets = 4*sz;
-
-        #define ASSOC 2
-        struct pt v[nbuckets][ASSOC];
-        memset(v, 0, sizeof(v));
-
-        // put each point into a bucket.
-        for (int i = 0; i < sz; i++) {
-            struct pt *p;
-            zarray_get_volatile(cluster, i, &p);
-
-            assert(p->theta >= -M_PI && p->theta <= M_PI);
-
-            int bucket = (nbuckets - 1) * (p->theta + M_PI) / (2*M_PI);
-            assert(bucket >= 0 && bucket < nbuckets);
-
-            for (int i = 0; i < ASSOC; i++) {
-                if (v[bucket][i].theta == 0) {
-                    v[bucket][i] = *p;
-                    break;
-                }
-            }
-        }
-
-        // collect the points from the buckets and put them back into the array.
-        int outsz = 0;
-        for (int i = 0; i < nbuckets; i++) {
-            for (int j = 0; j < ASSOC; j++) {
-                if (v[i][j].theta != 0) {
-                    zarray_set(cluster, outsz, &v[i][j], NULL);
-                    outsz++;
-                }
-            }
-        }
-
-        zarray_truncate(cluster, outsz);
-        sz = outsz;
-    }
+    // fixed-point, should range be bigger?) (cx,cy) is in units of
+    // 1/256 of the points' fixed point, and the noise also keeps it
+    // off the rows and columns of the points.
+    int64_t cx = 128 * ((int64_t) xmin + xmax) + 13;  // + 0.05118
+    int64_t cy = 128 * ((int64_t) ymin + ymax) - 7;   // - 0.028581; NOTE: I don't understand the intention here -MZ
+
+    // we now sort the points according to their angle about (cx,cy),
+    // as atan2 would have it (but with an integer key). This is a
+    // prepatory step for segmenting them into four lines. The sort
+    // also removes duplicate points. (A byproduct of our
+    // segmentation system.)
+    sz = pt_sort_angle(pts, sz, cx, cy);
 
     if (sz < 4)
         return 0;
@@ -860,11 +1169,18 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     // Step 2. Precompute statistics that allow line fit queries to be
     // efficiently computed for any contiguous range of indices.
 
-    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
+    fit_quad_buffers_reserve(buffers, sz);
+
+    // (the moments accumulate from those of the previous point, from
+    // zero.)
+    struct line_fit_pt *lfps = buffers->lfps;
+    memset(&lfps[0], 0, sizeof(struct line_fit_pt));
+
+    // (and, for fit_line_windows, the weights in fixed point.)
+    int32_t *weights = td->qtp.fixed_line_fit ? buffers->weights : NULL;
 
     for (int i = 0; i < sz; i++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, i, &p);
+        struct pt *p = &pts[i];
 
         if (i > 0) {
             memcpy(&lfps[i], &lfps[i-1], sizeof(struct line_fit_pt));
@@ -926,6 +1242,9 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
                 W = sqrt(grad_x*grad_x + grad_y*grad_y) + 1;
             }
 
+            if (weights)
+                weights[i] = W * (1 << LINE_FIT_WEIGHT_BITS) + 0.5;
+
             double fx = x, fy = y;
             lfps[i].Mx  += W * fx;
             lfps[i].My  += W * fy;
@@ -938,10 +1257,10 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
 
     int indices[4];
     if (1) {
-        if (!quad_segment_maxima(td, cluster, lfps, indices))
+        if (!quad_segment_maxima(td, pts, sz, lfps, weights, xmin, ymin, indices))
             goto finish;
     } else {
-        if (!quad_segment_agg(td, cluster, lfps, indices))
+        if (!quad_segment_agg(td, sz, lfps, buffers, indices))
             goto finish;
     }
 
@@ -954,8 +1273,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
         // plausibility checks that save us tons of time in quad
         // decoding.
         for (int i = 0; i < 4; i++) {
-            struct pt *p;
-            zarray_get_volatile(cluster, indices[i], &p);
+            struct pt *p = &pts[indices[i]];
 
             quad->p[i][0] = .5*p->x; // undo fixed-point arith.
             quad->p[i][1] = .5*p->y;
@@ -988,6 +1306,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
 
             // XXX VALUE?
             if (err > td->qtp.max_line_fit_mse) {
+                *reject = APRILTAG_REJECT_LINE_FIT;
                 res = 0;
                 goto finish;
             }
@@ -1019,6 +1338,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
             // inverse.
             double W00 = A11 / det, W01 = -A01 / det;
             if (fabs(det) < 0.001) {
+                *reject = APRILTAG_REJECT_SHAPE;
                 res = 0;
                 goto finish;
             }
@@ -1056,6 +1376,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
                 sq(quad->p[i][1] - quad->p[i+1][1]);
 
             if (dist2 < sq(6) || dist2 > sq(4096)) {
+                *reject = APRILTAG_REJECT_SHAPE;
                 res = 0;
                 goto finish;
             }
@@ -1078,13 +1399,16 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
             if (dtheta < 0)
                 dtheta += 2*M_PI;
 
-            if (dtheta < td->qtp.critical_rad || dtheta > (M_PI - td->qtp.critical_rad))
+            if (dtheta < td->qtp.critical_rad || dtheta > (M_PI - td->qtp.critical_rad)) {
+                *reject = APRILTAG_REJECT_SHAPE;
                 res = 0;
+            }
 
             total += dtheta;
         }
 
         if (total < 6.2 || total > 6.4) {
+            *reject = APRILTAG_REJECT_SHAPE;
             res = 0;
             goto finish;
         }
@@ -1116,9 +1440,8 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
                 i1 += sz;
 
             for (int i = i0; i <= i1; i++) {
-                struct pt *p;
                 // XXX Needs adjusting for fixed-point
-                zarray_get_volatile(cluster, i % sz, &p);
+                struct pt *p = &pts[i % sz];
                 im->buf[((int) p->y)*im->stride + ((int) p->x)] = 64 + 128*(j%2);
             }
         }
@@ -1129,8 +1452,6 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     }
 */
 
-    free(lfps);
-
     return res;
 }
 
@@ -1165,82 +1486,539 @@ static void do_unionfind_task(void *p)
     }
 }
 
+// Could the cluster be the border of a tag of the expected size? Its
+// points lie on the boundary of the border, so the larger side of
+// their bounding box is the size of the tag (give or take a couple of
+// pixels, since the thresholded border is not exactly where the tag's
+// is). A tag that size has about twice as many boundary points, so
+// that is checked first.
+static inline int cluster_size_ok(struct quad_task *task, struct cluster_span *span)
+{
+    if (task->min_size <= 0 && task->max_size <= 0)
+        return 1;
+
+    const float slack = 2;
+
+    if (span->size < 2*(task->min_size - slack))
+        return 0;
+
+    struct pt *pts = &task->pts[span->start];
+    int xmin = pts[0].x, xmax = pts[0].x, ymin = pts[0].y, ymax = pts[0].y;
+
+    for (uint32_t i = 1; i < span->size; i++) {
+        xmin = imin(xmin, pts[i].x);
+        xmax = imax(xmax, pts[i].x);
+        ymin = imin(ymin, pts[i].y);
+        ymax = imax(ymax, pts[i].y);
+    }
+
+    // (the points are at twice their coordinates.)
+    float size = imax(xmax - xmin, ymax - ymin) / 2.0f;
+
+    if (size < task->min_size - slack)
+        return 0;
+    if (task->max_size > 0 && size > task->max_size + slack)
+        return 0;
+
+    return 1;
+}
+
+static int cluster_span_compare_descending(const void *_a, const void *_b)
+{
+    const struct cluster_span *a = _a, *b = _b;
+
+    // (ties by position, so that the order does not depend on qsort.)
+    if (a->size != b->size)
+        return a->size < b->size ? 1 : -1;
+    return (a->start > b->start) - (a->start < b->start);
+}
+
 static void do_quad_task(void *p)
 {
     struct quad_task *task = (struct quad_task*) p;
 
-    zarray_t *clusters = task->clusters;
     zarray_t *quads = task->quads;
-    apriltag_detector_t *td = task->td;
+    apriltag_detect_context_t *ctx = task->ctx;
+    apriltag_detector_t *td = ctx->td;
     int w = task->w, h = task->h;
 
+    struct fit_quad_buffers buffers;
+    memset(&buffers, 0, sizeof(buffers));
+
     for (int cidx = task->cidx0; cidx < task->cidx1; cidx++) {
 
-        zarray_t *cluster;
-        zarray_get(clusters, cidx, &cluster);
+        // (the quads fit so far are still decoded.)
+        if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+            break;
 
-        if (zarray_size(cluster) < td->qtp.min_cluster_pixels)
-            continue;
+        struct cluster_span *span = &task->spans[cidx];
 
         // a cluster should contain only boundary points around the
         // tag. it cannot be bigger than the whole screen. (Reject
         // large connected blobs that will be prohibitively slow to
         // fit quads to.)
-        if (zarray_size(cluster) > 4*(w+h)) {
+        if ((int) span->size < td->qtp.min_cluster_pixels ||
+            (int) span->size > 4*(w+h)) {
+            task->ncluster_rejected++;
+            task->nrejected[APRILTAG_REJECT_CLUSTER_PIXELS]++;
+            continue;
+        }
+
+        if (!cluster_size_ok(task, span)) {
+            task->ncluster_rejected++;
+            task->nrejected[APRILTAG_REJECT_CLUSTER_SIZE]++;
             continue;
         }
 
+        // (fit_quad sorts the cluster within its own span.)
         struct quad quad;
         memset(&quad, 0, sizeof(struct quad));
 
-        if (fit_quad(td, task->im, cluster, &quad)) {
-            pthread_mutex_lock(&td->mutex);
+        int reject;
+        if (fit_quad(td, task->im, &task->pts[span->start], span->size, &quad, &buffers, &reject)) {
+            pthread_mutex_lock(&ctx->mutex);
 
             zarray_add(quads, &quad);
-            pthread_mutex_unlock(&td->mutex);
+            pthread_mutex_unlock(&ctx->mutex);
+        } else {
+            task->nquad_fit_rejected++;
+            task->nrejected[reject]++;
         }
     }
+
+    fit_quad_buffers_destroy(&buffers);
 }
 
-image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+
+// Return the first x in [x, end) at which row[x] is non-zero, or end.
+// (Most of an edge image is zero.)
+static inline int edge_row_next(const uint8_t *row, int x, int end)
 {
-    int w = im->width, h = im->height, s = im->stride;
-    assert(w < 32768);
-    assert(h < 32768);
+    for (; x < end && (x & 7); x++) {
+        if (row[x])
+            return x;
+    }
 
-    image_u8_t *threshim = image_u8_create(w, h);
-    assert(threshim->stride == s);
+    for (; x + 8 <= end; x += 8) {
+        uint64_t v;
+        memcpy(&v, &row[x], sizeof(v));
+        if (v)
+            break;
+    }
 
-    // The idea is to find the maximum and minimum values in a
-    // window around each pixel. If it's a contrast-free region
-    // (max-min is small), don't try to binarize. Otherwise,
-    // threshold according to (max+min)/2.
+    while (x < end && row[x] == 0)
+        x++;
 
-    // however, computing max/min around every pixel is needlessly
-    // expensive. We compute max/min for tiles. To avoid artifacts
-    // that arise when high-contrast features appear near a tile
-    // edge (and thus moving from one tile to another results in a
-    // large change in max/min value), the max/min values used for
-    // any pixel are computed from all 3x3 surrounding tiles. Thus,
-    // the max/min sampling area for nearby pixels overlap by at least
-    // on tile.
-    //
-    // The important thing is that the windows be large enough to
-    // capture edge transitions; the tag does not need to fit into
-    // a tile.
+    return x;
+}
 
-    // XXX Tunable
-    int tilesz = 4;
+// Write the runs of a row of the edge images (nwords words of each)
+// to runs (which has room for one per pixel), and return how many
+// there are.
+//
+// The runs are found a word at a time, from the pixels at which
+// either kind of run starts and ends: since the runs of a row don't
+// overlap, the k-th start and the k-th end are those of the k-th run.
+static inline int edge_row_runs(const uint64_t *black, const uint64_t *white, int nwords,
+                                struct edge_run *runs)
+{
+    int nstarts = 0, nends = 0;
+    uint64_t bprev = 0, wprev = 0;
+
+    for (int i = 0; i < nwords; i++) {
+        uint64_t b = black[i], w = white[i];
+        uint64_t bnext = i + 1 < nwords ? black[i + 1] : 0;
+        uint64_t wnext = i + 1 < nwords ? white[i + 1] : 0;
+
+        uint64_t bstarts = b & ~((b << 1) | (bprev >> 63));
+        uint64_t wstarts = w & ~((w << 1) | (wprev >> 63));
+        uint64_t starts = bstarts | wstarts;
+        uint64_t ends = (b & ~((b >> 1) | (bnext << 63))) | (w & ~((w >> 1) | (wnext << 63)));
+
+        for (; starts; starts &= starts - 1) {
+            int k = __builtin_ctzll(starts);
+            runs[nstarts].x0 = 64*i + k;
+            runs[nstarts].v = ((bstarts >> k) & 1) ? 0xc0 : 0x3f;
+            nstarts++;
+        }
 
-    int tw = w/tilesz + 1;
-    int th = h/tilesz + 1;
+        for (; ends; ends &= ends - 1)
+            runs[nends++].x1 = 64*i + __builtin_ctzll(ends) + 1;
 
-    uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
-    uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
+        bprev = b;
+        wprev = w;
+    }
 
-    // first, collect min/max statistics for each tile
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
+    return nstarts;
+}
+
+static void do_find_runs_task(void *p)
+{
+    struct run_task *task = (struct run_task*) p;
+    image_u1_t *edge_black = task->edge_black, *edge_white = task->edge_white;
+
+    uint32_t n = 0;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        struct edge_run *runs = apriltag_scratch_buffer(task->runs,
+                                                        (n + edge_black->width) * sizeof(struct edge_run));
+        int k = edge_row_runs(image_u1_row(edge_black, y), image_u1_row(edge_white, y),
+                              edge_black->stride, &runs[n]);
+
+        task->cc->row_runs[y + 1] = k;
+        n += k;
+    }
+
+    task->nruns = n;
+}
+
+// Connect the runs of row y to the runs of row y+1 that touch them (8
+// connectivity) and have the same value.
+static inline void connect_row_runs(struct components *cc, int y)
+{
+    unionfind_t *uf = cc->uf;
+    struct edge_run *runs = cc->runs;
+    uint32_t j0 = cc->row_runs[y + 1], jend = cc->row_runs[y + 2];
+
+    for (uint32_t i = cc->row_runs[y]; i < cc->row_runs[y + 1]; i++) {
+        struct edge_run *a = &runs[i];
+
+        // runs of row y+1 that end before a begins cannot touch a, or
+        // any later run of row y.
+        while (j0 < jend && runs[j0].x1 < a->x0)
+            j0++;
+
+        // (the representative of a is looked up only once, and kept
+        // as a's set grows.)
+        uint32_t arep = UINT32_MAX;
+
+        for (uint32_t j = j0; j < jend && runs[j].x0 <= a->x1; j++) {
+            if (runs[j].v != a->v)
+                continue;
+
+            if (arep == UINT32_MAX)
+                arep = unionfind_get_representative(uf, i);
+            arep = unionfind_connect(uf, arep, j);
+        }
+    }
+}
+
+static void do_connect_runs_task(void *p)
+{
+    struct run_task *task = (struct run_task*) p;
+
+    // the last row is connected to the next task's first row
+    // afterwards.
+    for (int y = task->y0; y + 1 < task->y1; y++)
+        connect_row_runs(task->cc, y);
+}
+
+// Compute the representatives of the edge pixels in [1, w) of row y.
+// (edgeim is only needed for components over pixels.) The cluster
+// tasks call this at once on the same components, so the paths aren't
+// collapsed (see unionfind_find).
+static inline void cluster_row_reps(struct components *cc, image_u8_t *edgeim, int y,
+                                    uint32_t *rowreps)
+{
+    if (cc->runs) {
+        for (uint32_t i = cc->row_runs[y]; i < cc->row_runs[y + 1]; i++) {
+            uint32_t rep = unionfind_find(cc->uf, i);
+
+            for (int x = cc->runs[i].x0; x < cc->runs[i].x1; x++)
+                rowreps[x] = rep;
+        }
+        return;
+    }
+
+    const uint8_t *row = &edgeim->buf[y*edgeim->stride];
+    int w = edgeim->width;
+
+    for (int x = edge_row_next(row, 1, w); x < w; x = edge_row_next(row, x + 1, w))
+        rowreps[x] = unionfind_find(cc->uf, y*w + x);
+}
+
+// Emit the pairs of boundary points (one either side of an edge
+// between two components) of rows [y0, y1) into task->pairs, each
+// keyed by the representatives of its two components, (max << 32) |
+// min.
+static void do_cluster_task(void *p)
+{
+    struct cluster_task *task = (struct cluster_task*) p;
+
+    struct components *cc = task->cc;
+    image_u1_t *edge_black = task->edge_black, *edge_white = task->edge_white;
+    int w = edge_black->width, nwords = edge_black->stride;
+
+    // the representatives of the edge pixels in rows y and y+1. (The
+    // entries for other pixels are stale, but valid.)
+    uint32_t *rowreps0 = task->rowreps, *rowreps1 = &rowreps0[w];
+    memset(rowreps0, 0, 2 * w * sizeof(uint32_t));
+    cluster_row_reps(cc, task->edgeim, task->y0, rowreps1);
+
+    struct cluster_pair *pairs = NULL;
+    int npairs = 0;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        uint32_t *t = rowreps0;
+        rowreps0 = rowreps1;
+        rowreps1 = t;
+        cluster_row_reps(cc, task->edgeim, y + 1, rowreps1);
+
+        // each pixel produces at most 2 pairs.
+        pairs = apriltag_scratch_buffer(task->pairs, (size_t) (npairs + 2*w) * sizeof(struct cluster_pair));
+
+        const uint64_t *b0 = image_u1_row(edge_black, y), *w0 = image_u1_row(edge_white, y);
+        const uint64_t *b1 = image_u1_row(edge_black, y + 1), *w1 = image_u1_row(edge_white, y + 1);
+
+        for (int i = 0; i < nwords; i++) {
+            // 4 connectivity. (2 neighbors to check) A pixel is on a
+            // boundary when a neighbor is the other kind of edge.
+            uint64_t bright = (b0[i] >> 1) | (i + 1 < nwords ? b0[i + 1] << 63 : 0);
+            uint64_t wright = (w0[i] >> 1) | (i + 1 < nwords ? w0[i + 1] << 63 : 0);
+            uint64_t right = (b0[i] & wright) | (w0[i] & bright);
+            uint64_t down = (b0[i] & w1[i]) | (w0[i] & b1[i]);
+
+            for (uint64_t m = right | down; m; m &= m - 1) {
+                int k = __builtin_ctzll(m);
+                int x = 64*i + k;
+                uint64_t rep0 = rowreps0[x];
+
+                // Both pairs are written, and kept only if they are
+                // boundaries, since whether they are is unpredictable.
+#define DO_CONN(dx, dy, rep1, boundary)                                 \
+                if (1) {                                                \
+                    uint64_t rmin = rep0 < rep1 ? rep0 : rep1;          \
+                    uint64_t rmax = rep0 < rep1 ? rep1 : rep0;          \
+                    struct cluster_pair *pair = &pairs[npairs];         \
+                    pair->key = (rmax << 32) + rmin;                    \
+                    pair->x0 = 2*x + 2*dx;                              \
+                    pair->y0 = 2*y + 2*dy;                              \
+                    pair->x1 = 2*x;                                     \
+                    pair->y1 = 2*y;                                     \
+                    npairs += boundary;                                 \
+                }
+
+                DO_CONN(1, 0, (uint64_t) rowreps0[x+1], (right >> k) & 1);
+                DO_CONN(0, 1, (uint64_t) rowreps1[x], (down >> k) & 1);
+#undef DO_CONN
+            }
+        }
+    }
+
+    task->npairs = npairs;
+}
+
+// Return the label of the component whose representative is rep,
+// giving it the next label, *nlabels, if it has none. (labels[rep] is
+// one more than its label, or zero.)
+static inline uint64_t cluster_label(uint32_t rep, uint32_t *labels, uint32_t *counts,
+                                     uint32_t *nlabels)
+{
+    if (labels[rep] == 0) {
+        counts[*nlabels] = 0;
+        labels[rep] = ++(*nlabels);
+    }
+
+    return labels[rep] - 1;
+}
+
+// Buckets of up to this many pairs are sorted by insertion; larger
+// ones by a radix sort, CLUSTER_RADIX_BITS at a time.
+#define CLUSTER_INSERTION_MAX 32
+#define CLUSTER_RADIX_BITS 8
+
+// Stable sort of the n pairs by the low 32 bits of their keys, all of
+// which are less than 2^labelbits, using tmp (which has room for n
+// pairs) as working space. The result is left in pairs.
+static void cluster_pairs_sort_lo(struct cluster_pair *pairs, struct cluster_pair *tmp, int n,
+                                  int labelbits)
+{
+    if (n <= CLUSTER_INSERTION_MAX) {
+        for (int i = 1; i < n; i++) {
+            struct cluster_pair p = pairs[i];
+            uint32_t lo = (uint32_t) p.key;
+
+            int j = i;
+            for (; j > 0 && (uint32_t) pairs[j-1].key > lo; j--)
+                pairs[j] = pairs[j-1];
+            pairs[j] = p;
+        }
+        return;
+    }
+
+    const int nbuckets = 1 << CLUSTER_RADIX_BITS;
+    const uint32_t mask = nbuckets - 1;
+
+    struct cluster_pair *src = pairs, *dst = tmp;
+
+    for (int shift = 0; shift < labelbits; shift += CLUSTER_RADIX_BITS) {
+        uint32_t count[nbuckets];
+        memset(count, 0, sizeof(count));
+
+        for (int i = 0; i < n; i++)
+            count[((uint32_t) src[i].key >> shift) & mask]++;
+
+        // skip digits that are the same for every key.
+        if (count[((uint32_t) src[0].key >> shift) & mask] == (uint32_t) n)
+            continue;
+
+        uint32_t offset = 0;
+        for (int d = 0; d < nbuckets; d++) {
+            uint32_t c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+
+        for (int i = 0; i < n; i++)
+            dst[count[((uint32_t) src[i].key >> shift) & mask]++] = src[i];
+
+        struct cluster_pair *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != pairs)
+        memcpy(pairs, src, n * sizeof(struct cluster_pair));
+}
+
+// Group the n pairs by key, using tmp (which has room for n pairs) as
+// working space. Each key is a pair of labels, (hi << 32) | lo, both
+// less than nlabels; count[hi] is the number of pairs with that hi
+// label.
+//
+// The pairs are distributed by hi (a counting sort, whose writes are
+// as local as the labels are), and then each bucket is sorted by lo.
+// Both steps are stable, so each cluster's points remain in the order
+// in which they were found. The points of the clusters are written to
+// pts, which may (and does) share the storage of pairs, and their
+// spans to spans. Returns the number of clusters.
+static int cluster_pairs_group(struct cluster_pair *pairs, struct cluster_pair *tmp, int n,
+                               uint32_t *count, uint32_t nlabels,
+                               struct pt *pts, struct cluster_span *spans)
+{
+    int labelbits = 1;
+    while ((1u << labelbits) < nlabels)
+        labelbits++;
+
+    uint32_t offset = 0;
+    for (uint32_t l = 0; l < nlabels; l++) {
+        uint32_t c = count[l];
+        count[l] = offset;
+        offset += c;
+    }
+
+    for (int i = 0; i < n; i++)
+        tmp[count[pairs[i].key >> 32]++] = pairs[i];
+
+    // count[l] is now the end of bucket l. Each bucket is sorted
+    // using its own part of pairs, which any part of pts written so
+    // far precedes.
+    int nclusters = 0;
+    uint32_t b0 = 0;
+
+    for (uint32_t l = 0; l < nlabels; l++) {
+        uint32_t b1 = count[l];
+        if (b1 - b0 > 1)
+            cluster_pairs_sort_lo(&tmp[b0], &pairs[b0], b1 - b0, labelbits);
+
+        for (uint32_t i = b0; i < b1; i++) {
+            if (i == b0 || tmp[i].key != tmp[i-1].key) {
+                spans[nclusters].start = 2*i;
+                spans[nclusters].size = 0;
+                nclusters++;
+            }
+
+            pts[2*i] = (struct pt) { .x = tmp[i].x0, .y = tmp[i].y0 };
+            pts[2*i+1] = (struct pt) { .x = tmp[i].x1, .y = tmp[i].y1 };
+            spans[nclusters-1].size += 2;
+        }
+
+        b0 = b1;
+    }
+
+    return nclusters;
+}
+
+// Keep the bounding box of each cluster large enough to be fit (see
+// td->capture), in the pixels of the frame.
+static void capture_clusters(apriltag_detect_context_t *ctx, const struct pt *pts,
+                             const struct cluster_span *spans, int nclusters, float decimate)
+{
+    float scale = decimate > 1 ? decimate : 1;
+
+    for (int i = 0; i < nclusters; i++) {
+        const struct cluster_span *s = &spans[i];
+        if ((int) s->size < ctx->td->qtp.min_cluster_pixels)
+            continue;
+
+        int x0 = pts[s->start].x, x1 = x0, y0 = pts[s->start].y, y1 = y0;
+        for (uint32_t j = s->start + 1; j < s->start + s->size; j++) {
+            x0 = imin(x0, pts[j].x);
+            x1 = imax(x1, pts[j].x);
+            y0 = imin(y0, pts[j].y);
+            y1 = imax(y1, pts[j].y);
+        }
+
+        // (the points are at twice their coordinates.)
+        struct apriltag_capture_cluster c = {
+            .x0 = x0 * scale / 2, .y0 = y0 * scale / 2,
+            .x1 = x1 * scale / 2, .y1 = y1 * scale / 2,
+            .npoints = s->size,
+        };
+        zarray_add(ctx->capture->clusters, &c);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Row kernels for threshold(), one per instruction set (see simd.h),
+// in apriltag_quad_thresh_kernels.h. Each has an SSE2 (plus AVX2
+// where it helps) or NEON body that handles as many elements as fit
+// in whole vectors, followed by a scalar loop for the remainder.
+
+struct threshold_kernels
+{
+    void (*tile_minmax4)(const uint8_t *src, int s, int ntiles, uint8_t *tmax, uint8_t *tmin);
+    void (*maxmin3_u8)(const uint8_t *a, const uint8_t *b, const uint8_t *c, uint8_t *out,
+                       const uint8_t *a2, const uint8_t *b2, const uint8_t *c2, uint8_t *out2,
+                       int n);
+    void (*binarize_row4)(const uint8_t *src, const uint8_t *thresh, int w, uint8_t *dst);
+    void (*binarize_row4_u1)(const uint8_t *src, const uint8_t *thresh, int w, int padded,
+                             uint64_t *dst);
+    void (*absdiff_exceeds_row)(const uint8_t *a, const uint8_t *b, int n, uint8_t tolerance,
+                                uint8_t *acc);
+};
+
+#define SIMD_KERNELS "apriltag_quad_thresh_kernels.h"
+#include "simd_kernels.h"
+
+static const struct threshold_kernels *const threshold_kernels[SIMD_NISAS] = {
+    SIMD_KERNEL_TABLES(threshold_kernels)
+};
+
+static inline const struct threshold_kernels *kernels(void)
+{
+    return threshold_kernels[simd_isa()];
+}
+
+// first, collect min/max statistics for each tile in [ty0, ty1)
+static void do_tile_minmax_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im;
+    uint8_t *im_max = task->im_max, *im_min = task->im_min;
+    int w = im->width, h = im->height, s = im->stride;
+    int tilesz = task->tilesz, tw = task->tw;
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        int tx0 = 0;
+
+        // complete tiles don't need any bounds checks.
+        if (tilesz == 4 && (ty+1)*tilesz <= h) {
+            tx0 = w / tilesz;
+            kernels()->tile_minmax4(&im->buf[ty*tilesz*s], s, tx0, &im_max[ty*tw], &im_min[ty*tw]);
+        }
+
+        for (int tx = tx0; tx < tw; tx++) {
             uint8_t max = 0, min = 255;
 
             for (int dy = 0; dy < tilesz; dy++) {
@@ -1263,103 +2041,386 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
             im_min[ty*tw+tx] = min;
         }
     }
+}
+
+// The threshold of each tile in row ty, in thresh[0, tw). Reads the
+// tile statistics of the neighboring rows as well.
+static void tile_row_thresholds(const struct threshold_task *task, int ty, uint8_t *thresh)
+{
+    apriltag_detector_t *td = task->td;
+    const uint8_t *im_max = task->im_max, *im_min = task->im_min;
+    int tw = task->tw, th = task->th;
 
     // second, apply 3x3 max/min convolution to "blur" these values
     // over larger areas. This reduces artifacts due to abrupt changes
     // in the threshold value.
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
-            uint8_t max = 0, min = 255;
+    //
+    // This is done separably: first vertically (clamping at the top
+    // and bottom rows, which doesn't change the max/min), then
+    // horizontally.
+    uint8_t vmax[tw], vmin[tw];
+    uint8_t rmax[tw], rmin[tw];
 
-            for (int dy = -1; dy <= 1; dy++) {
-                if (ty+dy < 0 || ty+dy >= th)
-                    continue;
-                for (int dx = -1; dx <= 1; dx++) {
-                    if (tx+dx < 0 || tx+dx >= tw)
-                        continue;
+    int ty0 = imax(ty - 1, 0), ty1 = imin(ty + 1, th - 1);
 
-                    uint8_t m = im_max[(ty+dy)*tw+tx+dx];
-                    if (m > max)
-                        max = m;
-                    m = im_min[(ty+dy)*tw+tx+dx];
-                    if (m < min)
-                        min = m;
-                }
+    kernels()->maxmin3_u8(&im_max[ty0*tw], &im_max[ty*tw], &im_max[ty1*tw], vmax,
+               &im_min[ty0*tw], &im_min[ty*tw], &im_min[ty1*tw], vmin, tw);
+
+    if (tw > 2)
+        kernels()->maxmin3_u8(vmax, vmax + 1, vmax + 2, rmax + 1,
+                   vmin, vmin + 1, vmin + 2, rmin + 1, tw - 2);
+
+    rmax[0] = imax(vmax[0], vmax[imin(1, tw-1)]);
+    rmin[0] = imin(vmin[0], vmin[imin(1, tw-1)]);
+    rmax[tw-1] = imax(vmax[tw-1], vmax[imax(tw-2, 0)]);
+    rmin[tw-1] = imin(vmin[tw-1], vmin[imax(tw-2, 0)]);
+
+    for (int tx = 0; tx < tw; tx++) {
+        uint8_t max = rmax[tx], min = rmin[tx];
+
+        // XXX Tunable
+        //
+        // Don't binarize contrast-free tiles. (A threshold of 255
+        // leaves them at 0.)
+        if (max - min < td->qtp.min_white_black_diff) {
+            thresh[tx] = 255;
+            continue;
+        }
+
+        // argument for biasing towards dark; specular highlights
+        // can be substantially brighter than white tag parts
+        thresh[tx] = min + (max - min) / 2;
+    }
+}
+
+// threshold the pixels of tile rows [ty0, ty1). Reads the tile
+// statistics of the neighboring rows as well, so all of them must
+// have been computed first.
+static void do_tile_threshold_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im;
+    image_u1_t *threshim = task->threshim;
+    int w = im->width, h = im->height, s = im->stride;
+    int tilesz = task->tilesz, tw = task->tw;
+
+    // per-tile threshold for this row of tiles. (Padded so that the
+    // SIMD binarizer may read past the last tile, up to the next
+    // multiple of 64 pixels.)
+    uint8_t thresh[tw + 24];
+    memset(thresh, 255, sizeof(thresh));
+
+    int padded = image_u8_aligned(im);
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        tile_row_thresholds(task, ty, thresh);
+
+        for (int dy = 0; dy < tilesz; dy++) {
+            int y = ty*tilesz + dy;
+            if (y >= h)
+                break;
+
+            uint64_t *row = image_u1_row(threshim, y);
+
+            if (tilesz == 4) {
+                kernels()->binarize_row4_u1(&im->buf[y*s], thresh, w, padded, row);
+            } else {
+                memset(row, 0, threshim->stride * sizeof(uint64_t));
+                for (int x = 0; x < w; x++)
+                    row[x/64] |= ((uint64_t) (im->buf[y*s+x] > thresh[x/tilesz])) << (x & 63);
             }
+        }
+    }
+}
 
-            // XXX Tunable
-            if (max - min < td->qtp.min_white_black_diff)
-                continue;
+// The first pass of threshold() when the tiles of the previous frame
+// are reused: for the 4x4 tiles of [ty0, ty1), find those whose pixels
+// differ from task->prev by more than the tolerance, and recompute
+// their statistics (and their pixels in task->prev).
+static void do_tile_update_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im, *prev = task->prev;
+    uint8_t *im_max = task->im_max, *im_min = task->im_min;
+    int w = im->width, h = im->height;
+    int tw = task->tw;
+    uint8_t tolerance = task->td->qtp.tile_tolerance;
 
-            // argument for biasing towards dark; specular highlights
-            // can be substantially brighter than white tag parts
-            uint8_t thresh = min + (max - min) / 2;
+    // (padded to whole tiles.)
+    uint8_t exceeds[4*tw];
 
-            for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-                if (y >= h)
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        int y0 = 4*ty, y1 = imin(h, y0 + 4);
+
+        memset(exceeds, 0, sizeof(exceeds));
+        for (int y = y0; y < y1; y++)
+            kernels()->absdiff_exceeds_row(&im->buf[y*im->stride], &prev->buf[y*prev->stride], w, tolerance, exceeds);
+
+        uint8_t *changed = &task->changed[ty*tw];
+        memset(changed, 0, tw);
+        task->changed[task->th*tw + ty] = 0;
+
+        for (int tx = 0; tx < tw; tx++) {
+            // (most of a static scene is unchanged: skip 4 tiles at a
+            // time.)
+            uint64_t any4[2] = { 0, 0 };
+            if ((tx & 3) == 0 && 4*tx + 16 <= 4*tw) {
+                memcpy(any4, &exceeds[4*tx], sizeof(any4));
+                if (!(any4[0] | any4[1])) {
+                    tx += 3;
                     continue;
+                }
+            }
 
-                for (int dx = 0; dx < tilesz; dx++) {
-                    int x = tx*tilesz + dx;
-                    if (x >= w)
-                        continue;
+            uint32_t any;
+            memcpy(&any, &exceeds[4*tx], sizeof(any));
+            if (!any)
+                continue;
+
+            changed[tx] = 1;
+            task->changed[task->th*tw + ty] = 1;
 
-                    uint8_t v = im->buf[y*s+x];
-                    threshim->buf[y*s+x] = v > thresh;
+            int x0 = 4*tx, x1 = imin(w, x0 + 4);
+            uint8_t max = 0, min = 255;
+
+            for (int y = y0; y < y1; y++) {
+                const uint8_t *src = &im->buf[y*im->stride];
+                for (int x = x0; x < x1; x++) {
+                    max = src[x] > max ? src[x] : max;
+                    min = src[x] < min ? src[x] : min;
                 }
+                memcpy(&prev->buf[y*prev->stride + x0], &src[x0], x1 - x0);
             }
+
+            im_max[ty*tw + tx] = max;
+            im_min[ty*tw + tx] = min;
         }
     }
+}
 
-    free(im_min);
-    free(im_max);
+// The second pass of threshold() when the tiles of the previous frame
+// are reused: rebinarize, in tile rows [ty0, ty1), the 64 pixel words
+// of threshim next to a changed tile (whose threshold, from the 3x3
+// tiles around it, or whose pixels may have changed). The rest keep
+// the previous frame's bits.
+static void do_tile_rethreshold_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im;
+    image_u1_t *threshim = task->threshim;
+    int w = im->width, h = im->height, s = im->stride;
+    int tw = task->tw, th = task->th;
 
-    timeprofile_stamp(td->tp, "threshold");
+    uint8_t thresh[tw + 24];
+    memset(thresh, 255, sizeof(thresh));
 
-    return threshim;
+    int padded = image_u8_aligned(im);
+
+    // whether each tile of the row is next to a changed one.
+    uint8_t near[tw + 16];
+
+    const uint8_t *row_changed = &task->changed[th*tw];
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        int y0 = imax(ty - 1, 0), y1 = imin(ty + 1, th - 1);
+        if (!(row_changed[y0] | row_changed[ty] | row_changed[y1]))
+            continue;
+
+        int any = 0;
+        memset(near, 0, sizeof(near));
+
+        for (int y = y0; y <= y1; y++) {
+            if (!row_changed[y])
+                continue;
+
+            const uint8_t *changed = &task->changed[y*tw];
+            for (int tx = 0; tx < tw; tx++) {
+                if (!changed[tx])
+                    continue;
+
+                near[imax(tx - 1, 0)] = near[tx] = near[imin(tx + 1, tw - 1)] = 1;
+                any = 1;
+            }
+        }
+
+        if (!any)
+            continue;
+
+        tile_row_thresholds(task, ty, thresh);
+
+        // 16 tiles (of 4 pixels) to a word.
+        for (int x = 0; x < w; x += 64) {
+            uint32_t n0 = 0, n1 = 0, n2 = 0, n3 = 0;
+            memcpy(&n0, &near[x/4], 4);
+            memcpy(&n1, &near[x/4 + 4], 4);
+            memcpy(&n2, &near[x/4 + 8], 4);
+            memcpy(&n3, &near[x/4 + 12], 4);
+            if (!(n0 | n1 | n2 | n3))
+                continue;
+
+            for (int y = 4*ty; y < imin(h, 4*ty + 4); y++)
+                kernels()->binarize_row4_u1(&im->buf[y*s + x], &thresh[x/4], imin(64, w - x),
+                                 padded, &image_u1_row(threshim, y)[x/64]);
+        }
+    }
 }
 
-// basically the same as threshold(), but assumes the input image is a
-// bayer image. It collects statistics separately for each 2x2 block
-// of pixels.
-image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
+// Run the two passes of threshold() (or threshold_bayer()) over im
+// with tiles of tilesz pixels, each with nstats statistics.
+static void threshold_tiles(apriltag_detect_context_t *ctx, image_u8_t *im, image_u1_t *threshim,
+                            int tilesz, int nstats, image_u8_t *prev,
+                            void (*minmax_task)(void*), void (*threshold_task)(void*))
 {
-    int w = im->width, h = im->height, s = im->stride;
-
-    image_u8_t *threshim = image_u8_create(w, h);
-    assert(threshim->stride == s);
+    apriltag_detector_t *td = ctx->td;
 
-    int tilesz = 32;
-    assert((tilesz & 1) == 0); // must be multiple of 2
+    int w = im->width, h = im->height;
 
     int tw = w/tilesz + 1;
     int th = h/tilesz + 1;
 
-    uint8_t *im_max[4], *im_min[4];
-    for (int i = 0; i < 4; i++) {
-        im_max[i] = calloc(tw*th, sizeof(uint8_t));
-        im_min[i] = calloc(tw*th, sizeof(uint8_t));
+    // (every tile is written in the first pass, so the recycled
+    // buffers need not be cleared.)
+    apriltag_scratch_t *scratch = ctx->scratch;
+    if (scratch->tile_alloc < nstats*tw*th) {
+        memstat_free(APRILTAG_MEMORY_BUFFERS, scratch->tile_max, scratch->tile_alloc);
+        memstat_free(APRILTAG_MEMORY_BUFFERS, scratch->tile_min, scratch->tile_alloc);
+        scratch->tile_alloc = nstats*tw*th;
+        scratch->tile_max = memstat_calloc(APRILTAG_MEMORY_BUFFERS, nstats*tw*th, sizeof(uint8_t));
+        scratch->tile_min = memstat_calloc(APRILTAG_MEMORY_BUFFERS, nstats*tw*th, sizeof(uint8_t));
     }
 
-    for (int ty = 0; ty < th; ty++) {
+    uint8_t *im_max = scratch->tile_max;
+    uint8_t *im_min = scratch->tile_min;
+
+    uint8_t *changed = NULL;
+    if (prev)
+        changed = apriltag_scratch_buffer(&scratch->tile_changed, (size_t) (tw + 1) * th);
+
+    // each task handles a band of tile rows.
+    int chunksize = 1 + th / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+    struct threshold_task tasks[th / chunksize + 1];
+
+    int ntasks = 0;
+
+    for (int i = 0; i < th; i += chunksize) {
+        tasks[ntasks].td = td;
+        tasks[ntasks].im = im;
+        tasks[ntasks].threshim = threshim;
+        tasks[ntasks].im_max = im_max;
+        tasks[ntasks].im_min = im_min;
+        tasks[ntasks].tilesz = tilesz;
+        tasks[ntasks].tw = tw;
+        tasks[ntasks].th = th;
+        tasks[ntasks].ty0 = i;
+        tasks[ntasks].ty1 = imin(th, i + chunksize);
+        tasks[ntasks].prev = prev;
+        tasks[ntasks].changed = changed;
+        ntasks++;
+    }
+
+    // The second pass reads the statistics of neighboring tile rows,
+    // so all of the first pass must finish first. Each task writes
+    // only its own rows of tiles (and of threshim), so the result does
+    // not depend upon the number of threads.
+    if (ctx->nthreads <= 1) {
+        for (int i = 0; i < ntasks; i++)
+            minmax_task(&tasks[i]);
+        for (int i = 0; i < ntasks; i++)
+            threshold_task(&tasks[i]);
+    } else {
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, minmax_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(ctx->wp, threshold_task, &tasks[i]);
+        workerpool_run(ctx->wp);
+    }
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_THRESHOLD, "threshold");
+}
+
+image_u1_t *threshold(apriltag_detect_context_t *ctx, image_u8_t *im)
+{
+    int w = im->width, h = im->height;
+    assert(w < 32768);
+    assert(h < 32768);
+
+    // every pixel is written below, so a recycled image need not be
+    // cleared.
+    image_u1_t *threshim = apriltag_scratch_image_u1(&ctx->scratch->threshbits, w, h);
+
+    // The idea is to find the maximum and minimum values in a
+    // window around each pixel. If it's a contrast-free region
+    // (max-min is small), don't try to binarize. Otherwise,
+    // threshold according to (max+min)/2.
+
+    // however, computing max/min around every pixel is needlessly
+    // expensive. We compute max/min for tiles. To avoid artifacts
+    // that arise when high-contrast features appear near a tile
+    // edge (and thus moving from one tile to another results in a
+    // large change in max/min value), the max/min values used for
+    // any pixel are computed from all 3x3 surrounding tiles. Thus,
+    // the max/min sampling area for nearby pixels overlap by at least
+    // on tile.
+    //
+    // The important thing is that the windows be large enough to
+    // capture edge transitions; the tag does not need to fit into
+    // a tile.
+
+    // XXX Tunable
+    int tilesz = 4;
+
+    // The tiles of the previous frame can be reused if it was
+    // thresholded last, at the same size, and its pixels kept.
+    apriltag_scratch_t *scratch = ctx->scratch;
+    int reuse = ctx->td->qtp.tile_tolerance >= 0 && ctx->whole_frame;
+
+    if (reuse && scratch->thresh_reuse &&
+        scratch->thresh_prev.im.width == w && scratch->thresh_prev.im.height == h) {
+        threshold_tiles(ctx, im, threshim, tilesz, 1, &scratch->thresh_prev.im,
+                        do_tile_update_task, do_tile_rethreshold_task);
+    } else {
+        threshold_tiles(ctx, im, threshim, tilesz, 1, NULL, do_tile_minmax_task, do_tile_threshold_task);
+
+        if (reuse) {
+            image_u8_t *prev = apriltag_scratch_image(&scratch->thresh_prev, w, h);
+            for (int y = 0; y < h; y++)
+                memcpy(&prev->buf[y*prev->stride], &im->buf[y*im->stride], w);
+        }
+    }
+
+    scratch->thresh_reuse = reuse;
+
+    return threshim;
+}
+
+// threshold_bayer's first pass: the min/max of each of the four
+// elements of the 2x2 bayer pattern, for each tile in [ty0, ty1).
+// Element e = 2*(y&1) + (x&1) of tile (tx, ty) is at 4*(ty*tw+tx) + e.
+static void do_bayer_tile_minmax_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im;
+    uint8_t *im_max = task->im_max, *im_min = task->im_min;
+    int w = im->width, h = im->height, s = im->stride;
+    int tilesz = task->tilesz, tw = task->tw;
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
         for (int tx = 0; tx < tw; tx++) {
 
-            uint8_t max[4] = { 0, 0, 0, 0};
+            uint8_t max[4] = { 0, 0, 0, 0 };
             uint8_t min[4] = { 255, 255, 255, 255 };
 
-            for (int dy = 0; dy < tilesz; dy++) {
-                if (ty*tilesz+dy >= h)
-                    continue;
-
-                for (int dx = 0; dx < tilesz; dx++) {
-                    if (tx*tilesz+dx >= w)
-                        continue;
+            for (int dy = 0; dy < tilesz && ty*tilesz+dy < h; dy++) {
+                const uint8_t *src = &im->buf[(ty*tilesz+dy)*s + tx*tilesz];
 
-                    // which bayer element is this pixel?
-                    int idx = (2*(dy&1) + (dx&1));
+                for (int dx = 0; dx < tilesz && tx*tilesz+dx < w; dx++) {
+                    // which bayer element is this pixel? (tilesz is
+                    // even, so the same as for its offset in the tile.)
+                    int idx = 2*(dy&1) + (dx&1);
 
-                    uint8_t v = im->buf[(ty*tilesz+dy)*s + tx*tilesz + dx];
+                    uint8_t v = src[dx];
                     if (v < min[idx])
                         min[idx] = v;
                     if (v > max[idx])
@@ -1367,212 +2428,303 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
                 }
             }
 
-            for (int i = 0; i < 4; i++) {
-                im_max[i][ty*tw+tx] = max[i];
-                im_min[i][ty*tw+tx] = min[i];
-            }
+            memcpy(&im_max[4*(ty*tw+tx)], max, 4);
+            memcpy(&im_min[4*(ty*tw+tx)], min, 4);
         }
     }
+}
 
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
+// threshold_bayer's second pass over tile rows [ty0, ty1): the same as
+// do_tile_threshold_task, but for each bayer element separately.
+static void do_bayer_tile_threshold_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    apriltag_detector_t *td = task->td;
+    image_u8_t *im = task->im;
+    image_u1_t *threshim = task->threshim;
+    uint8_t *im_max = task->im_max, *im_min = task->im_min;
+    int w = im->width, h = im->height, s = im->stride;
+    int tilesz = task->tilesz, tw = task->tw, th = task->th;
 
-            uint8_t max[4] = { 0, 0, 0, 0};
-            uint8_t min[4] = { 255, 255, 255, 255 };
+    // the statistics of a row of tiles, 4 per tile.
+    int n = 4*tw;
+    uint8_t vmax[n], vmin[n];
+    uint8_t rmax[n], rmin[n];
+    uint8_t thresh[n];
 
-            for (int dy = -1; dy <= 1; dy++) {
-                if (ty+dy < 0 || ty+dy >= th)
-                    continue;
-                for (int dx = -1; dx <= 1; dx++) {
-                    if (tx+dx < 0 || tx+dx >= tw)
-                        continue;
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        int ty0 = imax(ty - 1, 0), ty1 = imin(ty + 1, th - 1);
 
-                    for (int i = 0; i < 4; i++) {
-                        uint8_t m = im_max[i][(ty+dy)*tw+tx+dx];
-                        if (m > max[i])
-                            max[i] = m;
-                        m = im_min[i][(ty+dy)*tw+tx+dx];
-                        if (m < min[i])
-                            min[i] = m;
-                    }
-                }
-            }
+        // 3x3 max/min over the tiles, as in do_tile_threshold_task
+        // (the neighbors of a tile's element being 4 bytes away).
+        kernels()->maxmin3_u8(&im_max[ty0*n], &im_max[ty*n], &im_max[ty1*n], vmax,
+                   &im_min[ty0*n], &im_min[ty*n], &im_min[ty1*n], vmin, n);
 
-            // XXX CONSTANT
-//            if (max - min < 30)
-//                continue;
+        if (tw > 2)
+            kernels()->maxmin3_u8(vmax, vmax + 4, vmax + 8, rmax + 4,
+                       vmin, vmin + 4, vmin + 8, rmin + 4, n - 8);
 
-            // argument for biasing towards dark; specular highlights
-            // can be substantially brighter than white tag parts
-            uint8_t thresh[4];
-            for (int i = 0; i < 4; i++) {
-                thresh[i] = min[i] + (max[i] - min[i]) / 2;
+        for (int i = 0; i < 4; i++) {
+            rmax[i] = imax(vmax[i], vmax[imin(4, n-4) + i]);
+            rmin[i] = imin(vmin[i], vmin[imin(4, n-4) + i]);
+            rmax[n-4+i] = imax(vmax[n-4+i], vmax[imax(n-8, 0) + i]);
+            rmin[n-4+i] = imin(vmin[n-4+i], vmin[imax(n-8, 0) + i]);
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint8_t max = rmax[i], min = rmin[i];
+
+            // XXX Tunable
+            if (max - min < td->qtp.min_white_black_diff) {
+                thresh[i] = 255;
+                continue;
             }
 
-            for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-                if (y >= h)
-                    continue;
+            // argument for biasing towards dark; specular highlights
+            // can be substantially brighter than white tag parts
+            thresh[i] = min + (max - min) / 2;
+        }
 
-                for (int dx = 0; dx < tilesz; dx++) {
-                    int x = tx*tilesz + dx;
-                    if (x >= w)
-                        continue;
+        for (int dy = 0; dy < tilesz; dy++) {
+            int y = ty*tilesz + dy;
+            if (y >= h)
+                break;
 
-                    // which bayer element is this pixel?
-                    int idx = (2*(y&1) + (x&1));
+            const uint8_t *src = &im->buf[y*s];
+            const uint8_t *t = &thresh[2*(y&1)];
+            uint64_t *row = image_u1_row(threshim, y);
 
-                    uint8_t v = im->buf[y*s+x];
-                    threshim->buf[y*s+x] = v > thresh[idx];
-                }
-            }
+            memset(row, 0, threshim->stride * sizeof(uint64_t));
+            for (int x = 0; x < w; x++)
+                row[x/64] |= ((uint64_t) (src[x] > t[4*(x/tilesz) + (x&1)])) << (x & 63);
         }
     }
+}
 
-    for (int i = 0; i < 4; i++) {
-        free(im_min[i]);
-        free(im_max[i]);
-    }
+// basically the same as threshold(), but assumes the input image is a
+// bayer image. It collects statistics separately for each 2x2 block
+// of pixels.
+image_u1_t *threshold_bayer(apriltag_detect_context_t *ctx, image_u8_t *im)
+{
+    int w = im->width, h = im->height;
+    assert(w < 32768);
+    assert(h < 32768);
+
+    image_u1_t *threshim = apriltag_scratch_image_u1(&ctx->scratch->threshbits, w, h);
+
+    // XXX Tunable
+    int tilesz = 4;
+    assert((tilesz & 1) == 0); // must be multiple of 2
 
-    timeprofile_stamp(td->tp, "threshold");
+    ctx->scratch->thresh_reuse = 0;
+    threshold_tiles(ctx, im, threshim, tilesz, 4, NULL,
+                    do_bayer_tile_minmax_task, do_bayer_tile_threshold_task);
 
     return threshim;
 }
 
-zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
+// Run task on bands of the h rows, each a copy of proto with its own
+// [y0, y1).
+static void run_edge_tasks(apriltag_detect_context_t *ctx, int h, void (*task)(void*),
+                           const struct edge_task *proto)
 {
+    int chunksize = 1 + h / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+    struct edge_task tasks[h / chunksize + 1];
 
+    int ntasks = 0;
 
-    if (td->quad_contours) {
-        fprintf(stderr, "quad_contours is set in tag detector!\n");
-        assert(!td->quad_contours);
-        exit(1);
+    for (int y = 0; y < h; y += chunksize) {
+        tasks[ntasks] = *proto;
+        tasks[ntasks].y0 = y;
+        tasks[ntasks].y1 = imin(h, y + chunksize);
+        ntasks++;
     }
-  
-    ////////////////////////////////////////////////////////
-    // step 1. threshold the image, creating the edge image.
 
-    int w = im->width, h = im->height, s = im->stride;
+    if (ctx->nthreads <= 1) {
+        for (int i = 0; i < ntasks; i++)
+            task(&tasks[i]);
+        return;
+    }
 
-    image_u8_t *threshim = threshold(td, im);
-    assert(threshim->stride == s);
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(ctx->wp, task, &tasks[i]);
+    workerpool_run(ctx->wp);
+}
 
-    image_u8_t *edgeim = image_u8_create(w, h);
+// The mask of the columns [1, w-1) of word i of a row (which
+// deglitching and edges are restricted to).
+static inline uint64_t interior_mask(int w, int i)
+{
+    int n = w - 1 - 64*i;
+    uint64_t mask = n >= 64 ? ~(uint64_t) 0 : n > 0 ? (((uint64_t) 1) << n) - 1 : 0;
+    if (i == 0)
+        mask &= ~(uint64_t) 1;
+    return mask;
+}
 
-    if (1) {
-        image_u8_t *sumim = image_u8_create(w, h);
+// Deglitch the binarized image: flip the pixels whose 8 neighbors are
+// all the other value (except on the border of the image). Such a
+// pixel's neighbors have a neighbor of their own color, so that
+// flipping it never changes whether another pixel is flipped: the
+// pixels are all decided from the binarized image, 64 at a time.
+static void do_deglitch_task(void *p)
+{
+    struct edge_task *task = p;
+    const image_u1_t *threshim = task->threshim;
+    int w = threshim->width, h = threshim->height, nwords = threshim->stride;
 
-        // apply a horizontal sum kernel of width 3
-        for (int y = 0; y < h; y++) {
-            for (int x = 1; x+1 < w; x++) {
+    for (int y = task->y0; y < task->y1; y++) {
+        const uint64_t *r1 = image_u1_row(threshim, y);
+        uint64_t *out = image_u1_row(task->deglitched, y);
 
-                sumim->buf[y*s + x] =
-                    threshim->buf[y*s + x - 1] +
-                    threshim->buf[y*s + x + 0] +
-                    threshim->buf[y*s + x + 1];
-            }
+        if (y == 0 || y + 1 >= h) {
+            memcpy(out, r1, nwords * sizeof(uint64_t));
+            continue;
         }
-        timeprofile_stamp(td->tp, "sumim");
 
-        // deglitch
-        if (td->qtp.deglitch) {
-            for (int y = 1; y+1 < h; y++) {
-                for (int x = 1; x+1 < w; x++) {
-                    // edge: black pixel next to white pixel
-                    if (threshim->buf[y*s + x] == 0 &&
-                        sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 8) {
-                        threshim->buf[y*s + x] = 1;
-                        sumim->buf[y*s + x - 1]++;
-                        sumim->buf[y*s + x + 0]++;
-                        sumim->buf[y*s + x + 1]++;
-                    }
+        const uint64_t *r0 = image_u1_row(threshim, y - 1);
+        const uint64_t *r2 = image_u1_row(threshim, y + 1);
 
-                    if (threshim->buf[y*s + x] == 1 &&
-                        sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 1) {
-                        threshim->buf[y*s + x] = 0;
-                        sumim->buf[y*s + x - 1]--;
-                        sumim->buf[y*s + x + 0]--;
-                        sumim->buf[y*s + x + 1]--;
-                   }
-                }
+        // of the previous, current and next words: whether the
+        // pixels above and below are both white (or both black), and
+        // whether the column of three is.
+        uint64_t allp = 0, nonep = 0;
+        uint64_t all = r0[0] & r1[0] & r2[0], none = ~(r0[0] | r1[0] | r2[0]);
+
+        for (int i = 0; i < nwords; i++) {
+            uint64_t alln = 0, nonen = 0;
+            if (i + 1 < nwords) {
+                alln = r0[i + 1] & r1[i + 1] & r2[i + 1];
+                nonen = ~(r0[i + 1] | r1[i + 1] | r2[i + 1]);
             }
 
-            timeprofile_stamp(td->tp, "deglitch");
+            uint64_t white = r0[i] & r2[i] & ((all << 1) | (allp >> 63)) & ((all >> 1) | (alln << 63));
+            uint64_t black = ~(r0[i] | r2[i]) & ((none << 1) | (nonep >> 63)) & ((none >> 1) | (nonen << 63));
+
+            uint64_t flip = ((~r1[i] & white) | (r1[i] & black)) & interior_mask(w, i);
+
+            allp = all;
+            nonep = none;
+            all = alln;
+            none = nonen;
+
+            out[i] = r1[i] ^ flip;
         }
+    }
+}
 
-        // apply a vertical sum kernel of width 3; check if any
-        // over-threshold pixels are adjacent to an under-threshold
-        // pixel.
-        //
-        // There are two types of edges: white pixels neighboring a
-        // black pixel, and black pixels neighboring a white pixel. We
-        // label these separately.  (Values 0xc0 and 0x3f are picked
-        // such that they add to 255 (see below) and so that they can be
-        // viewed as pixel intensities for visualization purposes.)
-        //
-        // symmetry of detection. We don't want to use JUST "black
-        // near white" (or JUST "white near black"), because that
-        // biases the detection towards one side of the edge. This
-        // measurably reduces detection performance.
-        //
-        // On large tags, we could treat "neighbor" pixels the same
-        // way. But on very small tags, there may be other edges very
-        // near the tag edge. Since each of these edges is effectively
-        // two pixels thick (the white pixel near the black pixel, and
-        // the black pixel near the white pixel), it becomes likely
-        // that these two nearby edges will actually touch.
-        //
-        // A partial solution to this problem is to define edges to be
-        // adjacent white-near-black and black-near-white pixels.
-        //
+// Find the edge pixels of the binarized image: the black pixels with
+// a white pixel among their 8 neighbors, and the white pixels with a
+// black one. Each kind is found 64 pixels at a time, by dilating the
+// other color with a 3x3 box. Pixels on the border of the image are
+// never edges.
+//
+// There are two types of edges: white pixels neighboring a
+// black pixel, and black pixels neighboring a white pixel. We
+// label these separately.  (Values 0xc0 and 0x3f are picked
+// such that they add to 255 (see below) and so that they can be
+// viewed as pixel intensities for visualization purposes.)
+//
+// symmetry of detection. We don't want to use JUST "black
+// near white" (or JUST "white near black"), because that
+// biases the detection towards one side of the edge. This
+// measurably reduces detection performance.
+//
+// On large tags, we could treat "neighbor" pixels the same
+// way. But on very small tags, there may be other edges very
+// near the tag edge. Since each of these edges is effectively
+// two pixels thick (the white pixel near the black pixel, and
+// the black pixel near the white pixel), it becomes likely
+// that these two nearby edges will actually touch.
+//
+// A partial solution to this problem is to define edges to be
+// adjacent white-near-black and black-near-white pixels.
+static void do_find_edges_task(void *p)
+{
+    struct edge_task *task = p;
+    const image_u1_t *threshim = task->threshim;
+    int w = threshim->width, h = threshim->height, nwords = threshim->stride;
 
-        for (int y = 1; y+1 < h; y++) {
-            for (int x = 1; x+1 < w; x++) {
-                if (threshim->buf[y*s + x] == 0) {
+    for (int y = task->y0; y < task->y1; y++) {
+        uint64_t *black = image_u1_row(task->edge_black, y), *white = image_u1_row(task->edge_white, y);
 
-                    // edge: black pixel next to white pixel
-                    if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] > 0)
-                        edgeim->buf[y*s + x] = 0xc0;
-                } else {
-                    // edge: white pixel next to black pixel when both
-                    // edge types are on, we get less bias towards one
-                    // side of the edge.
-                    if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] < 9)
-                        edgeim->buf[y*s + x] = 0x3f;
-                }
-            }
+        if (y == 0 || y + 1 >= h) {
+            memset(black, 0, nwords * sizeof(uint64_t));
+            memset(white, 0, nwords * sizeof(uint64_t));
+            continue;
         }
 
-        if (td->debug) {
-            for (int y = 0; y < h; y++) {
-                for (int x = 0; x < w; x++) {
-                    threshim->buf[y*s + x] *= 255;
-                }
+        const uint64_t *r0 = image_u1_row(threshim, y - 1);
+        const uint64_t *r1 = image_u1_row(threshim, y);
+        const uint64_t *r2 = image_u1_row(threshim, y + 1);
+
+        // the vertical dilation of white (any) and of black (not
+        // all) of the previous, current and next words.
+        uint64_t anyp = 0, allp = ~(uint64_t) 0;
+        uint64_t any = r0[0] | r1[0] | r2[0], all = r0[0] & r1[0] & r2[0];
+
+        for (int i = 0; i < nwords; i++) {
+            uint64_t anyn = 0, alln = ~(uint64_t) 0;
+            if (i + 1 < nwords) {
+                anyn = r0[i + 1] | r1[i + 1] | r2[i + 1];
+                alln = r0[i + 1] & r1[i + 1] & r2[i + 1];
             }
 
-            image_u8_write_pnm(threshim, "debug_threshold.pnm");
-            image_u8_write_pnm(edgeim, "debug_edge.pnm");
-//            image_u8_destroy(edgeim2);
+            // ...and then horizontally.
+            uint64_t dwhite = any | (any << 1) | (anyp >> 63) | (any >> 1) | (anyn << 63);
+            uint64_t dblack = ~(all & ((all << 1) | (allp >> 63)) & ((all >> 1) | (alln << 63)));
+
+            // only columns [1, w-1) can be edges.
+            uint64_t mask = interior_mask(w, i);
+
+            anyp = any;
+            allp = all;
+            any = anyn;
+            all = alln;
+
+            black[i] = ~r1[i] & dwhite & mask;
+            white[i] = r1[i] & dblack & mask;
         }
+    }
+}
+
+// Write the 8 bit edge image of the packed edge images.
+static void do_edges_to_u8_task(void *p)
+{
+    struct edge_task *task = p;
+    const image_u1_t *edge_black = task->edge_black, *edge_white = task->edge_white;
+    image_u8_t *edgeim = task->edgeim;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        const uint64_t *black = image_u1_row(edge_black, y), *white = image_u1_row(edge_white, y);
+        uint8_t *row = &edgeim->buf[y*edgeim->stride];
 
-        image_u8_destroy(threshim);
-        image_u8_destroy(sumim);
+        for (int x = 0; x < edgeim->width; x++) {
+            int b = (black[x/64] >> (x & 63)) & 1, wt = (white[x/64] >> (x & 63)) & 1;
+            row[x] = b ? 0xc0 : (wt ? 0x3f : 0);
+        }
     }
+}
 
-    timeprofile_stamp(td->tp, "edges");
+// Find the connected components of edgeim over its pixels.
+static void components_pixels(apriltag_detect_context_t *ctx, image_u8_t *edgeim, struct components *cc)
+{
+    int w = edgeim->width, h = edgeim->height, s = edgeim->stride;
 
-    ////////////////////////////////////////////////////////
-    // step 2. find connected components.
+    cc->n = w * h;
+    cc->uf = apriltag_scratch_unionfind(ctx->scratch, cc->n);
+    cc->runs = NULL;
+    cc->row_runs = NULL;
 
-    unionfind_t *uf = unionfind_create(w * h);
+    unionfind_t *uf = cc->uf;
 
-    if (td->nthreads <= 1) {
+    if (ctx->nthreads <= 1) {
         for (int y = 0; y < h - 1; y++) {
             do_unionfind_line(uf, edgeim, h, w, s, y);
         }
     } else {
         int sz = h - 1;
-        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
         struct unionfind_task tasks[sz / chunksize + 1];
 
         int ntasks = 0;
@@ -1591,11 +2743,11 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
             tasks[ntasks].uf = uf;
             tasks[ntasks].edgeim = edgeim;
 
-            workerpool_add_task(td->wp, do_unionfind_task, &tasks[ntasks]);
+            workerpool_add_task(ctx->wp, do_unionfind_task, &tasks[ntasks]);
             ntasks++;
         }
 
-        workerpool_run(td->wp);
+        workerpool_run(ctx->wp);
 
         // XXX stitch together the different chunks.
         for (int i = 0; i + 1 < ntasks; i++) {
@@ -1603,106 +2755,303 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         }
     }
 
-    timeprofile_stamp(td->tp, "unionfind");
+}
+
+// Find the connected components of edgeim over its runs (so that the
+// work and memory scale with the number of runs rather than pixels).
+static void components_runs(apriltag_detect_context_t *ctx, image_u1_t *edge_black, image_u1_t *edge_white,
+                            struct components *cc)
+{
+    int h = edge_black->height;
 
-    uint64_zarray_hash_t *clustermap = uint64_zarray_hash_create();
+    int chunksize = 1 + h / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+    if (ctx->nthreads <= 1)
+        chunksize = h;
 
-    for (int y = 1; y < h-1; y++) {
-        for (int x = 1; x < w-1; x++) {
+    int ntasks = (h + chunksize - 1) / chunksize;
+    struct run_task tasks[ntasks + 1];
 
-            uint8_t v0 = edgeim->buf[y*s + x];
-            if (v0 == 0)
-                continue;
+    apriltag_scratch_buffer_t *bands = apriltag_scratch_buffers(&ctx->scratch->cc_bands, ntasks);
+    cc->row_runs = apriltag_scratch_buffer(&ctx->scratch->cc_row_runs, (h + 1) * sizeof(uint32_t));
+    cc->row_runs[0] = 0;
 
-            uint64_t rep0 = unionfind_get_representative(uf, y*w + x);
-
-            // 8 connectivity. (4 neighbors to check).
-//            for (int dy = 0; dy <= 1; dy++) {
-//                for (int dx = 1-2*dy; dx <= 1; dx++) {
-
-#define DO_CONN(dx, dy)                                                 \
-            if (1) {                                                    \
-                uint8_t v1 = edgeim->buf[y*s + dy*s + x + dx];          \
-                if (v0 + v1 == 255) {                                   \
-                    uint64_t rep1 = unionfind_get_representative(uf, y*w + dy*w + x + dx); \
-                    uint64_t clusterid;                                 \
-                    if (rep0 < rep1)                                    \
-                        clusterid = (rep1 << 32) + rep0;                \
-                    else                                                \
-                        clusterid = (rep0 << 32) + rep1;                \
-                    zarray_t *cluster = NULL;                           \
-                    if (!uint64_zarray_hash_get(clustermap, &clusterid, &cluster)) { \
-                        cluster = zarray_create(sizeof(struct pt));     \
-                        uint64_zarray_hash_put(clustermap, &clusterid, &cluster, NULL, NULL); \
-                    }                                                   \
-                    struct pt p = { .x = 2*x + 2*dx, .y = 2*y + 2*dy }; \
-                    zarray_add(cluster, &p);                            \
-                    struct pt p2 = { .x = 2*x, .y = 2*y };              \
-                    zarray_add(cluster, &p2);                            \
-                }                                                       \
-            }
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].y0 = i * chunksize;
+        tasks[i].y1 = imin(h, (i + 1) * chunksize);
+        tasks[i].edge_black = edge_black;
+        tasks[i].edge_white = edge_white;
+        tasks[i].cc = cc;
+        tasks[i].runs = &bands[i];
 
-            // do 4 connectivity
-            DO_CONN(1, 0);
-            DO_CONN(0, 1);
-#undef DO_CONN
+        if (ctx->nthreads <= 1)
+            do_find_runs_task(&tasks[i]);
+        else
+            workerpool_add_task(ctx->wp, do_find_runs_task, &tasks[i]);
+    }
 
-/*
-            // 4 connectivity. (2 neighbors to check)
-            for (int n = 1; n <= 2; n++) {
-                int dy = n & 1;
-                int dx = n >> 1;
+    if (ctx->nthreads > 1)
+        workerpool_run(ctx->wp);
 
-                uint8_t v1 = edgeim->buf[(y+dy)*s + x + dx];
-                if (v0 + v1 != 255)
-                    continue;
-                uint64_t rep1 = unionfind_get_representative(uf, (y+dy)*w + x+dx);
+    // number the runs of all the tasks in order, gathering them into
+    // one array if there is more than one task.
+    for (int y = 0; y < h; y++)
+        cc->row_runs[y + 1] += cc->row_runs[y];
 
-// No. The segmented regions can be smaller than min_cluster_pixels,
-// with the region between them still bigger.
-//
-//                if (unionfind_get_set_size(uf, rep1) < td->qtp.min_cluster_pixels)
-//                    continue;
+    cc->n = cc->row_runs[h];
 
-                uint64_t clusterid;
-                if (rep0 < rep1)
-                    clusterid = (rep1 << 32) + rep0;
-                else
-                    clusterid = (rep0 << 32) + rep1;
+    if (ntasks == 1) {
+        cc->runs = bands[0].buf;
+    } else {
+        cc->runs = apriltag_scratch_buffer(&ctx->scratch->cc_runs, (cc->n + 1) * sizeof(struct edge_run));
+        for (int i = 0; i < ntasks; i++)
+            memcpy(&cc->runs[cc->row_runs[tasks[i].y0]], bands[i].buf, tasks[i].nruns * sizeof(struct edge_run));
+    }
 
-                zarray_t *cluster = NULL;
+    cc->uf = apriltag_scratch_unionfind(ctx->scratch, cc->n);
 
-                if (!uint64_zarray_hash_get(clustermap, &clusterid, &cluster)) {
-                    cluster = zarray_create(sizeof(struct pt));
-                    if (uint64_zarray_hash_put(clustermap, &clusterid, &cluster, NULL, NULL))
-                        assert(0);
-                }
+    for (int i = 0; i < ntasks; i++) {
+        if (ctx->nthreads <= 1)
+            do_connect_runs_task(&tasks[i]);
+        else
+            workerpool_add_task(ctx->wp, do_connect_runs_task, &tasks[i]);
+    }
 
-                // Add the point half-way between the two pixels. We
-                // use a fixed-point representation with a scale
-                // factor of 2. (This scale factor is undone when
-                // computing quads.)
-                if (1) {
-                    struct pt p = { .x = 2*x + dx, .y = 2*y + dy };
-                    zarray_add(cluster, &p);
-                }
-            }
-*/
+    if (ctx->nthreads > 1)
+        workerpool_run(ctx->wp);
+
+    // stitch together the different chunks.
+    for (int i = 0; i + 1 < ntasks; i++)
+        connect_row_runs(cc, tasks[i].y1 - 1);
+}
+
+// im is the input image decimated by decimate (to which
+// td->min_tag_size and td->max_tag_size refer).
+zarray_t *apriltag_quad_thresh(apriltag_detect_context_t *ctx, image_u8_t *im, float decimate)
+{
+    apriltag_detector_t *td = ctx->td;
+
+    if (td->quad_contours || td->quad_gradient) {
+        fprintf(stderr, "quad_contours or quad_gradient is set in tag detector!\n");
+        assert(!td->quad_contours && !td->quad_gradient);
+        exit(1);
+    }
+  
+    ////////////////////////////////////////////////////////
+    // step 1. threshold the image, creating the edge image.
+
+    int w = im->width, h = im->height;
+
+    image_u1_t *threshim, *edge_black, *edge_white;
+    image_u8_t *edgeim = NULL;
+
+    if (ctx->gpu_frame) {
+        // segmented on the GPU (see apriltag_gpu.h), with the edge
+        // image and its components over pixels.
+        apriltag_gpu_frame_t *frame = ctx->gpu_frame;
+        threshim = frame->threshim;
+        edge_black = frame->edge_black;
+        edge_white = frame->edge_white;
+        edgeim = frame->edgeim;
+        ctx->scratch->thresh_reuse = 0;
+
+        if (td->debug) {
+            image_u8_t *threshim8 = apriltag_scratch_image(&ctx->scratch->threshim, w, h);
+            image_u1_to_u8(threshim, threshim8, 255);
+            image_u8_write_pnm(threshim8, "debug_threshold.pnm");
+            image_u8_write_pnm(edgeim, "debug_edge.pnm");
+        }
+    } else {
+        // the luma of a whole bayer frame (not decimated, or a region of
+        // it) is thresholded from the mosaic, by element.
+        if (ctx->bayer && im == &ctx->scratch->luma.im)
+            threshim = threshold_bayer(ctx, ctx->bayer);
+        else
+            threshim = threshold(ctx, im);
+
+        // threshim and the edge images belong to ctx->scratch (as do the 8
+        // bit versions, when they are needed). Each stage runs on bands of
+        // rows.
+        struct edge_task edge_proto;
+        memset(&edge_proto, 0, sizeof(edge_proto));
+
+        if (td->qtp.deglitch) {
+            edge_proto.threshim = threshim;
+            edge_proto.deglitched = apriltag_scratch_image_u1(&ctx->scratch->deglitchbits, w, h);
+            run_edge_tasks(ctx, h, do_deglitch_task, &edge_proto);
+            threshim = edge_proto.deglitched;
+
+            apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_THRESHOLD, "deglitch");
+        }
+
+        if (td->debug) {
+            image_u8_t *threshim8 = apriltag_scratch_image(&ctx->scratch->threshim, w, h);
+            image_u1_to_u8(threshim, threshim8, 255);
+            image_u8_write_pnm(threshim8, "debug_threshold.pnm");
         }
+
+        edge_proto.threshim = threshim;
+        edge_proto.edge_black = apriltag_scratch_image_u1(&ctx->scratch->edge_black, w, h);
+        edge_proto.edge_white = apriltag_scratch_image_u1(&ctx->scratch->edge_white, w, h);
+        run_edge_tasks(ctx, h, do_find_edges_task, &edge_proto);
+
+        edge_black = edge_proto.edge_black;
+        edge_white = edge_proto.edge_white;
+
+        // the components over pixels, and the debugging output, use an 8
+        // bit edge image.
+        if (!td->qtp.run_components || td->debug) {
+            edgeim = apriltag_scratch_image(&ctx->scratch->edgeim, w, h);
+            edge_proto.edgeim = edgeim;
+            run_edge_tasks(ctx, h, do_edges_to_u8_task, &edge_proto);
+
+            if (td->debug)
+                image_u8_write_pnm(edgeim, "debug_edge.pnm");
+        }
+    }
+
+    if (ctx->capture && ctx->whole_frame)
+        apriltag_capture_threshold(ctx->capture, threshim);
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_SEGMENT, "edges");
+
+    // out of time, there are no quads to be had from this image.
+    if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        return apriltag_scratch_quads(ctx->scratch, sizeof(struct quad));
+
+    ////////////////////////////////////////////////////////
+    // step 2. find connected components.
+
+    struct components cc;
+
+    if (ctx->gpu_frame) {
+        cc.n = w * h;
+        cc.uf = ctx->gpu_frame->uf;
+        cc.runs = NULL;
+        cc.row_runs = NULL;
+    } else if (td->qtp.run_components)
+        components_runs(ctx, edge_black, edge_white, &cc);
+    else
+        components_pixels(ctx, edgeim, &cc);
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_SEGMENT, "unionfind");
+
+    // Every pair of boundary points (one either side of an edge
+    // between two components) is emitted, tagged with its cluster,
+    // into one array, which is then sorted so that each cluster is a
+    // contiguous span. The pairs are found by bands of rows in
+    // parallel.
+    int nrows = h - 2;
+    int bandsz = 1 + nrows / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
+    if (ctx->nthreads <= 1)
+        bandsz = imax(1, nrows);
+
+    int nbands = nrows > 0 ? (nrows + bandsz - 1) / bandsz : 0;
+    struct cluster_task cluster_tasks[nbands + 1];
+
+    apriltag_scratch_buffer_t *bands = apriltag_scratch_buffers(&ctx->scratch->cluster_bands, nbands);
+    uint32_t *rowreps = apriltag_scratch_buffer(&ctx->scratch->cluster_rowreps,
+                                                (size_t) nbands * 2 * w * sizeof(uint32_t));
+
+    for (int i = 0; i < nbands; i++) {
+        cluster_tasks[i].y0 = 1 + i * bandsz;
+        cluster_tasks[i].y1 = imin(h - 1, 1 + (i + 1) * bandsz);
+        cluster_tasks[i].cc = &cc;
+        cluster_tasks[i].edge_black = edge_black;
+        cluster_tasks[i].edge_white = edge_white;
+        cluster_tasks[i].edgeim = edgeim;
+        cluster_tasks[i].rowreps = &rowreps[(size_t) i * 2 * w];
+        cluster_tasks[i].pairs = &bands[i];
+
+        if (ctx->nthreads <= 1)
+            do_cluster_task(&cluster_tasks[i]);
+        else
+            workerpool_add_task(ctx->wp, do_cluster_task, &cluster_tasks[i]);
     }
 
+    if (ctx->nthreads > 1)
+        workerpool_run(ctx->wp);
+
+    // Merge the bands, in order, into the same pairs as a serial scan
+    // would find. The components are relabeled densely, in the order
+    // in which they are first seen, so that the pairs of each
+    // (higher) label can be counted for the sort.
+    int npairs = 0;
+    for (int i = 0; i < nbands; i++)
+        npairs += cluster_tasks[i].npairs;
+
+    size_t nids = cc.n;
+    uint32_t *labels = apriltag_scratch_buffer(&ctx->scratch->cluster_labels, (2 * nids + 1) * sizeof(uint32_t));
+    uint32_t *counts = &labels[nids];
+    memset(labels, 0, nids * sizeof(uint32_t));
+    uint32_t nlabels = 0;
+
+    struct cluster_pair *pairs = apriltag_scratch_buffer(&ctx->scratch->cluster_pairs,
+                                                         (size_t) npairs * sizeof(struct cluster_pair));
+    int pos = 0;
+
+    for (int i = 0; i < nbands; i++) {
+        struct cluster_pair *band = bands[i].buf;
+
+        for (int j = 0; j < cluster_tasks[i].npairs; j++) {
+            uint64_t label0 = cluster_label(band[j].key >> 32, labels, counts, &nlabels);
+            uint64_t label1 = cluster_label((uint32_t) band[j].key, labels, counts, &nlabels);
+
+            uint64_t lmin = label0 < label1 ? label0 : label1;
+            uint64_t lmax = label0 < label1 ? label1 : label0;
+            counts[lmax]++;
+
+            pairs[pos] = band[j];
+            pairs[pos].key = (lmax << 32) + lmin;
+            pos++;
+        }
+    }
+
+    // group the points by cluster.
+    struct cluster_pair *tmp = apriltag_scratch_buffer(&ctx->scratch->cluster_tmp,
+                                                       (size_t) npairs * sizeof(struct cluster_pair));
+    struct pt *pts = (struct pt*) pairs;
+    struct cluster_span *spans = apriltag_scratch_buffer(&ctx->scratch->cluster_spans,
+                                                         (size_t) (npairs + 1) * sizeof(struct cluster_span));
+
+    int nclusters = cluster_pairs_group(pairs, tmp, npairs, counts, nlabels, pts, spans);
+
+    if (ctx->capture && ctx->whole_frame)
+        capture_clusters(ctx, pts, spans, nclusters, decimate);
+
     // make segmentation image.
     if (td->debug) {
         image_u8_t *d = image_u8_create(w, h);
-        assert(d->stride == s);
 
-        uint8_t *colors = (uint8_t*) calloc(w*h, 1);
+        uint8_t *colors = (uint8_t*) calloc(cc.n, 1);
+
+        // over runs, the size of a set is its number of runs; count
+        // its pixels instead.
+        uint32_t *npixels = NULL, *rowreps = NULL;
+        if (cc.runs) {
+            npixels = (uint32_t*) calloc(cc.n, sizeof(uint32_t));
+            rowreps = (uint32_t*) calloc(w, sizeof(uint32_t));
+            for (uint32_t i = 0; i < cc.n; i++)
+                npixels[unionfind_get_representative(cc.uf, i)] += cc.runs[i].x1 - cc.runs[i].x0;
+        }
 
         for (int y = 0; y < h; y++) {
+            if (cc.runs)
+                cluster_row_reps(&cc, edgeim, y, rowreps);
+
             for (int x = 0; x < w; x++) {
-                uint32_t v = unionfind_get_representative(uf, y*w+x);
+                uint32_t v, size;
 
-                if (unionfind_get_set_size(uf, v) < td->qtp.min_cluster_pixels)
+                if (cc.runs) {
+                    if (edgeim->buf[y*edgeim->stride + x] == 0)
+                        continue;
+                    v = rowreps[x];
+                    size = npixels[v];
+                } else {
+                    v = unionfind_get_representative(cc.uf, y*w+x);
+                    size = unionfind_get_set_size(cc.uf, v);
+                }
+
+                if ((int) size < td->qtp.min_cluster_pixels)
                     continue;
 
                 uint8_t color = colors[v];
@@ -1720,54 +3069,73 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         }
 
         free(colors);
+        free(npixels);
+        free(rowreps);
 
         image_u8_write_pnm(d, "debug_segmentation.pnm");
         image_u8_destroy(d);
     }
 
-    timeprofile_stamp(td->tp, "make clusters");
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_CLUSTER, "make clusters");
 
+    if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH))
+        return apriltag_scratch_quads(ctx->scratch, sizeof(struct quad));
 
     ////////////////////////////////////////////////////////
     // step 3. process each connected component.
-    zarray_t *clusters = zarray_create(sizeof(zarray_t*)); //, uint64_zarray_hash_size(clustermap));
-    if (1) {
-        uint64_zarray_hash_iterator_t zit;
-        uint64_zarray_hash_iterator_init(clustermap, &zit);
-        uint64_t key;
-        zarray_t *value;
-        while (uint64_zarray_hash_iterator_next(&zit, &key, &value)) {
-            zarray_add(clusters, &value);
-        }
-    }
+    zarray_t *quads = apriltag_scratch_quads(ctx->scratch, sizeof(struct quad));
 
-//    uint64_zarray_hash_performance(clustermap);
-    uint64_zarray_hash_destroy(clustermap);
+    // fitting a quad takes time in proportion to the cluster's size
+    // (those rejected by their size take none), so the largest go
+    // first, and the clusters are divided among the tasks by size.
+    qsort(spans, nclusters, sizeof(struct cluster_span), cluster_span_compare_descending);
 
-    zarray_t *quads = zarray_create(sizeof(struct quad));
+    uint32_t *costs = apriltag_scratch_buffer(&ctx->scratch->cluster_costs, (nclusters + 1) * sizeof(uint32_t));
+    for (int i = 0; i < nclusters; i++) {
+        int size = spans[i].size;
+        costs[i] = size >= td->qtp.min_cluster_pixels && size <= 4*(w+h) ? size : 1;
+    }
 
-    int sz = zarray_size(clusters);
-    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task tasks[sz / chunksize + 1];
+    int maxtasks = APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads + 1;
+    int first[maxtasks + 1], order[maxtasks];
+    int ntasks = workerpool_cost_chunks(ctx->nthreads, costs, nclusters, APRILTAG_TASKS_PER_THREAD_TARGET,
+                                        first, order);
+
+    struct quad_task tasks[maxtasks];
+
+    float scale = decimate > 1 ? decimate : 1;
+
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].ctx = ctx;
+        tasks[i].cidx0 = first[i];
+        tasks[i].cidx1 = first[i + 1];
+        tasks[i].h = h;
+        tasks[i].w = w;
+        tasks[i].quads = quads;
+        tasks[i].pts = pts;
+        tasks[i].spans = spans;
+        tasks[i].min_size = td->min_tag_size / scale;
+        tasks[i].max_size = td->max_tag_size / scale;
+        tasks[i].im = im;
+        tasks[i].ncluster_rejected = 0;
+        tasks[i].nquad_fit_rejected = 0;
+        memset(tasks[i].nrejected, 0, sizeof(tasks[i].nrejected));
+    }
 
-    int ntasks = 0;
-    for (int i = 0; i < sz; i += chunksize) {
-        tasks[ntasks].td = td;
-        tasks[ntasks].cidx0 = i;
-        tasks[ntasks].cidx1 = imin(sz, i + chunksize);
-        tasks[ntasks].h = h;
-        tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
-        tasks[ntasks].clusters = clusters;
-        tasks[ntasks].im = im;
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(ctx->wp, do_quad_task, &tasks[order[i]]);
 
-        workerpool_add_task(td->wp, do_quad_task, &tasks[ntasks]);
-        ntasks++;
-    }
+    workerpool_run(ctx->wp);
 
-    workerpool_run(td->wp);
+    ctx->stats.nclusters += nclusters;
+    for (int i = 0; i < ntasks; i++) {
+        ctx->stats.ncluster_rejected += tasks[i].ncluster_rejected;
+        ctx->stats.nquad_fit_rejected += tasks[i].nquad_fit_rejected;
+        for (int r = 0; r < APRILTAG_NREJECTS; r++)
+            ctx->stats.nrejected[r] += tasks[i].nrejected[r];
+    }
 
-    timeprofile_stamp(td->tp, "fit quads to clusters");
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_QUAD_FIT, "fit quads to clusters");
 
     if (td->debug) {
         FILE *f = fopen("debug_lines.ps", "w");
@@ -1827,17 +3195,8 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
             }
             } */
 
-    unionfind_destroy(uf);
-
-    for (int i = 0; i < zarray_size(clusters); i++) {
-        zarray_t *cluster;
-        zarray_get(clusters, i, &cluster);
-        zarray_destroy(cluster);
-    }
-
-    zarray_destroy(clusters);
-
-    image_u8_destroy(edgeim);
+    // NB: the components, clusters, edgeim, and quads belong to
+    // ctx->scratch.
 
     return quads;
 }
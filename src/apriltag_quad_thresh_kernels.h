@@ -0,0 +1,297 @@
+// (no include guard: the row kernels of threshold() in
+// apriltag_quad_thresh.c, compiled for each instruction set by
+// simd_kernels.h.)
+
+// Reduce ntiles complete 4x4 tiles, whose top-left pixels are src,
+// src+4, ..., src+4*(ntiles-1).
+static void KERNEL(tile_minmax4)(const uint8_t *src, int s, int ntiles, uint8_t *tmax, uint8_t *tmin)
+{
+    int tx = 0;
+
+#if KERNEL_SSE2
+    // 16 pixels = 4 tiles per iteration.
+    const __m128i lowbyte = _mm_set1_epi32(0xff);
+
+    for (; tx + 4 <= ntiles; tx += 4) {
+        const uint8_t *p = &src[4*tx];
+        __m128i r0 = _mm_loadu_si128((const __m128i*) p);
+        __m128i r1 = _mm_loadu_si128((const __m128i*) (p + s));
+        __m128i r2 = _mm_loadu_si128((const __m128i*) (p + 2*s));
+        __m128i r3 = _mm_loadu_si128((const __m128i*) (p + 3*s));
+
+        __m128i mx = _mm_max_epu8(_mm_max_epu8(r0, r1), _mm_max_epu8(r2, r3));
+        __m128i mn = _mm_min_epu8(_mm_min_epu8(r0, r1), _mm_min_epu8(r2, r3));
+
+        // reduce each 32 bit lane (one tile) into its low byte
+        mx = _mm_max_epu8(mx, _mm_srli_epi32(mx, 16));
+        mx = _mm_max_epu8(mx, _mm_srli_epi32(mx, 8));
+        mn = _mm_min_epu8(mn, _mm_srli_epi32(mn, 16));
+        mn = _mm_min_epu8(mn, _mm_srli_epi32(mn, 8));
+
+        mx = _mm_and_si128(mx, lowbyte);
+        mn = _mm_and_si128(mn, lowbyte);
+
+        // pack to bytes: mx in the low 4 bytes, mn in the next 4.
+        __m128i packed = _mm_packs_epi32(mx, mn);
+        packed = _mm_packus_epi16(packed, packed);
+
+        uint32_t vmax = _mm_cvtsi128_si32(packed);
+        uint32_t vmin = _mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+        memcpy(&tmax[tx], &vmax, 4);
+        memcpy(&tmin[tx], &vmin, 4);
+    }
+#elif KERNEL_NEON
+    // 64 pixels = 16 tiles per iteration. vld4 de-interleaves, so that
+    // lane i of each of the four vectors is a pixel of tile i.
+    for (; tx + 16 <= ntiles; tx += 16) {
+        const uint8_t *p = &src[4*tx];
+        uint8x16_t mx = vdupq_n_u8(0), mn = vdupq_n_u8(255);
+
+        for (int dy = 0; dy < 4; dy++) {
+            uint8x16x4_t r = vld4q_u8(p + dy*s);
+            mx = vmaxq_u8(mx, vmaxq_u8(vmaxq_u8(r.val[0], r.val[1]), vmaxq_u8(r.val[2], r.val[3])));
+            mn = vminq_u8(mn, vminq_u8(vminq_u8(r.val[0], r.val[1]), vminq_u8(r.val[2], r.val[3])));
+        }
+
+        vst1q_u8(&tmax[tx], mx);
+        vst1q_u8(&tmin[tx], mn);
+    }
+#endif
+
+    for (; tx < ntiles; tx++) {
+        uint8_t max = 0, min = 255;
+
+        for (int dy = 0; dy < 4; dy++) {
+            for (int dx = 0; dx < 4; dx++) {
+                uint8_t v = src[dy*s + 4*tx + dx];
+                if (v < min)
+                    min = v;
+                if (v > max)
+                    max = v;
+            }
+        }
+
+        tmax[tx] = max;
+        tmin[tx] = min;
+    }
+}
+
+// out[i] = max(a[i], b[i], c[i]) and out2[i] = min(a2[i], b2[i], c2[i])
+static void KERNEL(maxmin3_u8)(const uint8_t *a, const uint8_t *b, const uint8_t *c, uint8_t *out,
+                       const uint8_t *a2, const uint8_t *b2, const uint8_t *c2, uint8_t *out2,
+                       int n)
+{
+    int i = 0;
+
+#if KERNEL_AVX2
+    for (; i + 32 <= n; i += 32) {
+        __m256i mx = _mm256_max_epu8(_mm256_loadu_si256((const __m256i*) &a[i]),
+                                     _mm256_loadu_si256((const __m256i*) &b[i]));
+        mx = _mm256_max_epu8(mx, _mm256_loadu_si256((const __m256i*) &c[i]));
+        _mm256_storeu_si256((__m256i*) &out[i], mx);
+
+        __m256i mn = _mm256_min_epu8(_mm256_loadu_si256((const __m256i*) &a2[i]),
+                                     _mm256_loadu_si256((const __m256i*) &b2[i]));
+        mn = _mm256_min_epu8(mn, _mm256_loadu_si256((const __m256i*) &c2[i]));
+        _mm256_storeu_si256((__m256i*) &out2[i], mn);
+    }
+#endif
+
+#if KERNEL_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i mx = _mm_max_epu8(_mm_loadu_si128((const __m128i*) &a[i]),
+                                  _mm_loadu_si128((const __m128i*) &b[i]));
+        mx = _mm_max_epu8(mx, _mm_loadu_si128((const __m128i*) &c[i]));
+        _mm_storeu_si128((__m128i*) &out[i], mx);
+
+        __m128i mn = _mm_min_epu8(_mm_loadu_si128((const __m128i*) &a2[i]),
+                                  _mm_loadu_si128((const __m128i*) &b2[i]));
+        mn = _mm_min_epu8(mn, _mm_loadu_si128((const __m128i*) &c2[i]));
+        _mm_storeu_si128((__m128i*) &out2[i], mn);
+    }
+#elif KERNEL_NEON
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t mx = vmaxq_u8(vmaxq_u8(vld1q_u8(&a[i]), vld1q_u8(&b[i])), vld1q_u8(&c[i]));
+        vst1q_u8(&out[i], mx);
+
+        uint8x16_t mn = vminq_u8(vminq_u8(vld1q_u8(&a2[i]), vld1q_u8(&b2[i])), vld1q_u8(&c2[i]));
+        vst1q_u8(&out2[i], mn);
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint8_t mx = a[i];
+        if (b[i] > mx)
+            mx = b[i];
+        if (c[i] > mx)
+            mx = c[i];
+        out[i] = mx;
+
+        uint8_t mn = a2[i];
+        if (b2[i] < mn)
+            mn = b2[i];
+        if (c2[i] < mn)
+            mn = c2[i];
+        out2[i] = mn;
+    }
+}
+
+// dst[x] = src[x] > thresh[x/4], for 0 <= x < w.
+static void KERNEL(binarize_row4)(const uint8_t *src, const uint8_t *thresh, int w, uint8_t *dst)
+{
+    int x = 0;
+
+#if KERNEL_SSE2
+    // SSE2 has no unsigned byte compare; flip the sign bits and
+    // compare signed instead.
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    const __m128i one = _mm_set1_epi8(1);
+
+#if KERNEL_AVX2
+    const __m256i bias256 = _mm256_set1_epi8((char) 0x80);
+    const __m256i one256 = _mm256_set1_epi8(1);
+
+    for (; x + 32 <= w; x += 32) {
+        // replicate each of 8 thresholds 4 times
+        __m128i t = _mm_loadl_epi64((const __m128i*) &thresh[x/4]);
+        t = _mm_unpacklo_epi8(t, t);
+        __m256i t4 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(t, t)),
+                                             _mm_unpackhi_epi16(t, t), 1);
+
+        __m256i v = _mm256_loadu_si256((const __m256i*) &src[x]);
+        __m256i gt = _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias256), _mm256_xor_si256(t4, bias256));
+        _mm256_storeu_si256((__m256i*) &dst[x], _mm256_and_si256(gt, one256));
+    }
+#endif
+
+    for (; x + 16 <= w; x += 16) {
+        uint32_t t32;
+        memcpy(&t32, &thresh[x/4], 4);
+        __m128i t = _mm_cvtsi32_si128(t32);
+        t = _mm_unpacklo_epi8(t, t);
+        t = _mm_unpacklo_epi16(t, t);
+
+        __m128i v = _mm_loadu_si128((const __m128i*) &src[x]);
+        __m128i gt = _mm_cmpgt_epi8(_mm_xor_si128(v, bias), _mm_xor_si128(t, bias));
+        _mm_storeu_si128((__m128i*) &dst[x], _mm_and_si128(gt, one));
+    }
+#elif KERNEL_NEON
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    for (; x + 16 <= w; x += 16) {
+        uint8x8_t t = vld1_u8(&thresh[x/4]);  // only the first 4 are used
+        uint8x8x2_t t2 = vzip_u8(t, t);
+        uint8x8x2_t t4 = vzip_u8(t2.val[0], t2.val[0]);
+
+        uint8x16_t v = vld1q_u8(&src[x]);
+        uint8x16_t gt = vcgtq_u8(v, vcombine_u8(t4.val[0], t4.val[1]));
+        vst1q_u8(&dst[x], vandq_u8(gt, one));
+    }
+#endif
+
+    for (; x < w; x++)
+        dst[x] = src[x] > thresh[x/4];
+}
+
+// The same, but packed: bit x of dst is src[x] > thresh[x/4] (and the
+// bits past w are 0). If padded, src (and thresh) can be read up to
+// the next multiple of 64 pixels past w (see image_u8_aligned), so
+// that the last word need not be binarized a pixel at a time.
+static void KERNEL(binarize_row4_u1)(const uint8_t *src, const uint8_t *thresh, int w, int padded, uint64_t *dst)
+{
+    int x = 0;
+#if KERNEL_SSE2
+    int xend = padded ? w : w - 63; // (the words starting before xend)
+#endif
+#if KERNEL_AVX2
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+    for (; x < xend; x += 64) {
+        uint64_t word = 0;
+        for (int half = 0; half < 2; half++) {
+            int hx = x + 32*half;
+            // replicate each of 8 thresholds 4 times
+            __m128i t = _mm_loadl_epi64((const __m128i*) &thresh[hx/4]);
+            t = _mm_unpacklo_epi8(t, t);
+            __m256i t4 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(t, t)),
+                                                 _mm_unpackhi_epi16(t, t), 1);
+            __m256i v = _mm256_loadu_si256((const __m256i*) &src[hx]);
+            __m256i gt = _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias), _mm256_xor_si256(t4, bias));
+            word |= ((uint64_t) (uint32_t) _mm256_movemask_epi8(gt)) << (32*half);
+        }
+        dst[x/64] = word;
+    }
+#elif KERNEL_SSE2
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    for (; x < xend; x += 64) {
+        uint64_t word = 0;
+        for (int q = 0; q < 4; q++) {
+            int qx = x + 16*q;
+            uint32_t t32;
+            memcpy(&t32, &thresh[qx/4], 4);
+            __m128i t = _mm_cvtsi32_si128(t32);
+            t = _mm_unpacklo_epi8(t, t);
+            t = _mm_unpacklo_epi16(t, t);
+
+            __m128i v = _mm_loadu_si128((const __m128i*) &src[qx]);
+            __m128i gt = _mm_cmpgt_epi8(_mm_xor_si128(v, bias), _mm_xor_si128(t, bias));
+            word |= ((uint64_t) (uint16_t) _mm_movemask_epi8(gt)) << (16*q);
+        }
+        dst[x/64] = word;
+    }
+#endif
+    // (the pixels of the padding.)
+    if (x > w)
+        dst[x/64 - 1] &= (((uint64_t) 1) << (w & 63)) - 1;
+
+    // the rest is binarized a byte per pixel, then packed.
+    uint8_t bytes[64];
+    for (; x < w; x += 64) {
+        int n = imin(64, w - x);
+        KERNEL(binarize_row4)(&src[x], &thresh[x/4], n, bytes);
+
+        uint64_t word = 0;
+        int i = 0;
+#if KERNEL_SSE2
+        for (; i + 16 <= n; i += 16) {
+            // move the 0/1 bytes into their sign bits.
+            __m128i v = _mm_slli_epi16(_mm_loadu_si128((const __m128i*) &bytes[i]), 7);
+            word |= ((uint64_t) _mm_movemask_epi8(v)) << i;
+        }
+#endif
+        for (; i < n; i++)
+            word |= ((uint64_t) bytes[i]) << i;
+        dst[x/64] = word;
+    }
+}
+
+// acc[x] |= (|a[x] - b[x]| > tolerance), for x in [0, n).
+static void KERNEL(absdiff_exceeds_row)(const uint8_t *a, const uint8_t *b, int n, uint8_t tolerance, uint8_t *acc)
+{
+    int x = 0;
+#if KERNEL_SSE2
+    const __m128i tol = _mm_set1_epi8((char) tolerance);
+    for (; x + 16 <= n; x += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) &a[x]);
+        __m128i vb = _mm_loadu_si128((const __m128i*) &b[x]);
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i v = _mm_loadu_si128((const __m128i*) &acc[x]);
+        _mm_storeu_si128((__m128i*) &acc[x], _mm_or_si128(v, _mm_subs_epu8(d, tol)));
+    }
+#elif KERNEL_NEON
+    const uint8x16_t tol = vdupq_n_u8(tolerance);
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(&a[x]), vld1q_u8(&b[x]));
+        vst1q_u8(&acc[x], vorrq_u8(vld1q_u8(&acc[x]), vqsubq_u8(d, tol)));
+    }
+#endif
+    for (; x < n; x++)
+        acc[x] |= abs(a[x] - b[x]) > tolerance;
+}
+
+static const struct threshold_kernels KERNEL(threshold_kernels) = {
+    KERNEL(tile_minmax4),
+    KERNEL(maxmin3_u8),
+    KERNEL(binarize_row4),
+    KERNEL(binarize_row4_u1),
+    KERNEL(absdiff_exceeds_row),
+};
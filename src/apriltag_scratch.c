@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag.h"
+#include "apriltag_scratch.h"
+#include "common/memstat.h"
+
+// (the storage of the slots is charged to the scope of the thread
+// growing it, see memstat.h: the context being detected. It is only
+// freed when the scratch is, with the context, and so isn't charged
+// back then.)
+
+apriltag_scratch_t *apriltag_scratch_create()
+{
+    apriltag_scratch_t *s = calloc(1, sizeof(apriltag_scratch_t));
+
+    return s;
+}
+
+void apriltag_scratch_destroy(apriltag_scratch_t *s)
+{
+    if (!s)
+        return;
+
+    free(s->luma.im.buf);
+    free(s->decimate.im.buf);
+    free(s->blur.im.buf);
+    free(s->roi.im.buf);
+    free(s->motion[0].im.buf);
+    free(s->motion[1].im.buf);
+    free(s->motion_sads.buf);
+    free(s->threshbits.im.buf);
+    free(s->deglitchbits.im.buf);
+    free(s->edge_black.im.buf);
+    free(s->edge_white.im.buf);
+    free(s->threshim.im.buf);
+    free(s->edgeim.im.buf);
+
+    free(s->tile_max);
+    free(s->tile_min);
+    free(s->thresh_prev.im.buf);
+    free(s->tile_changed.buf);
+
+    if (s->uf)
+        unionfind_destroy(s->uf);
+
+    for (int i = 0; i < s->cc_bands.n; i++)
+        free(s->cc_bands.bufs[i].buf);
+    free(s->cc_bands.bufs);
+    free(s->cc_runs.buf);
+    free(s->cc_row_runs.buf);
+
+    for (int i = 0; i < s->cluster_bands.n; i++)
+        free(s->cluster_bands.bufs[i].buf);
+    free(s->cluster_bands.bufs);
+    free(s->cluster_rowreps.buf);
+    free(s->cluster_pairs.buf);
+    free(s->cluster_tmp.buf);
+    free(s->cluster_spans.buf);
+    free(s->cluster_costs.buf);
+    free(s->cluster_labels.buf);
+
+    for (int i = 0; i < s->decode_results.n; i++)
+        free(s->decode_results.bufs[i].buf);
+    free(s->decode_results.bufs);
+    free(s->expected_found.buf);
+    free(s->decode_costs.buf);
+
+    free(s->qfc_results.buf);
+    free(s->qfc_candidates.buf);
+    free(s->qfc_quads.buf);
+    free(s->qfc_tasks.buf);
+
+    free(s->grad_mag.buf);
+    free(s->grad_theta.buf);
+    free(s->grad_labels.buf);
+    free(s->grad_uf.buf);
+    free(s->grad_pixels.buf);
+    free(s->grad_clusters.buf);
+    free(s->grad_offsets.buf);
+    free(s->grad_members.buf);
+    free(s->grad_segments.buf);
+    free(s->grad_next.buf);
+    free(s->grad_prev.buf);
+    free(s->grad_joined.buf);
+    free(s->grad_cell_offsets.buf);
+    free(s->grad_cell_segs.buf);
+    free(s->grad_cell_of.buf);
+    free(s->grad_children.buf);
+    free(s->grad_nchildren.buf);
+    free(s->grad_quads.buf);
+    free(s->grad_nquads.buf);
+
+    if (s->quads)
+        zarray_destroy(s->quads);
+    if (s->detections)
+        zarray_destroy(s->detections);
+    if (s->roi_quads)
+        zarray_destroy(s->roi_quads);
+    if (s->pyramid_rois)
+        zarray_destroy(s->pyramid_rois);
+
+    free(s);
+}
+
+image_u8_t *apriltag_scratch_image(apriltag_scratch_image_t *slot, int width, int height)
+{
+    if (slot->im.buf && slot->im.width == width && slot->im.height == height)
+        return &slot->im;
+
+    int stride = image_u8_default_stride(width);
+    size_t sz = (size_t) height * stride;
+
+    uint8_t *buf = slot->im.buf;
+    if (sz > slot->alloc) {
+        free(buf);
+        buf = image_u8_alloc_buf(sz);
+        memstat_scope_charge(APRILTAG_MEMORY_IMAGES, (int64_t) sz - (int64_t) slot->alloc);
+        slot->alloc = sz;
+    }
+
+    // const initializer
+    image_u8_t tmp = { .width = width, .height = height, .stride = stride, .buf = buf };
+    memcpy(&slot->im, &tmp, sizeof(image_u8_t));
+
+    return &slot->im;
+}
+
+image_u1_t *apriltag_scratch_image_u1(apriltag_scratch_image_u1_t *slot, int width, int height)
+{
+    if (slot->im.buf && slot->im.width == width && slot->im.height == height)
+        return &slot->im;
+
+    int stride = image_u1_default_stride(width);
+    size_t sz = (size_t) height * stride;
+
+    uint64_t *buf = slot->im.buf;
+    if (sz > slot->alloc) {
+        free(buf);
+        buf = image_u8_alloc_buf(sz * sizeof(uint64_t));
+        memstat_scope_charge(APRILTAG_MEMORY_IMAGES, ((int64_t) sz - (int64_t) slot->alloc) * sizeof(uint64_t));
+        slot->alloc = sz;
+    }
+
+    // const initializer
+    image_u1_t tmp = { .width = width, .height = height, .stride = stride, .buf = buf };
+    memcpy(&slot->im, &tmp, sizeof(image_u1_t));
+
+    return &slot->im;
+}
+
+unionfind_t *apriltag_scratch_unionfind(apriltag_scratch_t *s, uint32_t n)
+{
+    if (s->uf && n + 1 <= s->uf_alloc) {
+        s->uf->maxid = n;
+        unionfind_reset(s->uf);
+        return s->uf;
+    }
+
+    if (s->uf)
+        unionfind_destroy(s->uf);
+
+    s->uf = unionfind_create(n);
+    memstat_scope_charge(APRILTAG_MEMORY_UNIONFIND,
+                         ((int64_t) n + 1 - s->uf_alloc) * sizeof(struct ufrec));
+    s->uf_alloc = n + 1;
+    return s->uf;
+}
+
+void *apriltag_scratch_buffer(apriltag_scratch_buffer_t *b, size_t sz)
+{
+    if (sz > b->alloc) {
+        // grow geometrically, since buffers are often grown
+        // incrementally.
+        size_t alloc = b->alloc * 2;
+        if (alloc < sz)
+            alloc = sz;
+
+        b->buf = memstat_realloc(APRILTAG_MEMORY_BUFFERS, b->buf, b->alloc, alloc);
+        b->alloc = alloc;
+    }
+
+    return b->buf;
+}
+
+apriltag_scratch_buffer_t *apriltag_scratch_buffers(apriltag_scratch_buffers_t *b, int n)
+{
+    if (n > b->n) {
+        b->bufs = memstat_realloc(APRILTAG_MEMORY_BUFFERS, b->bufs, b->n * sizeof(apriltag_scratch_buffer_t),
+                                  n * sizeof(apriltag_scratch_buffer_t));
+        memset(&b->bufs[b->n], 0, (n - b->n) * sizeof(apriltag_scratch_buffer_t));
+        b->n = n;
+    }
+
+    return b->bufs;
+}
+
+zarray_t *apriltag_scratch_quads(apriltag_scratch_t *s, size_t el_sz)
+{
+    if (!s->quads)
+        s->quads = zarray_create(el_sz);
+
+    assert(s->quads->el_sz == el_sz);
+    zarray_clear(s->quads);
+    return s->quads;
+}
+
+zarray_t *apriltag_scratch_detections(apriltag_scratch_t *s, size_t el_sz)
+{
+    if (!s->detections)
+        s->detections = zarray_create(el_sz);
+
+    assert(s->detections->el_sz == el_sz);
+    zarray_clear(s->detections);
+    return s->detections;
+}
+
+zarray_t *apriltag_scratch_roi_quads(apriltag_scratch_t *s, size_t el_sz)
+{
+    if (!s->roi_quads)
+        s->roi_quads = zarray_create(el_sz);
+
+    assert(s->roi_quads->el_sz == el_sz);
+    zarray_clear(s->roi_quads);
+    return s->roi_quads;
+}
+
+zarray_t *apriltag_scratch_pyramid_rois(apriltag_scratch_t *s, size_t el_sz)
+{
+    if (!s->pyramid_rois)
+        s->pyramid_rois = zarray_create(el_sz);
+
+    assert(s->pyramid_rois->el_sz == el_sz);
+    zarray_clear(s->pyramid_rois);
+    return s->pyramid_rois;
+}
@@ -0,0 +1,211 @@
+#ifndef _APRILTAG_SCRATCH_H
+#define _APRILTAG_SCRATCH_H
+
+#include "common/image_u1.h"
+#include "common/image_u8.h"
+#include "common/unionfind.h"
+#include "common/zarray.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Buffers used internally by apriltag_detector_detect. They are
+// created on the first frame and reused for subsequent frames as long
+// as the image size does not change, so that a steady-state detector
+// does (almost) no heap allocation per frame.
+//
+// Not thread safe: a scratch object may only be used by one call to
+// the detector at a time.
+
+// An image whose storage is retained (and reused for any image that
+// fits in it) between frames. Its rows are aligned and padded as
+// image_u8_create's are (see IMAGE_U8_ALIGNMENT).
+typedef struct apriltag_scratch_image apriltag_scratch_image_t;
+struct apriltag_scratch_image
+{
+    image_u8_t im;
+    size_t alloc; // bytes allocated for im.buf
+};
+
+// The same, for a packed binary image.
+typedef struct apriltag_scratch_image_u1 apriltag_scratch_image_u1_t;
+struct apriltag_scratch_image_u1
+{
+    image_u1_t im;
+    size_t alloc; // words allocated for im.buf
+};
+
+// A block of memory whose storage is retained between frames.
+typedef struct apriltag_scratch_buffer apriltag_scratch_buffer_t;
+struct apriltag_scratch_buffer
+{
+    void *buf;
+    size_t alloc; // bytes allocated for buf
+};
+
+// A set of buffers, of which there are as many as have been asked for.
+typedef struct apriltag_scratch_buffers apriltag_scratch_buffers_t;
+struct apriltag_scratch_buffers
+{
+    apriltag_scratch_buffer_t *bufs;
+    int n;
+};
+
+typedef struct apriltag_scratch apriltag_scratch_t;
+struct apriltag_scratch
+{
+    // apriltag_detector_detect_image: the Y samples of a packed YUV
+    // frame, or the luma of a bayer mosaic.
+    apriltag_scratch_image_t luma;
+
+    // preprocessing: the decimated image, and the horizontal pass of
+    // the blur/sharpen.
+    apriltag_scratch_image_t decimate;
+    apriltag_scratch_image_t blur;
+
+    // apriltag_detector_detect_rois: the current region of interest.
+    apriltag_scratch_image_t roi;
+
+    // motion gating: the reduced copies of the current and previous
+    // frames (alternately), and the difference of each tile.
+    apriltag_scratch_image_t motion[2];
+    apriltag_scratch_buffer_t motion_sads;
+
+    // quad_thresh: binarized image and tile statistics, and the
+    // deglitched binarized image.
+    apriltag_scratch_image_u1_t threshbits;
+    apriltag_scratch_image_u1_t deglitchbits;
+    uint8_t *tile_max, *tile_min;
+    int tile_alloc;
+
+    // quad_thresh: when the tiles are reused from frame to frame (see
+    // qtp.tile_tolerance), whether those of the last threshold can
+    // be, the pixels they were computed from, and which of them
+    // changed in the current frame.
+    int thresh_reuse;
+    apriltag_scratch_image_t thresh_prev;
+    apriltag_scratch_buffer_t tile_changed;
+
+    // quad_thresh: the edge pixels, black (next to white) and white
+    // (next to black).
+    apriltag_scratch_image_u1_t edge_black, edge_white;
+
+    // quad_thresh: 8 bit versions of the binarized and edge images,
+    // for debugging and the per-pixel components.
+    apriltag_scratch_image_t threshim;
+    apriltag_scratch_image_t edgeim;
+
+    unionfind_t *uf;
+    uint32_t uf_alloc; // elements allocated in uf->data
+
+    // quad_thresh: the runs of the edge image found by each band of
+    // rows, all of the runs, and the first run of each row.
+    apriltag_scratch_buffers_t cc_bands;
+    apriltag_scratch_buffer_t cc_runs;
+    apriltag_scratch_buffer_t cc_row_runs;
+
+    // quad_thresh: the pairs of boundary points found by each band of
+    // rows (and the working space of each band); the pairs of every
+    // cluster (and space to sort them by cluster), the span of each
+    // cluster in the sorted points (and the cost of fitting a quad to
+    // it), and the relabeling of the components. See
+    // apriltag_quad_thresh.c.
+    apriltag_scratch_buffers_t cluster_bands;
+    apriltag_scratch_buffer_t cluster_rowreps;
+    apriltag_scratch_buffer_t cluster_pairs;
+    apriltag_scratch_buffer_t cluster_tmp;
+    apriltag_scratch_buffer_t cluster_spans;
+    apriltag_scratch_buffer_t cluster_costs;
+    apriltag_scratch_buffer_t cluster_labels;
+
+    // quads_from_contours: the result of each contour, the contours
+    // which passed the prefilter, the quad fitted to each of those,
+    // and the tasks fitting them.
+    apriltag_scratch_buffer_t qfc_results;
+    apriltag_scratch_buffer_t qfc_candidates;
+    apriltag_scratch_buffer_t qfc_quads;
+    apriltag_scratch_buffer_t qfc_tasks;
+
+    // quad_gradient: the gradient of each pixel, and the direction of
+    // each edge pixel; the ids of the edge pixels of two rows, their
+    // union-find, the pixel of each id, the cluster of each component,
+    // and the pixels of every cluster (and where each starts); the
+    // segment fit to each cluster, the segment each carries on into
+    // (and from), and the joined segments; the grid
+    // of the segments' starts (the start of each cell, the segments by
+    // cell, and the cell of each); the children of each segment, and
+    // the quads starting at each. See apriltag_quad_gradient.c.
+    apriltag_scratch_buffer_t grad_mag, grad_theta;
+    apriltag_scratch_buffer_t grad_labels, grad_uf, grad_pixels;
+    apriltag_scratch_buffer_t grad_clusters, grad_members, grad_offsets;
+    apriltag_scratch_buffer_t grad_segments, grad_next, grad_prev, grad_joined;
+    apriltag_scratch_buffer_t grad_cell_offsets, grad_cell_segs, grad_cell_of;
+    apriltag_scratch_buffer_t grad_children, grad_nchildren;
+    apriltag_scratch_buffer_t grad_quads, grad_nquads;
+
+    // decode_quads: the cost of each quad, the detections of each
+    // task, and which of the expected ids have been found (see
+    // td->expected_ids).
+    apriltag_scratch_buffer_t decode_costs;
+    apriltag_scratch_buffers_t decode_results;
+    apriltag_scratch_buffer_t expected_found;
+
+    // quads (struct quad) produced by the current frame.
+    zarray_t *quads;
+
+    // the detections (apriltag_detection_record_t) of the current
+    // frame.
+    zarray_t *detections;
+
+    // apriltag_detector_detect_rois: the quads of every region.
+    zarray_t *roi_quads;
+
+    // the pyramid search: the regions not yet covered by tags (and
+    // motion gating: the regions changed; tiling: the tiles).
+    zarray_t *pyramid_rois;
+};
+
+apriltag_scratch_t *apriltag_scratch_create();
+void apriltag_scratch_destroy(apriltag_scratch_t *s);
+
+// Return a width x height image (with the same stride that
+// image_u8_create would use) stored in slot, growing its storage if
+// necessary. The contents of a recycled image are NOT cleared.
+image_u8_t *apriltag_scratch_image(apriltag_scratch_image_t *slot, int width, int height);
+
+// The same, for a packed binary image. The contents of a recycled
+// image are NOT cleared (and so every word, including the bits past
+// the width, must be written).
+image_u1_t *apriltag_scratch_image_u1(apriltag_scratch_image_u1_t *slot, int width, int height);
+
+// Return a unionfind with maxid = n, reset so that every element is
+// in its own set.
+unionfind_t *apriltag_scratch_unionfind(apriltag_scratch_t *s, uint32_t n);
+
+// Return the (empty) array into which apriltag_detector_detect_rois
+// collects quads.
+zarray_t *apriltag_scratch_roi_quads(apriltag_scratch_t *s, size_t el_sz);
+
+// Return the (empty) array of regions searched by a level of the
+// pyramid search (or by motion gating, or tiling).
+zarray_t *apriltag_scratch_pyramid_rois(apriltag_scratch_t *s, size_t el_sz);
+
+// Return b's storage, grown (preserving its contents) to at least sz
+// bytes if necessary.
+void *apriltag_scratch_buffer(apriltag_scratch_buffer_t *b, size_t sz);
+
+// Return the first n buffers of b, adding (empty) buffers if necessary.
+apriltag_scratch_buffer_t *apriltag_scratch_buffers(apriltag_scratch_buffers_t *b, int n);
+
+// Return the (empty) quads array for a new frame.
+zarray_t *apriltag_scratch_quads(apriltag_scratch_t *s, size_t el_sz);
+
+// Return the (empty) detections array for a new frame.
+zarray_t *apriltag_scratch_detections(apriltag_scratch_t *s, size_t el_sz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
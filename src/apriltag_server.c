@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "apriltag.h"
+#include "apriltag_family.h"
+#include "apriltag_capture.h"
+#include "apriltag_shm.h"
+#include "image_u8.h"
+#include "time_util.h"
+#include "trace.h"
+
+#include "zarray.h"
+#include "getopt.h"
+
+// A detection server: one detector (with one set of decode tables and
+// one pool of threads) for every process that needs the tags of a
+// camera. Detects the newest frame of a frame ring (see
+// apriltag_shm.h), in place, whenever there is a new one, and
+// publishes its detections into a detection ring, until interrupted.
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_bool(getopt, 'q', "quiet", 0, "Reduce output");
+    getopt_add_string(getopt, '\0', "frames", "/apriltag_frames", "Detect the frames of this frame ring");
+    getopt_add_string(getopt, '\0', "detections", "/apriltag_detections", "Publish the detections into this detection ring");
+    getopt_add_int(getopt, '\0', "slots", "8", "Keep the detections of this many frames");
+    getopt_add_int(getopt, '\0', "capacity", "64", "Publish up to this many detections of a frame");
+    getopt_add_int(getopt, '\0', "poll", "1000", "Wait this many us before looking for a new frame again");
+    getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag families to use (e.g. tag36h11,tag16h5)");
+    getopt_add_int(getopt, '\0', "border", "1", "Set tag family border size");
+    getopt_add_int(getopt, '\0', "max-hamming", "2", "Correct up to this many bit errors");
+    getopt_add_int(getopt, 't', "threads", "4", "Use this many CPU threads");
+    getopt_add_double(getopt, 'x', "decimate", "1.0", "Decimate input image by this factor");
+    getopt_add_double(getopt, 'b', "blur", "0.0", "Apply low-pass blur to input");
+    getopt_add_bool(getopt, '0', "refine-edges", 1, "Spend more time aligning edges of tags");
+    getopt_add_bool(getopt, '\0', "refine-edges-full", 0, "Align the edges of tags at every decimation (including 1)");
+    getopt_add_bool(getopt, '1', "refine-decode", 0, "Spend more time decoding tags");
+    getopt_add_bool(getopt, '2', "refine-pose", 0, "Spend more time computing pose of tags");
+    getopt_add_bool(getopt, '\0', "gpu", 0, "Segment the frames on the GPU (with OpenCL)");
+    getopt_add_string(getopt, '\0', "trace", "", "On exit, write what each thread did when to this file, as a Chrome trace (see trace.h)");
+    getopt_add_int(getopt, '\0', "trace-events", "65536", "Trace the last this many events of each thread");
+    getopt_add_string(getopt, '\0', "capture", "", "Capture sampled frames, and what was found in them, to files starting with this (see apriltag_capture.h)");
+    getopt_add_int(getopt, '\0', "capture-interval", "1", "Capture every this many'th frame");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int quiet = getopt_get_bool(getopt, "quiet");
+
+    apriltag_family_t *families[APRILTAG_SHM_MAX_FAMILIES];
+    int nfamilies = 0;
+
+    apriltag_detector_t *td = apriltag_detector_create();
+
+    char famlist[1024];
+    snprintf(famlist, sizeof(famlist), "%s", getopt_get_string(getopt, "family"));
+    for (char *name = strtok(famlist, ","); name; name = strtok(NULL, ",")) {
+        if (nfamilies == APRILTAG_SHM_MAX_FAMILIES) {
+            printf("At most %d families can be used.\n", APRILTAG_SHM_MAX_FAMILIES);
+            exit(-1);
+        }
+
+        apriltag_family_t *tf = apriltag_family_create(name);
+        if (!tf) {
+            printf("Unrecognized tag family name %s. Use e.g. \"tag36h11\".\n", name);
+            exit(-1);
+        }
+
+        tf->black_border = getopt_get_int(getopt, "border");
+        apriltag_family_build_decode_table(tf, getopt_get_int(getopt, "max-hamming"));
+        apriltag_detector_add_family(td, tf);
+        families[nfamilies++] = tf;
+    }
+
+    td->quad_decimate = getopt_get_double(getopt, "decimate");
+    td->quad_sigma = getopt_get_double(getopt, "blur");
+    td->nthreads = getopt_get_int(getopt, "threads");
+    td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    if (getopt_get_bool(getopt, "refine-edges-full"))
+        td->refine_edges = 2;
+    td->refine_decode = getopt_get_bool(getopt, "refine-decode");
+    td->refine_pose = getopt_get_bool(getopt, "refine-pose");
+    td->gpu = getopt_get_bool(getopt, "gpu");
+
+    // the detector blurs an undecimated image in place, which the
+    // (read only) frames can't be: detect a copy of those.
+    int copy_frames = td->quad_sigma != 0 && td->quad_decimate <= 1;
+
+    const char *frames_name = getopt_get_string(getopt, "frames");
+    const char *detections_name = getopt_get_string(getopt, "detections");
+    int capacity = getopt_get_int(getopt, "capacity");
+
+    apriltag_shm_t *out = apriltag_shm_detections_create(detections_name, getopt_get_int(getopt, "slots"),
+                                                         capacity, families, nfamilies);
+    if (!out) {
+        printf("Couldn't create the detection ring %s\n", detections_name);
+        exit(-1);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    int poll_us = getopt_get_int(getopt, "poll");
+
+    // (the rings keep the last events, i.e. those of the frames
+    // before exiting.)
+    const char *tracepath = getopt_get_string(getopt, "trace");
+    if (tracepath[0])
+        trace_start(getopt_get_int(getopt, "trace-events"));
+
+    apriltag_capture_t *capture = NULL;
+    const char *capturepath = getopt_get_string(getopt, "capture");
+    if (capturepath[0]) {
+        capture = apriltag_capture_create(capturepath, getopt_get_int(getopt, "capture-interval"), 4);
+        if (!capture) {
+            printf("Couldn't capture to %s\n", capturepath);
+            exit(-1);
+        }
+        td->capture = capture;
+    }
+
+    // (the frame ring may not have been created yet.)
+    apriltag_shm_t *in = NULL;
+    while (!stop && !(in = apriltag_shm_frames_open(frames_name)))
+        usleep(poll_us);
+
+    if (!quiet && in)
+        printf("Detecting the frames of %s into %s\n", frames_name, detections_name);
+
+    apriltag_detection_record_t *dets = calloc(capacity + 1, sizeof(apriltag_detection_record_t));
+    image_u8_t *copy = NULL;
+
+    uint64_t last = 0;
+    int64_t ndetected = 0, nskipped = 0, ndropped = 0;
+
+    while (!stop) {
+        image_u8_t frame;
+        int64_t utime;
+        uint64_t seq = apriltag_shm_frame_latest(in, last, &frame, &utime);
+        if (!seq) {
+            usleep(poll_us);
+            continue;
+        }
+
+        // frames that came while the last was being detected are
+        // never detected.
+        if (last && seq > last + 1)
+            nskipped += seq - last - 1;
+        last = seq;
+
+        image_u8_t *im = &frame;
+        if (copy_frames) {
+            if (!copy || copy->width != frame.width || copy->height != frame.height) {
+                image_u8_destroy(copy);
+                copy = image_u8_create(frame.width, frame.height);
+            }
+            for (int y = 0; y < frame.height; y++)
+                memcpy(&copy->buf[y*copy->stride], &frame.buf[y*frame.stride], frame.width);
+            im = copy;
+        }
+
+        if (copy_frames && !apriltag_shm_frame_valid(in, seq)) {
+            ndropped++;
+            continue;
+        }
+
+        int ndets = apriltag_detector_detect_into(td, im, dets, capacity);
+
+        // the camera overwrote the frame while it was being detected.
+        if (!copy_frames && !apriltag_shm_frame_valid(in, seq)) {
+            ndropped++;
+            continue;
+        }
+
+        apriltag_shm_detections_publish(out, seq, utime, dets, ndets, apriltag_detector_stats(td));
+        ndetected++;
+    }
+
+    if (!quiet)
+        printf("Detected %" PRId64 " frames; skipped %" PRId64 ", dropped %" PRId64 " overwritten while detected\n",
+               ndetected, nskipped, ndropped);
+
+    if (tracepath[0]) {
+        trace_stop();
+        if (trace_write_json(tracepath) != 0)
+            printf("Couldn't write %s\n", tracepath);
+    }
+
+    if (capture) {
+        apriltag_capture_flush(capture);
+
+        apriltag_capture_counts_t counts;
+        apriltag_capture_get_counts(capture, &counts);
+        if (!quiet || counts.nfailed)
+            printf("Captured %" PRIu64 " frames: wrote %" PRIu64 ", dropped %" PRIu64 " (failed %" PRIu64 ")\n",
+                   counts.ncaptured, counts.nwritten, counts.ndropped, counts.nfailed);
+    }
+
+    image_u8_destroy(copy);
+    free(dets);
+    apriltag_shm_close(in);
+    apriltag_shm_close(out);
+    apriltag_detector_destroy(td);
+    apriltag_capture_destroy(capture);
+
+    for (int i = 0; i < nfamilies; i++)
+        apriltag_family_destroy(families[i]);
+
+    getopt_destroy(getopt);
+    return 0;
+}
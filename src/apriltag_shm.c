@@ -0,0 +1,412 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "apriltag_shm.h"
+
+// The layout of a ring: its header (64 bytes), then (for a detection
+// ring) its family records, then its slots, each a slot header (64
+// bytes) followed by its frame, or its records.
+struct frames_header
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t nslots;
+    uint32_t width, height, stride;
+    uint32_t slot_size;   // bytes, the slot header's included
+    uint64_t head;        // the newest entry published (0 for none)
+    uint8_t reserved[24];
+};
+
+struct detections_header
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t nslots;
+    uint32_t max_detections;
+    uint32_t record_size; // sizeof(apriltag_log_record_t)
+    uint32_t nfamilies;
+    uint32_t slot_size;
+    uint64_t head;
+    uint8_t reserved[24];
+};
+
+struct slot_header
+{
+    uint64_t seq;         // the entry held, or 0 while it is written
+    int64_t utime;
+    uint32_t width, height;
+    uint8_t reserved[40];
+};
+
+typedef char apriltag_shm_frames_header_check[sizeof(struct frames_header) == 64 ? 1 : -1];
+typedef char apriltag_shm_detections_header_check[sizeof(struct detections_header) == 64 ? 1 : -1];
+typedef char apriltag_shm_slot_header_check[sizeof(struct slot_header) == 64 ? 1 : -1];
+
+#define DETECTIONS_FAMILIES_SIZE (APRILTAG_SHM_MAX_FAMILIES * sizeof(apriltag_log_record_t))
+
+// Map a new shared memory object of sz (zeroed) bytes.
+static apriltag_shm_t *shm_create(const char *name, size_t sz)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    // (truncating first zeroes a ring left behind by a previous writer,
+    // so that readers of it see its magic only once it is initialized.)
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, sz) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    apriltag_shm_t *shm = calloc(1, sizeof(apriltag_shm_t));
+    shm->map = map;
+    shm->maplen = sz;
+    shm->name = strdup(name);
+    return shm;
+}
+
+// Map an existing shared memory object, read only, if it has at least
+// minsz bytes and the given magic.
+static apriltag_shm_t *shm_open_magic(const char *name, const char *magic, size_t minsz)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) minsz) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t maplen = st.st_size;
+    void *map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    // (the magic is written last.)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (memcmp(map, magic, 8)) {
+        munmap(map, maplen);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    apriltag_shm_t *shm = calloc(1, sizeof(apriltag_shm_t));
+    shm->map = map;
+    shm->maplen = maplen;
+    return shm;
+}
+
+// Publish the header of a new ring to its readers.
+static void shm_set_magic(apriltag_shm_t *shm, const char *magic)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->map, magic, 8);
+}
+
+void apriltag_shm_close(apriltag_shm_t *shm)
+{
+    if (!shm)
+        return;
+
+    munmap(shm->map, shm->maplen);
+    if (shm->name) {
+        shm_unlink(shm->name);
+        free(shm->name);
+    }
+    free(shm);
+}
+
+static struct slot_header *slot_of(const apriltag_shm_t *shm, size_t offset, uint32_t nslots,
+                                   uint32_t slot_size, uint64_t seq)
+{
+    return (struct slot_header*) ((uint8_t*) shm->map + offset + ((seq - 1) % nslots) * slot_size);
+}
+
+// Begin writing the entry after head into its slot: readers of the
+// entry it held see that it is gone before any of it changes.
+static struct slot_header *slot_begin(apriltag_shm_t *shm, size_t offset, uint32_t nslots,
+                                      uint32_t slot_size, uint64_t head)
+{
+    shm->seq = head + 1;
+
+    struct slot_header *slot = slot_of(shm, offset, nslots, slot_size, shm->seq);
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot;
+}
+
+static void slot_publish(struct slot_header *slot, uint64_t *head, uint64_t seq)
+{
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(head, seq, __ATOMIC_RELEASE);
+}
+
+// The slot of the newest entry, if it came after after and is not
+// being written: read it, then check that its seq is still *seq.
+static const struct slot_header *slot_latest(const apriltag_shm_t *shm, size_t offset, uint32_t nslots,
+                                             uint32_t slot_size, const uint64_t *head,
+                                             uint64_t after, uint64_t *seq)
+{
+    uint64_t n = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    if (n <= after)
+        return NULL;
+
+    const struct slot_header *slot = slot_of(shm, offset, nslots, slot_size, n);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n)
+        return NULL;
+
+    *seq = n;
+    return slot;
+}
+
+static int slot_valid(const apriltag_shm_t *shm, size_t offset, uint32_t nslots,
+                      uint32_t slot_size, uint64_t seq)
+{
+    const struct slot_header *slot = slot_of(shm, offset, nslots, slot_size, seq);
+
+    // (the reads of the entry come before this.)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+////////////////////////////////////////////////////////////////////
+// frame rings
+
+apriltag_shm_t *apriltag_shm_frames_create(const char *name, int nslots, int width, int height)
+{
+    if (nslots < 1 || width < 1 || height < 1)
+        return NULL;
+
+    uint32_t stride = (width + IMAGE_U8_ALIGNMENT - 1) / IMAGE_U8_ALIGNMENT * IMAGE_U8_ALIGNMENT;
+    uint32_t slot_size = sizeof(struct slot_header) + (size_t) stride * height;
+
+    apriltag_shm_t *shm = shm_create(name, sizeof(struct frames_header) + (size_t) nslots * slot_size);
+    if (!shm)
+        return NULL;
+
+    struct frames_header *hdr = shm->map;
+    hdr->byte_order = APRILTAG_SHM_BYTE_ORDER;
+    hdr->nslots = nslots;
+    hdr->width = width;
+    hdr->height = height;
+    hdr->stride = stride;
+    hdr->slot_size = slot_size;
+    shm_set_magic(shm, APRILTAG_SHM_FRAMES_MAGIC);
+    return shm;
+}
+
+apriltag_shm_t *apriltag_shm_frames_open(const char *name)
+{
+    apriltag_shm_t *shm = shm_open_magic(name, APRILTAG_SHM_FRAMES_MAGIC, sizeof(struct frames_header));
+    if (!shm)
+        return NULL;
+
+    const struct frames_header *hdr = shm->map;
+    if (hdr->byte_order != APRILTAG_SHM_BYTE_ORDER ||
+        shm->maplen < sizeof(*hdr) + (size_t) hdr->nslots * hdr->slot_size) {
+        apriltag_shm_close(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void apriltag_shm_frames_dims(const apriltag_shm_t *shm, int *width, int *height)
+{
+    const struct frames_header *hdr = shm->map;
+    *width = hdr->width;
+    *height = hdr->height;
+}
+
+int apriltag_shm_frame_begin(apriltag_shm_t *shm, int width, int height, image_u8_t *im)
+{
+    struct frames_header *hdr = shm->map;
+    if (width < 0 || height < 0 || width > (int) hdr->width || height > (int) hdr->height)
+        return -1;
+
+    struct slot_header *slot = slot_begin(shm, sizeof(*hdr), hdr->nslots, hdr->slot_size, hdr->head);
+    slot->width = width;
+    slot->height = height;
+
+    image_u8_t tmp = { .width = width, .height = height, .stride = hdr->stride,
+                       .buf = (uint8_t*) &slot[1] };
+    memcpy(im, &tmp, sizeof(tmp));
+    return 0;
+}
+
+uint64_t apriltag_shm_frame_publish(apriltag_shm_t *shm, int64_t utime)
+{
+    struct frames_header *hdr = shm->map;
+    struct slot_header *slot = slot_of(shm, sizeof(*hdr), hdr->nslots, hdr->slot_size, shm->seq);
+
+    slot->utime = utime;
+    slot_publish(slot, &hdr->head, shm->seq);
+    return shm->seq;
+}
+
+uint64_t apriltag_shm_frame_latest(const apriltag_shm_t *shm, uint64_t after,
+                                   image_u8_t *im, int64_t *utime)
+{
+    const struct frames_header *hdr = shm->map;
+
+    uint64_t seq;
+    const struct slot_header *slot = slot_latest(shm, sizeof(*hdr), hdr->nslots, hdr->slot_size,
+                                                 &hdr->head, after, &seq);
+    if (!slot)
+        return 0;
+
+    // (a frame rewritten meanwhile may have any dimensions: keep them
+    // within the slot.)
+    int width = slot->width, height = slot->height;
+    if (width > (int) hdr->width)
+        width = hdr->width;
+    if (height > (int) hdr->height)
+        height = hdr->height;
+
+    image_u8_t tmp = { .width = width, .height = height, .stride = hdr->stride,
+                       .buf = (uint8_t*) &slot[1] };
+    memcpy(im, &tmp, sizeof(tmp));
+    *utime = slot->utime;
+    return seq;
+}
+
+int apriltag_shm_frame_valid(const apriltag_shm_t *shm, uint64_t seq)
+{
+    const struct frames_header *hdr = shm->map;
+    return slot_valid(shm, sizeof(*hdr), hdr->nslots, hdr->slot_size, seq);
+}
+
+////////////////////////////////////////////////////////////////////
+// detection rings
+
+apriltag_shm_t *apriltag_shm_detections_create(const char *name, int nslots, int max_detections,
+                                               apriltag_family_t **families, int nfamilies)
+{
+    if (nslots < 1 || max_detections < 0 || nfamilies < 0 || nfamilies > APRILTAG_SHM_MAX_FAMILIES)
+        return NULL;
+
+    uint32_t slot_size = sizeof(struct slot_header) + (1 + max_detections) * sizeof(apriltag_log_record_t);
+
+    apriltag_shm_t *shm = shm_create(name, sizeof(struct detections_header) + DETECTIONS_FAMILIES_SIZE +
+                                     (size_t) nslots * slot_size);
+    if (!shm)
+        return NULL;
+
+    struct detections_header *hdr = shm->map;
+    hdr->byte_order = APRILTAG_SHM_BYTE_ORDER;
+    hdr->nslots = nslots;
+    hdr->max_detections = max_detections;
+    hdr->record_size = sizeof(apriltag_log_record_t);
+    hdr->nfamilies = nfamilies;
+    hdr->slot_size = slot_size;
+
+    apriltag_log_record_t *records = (apriltag_log_record_t*) &hdr[1];
+    for (int i = 0; i < nfamilies; i++) {
+        apriltag_log_family_record(&records[i], i, families[i]);
+        shm->families[i] = families[i];
+    }
+    shm->nfamilies = nfamilies;
+
+    shm_set_magic(shm, APRILTAG_SHM_DETECTIONS_MAGIC);
+    return shm;
+}
+
+apriltag_shm_t *apriltag_shm_detections_open(const char *name)
+{
+    apriltag_shm_t *shm = shm_open_magic(name, APRILTAG_SHM_DETECTIONS_MAGIC,
+                                         sizeof(struct detections_header) + DETECTIONS_FAMILIES_SIZE);
+    if (!shm)
+        return NULL;
+
+    const struct detections_header *hdr = shm->map;
+    if (hdr->byte_order != APRILTAG_SHM_BYTE_ORDER ||
+        hdr->record_size != sizeof(apriltag_log_record_t) ||
+        hdr->nfamilies > APRILTAG_SHM_MAX_FAMILIES ||
+        shm->maplen < sizeof(*hdr) + DETECTIONS_FAMILIES_SIZE + (size_t) hdr->nslots * hdr->slot_size) {
+        apriltag_shm_close(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+uint64_t apriltag_shm_detections_publish(apriltag_shm_t *shm, uint64_t frame_seq, int64_t utime,
+                                         const apriltag_detection_record_t *dets, int ndets,
+                                         const apriltag_stats_t *stats)
+{
+    struct detections_header *hdr = shm->map;
+
+    if (ndets > (int) hdr->max_detections)
+        ndets = hdr->max_detections;
+
+    int families[ndets + 1];
+    for (int i = 0; i < ndets; i++) {
+        families[i] = -1;
+        for (int j = 0; j < shm->nfamilies; j++) {
+            if (shm->families[j] == dets[i].family)
+                families[i] = j;
+        }
+        if (families[i] < 0)
+            return 0;
+    }
+
+    struct slot_header *slot = slot_begin(shm, sizeof(*hdr) + DETECTIONS_FAMILIES_SIZE,
+                                          hdr->nslots, hdr->slot_size, hdr->head);
+    slot->utime = utime;
+
+    apriltag_log_record_t *records = (apriltag_log_record_t*) &slot[1];
+    for (int i = 0; i <= ndets; i++) {
+        records[i].utime = utime;
+        records[i].frame = frame_seq;
+    }
+
+    apriltag_log_frame_record(&records[0], ndets, stats);
+    for (int i = 0; i < ndets; i++)
+        apriltag_log_detection_record(&records[1 + i], families[i], &dets[i]);
+
+    slot_publish(slot, &hdr->head, shm->seq);
+    return shm->seq;
+}
+
+const apriltag_log_record_t *apriltag_shm_detections_latest(const apriltag_shm_t *shm, uint64_t after,
+                                                            uint64_t *seq)
+{
+    const struct detections_header *hdr = shm->map;
+
+    const struct slot_header *slot = slot_latest(shm, sizeof(*hdr) + DETECTIONS_FAMILIES_SIZE,
+                                                 hdr->nslots, hdr->slot_size, &hdr->head, after, seq);
+    if (!slot)
+        return NULL;
+
+    return (const apriltag_log_record_t*) &slot[1];
+}
+
+int apriltag_shm_detections_valid(const apriltag_shm_t *shm, uint64_t seq)
+{
+    const struct detections_header *hdr = shm->map;
+    return slot_valid(shm, sizeof(*hdr) + DETECTIONS_FAMILIES_SIZE, hdr->nslots, hdr->slot_size, seq);
+}
+
+const apriltag_log_record_t *apriltag_shm_family(const apriltag_shm_t *shm, int family)
+{
+    const struct detections_header *hdr = shm->map;
+    if (family < 0 || family >= (int) hdr->nfamilies)
+        return NULL;
+
+    return &((const apriltag_log_record_t*) &hdr[1])[family];
+}
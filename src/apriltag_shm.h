@@ -0,0 +1,137 @@
+#ifndef _APRILTAG_SHM_H
+#define _APRILTAG_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apriltag.h"
+#include "apriltag_log.h"
+#include "common/image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Rings of frames and of detections in POSIX shared memory (see
+// shm_open; names are of the form "/name"), through which several
+// processes share one detector (see apriltag_server): a camera
+// process writes frames into the slots of a frame ring, the server
+// detects each one in place and publishes its detections into a
+// detection ring, and any number of consumers read them in place.
+//
+// Each ring has one writer, which creates it (and removes it when it
+// closes it), and readers which map it read-only and poll it for the
+// newest entry. Every entry carries a sequence number (from 1), and
+// is being written while its slot's number isn't that: a reader
+// checks (with _valid) that the slot still holds the entry once done
+// with it, since the writer never waits for readers and a slow one
+// may find its entry overwritten. Entries are in the byte order of
+// the writer.
+
+#define APRILTAG_SHM_FRAMES_MAGIC "ATSHMFR1"
+#define APRILTAG_SHM_DETECTIONS_MAGIC "ATSHMDT1"
+#define APRILTAG_SHM_BYTE_ORDER 0x01020304
+
+// the number of families a detection ring has room for.
+#define APRILTAG_SHM_MAX_FAMILIES 16
+
+typedef struct apriltag_shm apriltag_shm_t;
+struct apriltag_shm
+{
+    void *map;
+    size_t maplen;
+
+    // the writer's: the name to remove on close, the sequence number
+    // being written, and the families numbered as in the ring.
+    char *name;
+    uint64_t seq;
+    int nfamilies;
+    apriltag_family_t *families[APRILTAG_SHM_MAX_FAMILIES];
+};
+
+// Close a ring (of either kind), removing it if it was created by
+// this handle.
+void apriltag_shm_close(apriltag_shm_t *shm);
+
+////////////////////////////////////////////////////////////////////
+// Frame rings: nslots 8 bit gray frames of up to width x height
+// pixels, each row aligned (to IMAGE_U8_ALIGNMENT) as by
+// image_u8_create.
+
+// Create (or recreate) the frame ring name. NULL on failure.
+apriltag_shm_t *apriltag_shm_frames_create(const char *name, int nslots, int width, int height);
+
+// Open the frame ring name for reading. NULL if it doesn't exist (or
+// hasn't been initialized yet).
+apriltag_shm_t *apriltag_shm_frames_open(const char *name);
+
+// The largest frame the ring holds.
+void apriltag_shm_frames_dims(const apriltag_shm_t *shm, int *width, int *height);
+
+// Begin writing the next frame, of width x height pixels (at most
+// those of the ring): sets *im to a view of its slot, into which to
+// write the frame before publishing it. Returns 0, or -1 if the frame
+// is too large.
+int apriltag_shm_frame_begin(apriltag_shm_t *shm, int width, int height, image_u8_t *im);
+
+// Publish the frame begun last, taken at utime. Returns its sequence
+// number.
+uint64_t apriltag_shm_frame_publish(apriltag_shm_t *shm, int64_t utime);
+
+// The newest frame, if it came after the frame numbered after:
+// returns its sequence number, having set *im to a (read only) view
+// of it in place and *utime to its time, or 0 if there is no newer
+// frame (or it is being written).
+uint64_t apriltag_shm_frame_latest(const apriltag_shm_t *shm, uint64_t after,
+                                   image_u8_t *im, int64_t *utime);
+
+// Whether the frame numbered seq is still in its slot (i.e. whether
+// what was read of it is the frame).
+int apriltag_shm_frame_valid(const apriltag_shm_t *shm, uint64_t seq);
+
+////////////////////////////////////////////////////////////////////
+// Detection rings: nslots frames of detections, each kept as records
+// (see apriltag_log.h): its APRILTAG_LOG_FRAME record, whose frame is
+// the (low bits of the) sequence number of the frame in its frame
+// ring, followed by the APRILTAG_LOG_DETECTION records of its (up to
+// max_detections) detections. The ring holds the
+// APRILTAG_LOG_FAMILY records of the families the detections number.
+
+// Create (or recreate) the detection ring name, for the detections of
+// the nfamilies families. NULL on failure.
+apriltag_shm_t *apriltag_shm_detections_create(const char *name, int nslots, int max_detections,
+                                               apriltag_family_t **families, int nfamilies);
+
+// Open the detection ring name for reading. NULL if it doesn't exist
+// (or hasn't been initialized yet).
+apriltag_shm_t *apriltag_shm_detections_open(const char *name);
+
+// Publish the detections of the frame numbered frame_seq, taken at
+// utime, and (unless NULL) its statistics, keeping only the first
+// max_detections. Returns the sequence number of the entry, or 0 if
+// a detection is of a family not given to
+// apriltag_shm_detections_create (having published nothing).
+uint64_t apriltag_shm_detections_publish(apriltag_shm_t *shm, uint64_t frame_seq, int64_t utime,
+                                         const apriltag_detection_record_t *dets, int ndets,
+                                         const apriltag_stats_t *stats);
+
+// The records of the newest entry, if it came after the one numbered
+// after: its APRILTAG_LOG_FRAME record (followed, in place, by its
+// stats.ndetections detection records), having set *seq to its
+// sequence number; or NULL if there is no newer entry (or it is being
+// written).
+const apriltag_log_record_t *apriltag_shm_detections_latest(const apriltag_shm_t *shm, uint64_t after,
+                                                            uint64_t *seq);
+
+// Whether the entry numbered seq is still in its slot.
+int apriltag_shm_detections_valid(const apriltag_shm_t *shm, uint64_t seq);
+
+// The APRILTAG_LOG_FAMILY record of the family numbered family, or
+// NULL.
+const apriltag_log_record_t *apriltag_shm_family(const apriltag_shm_t *shm, int family);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -255,6 +255,68 @@ matd_t *homography_compute(zarray_t *correspondences, int flags)
 }
 
 
+
+int homography33_compute_quad(double H[9], const float p[4][2])
+{
+    // Following Heckbert, first find the homography G taking the unit
+    // square (0,0), (1,0), (1,1), (0,1) to p: with G normalized so
+    // that G[8] = 1, the remaining eight elements are linear in the
+    // corners once G[6] and G[7] (which vanish when p is a
+    // parallelogram) are known.
+    double x0 = p[0][0], y0 = p[0][1];
+    double x1 = p[1][0], y1 = p[1][1];
+    double x2 = p[2][0], y2 = p[2][1];
+    double x3 = p[3][0], y3 = p[3][1];
+
+    double sx = x0 - x1 + x2 - x3;
+    double sy = y0 - y1 + y2 - y3;
+    double dx1 = x1 - x2, dy1 = y1 - y2;
+    double dx2 = x3 - x2, dy2 = y3 - y2;
+
+    double den = dx1*dy2 - dx2*dy1;
+    if (den == 0)
+        return -1;
+
+    double g = (sx*dy2 - dx2*sy) / den;
+    double h = (dx1*sy - sx*dy1) / den;
+
+    double a = x1 - x0 + g*x1, b = x3 - x0 + h*x3;
+    double d = y1 - y0 + g*y1, e = y3 - y0 + h*y3;
+
+    // H = G * [ 1/2 0 1/2 ; 0 1/2 1/2 ; 0 0 1 ], which first takes
+    // [-1,1] to [0,1].
+    H[0] = a/2; H[1] = b/2; H[2] = (a + b)/2 + x0;
+    H[3] = d/2; H[4] = e/2; H[5] = (d + e)/2 + y0;
+    H[6] = g/2; H[7] = h/2; H[8] = (g + h)/2 + 1;
+
+    return 0;
+}
+
+int homography33_inverse(double Hinv[9], const double H[9])
+{
+    double c0 = H[4]*H[8] - H[5]*H[7];
+    double c1 = H[5]*H[6] - H[3]*H[8];
+    double c2 = H[3]*H[7] - H[4]*H[6];
+
+    double det = H[0]*c0 + H[1]*c1 + H[2]*c2;
+    if (det == 0)
+        return -1;
+
+    double invdet = 1.0 / det;
+
+    Hinv[0] = c0 * invdet;
+    Hinv[1] = (H[2]*H[7] - H[1]*H[8]) * invdet;
+    Hinv[2] = (H[1]*H[5] - H[2]*H[4]) * invdet;
+    Hinv[3] = c1 * invdet;
+    Hinv[4] = (H[0]*H[8] - H[2]*H[6]) * invdet;
+    Hinv[5] = (H[2]*H[3] - H[0]*H[5]) * invdet;
+    Hinv[6] = c2 * invdet;
+    Hinv[7] = (H[1]*H[6] - H[0]*H[7]) * invdet;
+    Hinv[8] = (H[0]*H[4] - H[1]*H[3]) * invdet;
+
+    return 0;
+}
+
 // assuming that the projection matrix is:
 // [ fx 0  cx 0 ]
 // [  0 fy cy 0 ]
@@ -53,6 +53,56 @@ static inline void homography_project(const matd_t *H, double x, double y, doubl
     *oy = yy / zz;
 }
 
+// Fixed-size homographies: a row-major double[9], which (unlike a
+// matd_t) needs no heap allocation, for the per-quad work of the
+// detector.
+
+// Compute the homography H that takes the corners of the tag square,
+// (-1,-1), (1,-1), (1,1) and (-1,1), to p[0] .. p[3]. Four exact
+// correspondences determine H, so it is computed in closed form
+// rather than by a least-squares fit. Returns 0, or -1 (leaving H
+// unchanged) if p is degenerate.
+int homography33_compute_quad(double H[9], const float p[4][2]);
+
+// Hinv = inverse(H), via the adjugate. Returns 0, or -1 (leaving Hinv
+// unchanged) if H is singular.
+int homography33_inverse(double Hinv[9], const double H[9]);
+
+static inline void homography33_project(const double H[9], double x, double y, double *ox, double *oy)
+{
+    double xx = H[0]*x + H[1]*y + H[2];
+    double yy = H[3]*x + H[4]*y + H[5];
+    double zz = H[6]*x + H[7]*y + H[8];
+
+    *ox = xx / zz;
+    *oy = yy / zz;
+}
+
+// Project the n points (x0 + i*dx, y0 + i*dy), i = 0 .. n-1, into ox
+// and oy. Along a line, the homogeneous coordinates of the projected
+// points are affine in i, so each point costs a few multiply-adds and
+// one reciprocal (rather than a 3x3 product and two divisions), and
+// the loop vectorizes across points.
+static inline void homography33_project_line(const double H[9], double x0, double y0,
+                                             double dx, double dy, int n,
+                                             double *ox, double *oy)
+{
+    double xx0 = H[0]*x0 + H[1]*y0 + H[2];
+    double yy0 = H[3]*x0 + H[4]*y0 + H[5];
+    double zz0 = H[6]*x0 + H[7]*y0 + H[8];
+
+    double dxx = H[0]*dx + H[1]*dy;
+    double dyy = H[3]*dx + H[4]*dy;
+    double dzz = H[6]*dx + H[7]*dy;
+
+    for (int i = 0; i < n; i++) {
+        double r = 1.0 / (zz0 + i*dzz);
+
+        ox[i] = (xx0 + i*dxx) * r;
+        oy[i] = (yy0 + i*dyy) * r;
+    }
+}
+
 // assuming that the projection matrix is:
 // [ fx 0  cx 0 ]
 // [  0 fy cy 0 ]
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_u1.h"
+
+unsigned int image_u1_default_stride(unsigned int width)
+{
+    return (width + 63) / 64;
+}
+
+image_u1_t *image_u1_create(unsigned int width, unsigned int height)
+{
+    int stride = image_u1_default_stride(width);
+
+    uint64_t *buf = image_u8_alloc_buf((size_t) height*stride*sizeof(uint64_t));
+
+    // const initializer
+    image_u1_t tmp = { .width = width, .height = height, .stride = stride, .buf = buf };
+
+    image_u1_t *im = calloc(1, sizeof(image_u1_t));
+    memcpy(im, &tmp, sizeof(image_u1_t));
+    return im;
+}
+
+void image_u1_destroy(image_u1_t *im)
+{
+    if (!im)
+        return;
+
+    free(im->buf);
+    free(im);
+}
+
+void image_u1_clear(image_u1_t *im)
+{
+    memset(im->buf, 0, (size_t) im->height*im->stride*sizeof(uint64_t));
+}
+
+void image_u1_from_u8(image_u1_t *im, const image_u8_t *im8)
+{
+    for (int y = 0; y < im->height; y++) {
+        const uint8_t *src = &im8->buf[y*im8->stride];
+        uint64_t *dst = image_u1_row(im, y);
+
+        for (int i = 0; i < im->stride; i++) {
+            int n = im->width - 64*i;
+            if (n > 64)
+                n = 64;
+
+            uint64_t word = 0;
+            for (int b = 0; b < n; b++)
+                word |= ((uint64_t) (src[64*i + b] != 0)) << b;
+
+            dst[i] = word;
+        }
+    }
+}
+
+void image_u1_to_u8(const image_u1_t *im, image_u8_t *im8, uint8_t value)
+{
+    for (int y = 0; y < im->height; y++) {
+        const uint64_t *src = image_u1_row(im, y);
+        uint8_t *dst = &im8->buf[y*im8->stride];
+
+        for (int x = 0; x < im->width; x++)
+            dst[x] = ((src[x/64] >> (x & 63)) & 1) ? value : 0;
+    }
+}
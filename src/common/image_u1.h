@@ -0,0 +1,75 @@
+#ifndef _IMAGE_U1_H
+#define _IMAGE_U1_H
+
+#include <stdint.h>
+
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A binary image, packed 64 pixels to a word: pixel x of row y is bit
+// (x % 64) of buf[y*stride + x/64]. The bits past the width of each
+// row are always zero, so that rows can be scanned a word at a time.
+// (buf is aligned to a cache line, see IMAGE_U8_ALIGNMENT, but the
+// rows are not padded to one: they are only read a word at a time.)
+typedef struct image_u1 image_u1_t;
+struct image_u1
+{
+    const int width, height;
+    const int stride; // in words
+
+    uint64_t *const buf; // const pointer, not buf
+};
+
+// the stride (in words) of an image of this width.
+unsigned int image_u1_default_stride(unsigned int width);
+
+image_u1_t *image_u1_create(unsigned int width, unsigned int height);
+void image_u1_destroy(image_u1_t *im);
+void image_u1_clear(image_u1_t *im);
+
+// Pack im8, setting the pixels that are non-zero. im and im8 must have
+// the same size.
+void image_u1_from_u8(image_u1_t *im, const image_u8_t *im8);
+
+// Unpack im into im8, writing value for the set pixels and 0 for the
+// others.
+void image_u1_to_u8(const image_u1_t *im, image_u8_t *im8, uint8_t value);
+
+static inline uint64_t *image_u1_row(const image_u1_t *im, int y)
+{
+    return &im->buf[y*im->stride];
+}
+
+static inline int image_u1_get(const image_u1_t *im, int x, int y)
+{
+    return (im->buf[y*im->stride + x/64] >> (x & 63)) & 1;
+}
+
+static inline void image_u1_set(image_u1_t *im, int x, int y, int v)
+{
+    uint64_t bit = ((uint64_t) 1) << (x & 63);
+    uint64_t *word = &im->buf[y*im->stride + x/64];
+
+    *word = v ? (*word | bit) : (*word & ~bit);
+}
+
+// the mask of the pixels of word i of a row that lie within the image.
+static inline uint64_t image_u1_word_mask(const image_u1_t *im, int i)
+{
+    int n = im->width - 64*i;
+
+    if (n >= 64)
+        return ~((uint64_t) 0);
+    if (n <= 0)
+        return 0;
+    return (((uint64_t) 1) << n) - 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
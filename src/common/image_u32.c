@@ -36,6 +36,7 @@ either expressed or implied, of the FreeBSD Project.
 #include <math.h>
 
 #include "pnm.h"
+#include "image_u8.h"
 #include "image_u32.h"
 
 // least common multiple of 64 (sandy bridge cache line) and 64 (stride
@@ -59,7 +60,9 @@ image_u32_t *image_u32_create_alignment(int width, int height, int alignment)
     if ((im->stride % alignment) != 0)
         im->stride += alignment - (im->stride % alignment);
 
-    im->buf = (uint32_t*) calloc(im->height*im->stride, sizeof(uint32_t));
+    // (aligned to a cache line, as image_u8_create's pixels are; the
+    // default stride keeps every row so.)
+    im->buf = (uint32_t*) image_u8_alloc_buf((size_t) im->height*im->stride*sizeof(uint32_t));
 
     return im;
 }
@@ -34,13 +34,25 @@ either expressed or implied, of the FreeBSD Project.
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "image_u8.h"
 #include "pnm.h"
 
-// least common multiple of 64 (sandy bridge cache line) and 24 (stride
-// needed for RGB in 8-wide vector processing)
-#define DEFAULT_ALIGNMENT 96 // NOTE: 96 is not LCM of 64 and 24. That would be 192
+#include "simd.h"
+
+#if defined(SIMD_X86)
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// a cache line (see IMAGE_U8_ALIGNMENT).
+#define DEFAULT_ALIGNMENT IMAGE_U8_ALIGNMENT
 
 static inline double sq(double v)
 {
@@ -56,11 +68,33 @@ static int iclamp(int v, int min, int max)
     return v;
 }
 
+void *image_u8_alloc_buf(size_t sz)
+{
+    void *buf = NULL;
+
+    // (posix_memalign fails for sz 0 on some systems.)
+    if (posix_memalign(&buf, IMAGE_U8_ALIGNMENT, sz > 0 ? sz : 1) != 0)
+        return NULL;
+
+    memset(buf, 0, sz);
+    return buf;
+}
+
 image_u8_t *image_u8_create(unsigned int width, unsigned int height)
 {
     return image_u8_create_alignment(width, height, DEFAULT_ALIGNMENT);
 }
 
+unsigned int image_u8_default_stride(unsigned int width)
+{
+    unsigned int stride = width;
+
+    if ((stride % DEFAULT_ALIGNMENT) != 0)
+        stride += DEFAULT_ALIGNMENT - (stride % DEFAULT_ALIGNMENT);
+
+    return stride;
+}
+
 image_u8_t *image_u8_create_alignment(unsigned int width, unsigned int height, unsigned int alignment)
 {
     int stride = width;
@@ -68,7 +102,7 @@ image_u8_t *image_u8_create_alignment(unsigned int width, unsigned int height, u
     if ((stride % alignment) != 0)
         stride += alignment - (stride % alignment);
 
-    uint8_t *buf = calloc(height*stride, sizeof(uint8_t));
+    uint8_t *buf = image_u8_alloc_buf((size_t) height*stride);
 
     // const initializer
     image_u8_t tmp = { .width = width, .height = height, .stride = stride, .buf = buf };
@@ -80,17 +114,32 @@ image_u8_t *image_u8_create_alignment(unsigned int width, unsigned int height, u
 
 image_u8_t *image_u8_copy(const image_u8_t *in)
 {
-    uint8_t *buf = malloc(in->height*in->stride*sizeof(uint8_t));
-    memcpy(buf, in->buf, in->height*in->stride*sizeof(uint8_t));
+    // row by row: in may be a view into a bigger image (see
+    // image_u8_view), whose last row's padding isn't ours to read. (The
+    // copy has the default stride, whatever in's.)
+    int stride = image_u8_default_stride(in->width);
+    uint8_t *buf = image_u8_alloc_buf((size_t) in->height*stride);
+    for (int y = 0; y < in->height; y++)
+        memcpy(&buf[y*stride], &in->buf[y*in->stride], in->width);
 
     // const initializer
-    image_u8_t tmp = { .width = in->width, .height = in->height, .stride = in->stride, .buf = buf };
+    image_u8_t tmp = { .width = in->width, .height = in->height, .stride = stride, .buf = buf };
 
     image_u8_t *copy = calloc(1, sizeof(image_u8_t));
     memcpy(copy, &tmp, sizeof(image_u8_t));
     return copy;
 }
 
+image_u8_t image_u8_view(const image_u8_t *im, int x, int y, int width, int height)
+{
+    assert(x >= 0 && y >= 0 && width >= 0 && height >= 0);
+    assert(x + width <= im->width && y + height <= im->height);
+
+    image_u8_t view = { .width = width, .height = height, .stride = im->stride,
+                        .buf = &im->buf[y*im->stride + x] };
+    return view;
+}
+
 void image_u8_destroy(image_u8_t *im)
 {
     if (!im)
@@ -149,6 +198,97 @@ image_u8_t *image_u8_create_from_pnm_alignment(const char *path, int alignment)
     return im;
 }
 
+// An image of a mapped file: the mapping follows the image, so that
+// image_u8_unmap can find it.
+struct image_u8_map
+{
+    image_u8_t im;
+    void *map;
+    size_t maplen;
+};
+
+// The next whitespace-separated number of a pnm header (skipping
+// comments), from *pos, or -1.
+static int pnm_header_int(const uint8_t *p, size_t len, size_t *pos)
+{
+    size_t i = *pos;
+    for (;;) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n'))
+            i++;
+        if (i < len && p[i] == '#') {
+            while (i < len && p[i] != '\n')
+                i++;
+            continue;
+        }
+        break;
+    }
+
+    if (i >= len || p[i] < '0' || p[i] > '9')
+        return -1;
+
+    int v = 0;
+    while (i < len && p[i] >= '0' && p[i] <= '9' && v < (1 << 24))
+        v = v*10 + p[i++] - '0';
+
+    *pos = i;
+    return v;
+}
+
+image_u8_t *image_u8_map_pnm(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t maplen = st.st_size;
+    uint8_t *map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    // P5, the width, height and maximum value, and then (after a single
+    // whitespace character) the pixels.
+    size_t pos = 2;
+    int width = -1, height = -1, maxval = -1;
+    if (map[0] == 'P' && map[1] == '5') {
+        width = pnm_header_int(map, maplen, &pos);
+        height = width > 0 ? pnm_header_int(map, maplen, &pos) : -1;
+        maxval = height > 0 ? pnm_header_int(map, maplen, &pos) : -1;
+    }
+
+    pos++;
+    if (maxval <= 0 || maxval > 255 || pos > maplen || maplen - pos < (size_t) width * height) {
+        munmap(map, maplen);
+        return NULL;
+    }
+
+    madvise(map, maplen, MADV_SEQUENTIAL);
+
+    struct image_u8_map *m = calloc(1, sizeof(struct image_u8_map));
+    image_u8_t tmp = { .width = width, .height = height, .stride = width, .buf = &map[pos] };
+    memcpy(&m->im, &tmp, sizeof(image_u8_t));
+    m->map = map;
+    m->maplen = maplen;
+
+    return &m->im;
+}
+
+void image_u8_unmap(image_u8_t *im)
+{
+    if (!im)
+        return;
+
+    struct image_u8_map *m = (struct image_u8_map*) im;
+    munmap(m->map, m->maplen);
+    free(m);
+}
+
 image_u8_t *image_u8_create_from_f32(image_f32_t *fim)
 {
     image_u8_t *im = image_u8_create(fim->width, fim->height);
@@ -252,6 +392,11 @@ void image_u8_draw_line(image_u8_t *im, float x0, float y0, float x1, float y1,
     }
 }
 
+void image_u8_clear(image_u8_t *im)
+{
+    memset(im->buf, 0, im->height*im->stride*sizeof(uint8_t));
+}
+
 void image_u8_darken(image_u8_t *im)
 {
     for (int y = 0; y < im->height; y++) {
@@ -261,31 +406,7 @@ void image_u8_darken(image_u8_t *im)
     }
 }
 
-static void convolve(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz)
-{
-    assert((ksz&1)==1);
-
-    for (int i = 0; i < ksz/2 && i < sz; i++)
-        y[i] = x[i];
-
-    for (int i = 0; i < sz - ksz; i++) {
-        uint32_t acc = 0;
-
-        for (int j = 0; j < ksz; j++)
-            acc += k[j]*x[i+j];
-
-        y[ksz/2 + i] = acc >> 8;
-    }
-
-    // fixed a bug where we could start reading/writing before line -MZ
-    int istart = sz - ksz + ksz/2;
-    if (istart < 0) { istart = 0; }
-
-    for (int i = istart; i < sz; i++)
-      y[i] = x[i]; // this was invalid when i = sz - ksz + ksz/2 for small sz
-}
-
-void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+void image_u8_gaussian_kernel(double sigma, int ksz, uint8_t *k)
 {
     assert((ksz & 1) == 1); // ksz must be odd.
 
@@ -308,7 +429,8 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
     for (int i = 0; i < ksz; i++)
         dk[i] /= acc;
 
-    uint8_t k[ksz];
+    // NB: the taps sum to at most 255, so a convolution of 8 bit
+    // pixels fits in 16 bits.
     for (int i = 0; i < ksz; i++)
         k[i] = dk[i]*255;
 
@@ -316,29 +438,106 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
         for (int i = 0; i < ksz; i++)
             printf("%d %15f %5d\n", i, dk[i], k[i]);
     }
+}
 
-    for (int y = 0; y < im->height; y++) {
+////////////////////////////////////////////////////////////////////////
+// The row kernels of the convolutions, decimations, SADs and color
+// conversions below, one per instruction set (see simd.h), in
+// image_u8_kernels.h.
 
-        uint8_t x[im->stride];
-        memcpy(x, &im->buf[y*im->stride], im->stride);
+struct image_u8_kernels
+{
+    void (*convolve_row)(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz);
+    void (*convolve_col)(const uint8_t **src, const uint8_t *src1, const uint8_t *orig,
+                         uint8_t *out, int w, const uint8_t *k, int ksz);
+    void (*decimate2_row)(const uint8_t *src, int s, uint8_t *dst, int swidth);
+    void (*decimate3_row)(const uint8_t *src, int s, uint8_t *dst, int swidth);
+    void (*decimate4_row)(const uint8_t *src, int s, uint8_t *dst, int swidth);
+    int (*sad8_row)(const uint8_t *pa, const uint8_t *pb, int w, uint32_t *row);
+    void (*color_gray_row)(const uint8_t *src, int bpp, const uint8_t *wts, uint8_t *dst, int w);
+    void (*sample_bilinear)(const uint8_t *buf, int stride, int width, int height, int aligned,
+                            const float *xs, const float *ys, int n, float *vals);
+};
+
+#if defined(SIMD_X86)
+// pshufb masks: decimate3_shuffle[k][v] gathers input byte 3j+k
+// (j = 0..15) from the v'th of three consecutive 16 byte vectors.
+static const int8_t decimate3_shuffle[3][3][16] = {
+    { { 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 } },
+    { { 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 } },
+    { { 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+      { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 } },
+};
+#endif
 
-        convolve(x, &im->buf[y*im->stride], im->width, k, ksz);
-    }
+#define SIMD_KERNELS "image_u8_kernels.h"
+#include "simd_kernels.h"
+
+static const struct image_u8_kernels *const image_u8_kernels[SIMD_NISAS] = {
+    SIMD_KERNEL_TABLES(image_u8_kernels)
+};
+
+static inline const struct image_u8_kernels *kernels(void)
+{
+    return image_u8_kernels[simd_isa()];
+}
+
+void image_u8_convolve_rows(const image_u8_t *im, image_u8_t *tmp, const uint8_t *k, int ksz,
+                            int y0, int y1)
+{
+    assert(tmp->width == im->width && tmp->height == im->height);
 
-    for (int x = 0; x < im->width; x++) {
-        uint8_t xb[im->height];
-        uint8_t yb[im->height];
+    for (int y = y0; y < y1; y++)
+        kernels()->convolve_row(&im->buf[y*im->stride], &tmp->buf[y*tmp->stride], im->width, k, ksz);
+}
 
-        for (int y = 0; y < im->height; y++)
-            xb[y] = im->buf[y*im->stride + x];
+void image_u8_convolve_cols(const image_u8_t *tmp, image_u8_t *im, const uint8_t *k, int ksz,
+                            int sharpen, int y0, int y1)
+{
+    assert(tmp->width == im->width && tmp->height == im->height);
+    assert(tmp->buf != im->buf);
+
+    int h = im->height;
+
+    // as in convolve_row, rows where the whole kernel doesn't fit
+    // (and the last row where it does) are copied.
+    int yfull0 = ksz/2, yfull1 = ksz/2 + h - ksz;
+
+    for (int y = y0; y < y1; y++) {
+        uint8_t *out = &im->buf[y*im->stride];
+        const uint8_t *orig = sharpen ? out : NULL;
+
+        if (y < yfull0 || y >= yfull1) {
+            kernels()->convolve_col(NULL, &tmp->buf[y*tmp->stride], orig, out, im->width, k, ksz);
+            continue;
+        }
 
-        convolve(xb, yb, im->height, k, ksz);
+        const uint8_t *src[ksz];
+        for (int j = 0; j < ksz; j++)
+            src[j] = &tmp->buf[(y - ksz/2 + j)*tmp->stride];
 
-        for (int y = 0; y < im->height; y++)
-            im->buf[y*im->stride + x] = yb[y];
+        kernels()->convolve_col(src, NULL, orig, out, im->width, k, ksz);
     }
 }
 
+void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+{
+    uint8_t k[ksz];
+    image_u8_gaussian_kernel(sigma, ksz, k);
+
+    image_u8_t *tmp = image_u8_create(im->width, im->height);
+
+    image_u8_convolve_rows(im, tmp, k, ksz, 0, im->height);
+    image_u8_convolve_cols(tmp, im, k, ksz, 0, 0, im->height);
+
+    image_u8_destroy(tmp);
+}
+
 image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
 {
     int iwidth = in->width, iheight = in->height;
@@ -390,8 +589,6 @@ image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
 }
 
 #ifdef __ARM_NEON__
-#include <arm_neon.h>
-
 void neon_decimate2(uint8_t * __restrict dest, int destwidth, int destheight, int deststride,
                uint8_t * __restrict src, int srcwidth, int srcheight, int srcstride)
 {
@@ -476,17 +673,104 @@ void neon_decimate4(uint8_t * __restrict dest, int destwidth, int destheight, in
 
 #endif
 
-image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
+int image_u8_sample_points(const image_u8_t *im, const double *xs, const double *ys, int n,
+                           int bilinear, float *vals)
+{
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        // don't round
+        int ix = xs[i];
+        int iy = ys[i];
+
+        if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height) {
+            vals[i] = -1;
+            continue;
+        }
+
+        count++;
+
+        if (!bilinear) {
+            vals[i] = im->buf[iy*im->stride + ix];
+            continue;
+        }
+
+        // pixel centers are at half-integer coordinates.
+        double x = xs[i] - 0.5, y = ys[i] - 0.5;
+        int x0 = floor(x), y0 = floor(y);
+        double ax = x - x0, ay = y - y0;
+
+        // (points in the outer half of the edge pixels, and those
+        // just left of or above the image, which truncate to pixel 0,
+        // are clamped to the edge.)
+        int xb = x0 + 1, yb = y0 + 1;
+        int xa = x0 < 0 ? 0 : x0, ya = y0 < 0 ? 0 : y0;
+        xb = xb < 0 ? 0 : xb >= im->width ? im->width - 1 : xb;
+        yb = yb < 0 ? 0 : yb >= im->height ? im->height - 1 : yb;
+
+        const uint8_t *ra = &im->buf[ya*im->stride];
+        const uint8_t *rb = &im->buf[yb*im->stride];
+
+        vals[i] = (1-ay)*((1-ax)*ra[xa] + ax*ra[xb]) + ay*((1-ax)*rb[xa] + ax*rb[xb]);
+    }
+
+    return count;
+}
+
+void image_u8_sample_points_f32(const image_u8_t *im, const float *xs, const float *ys, int n, float *vals)
 {
-    int width = im->width, height = im->height;
+    kernels()->sample_bilinear(im->buf, im->stride, im->width, im->height, image_u8_aligned(im),
+                               xs, ys, n, vals);
+}
 
+void image_u8_decimate_dims(const image_u8_t *im, float ffactor, int *swidth, int *sheight)
+{
     if (ffactor == 1.5) {
-        int swidth = width / 3 * 2, sheight = height / 3 * 2;
+        *swidth = im->width / 3 * 2;
+        *sheight = im->height / 3 * 2;
+    } else {
+        int factor = (int) ffactor;
+        *swidth = im->width / factor;
+        *sheight = im->height / factor;
+    }
+}
+
+image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
+{
+    int swidth, sheight;
+    image_u8_decimate_dims(im, ffactor, &swidth, &sheight);
+
+    image_u8_t *decim = image_u8_create(swidth, sheight);
+    image_u8_decimate_into(im, ffactor, decim);
+
+    return decim;
+}
+
 
-        image_u8_t *decim = image_u8_create(swidth, sheight);
+////////////////////////////////////////////////////////////////////////
+// Row kernels for the integer decimation factors. Each computes one
+// output row of swidth pixels from 'factor' input rows starting at src,
+// with exactly the same (truncating) arithmetic as the scalar loop at
+// its end.
 
-        int y = 0, sy = 0;
-        while (sy < sheight) {
+void image_u8_decimate_into(const image_u8_t *im, float ffactor, image_u8_t *decim)
+{
+    image_u8_decimate_rows(im, ffactor, decim, 0, decim->height);
+}
+
+void image_u8_decimate_rows(const image_u8_t *im, float ffactor, image_u8_t *decim, int sy0, int sy1)
+{
+    int swidth, sheight;
+    image_u8_decimate_dims(im, ffactor, &swidth, &sheight);
+    assert(decim->width == swidth && decim->height == sheight);
+    assert(0 <= sy0 && sy0 <= sy1 && sy1 <= sheight);
+
+    if (ffactor == 1.5) {
+        // output rows are produced in pairs.
+        assert((sy0 & 1) == 0 && (sy1 & 1) == 0);
+
+        int y = sy0 / 2 * 3, sy = sy0;
+        while (sy < sy1) {
             int x = 0, sx = 0;
             while (sx < swidth) {
 
@@ -523,95 +807,132 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
             sy += 2;
         }
 
-        return decim;
+        return;
     }
 
     int factor = (int) ffactor;
 
-    int swidth = width / factor, sheight = height / factor;
-
-    image_u8_t *decim = image_u8_create(swidth, sheight);
-
 #ifdef __ARM_NEON__
-    if (factor == 2) {
-        neon_decimate2(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
-    } else if (factor == 3) {
-        neon_decimate3(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
-    } else if (factor == 4) {
-        neon_decimate4(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
+    uint8_t *neon_dest = decim->buf + sy0*decim->stride;
+    uint8_t *neon_src = im->buf + sy0*factor*im->stride;
+
+    // (these average differently from the row kernels, so only when
+    // those are the NEON ones.)
+    if (simd_isa() == SIMD_NEON && factor == 2) {
+        neon_decimate2(neon_dest, decim->width, sy1 - sy0, decim->stride,
+                       neon_src, im->width, im->height, im->stride);
+        return;
+    } else if (simd_isa() == SIMD_NEON && factor == 3) {
+        neon_decimate3(neon_dest, decim->width, sy1 - sy0, decim->stride,
+                       neon_src, im->width, im->height, im->stride);
+        return;
+    } else if (simd_isa() == SIMD_NEON && factor == 4) {
+        neon_decimate4(neon_dest, decim->width, sy1 - sy0, decim->stride,
+                       neon_src, im->width, im->height, im->stride);
+        return;
     }
 #endif
 
-    if (factor == 2) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*2)*im->stride;
-
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] +
-                    im->buf[idx+im->stride] + im->buf[idx+im->stride + 1];
-                decim->buf[sidx] = (v>>2);
-                idx+=2;
-                sidx++;
-            }
-        }
-    } else if (factor == 3) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*3)*im->stride;
-
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] +
-                    im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
-                    im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1];
-                // + im->buf[idx+2*im->stride + 1];
-                // deliberately omit lower right corner so there are exactly 8 samples...
-                decim->buf[sidx] = (v>>3);
-                idx+=3;
-                sidx++;
-            }
-        }
-    } else if (factor == 4) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*4)*im->stride;
-
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] + im->buf[idx+3] +
-                im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
-                im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1] + im->buf[idx+2*im->stride + 2] + im->buf[idx+2*im->stride + 3];
-
-                decim->buf[sidx] = (v>>4);
-                idx+=4;
-                sidx++;
-            }
-        }
-    } else {
-        // XXX this isn't a very good decimation code.
-        uint32_t row[swidth];
-
-        for (int y = 0; y < height; y+= factor) {
+    for (int sy = sy0; sy < sy1; sy++) {
+        const uint8_t *src = &im->buf[sy*factor*im->stride];
+        uint8_t *dst = &decim->buf[sy*decim->stride];
+
+        if (factor == 2) {
+            kernels()->decimate2_row(src, im->stride, dst, swidth);
+        } else if (factor == 3) {
+            kernels()->decimate3_row(src, im->stride, dst, swidth);
+        } else if (factor == 4) {
+            kernels()->decimate4_row(src, im->stride, dst, swidth);
+        } else {
+            // XXX this isn't a very good decimation code. (Pixels
+            // beyond the last complete factor x factor block are
+            // ignored.)
+            uint32_t row[swidth];
             memset(row, 0, sizeof(row));
 
             for (int dy = 0; dy < factor; dy++) {
-                for (int x = 0; x < width; x++) {
-                    row[x/factor] += im->buf[(y+dy)*im->stride + x];
+                for (int x = 0; x < swidth*factor; x++) {
+                    row[x/factor] += src[dy*im->stride + x];
                 }
             }
 
             for (int x = 0; x < swidth; x++)
-                decim->buf[(y/factor)*decim->stride + x] = row[x] / sq(factor);
+                dst[x] = row[x] / sq(factor);
+        }
+    }
+}
+
+void image_u8_color_gray_rows(const uint8_t *buf, int stride, image_u8_color_t color,
+                              image_u8_t *gray, int y0, int y1)
+{
+    // the Rec. 601 weights of R, G and B, in 8 bits, by byte.
+    static const uint8_t weights[2][3] = { { 77, 150, 29 }, { 29, 150, 77 } };
+
+    int bpp = (color == IMAGE_U8_COLOR_RGBA || color == IMAGE_U8_COLOR_BGRA) ? 4 : 3;
+    const uint8_t *wts = weights[color == IMAGE_U8_COLOR_BGR || color == IMAGE_U8_COLOR_BGRA];
+
+    for (int y = y0; y < y1; y++)
+        kernels()->color_gray_row(&buf[y*stride], bpp, wts, &gray->buf[y*gray->stride], gray->width);
+}
+
+image_u8_t *image_u8_create_from_rgb3(int width, int height, uint8_t *rgb, int stride)
+{
+    image_u8_t *im = image_u8_create(width, height);
+    image_u8_color_gray_rows(rgb, stride, IMAGE_U8_COLOR_RGB, im, 0, height);
+    return im;
+}
 
+void image_u8_bayer_luma_rows(const image_u8_t *im, image_u8_t *luma, int y0, int y1)
+{
+    int w = im->width, h = im->height, s = im->stride;
+    assert(luma->width == w && luma->height == h);
+    assert(w >= 2 && h >= 2);
+    assert(0 <= y0 && y0 <= y1 && y1 <= h);
+
+    for (int y = y0; y < y1; y++) {
+        // reflected about the border rows, rather than replicated, so
+        // that the neighbors are of the right elements.
+        const uint8_t *r0 = &im->buf[(y > 0 ? y - 1 : 1) * s];
+        const uint8_t *r1 = &im->buf[y * s];
+        const uint8_t *r2 = &im->buf[(y + 1 < h ? y + 1 : h - 2) * s];
+        uint8_t *dst = &luma->buf[y * luma->stride];
+
+        // the vertical pass of columns x-1, x and x+1.
+        int a = r0[1] + 2*r1[1] + r2[1];
+        int b = r0[0] + 2*r1[0] + r2[0];
+
+        for (int x = 0; x < w; x++) {
+            int xc = x + 1 < w ? x + 1 : w - 2;
+            int c = r0[xc] + 2*r1[xc] + r2[xc];
+
+            dst[x] = (a + 2*b + c + 8) >> 4;
+            a = b;
+            b = c;
         }
     }
+}
 
-    return decim;
+void image_u8_sad_tiles(const image_u8_t *a, const image_u8_t *b, int ts, uint32_t *sums)
+{
+    assert(a->width == b->width && a->height == b->height);
+    assert(ts > 0);
+
+    int w = a->width, h = a->height;
+    int ntx = (w + ts - 1) / ts;
+
+    memset(sums, 0, (size_t) ntx * ((h + ts - 1) / ts) * sizeof(uint32_t));
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t *pa = &a->buf[y*a->stride], *pb = &b->buf[y*b->stride];
+        uint32_t *row = &sums[(y / ts) * ntx];
+        int x = 0;
+
+        if (ts == 8)
+            x = kernels()->sad8_row(pa, pb, w, row);
+
+        for (; x < w; x++)
+            row[x/ts] += abs(pa[x] - pb[x]);
+    }
 }
 
 void image_u8_fill_line_max(image_u8_t *im, const image_u8_lut_t *lut, const float *xy0, const float *xy1)
@@ -32,6 +32,7 @@ either expressed or implied, of the FreeBSD Project.
 #ifndef _IMAGE_U8_H
 #define _IMAGE_U8_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -62,16 +63,60 @@ struct image_u8_lut
 
 #include "image_f32.h"
 
-// Create or load an image. returns NULL on failure. Uses default stride alignment.
+// The images created here (and the detector's own, see
+// apriltag_scratch.h) have rows aligned to a cache line: buf and
+// stride are multiples of IMAGE_U8_ALIGNMENT. Every row can then be
+// read (and written) in whole aligned blocks of IMAGE_U8_ALIGNMENT
+// bytes, up to the first multiple past its width, without bounds
+// checks. Views, images of memory allocated elsewhere, and those
+// created with a smaller alignment, may not be (see image_u8_aligned).
+#define IMAGE_U8_ALIGNMENT 64
+
+static inline int image_u8_aligned(const image_u8_t *im)
+{
+    return ((uintptr_t) im->buf % IMAGE_U8_ALIGNMENT) == 0 && (im->stride % IMAGE_U8_ALIGNMENT) == 0;
+}
+
+// Allocate sz zeroed bytes, aligned to IMAGE_U8_ALIGNMENT (to be
+// freed with free), for the pixels of an image.
+void *image_u8_alloc_buf(size_t sz);
+
+// Create or load an image. returns NULL on failure. Uses default stride
+// alignment (IMAGE_U8_ALIGNMENT). The stride of the _alignment variants
+// is the smallest multiple of alignment no less than the width (the
+// width itself, for alignment 1). Their buf is aligned all the same,
+// but their rows are only if alignment is a multiple of
+// IMAGE_U8_ALIGNMENT.
 image_u8_t *image_u8_create(unsigned int width, unsigned int height);
 image_u8_t *image_u8_create_alignment(unsigned int width, unsigned int height, unsigned int alignment);
+
+// the stride that image_u8_create uses for an image of this width.
+unsigned int image_u8_default_stride(unsigned int width);
+// the gray of the 8 bit RGB image of width x height pixels whose rows
+// are stride bytes apart starting at rgb (see image_u8_color_gray_rows).
 image_u8_t *image_u8_create_from_rgb3(int width, int height, uint8_t *rgb, int stride);
 image_u8_t *image_u8_create_from_f32(image_f32_t *fim);
 
 image_u8_t *image_u8_create_from_pnm(const char *path);
 image_u8_t *image_u8_create_from_pnm_alignment(const char *path, int alignment);
 
+// Map a binary PGM (P5, 8 bit) file into memory, as an image of the
+// file's own pixels, without copying them (its stride is its width,
+// and it is not aligned, see image_u8_aligned). The mapping is
+// private: writing the pixels (as detecting may) leaves the file as it
+// was. Returns NULL if the file can't be mapped or is of another
+// format, which image_u8_create_from_pnm may still load. Destroy with
+// image_u8_unmap (not image_u8_destroy).
+image_u8_t *image_u8_map_pnm(const char *path);
+void image_u8_unmap(image_u8_t *im);
+
 image_u8_t *image_u8_copy(const image_u8_t *in);
+
+// A view of the width x height region of im at (x, y), sharing im's
+// pixels (and stride): nothing is copied, and the view is not to be
+// destroyed. Any image, including a view, may have a stride larger
+// than its width.
+image_u8_t image_u8_view(const image_u8_t *im, int x, int y, int width, int height);
 void image_u8_draw_line(image_u8_t *im, float x0, float y0, float x1, float y1, int v, int width);
 void image_u8_draw_circle(image_u8_t *im, float x0, float y0, float r, int v);
 void image_u8_draw_annulus(image_u8_t *im, float x0, float y0, float r0, float r1, int v);
@@ -80,9 +125,73 @@ void image_u8_clear(image_u8_t *im);
 void image_u8_darken(image_u8_t *im);
 void image_u8_gaussian_blur(image_u8_t *im, double sigma, int k);
 
+// The pieces of image_u8_gaussian_blur, so that the blur can be split
+// between threads and its buffers reused. k must hold ksz taps.
+// convolve_rows writes the horizontal pass of rows [y0, y1) of im into
+// tmp. Once every row of tmp is done, convolve_cols writes the
+// vertical pass of rows [y0, y1) back into im. With sharpen set, it
+// instead writes the unsharp mask 2*im - blur (clamped to [0, 255]).
+void image_u8_gaussian_kernel(double sigma, int ksz, uint8_t *k);
+void image_u8_convolve_rows(const image_u8_t *im, image_u8_t *tmp, const uint8_t *k, int ksz,
+                            int y0, int y1);
+void image_u8_convolve_cols(const image_u8_t *tmp, image_u8_t *im, const uint8_t *k, int ksz,
+                            int sharpen, int y0, int y1);
+
+// Sample im at the n points (xs[i], ys[i]), writing the values to
+// vals. Without bilinear, a point reads the pixel that contains it
+// (truncating its coordinates); with bilinear, it interpolates between
+// the four nearest pixel centers. Points that fall outside the image
+// are written as -1. Returns the number of points inside the image.
+int image_u8_sample_points(const image_u8_t *im, const double *xs, const double *ys, int n,
+                           int bilinear, float *vals);
+
+// image_u8_sample_points, bilinear, of points in float (and computed
+// in float, a vector of points at a time).
+void image_u8_sample_points_f32(const image_u8_t *im, const float *xs, const float *ys, int n, float *vals);
+
 // 1.5, 2, 3, 4, ... supported
 image_u8_t *image_u8_decimate(image_u8_t *im, float factor);
 
+// the size of the image that image_u8_decimate would produce.
+void image_u8_decimate_dims(const image_u8_t *im, float factor, int *width, int *height);
+
+// same as image_u8_decimate, but writes into an existing image, which
+// must have the dimensions given by image_u8_decimate_dims.
+void image_u8_decimate_into(const image_u8_t *im, float factor, image_u8_t *decim);
+
+// decimate only output rows [sy0, sy1) of decim, so that the work can
+// be split between threads. For factor 1.5, sy0 and sy1 must be even.
+void image_u8_decimate_rows(const image_u8_t *im, float factor, image_u8_t *decim, int sy0, int sy1);
+
+// The layouts of the 8 bit color pixels image_u8_color_gray_rows
+// converts (the fourth byte, alpha, is ignored).
+typedef enum {
+    IMAGE_U8_COLOR_RGB,
+    IMAGE_U8_COLOR_BGR,
+    IMAGE_U8_COLOR_RGBA,
+    IMAGE_U8_COLOR_BGRA
+} image_u8_color_t;
+
+// Write rows [y0, y1) of the gray of the color image whose rows are
+// stride bytes apart starting at buf into gray, which has its
+// dimensions: the Rec. 601 luma (77 R + 150 G + 29 B + 128) >> 8.
+void image_u8_color_gray_rows(const uint8_t *buf, int stride, image_u8_color_t color,
+                              image_u8_t *gray, int y0, int y1);
+
+// Write rows [y0, y1) of the luma of the bayer mosaic im (of any 2x2
+// pattern) into luma, which has im's dimensions: the 3x3 binomial
+// filter [1 2 1]^T [1 2 1] / 16, which weighs the elements of every
+// 2x2 block equally at each pixel (R/4 + G/2 + B/4), without moving
+// edges. The borders are reflected (so as to keep the pattern). im
+// must be at least 2x2.
+void image_u8_bayer_luma_rows(const image_u8_t *im, image_u8_t *luma, int y0, int y1);
+
+// The sums of the absolute differences between a and b (which have
+// the same dimensions) over each ts x ts tile, in sums[ty*ntx + tx],
+// where ntx is the number of tiles across (width / ts, rounded up).
+// The tiles at the right and bottom edges may be partial.
+void image_u8_sad_tiles(const image_u8_t *a, const image_u8_t *b, int ts, uint32_t *sums);
+
 void image_u8_destroy(image_u8_t *im);
 
 // Write a pnm. Returns 0 on success
@@ -0,0 +1,533 @@
+// (no include guard: the kernels of image_u8.c, compiled for each
+// instruction set by simd_kernels.h.)
+
+// Horizontal pass: y[i] = (sum_j k[j]*x[i-ksz/2+j]) >> 8 wherever the
+// whole kernel fits (and i < sz - ksz/2 - 1); elsewhere y[i] = x[i].
+// x and y may not alias.
+static void KERNEL(convolve_row)(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz)
+{
+    assert((ksz&1)==1);
+
+    for (int i = 0; i < ksz/2 && i < sz; i++)
+        y[i] = x[i];
+
+    int n = sz - ksz; // number of outputs
+    int i = 0;
+
+#if KERNEL_AVX2
+    for (; i + 16 <= n; i += 16) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < ksz; j++) {
+            __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &x[i+j]));
+            acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(v, _mm256_set1_epi16(k[j])));
+        }
+        acc = _mm256_srli_epi16(acc, 8);
+        __m128i r = _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        _mm_storeu_si128((__m128i*) &y[ksz/2 + i], r);
+    }
+#elif KERNEL_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = zero, hi = zero;
+        for (int j = 0; j < ksz; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &x[i+j]);
+            __m128i kj = _mm_set1_epi16(k[j]);
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), kj));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), kj));
+        }
+        __m128i r = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        _mm_storeu_si128((__m128i*) &y[ksz/2 + i], r);
+    }
+#elif KERNEL_NEON
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (int j = 0; j < ksz; j++)
+            acc = vmlal_u8(acc, vld1_u8(&x[i+j]), vdup_n_u8(k[j]));
+        vst1_u8(&y[ksz/2 + i], vshrn_n_u16(acc, 8));
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint32_t acc = 0;
+
+        for (int j = 0; j < ksz; j++)
+            acc += k[j]*x[i+j];
+
+        y[ksz/2 + i] = acc >> 8;
+    }
+
+    // fixed a bug where we could start reading/writing before line -MZ
+    int istart = sz - ksz + ksz/2;
+    if (istart < 0) { istart = 0; }
+
+    for (int i = istart; i < sz; i++)
+      y[i] = x[i]; // this was invalid when i = sz - ksz + ksz/2 for small sz
+}
+
+// Vertical pass for one output row y of width w: out = the
+// convolution of rows src[0..ksz-1] (or, if src1 is non-NULL, a copy of
+// src1). If orig is non-NULL, write the unsharp mask 2*orig - blur
+// instead of the blur itself. out may alias orig.
+static void KERNEL(convolve_col)(const uint8_t **src, const uint8_t *src1, const uint8_t *orig,
+                         uint8_t *out, int w, const uint8_t *k, int ksz)
+{
+    int x = 0;
+
+    if (src1) {
+        if (!orig) {
+            memcpy(out, src1, w);
+            return;
+        }
+
+        for (; x < w; x++) {
+            int v = 2*orig[x] - src1[x];
+            out[x] = v < 0 ? 0 : (v > 255 ? 255 : v);
+        }
+        return;
+    }
+
+#if KERNEL_AVX2
+    for (; x + 16 <= w; x += 16) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int j = 0; j < ksz; j++) {
+            __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &src[j][x]));
+            acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(v, _mm256_set1_epi16(k[j])));
+        }
+        acc = _mm256_srli_epi16(acc, 8);
+
+        if (orig) {
+            __m256i o = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &orig[x]));
+            acc = _mm256_sub_epi16(_mm256_add_epi16(o, o), acc);
+        }
+
+        // packus also clamps the unsharp mask to [0, 255]
+        __m128i r = _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        _mm_storeu_si128((__m128i*) &out[x], r);
+    }
+#elif KERNEL_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; x + 16 <= w; x += 16) {
+        __m128i lo = zero, hi = zero;
+        for (int j = 0; j < ksz; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &src[j][x]);
+            __m128i kj = _mm_set1_epi16(k[j]);
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), kj));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), kj));
+        }
+        lo = _mm_srli_epi16(lo, 8);
+        hi = _mm_srli_epi16(hi, 8);
+
+        if (orig) {
+            __m128i o = _mm_loadu_si128((const __m128i*) &orig[x]);
+            __m128i olo = _mm_unpacklo_epi8(o, zero), ohi = _mm_unpackhi_epi8(o, zero);
+            lo = _mm_sub_epi16(_mm_add_epi16(olo, olo), lo);
+            hi = _mm_sub_epi16(_mm_add_epi16(ohi, ohi), hi);
+        }
+
+        // packus also clamps the unsharp mask to [0, 255]
+        _mm_storeu_si128((__m128i*) &out[x], _mm_packus_epi16(lo, hi));
+    }
+#elif KERNEL_NEON
+    for (; x + 8 <= w; x += 8) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (int j = 0; j < ksz; j++)
+            acc = vmlal_u8(acc, vld1_u8(&src[j][x]), vdup_n_u8(k[j]));
+        acc = vshrq_n_u16(acc, 8);
+
+        if (orig) {
+            int16x8_t o = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&orig[x])));
+            int16x8_t v = vsubq_s16(vshlq_n_s16(o, 1), vreinterpretq_s16_u16(acc));
+            vst1_u8(&out[x], vqmovun_s16(v));
+        } else {
+            vst1_u8(&out[x], vmovn_u16(acc));
+        }
+    }
+#endif
+
+    for (; x < w; x++) {
+        uint32_t acc = 0;
+
+        for (int j = 0; j < ksz; j++)
+            acc += k[j]*src[j][x];
+
+        acc >>= 8;
+
+        if (orig) {
+            int v = 2*orig[x] - (int) acc;
+            out[x] = v < 0 ? 0 : (v > 255 ? 255 : v);
+        } else {
+            out[x] = acc;
+        }
+    }
+}
+
+#if KERNEL_SSSE3
+// byte k of every 3 byte group of the 48 bytes at p.
+static inline __m128i KERNEL(decimate3_gather)(const uint8_t *p, int k)
+{
+    __m128i r = _mm_setzero_si128();
+    for (int v = 0; v < 3; v++) {
+        __m128i in = _mm_loadu_si128((const __m128i*) (p + 16*v));
+        __m128i mask = _mm_loadu_si128((const __m128i*) decimate3_shuffle[k][v]);
+        r = _mm_or_si128(r, _mm_shuffle_epi8(in, mask));
+    }
+    return r;
+}
+#endif
+
+static void KERNEL(decimate2_row)(const uint8_t *src, int s, uint8_t *dst, int swidth)
+{
+    int sx = 0;
+
+#if KERNEL_SSE2
+    // sum horizontally adjacent pairs into 16 bit lanes.
+    const __m128i lowbyte = _mm_set1_epi16(0xff);
+
+    for (; sx + 16 <= swidth; sx += 16) {
+        __m128i sum[2];
+
+        for (int half = 0; half < 2; half++) {
+            __m128i r0 = _mm_loadu_si128((const __m128i*) &src[2*sx + 16*half]);
+            __m128i r1 = _mm_loadu_si128((const __m128i*) &src[2*sx + 16*half + s]);
+
+            __m128i v = _mm_add_epi16(_mm_and_si128(r0, lowbyte), _mm_srli_epi16(r0, 8));
+            v = _mm_add_epi16(v, _mm_and_si128(r1, lowbyte));
+            v = _mm_add_epi16(v, _mm_srli_epi16(r1, 8));
+            sum[half] = _mm_srli_epi16(v, 2);
+        }
+
+        _mm_storeu_si128((__m128i*) &dst[sx], _mm_packus_epi16(sum[0], sum[1]));
+    }
+#endif
+
+    for (; sx < swidth; sx++) {
+        int idx = 2*sx;
+        uint32_t v = src[idx] + src[idx+1] +
+            src[idx+s] + src[idx+s + 1];
+        dst[sx] = (v>>2);
+    }
+}
+
+static void KERNEL(decimate3_row)(const uint8_t *src, int s, uint8_t *dst, int swidth)
+{
+    int sx = 0;
+
+#if KERNEL_SSSE3
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; sx + 16 <= swidth; sx += 16) {
+        const uint8_t *p = &src[3*sx];
+
+        // deliberately omit lower right corner so there are exactly 8
+        // samples (see below).
+        __m128i v[8] = {
+            KERNEL(decimate3_gather)(p, 0),
+            KERNEL(decimate3_gather)(p, 1),
+            KERNEL(decimate3_gather)(p, 2),
+            KERNEL(decimate3_gather)(p + s, 0),
+            KERNEL(decimate3_gather)(p + s, 1),
+            KERNEL(decimate3_gather)(p + s, 2),
+            KERNEL(decimate3_gather)(p + 2*s, 0),
+            KERNEL(decimate3_gather)(p + 2*s, 1),
+        };
+
+        __m128i lo = zero, hi = zero;
+        for (int i = 0; i < 8; i++) {
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v[i], zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v[i], zero));
+        }
+
+        _mm_storeu_si128((__m128i*) &dst[sx],
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 3), _mm_srli_epi16(hi, 3)));
+    }
+#endif
+
+    for (; sx < swidth; sx++) {
+        int idx = 3*sx;
+        uint32_t v = src[idx] + src[idx+1] + src[idx+2] +
+            src[idx+s] + src[idx+s + 1] + src[idx+s + 2] +
+            src[idx+2*s] + src[idx+2*s + 1];
+        // + src[idx+2*s + 2];
+        // deliberately omit lower right corner so there are exactly 8 samples...
+        dst[sx] = (v>>3);
+    }
+}
+
+static void KERNEL(decimate4_row)(const uint8_t *src, int s, uint8_t *dst, int swidth)
+{
+    int sx = 0;
+
+#if KERNEL_SSE2
+    const __m128i lowbyte = _mm_set1_epi16(0xff);
+    const __m128i lowword = _mm_set1_epi32(0xffff);
+
+    for (; sx + 16 <= swidth; sx += 16) {
+        __m128i sum[4];
+
+        // each 16 input bytes produce 4 outputs, one per 32 bit lane.
+        for (int q = 0; q < 4; q++) {
+            const uint8_t *p = &src[4*sx + 16*q];
+            __m128i r0 = _mm_loadu_si128((const __m128i*) p);
+            __m128i r1 = _mm_loadu_si128((const __m128i*) (p + s));
+            __m128i r2 = _mm_loadu_si128((const __m128i*) (p + 2*s));
+
+            // pairwise sums: (b0+b1), (b2+b3), ...
+            __m128i p0 = _mm_add_epi16(_mm_and_si128(r0, lowbyte), _mm_srli_epi16(r0, 8));
+            __m128i p1 = _mm_add_epi16(_mm_and_si128(r1, lowbyte), _mm_srli_epi16(r1, 8));
+            __m128i p2 = _mm_add_epi16(_mm_and_si128(r2, lowbyte), _mm_srli_epi16(r2, 8));
+
+            // (b1+b2), (b3+b4), ... for the middle row, which is
+            // sampled as b0 + 2*b1 + b2 below.
+            __m128i r1s = _mm_srli_si128(r1, 1);
+            __m128i p1s = _mm_add_epi16(_mm_and_si128(r1s, lowbyte), _mm_srli_epi16(r1s, 8));
+
+            __m128i v = _mm_add_epi32(_mm_and_si128(p0, lowword), _mm_srli_epi32(p0, 16));
+            v = _mm_add_epi32(v, _mm_and_si128(p2, lowword));
+            v = _mm_add_epi32(v, _mm_srli_epi32(p2, 16));
+            v = _mm_add_epi32(v, _mm_and_si128(p1, lowword));
+            v = _mm_add_epi32(v, _mm_and_si128(p1s, lowword));
+
+            sum[q] = _mm_srli_epi32(v, 4);
+        }
+
+        __m128i lo = _mm_packs_epi32(sum[0], sum[1]);
+        __m128i hi = _mm_packs_epi32(sum[2], sum[3]);
+        _mm_storeu_si128((__m128i*) &dst[sx], _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; sx < swidth; sx++) {
+        int idx = 4*sx;
+        uint32_t v = src[idx] + src[idx+1] + src[idx+2] + src[idx+3] +
+            src[idx+s] + src[idx+s + 1] + src[idx+s + 1] + src[idx+s + 2] +
+            src[idx+2*s] + src[idx+2*s + 1] + src[idx+2*s + 2] + src[idx+2*s + 3];
+
+        dst[sx] = (v>>4);
+    }
+}
+
+// Adds the absolute differences of a and b to row[x/8], for the x in
+// whole 16 pixel blocks (two tiles of 8) of [0, w); returns the end
+// of those.
+static int KERNEL(sad8_row)(const uint8_t *pa, const uint8_t *pb, int w, uint32_t *row)
+{
+    int x = 0;
+#if KERNEL_SSE2
+    for (; x + 16 <= w; x += 16) {
+        __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*) &pa[x]),
+                                   _mm_loadu_si128((const __m128i*) &pb[x]));
+        row[x/8] += _mm_cvtsi128_si32(sad);
+        row[x/8 + 1] += _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+    }
+#elif KERNEL_NEON
+    for (; x + 16 <= w; x += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(&pa[x]), vld1q_u8(&pb[x]));
+        uint64x2_t sad = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(d)));
+        row[x/8] += vgetq_lane_u64(sad, 0);
+        row[x/8 + 1] += vgetq_lane_u64(sad, 1);
+    }
+#else
+    (void) pa; (void) pb; (void) w; (void) row;
+#endif
+    return x;
+}
+
+#if KERNEL_SSE2
+// the gray of 8 pixels, from their channels (in 16 bit lanes): see
+// color_gray_row.
+static inline __m128i KERNEL(color_gray8)(__m128i c0, __m128i c1, __m128i c2, const uint8_t *wts)
+{
+    // (at most 255*256 + 128, which fits in 16 unsigned bits.)
+    __m128i v = _mm_add_epi16(_mm_mullo_epi16(c0, _mm_set1_epi16(wts[0])), _mm_set1_epi16(128));
+    v = _mm_add_epi16(v, _mm_mullo_epi16(c1, _mm_set1_epi16(wts[1])));
+    v = _mm_add_epi16(v, _mm_mullo_epi16(c2, _mm_set1_epi16(wts[2])));
+    return _mm_srli_epi16(v, 8);
+}
+#endif
+
+// dst[x] = (wts[0]*p[0] + wts[1]*p[1] + wts[2]*p[2] + 128) >> 8 for
+// each of the w pixels p of bpp (3 or 4) bytes at src, whose weights
+// sum to 256 (the fourth byte, if any, being ignored).
+static void KERNEL(color_gray_row)(const uint8_t *src, int bpp, const uint8_t *wts, uint8_t *dst, int w)
+{
+    int x = 0;
+
+#if KERNEL_SSSE3
+    if (bpp == 3) {
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; x + 16 <= w; x += 16) {
+            const uint8_t *p = &src[3*x];
+            __m128i c0 = KERNEL(decimate3_gather)(p, 0);
+            __m128i c1 = KERNEL(decimate3_gather)(p, 1);
+            __m128i c2 = KERNEL(decimate3_gather)(p, 2);
+
+            __m128i lo = KERNEL(color_gray8)(_mm_unpacklo_epi8(c0, zero), _mm_unpacklo_epi8(c1, zero),
+                                             _mm_unpacklo_epi8(c2, zero), wts);
+            __m128i hi = KERNEL(color_gray8)(_mm_unpackhi_epi8(c0, zero), _mm_unpackhi_epi8(c1, zero),
+                                             _mm_unpackhi_epi8(c2, zero), wts);
+            _mm_storeu_si128((__m128i*) &dst[x], _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+#if KERNEL_SSE2
+    if (bpp == 4) {
+        const __m128i lowbyte = _mm_set1_epi32(0xff);
+
+        for (; x + 16 <= w; x += 16) {
+            __m128i v[4], gray[2];
+            for (int q = 0; q < 4; q++)
+                v[q] = _mm_loadu_si128((const __m128i*) &src[4*x + 16*q]);
+
+            // byte c of each pixel, for 8 pixels at a time.
+            for (int half = 0; half < 2; half++) {
+                __m128i a = v[2*half], b = v[2*half + 1];
+                __m128i c[3];
+                for (int k = 0; k < 3; k++) {
+                    __m128i ak = _mm_and_si128(_mm_srli_epi32(a, 8*k), lowbyte);
+                    __m128i bk = _mm_and_si128(_mm_srli_epi32(b, 8*k), lowbyte);
+                    c[k] = _mm_packs_epi32(ak, bk);
+                }
+                gray[half] = KERNEL(color_gray8)(c[0], c[1], c[2], wts);
+            }
+
+            _mm_storeu_si128((__m128i*) &dst[x], _mm_packus_epi16(gray[0], gray[1]));
+        }
+    }
+#elif KERNEL_NEON
+    uint8x8_t w0 = vdup_n_u8(wts[0]), w1 = vdup_n_u8(wts[1]), w2 = vdup_n_u8(wts[2]);
+
+    for (; x + 16 <= w; x += 16) {
+        uint8x16_t c0, c1, c2;
+        if (bpp == 3) {
+            uint8x16x3_t px = vld3q_u8(&src[3*x]);
+            c0 = px.val[0]; c1 = px.val[1]; c2 = px.val[2];
+        } else {
+            uint8x16x4_t px = vld4q_u8(&src[4*x]);
+            c0 = px.val[0]; c1 = px.val[1]; c2 = px.val[2];
+        }
+
+        uint16x8_t lo = vmull_u8(vget_low_u8(c0), w0);
+        lo = vmlal_u8(lo, vget_low_u8(c1), w1);
+        lo = vmlal_u8(lo, vget_low_u8(c2), w2);
+        uint16x8_t hi = vmull_u8(vget_high_u8(c0), w0);
+        hi = vmlal_u8(hi, vget_high_u8(c1), w1);
+        hi = vmlal_u8(hi, vget_high_u8(c2), w2);
+
+        // (the rounding shift adds the 128.)
+        vst1q_u8(&dst[x], vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+#endif
+
+    for (; x < w; x++) {
+        const uint8_t *p = &src[bpp*x];
+        dst[x] = (wts[0]*p[0] + wts[1]*p[1] + wts[2]*p[2] + 128) >> 8;
+    }
+}
+
+// vals[i] = the bilinear interpolation of the image (of width x
+// height pixels, at buf) at (xs[i], ys[i]), or -1 outside it, as
+// image_u8_sample_points and in float arithmetic. aligned: whether the
+// 4 byte words of the buffer can all be read (as for the images of
+// image_u8_create), which the vector body gathers pixels from.
+static void KERNEL(sample_bilinear)(const uint8_t *buf, int stride, int width, int height, int aligned,
+                                    const float *xs, const float *ys, int n, float *vals)
+{
+    int i = 0;
+
+#if KERNEL_AVX2
+    // (SSE2 and NEON have no gathers, without which the four loads of
+    // each point, not the arithmetic, take the time.)
+    if (aligned) {
+        const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+        const __m256i w = _mm256_set1_epi32(width), h = _mm256_set1_epi32(height);
+        const __m256i wmax = _mm256_set1_epi32(width - 1), hmax = _mm256_set1_epi32(height - 1);
+        const __m256i s = _mm256_set1_epi32(stride);
+        const __m256 half = _mm256_set1_ps(0.5f);
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 x = _mm256_loadu_ps(&xs[i]), y = _mm256_loadu_ps(&ys[i]);
+
+            // (truncating, as image_u8_sample_points does.)
+            __m256i ix = _mm256_cvttps_epi32(x), iy = _mm256_cvttps_epi32(y);
+            __m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(w, ix), _mm256_cmpgt_epi32(h, iy));
+            inside = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(zero, ix),
+                                                         _mm256_cmpgt_epi32(zero, iy)), inside);
+
+            __m256 fx = _mm256_sub_ps(x, half), fy = _mm256_sub_ps(y, half);
+            __m256 x0f = _mm256_floor_ps(fx), y0f = _mm256_floor_ps(fy);
+            __m256 ax = _mm256_sub_ps(fx, x0f), ay = _mm256_sub_ps(fy, y0f);
+            __m256i x0 = _mm256_cvttps_epi32(x0f), y0 = _mm256_cvttps_epi32(y0f);
+
+            // (clamped as in the scalar loop, and the points outside
+            // the image to some pixel.)
+            __m256i xa = _mm256_min_epi32(_mm256_max_epi32(x0, zero), wmax);
+            __m256i xb = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(x0, one), zero), wmax);
+            __m256i ra = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(y0, zero), hmax), s);
+            __m256i rb = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y0, one), zero),
+                                                             hmax), s);
+
+            __m256i idx[4] = { _mm256_add_epi32(ra, xa), _mm256_add_epi32(ra, xb),
+                               _mm256_add_epi32(rb, xa), _mm256_add_epi32(rb, xb) };
+            __m256 v[4];
+            for (int k = 0; k < 4; k++) {
+                // each pixel from the (aligned) word that holds it.
+                __m256i word = _mm256_i32gather_epi32((const int*) buf,
+                                                      _mm256_andnot_si256(_mm256_set1_epi32(3), idx[k]), 1);
+                __m256i shift = _mm256_slli_epi32(_mm256_and_si256(idx[k], _mm256_set1_epi32(3)), 3);
+                word = _mm256_and_si256(_mm256_srlv_epi32(word, shift), _mm256_set1_epi32(0xff));
+                v[k] = _mm256_cvtepi32_ps(word);
+            }
+
+            __m256 top = _mm256_add_ps(v[0], _mm256_mul_ps(ax, _mm256_sub_ps(v[1], v[0])));
+            __m256 bot = _mm256_add_ps(v[2], _mm256_mul_ps(ax, _mm256_sub_ps(v[3], v[2])));
+            __m256 val = _mm256_add_ps(top, _mm256_mul_ps(ay, _mm256_sub_ps(bot, top)));
+
+            val = _mm256_blendv_ps(_mm256_set1_ps(-1), val, _mm256_castsi256_ps(inside));
+            _mm256_storeu_ps(&vals[i], val);
+        }
+    }
+#else
+    (void) aligned;
+#endif
+
+    for (; i < n; i++) {
+        int ix = xs[i];
+        int iy = ys[i];
+
+        if (ix < 0 || iy < 0 || ix >= width || iy >= height) {
+            vals[i] = -1;
+            continue;
+        }
+
+        float fx = xs[i] - 0.5f, fy = ys[i] - 0.5f;
+        float x0f = floorf(fx), y0f = floorf(fy);
+        float ax = fx - x0f, ay = fy - y0f;
+        int x0 = x0f, y0 = y0f;
+
+        int xa = x0 < 0 ? 0 : x0, ya = y0 < 0 ? 0 : y0;
+        int xb = x0 + 1, yb = y0 + 1;
+        xb = xb < 0 ? 0 : xb >= width ? width - 1 : xb;
+        yb = yb < 0 ? 0 : yb >= height ? height - 1 : yb;
+
+        const uint8_t *ra = &buf[ya*stride];
+        const uint8_t *rb = &buf[yb*stride];
+
+        float top = ra[xa] + ax*((float) ra[xb] - ra[xa]);
+        float bot = rb[xa] + ax*((float) rb[xb] - rb[xa]);
+        vals[i] = top + ay*(bot - top);
+    }
+}
+
+static const struct image_u8_kernels KERNEL(image_u8_kernels) = {
+    KERNEL(convolve_row),
+    KERNEL(convolve_col),
+    KERNEL(decimate2_row),
+    KERNEL(decimate3_row),
+    KERNEL(decimate4_row),
+    KERNEL(sad8_row),
+    KERNEL(color_gray_row),
+    KERNEL(sample_bilinear),
+};
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+
+#include "memstat.h"
+
+static __thread memstat_t *scope;
+
+memstat_t *memstat_scope_set(memstat_t *counters)
+{
+    memstat_t *prev = scope;
+    scope = counters;
+    return prev;
+}
+
+memstat_t *memstat_scope(void)
+{
+    return scope;
+}
+
+void memstat_charge(memstat_t *counters, int category, int64_t bytes)
+{
+    if (!counters || !bytes)
+        return;
+
+    memstat_t *m = &counters[category];
+    int64_t now = __atomic_add_fetch(&m->bytes, bytes, __ATOMIC_RELAXED);
+
+    int64_t peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+    while (now > peak &&
+           !__atomic_compare_exchange_n(&m->peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void memstat_scope_charge(int category, int64_t bytes)
+{
+    memstat_charge(scope, category, bytes);
+}
+
+void *memstat_malloc(int category, size_t sz)
+{
+    void *p = malloc(sz);
+    if (p)
+        memstat_charge(scope, category, sz);
+    return p;
+}
+
+void *memstat_calloc(int category, size_t n, size_t sz)
+{
+    void *p = calloc(n, sz);
+    if (p)
+        memstat_charge(scope, category, n * sz);
+    return p;
+}
+
+void *memstat_realloc(int category, void *p, size_t oldsz, size_t sz)
+{
+    void *q = realloc(p, sz);
+    if (q)
+        memstat_charge(scope, category, (int64_t) sz - (int64_t) (p ? oldsz : 0));
+    return q;
+}
+
+void memstat_free(int category, void *p, size_t sz)
+{
+    if (p)
+        memstat_charge(scope, category, -(int64_t) sz);
+    free(p);
+}
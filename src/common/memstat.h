@@ -0,0 +1,49 @@
+#ifndef _MEMSTAT_H
+#define _MEMSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counting allocation wrappers, for knowing how much memory each
+// part of a program holds. A set of counters (an array of memstat_t,
+// one for each category of memory) is made the scope of a thread
+// with memstat_scope_set; the wrappers below charge what they
+// allocate, and free, to a category of the calling thread's scope, or
+// to nothing if it has none. Not counting costs a wrapper one load of
+// a thread-local variable more than the call it wraps. The workerpool
+// runs each task in the scope of the thread running the pool (see
+// workerpool_run).
+
+typedef struct memstat memstat_t;
+struct memstat
+{
+    int64_t bytes; // held now
+    int64_t peak;  // the most ever held
+};
+
+// Make counters the calling thread's scope (NULL for none). Returns
+// the scope it had.
+memstat_t *memstat_scope_set(memstat_t *counters);
+memstat_t *memstat_scope(void);
+
+// Charge bytes (negative when freed) to category of counters (unless
+// counters is NULL), and of the calling thread's scope.
+void memstat_charge(memstat_t *counters, int category, int64_t bytes);
+void memstat_scope_charge(int category, int64_t bytes);
+
+// As malloc, calloc, realloc and free, charging the scope. Those that
+// free are given the size the memory was allocated with.
+void *memstat_malloc(int category, size_t sz);
+void *memstat_calloc(int category, size_t n, size_t sz);
+void *memstat_realloc(int category, void *p, size_t oldsz, size_t sz);
+void memstat_free(int category, void *p, size_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
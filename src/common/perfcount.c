@@ -0,0 +1,115 @@
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfcount.h"
+
+// the calling thread's counters: the fd of the group leader (-1 when
+// not yet opened, -2 if they can't be), and the position in the
+// group's read of each event (-1 if it couldn't be opened).
+static __thread int group_fd = -1;
+static __thread int positions[PERFCOUNT_N];
+static __thread int ngroup;
+
+static __thread uint64_t *thread_sink;
+
+const char *perfcount_name(int event)
+{
+    static const char *names[PERFCOUNT_N] = {
+        [PERFCOUNT_CYCLES] = "cycles",
+        [PERFCOUNT_INSTRUCTIONS] = "instructions",
+        [PERFCOUNT_CACHE_MISSES] = "cache misses",
+        [PERFCOUNT_BRANCH_MISSES] = "branch misses",
+    };
+
+    if (event < 0 || event >= PERFCOUNT_N)
+        return NULL;
+
+    return names[event];
+}
+
+#ifdef __linux__
+static void open_counters(void)
+{
+    static const uint64_t configs[PERFCOUNT_N] = {
+        [PERFCOUNT_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+        [PERFCOUNT_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+        [PERFCOUNT_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+        [PERFCOUNT_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    group_fd = -2;
+    ngroup = 0;
+
+    for (int i = 0; i < PERFCOUNT_N; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int leader = group_fd >= 0 ? group_fd : -1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+
+        positions[i] = -1;
+        if (fd < 0)
+            continue;
+
+        if (leader < 0)
+            group_fd = fd;
+        positions[i] = ngroup++;
+    }
+}
+#endif
+
+int perfcount_read(uint64_t counts[PERFCOUNT_N])
+{
+    memset(counts, 0, PERFCOUNT_N * sizeof(uint64_t));
+
+#ifdef __linux__
+    if (group_fd == -1)
+        open_counters();
+    if (group_fd < 0)
+        return -1;
+
+    // (nr, then the value of each member.)
+    uint64_t buf[1 + PERFCOUNT_N];
+    ssize_t len = (1 + ngroup) * sizeof(uint64_t);
+    if (read(group_fd, buf, len) != len)
+        return -1;
+
+    for (int i = 0; i < PERFCOUNT_N; i++) {
+        if (positions[i] >= 0)
+            counts[i] = buf[1 + positions[i]];
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+uint64_t *perfcount_sink_set(uint64_t *sink)
+{
+    uint64_t *prev = thread_sink;
+    thread_sink = sink;
+    return prev;
+}
+
+uint64_t *perfcount_sink(void)
+{
+    return thread_sink;
+}
+
+void perfcount_add(uint64_t *sink, const uint64_t t0[PERFCOUNT_N], const uint64_t t1[PERFCOUNT_N])
+{
+    for (int i = 0; i < PERFCOUNT_N; i++)
+        __atomic_add_fetch(&sink[i], t1[i] - t0[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+#ifndef _PERFCOUNT_H
+#define _PERFCOUNT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hardware performance counters of the calling thread (with Linux's
+// perf_event_open). Each thread opens its own counters on first use,
+// counting only what it runs, in user space. They can't be opened
+// off Linux, without a PMU (as in many VMs), or when
+// kernel.perf_event_paranoid forbids it; reads then fail.
+//
+// Counts taken by a thread can be added to a sink (an array of
+// PERFCOUNT_N) of another: the workerpool adds what each task cost
+// to the sink of the thread running the pool (see workerpool_run),
+// if that has one, so that a stage's counts include those of its
+// tasks.
+
+enum perfcount_event
+{
+    PERFCOUNT_CYCLES,
+    PERFCOUNT_INSTRUCTIONS,
+    PERFCOUNT_CACHE_MISSES,  // (last level cache)
+    PERFCOUNT_BRANCH_MISSES,
+    PERFCOUNT_N
+};
+
+// The name of an event (e.g. "cycles"), or NULL.
+const char *perfcount_name(int event);
+
+// The counts of the calling thread so far (zero for any event the CPU
+// doesn't count). Returns 0, or -1 if there are no counters.
+int perfcount_read(uint64_t counts[PERFCOUNT_N]);
+
+// Make sink the calling thread's (NULL for none). Returns the sink it
+// had.
+uint64_t *perfcount_sink_set(uint64_t *sink);
+uint64_t *perfcount_sink(void);
+
+// Add (atomically) the counts from t0 to t1 to sink.
+void perfcount_add(uint64_t *sink, const uint64_t t0[PERFCOUNT_N], const uint64_t t1[PERFCOUNT_N]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
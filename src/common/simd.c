@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+
+int simd_current_isa = -1;
+
+static const char *const simd_isa_names[SIMD_NISAS] = {
+    [SIMD_SCALAR] = "scalar",
+    [SIMD_SSE2] = "sse2",
+    [SIMD_SSSE3] = "ssse3",
+    [SIMD_AVX2] = "avx2",
+    [SIMD_NEON] = "neon",
+};
+
+int simd_isa_supported(simd_isa_t isa)
+{
+    switch (isa) {
+        case SIMD_SCALAR:
+            return 1;
+#ifdef SIMD_X86
+        // (these also check that the OS saves the AVX registers.)
+        case SIMD_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case SIMD_SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case SIMD_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef SIMD_ARM_NEON
+        // (compiled for a CPU with NEON: every ARMv8 one.)
+        case SIMD_NEON:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+simd_isa_t simd_probe(void)
+{
+    int isa = __atomic_load_n(&simd_current_isa, __ATOMIC_RELAXED);
+    if (isa >= 0)
+        return (simd_isa_t) isa;
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+#endif
+
+    // (racing threads all probe the same.)
+    isa = SIMD_SCALAR;
+    for (int i = SIMD_NISAS - 1; i > SIMD_SCALAR; i--) {
+        if (simd_isa_supported((simd_isa_t) i)) {
+            isa = i;
+            break;
+        }
+    }
+
+    const char *env = getenv("APRILTAG_SIMD");
+    if (env != NULL && env[0]) {
+        int want = simd_isa_from_name(env);
+        if (want >= 0 && simd_isa_supported((simd_isa_t) want))
+            isa = want;
+        else
+            fprintf(stderr, "APRILTAG_SIMD=%s is not supported here; using %s\n",
+                    env, simd_isa_names[isa]);
+    }
+
+    __atomic_store_n(&simd_current_isa, isa, __ATOMIC_RELAXED);
+    return (simd_isa_t) isa;
+}
+
+int simd_set_isa(simd_isa_t isa)
+{
+    if ((int) isa < 0 || isa >= SIMD_NISAS || !simd_isa_supported(isa))
+        return -1;
+
+    __atomic_store_n(&simd_current_isa, (int) isa, __ATOMIC_RELAXED);
+    return 0;
+}
+
+const char *simd_isa_name(simd_isa_t isa)
+{
+    if ((int) isa < 0 || isa >= SIMD_NISAS)
+        return NULL;
+    return simd_isa_names[isa];
+}
+
+int simd_isa_from_name(const char *name)
+{
+    for (int i = 0; i < SIMD_NISAS; i++) {
+        if (!strcmp(name, simd_isa_names[i]))
+            return i;
+    }
+    return -1;
+}
@@ -0,0 +1,84 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runtime selection of the vector kernels (of image_u8.c and
+// apriltag_quad_thresh.c). Each kernel is compiled once for every
+// instruction set below that the compiler can target, whatever the
+// compiler flags, and called through a table of function pointers
+// for the one in use. That is the best one the CPU supports, as
+// probed on first use (or by apriltag_detector_create), unless
+// overridden with the APRILTAG_SIMD environment variable (e.g.
+// APRILTAG_SIMD=sse2) or simd_set_isa, to time a particular one.
+// Every kernel computes the same results on every instruction set.
+typedef enum {
+    SIMD_SCALAR = 0,
+    SIMD_SSE2,
+    SIMD_SSSE3,
+    SIMD_AVX2,
+    SIMD_NEON,
+    SIMD_NISAS
+} simd_isa_t;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define SIMD_ARM_NEON 1
+#endif
+
+// the instruction set in use (-1 until probed).
+extern int simd_current_isa;
+
+// Probes the CPU (once) and returns the instruction set in use.
+simd_isa_t simd_probe(void);
+
+static inline simd_isa_t simd_isa(void)
+{
+    int isa = __atomic_load_n(&simd_current_isa, __ATOMIC_RELAXED);
+    return isa >= 0 ? (simd_isa_t) isa : simd_probe();
+}
+
+// whether the kernels were compiled for isa, and this CPU runs it.
+int simd_isa_supported(simd_isa_t isa);
+
+// Use isa from now on (for the detectors of every thread). Returns -1,
+// changing nothing, if it isn't supported.
+int simd_set_isa(simd_isa_t isa);
+
+// "scalar", "sse2", "ssse3", "avx2" or "neon", and back (-1 if name
+// is none of those).
+const char *simd_isa_name(simd_isa_t isa);
+int simd_isa_from_name(const char *name);
+
+// The table of a file's kernels for each instruction set, from the
+// tables simd_kernels.h defines, e.g.
+//
+//     static const struct foo_kernels *const foo_kernels[SIMD_NISAS] = {
+//         SIMD_KERNEL_TABLES(foo_kernels)
+//     };
+//
+// (NULL for the instruction sets the kernels aren't compiled for,
+// which simd_isa never returns.)
+#ifdef SIMD_X86
+#define SIMD_KERNEL_TABLES_X86(t) \
+    [SIMD_SSE2] = &t##_sse2, [SIMD_SSSE3] = &t##_ssse3, [SIMD_AVX2] = &t##_avx2,
+#else
+#define SIMD_KERNEL_TABLES_X86(t)
+#endif
+#ifdef SIMD_ARM_NEON
+#define SIMD_KERNEL_TABLES_NEON(t) [SIMD_NEON] = &t##_neon,
+#else
+#define SIMD_KERNEL_TABLES_NEON(t)
+#endif
+#define SIMD_KERNEL_TABLES(t) \
+    [SIMD_SCALAR] = &t##_scalar, SIMD_KERNEL_TABLES_X86(t) SIMD_KERNEL_TABLES_NEON(t)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
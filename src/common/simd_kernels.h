@@ -0,0 +1,118 @@
+// (no include guard: included once per file of kernels.)
+//
+// Compiles the kernels of the file named by SIMD_KERNELS once for
+// each instruction set of simd.h the compiler can target. There, each
+// kernel is named KERNEL(name) (name_scalar, name_sse2, ...), and its
+// vector bodies are under #if KERNEL_SSE2, KERNEL_SSSE3, KERNEL_AVX2
+// or KERNEL_NEON (each of which implies the ones before it on its
+// architecture) rather than the compiler's own __SSE2__ etc, so that
+// the scalar variant is scalar even in a -march=native build. The
+// file ends with its table of kernels, KERNEL(<file>_kernels).
+//
+// On x86 the intrinsics of every instruction set (immintrin.h) must
+// already be included.
+
+#ifndef SIMD_KERNELS
+#error "define SIMD_KERNELS to the file of kernels"
+#endif
+
+#define KERNEL(name) name##_scalar
+#define KERNEL_SSE2 0
+#define KERNEL_SSSE3 0
+#define KERNEL_AVX2 0
+#define KERNEL_NEON 0
+#include SIMD_KERNELS
+#undef KERNEL
+#undef KERNEL_SSE2
+#undef KERNEL_SSSE3
+#undef KERNEL_AVX2
+#undef KERNEL_NEON
+
+#ifdef SIMD_X86
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#define KERNEL(name) name##_sse2
+#define KERNEL_SSE2 1
+#define KERNEL_SSSE3 0
+#define KERNEL_AVX2 0
+#define KERNEL_NEON 0
+#include SIMD_KERNELS
+#undef KERNEL
+#undef KERNEL_SSE2
+#undef KERNEL_SSSE3
+#undef KERNEL_AVX2
+#undef KERNEL_NEON
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("ssse3"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+#endif
+#define KERNEL(name) name##_ssse3
+#define KERNEL_SSE2 1
+#define KERNEL_SSSE3 1
+#define KERNEL_AVX2 0
+#define KERNEL_NEON 0
+#include SIMD_KERNELS
+#undef KERNEL
+#undef KERNEL_SSE2
+#undef KERNEL_SSSE3
+#undef KERNEL_AVX2
+#undef KERNEL_NEON
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define KERNEL(name) name##_avx2
+#define KERNEL_SSE2 1
+#define KERNEL_SSSE3 1
+#define KERNEL_AVX2 1
+#define KERNEL_NEON 0
+#include SIMD_KERNELS
+#undef KERNEL
+#undef KERNEL_SSE2
+#undef KERNEL_SSSE3
+#undef KERNEL_AVX2
+#undef KERNEL_NEON
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif // SIMD_X86
+
+#ifdef SIMD_ARM_NEON
+#define KERNEL(name) name##_neon
+#define KERNEL_SSE2 0
+#define KERNEL_SSSE3 0
+#define KERNEL_AVX2 0
+#define KERNEL_NEON 1
+#include SIMD_KERNELS
+#undef KERNEL
+#undef KERNEL_SSE2
+#undef KERNEL_SSSE3
+#undef KERNEL_AVX2
+#undef KERNEL_NEON
+#endif
+
+#undef SIMD_KERNELS
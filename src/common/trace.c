@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+struct trace_record
+{
+    const char *name;
+    int64_t t0, t1;
+};
+
+// The ring of a thread: its events [count - capacity, count), the
+// i'th in records[i & (capacity - 1)]. Written by its thread only.
+struct trace_buffer
+{
+    struct trace_buffer *next;
+    int tid;
+
+    struct trace_record *records;
+    uint64_t capacity;
+    uint64_t count;
+
+    int64_t mark;
+};
+
+int trace_recording;
+
+// the capacity of the rings (a power of two), and the ring of every
+// thread that recorded an event, kept (with its events) after the
+// thread exits.
+static uint64_t trace_capacity;
+static struct trace_buffer *buffers;
+static int nbuffers;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct trace_buffer *thread_buffer;
+
+int64_t trace_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_buffer *get_buffer(void)
+{
+    struct trace_buffer *b = thread_buffer;
+
+    if (!b) {
+        b = calloc(1, sizeof(struct trace_buffer));
+
+        pthread_mutex_lock(&buffers_mutex);
+        b->tid = nbuffers++;
+        b->next = buffers;
+        buffers = b;
+        pthread_mutex_unlock(&buffers_mutex);
+
+        thread_buffer = b;
+    }
+
+    // (tracing was started again with another capacity.)
+    uint64_t capacity = __atomic_load_n(&trace_capacity, __ATOMIC_ACQUIRE);
+    if (b->capacity != capacity) {
+        free(b->records);
+        b->records = calloc(capacity, sizeof(struct trace_record));
+        b->capacity = capacity;
+        b->count = 0;
+    }
+
+    return b;
+}
+
+void trace_start(int capacity)
+{
+    uint64_t c = 1;
+    while (c < (uint64_t) capacity)
+        c <<= 1;
+
+    pthread_mutex_lock(&buffers_mutex);
+    for (struct trace_buffer *b = buffers; b; b = b->next)
+        b->count = 0;
+    pthread_mutex_unlock(&buffers_mutex);
+
+    __atomic_store_n(&trace_capacity, c, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_recording, 1, __ATOMIC_RELEASE);
+}
+
+void trace_stop(void)
+{
+    __atomic_store_n(&trace_recording, 0, __ATOMIC_RELEASE);
+}
+
+void trace_event(const char *name, int64_t t0, int64_t t1)
+{
+    if (!trace_on())
+        return;
+
+    struct trace_buffer *b = get_buffer();
+    struct trace_record *r = &b->records[b->count & (b->capacity - 1)];
+    r->name = name;
+    r->t0 = t0;
+    r->t1 = t1;
+    b->count++;
+}
+
+void trace_mark(const char *name)
+{
+    if (!trace_on())
+        return;
+
+    struct trace_buffer *b = get_buffer();
+    int64_t now = trace_ns();
+
+    // (the thread's first mark begins at its first event.)
+    trace_event(name, b->mark ? b->mark : now, now);
+    b->mark = now;
+}
+
+void trace_mark_reset(void)
+{
+    if (!trace_on())
+        return;
+
+    get_buffer()->mark = trace_ns();
+}
+
+static void write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+int trace_write_json(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    pthread_mutex_lock(&buffers_mutex);
+
+    // (times are given from the first event traced.)
+    int64_t t_first = INT64_MAX;
+    for (struct trace_buffer *b = buffers; b; b = b->next) {
+        uint64_t n = b->count < b->capacity ? b->count : b->capacity;
+        for (uint64_t i = b->count - n; i < b->count; i++) {
+            const struct trace_record *r = &b->records[i & (b->capacity - 1)];
+            if (r->t0 < t_first)
+                t_first = r->t0;
+        }
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+
+    int first = 1;
+    for (struct trace_buffer *b = buffers; b; b = b->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}",
+                first ? "" : ",\n", b->tid, b->tid);
+        first = 0;
+
+        uint64_t n = b->count < b->capacity ? b->count : b->capacity;
+        for (uint64_t i = b->count - n; i < b->count; i++) {
+            const struct trace_record *r = &b->records[i & (b->capacity - 1)];
+
+            fprintf(f, ",\n{\"name\":");
+            write_string(f, r->name);
+            fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    b->tid, (r->t0 - t_first) / 1.0E3, (r->t1 - r->t0) / 1.0E3);
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+
+    pthread_mutex_unlock(&buffers_mutex);
+
+    int res = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0)
+        res = -1;
+    return res;
+}
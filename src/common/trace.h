@@ -0,0 +1,60 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A record of what every thread was doing and when, for finding the
+// threads that sit idle and the work that runs on one thread only:
+// while tracing, each thread keeps its last events (each a name, and
+// the times it began and ended) in a ring of its own, and the
+// detector records its stages (see apriltag_detect_context_stamp)
+// and the workerpool each of its tasks. trace_write_json writes them
+// all in the Chrome trace format (for chrome://tracing, or
+// ui.perfetto.dev).
+//
+// Recording an event costs a clock read and a store; when not
+// tracing, it is one load of a flag. Names are kept by address, and
+// must outlive the trace (e.g. string literals).
+
+extern int trace_recording;
+
+static inline int trace_on(void)
+{
+    return __atomic_load_n(&trace_recording, __ATOMIC_RELAXED);
+}
+
+// Start tracing (again), keeping the last capacity events of each
+// thread, having forgotten those traced before. Not to be called
+// while other threads are recording events.
+void trace_start(int capacity);
+
+// Stop recording events (keeping those recorded so far).
+void trace_stop(void);
+
+// The time, in nanoseconds, by the clock of the trace.
+int64_t trace_ns(void);
+
+// Record an event of the calling thread, from t0 until t1 (as from
+// trace_ns).
+void trace_event(const char *name, int64_t t0, int64_t t1);
+
+// Record an event of the calling thread (named name) that lasted from
+// its last mark until now, and mark now: a thread marks the end of
+// each step of a sequence of them. trace_mark_reset marks now only.
+void trace_mark(const char *name);
+void trace_mark_reset(void);
+
+// Write the events recorded, as Chrome trace (JSON) events. Not to be
+// called while threads are recording events (e.g. after trace_stop).
+// Returns 0, or -1 if the file couldn't be written.
+int trace_write_json(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -67,6 +67,15 @@ static inline unionfind_t *unionfind_create(uint32_t maxid)
     return uf;
 }
 
+// put every element back into its own set, retaining the storage.
+static inline void unionfind_reset(unionfind_t *uf)
+{
+    for (uint32_t i = 0; i <= uf->maxid; i++) {
+        uf->data[i].size = 1;
+        uf->data[i].parent = i;
+    }
+}
+
 static inline void unionfind_destroy(unionfind_t *uf)
 {
     free(uf->data);
@@ -115,6 +124,18 @@ static inline uint32_t unionfind_get_representative(unionfind_t *uf, uint32_t id
     return root;
 }
 
+// The representative of id, as unionfind_get_representative finds
+// it, but without collapsing the path: it writes nothing, so any
+// number of threads may call it at once (while none is connecting
+// sets).
+static inline uint32_t unionfind_find(const unionfind_t *uf, uint32_t id)
+{
+    while (uf->data[id].parent != id)
+        id = uf->data[id].parent;
+
+    return id;
+}
+
 static inline uint32_t unionfind_get_set_size(unionfind_t *uf, uint32_t id)
 {
     uint32_t repid = unionfind_get_representative(uf, id);
@@ -29,97 +29,327 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the FreeBSD Project.
  */
 
-#define __USE_GNU
+#define _GNU_SOURCE // for pthread_setaffinity_np
 #include <pthread.h>
 #include <sched.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "workerpool.h"
 #include "timeprofile.h"
+#include "time_util.h"
+#include "trace.h"
+#include "memstat.h"
+#include "perfcount.h"
+
+// how long idle threads spin, waiting for work, before sleeping. (See
+// workerpool_set_spin.)
+#define WORKERPOOL_DEFAULT_SPIN_US 50
+
+// The tasks of a run are divided among the threads, each of which
+// has a deque: a range [head, tail) of the task array, packed into a
+// single word so that it can be updated with one compare-and-swap.
+// A thread takes tasks from the head of its own deque and, when that
+// is empty, steals from the tail of the others'. (Tasks are never
+// added while the pool is running, so the deques only shrink.)
+struct deque {
+    uint64_t range; // head << 32 | tail
+    char pad[64 - sizeof(uint64_t)]; // one deque per cache line
+};
 
 struct workerpool {
     int nthreads;
     zarray_t *tasks;
-    int taskspos;
 
+    // the threads besides the caller's, of which those past the
+    // first nthreads - 1 are parked (see workerpool_set_nthreads),
+    // and a deque for each thread and the caller. Deques replaced by
+    // larger ones are kept (retired) until the pool is destroyed, as a
+    // thread finishing a run may still be looking at them.
     pthread_t *threads;
-    int *status;
+    int nworkers;
+    struct deque *deques;
+    zarray_t *retired;
+    size_t retired_bytes;
+
+    // how many tasks of the current run have not yet completed.
+    int remaining;
 
     pthread_mutex_t mutex;
     pthread_cond_t startcond;   // used to signal the availability of work
     pthread_cond_t endcond;     // used to signal completion of all work
-
-    int end_count; // how many threads are done?
+    pthread_cond_t parkcond;    // used to unpark threads
+
+    int generation; // incremented (under mutex) for each run
+    int exit;       // set (under mutex) to ask the threads to exit
+
+    int spin_us;
+    int spin_set; // (by workerpool_set_spin, rather than by default.)
+
+    // held by the thread adding tasks to (and then running) the
+    // pool, so that several threads can share it, and the next of
+    // the pools that thread holds (see held_pools).
+    pthread_mutex_t runmutex;
+    workerpool_t *held_next;
+
+    // the memstat scope of the thread running the pool, in which the
+    // tasks of the run are run, and its perfcount sink, to which the
+    // other threads add what their tasks cost.
+    memstat_t *scope;
+    uint64_t *perf_sink;
+
+#ifdef __linux__
+    // the CPUs of workerpool_set_affinity, for threads started later.
+    cpu_set_t affinity;
+    int has_affinity;
+#endif
 };
 
+// the pools whose runmutex this thread holds, linked through their
+// held_next. (A thread may add tasks to several pools before running
+// any of them. Only the holder touches a pool's held_next.)
+static __thread workerpool_t *held_pools;
+
 struct task
 {
     void (*f)(void *p);
     void *p;
 };
 
-void *worker_thread(void *p)
+struct worker
+{
+    workerpool_t *wp;
+    int idx;
+};
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// the first add_task (or run) of a thread waits until no other thread
+// is using the pool; the run that follows lets it go again.
+static int pool_held(workerpool_t *wp)
+{
+    for (workerpool_t *h = held_pools; h; h = h->held_next)
+        if (h == wp)
+            return 1;
+    return 0;
+}
+
+static void pool_hold(workerpool_t *wp)
+{
+    if (!pool_held(wp)) {
+        pthread_mutex_lock(&wp->runmutex);
+        wp->held_next = held_pools;
+        held_pools = wp;
+    }
+}
+
+static void pool_release(workerpool_t *wp)
+{
+    for (workerpool_t **h = &held_pools; *h; h = &(*h)->held_next) {
+        if (*h == wp) {
+            *h = wp->held_next;
+            wp->held_next = NULL;
+            pthread_mutex_unlock(&wp->runmutex);
+            return;
+        }
+    }
+}
+
+// spin for up to wp->spin_us until (*v == value) == equal, so that a
+// thread that is about to be given work (or told that work is done)
+// doesn't have to sleep and be woken. The caller must still check
+// (and wait on the condition) afterwards.
+static void spin_until(workerpool_t *wp, const int *v, int value, int equal)
+{
+    if (wp->spin_us <= 0)
+        return;
+
+    int64_t t0 = utime_now();
+
+    for (int i = 1; (__atomic_load_n(v, __ATOMIC_ACQUIRE) == value) != equal; i++) {
+        cpu_relax();
+
+        if ((i & 63) == 0 && utime_now() - t0 > wp->spin_us)
+            return;
+    }
+}
+
+static inline uint64_t deque_range(uint32_t head, uint32_t tail)
 {
-    workerpool_t *wp = (workerpool_t*) p;
+    return ((uint64_t) head << 32) | tail;
+}
 
-    int cnt = 0;
+// take a task from the head (steal = 0) or the tail (steal = 1) of a
+// deque. Returns the index of the task, or -1 if the deque is empty.
+static int deque_take(struct deque *d, int steal)
+{
+    uint64_t range = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
 
     while (1) {
-        struct task *task;
+        uint32_t head = range >> 32, tail = (uint32_t) range;
 
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->taskspos == zarray_size(wp->tasks)) {
-            wp->end_count++;
-//          printf("%"PRId64" thread %d did %d\n", utime_now(), pthread_self(), cnt);
-            pthread_cond_broadcast(&wp->endcond);
-            pthread_cond_wait(&wp->startcond, &wp->mutex);
-            cnt = 0;
-//            printf("%"PRId64" thread %d awake\n", utime_now(), pthread_self());
+        if (head >= tail)
+            return -1;
+
+        uint64_t next = steal ? deque_range(head, tail - 1) : deque_range(head + 1, tail);
+
+        // on failure, range is reloaded.
+        if (__atomic_compare_exchange_n(&d->range, &range, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return steal ? (int) tail - 1 : (int) head;
+    }
+}
+
+// run tasks (starting with thread idx's own) until none of the
+// nthreads deques has any left.
+static void worker_run_tasks(workerpool_t *wp, int idx, int nthreads, struct deque *deques)
+{
+    for (int i = 0; i < nthreads; i++) {
+        int victim = (idx + i) % nthreads;
+        int taskidx;
+
+        while ((taskidx = deque_take(&deques[victim], i > 0)) >= 0) {
+            struct task *task;
+            zarray_get_volatile(wp->tasks, taskidx, &task);
+
+            memstat_scope_set(wp->scope);
+
+            // (the thread running the pool counts its own.)
+            uint64_t *sink = idx > 0 ? wp->perf_sink : NULL;
+            uint64_t counts0[PERFCOUNT_N], counts1[PERFCOUNT_N];
+            if (sink && perfcount_read(counts0) != 0)
+                sink = NULL;
+
+            int64_t t0 = trace_on() ? trace_ns() : 0;
+            task->f(task->p);
+            if (t0)
+                trace_event(i > 0 ? "stolen task" : "task", t0, trace_ns());
+
+            if (sink && perfcount_read(counts1) == 0)
+                perfcount_add(sink, counts0, counts1);
+
+            if (__atomic_sub_fetch(&wp->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&wp->mutex);
+                pthread_cond_broadcast(&wp->endcond);
+                pthread_mutex_unlock(&wp->mutex);
+            }
         }
+    }
+}
+
+void *worker_thread(void *p)
+{
+    struct worker *worker = (struct worker*) p;
+    workerpool_t *wp = worker->wp;
+    int idx = worker->idx;
+    free(worker);
+
+    int generation = 0;
 
-        zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-        wp->taskspos++;
-        cnt++;
+    while (1) {
+        // (a parked thread doesn't spin.)
+        if (idx < __atomic_load_n(&wp->nthreads, __ATOMIC_RELAXED))
+            spin_until(wp, &wp->generation, generation, 0);
+
+        pthread_mutex_lock(&wp->mutex);
+        while (!wp->exit && (idx >= wp->nthreads || wp->generation == generation))
+            pthread_cond_wait(idx >= wp->nthreads ? &wp->parkcond : &wp->startcond, &wp->mutex);
+
+        // (the run's threads and deques, which stay as they are until
+        // it is over.)
+        generation = wp->generation;
+        int nthreads = wp->nthreads;
+        struct deque *deques = wp->deques;
+        int done = wp->exit;
         pthread_mutex_unlock(&wp->mutex);
-//        pthread_yield();
-        sched_yield();
 
         // we've been asked to exit.
-        if (task->f == NULL)
+        if (done)
             return NULL;
 
-        task->f(task->p);
+        worker_run_tasks(wp, idx, nthreads, deques);
     }
 
     return NULL;
 }
 
+// the default spin, for nthreads threads: spinning only helps if the
+// threads have cores of their own.
+static void pool_default_spin(workerpool_t *wp, int nthreads)
+{
+    if (!wp->spin_set)
+        wp->spin_us = nthreads <= sysconf(_SC_NPROCESSORS_ONLN) ? WORKERPOOL_DEFAULT_SPIN_US : 0;
+}
+
+// start threads (parked, until nthreads is raised) so that there are
+// nworkers besides the caller's. (Call with the pool held and not
+// running.)
+static void pool_start_workers(workerpool_t *wp, int nworkers)
+{
+    if (nworkers <= wp->nworkers)
+        return;
+
+    wp->threads = realloc(wp->threads, nworkers * sizeof(pthread_t));
+
+    struct deque *deques = calloc(nworkers + 1, sizeof(struct deque));
+    if (wp->deques) {
+        zarray_add(wp->retired, &wp->deques);
+        wp->retired_bytes += (wp->nworkers + 1) * sizeof(struct deque);
+    }
+
+    pthread_mutex_lock(&wp->mutex);
+    wp->deques = deques;
+    pthread_mutex_unlock(&wp->mutex);
+
+    // the calling thread of workerpool_run is worker 0.
+    for (int i = wp->nworkers + 1; i <= nworkers; i++) {
+        struct worker *worker = malloc(sizeof(struct worker));
+        worker->wp = wp;
+        worker->idx = i;
+
+        int res = pthread_create(&wp->threads[i - 1], NULL, worker_thread, worker);
+        if (res != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
+
+#ifdef __linux__
+        if (wp->has_affinity)
+            pthread_setaffinity_np(wp->threads[i - 1], sizeof(wp->affinity), &wp->affinity);
+#endif
+    }
+
+    wp->nworkers = nworkers;
+}
+
 workerpool_t *workerpool_create(int nthreads)
 {
     assert(nthreads > 0);
 
     workerpool_t *wp = calloc(1, sizeof(workerpool_t));
-    wp->nthreads = nthreads;
     wp->tasks = zarray_create(sizeof(struct task));
+    wp->retired = zarray_create(sizeof(struct deque*));
+    pthread_mutex_init(&wp->runmutex, NULL);
 
-    if (nthreads > 1) {
-        wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
+    pthread_mutex_init(&wp->mutex, NULL);
+    pthread_cond_init(&wp->startcond, NULL);
+    pthread_cond_init(&wp->endcond, NULL);
+    pthread_cond_init(&wp->parkcond, NULL);
 
-        pthread_mutex_init(&wp->mutex, NULL);
-        pthread_cond_init(&wp->startcond, NULL);
-        pthread_cond_init(&wp->endcond, NULL);
+    pool_default_spin(wp, nthreads);
 
-        for (int i = 0; i < nthreads; i++) {
-            int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
-            if (res != 0) {
-                perror("pthread_create");
-                exit(-1);
-            }
-        }
-    }
+    wp->nthreads = nthreads;
+    pool_start_workers(wp, nthreads - 1);
 
     return wp;
 }
@@ -129,31 +359,157 @@ void workerpool_destroy(workerpool_t *wp)
     if (wp == NULL)
         return;
 
-    // force all worker threads to exit.
-    if (wp->nthreads > 1) {
-        for (int i = 0; i < wp->nthreads; i++)
-            workerpool_add_task(wp, NULL, NULL);
-
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
-        pthread_mutex_unlock(&wp->mutex);
-
-        for (int i = 0; i < wp->nthreads; i++)
-            pthread_join(wp->threads[i], NULL);
-
-        pthread_mutex_destroy(&wp->mutex);
-        pthread_cond_destroy(&wp->startcond);
-        pthread_cond_destroy(&wp->endcond);
-        free(wp->threads);
+    // force all worker threads (parked or not) to exit.
+    pthread_mutex_lock(&wp->mutex);
+    __atomic_store_n(&wp->exit, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&wp->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wp->startcond);
+    pthread_cond_broadcast(&wp->parkcond);
+    pthread_mutex_unlock(&wp->mutex);
+
+    for (int i = 0; i < wp->nworkers; i++)
+        pthread_join(wp->threads[i], NULL);
+
+    for (int i = 0; i < zarray_size(wp->retired); i++) {
+        struct deque *deques;
+        zarray_get(wp->retired, i, &deques);
+        free(deques);
     }
 
+    pthread_mutex_destroy(&wp->mutex);
+    pthread_cond_destroy(&wp->startcond);
+    pthread_cond_destroy(&wp->endcond);
+    pthread_cond_destroy(&wp->parkcond);
+    free(wp->threads);
+    free(wp->deques);
+
+    pthread_mutex_destroy(&wp->runmutex);
+    zarray_destroy(wp->retired);
     zarray_destroy(wp->tasks);
     free(wp);
 }
 
 int workerpool_get_nthreads(workerpool_t *wp)
 {
-    return wp->nthreads;
+    return __atomic_load_n(&wp->nthreads, __ATOMIC_RELAXED);
+}
+
+void workerpool_set_nthreads(workerpool_t *wp, int nthreads)
+{
+    assert(nthreads > 0);
+
+    // (waiting for another thread's run, if there is one, but keeping
+    // the pool if this thread has tasks in it already.)
+    int held = pool_held(wp);
+    pool_hold(wp);
+
+    pool_start_workers(wp, nthreads - 1);
+    pool_default_spin(wp, nthreads);
+
+    pthread_mutex_lock(&wp->mutex);
+    __atomic_store_n(&wp->nthreads, nthreads, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&wp->parkcond);
+    pthread_mutex_unlock(&wp->mutex);
+
+    if (!held)
+        pool_release(wp);
+}
+
+size_t workerpool_get_memory(workerpool_t *wp)
+{
+    size_t sz = sizeof(workerpool_t) + 2 * sizeof(zarray_t) + wp->tasks->alloc * wp->tasks->el_sz;
+
+    sz += wp->nworkers * sizeof(pthread_t) + (wp->nworkers + 1) * sizeof(struct deque);
+    sz += wp->retired->alloc * wp->retired->el_sz + wp->retired_bytes;
+
+    return sz;
+}
+
+int workerpool_cost_chunks(int nthreads, const uint32_t *costs, int n, int tasks_per_thread,
+                           int *first, int *order)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += costs[i];
+
+    // (rounded up, so that the chunks closed at target each cost at
+    // least 1/(tasks_per_thread * nthreads) of the total.)
+    uint64_t maxchunks = (uint64_t) tasks_per_thread * nthreads;
+    uint64_t target = (total + maxchunks - 1) / maxchunks;
+    if (target == 0)
+        target = 1;
+
+    int nchunks = 0;
+    uint64_t cost = 0;
+
+    first[0] = 0;
+    for (int i = 0; i < n; i++) {
+        cost += costs[i];
+        if (cost >= target || i == n - 1) {
+            first[++nchunks] = i + 1;
+            cost = 0;
+        }
+    }
+
+    // workerpool_run gives each thread a contiguous share of the tasks
+    // (as many as floor(ntasks * (t + 1) / nthreads) - floor(ntasks * t
+    // / nthreads) for thread t), which it runs from the first, while
+    // idle threads take the last of the others'. Deal the chunks, in
+    // decreasing cost, to the heads of the shares in turn.
+    int filled[nthreads];
+    memset(filled, 0, sizeof(filled));
+
+    int t = 0;
+    for (int k = 0; k < nchunks; k++) {
+        int start, len;
+        while (1) {
+            start = (int) ((int64_t) nchunks * t / nthreads);
+            len = (int) ((int64_t) nchunks * (t + 1) / nthreads) - start;
+            if (filled[t] < len)
+                break;
+            t = (t + 1) % nthreads;
+        }
+
+        order[start + filled[t]++] = k;
+        t = (t + 1) % nthreads;
+    }
+
+    return nchunks;
+}
+
+void workerpool_set_spin(workerpool_t *wp, int us)
+{
+    wp->spin_us = us;
+    wp->spin_set = 1;
+}
+
+int workerpool_set_affinity(workerpool_t *wp, const int *cpus, int ncpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int i = 0; i < ncpus; i++) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+            return -1;
+        CPU_SET(cpus[i], &set);
+    }
+
+    for (int i = 0; i < wp->nworkers; i++) {
+        if (pthread_setaffinity_np(wp->threads[i], sizeof(set), &set) != 0)
+            return -1;
+    }
+
+    wp->affinity = set;
+    wp->has_affinity = 1;
+
+    return 0;
+#else
+    return -1;
+#endif
 }
 
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
@@ -162,41 +518,72 @@ void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
     t.f = f;
     t.p = p;
 
+    pool_hold(wp);
     zarray_add(wp->tasks, &t);
 }
 
 void workerpool_run_single(workerpool_t *wp)
 {
+    pool_hold(wp);
+
     for (int i = 0; i < zarray_size(wp->tasks); i++) {
         struct task *task;
         zarray_get_volatile(wp->tasks, i, &task);
+
+        int64_t t0 = trace_on() ? trace_ns() : 0;
         task->f(task->p);
+        if (t0)
+            trace_event("task", t0, trace_ns());
     }
 
     zarray_clear(wp->tasks);
+    pool_release(wp);
 }
 
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp)
 {
-    if (wp->nthreads > 1) {
-        wp->end_count = 0;
+    pool_hold(wp);
 
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
+    int ntasks = zarray_size(wp->tasks);
 
-        while (wp->end_count < wp->nthreads) {
-//            printf("caught %d\n", wp->end_count);
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
-        }
+    // not worth waking the other threads for.
+    if (wp->nthreads == 1 || ntasks <= 1) {
+        workerpool_run_single(wp);
+        return;
+    }
 
-        pthread_mutex_unlock(&wp->mutex);
+    __atomic_store_n(&wp->remaining, ntasks, __ATOMIC_RELAXED);
+    wp->scope = memstat_scope();
+    wp->perf_sink = perfcount_sink();
+
+    // give each thread a contiguous share of the tasks. (A thread
+    // still finishing the previous run may see these before it is
+    // woken, so they are released: whoever takes a task then also sees
+    // the task array and the count.)
+    for (int i = 0; i < wp->nthreads; i++) {
+        uint32_t head = (int64_t) ntasks * i / wp->nthreads;
+        uint32_t tail = (int64_t) ntasks * (i + 1) / wp->nthreads;
+        __atomic_store_n(&wp->deques[i].range, deque_range(head, tail), __ATOMIC_RELEASE);
+    }
 
-        wp->taskspos = 0;
+    pthread_mutex_lock(&wp->mutex);
+    __atomic_add_fetch(&wp->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wp->startcond);
+    pthread_mutex_unlock(&wp->mutex);
 
-        zarray_clear(wp->tasks);
+    worker_run_tasks(wp, 0, wp->nthreads, wp->deques);
 
-    } else {
-        workerpool_run_single(wp);
-    }
+    // the other threads are finishing their last tasks.
+    int64_t t0 = trace_on() ? trace_ns() : 0;
+    spin_until(wp, &wp->remaining, 0, 1);
+    pthread_mutex_lock(&wp->mutex);
+    while (__atomic_load_n(&wp->remaining, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&wp->endcond, &wp->mutex);
+    pthread_mutex_unlock(&wp->mutex);
+    if (t0)
+        trace_event("wait", t0, trace_ns());
+
+    zarray_clear(wp->tasks);
+    pool_release(wp);
 }
@@ -32,12 +32,17 @@ either expressed or implied, of the FreeBSD Project.
 #ifndef _WORKERPOOL_H
 #define _WORKERPOOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "zarray.h"
 
 typedef struct workerpool workerpool_t;
 
 // as a special case, if nthreads==1, no additional threads are
-// created, and workerpool_run will run synchronously.
+// created, and workerpool_run will run synchronously. Otherwise
+// nthreads-1 threads are created, and the thread calling
+// workerpool_run works alongside them.
 workerpool_t *workerpool_create(int nthreads);
 void workerpool_destroy(workerpool_t *wp);
 
@@ -51,4 +56,50 @@ void workerpool_run_single(workerpool_t *wp);
 
 int workerpool_get_nthreads(workerpool_t *wp);
 
+// Change the number of threads of the pool in place: threads beyond
+// the new number are parked (left asleep, ready to be unparked by a
+// later workerpool_set_nthreads), and new ones are only started if
+// the pool has never had as many. Waits for the run of another
+// thread, if one is using the pool, but not for anything else. The
+// work of callers which divided it up for the old number (see
+// workerpool_get_nthreads) is still run correctly, on the new number
+// of threads.
+void workerpool_set_nthreads(workerpool_t *wp, int nthreads);
+
+// The memory the pool has allocated (its tasks, threads and deques).
+// The stacks of its threads are not counted: they are address space
+// reserved (8 MB each, by default), of which a thread's tasks touch
+// only what they use.
+size_t workerpool_get_memory(workerpool_t *wp);
+
+// A pool may be shared, e.g. by several detectors running in
+// different threads: each thread's tasks are added and run in turn
+// (the first workerpool_add_task of a thread waits until the pool is
+// not in use by another thread, and the workerpool_run that follows
+// frees it again).
+
+// How long (in microseconds) idle threads spin, waiting for more
+// work, before they sleep. The default is 50, or 0 if the pool has
+// more threads than there are CPUs.
+void workerpool_set_spin(workerpool_t *wp, int us);
+
+// Restrict the threads of the pool (not including those calling
+// workerpool_run) to the ncpus CPUs listed in cpus. Returns 0 on
+// success, or -1 if the affinity could not be set (or this isn't
+// supported).
+int workerpool_set_affinity(workerpool_t *wp, const int *cpus, int ncpus);
+
+// Divide n items, whose costs are given (roughly) in decreasing
+// order, into chunks of about equal cost, about tasks_per_thread of
+// them per thread (of nthreads, e.g. workerpool_get_nthreads), to be
+// run as a task each. An item costlier than a
+// chunk is a chunk of its own. Chunk k is items [first[k],
+// first[k+1]), and the i'th task to add is chunk order[i]: in that
+// order, each thread starts on one of the costliest chunks, rather
+// than one or two threads being left with all of them. Returns the
+// number of chunks, which is at most tasks_per_thread * nthreads + 1
+// (the room needed in order, and one more in first).
+int workerpool_cost_chunks(int nthreads, const uint32_t *costs, int n, int tasks_per_thread,
+                           int *first, int *order);
+
 #endif
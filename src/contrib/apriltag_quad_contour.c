@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <limits.h>
 #include "apriltag_quad_contour.h"
+#include "apriltag_scratch.h"
 #include "contour.h"
 #include "box.h"
 #include "lm.h"
@@ -380,6 +381,8 @@ void apriltag_quad_contour_defaults(struct apriltag_quad_contour_params* qcp) {
   qcp->contour_margin = 5.0;
   qcp->corner_skip_scl = 0.0625;
   qcp->corner_skip_bias = 0.5;
+  qcp->line_sweep = 1;
+  qcp->stream_threshold = 1;
   
 }
 
@@ -501,13 +504,70 @@ static inline int lines_from_corners_contour(const apriltag_detector_t* td,
 
 }
 
-/* The workhorse of the quad detection: takes an individual contour and
-   tries to extract a quad from it, with various types of rejection. */
-static inline int quad_from_contour(const apriltag_detector_t* td,
-                                    const image_u8_t* im,
-                                    const contour_info_t* ci,
-                                    struct quad* q) {
+/* Could the contour be the border of a tag of the expected size (in
+   pixels of an image decimated by scale)? The larger side of its
+   bounding box is the size of the tag (give or take a couple of
+   pixels, since the thresholded border is not exactly where the
+   tag's is), and a tag that size has about twice as many contour
+   points. */
+static inline int contour_size_ok(const apriltag_detector_t* td,
+                                  const contour_info_t* ci,
+                                  float scale) {
+
+  if (td->min_tag_size <= 0 && td->max_tag_size <= 0) {
+    return 1;
+  }
+
+  float min_size = td->min_tag_size / scale;
+  float max_size = td->max_tag_size / scale;
+
+  const float slack = 2;
+
+  int n = zarray_size(ci->points);
+  if (n < 2*(min_size - slack)) {
+    return 0;
+  }
+
+  const contour_point_t* pts = (const contour_point_t*)ci->points->data;
+  uint32_t xmin = pts[0].x, xmax = pts[0].x, ymin = pts[0].y, ymax = pts[0].y;
+
+  for (int i=1; i<n; ++i) {
+    if (pts[i].x < xmin) { xmin = pts[i].x; }
+    if (pts[i].x > xmax) { xmax = pts[i].x; }
+    if (pts[i].y < ymin) { ymin = pts[i].y; }
+    if (pts[i].y > ymax) { ymax = pts[i].y; }
+  }
+
+  // the points are the border pixels themselves.
+  float size = 1 + (xmax - xmin > ymax - ymin ? xmax - xmin : ymax - ymin);
+
+  if (size < min_size - slack || (max_size > 0 && size > max_size + slack)) {
+    return 0;
+  }
+
+  return 1;
+
+}
 
+/* The enum apriltag_reject of a non-zero result of contour_prefilter
+   or quad_from_contour. */
+static inline int contour_reject(int result) {
+  switch (result) {
+    case -1: return APRILTAG_REJECT_CLUSTER_PIXELS;
+    case -2: return APRILTAG_REJECT_CLUSTER_SIZE;
+    case 4: case 5: return APRILTAG_REJECT_LINE_FIT;
+    default: return APRILTAG_REJECT_SHAPE;
+  }
+}
+
+/* The cheap rejections of quad_from_contour, made before the
+   contours are handed out to the workers: returns -1 (too small), -2
+   (outside the tag sizes) or 1 (as quad_from_contour would) if ci
+   can't be a quad, or 0, setting ctr to its centroid. */
+static inline int contour_prefilter(const apriltag_detector_t* td,
+                                    const contour_info_t* ci,
+                                    float scale,
+                                    float ctr[2]) {
 
   /* Look at perimiter and area */
   const int min_perimeter = 4*td->qcp.min_side_length;
@@ -521,21 +581,34 @@ static inline int quad_from_contour(const apriltag_detector_t* td,
     return -1;
   }
 
+  if (!contour_size_ok(td, ci, scale)) {
+    return -2;
+  }
+
   /* Compute area and centroid. */
-  float ctr[2];
   float area = fabs(contour_area_centroid(ci->points, ctr));
 
   // area check
   if (area < min_area) {
     return 1;
   }
-      
+
+  return 0;
+
+}
+
+/* The workhorse of the quad detection: takes an individual contour
+   (which has passed contour_prefilter, finding its centroid ctr) and
+   tries to extract a quad from it, with various types of rejection. */
+static inline int quad_from_contour(const apriltag_detector_t* td,
+                                    const image_u8_t* im,
+                                    const contour_info_t* ci,
+                                    const float ctr[2],
+                                    struct quad* q) {
+
   int idx[4];
   float l, w;
 
-  q->H = 0;
-  q->Hinv = 0;
-    
   quad_from_points(ci->points, ctr, q, idx, &l, &w);
       
   // diagonal aspect ratio check
@@ -611,10 +684,22 @@ static inline int quad_from_contour(const apriltag_detector_t* td,
 
 }
 
+/* The result of a candidate left unfit because the frame ran out of
+   time (see td->budget_utime): neither a quad nor a rejection. */
+#define QFC_OUT_OF_TIME (-3)
+
+/* A contour which passed contour_prefilter. */
+typedef struct qfc_candidate {
+  int index; // in the contours
+  float ctr[2];
+} qfc_candidate_t;
+
 typedef struct qfc_info {
+  apriltag_detect_context_t* ctx;
   const apriltag_detector_t* td;
   const image_u8_t* im;
   const contour_info_t* contours;
+  const qfc_candidate_t* candidates;
   struct quad* quads;
   int* results;
   int count;
@@ -626,18 +711,29 @@ static void qfc_task(void* p) {
   qfc_info_t* qfc = (qfc_info_t*)p;
 
   for (int i=0; i<qfc->count; ++i) {
-    qfc->results[i] = quad_from_contour(qfc->td, qfc->im,
-                                        qfc->contours + i,
-                                        qfc->quads + i);
+    const qfc_candidate_t* cand = qfc->candidates + i;
+    /* (the quads fit so far are still decoded.) */
+    if (apriltag_detect_context_expired(qfc->ctx, APRILTAG_DEGRADED_SEARCH)) {
+      for (; i<qfc->count; ++i) {
+        qfc->results[qfc->candidates[i].index] = QFC_OUT_OF_TIME;
+      }
+      break;
+    }
+    qfc->results[cand->index] = quad_from_contour(qfc->td, qfc->im,
+                                                  qfc->contours + cand->index,
+                                                  cand->ctr,
+                                                  qfc->quads + i);
   }
   
 }
 
-zarray_t* quads_from_contours(const apriltag_detector_t* td,
+zarray_t* quads_from_contours(apriltag_detect_context_t* ctx,
                               const image_u8_t* im,
-                              const zarray_t* contours) {
+                              const zarray_t* contours,
+                              float scale) {
 
-  zarray_t* quads = zarray_create(sizeof(struct quad));
+  const apriltag_detector_t* td = ctx->td;
+  zarray_t* quads = apriltag_scratch_quads(ctx->scratch, sizeof(struct quad));
 
   image_u32_t* debug_vis = NULL;
   
@@ -647,53 +743,77 @@ zarray_t* quads_from_contours(const apriltag_detector_t* td,
 
   int nc = zarray_size(contours);
 
-  /* Step 3: divide list of contours into a worker pool, and tell
-     workers to run the qfc_task, which is just a simple wrapper on
-     quad_from_contour. */
+  /* Step 3: reject what contour_prefilter can, cheaply, then divide
+     the rest of the contours among a worker pool, and tell workers to
+     run the qfc_task, which is just a simple wrapper on
+     quad_from_contour. The arrays are kept by the scratch from frame
+     to frame, since there may be tens of thousands of contours. */
 
-  struct quad wquads[nc];
-  int results[nc];
   const contour_info_t* ctrs = (const contour_info_t*)contours->data;
 
-#if 1
+  apriltag_scratch_t* s = ctx->scratch;
+  int* results = apriltag_scratch_buffer(&s->qfc_results, (nc+1) * sizeof(int));
+  qfc_candidate_t* candidates =
+    apriltag_scratch_buffer(&s->qfc_candidates, (nc+1) * sizeof(qfc_candidate_t));
+
+  int ncand = 0;
+
+  for (int c=0; c<nc; ++c) {
+    results[c] = contour_prefilter(td, ctrs + c, scale, candidates[ncand].ctr);
+    if (results[c] == 0) {
+      candidates[ncand++].index = c;
+    }
+  }
+
+  struct quad* wquads = apriltag_scratch_buffer(&s->qfc_quads,
+                                                (ncand+1) * sizeof(struct quad));
 
-  int chunksize = 1 + nc / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-  //int chunksize = 1 + nc / td->nthreads;
+  int chunksize = 1 + ncand / (APRILTAG_TASKS_PER_THREAD_TARGET * ctx->nthreads);
 
-  qfc_info_t qfcs[nc / chunksize + 1];
+  qfc_info_t* qfcs = apriltag_scratch_buffer(&s->qfc_tasks,
+                                             (ncand / chunksize + 1) * sizeof(qfc_info_t));
 
   int ntasks = 0;
 
-  for (int i=0; i<nc; i+=chunksize) {
+  for (int i=0; i<ncand; i+=chunksize) {
+    qfcs[ntasks].ctx = ctx;
     qfcs[ntasks].td = td;
     qfcs[ntasks].im = im;
-    qfcs[ntasks].contours = ctrs + i;
+    qfcs[ntasks].contours = ctrs;
+    qfcs[ntasks].candidates = candidates + i;
     qfcs[ntasks].quads = wquads + i;
-    qfcs[ntasks].results = results + i;
-    qfcs[ntasks].count = imin(nc, i+chunksize) - i;
-    workerpool_add_task(td->wp, qfc_task, qfcs+ntasks);
+    qfcs[ntasks].results = results;
+    qfcs[ntasks].count = imin(ncand, i+chunksize) - i;
+    workerpool_add_task(ctx->wp, qfc_task, qfcs+ntasks);
     ++ntasks;
   }
 
-  workerpool_run(td->wp);
+  workerpool_run(ctx->wp);
 
-#else
+  ctx->stats.nclusters += nc;
 
-  qfc_info_t p;
-  p.td = td;
-  p.im = im;
-  p.contours = ctrs;
-  p.quads = wquads;
-  p.results = results;
-  p.count = nc;
-  qfc_task(&p);
+  for (int c=0, k=0; c<nc; ++c) {
+
+    // the quad of the k'th candidate
+    const struct quad* wq = NULL;
+    if (k < ncand && candidates[k].index == c) {
+      wq = wquads + k++;
+    }
+
+    if (results[c] == QFC_OUT_OF_TIME) {
+      continue;
+    }
 
-#endif
-  
-  for (int c=0; c<nc; ++c) {
-    
     if (results[c] == 0) {
-      zarray_add(quads, wquads+c);
+      zarray_add(quads, wq);
+    } else if (results[c] < 0) {
+      ctx->stats.ncluster_rejected++;
+    } else {
+      ctx->stats.nquad_fit_rejected++;
+    }
+
+    if (results[c] != 0) {
+      ctx->stats.nrejected[contour_reject(results[c])]++;
     }
 
     if (td->debug && results[c] >= 0) {
@@ -721,9 +841,35 @@ zarray_t* quads_from_contours(const apriltag_detector_t* td,
 }
 
 
+/* The rows of the thresholded image, as a contour_row_source_t: each
+   band of rows is thresholded by a box_threshold_stream_t of its own. */
+typedef struct threshold_rows {
+  const image_u8_t* im;
+  const apriltag_detector_t* td;
+} threshold_rows_t;
+
+static void* threshold_rows_begin(void* user, int y0) {
+  const threshold_rows_t* tr = (const threshold_rows_t*)user;
+  return box_threshold_stream_create(tr->im, 1,
+                                     tr->td->qcp.threshold_neighborhood_size,
+                                     tr->td->qcp.threshold_value,
+                                     y0);
+}
+
+static void threshold_rows_next(void* state, uint64_t* row) {
+  box_threshold_stream_next((box_threshold_stream_t*)state, row);
+}
+
+static void threshold_rows_end(void* state) {
+  box_threshold_stream_destroy((box_threshold_stream_t*)state);
+}
+
 /* Main function added by Matt. */
-zarray_t* apriltag_quad_contour(apriltag_detector_t* td,
-                                image_u8_t* im) {
+zarray_t* apriltag_quad_contour(apriltag_detect_context_t* ctx,
+                                image_u8_t* im,
+                                float decimate) {
+
+  const apriltag_detector_t* td = ctx->td;
 
   if (!td->quad_contours) {
     fprintf(stderr, "quad_contours is not set in tag detector!\n");
@@ -731,21 +877,66 @@ zarray_t* apriltag_quad_contour(apriltag_detector_t* td,
     exit(1);
   }
 
-  /* Step 1: box blur & threshold (adaptive threshold) */
-  image_u8_t* thresh = box_threshold_mt(im, 255, 1,
-                                        td->qcp.threshold_neighborhood_size,
-                                        td->qcp.threshold_value,
-                                        td->wp);
+  /* quad_from_contour rejects the holes and the contours of fewer
+     than 4*min_side_length points, so the sweep needn't make them
+     (unless they are to be drawn). */
+  int outer_only = !td->debug;
+  int min_points = td->debug ? 0 : 4*td->qcp.min_side_length;
+
+  zarray_t* contours;
+
+  if (td->qcp.line_sweep && td->qcp.stream_threshold && !td->debug) {
+
+    /* Steps 1 and 2 together: threshold each row as the sweep
+       reaches it. */
+    threshold_rows_t tr = { im, td };
+    contour_row_source_t src = {
+      .width = im->width,
+      .height = im->height,
+      .user = &tr,
+      .begin = threshold_rows_begin,
+      .next = threshold_rows_next,
+      .end = threshold_rows_end,
+    };
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_THRESHOLD, "threshold");
+    contours = contour_detect_sweep_rows_mt(&src, outer_only, min_points,
+                                            ctx->wp);
+
+  } else {
+
+    /* Step 1: box blur & threshold (adaptive threshold) */
+    image_u1_t* thresh = box_threshold_u1_mt(im, 1,
+                                             td->qcp.threshold_neighborhood_size,
+                                             td->qcp.threshold_value,
+                                             ctx->wp);
+
+    if (td->debug) {
+      image_u8_t* thresh8 = image_u8_create(im->width, im->height);
+      image_u1_to_u8(thresh, thresh8, 255);
+      image_u8_write_pnm(thresh8, "debug_threshold.pnm");
+      image_u8_destroy(thresh8);
+    }
+
+    apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_THRESHOLD, "threshold");
+
+    /* Step 2: contour detection */
+    contours = (td->qcp.line_sweep ?
+                contour_detect_sweep_u1_mt(thresh, outer_only,
+                                           min_points, ctx->wp) :
+                contour_detect_u1(thresh));
+
+    image_u1_destroy(thresh);
 
-  if (td->debug) {
-    image_u8_write_pnm(thresh, "debug_threshold.pnm");
   }
 
-  timeprofile_stamp(td->tp, "threshold");
+  apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_SEGMENT, "contour");
 
-  /* Step 2: contour detection */
-  zarray_t* contours = contour_detect(thresh); 
-  timeprofile_stamp(td->tp, "contour");
+  /* out of time, there are no quads to be had from this image. */
+  if (apriltag_detect_context_expired(ctx, APRILTAG_DEGRADED_SEARCH)) {
+    contour_destroy(contours);
+    return apriltag_scratch_quads(ctx->scratch, sizeof(struct quad));
+  }
 
   if (td->debug) {
     image_u32_t* display = im8_to_im32_dim(im, 0.5);
@@ -762,11 +953,10 @@ zarray_t* apriltag_quad_contour(apriltag_detector_t* td,
   }
 
   /* Steps 3-N: extract quads from contours (see above). */
-  zarray_t* quads = quads_from_contours(td, im, contours);
-  timeprofile_stamp(td->tp, "quads from contours");
+  zarray_t* quads = quads_from_contours(ctx, im, contours, decimate > 1 ? decimate : 1);
+  apriltag_detect_context_stamp(ctx, APRILTAG_STAGE_QUAD_FIT, "quads from contours");
 
   contour_destroy(contours);
-  image_u8_destroy(thresh);
 
   return quads;
   
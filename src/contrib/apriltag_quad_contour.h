@@ -11,7 +11,9 @@ extern "C" {
 #endif
 
 void apriltag_quad_contour_defaults(struct apriltag_quad_contour_params* qcp);
-zarray_t* apriltag_quad_contour(apriltag_detector_t* td, image_u8_t* im);
+// im is the input image decimated by decimate (to which
+// td->min_tag_size and td->max_tag_size refer), for ctx->td.
+zarray_t* apriltag_quad_contour(apriltag_detect_context_t* ctx, image_u8_t* im, float decimate);
 
 #ifdef __cplusplus
 }
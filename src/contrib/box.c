@@ -9,24 +9,6 @@
 #include <pthread.h>
 #include <math.h>
 
-#ifdef __linux
-#include <malloc.h>
-
-int my_memalign(void** pptr, size_t alignment, size_t size) {
-  *pptr = memalign(alignment, size);
-  int fail = (!*pptr);
-  return fail;
-}
-
-#else
-
-#define my_memalign posix_memalign
-
-#endif
-
-
-
-
 /*
 #ifdef NDEBUG
 #undef NDEBUG
@@ -41,70 +23,18 @@ static inline int ceildivide(int a, int b) {
   return x;
 }
 
-image_u8_t* image_u8_aligned64(int width, int height) {
-
-  int stride = width;
-
-  if (stride & 0x3f) {
-    stride += 64 - (stride & 0x3f);
-  }
-
-  assert(stride % 64 == 0);
-
-  void* vptr = 0;
-
-  size_t size = height * stride * sizeof(uint8_t);
-
-  int status = my_memalign(&vptr, 64, size);
-  
-  if (status != 0 || !vptr) {
-    return NULL;
-  }
-
-
-  image_u8_t tmp = {
-    .width = width,
-    .height = height,
-    .stride = stride,
-    .buf = vptr
-  };
-
-  image_u8_t* img = (image_u8_t*)malloc(sizeof(image_u8_t));
-
-  memcpy(img, &tmp, sizeof(tmp));
-
+// (image_u8_create and image_u32_create align every row to 64 bytes,
+// see IMAGE_U8_ALIGNMENT.)
+static image_u8_t* image_u8_aligned64(int width, int height) {
+  image_u8_t* img = image_u8_create(width, height);
+  assert(image_u8_aligned(img));
   return img;
-  
 }
 
-image_u32_t* image_u32_aligned64(int width, int height) {
-
-  int stride = width;
-
-  if (stride & 0xf) {
-    stride += 16 - (stride & 0xf);
-  }
-
-  assert((stride * sizeof(uint32_t)) % 64 == 0);
-  
-  void* vptr = 0;
-
-  size_t size = height * stride * sizeof(uint32_t);
-  int status = my_memalign(&vptr, 64, size);
-  
-  if (status != 0 || !vptr) {
-    return NULL;
-  }
-
-  image_u32_t* img = (image_u32_t*)malloc(sizeof(image_u32_t));
-  
-  img->width = width;
-  img->height = height;
-  img->stride = stride;
-  img->buf = vptr;
-
+static image_u32_t* image_u32_aligned64(int width, int height) {
+  image_u32_t* img = image_u32_create(width, height);
+  assert(((uintptr_t) img->buf % 64) == 0 && (img->stride * sizeof(uint32_t)) % 64 == 0);
   return img;
-  
 }
 
 enum {
@@ -266,64 +196,217 @@ image_u8_t* box_filter_border_replicate_mt(const image_u8_t* src_img,
 }
 
 
-static inline void box_threshold_rows(uint8_t* dst_row, int dst_stride, 
-                                      const uint32_t* sum_row, int sum_stride,
-                                      const uint8_t* src_row, int src_stride,
-                                      int nx, int ny,
-                                      int sz, int tau,
-                                      int gt, int lt) {
+/* The box threshold streams down each block of rows, keeping only the
+   sums over the window's rows of each column (of the image, and of l
+   replicated columns on either side), which it slides down a row at a
+   time and across each row a pixel at a time. A pixel is set if
 
-  int s2 = sz*sz;
-  int s22 = s2/2; // for rounding?
-  
-  int ob = sum_stride*sz;
-  int od = ob + sz;
-  
-  for (int y=0; y<ny; ++y) {
-    uint8_t* dst = dst_row;
-    const uint32_t* sum = sum_row;
-    const uint8_t* src = src_row;
-    for (int x=0; x<nx; ++x) {
-      int t = (sum[od] - sum[ob] - sum[sz] + sum[0] + s22)/s2 - tau;
-      int s = *src++;
-      *dst++ = s > t ? gt : lt;
-      ++sum;
+     s > (box + s2/2)/s2 - tau,
+
+   where box is the sum of the window, or without the division (as
+   s + tau is an integer): (s + tau)*s2 > box + s2/2. */
+
+static inline const uint8_t* box_src_row(const image_u8_t* im, int y) {
+  y = y < 0 ? 0 : (y >= im->height ? im->height-1 : y);
+  return im->buf + y*im->stride;
+}
+
+// The column sums of the window of rows [y-l, y+l].
+static inline void box_colsums_init(uint32_t* colsum, const image_u8_t* im,
+                                    int y, int l) {
+
+  memset(colsum + l, 0, im->width * sizeof(uint32_t));
+
+  for (int dy=-l; dy<=l; ++dy) {
+    const uint8_t* row = box_src_row(im, y+dy);
+    for (int x=0; x<im->width; ++x) {
+      colsum[l+x] += row[x];
     }
-    dst_row += dst_stride;
-    sum_row += sum_stride;
-    src_row += src_stride;
   }
 
+}
+
+// Slide the window down a row to [y-l, y+l], from [y-l-1, y+l-1].
+static inline void box_colsums_slide(uint32_t* colsum, const image_u8_t* im,
+                                     int y, int l) {
+
+  const uint8_t* add = box_src_row(im, y+l);
+  const uint8_t* sub = box_src_row(im, y-l-1);
+
+  if (add == sub) {
+    return;
+  }
+
+  for (int x=0; x<im->width; ++x) {
+    colsum[l+x] += add[x] - sub[x];
+  }
+
+}
+
+static inline void box_colsums_replicate(uint32_t* colsum, int width, int l) {
+  for (int i=0; i<l; ++i) {
+    colsum[i] = colsum[l];
+    colsum[l+width+i] = colsum[l+width-1];
+  }
+}
+
+static inline void box_threshold_row(uint8_t* dst, const uint32_t* colsum,
+                                     const uint8_t* src, int nx,
+                                     int sz, int tau, int gt, int lt) {
+
+  int s2 = sz*sz;
+  int s22 = s2/2;
+
+  uint32_t box = 0;
+  for (int i=0; i<sz-1; ++i) {
+    box += colsum[i];
+  }
+
+  for (int x=0; x<nx; ++x) {
+    box += colsum[x+sz-1];
+    dst[x] = (src[x] + tau)*s2 > (int)box + s22 ? gt : lt;
+    box -= colsum[x];
+  }
+
+}
+
+// The same, but writes packed bits: set where the 8 bit output would
+// be non-zero.
+static inline void box_threshold_row_u1(uint64_t* dst, const uint32_t* colsum,
+                                        const uint8_t* src, int nx,
+                                        int sz, int tau, int invert) {
+
+  int s2 = sz*sz;
+  int s22 = s2/2;
+
+  uint32_t box = 0;
+  for (int i=0; i<sz-1; ++i) {
+    box += colsum[i];
+  }
+
+  int nwords = (nx + 63) / 64;
+
+  for (int i=0; i<nwords; ++i) {
+    int n = nx - 64*i < 64 ? nx - 64*i : 64;
+    uint64_t word = 0;
+    for (int b=0; b<n; ++b) {
+      box += colsum[sz-1];
+      word |= ((uint64_t) (((*src++ + tau)*s2 > (int)box + s22) != invert)) << b;
+      box -= *colsum++;
+    }
+    dst[i] = word;
+  }
 
 }
 
 
 typedef struct box_threshold_info {
-  uint8_t* dst;
-  const uint32_t* sum;
-  const uint8_t* src;
-  int dst_stride;
-  int sum_stride;
-  int src_stride;
-  int nx;
-  int ny;
+  const image_u8_t* src;
+  image_u8_t* dst;
+  image_u1_t* dst1; // if not NULL, write packed bits here instead
+  int y0;
+  int y1;
   int sz;
   int tau;
   int gt;
   int lt;
+  int invert;
 } box_threshold_info_t;
 
 void box_threshold_task(void* p) {
 
   box_threshold_info_t* info = (box_threshold_info_t*)p;
 
-  box_threshold_rows(info->dst, info->dst_stride,
-                     info->sum, info->sum_stride,
-                     info->src, info->src_stride,
-                     info->nx, info->ny,
-                     info->sz, info->tau,
-                     info->gt, info->lt);
-  
+  const image_u8_t* src = info->src;
+  int l = info->sz/2;
+
+  if (info->y0 >= info->y1) {
+    return;
+  }
+
+  uint32_t* colsum = malloc((src->width + 2*l) * sizeof(uint32_t));
+
+  for (int y=info->y0; y<info->y1; ++y) {
+
+    if (y == info->y0) {
+      box_colsums_init(colsum, src, y, l);
+    } else {
+      box_colsums_slide(colsum, src, y, l);
+    }
+    box_colsums_replicate(colsum, src->width, l);
+
+    const uint8_t* src_row = src->buf + y*src->stride;
+
+    if (info->dst1) {
+      box_threshold_row_u1(image_u1_row(info->dst1, y), colsum, src_row,
+                           src->width, info->sz, info->tau, info->invert);
+    } else {
+      box_threshold_row(info->dst->buf + y*info->dst->stride, colsum, src_row,
+                        src->width, info->sz, info->tau, info->gt, info->lt);
+    }
+
+  }
+
+  free(colsum);
+
+}
+
+struct box_threshold_stream {
+  const image_u8_t* src;
+  int sz;
+  int tau;
+  int invert;
+  int y;            // the next row
+  int started;
+  uint32_t* colsum;
+};
+
+box_threshold_stream_t* box_threshold_stream_create(const image_u8_t* src,
+                                                    int invert,
+                                                    int sz,
+                                                    int tau,
+                                                    int y0) {
+
+  box_threshold_stream_t* s = calloc(1, sizeof(box_threshold_stream_t));
+
+  s->src = src;
+  s->sz = 2*(sz/2)+1;
+  s->tau = tau;
+  s->invert = invert;
+  s->y = y0;
+  s->colsum = malloc((src->width + 2*(sz/2)) * sizeof(uint32_t));
+
+  return s;
+
+}
+
+void box_threshold_stream_next(box_threshold_stream_t* s, uint64_t* row) {
+
+  const image_u8_t* src = s->src;
+  int l = s->sz/2;
+
+  assert(s->y < src->height);
+
+  if (!s->started) {
+    box_colsums_init(s->colsum, src, s->y, l);
+    s->started = 1;
+  } else {
+    box_colsums_slide(s->colsum, src, s->y, l);
+  }
+  box_colsums_replicate(s->colsum, src->width, l);
+
+  box_threshold_row_u1(row, s->colsum, src->buf + s->y*src->stride,
+                       src->width, s->sz, s->tau, s->invert);
+
+  ++s->y;
+
+}
+
+void box_threshold_stream_destroy(box_threshold_stream_t* s) {
+  if (s) {
+    free(s->colsum);
+    free(s);
+  }
 }
 
 image_u8_t* box_threshold(const image_u8_t* src_img, 
@@ -336,73 +419,84 @@ image_u8_t* box_threshold(const image_u8_t* src_img,
 
 }
 
-image_u8_t* box_threshold_mt(const image_u8_t* src_img, 
-                             int max_value, 
-                             int invert, 
-                             int sz, 
-                             int tau,
-                             workerpool_t* wp) {
-
-  image_u8_t* dst_img = image_u8_aligned64(src_img->width,
-                                           src_img->height);
+// Threshold src_img into exactly one of dst8 or dst1.
+static void box_threshold_into(const image_u8_t* src_img, 
+                               int max_value, 
+                               int invert, 
+                               int sz, 
+                               int tau,
+                               workerpool_t* wp,
+                               image_u8_t* dst8,
+                               image_u1_t* dst1) {
 
   int l = sz/2;
   sz = 2*l+1;
 
-  image_u32_t* sum_img = integrate_border_replicate_mt(src_img, l, wp);
-
   int gt = invert ? 0 : max_value;
   int lt = max_value - gt;
 
   int nt = wp ? workerpool_get_nthreads(wp) : 1;
 
-  if (wp == NULL || nt <= 1) {
-
-    box_threshold_rows(dst_img->buf, dst_img->stride,
-                       sum_img->buf, sum_img->stride,
-                       src_img->buf, src_img->stride,
-                       src_img->width, src_img->height,
-                       sz, tau, gt, lt);
+  int ntasks = (wp == NULL || nt <= 1) ? 1 : nt;
+  int rows_per_block = ceildivide(src_img->height, ntasks);
+
+  box_threshold_info_t bts[ntasks];
+
+  int y0 = 0;
+
+  for (int i=0; i<ntasks; ++i) {
+    int y1 = y0 + rows_per_block;
+    if (y1 > src_img->height) { y1 = src_img->height; }
+    if (y0 > y1) { y0 = y1; }
+    bts[i].src = src_img;
+    bts[i].dst = dst8;
+    bts[i].dst1 = dst1;
+    bts[i].y0 = y0;
+    bts[i].y1 = y1;
+    bts[i].sz = sz;
+    bts[i].tau = tau;
+    bts[i].gt = gt;
+    bts[i].lt = lt;
+    bts[i].invert = invert;
+    y0 = y1;
+  }
 
+  if (ntasks == 1) {
+    box_threshold_task(bts);
   } else {
+    for (int i=0; i<ntasks; ++i) {
+      workerpool_add_task(wp, box_threshold_task, bts+i);
+    }
+    workerpool_run(wp);
+  }
+
+}
+
+image_u8_t* box_threshold_mt(const image_u8_t* src_img, 
+                             int max_value, 
+                             int invert, 
+                             int sz, 
+                             int tau,
+                             workerpool_t* wp) {
 
-    int rows_per_block = ceildivide(dst_img->height, nt);
+  image_u8_t* dst_img = image_u8_aligned64(src_img->width,
+                                           src_img->height);
 
-    box_threshold_info_t bts[nt];
+  box_threshold_into(src_img, max_value, invert, sz, tau, wp, dst_img, NULL);
 
-    int y0 = 0;
-    uint8_t* dst_row = dst_img->buf;
-    const uint32_t* sum_row = sum_img->buf;
-    const uint8_t* src_row = src_img->buf;
+  return dst_img;
 
-    for (int i=0; i<nt; ++i) {
-      int y1 = y0 + rows_per_block;
-      if (y1 > src_img->height) { y1 = src_img->height; }
-      bts[i].dst = dst_row;
-      bts[i].sum = sum_row;
-      bts[i].src = src_row;
-      bts[i].dst_stride = dst_img->stride;
-      bts[i].sum_stride = sum_img->stride;
-      bts[i].src_stride = src_img->stride;
-      bts[i].nx = dst_img->width;
-      bts[i].ny = y1 - y0;
-      bts[i].sz = sz;
-      bts[i].tau = tau;
-      bts[i].gt = gt;
-      bts[i].lt = lt;
-      dst_row += rows_per_block * dst_img->stride;
-      sum_row += rows_per_block * sum_img->stride;
-      src_row += rows_per_block * src_img->stride;
-      workerpool_add_task(wp, box_threshold_task, bts+i);
-      y0 = y1;
-    }
+}
 
-    workerpool_run(wp);
+image_u1_t* box_threshold_u1_mt(const image_u8_t* src_img, 
+                                int invert, 
+                                int sz, 
+                                int tau,
+                                workerpool_t* wp) {
 
-  }
-                     
+  image_u1_t* dst_img = image_u1_create(src_img->width, src_img->height);
 
-  image_u32_destroy(sum_img);
+  box_threshold_into(src_img, 1, invert, sz, tau, wp, NULL, dst_img);
 
   return dst_img;
 
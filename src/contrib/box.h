@@ -1,6 +1,7 @@
 #ifndef _BOX_H
 #define _BOX_H
 
+#include "image_u1.h"
 #include "image_u8.h"
 #include "image_u32.h"
 #include "workerpool.h"
@@ -34,6 +35,31 @@ image_u8_t* box_threshold_mt(const image_u8_t* src,
                              int tau,
                              workerpool_t* wp);
 
+// box_threshold_mt, packed: a pixel is set where box_threshold_mt
+// would write max_value.
+image_u1_t* box_threshold_u1_mt(const image_u8_t* src,
+                                int invert,
+                                int sz, 
+                                int tau,
+                                workerpool_t* wp);
+
+// Thresholds src a row at a time, from row y0 down, as
+// box_threshold_u1_mt does, keeping only the sums of the window's
+// columns (and none of the rows already thresholded).
+typedef struct box_threshold_stream box_threshold_stream_t;
+
+box_threshold_stream_t* box_threshold_stream_create(const image_u8_t* src,
+                                                    int invert,
+                                                    int sz,
+                                                    int tau,
+                                                    int y0);
+
+// Write the packed bits of the next row (as image_u1_row lays them
+// out) to row.
+void box_threshold_stream_next(box_threshold_stream_t* s, uint64_t* row);
+
+void box_threshold_stream_destroy(box_threshold_stream_t* s);
+
 #ifdef __cplusplus
 }
 #endif
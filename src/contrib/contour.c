@@ -234,6 +234,8 @@ void debug_print_image(FILE* fp, const cimage_t* im) {
 
 }
 
+static zarray_t* contour_detect_cimage(cimage_t* im);
+
 zarray_t* contour_detect(const image_u8_t* im8) {
   
 
@@ -257,6 +259,38 @@ zarray_t* contour_detect(const image_u8_t* im8) {
     dst += im->stride;
   }
 
+  return contour_detect_cimage(im);
+
+}
+
+zarray_t* contour_detect_u1(const image_u1_t* im1) {
+
+  cimage_t* im = cimage_create(im1->width, im1->height);
+
+  memset(im->buf, 0, sizeof(ccount_t)*im->width);
+  memset(im->buf + (im->height-1)*im->stride, 0, sizeof(ccount_t)*im->width);
+
+  // most of a thresholded image is a few large regions, so visit only
+  // the set pixels of each word.
+  for (int y=1; y<im->height-1; ++y) {
+    const uint64_t* src = image_u1_row(im1, y);
+    ccount_t* dst = im->buf + y*im->stride;
+    memset(dst, 0, sizeof(ccount_t)*im->width);
+    for (int i=0; i<im1->stride; ++i) {
+      for (uint64_t k=src[i]; k; k &= k-1) {
+        dst[64*i + __builtin_ctzll(k)] = 1;
+      }
+    }
+    dst[0] = dst[1] = 0;
+    dst[im->width-2] = dst[im->width-1] = 0;
+  }
+
+  return contour_detect_cimage(im);
+
+}
+
+static zarray_t* contour_detect_cimage(cimage_t* im) {
+
   conn_info_t c = the_cinfo;
   
   for (int n=0; n<NUM_NEIGHBORS; ++n) {
@@ -1060,15 +1094,169 @@ static inline int find_next_nonzero_word(const uint8_t* buf, int len) {
   
 }
 
-zarray_t* contour_line_sweep(const image_u8_t* im) {
+/* The state of a line sweep: the nodes of the contours found so far,
+   and the edges (the nodes at the left and right ends of each
+   interval of set pixels) of the previous row and of the current
+   one. */
+typedef struct sweep {
+  zarray_t* nodes;
+  size_t* prev_edges;
+  size_t prev_count;
+  size_t* cur_edges;
+  size_t* citer;      // the next edge of the current row
+  size_t* piter;      // the first edge of the previous row left to join
+  const size_t* pend;
+  uint32_t conn8;     // join intervals which touch diagonally?
+} sweep_t;
+
+static void sweep_init(sweep_t* s, int width, int conn8) {
+  s->conn8 = conn8 ? 1 : 0;
+  s->nodes = zarray_create(sizeof(contour_node_t));
+  s->prev_edges = malloc(sizeof(size_t)*(width+1));
+  s->prev_count = 0;
+  s->cur_edges = malloc(sizeof(size_t)*(width+1));
+}
 
-  zarray_t* nodes = zarray_create(sizeof(contour_node_t));
-  zarray_t* contours = zarray_create(sizeof(zarray_t*));
+static void sweep_destroy(sweep_t* s) {
+  free(s->prev_edges);
+  free(s->cur_edges);
+  zarray_destroy(s->nodes);
+}
+
+static inline void sweep_begin_row(sweep_t* s) {
+  s->citer = s->cur_edges;
+  s->piter = s->prev_edges;
+  s->pend = s->prev_edges + s->prev_count;
+}
+
+static inline void sweep_end_row(sweep_t* s) {
+
+  s->prev_count = (s->citer-s->cur_edges);
+    
+  // swap prev and cur edges
+  size_t* tmp = s->prev_edges;
+  s->prev_edges = s->cur_edges;
+  s->cur_edges = tmp;
+
+}
 
-  size_t* prev_edges = malloc(sizeof(size_t)*(im->width+1));
-  size_t prev_count = 0;
+/* Add the interval [c0, c1) of set pixels of row y (the intervals of
+   a row being added from left to right), joining it to the contours
+   of the intervals it touches in the previous row (including those
+   it only touches diagonally, if conn8 is set, in which case the
+   polygon passes twice through the corner shared by the two). */
+static inline void sweep_interval(sweep_t* s, uint32_t y,
+                                  uint32_t c0, uint32_t c1) {
 
-  size_t* cur_edges = malloc(sizeof(size_t)*(im->width+1));
+  zarray_t* nodes = s->nodes;
+  size_t* citer = s->citer;
+  size_t* piter = s->piter;
+  const size_t* pend = s->pend;
+  const uint32_t conn8 = s->conn8;
+
+  dprintf("current interval is x=[%d,%d]\n", c0, c1);
+
+  while (piter != pend && node_get(nodes, piter[1])->point.x + conn8 <= c0) {
+    piter += 2;
+  }
+
+  if (piter == pend) {
+
+    dprintf("  starting new contour since piter == pend\n");
+    new_contour(nodes, &citer, y, c0, c1);
+
+  } else {
+
+    assert(piter < pend);
+            
+    dprintf("  prev interval is x=[%d,%d]\n",
+            (int)node_get(nodes, piter[0])->point.x,
+            (int)node_get(nodes, piter[1])->point.x);
+            
+    assert(c0 < node_get(nodes, piter[1])->point.x + conn8);
+            
+    if (c1 + conn8 <= node_get(nodes, piter[0])->point.x) {
+
+      dprintf("  starting new contour since c1 <= p0\n");
+      new_contour(nodes, &citer, y, c0, c1);
+              
+    } else {
+
+      { // set up scope for pp0
+
+        contour_node_t* pp0 = node_get(nodes, piter[0]);
+
+        dprintf("  joining left...\n");
+        // join left
+        if (pp0->point.x == c0) {
+          // just modify existing thing
+          citer[0] = piter[0];
+          pp0->point.y = y+1;
+          dprintf("    modifying left hand of prev since x's equal\n");
+        } else {
+          size_t q = node_create(nodes, c0, y, piter[0]);
+          citer[0] = node_create(nodes, c0, y+1, q);
+        }
+
+      } // no need to refer to pp0 after this point
+
+      // join interior
+      while (piter + 2 != pend &&
+             node_get(nodes, piter[2])->point.x < c1 + conn8) {
+        dprintf("  joining interior...\n");
+        node_join(nodes, piter[1], piter[2]);
+        piter += 2;
+      }
+
+      contour_node_t* pp1 = node_get(nodes, piter[1]);
+
+      // join right
+      dprintf("  joining right...\n");
+      if (pp1->point.x == c1) {
+                
+        dprintf("    modifying right hand of prev since x's equal\n");
+        citer[1] = piter[1];
+        pp1->point.y = y+1;
+        pp1->succ = citer[0];
+                
+      } else {
+
+        citer[1] = node_create(nodes, c1, y+1, citer[0]);
+
+        size_t q = node_create(nodes, c1, y,   citer[1]);
+
+        // must re-get pointer because it may have been invalidated
+        // due to creation immediately above this line
+        pp1 = node_get(nodes, piter[1]);
+
+        pp1->succ = q;
+
+        if (c1 < pp1->point.x) {
+                  
+          dprintf("    updating prev edge because c1 < p1\n");
+          piter[0] = q;
+                  
+        }
+                
+      }
+
+      citer += 2;
+              
+    } // c1 < p0
+  } // prev interval exists
+
+  s->citer = citer;
+  s->piter = piter;
+
+}
+
+zarray_t* contour_line_sweep(const image_u8_t* im) {
+
+  sweep_t s;
+  sweep_init(&s, im->width, 0);
+
+  zarray_t* nodes = s.nodes;
+  zarray_t* contours = zarray_create(sizeof(zarray_t*));
 
   const uint8_t* srcrow = im->buf;
   
@@ -1076,10 +1264,7 @@ zarray_t* contour_line_sweep(const image_u8_t* im) {
 
     dprintf("processing y=%d\n", y);
 
-    size_t* citer = cur_edges;
-
-    size_t* piter = prev_edges;
-    const size_t* pend = prev_edges + prev_count;
+    sweep_begin_row(&s);
 
     const uint8_t* src = srcrow;
     uint32_t c1 = 0;
@@ -1109,105 +1294,11 @@ zarray_t* contour_line_sweep(const image_u8_t* im) {
       c1 = c0 + cnt;
       remaining -= cnt;
 
-      dprintf("current interval is x=[%d,%d]\n", c0, c1);
-
-      while (piter != pend && node_get(nodes, piter[1])->point.x <= c0) {
-        piter += 2;
-      }
-
-      if (piter == pend) {
-
-        dprintf("  starting new contour since piter == pend\n");
-        new_contour(nodes, &citer, y, c0, c1);
-
-      } else {
-
-        assert(piter < pend);
-            
-        dprintf("  prev interval is x=[%d,%d]\n",
-                (int)node_get(nodes, piter[0])->point.x,
-                (int)node_get(nodes, piter[1])->point.x);
-            
-        assert(c0 < node_get(nodes, piter[1])->point.x);
-            
-        if (c1 <= node_get(nodes, piter[0])->point.x) {
-
-          dprintf("  starting new contour since c1 <= p0\n");
-          new_contour(nodes, &citer, y, c0, c1);
-              
-        } else {
-
-          { // set up scope for pp0
-
-            contour_node_t* pp0 = node_get(nodes, piter[0]);
-
-            dprintf("  joining left...\n");
-            // join left
-            if (pp0->point.x == c0) {
-              // just modify existing thing
-              citer[0] = piter[0];
-              pp0->point.y = y+1;
-              dprintf("    modifying left hand of prev since x's equal\n");
-            } else {
-              size_t q = node_create(nodes, c0, y, piter[0]);
-              citer[0] = node_create(nodes, c0, y+1, q);
-            }
-
-          } // no need to refer to pp0 after this point
-
-          // join interior
-          while (piter + 2 != pend &&
-                 node_get(nodes, piter[2])->point.x < c1) {
-            dprintf("  joining interior...\n");
-            node_join(nodes, piter[1], piter[2]);
-            piter += 2;
-          }
-
-          contour_node_t* pp1 = node_get(nodes, piter[1]);
-
-          // join right
-          dprintf("  joining right...\n");
-          if (pp1->point.x == c1) {
-                
-            dprintf("    modifying right hand of prev since x's equal\n");
-            citer[1] = piter[1];
-            pp1->point.y = y+1;
-            pp1->succ = citer[0];
-                
-          } else {
-
-            citer[1] = node_create(nodes, c1, y+1, citer[0]);
-
-            size_t q = node_create(nodes, c1, y,   citer[1]);
-
-            // must re-get pointer because it may have been invalidated
-            // due to creation immediately above this line
-            pp1 = node_get(nodes, piter[1]);
-
-            pp1->succ = q;
-
-            if (c1 < pp1->point.x) {
-                  
-              dprintf("    updating prev edge because c1 < p1\n");
-              piter[0] = q;
-                  
-            }
-                
-          }
-
-          citer += 2;
-              
-        } // c1 < p0
-      } // prev interval exists
+      sweep_interval(&s, y, c0, c1);
       
     } // for each column
 
-    prev_count = (citer-cur_edges);
-    
-    // swap prev and cur edges
-    size_t* tmp = prev_edges;
-    prev_edges = cur_edges;
-    cur_edges = tmp;
+    sweep_end_row(&s);
 
     // move to next row
     srcrow += im->stride;
@@ -1238,20 +1329,569 @@ zarray_t* contour_line_sweep(const image_u8_t* im) {
     exit(1);
   }
 
-  free(prev_edges);
-  free(cur_edges);
-  zarray_destroy(nodes);
+  sweep_destroy(&s);
   return contours;
 
 }
 
+/* Write the border pixels of the polygon v (the corners of the pixels,
+   from contour_line_sweep, with the set pixels on its right) to pts,
+   which has room for one per unit step along the polygon: for each
+   step, the set pixel on its right, skipping repeats. Returns the
+   number of pixels, and sets *start to the index of the pixel of the
+   first step from corner kmin (the top left corner), which is where
+   contour_detect would start following the border. */
+static int polygon_border_pixels(const contour_point_t* v, int nv, int kmin,
+                                 contour_point_t* pts, int* start) {
+
+  int n = 0;
+  int at_start = 0;
+  *start = 0;
+
+  for (int k=0; k<nv; ++k) {
+
+    const contour_point_t* a = v + k;
+    const contour_point_t* b = v + (k+1 == nv ? 0 : k+1);
+
+    int dx = (b->x > a->x) - (b->x < a->x);
+    int dy = (b->y > a->y) - (b->y < a->y);
+    assert(!dx || !dy);
+
+    int steps = dx ? abs((int)b->x - (int)a->x) : abs((int)b->y - (int)a->y);
+
+    // the pixel right of a step from (x, y) in direction (dx, dy)
+    uint32_t x = a->x + ((dx < 0 || dy > 0) ? -1 : 0);
+    uint32_t y = a->y + ((dx < 0 || dy < 0) ? -1 : 0);
+
+    // (the polygon may have corners one after the other at the same
+    // point, where contour_detect_sweep_u1_mt joined its bands.)
+    at_start |= k == kmin;
+
+    for (int i=0; i<steps; ++i, x+=dx, y+=dy) {
+      if (!n || pts[n-1].x != x || pts[n-1].y != y) {
+        pts[n].x = x;
+        pts[n].y = y;
+        ++n;
+      }
+      if (at_start) {
+        *start = n-1;
+        at_start = 0;
+      }
+    }
+
+  }
+
+  // the polygon is closed.
+  if (n > 1 && pts[0].x == pts[n-1].x && pts[0].y == pts[n-1].y) {
+    --n;
+    if (*start == n) {
+      *start = 0;
+    }
+  }
+
+  return n;
+
+}
+
+/* Turn the polygon v from contour_line_sweep into the record that
+   contour_detect makes for the same border: the border pixels, from
+   the same one and in the same direction around it (the opposite of
+   the polygon's). tmp is working space. Returns 0, or -1 (making no
+   record) for a hole if outer_only is set, or for a border of fewer
+   than min_points pixels. */
+static int polygon_to_info(const contour_point_t* v, int nv,
+                           int outer_only, int min_points,
+                           zarray_t* tmp, contour_info_t* ci) {
+
+  // the sweep goes clockwise (as seen in the image) around the outer
+  // borders, and anticlockwise around the holes.
+  int64_t area2 = 0;
+  int perimeter = 0;
+  int kmin = 0;
+
+  for (int k=0; k<nv; ++k) {
+    const contour_point_t* a = v + k;
+    const contour_point_t* b = v + (k+1 == nv ? 0 : k+1);
+    area2 += (int64_t)a->x*b->y - (int64_t)b->x*a->y;
+    perimeter += abs((int)b->x - (int)a->x) + abs((int)b->y - (int)a->y);
+    if (a->y < v[kmin].y || (a->y == v[kmin].y && a->x < v[kmin].x)) {
+      kmin = k;
+    }
+  }
+
+  // there are no more border pixels than unit steps.
+  if ((outer_only && area2 <= 0) || perimeter < min_points) {
+    return -1;
+  }
+
+  zarray_ensure_capacity(tmp, perimeter);
+  const contour_point_t* pts = (const contour_point_t*)tmp->data;
+
+  int start;
+  int n = polygon_border_pixels(v, nv, kmin, (contour_point_t*)tmp->data, &start);
+  if (n < min_points) {
+    return -1;
+  }
+
+  ci->parent = -1;
+  ci->is_outer = area2 > 0;
+  ci->points = zarray_create(sizeof(contour_point_t));
+  zarray_ensure_capacity(ci->points, n);
+
+  contour_point_t* dst = (contour_point_t*)ci->points->data;
+  for (int i=0; i<n; ++i) {
+    dst[i] = pts[start-i >= 0 ? start-i : start-i+n];
+  }
+  ci->points->size = n;
+
+  return 0;
+
+}
+
+static inline int info_before(const contour_info_t* a, const contour_info_t* b) {
+  const contour_point_t* pa = (const contour_point_t*)a->points->data;
+  const contour_point_t* pb = (const contour_point_t*)b->points->data;
+  return pa->x < pb->x || (pa->x == pb->x && a->is_outer > b->is_outer);
+}
+
+/* Return the contours in the order contour_detect finds them: by their
+   first points, in raster order (outer borders before holes at the
+   same point). There are many contours, but few start in any one row,
+   so sort them into rows and then each row by insertion. */
+static zarray_t* sort_contours(zarray_t* contours, int height) {
+
+  int nc = zarray_size(contours);
+  const contour_info_t* src = (const contour_info_t*)contours->data;
+
+  // rowstart[y] is the index of the first contour of row y, and
+  // rowend[y] that after the last sorted so far.
+  int* rowstart = calloc(2*(height+1), sizeof(int));
+  int* rowend = rowstart + height+1;
+  for (int i=0; i<nc; ++i) {
+    ++rowstart[((const contour_point_t*)src[i].points->data)->y + 1];
+  }
+  for (int y=0; y<height; ++y) {
+    rowstart[y+1] += rowstart[y];
+  }
+  memcpy(rowend, rowstart, (height+1)*sizeof(int));
+
+  zarray_t* sorted = zarray_create(sizeof(contour_info_t));
+  zarray_ensure_capacity(sorted, nc);
+  contour_info_t* dst = (contour_info_t*)sorted->data;
+
+  for (int i=0; i<nc; ++i) {
+    uint32_t y = ((const contour_point_t*)src[i].points->data)->y;
+    int j = rowend[y]++;
+    while (j > rowstart[y] && info_before(&src[i], &dst[j-1])) {
+      dst[j] = dst[j-1];
+      --j;
+    }
+    dst[j] = src[i];
+  }
+  sorted->size = nc;
+
+  free(rowstart);
+  zarray_destroy(contours);
+
+  return sorted;
+
+}
+
+/* Add the intervals of set pixels of row y (packed, as by image_u1_row)
+   of an image of the given width to the sweep, leaving out (as
+   contour_detect_u1 does) the first and last two columns. */
+static void sweep_row_u1(sweep_t* s, const uint64_t* row, int width,
+                         uint32_t y) {
+
+  const uint32_t x0 = 2;
+  const uint32_t x1 = width > 4 ? width-2 : 2;
+
+  uint64_t carry = 0; // the last pixel of the previous word
+  uint32_t c0 = 0;
+
+  for (int i=0; 64*i<width; ++i) {
+
+    uint32_t lo = 64*i;
+    if (lo >= x1) { break; }
+
+    uint64_t k = row[i];
+    if (x0 > lo) { k &= x0-lo < 64 ? UINT64_MAX << (x0-lo) : 0; }
+    if (x1 < lo+64) { k &= ((uint64_t)1 << (x1-lo)) - 1; }
+
+    // the pixels which differ from the pixel to their left start or
+    // end an interval.
+    uint64_t edges = k ^ ((k << 1) | carry);
+    carry = k >> 63;
+
+    for (; edges; edges &= edges-1) {
+      uint32_t x = lo + __builtin_ctzll(edges);
+      if (k & ((uint64_t)1 << (x-lo))) {
+        c0 = x;
+      } else {
+        sweep_interval(s, y, c0, x);
+      }
+    }
+
+  }
+
+  // an interval ending at the last word of the row
+  if (carry) {
+    sweep_interval(s, y, c0, x1);
+  }
+
+}
+
+/* Follow the cycle of nodes from node i, marking them visited, and
+   add the record of its polygon to contours (if polygon_to_info makes
+   one). verts and tmp are working space. */
+static void sweep_take_cycle(zarray_t* nodes, size_t i,
+                             int outer_only, int min_points,
+                             zarray_t* verts, zarray_t* tmp,
+                             zarray_t* contours) {
+
+  contour_node_t* n = node_get(nodes, i);
+  int nv = 0;
+
+  while (node_valid(nodes, n->succ)) {
+    zarray_ensure_capacity(verts, nv+1);
+    ((contour_point_t*)verts->data)[nv++] = n->point;
+    contour_node_t* nn = node_get(nodes, n->succ);
+    n->succ = npos;
+    n = nn;
+  }
+
+  contour_info_t ci;
+  if (polygon_to_info((const contour_point_t*)verts->data, nv,
+                      outer_only, min_points, tmp, &ci) == 0) {
+    zarray_add(contours, &ci);
+  }
+
+}
+
+/* A band of rows [y0, y1) of contour_detect_sweep_u1_mt, swept by
+   itself, as if the rows above and below it were clear. Its rows are
+   those of im, or if im is NULL, made by src. */
+typedef struct sweep_band {
+
+  const image_u1_t* im;
+  const contour_row_source_t* src;
+  int width;
+  uint32_t y0, y1;
+  int outer_only, min_points;
+
+  zarray_t* nodes;      // the band's own
+  size_t count;
+  zarray_t* all_nodes;  // those of all bands (shared)
+  size_t offset;        // of the band's own in those of all bands
+
+  // the top left and right corners of the intervals of row y0, and
+  // the edges of the intervals of row y1-1 (as in sweep_t).
+  size_t* top;
+  size_t ntop;
+  size_t* bottom;
+  size_t nbottom;
+
+  zarray_t* contours;
+
+} sweep_band_t;
+
+static void sweep_band_task(void* p) {
+
+  sweep_band_t* b = (sweep_band_t*)p;
+
+  sweep_t s;
+  sweep_init(&s, b->width, 1);
+
+  void* state = NULL;
+  uint64_t* buf = NULL;
+  if (!b->im) {
+    state = b->src->begin(b->src->user, b->y0);
+    buf = malloc(sizeof(uint64_t)*((b->width+63)/64));
+  }
+
+  for (uint32_t y=b->y0; y<b->y1; ++y) {
+
+    const uint64_t* row = buf;
+    if (b->im) {
+      row = image_u1_row(b->im, y);
+    } else {
+      b->src->next(state, buf);
+    }
+
+    sweep_begin_row(&s);
+    sweep_row_u1(&s, row, b->width, y);
+    sweep_end_row(&s);
+
+    // the intervals of the first row are all new contours, whose top
+    // corners come after their left edges.
+    if (y == b->y0) {
+      b->ntop = s.prev_count;
+      b->top = malloc(sizeof(size_t)*(b->ntop+1));
+      for (size_t i=0; i<b->ntop; i+=2) {
+        b->top[i] = node_get(s.nodes, s.prev_edges[i])->succ;
+        b->top[i+1] = node_get(s.nodes, b->top[i])->succ;
+      }
+    }
+
+  }
+
+  if (!b->im) {
+    b->src->end(state);
+    free(buf);
+  }
+
+  b->nodes = s.nodes;
+  b->count = s.nodes->size;
+  b->bottom = s.prev_edges;
+  b->nbottom = s.prev_count;
+  free(s.cur_edges);
+
+}
+
+/* Copy the band's nodes into those of all bands. */
+static void sweep_band_copy_task(void* p) {
+
+  sweep_band_t* b = (sweep_band_t*)p;
+  contour_node_t* dst = (contour_node_t*)b->all_nodes->data + b->offset;
+  const contour_node_t* src = (const contour_node_t*)b->nodes->data;
+
+  for (size_t i=0; i<b->count; ++i) {
+    dst[i].point = src[i].point;
+    dst[i].succ = src[i].succ == npos ? npos : src[i].succ + b->offset;
+  }
+
+}
+
+/* Join the intervals of the first row of band b to those of the last
+   row of band a, above it, in the nodes of all bands, as
+   sweep_interval joins an interval to those of the previous row: the
+   polygons of the two bands meet along the seam, and their edges
+   there are relinked into the borders of the union. */
+static void sweep_join_seam(zarray_t* nodes, sweep_band_t* a,
+                            const sweep_band_t* b) {
+
+  for (size_t i=0; i<a->nbottom; ++i) {
+    a->bottom[i] += a->offset;
+  }
+
+  size_t* piter = a->bottom;
+  const size_t* pend = a->bottom + a->nbottom;
+
+  for (size_t j=0; j<b->ntop; j+=2) {
+
+    size_t bj = b->top[j] + b->offset;
+    size_t cj = b->top[j+1] + b->offset;
+    uint32_t c0 = node_get(nodes, bj)->point.x;
+    uint32_t c1 = node_get(nodes, cj)->point.x;
+
+    while (piter != pend && node_get(nodes, piter[1])->point.x + 1 <= c0) {
+      piter += 2;
+    }
+
+    if (piter == pend || c1 + 1 <= node_get(nodes, piter[0])->point.x) {
+      continue;
+    }
+
+    // join left: up the left edge of b's interval, then along the
+    // seam to that of a's.
+    node_get(nodes, bj)->succ = piter[0];
+
+    // join interior
+    while (piter + 2 != pend &&
+           node_get(nodes, piter[2])->point.x < c1 + 1) {
+      node_join(nodes, piter[1], piter[2]);
+      piter += 2;
+    }
+
+    // join right: down the right edge of a's interval, along the seam
+    // and down that of b's. The rest of a's interval, if any, is then
+    // left of the right edge of b's.
+    node_join(nodes, piter[1], cj);
+    if (c1 < node_get(nodes, piter[1])->point.x) {
+      piter[0] = cj;
+    }
+
+  }
+
+}
+
+/* Make the records of the cycles of the band's own nodes, which no
+   longer include any crossing a seam. */
+static void sweep_band_contours_task(void* p) {
+
+  sweep_band_t* b = (sweep_band_t*)p;
+  zarray_t* verts = zarray_create(sizeof(contour_point_t));
+  zarray_t* tmp = zarray_create(sizeof(contour_point_t));
+
+  for (size_t i=b->offset; i<b->offset+b->count; ++i) {
+    if (node_valid(b->all_nodes, node_get(b->all_nodes, i)->succ)) {
+      sweep_take_cycle(b->all_nodes, i, b->outer_only, b->min_points,
+                       verts, tmp, b->contours);
+    }
+  }
+
+  zarray_destroy(verts);
+  zarray_destroy(tmp);
+
+}
+
+static void sweep_run_tasks(workerpool_t* wp, void (*f)(void* p),
+                            sweep_band_t* bands, int nbands) {
+
+  if (nbands == 1) {
+    f(bands);
+  } else {
+    for (int i=0; i<nbands; ++i) {
+      workerpool_add_task(wp, f, bands+i);
+    }
+    workerpool_run(wp);
+  }
+
+}
+
+static zarray_t* sweep_bands(const image_u1_t* im,
+                             const contour_row_source_t* src,
+                             int width, int height,
+                             int outer_only, int min_points,
+                             workerpool_t* wp) {
+
+  // as contour_detect_u1 does, leave out the first and last rows.
+  int nrows = height - 2;
+  if (nrows <= 0) {
+    return zarray_create(sizeof(contour_info_t));
+  }
+
+  int nt = wp ? workerpool_get_nthreads(wp) : 1;
+  int nbands = nt < nrows ? nt : nrows;
+  int rows_per_band = (nrows + nbands - 1) / nbands;
+  nbands = (nrows + rows_per_band - 1) / rows_per_band;
+
+  sweep_band_t bands[nbands];
+  memset(bands, 0, sizeof(bands));
+
+  for (int i=0; i<nbands; ++i) {
+    bands[i].im = im;
+    bands[i].src = src;
+    bands[i].width = width;
+    bands[i].y0 = 1 + i*rows_per_band;
+    bands[i].y1 = 1 + (i+1 < nbands ? (i+1)*rows_per_band : nrows);
+    bands[i].outer_only = outer_only;
+    bands[i].min_points = min_points;
+  }
+
+  sweep_run_tasks(wp, sweep_band_task, bands, nbands);
+
+  zarray_t* nodes;
+
+  if (nbands == 1) {
+
+    nodes = bands[0].nodes;
+
+  } else {
+
+    size_t total = 0;
+    for (int i=0; i<nbands; ++i) {
+      bands[i].offset = total;
+      total += bands[i].count;
+    }
+
+    nodes = zarray_create(sizeof(contour_node_t));
+    zarray_ensure_capacity(nodes, total);
+    nodes->size = total;
+
+    for (int i=0; i<nbands; ++i) {
+      bands[i].all_nodes = nodes;
+    }
+    sweep_run_tasks(wp, sweep_band_copy_task, bands, nbands);
+
+    for (int i=0; i<nbands; ++i) {
+      zarray_destroy(bands[i].nodes);
+    }
+
+    for (int i=1; i<nbands; ++i) {
+      sweep_join_seam(nodes, bands+i-1, bands+i);
+    }
+
+  }
+
+  zarray_t* contours = zarray_create(sizeof(contour_info_t));
+
+  // the cycles which might cross a seam start at the edges relinked
+  // there.
+  if (nbands > 1) {
+
+    zarray_t* verts = zarray_create(sizeof(contour_point_t));
+    zarray_t* tmp = zarray_create(sizeof(contour_point_t));
+
+    for (int i=0; i<nbands; ++i) {
+      for (size_t j=0; i>0 && j<bands[i].ntop; j+=2) {
+        size_t k = bands[i].top[j] + bands[i].offset;
+        if (node_valid(nodes, node_get(nodes, k)->succ)) {
+          sweep_take_cycle(nodes, k, outer_only, min_points,
+                           verts, tmp, contours);
+        }
+      }
+      for (size_t j=1; i+1<nbands && j<bands[i].nbottom; j+=2) {
+        size_t k = bands[i].bottom[j];
+        if (node_valid(nodes, node_get(nodes, k)->succ)) {
+          sweep_take_cycle(nodes, k, outer_only, min_points,
+                           verts, tmp, contours);
+        }
+      }
+    }
+
+    zarray_destroy(verts);
+    zarray_destroy(tmp);
+
+  }
+
+  for (int i=0; i<nbands; ++i) {
+    bands[i].all_nodes = nodes;
+    bands[i].contours = zarray_create(sizeof(contour_info_t));
+  }
+
+  sweep_run_tasks(wp, sweep_band_contours_task, bands, nbands);
+
+  for (int i=0; i<nbands; ++i) {
+    zarray_add_all(contours, bands[i].contours);
+    zarray_destroy(bands[i].contours);
+    free(bands[i].top);
+    free(bands[i].bottom);
+  }
+
+  zarray_destroy(nodes);
+
+  return sort_contours(contours, height);
+
+}
+
+
+zarray_t* contour_detect_sweep_u1(const image_u1_t* im,
+                                  int outer_only, int min_points) {
+  return contour_detect_sweep_u1_mt(im, outer_only, min_points, NULL);
+}
+
+zarray_t* contour_detect_sweep_u1_mt(const image_u1_t* im,
+                                     int outer_only, int min_points,
+                                     workerpool_t* wp) {
+  return sweep_bands(im, NULL, im->width, im->height,
+                     outer_only, min_points, wp);
+}
+
+zarray_t* contour_detect_sweep_rows_mt(const contour_row_source_t* src,
+                                       int outer_only, int min_points,
+                                       workerpool_t* wp) {
+  return sweep_bands(NULL, src, src->width, src->height,
+                     outer_only, min_points, wp);
+}
+
 
 void contour_line_sweep_destroy(zarray_t* contours) {
 
   for (int i=0; i<zarray_size(contours); ++i) {
     zarray_t* contour;
     zarray_get(contours, i, &contour);
-    free(contour);          
+    zarray_destroy(contour);
   }
     
   zarray_destroy(contours);
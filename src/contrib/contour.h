@@ -1,7 +1,9 @@
 #ifndef _CONTOUR_H
 #define _CONTOUR_H
 
+#include "image_u1.h"
 #include "image_u8.h"
+#include "workerpool.h"
 #include "zarray.h"
 #include <stdio.h>
 
@@ -21,6 +23,9 @@ typedef struct contour_info {
 
 zarray_t* contour_detect(const image_u8_t* im);
 
+// the same, for a packed binary image.
+zarray_t* contour_detect_u1(const image_u1_t* im);
+
 void contour_destroy(zarray_t* contours);
 
 // take array of contour_point_t as input
@@ -41,6 +46,42 @@ zarray_t* contour_line_sweep(const image_u8_t* im);
 
 void contour_line_sweep_destroy(zarray_t* contours);
 
+// the same as contour_detect_u1, but found with contour_line_sweep's
+// scan of the rows (a word at a time). The borders, their points and
+// their order are those of contour_detect_u1, but their parents are
+// not found (parent is always -1). If outer_only is set, the holes are
+// left out, and so are the borders of fewer than min_points pixels,
+// without making records for them. Free with contour_destroy.
+zarray_t* contour_detect_sweep_u1(const image_u1_t* im,
+                                  int outer_only, int min_points);
+
+// the same, but sweeping horizontal bands of the image on wp, one per
+// thread, whose contours are then joined where they cross from one
+// band into the next.
+zarray_t* contour_detect_sweep_u1_mt(const image_u1_t* im,
+                                     int outer_only, int min_points,
+                                     workerpool_t* wp);
+
+// The rows of a packed binary image of width x height, made as they
+// are swept by contour_detect_sweep_rows_mt, which never holds more
+// than a row of each band. For each band of rows [y0, y1), state =
+// begin(user, y0) is called, then next(state, row) for each of rows y0
+// to y1-1 in order, writing the row's packed bits (as image_u1_row
+// lays them out) to row, and then end(state). The bands are made at
+// the same time, on different threads.
+typedef struct contour_row_source {
+  int width, height;
+  void* user;
+  void* (*begin)(void* user, int y0);
+  void (*next)(void* state, uint64_t* row);
+  void (*end)(void* state);
+} contour_row_source_t;
+
+// contour_detect_sweep_u1_mt, on the image whose rows src makes.
+zarray_t* contour_detect_sweep_rows_mt(const contour_row_source_t* src,
+                                       int outer_only, int min_points,
+                                       workerpool_t* wp);
+
 #ifdef __cplusplus
 }
 #endif
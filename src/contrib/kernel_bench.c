@@ -0,0 +1,438 @@
+#include "box.h"
+#include "contour.h"
+#include "apriltag.h"
+#include "tag36h11.h"
+#include "homography.h"
+#include "matd.h"
+#include "unionfind.h"
+#include "image_u8.h"
+#include "image_u32.h"
+#include "simd.h"
+#include "workerpool.h"
+#include "time_util.h"
+#include "string_util.h"
+#include "getopt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Times the kernels the detector is built from, each at several image
+// sizes (and, for the threaded kernels, thread counts), on images
+// generated from a fixed seed, and prints the time per pixel (or per
+// call, for the kernels which don't work on images). The image kernels
+// are timed with the vector kernels (see simd.h) of each instruction
+// set asked for.
+
+enum { NDECODE = 1024, NHOMOGRAPHY = 256, NSVD = 64 };
+
+typedef struct bench_args {
+
+  const image_u8_t* im;     // blocks of random gray levels
+  const image_u8_t* binary; // the same, thresholded (black border)
+  image_u1_t* packed;       // and packed
+  image_u8_t* work;         // a copy of im, for the in-place kernels
+  workerpool_t* wp;
+  unionfind_t* uf;
+
+  apriltag_family_t* family;
+  uint64_t codes[NDECODE];
+
+  zarray_t* correspondences[NHOMOGRAPHY];
+  matd_t* matrices[NSVD];
+
+} bench_args_t;
+
+typedef struct kernel {
+  const char* name;
+  int per_pixel; // per pixel of the image, or per call
+  int threaded;
+  void (*run)(bench_args_t* args);
+  int ncalls;    // calls per run, of the per call kernels
+  int simd;      // uses the vector kernels of simd.h
+} kernel_t;
+
+static uint32_t rand_state;
+
+static uint32_t rand_u32() {
+  rand_state = rand_state * 1103515245u + 12345u;
+  return rand_state >> 8;
+}
+
+static double rand_uniform() {
+  return (rand_u32() & 0xffffff) / 16777216.0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// the kernels
+
+static void run_box_threshold(bench_args_t* args) {
+  image_u8_destroy(box_threshold_mt(args->im, 255, 1, 15, 5, args->wp));
+}
+
+static void run_integrate(bench_args_t* args) {
+  image_u32_destroy(integrate_border_replicate_mt(args->im, 7, args->wp));
+}
+
+static void run_contour_detect(bench_args_t* args) {
+  contour_destroy(contour_detect(args->binary));
+}
+
+static void run_contour_line_sweep(bench_args_t* args) {
+  contour_line_sweep_destroy(contour_line_sweep(args->binary));
+}
+
+static void run_contour_sweep_mt(bench_args_t* args) {
+  contour_destroy(contour_detect_sweep_u1_mt(args->packed, 0, 0, args->wp));
+}
+
+// connect each pixel of the binary image to its right and lower
+// neighbors of the same color, as the segmentation does.
+static void run_unionfind(bench_args_t* args) {
+
+  const image_u8_t* im = args->binary;
+  unionfind_t* uf = args->uf;
+
+  unionfind_reset(uf);
+
+  for (int y=0; y<im->height; ++y) {
+    const uint8_t* row = im->buf + y*im->stride;
+    for (int x=0; x<im->width; ++x) {
+      uint32_t id = y*im->width + x;
+      if (x+1 < im->width && row[x] == row[x+1]) {
+        unionfind_connect(uf, id, id+1);
+      }
+      if (y+1 < im->height && row[x] == row[x+im->stride]) {
+        unionfind_connect(uf, id, id+im->width);
+      }
+    }
+  }
+
+}
+
+static void run_decimate(bench_args_t* args) {
+  image_u8_destroy(image_u8_decimate((image_u8_t*) args->im, 2));
+}
+
+// blurs the work image in place, over and over.
+static void run_gaussian_blur(bench_args_t* args) {
+  image_u8_gaussian_blur(args->work, 0.8, 5);
+}
+
+static void run_decode(bench_args_t* args) {
+  int hamming, rotation;
+  for (int i=0; i<NDECODE; ++i) {
+    apriltag_family_decode(args->family, args->codes[i], &hamming, &rotation);
+  }
+}
+
+static void run_homography(bench_args_t* args) {
+  for (int i=0; i<NHOMOGRAPHY; ++i) {
+    matd_destroy(homography_compute(args->correspondences[i],
+                                    HOMOGRAPHY_COMPUTE_FLAG_SVD));
+  }
+}
+
+static void run_svd(bench_args_t* args) {
+  for (int i=0; i<NSVD; ++i) {
+    matd_svd_t svd = matd_svd(args->matrices[i]);
+    matd_destroy(svd.U);
+    matd_destroy(svd.S);
+    matd_destroy(svd.V);
+  }
+}
+
+static const kernel_t kernels[] = {
+  { "box_threshold_mt", 1, 1, run_box_threshold, 1, 0 },
+  { "integrate_border_replicate_mt", 1, 1, run_integrate, 1, 0 },
+  { "contour_detect", 1, 0, run_contour_detect, 1, 0 },
+  { "contour_line_sweep", 1, 0, run_contour_line_sweep, 1, 0 },
+  { "contour_detect_sweep_u1_mt", 1, 1, run_contour_sweep_mt, 1, 0 },
+  { "unionfind_connect", 1, 0, run_unionfind, 1, 0 },
+  { "image_u8_decimate", 1, 0, run_decimate, 1, 1 },
+  { "image_u8_gaussian_blur", 1, 0, run_gaussian_blur, 1, 1 },
+  { "quick_decode_codeword", 0, 0, run_decode, NDECODE, 0 },
+  { "homography_compute", 0, 0, run_homography, NHOMOGRAPHY, 0 },
+  { "matd_svd", 0, 0, run_svd, NSVD, 0 },
+};
+
+static const int nkernels = sizeof(kernels)/sizeof(kernels[0]);
+
+//////////////////////////////////////////////////////////////////////
+
+// Nanoseconds per run of k, over as many runs as fit in min_time
+// seconds (at least 3), after one run to warm up.
+static double time_kernel(const kernel_t* k, bench_args_t* args,
+                          double min_time) {
+
+  k->run(args);
+
+  int64_t start = utime_now(), elapsed = 0;
+  int nruns = 0;
+
+  while (nruns < 3 || elapsed < min_time*1e6) {
+    k->run(args);
+    ++nruns;
+    elapsed = utime_now() - start;
+  }
+
+  return 1e3 * elapsed / nruns;
+
+}
+
+// Blocks of 16x16 pixels of random gray levels, and the same
+// thresholded, with a black border (as contour_detect wants).
+static void make_images(int width, int height,
+                        image_u8_t** im, image_u8_t** binary) {
+
+  *im = image_u8_create(width, height);
+  *binary = image_u8_create(width, height);
+
+  int bw = (width+15)/16, bh = (height+15)/16;
+  uint8_t blocks[bw*bh];
+  for (int i=0; i<bw*bh; ++i) {
+    blocks[i] = rand_u32() & 0xff;
+  }
+
+  for (int y=0; y<height; ++y) {
+    for (int x=0; x<width; ++x) {
+      uint8_t v = blocks[(y/16)*bw + x/16];
+      int border = (x == 0 || y == 0 || x+1 == width || y+1 == height);
+      (*im)->buf[y*(*im)->stride + x] = v;
+      (*binary)->buf[y*(*binary)->stride + x] = (!border && v > 128) ? 255 : 0;
+    }
+  }
+
+}
+
+// The codes to decode: codes of the family with up to 3 bits flipped,
+// and random words, which mostly fail to decode.
+static void make_codes(bench_args_t* args) {
+
+  const apriltag_family_t* tf = args->family;
+  uint32_t nbits = tf->d*tf->d;
+
+  for (int i=0; i<NDECODE; ++i) {
+    uint64_t code;
+    if (i % 4 == 3) {
+      code = ((uint64_t) rand_u32() << 32) ^ rand_u32();
+    } else {
+      code = tf->codes[rand_u32() % tf->ncodes];
+      int nflip = i % 4;
+      for (int j=0; j<nflip; ++j) {
+        code ^= (uint64_t) 1 << (rand_u32() % nbits);
+      }
+    }
+    args->codes[i] = code & ((nbits == 64) ? UINT64_MAX : (((uint64_t) 1 << nbits) - 1));
+  }
+
+}
+
+// Four corners of a unit square and of a random quad around them.
+static void make_correspondences(bench_args_t* args) {
+
+  const float square[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+
+  for (int i=0; i<NHOMOGRAPHY; ++i) {
+    zarray_t* corr = zarray_create(sizeof(float[4]));
+    for (int j=0; j<4; ++j) {
+      float c[4] = { square[j][0], square[j][1],
+                     100 + 40*square[j][0] + 10*(rand_uniform()-0.5),
+                     100 + 40*square[j][1] + 10*(rand_uniform()-0.5) };
+      zarray_add(corr, c);
+    }
+    args->correspondences[i] = corr;
+  }
+
+  // the size of the systems homography_compute solves.
+  for (int i=0; i<NSVD; ++i) {
+    matd_t* A = matd_create(9, 9);
+    for (int j=0; j<81; ++j) {
+      A->data[j] = rand_uniform() - 0.5;
+    }
+    args->matrices[i] = A;
+  }
+
+}
+
+static int parse_size(const char* s, int* width, int* height) {
+  char c;
+  return (sscanf(s, "%dx%d%c", width, height, &c) == 2 &&
+          *width > 0 && *height > 0);
+}
+
+static int kernel_selected(const zarray_t* names, const char* name) {
+  if (zarray_size(names) == 0) {
+    return 1;
+  }
+  for (int i=0; i<zarray_size(names); ++i) {
+    char* n;
+    zarray_get(names, i, &n);
+    if (!strcmp(n, name)) { return 1; }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  getopt_t* getopt = getopt_create();
+
+  getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+  getopt_add_string(getopt, 's', "sizes", "320x240,640x480,1280x960", "Image sizes");
+  getopt_add_string(getopt, 't', "threads", "1,4", "Thread counts for the threaded kernels");
+  getopt_add_string(getopt, 'k', "kernels", "", "Run only these kernels (default all)");
+  getopt_add_int(getopt, '\0', "seed", "1234567", "Seed for the generated data");
+  getopt_add_double(getopt, '\0', "min-time", "0.2", "Time each kernel for at least this many seconds");
+  getopt_add_string(getopt, '\0', "simd", "", "Instruction sets to time the image kernels with (default the best supported)");
+
+  if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+    printf("Usage: %s [options]\n", argv[0]);
+    getopt_do_usage(getopt);
+    exit(0);
+  }
+
+  double min_time = getopt_get_double(getopt, "min-time");
+
+  zarray_t* sizes = str_split(getopt_get_string(getopt, "sizes"), ",");
+  zarray_t* threads = str_split(getopt_get_string(getopt, "threads"), ",");
+  zarray_t* names = str_split(getopt_get_string(getopt, "kernels"), ",");
+
+  for (int i=0; i<zarray_size(names); ++i) {
+    char* n;
+    zarray_get(names, i, &n);
+    int found = 0;
+    for (int k=0; k<nkernels; ++k) {
+      found = found || !strcmp(kernels[k].name, n);
+    }
+    if (!found) {
+      fprintf(stderr, "unknown kernel %s\n", n);
+      exit(1);
+    }
+  }
+
+  int nthreads[zarray_size(threads)];
+  for (int i=0; i<zarray_size(threads); ++i) {
+    char* s;
+    zarray_get(threads, i, &s);
+    nthreads[i] = atoi(s);
+    if (nthreads[i] < 1) {
+      fprintf(stderr, "bad thread count %s\n", s);
+      exit(1);
+    }
+  }
+
+  zarray_t* isa_names = str_split(getopt_get_string(getopt, "simd"), ",");
+  int nisas = zarray_size(isa_names) ? zarray_size(isa_names) : 1;
+  simd_isa_t isas[nisas];
+  isas[0] = simd_probe();
+  for (int i=0; i<zarray_size(isa_names); ++i) {
+    char* n;
+    zarray_get(isa_names, i, &n);
+    isas[i] = (simd_isa_t)simd_isa_from_name(n);
+    if (!simd_isa_supported(isas[i])) {
+      fprintf(stderr, "instruction set %s is not supported here\n", n);
+      exit(1);
+    }
+  }
+
+  bench_args_t args;
+  memset(&args, 0, sizeof(args));
+
+  rand_state = getopt_get_int(getopt, "seed");
+
+  // the detector builds (and frees) the family's decode table.
+  args.family = tag36h11_create();
+  apriltag_detector_t* td = apriltag_detector_create();
+  apriltag_detector_add_family(td, args.family);
+  make_codes(&args);
+  make_correspondences(&args);
+
+  // the kernels which don't work on images.
+  for (int k=0; k<nkernels; ++k) {
+    const kernel_t* kern = kernels + k;
+    if (kern->per_pixel || !kernel_selected(names, kern->name)) { continue; }
+    double ns = time_kernel(kern, &args, min_time) / kern->ncalls;
+    printf("%-30s %31s %10.3f ns/call\n", kern->name, "", ns);
+  }
+
+  for (int i=0; i<zarray_size(sizes); ++i) {
+
+    char* s;
+    zarray_get(sizes, i, &s);
+
+    int width, height;
+    if (!parse_size(s, &width, &height)) {
+      fprintf(stderr, "bad image size %s (use e.g. 640x480)\n", s);
+      exit(1);
+    }
+
+    image_u8_t *im, *binary;
+    make_images(width, height, &im, &binary);
+
+    args.im = im;
+    args.binary = binary;
+    args.packed = image_u1_create(width, height);
+    image_u1_from_u8(args.packed, binary);
+    args.work = image_u8_copy(im);
+    args.uf = unionfind_create(width*height);
+
+    for (int k=0; k<nkernels; ++k) {
+
+      const kernel_t* kern = kernels + k;
+      if (!kern->per_pixel || !kernel_selected(names, kern->name)) { continue; }
+
+      int nt = kern->threaded ? zarray_size(threads) : 1;
+
+      for (int j=0; j<(kern->simd ? nisas : 1); ++j) {
+
+        simd_set_isa(isas[j]);
+
+        for (int t=0; t<nt; ++t) {
+
+          int n = kern->threaded ? nthreads[t] : 1;
+          args.wp = workerpool_create(n);
+
+          double ns = time_kernel(kern, &args, min_time) / ((double) width*height);
+          printf("%-30s %-6s %5dx%-5d %2d threads %10.3f ns/pixel\n",
+                 kern->name, kern->simd ? simd_isa_name(isas[j]) : "", width, height, n, ns);
+
+          workerpool_destroy(args.wp);
+          args.wp = NULL;
+
+        }
+
+      }
+
+    }
+
+    image_u8_destroy(im);
+    image_u8_destroy(binary);
+    image_u1_destroy(args.packed);
+    image_u8_destroy(args.work);
+    unionfind_destroy(args.uf);
+
+  }
+
+  for (int i=0; i<NHOMOGRAPHY; ++i) {
+    zarray_destroy(args.correspondences[i]);
+  }
+  for (int i=0; i<NSVD; ++i) {
+    matd_destroy(args.matrices[i]);
+  }
+  apriltag_detector_destroy(td);
+  tag36h11_destroy(args.family);
+
+  zarray_vmap(sizes, free);
+  zarray_destroy(sizes);
+  zarray_vmap(threads, free);
+  zarray_destroy(threads);
+  zarray_vmap(names, free);
+  zarray_destroy(names);
+  zarray_vmap(isa_names, free);
+  zarray_destroy(isa_names);
+  getopt_destroy(getopt);
+
+  return 0;
+
+}
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <float.h>
+#include <string.h>
 
 // see http://research.microsoft.com/en-us/um/people/zhang/INRIA/Publis/Tutorial-Estim/node24.html
 
@@ -282,6 +283,7 @@ void lm_opts_defaults(lm_opts_t* opts) {
   opts->loss_tol = DBL_MIN;
   opts->lfunc = LM_LOSS_L2;
   opts->lparam = 0.0;
+  opts->lambda_init = 1e5;
 }
 
 const char* lm_result_to_string(int result) {
@@ -304,10 +306,11 @@ const char* lm_result_to_string(int result) {
 }
 
 static inline
-void transpose_product_inplace(const matd_t* A, 
-                               const matd_t* W,
-                               const matd_t* X,
-                               matd_t* B) {
+void transpose_product_inplace(int n, int m, int p,
+                               const double* A,
+                               const double* W,
+                               const double* X,
+                               double* B) {
 
   // compute A^T * X = B
   //
@@ -317,14 +320,8 @@ void transpose_product_inplace(const matd_t* A,
   //
   // A has m columns of length n
   // X has p columns of length n
-
-  int n = A->nrows;
-  int m = A->ncols;
-  int p = X->ncols;
-
-  if (W) { assert(W->nrows == n && W->ncols == 1); }
-  assert(X->nrows == n);
-  assert(B->nrows == m && B->ncols == p);
+  //
+  // all are row-major; W (n-by-1) may be null.
 
   // for each row of output
   for (int i=0; i<m; ++i) { 
@@ -338,15 +335,15 @@ void transpose_product_inplace(const matd_t* A,
 
       if (W) { 
         for (int k=0; k<n; ++k) {
-          Bij += MATD_EL(A,k,i) * MATD_EL(X,k,j) * W->data[k];
+          Bij += A[m*k + i] * X[p*k + j] * W[k];
         }
       } else {
         for (int k=0; k<n; ++k) {
-          Bij += MATD_EL(A,k,i) * MATD_EL(X,k,j);
+          Bij += A[m*k + i] * X[p*k + j];
         }
       }
         
-      MATD_EL(B,i,j) = Bij;
+      B[p*i + j] = Bij;
 
     }
     
@@ -355,20 +352,77 @@ void transpose_product_inplace(const matd_t* A,
 
 }
 
-double inf_norm(const matd_t* A) {
+double inf_norm(const double* a, int sz) {
 
-  int sz = A->nrows*A->ncols;
   double n = 0.0;
   
   for (int i=0; i<sz; ++i) {
-    double ai = fabs(A->data[i]);
+    double ai = fabs(a[i]);
     n = ai > n ? ai : n;
   }
 
   return n;
   
 }
-                               
+
+// the Cholesky factorization A = U'U of the m-by-m symmetric matrix A,
+// into the upper triangle of U (as matd_chol_inplace does it). Returns
+// nonzero if A is positive definite.
+static int chol_inplace(int m, const double* A, double* U) {
+
+  memcpy(U, A, sizeof(double)*m*m);
+
+  int is_spd = 1;
+
+  for (int i=0; i<m; ++i) {
+    double d = U[m*i + i];
+    is_spd &= (d > 0);
+
+    if (d < MATD_EPS)
+      d = MATD_EPS;
+    d = 1.0 / sqrt(d);
+
+    for (int j=i; j<m; ++j)
+      U[m*i + j] *= d;
+
+    for (int j=i+1; j<m; ++j) {
+      double s = U[m*i + j];
+
+      if (s == 0)
+        continue;
+
+      for (int k=j; k<m; ++k) {
+        U[m*j + k] -= U[m*i + k]*s;
+      }
+    }
+  }
+
+  return is_spd;
+
+}
+
+// solve U'U x = b for the factor U from chol_inplace.
+static void chol_solve_inplace(int m, const double* U, const double* b, double* x) {
+
+  memcpy(x, b, sizeof(double)*m);
+
+  // solve U'y = b
+  for (int i=0; i<m; ++i) {
+    for (int j=0; j<i; ++j) {
+      x[i] -= U[m*j + i]*x[j];
+    }
+    x[i] /= U[m*i + i];
+  }
+
+  // solve Ux = y
+  for (int k=m-1; k>=0; --k) {
+    x[k] *= 1.0 / U[m*k + k];
+    for (int i=0; i<k; ++i) {
+      x[i] += x[k] * -U[m*i + k];
+    }
+  }
+
+}
 
 int lm_der(int m, // # params
            int n, // # of residuals 
@@ -379,6 +433,26 @@ int lm_der(int m, // # params
            lm_info_t* info, //  may be null
            void* userdata) {
 
+  double* work = (double*)malloc(sizeof(double)*LM_WORK_SIZE(m, n));
+
+  int retval = lm_der_work(m, n, p, func, maxiter, opts, info, userdata, work);
+
+  free(work);
+
+  return retval;
+
+}
+
+int lm_der_work(int m, // # params
+                int n, // # of residuals 
+                double* p, // input: initial param vec; output: final param vec
+                lm_res_func_t func, // function to optimize
+                int maxiter, // maximum number of iterations 
+                const lm_opts_t* opts, // may be null
+                lm_info_t* info, //  may be null
+                void* userdata,
+                double* work) {
+
   lm_opts_t default_opts;
 
   if (!opts) {
@@ -390,21 +464,22 @@ int lm_der(int m, // # params
 
   double lparam = opts->lparam ? opts->lparam : lm_lparam_default(opts->lfunc);
 
-  // allocate space for Jacobian
-  matd_t* J = matd_create(n,m);
-  matd_t* x = matd_create(n,1);
+  // carve the Jacobian etc. out of work (see LM_WORK_SIZE)
+  double* J = work;
+  double* x = J + n*m;
   
-  matd_t* W = opts->lfunc ? matd_create(n,1) : NULL;
+  double* W = opts->lfunc ? x + n : NULL;
 
-  matd_t* JTWJ = matd_create(m,m);
-  matd_t* JTWx = matd_create(m,1);
+  double* JTWJ = x + 2*n;
+  double* U = JTWJ + m*m;
+  double* JTWx = U + m*m;
 
-  matd_t* p_prev = matd_create_data(m, 1, p);
-  matd_t* delta_p = matd_create(m, 1);
+  double* p_prev = JTWx + m;
+  double* delta_p = p_prev + m;
 
-  matd_chol_t* chol = (matd_chol_t*)calloc(1, sizeof(matd_chol_t));
+  memcpy(p_prev, p, sizeof(double)*m);
 
-  double lambda = 1e5;
+  double lambda = opts->lambda_init;
   
   double prev_loss = -1.0;
 
@@ -418,7 +493,7 @@ int lm_der(int m, // # params
     ////////////////////////////////////////////////// 
     // get the residuals and jacobian
 
-    func(m, n, p, x->data, J->data, userdata);
+    func(m, n, p, x, J, userdata);
 
     //////////////////////////////////////////////////
     // compute loss
@@ -427,11 +502,11 @@ int lm_der(int m, // # params
 
     if (opts->lfunc) {
       for (int i=0; i<n; ++i) {
-        cur_loss += lm_loss(opts->lfunc, x->data[i], lparam, W->data+i);
+        cur_loss += lm_loss(opts->lfunc, x[i], lparam, W+i);
       }
     } else {
       for (int i=0; i<n; ++i) {
-        cur_loss += x->data[i]*x->data[i];
+        cur_loss += x[i]*x[i];
       }
       cur_loss *= 0.5;
     }
@@ -444,7 +519,7 @@ int lm_der(int m, // # params
         info->initial_loss = cur_loss;
       }
     } else if (cur_loss > prev_loss) {
-      memcpy(p, p_prev->data, sizeof(double)*m);
+      memcpy(p, p_prev, sizeof(double)*m);
       lambda *= 10.0;
       lambda = lambda < 1e8 ? lambda : 1e8;
       continue;
@@ -455,10 +530,10 @@ int lm_der(int m, // # params
     //////////////////////////////////////////////////
     // form JTWJ and JTWx
 
-    transpose_product_inplace(J, W, J, JTWJ);
-    transpose_product_inplace(J, W, x, JTWx);
+    transpose_product_inplace(n, m, m, J, W, J, JTWJ);
+    transpose_product_inplace(n, m, 1, J, W, x, JTWx);
 
-    double JTWx_infnorm = inf_norm(JTWx);
+    double JTWx_infnorm = inf_norm(JTWx, m);
 
     if (JTWx_infnorm < opts->JT_err_infnorm_tol) {
       retval = LM_SUCCESS;
@@ -472,11 +547,11 @@ int lm_der(int m, // # params
     double dmax = 0.0;
     
     for (int i=0; i<m; ++i) {
-      double JTWJii = MATD_EL(JTWJ, i, i);
+      double JTWJii = JTWJ[m*i + i];
       JTWJii += lambda;
       //JTWJii *= (1.0 + lambda);
       dmax = (JTWJii > dmax) ? JTWJii : dmax;
-      MATD_EL(JTWJ, i, i) = JTWJii;
+      JTWJ[m*i + i] = JTWJii;
     }
 
     lambda *= 0.5;
@@ -490,21 +565,19 @@ int lm_der(int m, // # params
     //////////////////////////////////////////////////
     // do cholesky decompose/solve
     
-    matd_chol_inplace(JTWJ, chol);
-
-    if (!chol->is_spd) {
+    if (!chol_inplace(m, JTWJ, U)) {
       retval = stop_reason = LM_SINGULAR_MATRIX;
       break;
     }
     
-    matd_chol_solve_inplace(chol, JTWx, delta_p);
+    chol_solve_inplace(m, U, JTWx, delta_p);
 
     //////////////////////////////////////////////////
     // update solution
 
-    memcpy(p_prev->data, p, sizeof(double)*m);
+    memcpy(p_prev, p, sizeof(double)*m);
 
-    double relerr = inf_norm(delta_p) / inf_norm(p_prev);
+    double relerr = inf_norm(delta_p, m) / inf_norm(p_prev, m);
 
     if (relerr < opts->delta_p_rel_infnorm_tol) {
       retval = LM_SUCCESS;
@@ -513,20 +586,11 @@ int lm_der(int m, // # params
     }
     
     for (int i=0; i<m; ++i) {
-      p[i] -= delta_p->data[i];
+      p[i] -= delta_p[i];
     }
     
   }
 
-  matd_destroy(J);
-  matd_destroy(x);
-  matd_destroy(W);
-  matd_destroy(JTWJ);
-  matd_destroy(JTWx);
-  matd_destroy(p_prev);
-  matd_destroy(delta_p);
-  matd_chol_destroy(chol);
-
   if (info) {
     info->final_loss = prev_loss;
     info->num_iterations = iter;
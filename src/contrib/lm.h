@@ -37,6 +37,7 @@ typedef struct lm_opts {
   double loss_tol;
   lm_loss_func_t lfunc;
   double lparam; // parameter to loss function
+  double lambda_init; // initial damping; small values start near Gauss-Newton
 } lm_opts_t;
 
 typedef struct lm_info {
@@ -88,6 +89,25 @@ int lm_der(int m, // # of params (unknowns)
            lm_info_t* info, //  may be null
            void* userdata); // passed blindly to func
 
+// The number of doubles of workspace lm_der_work needs for m params
+// and n residuals. It is a constant expression if m and n are, so
+// that small fixed problems can keep their workspace on the stack
+// (double work[LM_WORK_SIZE(8, 32)]); a caller solving many
+// problems can allocate it once for the largest and reuse it.
+#define LM_WORK_SIZE(m, n) ((m)*(n) + 2*(n) + 2*(m)*(m) + 3*(m))
+
+// lm_der, keeping all of its matrices in work (LM_WORK_SIZE(m, n)
+// doubles), so that it never touches the heap.
+int lm_der_work(int m, // # of params (unknowns)
+                int n, // # of residuals 
+                double* p, // input: initial param vec; output: final param vec
+                lm_res_func_t func, // function to optimize
+                int maxiter, // maximum number of iterations 
+                const lm_opts_t* opts, // may be null
+                lm_info_t* info, //  may be null
+                void* userdata, // passed blindly to func
+                double* work);
+
 #ifdef __cplusplus
 }
 #endif 
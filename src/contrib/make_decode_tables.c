@@ -0,0 +1,135 @@
+/* Generates the decode tables compiled into the library (see
+   apriltag_decode_tables.h).
+
+   Usage: make_decode_tables <output directory> [family:maxhamming ...]
+
+   Saves the table of each family (correcting maxhamming errors) in the
+   output directory, as apriltag_family_save_decode_table does, and
+   writes apriltag_decode_tables.c there, which embeds the saved files
+   with the assembler's .incbin and lists them in
+   apriltag_decode_tables[]. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag.h"
+#include "apriltag_family.h"
+#include "apriltag_decode_tables.h"
+
+// this program is linked with the library's objects but not with the
+// tables it generates for it: build every table from scratch.
+const apriltag_decode_table_t apriltag_decode_tables[] = { { NULL, 0 } };
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <output directory> [family:maxhamming ...]\n", argv[0]);
+        return 1;
+    }
+
+    const char *outdir = argv[1];
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/apriltag_decode_tables.c", outdir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "couldn't create %s\n", path);
+        return 1;
+    }
+
+    fprintf(f,
+            "// Generated by make_decode_tables. Do not edit.\n"
+            "\n"
+            "#include \"apriltag_decode_tables.h\"\n"
+            "\n"
+            "#ifdef __APPLE__\n"
+            "# define DECODE_TABLE_SECTION \".const_data\\n\"\n"
+            "# define DECODE_TABLE_SECTION_END \".text\\n\"\n"
+            "# define DECODE_TABLE_SYMBOL(s) \".private_extern _\" s \"\\n_\" s \":\\n\"\n"
+            "#else\n"
+            "# define DECODE_TABLE_SECTION \".pushsection .rodata\\n\"\n"
+            "# define DECODE_TABLE_SECTION_END \".popsection\\n\"\n"
+            "# define DECODE_TABLE_SYMBOL(s) \".globl \" s \"\\n.hidden \" s \"\\n\" s \":\\n\"\n"
+            "#endif\n"
+            "\n");
+
+    apriltag_detector_t *td = apriltag_detector_create();
+
+    int ntables = 0;
+    long lens[argc];
+
+    for (int i = 2; i < argc; i++) {
+        char famname[256];
+        int maxhamming;
+
+        const char *colon = strchr(argv[i], ':');
+        if (colon == NULL || colon - argv[i] >= (int) sizeof(famname) ||
+            sscanf(colon + 1, "%d", &maxhamming) != 1 || maxhamming < 0 || maxhamming > 3) {
+            fprintf(stderr, "expected family:maxhamming (with maxhamming 0 to 3), not %s\n", argv[i]);
+            return 1;
+        }
+
+        memcpy(famname, argv[i], colon - argv[i]);
+        famname[colon - argv[i]] = 0;
+
+        apriltag_family_t *fam = apriltag_family_create(famname);
+        if (fam == NULL) {
+            fprintf(stderr, "unrecognized tag family %s\n", famname);
+            return 1;
+        }
+
+        char tblpath[4096];
+        snprintf(tblpath, sizeof(tblpath), "%s/%s_h%d.tbl", outdir, famname, maxhamming);
+
+        apriltag_family_build_decode_table(fam, maxhamming);
+        if (apriltag_family_save_decode_table(fam, tblpath) != 0) {
+            fprintf(stderr, "couldn't save decode table to %s\n", tblpath);
+            return 1;
+        }
+
+        // (removing the family from a detector frees its table.)
+        apriltag_detector_add_family(td, fam);
+        apriltag_detector_remove_family(td, fam);
+        apriltag_family_destroy(fam);
+
+        FILE *tbl = fopen(tblpath, "rb");
+        long len = -1;
+        if (tbl != NULL && fseek(tbl, 0, SEEK_END) == 0)
+            len = ftell(tbl);
+        if (tbl != NULL)
+            fclose(tbl);
+        if (len < 0) {
+            fprintf(stderr, "couldn't read back %s\n", tblpath);
+            return 1;
+        }
+
+        // (the symbols are hidden, i.e. local to the library.)
+        fprintf(f,
+                "// %s, correcting up to %d errors\n"
+                "__asm__(DECODE_TABLE_SECTION\n"
+                "        \".balign 64\\n\"\n"
+                "        DECODE_TABLE_SYMBOL(\"apriltag_decode_table_%d\")\n"
+                "        \".incbin \\\"%s\\\"\\n\"\n"
+                "        DECODE_TABLE_SECTION_END);\n"
+                "extern const char apriltag_decode_table_%d[];\n"
+                "\n",
+                famname, maxhamming, ntables, tblpath, ntables);
+
+        lens[ntables++] = len;
+    }
+
+    fprintf(f, "const apriltag_decode_table_t apriltag_decode_tables[] = {\n");
+    for (int i = 0; i < ntables; i++)
+        fprintf(f, "    { apriltag_decode_table_%d, %ld },\n", i, lens[i]);
+    fprintf(f, "    { NULL, 0 }\n};\n");
+
+    apriltag_detector_destroy(td);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "couldn't write %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
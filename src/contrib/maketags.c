@@ -5,15 +5,17 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "apriltag.h"
 #include "apriltag_family.h"
 #include "apriltag_vis.h"
 #include "image_u8.h"
-#include "contour.h"
 
 #include "zarray.h"
 #include "getopt.h"
+#include "workerpool.h"
 
 #include "pdfutil.h"
 
@@ -155,9 +157,57 @@ typedef struct options {
     const unit_t* font_unit;
 
     char tagsize_buf[1024];
+
+    // raster export: the directory to write into (NULL to write a
+    // pdf), the sizes (in pixels, white border included) to render
+    // each tag at, and the number of threads to render with.
+    const char* raster_dir;
+    int raster_sizes[64];
+    int nraster_sizes;
+    int raster_border;
+    int nthreads;
     
 } options_t;
 
+void get_raster_options(getopt_t* getopt, options_t* opts, double border_px) {
+
+    opts->raster_dir = getopt_get_string(getopt, "raster");
+    opts->raster_border = (int) round(border_px);
+    opts->nthreads = getopt_get_int(getopt, "threads");
+    if (opts->raster_border < 0) { opts->raster_border = 0; }
+    if (opts->nthreads < 1) { opts->nthreads = 1; }
+
+    int native = opts->family->d + 2*(opts->family->black_border + opts->raster_border);
+
+    opts->nraster_sizes = 0;
+
+    char* sizes = strdup(getopt_get_string(getopt, "sizes"));
+    for (char* tok = strtok(sizes, ","); tok; tok = strtok(NULL, ",")) {
+        int size = atoi(tok);
+        if (size < native) {
+            fprintf(stderr, "error: raster size %s is less than the tag's %d pixels\n", tok, native);
+            exit(1);
+        }
+        if (opts->nraster_sizes == 64) {
+            fprintf(stderr, "error: at most 64 raster sizes can be given\n");
+            exit(1);
+        }
+        opts->raster_sizes[opts->nraster_sizes++] = size;
+    }
+    free(sizes);
+
+    if (!opts->nraster_sizes) {
+        opts->raster_sizes[opts->nraster_sizes++] = native;
+    }
+
+    printf("using tag family %s of size %d\n",
+           opts->family->name, opts->family->d);
+
+    printf("rendering %u tags at %d sizes with %d threads into %s\n",
+           opts->max_id, opts->nraster_sizes, opts->nthreads, opts->raster_dir);
+
+}
+
 void get_options(int argc, char** argv, options_t* opts) {
 
     getopt_t* getopt = getopt_create();
@@ -178,6 +228,9 @@ void get_options(int argc, char** argv, options_t* opts) {
     getopt_add_string(getopt, 's', "fontsize", "12pt", "Font size for labels");
     getopt_add_double(getopt, 'g', "labelgray", "0.75", "Label grayscale (0=black, 1=white)");
     getopt_add_double(getopt, 'o', "output", "tags.pdf", "Output filename");
+    getopt_add_string(getopt, 'r', "raster", "", "Write each tag as a PGM file into this directory instead of a pdf");
+    getopt_add_string(getopt, 'S', "sizes", "", "Raster sizes in pixels, white border included (e.g. 10,20,40; default: one pixel per bit)");
+    getopt_add_int(getopt, 'j', "threads", "4", "Render rasters with this many threads");
 
     if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
         printf("Usage: %s [options] <input files>\n", argv[0]);
@@ -233,6 +286,12 @@ void get_options(int argc, char** argv, options_t* opts) {
         opts->max_id = opts->family->ncodes;
     }
 
+    opts->raster_dir = NULL;
+    if (*getopt_get_string(getopt, "raster")) {
+        get_raster_options(getopt, opts, border_px);
+        return;
+    }
+
     if (*paper_str) {
         opts->paper_unit = lookup_paper(paper_str, opts->paper_dims);
         if (*paperdims_str) {
@@ -375,12 +434,127 @@ void format_label(char* buf, size_t count,
 
 }
 
+// Rasters of a range of tags, at every size: rendered (by the nearest
+// pixel of the tag's texture) into one image per size, and written out
+// by the same thread.
+typedef struct raster_task {
+    const options_t* opts;
+    uint32_t id0, id1;
+    int* nerrors;
+} raster_task_t;
+
+static void raster_task(void* p) {
+
+    raster_task_t* task = p;
+    const options_t* opts = task->opts;
+
+    image_u8_t* images[64];
+    for (int s=0; s<opts->nraster_sizes; ++s) {
+        images[s] = image_u8_create(opts->raster_sizes[s], opts->raster_sizes[s]);
+    }
+
+    int nerrors = 0;
+
+    for (uint32_t i=task->id0; i<task->id1; ++i) {
+
+        image_u8_t* tex = apriltag_vis_texture2(opts->family, opts->family->codes[i],
+                                                opts->raster_border, 255, 0);
+
+        for (int s=0; s<opts->nraster_sizes; ++s) {
+
+            image_u8_t* im = images[s];
+            int size = opts->raster_sizes[s];
+
+            int sx[size];
+            for (int x=0; x<size; ++x) {
+                sx[x] = x * tex->width / size;
+            }
+
+            for (int y=0; y<size; ++y) {
+                const uint8_t* src = &tex->buf[(y * tex->height / size) * tex->stride];
+                uint8_t* dst = &im->buf[y*im->stride];
+                for (int x=0; x<size; ++x) {
+                    dst[x] = src[sx[x]];
+                }
+            }
+
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s_%05u_%d.pgm",
+                     opts->raster_dir, opts->family->name, i, size);
+
+            if (image_u8_write_pnm(im, path) != 0) {
+                nerrors++;
+            }
+
+        }
+
+        image_u8_destroy(tex);
+
+    }
+
+    for (int s=0; s<opts->nraster_sizes; ++s) {
+        image_u8_destroy(images[s]);
+    }
+
+    __atomic_add_fetch(task->nerrors, nerrors, __ATOMIC_RELAXED);
+
+}
+
+int write_rasters(const options_t* opts) {
+
+    if (mkdir(opts->raster_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error: can't create %s\n", opts->raster_dir);
+        return 1;
+    }
+
+    workerpool_t* wp = workerpool_create(opts->nthreads);
+
+    // (a few ranges per thread, so that they finish together.)
+    int ntasks = 4*opts->nthreads;
+    if ((uint32_t) ntasks > opts->max_id) { ntasks = opts->max_id; }
+
+    raster_task_t tasks[ntasks + 1];
+    int nerrors = 0;
+
+    for (int t=0; t<ntasks; ++t) {
+        tasks[t].opts = opts;
+        tasks[t].id0 = (uint64_t) opts->max_id * t / ntasks;
+        tasks[t].id1 = (uint64_t) opts->max_id * (t+1) / ntasks;
+        tasks[t].nerrors = &nerrors;
+        workerpool_add_task(wp, raster_task, &tasks[t]);
+    }
+
+    workerpool_run(wp);
+    workerpool_destroy(wp);
+
+    if (nerrors) {
+        fprintf(stderr, "error: couldn't write %d files into %s\n", nerrors, opts->raster_dir);
+        return 1;
+    }
+
+    return 0;
+
+}
+
 int main(int argc, char** argv) {
 
     options_t opts;
     get_options(argc, argv, &opts);
-    
-    pdf_t* pdf = pdf_create(opts.paper_dims[0], opts.paper_dims[1]);
+
+    if (opts.raster_dir) {
+        return write_rasters(&opts);
+    }
+
+    // (written a page at a time, so that a sheet of every tag of a
+    // large family takes no more memory than a page.)
+    FILE* fp = fopen(opts.output_filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "error: can't write %s\n", opts.output_filename);
+        exit(1);
+    }
+
+    pdf_t* pdf = pdf_create_streaming(opts.paper_dims[0], opts.paper_dims[1],
+                                      pdf_file_write, fp);
 
     int row = 0;
     int col = 0;
@@ -406,8 +580,6 @@ int main(int argc, char** argv) {
 
         image_u8_t* image = apriltag_vis_texture2(opts.family, code, 0, 255, 0);
 
-        zarray_t* contours = contour_line_sweep(image);
-
         double tx = opts.p0[0] + col*opts.tag_step[0];
         double ty = opts.p0[1] - (row+1)*opts.tag_step[1];
 
@@ -434,42 +606,24 @@ int main(int argc, char** argv) {
         pdf_ctm_concat(pdf, opts.px, 0, 0, opts.px,
                        tx+opts.border, ty+opts.border+opts.fontsize);
         
+        // the black bits, as rectangles.
         zarray_t* path = pdf_path_create();
-        pdf_path_rect(path, 0, 0, opts.base_px, opts.base_px);
-    
-        for (int i=0; i<zarray_size(contours); ++i) {
-
-            zarray_t* contour;
-            zarray_get(contours, i, &contour);
-
-            for (int j=0; j<zarray_size(contour); ++j) {
-                
-                const contour_point_t* pj;
-                zarray_get_volatile(contour, j, &pj);
-                
-                int py = image->height - pj->y;
-                
-                if (j == 0) {
-                    pdf_path_move_to(path, pj->x, py);
-                } else {
-                    pdf_path_line_to(path, pj->x, py);
-                }
-                
-            }
-            
-            pdf_path_close(path);
-
-        }
+        pdf_path_image_runs(path, image, 128);
 
         pdf_path_draw(pdf, path, PDF_STROKE_NONE, PDF_FILL_NONZERO);
         pdf_gstate_pop(pdf);
 
-        contour_line_sweep_destroy(contours);
         image_u8_destroy(image);
         
     }
 
-    pdf_save(pdf, opts.output_filename);
+    int status = pdf_finish(pdf);
+    pdf_destroy(pdf);
+
+    if (fclose(fp) != 0 || status != 0) {
+        fprintf(stderr, "error: couldn't write %s\n", opts.output_filename);
+        return 1;
+    }
     
     return 0;
 
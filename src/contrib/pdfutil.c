@@ -61,9 +61,12 @@ struct pdf_object {
 
 typedef struct pdf_toplevel_object {
   pdf_refspec_t refspec;
-  pdf_object_t* object;
+  pdf_object_t* object; // NULL once written (see pdf_create_streaming)
+  size_t offset; // in the file, once written
 } pdf_toplevel_object_t;
 
+typedef struct pdf_writer pdf_writer_t;
+
 typedef struct pdf_gstate {
   pdf_stroke_t stroke;
   pdf_fill_t fill;
@@ -80,6 +83,11 @@ struct pdf {
   zarray_t* toplevel_objects; // of pdf_toplevel_object_t*
   pdf_refspec_t fonts[14];
   zarray_t* gstate;
+
+  // the output of a streaming pdf (see pdf_create_streaming), and the
+  // number of toplevel objects that precede those of the current page.
+  pdf_writer_t* out;
+  int page_start;
 };
 
 int pdf_objects_equal(const pdf_object_t* a,
@@ -465,17 +473,22 @@ int pdf_lookup_toplevel(pdf_t* pdf, pdf_refspec_t refspec) {
 }
 
 
-typedef struct pdf_writer {
+struct pdf_writer {
   pdf_write_callback callback;
   void* userdata;
   size_t bytes_written;
+  int status; // of the first write that failed, which stops the rest
     jmp_buf env;
-} pdf_writer_t;
+};
 
 void pdf_write(pdf_writer_t* w, size_t len, const char* data) {
+  if (w->status != 0) {
+    return;
+  }
   int status = w->callback(len, data, w->userdata);
   if (status != 0) {
-      
+    w->status = status;
+    return;
   }
   w->bytes_written += len;
 }
@@ -599,10 +612,7 @@ void pdf_write_object(pdf_writer_t* w, pdf_object_t* o) {
 
 }
 
-int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
-
-  size_t nobj = zarray_size(pdf->toplevel_objects);
-  size_t toplevel_offsets[nobj];
+void pdf_write_header(pdf_writer_t* w) {
 
   pdf_write_str(w, "%PDF-1.1\n");
 
@@ -610,6 +620,42 @@ int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
                 "\xEF\xBC\x89\xE2\x95\xAF\xEF\xB8\xB5 "
                 "\xE2\x94\xBB\xE2\x94\x81\xE2\x94\xBB\n\n");
 
+}
+
+// write a toplevel object, noting its offset for the xref; a
+// streaming pdf then frees it.
+void pdf_write_toplevel(pdf_writer_t* w, pdf_t* pdf, pdf_toplevel_object_t* tli) {
+
+  char buf[1024];
+
+  tli->offset = w->bytes_written;
+
+  snprintf(buf, 1024, "%d %d obj\n", tli->refspec.id, tli->refspec.revision);
+  pdf_write_str(w, buf);
+
+  pdf_write_object(w, tli->object);
+  if (tli->object->type != PDF_OBJECT_STREAM) {
+    pdf_write_str(w, "\n");
+  }
+  pdf_write_str(w, "endobj\n\n");
+
+  if (pdf->out) {
+    pdf_object_destroy(tli->object);
+    tli->object = NULL;
+  }
+
+}
+
+int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
+
+  size_t nobj = zarray_size(pdf->toplevel_objects);
+
+  // (a streaming pdf has written its header, and the objects of its
+  // previous pages, already.)
+  if (!pdf->out) {
+    pdf_write_header(w);
+  }
+
   char buf[1024];
   
   // write toplevel objects
@@ -618,16 +664,9 @@ int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
     pdf_toplevel_object_t* tli;
     zarray_get_volatile(pdf->toplevel_objects, i, &tli);
 
-    toplevel_offsets[i] = w->bytes_written;
-
-    snprintf(buf, 1024, "%d %d obj\n", tli->refspec.id, tli->refspec.revision);
-    pdf_write_str(w, buf);
-    
-    pdf_write_object(w, tli->object);
-    if (tli->object->type != PDF_OBJECT_STREAM) {
-      pdf_write_str(w, "\n");
+    if (tli->object) {
+      pdf_write_toplevel(w, pdf, tli);
     }
-    pdf_write_str(w, "endobj\n\n");
     
   }
 
@@ -639,7 +678,9 @@ int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
   pdf_write_str(w, buf);
   pdf_write_str(w, "0000000000 65535 f \n");
   for (size_t i=0; i<nobj; ++i) {
-    snprintf(buf, 1024, "%010d 00000 n \n", (int)toplevel_offsets[i]);
+    pdf_toplevel_object_t* tli;
+    zarray_get_volatile(pdf->toplevel_objects, i, &tli);
+    snprintf(buf, 1024, "%010d 00000 n \n", (int)tli->offset);
     pdf_write_str(w, buf);
   }
   pdf_write_str(w, "trailer\n");
@@ -652,7 +693,7 @@ int pdf_write_full(pdf_writer_t* w, pdf_t* pdf) {
   pdf_write_str(w, buf);
   pdf_write_str(w, "%%EOF\n");
 
-  return 0;
+  return w->status;
   
 }
 void pdf_finish_page(pdf_t* pdf) {
@@ -683,6 +724,19 @@ void pdf_end_page(pdf_t* pdf) {
 
   pdf_finish_page(pdf);
 
+  // a streaming pdf writes out the objects of the page (but for the
+  // catalog and the pages dict, which last until the end).
+  if (pdf->out && pdf->cur_page) {
+    for (int i=pdf->page_start; i<zarray_size(pdf->toplevel_objects); ++i) {
+      pdf_toplevel_object_t* tli;
+      zarray_get_volatile(pdf->toplevel_objects, i, &tli);
+      if (tli->object && tli->refspec.id != 1 && tli->refspec.id != pdf->pages_ref.id) {
+        pdf_write_toplevel(pdf->out, pdf, tli);
+      }
+    }
+    pdf->page_start = zarray_size(pdf->toplevel_objects);
+  }
+
   pdf_gstate_t* base_gstate = pdf_cur_gstate(pdf);
 
   pdf_stroke_t old_stroke = base_gstate->stroke;
@@ -721,9 +775,21 @@ void pdf_end_page(pdf_t* pdf) {
 }
 
 pdf_t* pdf_create(double width, double height) {
+  return pdf_create_streaming(width, height, NULL, NULL);
+}
+
+pdf_t* pdf_create_streaming(double width, double height,
+                            pdf_write_callback cbk, void* userdata) {
 
   pdf_t* pdf = calloc(1, sizeof(pdf_t));
 
+  if (cbk) {
+    pdf->out = calloc(1, sizeof(pdf_writer_t));
+    pdf->out->callback = cbk;
+    pdf->out->userdata = userdata;
+    pdf_write_header(pdf->out);
+  }
+
   pdf->toplevel_objects = zarray_create(sizeof(pdf_toplevel_object_t));
 
   pdf_object_t* catalog = pdf_dict_create();
@@ -775,6 +841,7 @@ void pdf_destroy(pdf_t* pdf) {
 
   zarray_destroy(pdf->gstate);
 
+  free(pdf->out);
   free(pdf);
   
 }
@@ -795,7 +862,7 @@ int pdf_file_write(size_t len,
                     const char* data,
                     void* fp) {
     
-    return fwrite(data, len, 1, (FILE*)fp);
+    return fwrite(data, 1, len, (FILE*)fp) == len ? 0 : -1;
   
 }
 
@@ -804,6 +871,11 @@ int pdf_save_stream(pdf_t* pdf,
                      pdf_write_callback cbk,
                      void* userdata) {
 
+    // (a streaming pdf is written as it goes: see pdf_finish.)
+    if (pdf->out) {
+        return -1;
+    }
+
     pdf_finish_page(pdf);
 
   pdf_writer_t w = { cbk, userdata, 0 };
@@ -818,6 +890,18 @@ int pdf_save_stream(pdf_t* pdf,
   
 }
 
+int pdf_finish(pdf_t* pdf) {
+
+  if (!pdf->out) {
+    return -1;
+  }
+
+  pdf_finish_page(pdf);
+
+  return pdf_write_full(pdf->out, pdf);
+
+}
+
 int pdf_save(pdf_t* pdf,
              const char* filename) {
 
@@ -1050,6 +1134,59 @@ void pdf_path_rect(zarray_t* path, double x, double y, double w, double h) {
     zarray_add(path, &element);
 }
 
+void pdf_path_image_runs(zarray_t* path, const image_u8_t* image, int threshold) {
+
+    int w = image->width, h = image->height;
+
+    // the rectangle open at each x: the end of its run (0 if none),
+    // and its first row (from the top).
+    int run_end[w], run_y0[w];
+    memset(run_end, 0, sizeof(run_end));
+
+    for (int y=0; y<=h; ++y) {
+
+        // each run of this row (none past the last) either continues
+        // the rectangle open at its start, or opens one there, and
+        // the rectangles it doesn't continue are closed.
+        int x = 0;
+        while (x < w) {
+
+            int x1 = x;
+            if (y < h) {
+                while (x1 < w && image->buf[y*image->stride + x1] < threshold) { ++x1; }
+            }
+
+            if (x1 == x) {
+                if (run_end[x]) {
+                    pdf_path_rect(path, x, h - y, run_end[x] - x, y - run_y0[x]);
+                    run_end[x] = 0;
+                }
+                ++x;
+                continue;
+            }
+
+            if (run_end[x] != x1) {
+                if (run_end[x]) {
+                    pdf_path_rect(path, x, h - y, run_end[x] - x, y - run_y0[x]);
+                }
+                run_end[x] = x1;
+                run_y0[x] = y;
+            }
+
+            // (no rectangle opens within a run.)
+            for (int xi=x+1; xi<x1; ++xi) {
+                if (run_end[xi]) {
+                    pdf_path_rect(path, xi, h - y, run_end[xi] - xi, y - run_y0[xi]);
+                    run_end[xi] = 0;
+                }
+            }
+
+            x = x1;
+        }
+    }
+
+}
+
 void pdf_path_move_to(zarray_t* path, double x, double y) {
     pdf_path_element_t element = { PDF_PATH_TYPE_MOVETO, { x, y } };
     zarray_add(path, &element);
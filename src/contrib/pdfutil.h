@@ -12,8 +12,26 @@ extern "C" {
 
 typedef struct pdf pdf_t;
 
+// should return 0 on success
+typedef int (*pdf_write_callback)(size_t len, const char* data,
+                                  void* userdata);
+
 pdf_t* pdf_create(double width, double height);
 
+// A pdf which is written as it goes, through cbk (e.g. pdf_file_write
+// of a FILE*), rather than kept whole until pdf_save: the objects of
+// each page (its contents, images and fonts) are written, and freed,
+// when the page ends, noting their offsets for the xref table, so
+// that the pages the pdf keeps cost only a reference apiece.
+// pdf_finish then writes the rest. pdf_save and pdf_save_stream don't
+// apply.
+pdf_t* pdf_create_streaming(double width, double height,
+                            pdf_write_callback cbk, void* userdata);
+
+// Finish a streaming pdf. Returns 0, or the status of the write that
+// failed.
+int pdf_finish(pdf_t* pdf);
+
 void pdf_destroy(pdf_t* pdf);
 
 typedef enum pdf_font {
@@ -72,9 +90,6 @@ typedef struct pdf_fill {
 } pdf_fill_t;
 
 
-// should return 0 on success
-typedef int (*pdf_write_callback)(size_t len, const char* data,
-                                  void* userdata);
 
 void pdf_end_page(pdf_t* pdf);
 
@@ -125,6 +140,13 @@ void pdf_path_line_to(zarray_t* path, double x, double y);
 void pdf_path_rect(zarray_t* path, double x0, double y0, double w, double h);
 void pdf_path_close(zarray_t* path);
 
+// Add to path the rectangles that cover the pixels of image darker
+// than threshold, a unit apiece with y up from the bottom left corner
+// of the image: each horizontal run of them, merged with the same run
+// in the rows that follow (so that a tag takes a few rectangles, the
+// nonzero fill of which needs no contours).
+void pdf_path_image_runs(zarray_t* path, const image_u8_t* image, int threshold);
+
 void pdf_path_draw(pdf_t* pdf,
                    zarray_t* path,
                    pdf_stroke_type_t stroke_type,
@@ -1,6 +1,8 @@
 #include "pose.h"
 #include "zarray.h"
 #include "homography.h"
+#include "workerpool.h"
+#include "zhash.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,9 +13,6 @@
 
 typedef struct matd_12 { int nrows, ncols; double data[12]; } matd_12_t;
 typedef struct matd_9 { int nrows, ncols; double data[9]; } matd_9_t;
-typedef struct matd_8 { int nrows, ncols; double data[8]; } matd_8_t;
-typedef struct matd_6 { int nrows, ncols; double data[6]; } matd_6_t;
-typedef struct matd_3 { int nrows, ncols; double data[3]; } matd_3_t;
 
 
 matd_t* cross_mat(const double v[3]) {
@@ -89,10 +88,12 @@ static void accum_vec(double a[3], double alpha, double b[3]) {
     }
 }
 
-void rotate_vector(const double rvec[3],
-                   const double v[3],
-                   double Rv[3],
-                   matd_t** J) {
+// rotate_vector, with the jacobian (if J is not NULL) in a fixed size
+// array rather than a new matrix.
+static void rotate_vector_fixed(const double rvec[3],
+                                const double v[3],
+                                double Rv[3],
+                                double J[3][3]) {
 
     double k[3], theta;
     polar_decomp(rvec, k, &theta);
@@ -172,10 +173,28 @@ void rotate_vector(const double rvec[3],
         }
     };
 
-    const matd_t* A = (const matd_t*)&Afoo;
-    const matd_t* B = (const matd_t*)&Bfoo;
+    for (int i=0; i<3; ++i) {
+        for (int j=0; j<3; ++j) {
+            double acc = 0;
+            for (int k=0; k<4; ++k) {
+                acc += Afoo.data[4*i+k] * Bfoo.data[3*k+j];
+            }
+            J[i][j] = acc;
+        }
+    }
+
+}
+
+void rotate_vector(const double rvec[3],
+                   const double v[3],
+                   double Rv[3],
+                   matd_t** J) {
+
+    double Jr[3][3];
 
-    *J = matd_multiply(A, B);
+    rotate_vector_fixed(rvec, v, Rv, J ? Jr : NULL);
+
+    if (J) { *J = matd_create_data(3, 3, &Jr[0][0]); }
 
 }
 
@@ -266,12 +285,8 @@ void rvec_from_quaternion(const double qorig[4], double rvec[3]) {
 
 }
 
-void project_points(double fx, double fy, double cx, double cy,
-                    double tagsize,
-                    const double rvec[3],
-                    const double tvec[3],
-                    double corners_reproj[][2], // 4x2
-                    matd_t** Jptr) {
+// The corners of a tag of tagsize, in its own frame.
+static void tag_corners(double tagsize, double corners[4][3]) {
 
     const double corners_raw[4][3] = {
         { -0.5*tagsize, -0.5*tagsize, 0 },
@@ -280,24 +295,34 @@ void project_points(double fx, double fy, double cx, double cy,
         { -0.5*tagsize,  0.5*tagsize, 0 }
     };
 
-    if (Jptr) { *Jptr = matd_create(8, 6); }
-    
-    matd_9_t dpi_dgi = {
-        3, 3, {
-            fx, 0, cx,
-            0, fy, cy,
-            0, 0, 1
-        }
+    memcpy(corners, corners_raw, sizeof(corners_raw));
+
+}
+
+// project_points of the four corners corners_obj (in the frame that
+// rvec, tvec transform to the camera's), with the jacobian (if J is
+// not NULL) in a fixed size array rather than a new matrix.
+static void project_corners_fixed(double fx, double fy, double cx, double cy,
+                                  const double corners_raw[4][3],
+                                  const double rvec[3],
+                                  const double tvec[3],
+                                  double corners_reproj[][2], // 4x2
+                                  double J[8][6]) {
+
+    const double dpi_dgi[3][3] = {
+        { fx, 0, cx },
+        { 0, fy, cy },
+        { 0, 0, 1 }
     };
-    
+
     for (int i=0; i<4; ++i) {
-        
+
         const double* vi = corners_raw[i];
         double gi[3];
-        
-        // g = R(r)*v 
-        matd_t* dgi_dr;
-        rotate_vector(rvec, vi, gi, Jptr ? &dgi_dr : NULL);
+
+        // g = R(r)*v
+        double dgi_dr[3][3];
+        rotate_vector_fixed(rvec, vi, gi, J ? dgi_dr : NULL);
 
         // g = R(r)*v + t
         for (int j=0; j<3; ++j) { gi[j] += tvec[j]; }
@@ -313,50 +338,83 @@ void project_points(double fx, double fy, double cx, double cy,
         qi[0] = pi[0]/pi[2];
         qi[1] = pi[1]/pi[2];
 
-        if (Jptr) { 
+        if (J) {
 
-            matd_6_t dqi_dpi = {
-                2, 3, {
-                    1/pi[2], 0, -pi[0]/(pi[2]*pi[2]),
-                    0, 1/pi[2], -pi[1]/(pi[2]*pi[2])
-                }
+            const double dqi_dpi[2][3] = {
+                { 1/pi[2], 0, -pi[0]/(pi[2]*pi[2]) },
+                { 0, 1/pi[2], -pi[1]/(pi[2]*pi[2]) }
             };
 
-            matd_t* dqi_dgi = matd_multiply((const matd_t*)&dqi_dpi,
-                                            (const matd_t*)&dpi_dgi);
-
             // dqi_dr = dqi_dpi * dpi_dgi * dgi_dr
-            //        = dqi_dgi
+            //        = dqi_dgi * dgi_dr
+            // dqi_dt = dqi_dgi
 
-            matd_t* dqi_dr = matd_multiply(dqi_dgi, dgi_dr);
-            matd_t* dqi_dt = dqi_dgi; // * I
+            double dqi_dgi[2][3];
 
             for (int k=0; k<2; ++k) {
                 for (int j=0; j<3; ++j) {
-                    MATD_EL(*Jptr, 2*i+k, j+0) = MATD_EL(dqi_dr, k, j);
-                    MATD_EL(*Jptr, 2*i+k, j+3) = MATD_EL(dqi_dt, k, j);
+                    double acc = 0;
+                    for (int l=0; l<3; ++l) { acc += dqi_dpi[k][l] * dpi_dgi[l][j]; }
+                    dqi_dgi[k][j] = acc;
+                }
+            }
+
+            for (int k=0; k<2; ++k) {
+                for (int j=0; j<3; ++j) {
+                    double acc = 0;
+                    for (int l=0; l<3; ++l) { acc += dqi_dgi[k][l] * dgi_dr[l][j]; }
+                    J[2*i+k][j+0] = acc;
+                    J[2*i+k][j+3] = dqi_dgi[k][j];
                 }
             }
 
-            matd_destroy(dqi_dr);
-            matd_destroy(dqi_dgi);
-            matd_destroy(dgi_dr);
-            
         }
-        
+
     }
 
+}
+
+// project_points, with the jacobian (if J is not NULL) in a fixed size
+// array rather than a new matrix.
+static void project_points_fixed(double fx, double fy, double cx, double cy,
+                                 double tagsize,
+                                 const double rvec[3],
+                                 const double tvec[3],
+                                 double corners_reproj[][2], // 4x2
+                                 double J[8][6]) {
+
+    double corners_raw[4][3];
+    tag_corners(tagsize, corners_raw);
+
+    project_corners_fixed(fx, fy, cx, cy, corners_raw, rvec, tvec, corners_reproj, J);
 
 }
 
-double reprojection_error(const double corners_meas[][2],
-                          const double corners_reproj[][2],
-                          const matd_t* Jrt,
-                          double rtgrad[6]) {
+void project_points(double fx, double fy, double cx, double cy,
+                    double tagsize,
+                    const double rvec[3],
+                    const double tvec[3],
+                    double corners_reproj[][2], // 4x2
+                    matd_t** Jptr) {
 
-    matd_8_t err = { 8, 1, { 0 } };
-    double errsum = 0;
+    double J[8][6];
+
+    project_points_fixed(fx, fy, cx, cy, tagsize, rvec, tvec,
+                         corners_reproj, Jptr ? J : NULL);
 
+    if (Jptr) { *Jptr = matd_create_data(8, 6, &J[0][0]); }
+
+}
+
+// reprojection_error, with the jacobian Jrt (8x6, row major, or NULL)
+// in a plain array.
+static double reprojection_error_fixed(const double corners_meas[][2],
+                                       const double corners_reproj[][2],
+                                       const double* Jrt,
+                                       double rtgrad[6]) {
+
+    double err[8];
+    double errsum = 0;
 
     for (int i=0; i<4; ++i) {
         for (int k=0; k<2; ++k) {
@@ -366,21 +424,35 @@ double reprojection_error(const double corners_meas[][2],
             double ei = 0.5 * (corners_reproj[i][k] - corners_meas[i][k]);
             errsum += ei * ei;
 
-            err.data[row] = ei;
+            err[row] = ei;
 
         }
     }
 
     if (rtgrad && Jrt) {
-        matd_t* g = matd_op("M'*M", Jrt, (const matd_t*)&err);
-        memcpy(rtgrad, g->data, 6*sizeof(double));
-        matd_destroy(g);
+        for (int j=0; j<6; ++j) {
+            double acc = 0;
+            for (int row=0; row<8; ++row) { acc += Jrt[6*row+j] * err[row]; }
+            rtgrad[j] = acc;
+        }
     }
 
     return  errsum;
 
 }
 
+double reprojection_error(const double corners_meas[][2],
+                          const double corners_reproj[][2],
+                          const matd_t* Jrt,
+                          double rtgrad[6]) {
+
+    if (Jrt) { assert(Jrt->nrows == 8 && Jrt->ncols == 6); }
+
+    return reprojection_error_fixed(corners_meas, corners_reproj,
+                                    Jrt ? Jrt->data : NULL, rtgrad);
+
+}
+
 double reprojection_objective(const double corners_meas[][2], 
                               double fx, double fy, double kx, double ky,
                               double tagsize,
@@ -412,122 +484,411 @@ double reprojection_objective(const double corners_meas[][2],
 
 }
 
-matd_t* pose_from_homography(const matd_t* H,
-                             double fx, double fy, double cx, double cy,
-                             double tagsize,
-                             double z_sign,
-                             const double corners_meas[][2],
-                             double* initial_error,
-                             double* final_error) {
+// The orthogonal factor of the polar decomposition of the 3x3 matrix R
+// (row major), in place, by Newton's iteration R <- (R + R^-T)/2,
+// which allocates nothing (unlike matd_svd). Leaves R as it is if it
+// is singular.
+static void polar_orthogonalize(double R[9]) {
+
+    const int MAX_ITER = 50;
+
+    for (int iter=0; iter<MAX_ITER; ++iter) {
+
+        // the cofactors of R, i.e. det(R) R^-T
+        double C[9] = {
+            R[4]*R[8] - R[5]*R[7], R[5]*R[6] - R[3]*R[8], R[3]*R[7] - R[4]*R[6],
+            R[2]*R[7] - R[1]*R[8], R[0]*R[8] - R[2]*R[6], R[1]*R[6] - R[0]*R[7],
+            R[1]*R[5] - R[2]*R[4], R[2]*R[3] - R[0]*R[5], R[0]*R[4] - R[1]*R[3]
+        };
 
-    matd_t* M = homography_to_pose(H, fx, fy, cx, cy);
+        double det = R[0]*C[0] + R[1]*C[1] + R[2]*C[2];
 
-    if (MATD_EL(M, 2, 3) * z_sign < 0) {
+        if (det == 0) { return; }
+
+        double change = 0;
+
+        for (int i=0; i<9; ++i) {
+            double r = 0.5 * (R[i] + C[i] / det);
+            change = fmax(change, fabs(r - R[i]));
+            R[i] = r;
+        }
+
+        if (change < 1e-15) { break; }
+
+    }
+
+}
+
+// The pose M (4x4, row major) of pose_from_homography before any
+// refinement: homography_to_pose for the homography H (3x3, row
+// major), made to put the tag on the z_sign side of the camera, and
+// scaled to tagsize.
+static void pose_from_homography_fixed(const double H[9],
+                                       double fx, double fy, double cx, double cy,
+                                       double tagsize,
+                                       double z_sign,
+                                       double M[16]) {
+
+    // (as in homography_to_pose.)
+    double R20 = H[6];
+    double R21 = H[7];
+    double TZ  = H[8];
+    double R00 = (H[0] - cx*R20) / fx;
+    double R01 = (H[1] - cx*R21) / fx;
+    double TX  = (H[2] - cx*TZ)  / fx;
+    double R10 = (H[3] - cy*R20) / fy;
+    double R11 = (H[4] - cy*R21) / fy;
+    double TY  = (H[5] - cy*TZ)  / fy;
+
+    double length1 = sqrtf(R00*R00 + R10*R10 + R20*R20);
+    double length2 = sqrtf(R01*R01 + R11*R11 + R21*R21);
+    double s = 1.0 / sqrtf(length1 * length2);
+
+    if (TZ > 0)
+        s *= -1;
+
+    R20 *= s;
+    R21 *= s;
+    TZ  *= s;
+    R00 *= s;
+    R01 *= s;
+    TX  *= s;
+    R10 *= s;
+    R11 *= s;
+    TY  *= s;
+
+    double R[9] = { R00, R01, R10*R21 - R20*R11,
+                    R10, R11, R20*R01 - R00*R21,
+                    R20, R21, R00*R11 - R10*R01 };
+
+    polar_orthogonalize(R);
+
+    const double T[3] = { TX, TY, TZ };
+
+    for (int i=0; i<3; ++i) {
+        for (int j=0; j<3; ++j) {
+            M[4*i+j] = R[3*i+j];
+        }
+        M[4*i+3] = T[i];
+        M[12+i] = 0;
+    }
+    M[15] = 1;
+
+    if (M[11] * z_sign < 0) {
 
         for (int i=0; i<3; ++i) {
-            MATD_EL(M, i, 0) *= -1;
-            MATD_EL(M, i, 1) *= -1;
-            MATD_EL(M, i, 3) *= -1;
+            M[4*i+0] *= -1;
+            M[4*i+1] *= -1;
+            M[4*i+3] *= -1;
         }
 
     }
 
     for (int i=0; i<3; ++i) {
-        MATD_EL(M, i, 3) *= 0.5*tagsize;
+        M[4*i+3] *= 0.5*tagsize;
     }
 
-    
-    if (!corners_meas) { return M; }
-        
-    double rvec[3], tvec[3];
-        
-    mat4_to_rvec_tvec(M, rvec, tvec);
+}
 
-    double best_e = DBL_MAX;
-    
-    matd_6_t g = { 6, 1, { 0 } };
+// Solves the 6x6 system A x = b by Gaussian elimination with partial
+// pivoting, destroying A and b.
+static void solve6(double A[6][6], double b[6], double x[6]) {
 
+    for (int k=0; k<6; ++k) {
+
+        int p = k;
+        for (int i=k+1; i<6; ++i) {
+            if (fabs(A[i][k]) > fabs(A[p][k])) { p = i; }
+        }
+
+        if (p != k) {
+            for (int j=0; j<6; ++j) {
+                double t = A[k][j]; A[k][j] = A[p][j]; A[p][j] = t;
+            }
+            double t = b[k]; b[k] = b[p]; b[p] = t;
+        }
+
+        for (int i=k+1; i<6; ++i) {
+            double f = A[i][k] / A[k][k];
+            for (int j=k; j<6; ++j) { A[i][j] -= f * A[k][j]; }
+            b[i] -= f * b[k];
+        }
+
+    }
+
+    for (int i=5; i>=0; --i) {
+        double acc = b[i];
+        for (int j=i+1; j<6; ++j) { acc -= A[i][j] * x[j]; }
+        x[i] = acc / A[i][i];
+    }
+
+}
+
+// The number of iterations pose_from_homography refines a pose for.
+#define POSE_MAX_ITER 100
+
+// The reprojection_error of the n tags whose corners_obj (in the frame
+// that rvec, tvec transform to the camera's) were detected at
+// corners_meas, summed over the tags, with its gradient (if g is not
+// NULL, and then J, the jacobians of the tags, must not be either)
+// and the J'*J of the tags, summed, into JTJ.
+static double corners_error(const double corners_obj[][4][3],
+                            const double corners_meas[][4][2],
+                            int n,
+                            double fx, double fy, double cx, double cy,
+                            const double rvec[3],
+                            const double tvec[3],
+                            double g[6],
+                            double JTJ[6][6]) {
+
+    double e = 0;
+
+    if (g) {
+        memset(g, 0, 6 * sizeof(double));
+        memset(JTJ, 0, 36 * sizeof(double));
+    }
+
+    for (int t=0; t<n; ++t) {
+
+        double J[8][6], gt[6];
+        double corners_reproj[4][2];
+
+        project_corners_fixed(fx, fy, cx, cy, corners_obj[t], rvec, tvec,
+                              corners_reproj, g ? J : NULL);
+
+        e += reprojection_error_fixed(corners_meas[t], corners_reproj,
+                                      g ? &J[0][0] : NULL, g ? gt : NULL);
+
+        if (!g) { continue; }
+
+        for (int i=0; i<6; ++i) {
+            g[i] += gt[i];
+            for (int j=0; j<6; ++j) {
+                double acc = 0;
+                for (int row=0; row<8; ++row) { acc += J[row][i] * J[row][j]; }
+                JTJ[i][j] += acc;
+            }
+        }
+
+    }
+
+    return e;
+
+}
+
+// Refines the pose rvec, tvec in place by Levenberg-Marquardt, so as to
+// minimize the corners_error of the n tags, for up to max_iter
+// iterations, or until the objective is below min_error. Everything is
+// of fixed size and lives on the stack.
+static void pose_refine_fixed(const double corners_obj[][4][3],
+                              const double corners_meas[][4][2],
+                              int n,
+                              double fx, double fy, double cx, double cy,
+                              int max_iter,
+                              double min_error,
+                              double rvec[3],
+                              double tvec[3],
+                              double* initial_error,
+                              double* final_error) {
+
+    double best_e = DBL_MAX;
 
     double best_rvec[3], best_tvec[3];
 
     const double LMAX = 1e5;
     const double LMIN = 1e-7;
     const double STEP_TOL = 1e-12;
-    const int MAX_ITER = 100;
-        
+
     double lambda = LMAX;
     int done = 0;
 
-    memcpy(best_rvec, rvec, sizeof(rvec));
-    memcpy(best_tvec, tvec, sizeof(tvec));
-        
-    for (int iter=0; iter<MAX_ITER; ++iter) {
+    memcpy(best_rvec, rvec, sizeof(best_rvec));
+    memcpy(best_tvec, tvec, sizeof(best_tvec));
 
-        matd_t* J;
+    for (int iter=0; iter<max_iter; ++iter) {
 
-        double e = reprojection_objective(corners_meas,
-                                          fx, fy, cx, cy, tagsize,
-                                          rvec, tvec, g.data,
-                                          done ? NULL : &J);
+        double g[6], JTJ[6][6];
 
-        //printf("objective at iter %3d is %12f\n", iter, e);
+        double e = corners_error(corners_obj, corners_meas, n, fx, fy, cx, cy,
+                                 rvec, tvec, done ? NULL : g, JTJ);
 
         if (e < best_e) {
             best_e = e;
-            memcpy(best_rvec, rvec, sizeof(rvec));
-            memcpy(best_tvec, tvec, sizeof(tvec));
+            memcpy(best_rvec, rvec, sizeof(best_rvec));
+            memcpy(best_tvec, tvec, sizeof(best_tvec));
             lambda *= 0.5;
             if (lambda < LMIN) { lambda = LMIN; }
-            //printf("better than previous best of %g, decreased to lambda=%g\n", best_e, lambda);
         } else {
-            memcpy(rvec, best_rvec, sizeof(rvec));
-            memcpy(tvec, best_tvec, sizeof(tvec));
+            memcpy(rvec, best_rvec, sizeof(best_rvec));
+            memcpy(tvec, best_tvec, sizeof(best_tvec));
             lambda *= 10.0;
             if (lambda > LMAX) { lambda = LMAX; }
-            //printf("worse than previous best of %g, increased to lambda=%g\n", best_e, lambda);
         }
 
         if (iter == 0 && initial_error) {
             *initial_error = best_e;
         }
-        
-        if (done) {
+
+        if (done || best_e < min_error) {
             break;
         }
 
-        matd_t* JTJ = matd_op("M'*M", J, J);
+        // step = (J'*J + lambda*I) \ g
+        double step[6];
 
         for (int i=0; i<6; ++i) {
-            MATD_EL(JTJ, i, i) += lambda;
+            JTJ[i][i] += lambda;
         }
 
-        matd_t* step = matd_solve(JTJ, (matd_t*)&g);
+        solve6(JTJ, g, step);
 
         double stotal = 0;
         for (int i=0; i<6; ++i) {
-            stotal += step->data[i] * step->data[i];
+            stotal += step[i] * step[i];
         }
 
         for (int i=0; i<3; ++i) {
-            rvec[i] -= step->data[i+0];
-            tvec[i] -= step->data[i+3];
+            rvec[i] -= step[i+0];
+            tvec[i] -= step[i+3];
         }
 
-        matd_destroy(J);
-        matd_destroy(JTJ);
-        matd_destroy(step);
-
         if (stotal < STEP_TOL) {
             done = 1;
         }
-            
+
     }
 
     if (final_error) { *final_error = best_e; }
 
-    matd_destroy(M);
-           
-    return mat4_from_rvec_tvec(rvec, tvec);
+}
+
+// The reprojection_objective of the pose rvec, tvec, without its
+// gradient.
+static double pose_error(const double corners_meas[][2],
+                         double fx, double fy, double cx, double cy,
+                         double tagsize,
+                         const double rvec[3],
+                         const double tvec[3]) {
+
+    double corners_reproj[4][2];
+
+    project_points_fixed(fx, fy, cx, cy, tagsize, rvec, tvec,
+                         corners_reproj, NULL);
+
+    return reprojection_error_fixed(corners_meas, corners_reproj, NULL, NULL);
+
+}
+
+// The pose rvec, tvec as the 4x4 row major M (as in
+// mat4_from_rvec_tvec), allocating nothing.
+static void pose_matrix_fixed(const double rvec[3],
+                              const double tvec[3],
+                              double M[16]) {
+
+    double k[3], theta;
+    polar_decomp(rvec, k, &theta);
+
+    double s = sin(theta);
+    double c = cos(theta);
+
+    const double K[3][3] = {
+        {  0,    -k[2],  k[1] },
+        {  k[2],  0,    -k[0] },
+        { -k[1],  k[0],  0    }
+    };
+
+    for (int i=0; i<3; ++i) {
+        for (int j=0; j<3; ++j) {
+            double K2 = 0;
+            for (int l=0; l<3; ++l) { K2 += K[i][l] * K[l][j]; }
+            M[4*i+j] = s*K[i][j] + (1-c)*K2 + (i == j);
+        }
+        M[4*i+3] = tvec[i];
+        M[12+i] = 0;
+    }
+    M[15] = 1;
+
+}
+
+// pose_from_homography into the 4x4 row major M, allocating nothing.
+//
+// If seed (an rvec and tvec, as rt gives them) is not NULL and fits
+// corners_meas better than the pose of the homography, the refinement
+// starts from it instead, for up to seed_max_iter iterations. The
+// refinement stops early once the error is below min_error. If rt is
+// not NULL the refined rvec and tvec are stored there (it may be the
+// same as seed).
+static void pose_compute(const double H[9],
+                         double fx, double fy, double cx, double cy,
+                         double tagsize,
+                         double z_sign,
+                         const double corners_meas[][2],
+                         const double seed[6],
+                         int seed_max_iter,
+                         double min_error,
+                         double M[16],
+                         double rt[6],
+                         double* initial_error,
+                         double* final_error) {
+
+    pose_from_homography_fixed(H, fx, fy, cx, cy, tagsize, z_sign, M);
+
+    if (!corners_meas) { return; }
+
+    double rvec[3], tvec[3];
+
+    matd_9_t R = { 3, 3, { M[0], M[1], M[2], M[4], M[5], M[6], M[8], M[9], M[10] } };
+
+    rvec_from_matrix((const matd_t*)&R, rvec);
+    for (int i=0; i<3; ++i) {
+        tvec[i] = M[4*i+3];
+    }
+
+    int max_iter = POSE_MAX_ITER;
+
+    if (seed &&
+        pose_error(corners_meas, fx, fy, cx, cy, tagsize, seed, seed+3) <
+        pose_error(corners_meas, fx, fy, cx, cy, tagsize, rvec, tvec)) {
+
+        memcpy(rvec, seed, sizeof(rvec));
+        memcpy(tvec, seed+3, sizeof(tvec));
+        max_iter = seed_max_iter;
+
+    }
+
+    double corners_raw[4][3];
+    tag_corners(tagsize, corners_raw);
+
+    pose_refine_fixed((const double (*)[4][3])corners_raw,
+                      (const double (*)[4][2])corners_meas, 1,
+                      fx, fy, cx, cy, max_iter, min_error,
+                      rvec, tvec, initial_error, final_error);
+
+    if (rt) {
+        memcpy(rt, rvec, sizeof(rvec));
+        memcpy(rt+3, tvec, sizeof(tvec));
+    }
+
+    pose_matrix_fixed(rvec, tvec, M);
+
+}
+
+matd_t* pose_from_homography(const matd_t* H,
+                             double fx, double fy, double cx, double cy,
+                             double tagsize,
+                             double z_sign,
+                             const double corners_meas[][2],
+                             double* initial_error,
+                             double* final_error) {
+
+    assert(H->nrows == 3 && H->ncols == 3);
+
+    double M[16];
+
+    pose_compute(H->data, fx, fy, cx, cy, tagsize, z_sign, corners_meas,
+                 NULL, 0, 0, M, NULL, initial_error, final_error);
+
+    return matd_create_data(4, 4, M);
 
 }
 
@@ -565,3 +926,391 @@ matd_t* mat4_from_rvec_tvec(const double rvec[3],
     return M;
 
 }
+
+struct pose_task
+{
+    const apriltag_detection_record_t* dets;
+    int i0, i1;
+
+    double fx, fy, cx, cy;
+    double tagsize;
+    double z_sign;
+    int refine;
+
+    // the seeds and refined rvec, tvec of pose_compute, and whether
+    // each seed is set (NULL if none).
+    double (*rts)[6];
+    const int* seeded;
+    int seed_max_iter;
+    double min_error;
+
+    double (*poses)[16];
+    double* initial_errors;
+    double* final_errors;
+};
+
+static void pose_task(void* p) {
+
+    struct pose_task* task = (struct pose_task*)p;
+
+    for (int i=task->i0; i<task->i1; ++i) {
+
+        const apriltag_detection_record_t* det = &task->dets[i];
+
+        pose_compute(det->H, task->fx, task->fy, task->cx, task->cy,
+                     task->tagsize, task->z_sign,
+                     task->refine ? det->p : NULL,
+                     task->seeded && task->seeded[i] ? task->rts[i] : NULL,
+                     task->seed_max_iter, task->min_error,
+                     task->poses[i],
+                     task->rts ? task->rts[i] : NULL,
+                     task->initial_errors ? &task->initial_errors[i] : NULL,
+                     task->final_errors ? &task->final_errors[i] : NULL);
+
+    }
+
+}
+
+// runs pose_task for the n detections of proto, on the threads of wp
+// unless it is NULL.
+static void pose_tasks_run(const struct pose_task* proto, int n, workerpool_t* wp) {
+
+    if (n <= 0) { return; }
+
+    int nthreads = wp ? workerpool_get_nthreads(wp) : 1;
+    int chunksize = 1 + n / (APRILTAG_TASKS_PER_THREAD_TARGET * nthreads);
+
+    struct pose_task tasks[n / chunksize + 1];
+
+    int ntasks = 0;
+    for (int i=0; i<n; i+=chunksize) {
+        struct pose_task* task = &tasks[ntasks++];
+        *task = *proto;
+        task->i0 = i;
+        task->i1 = i + chunksize < n ? i + chunksize : n;
+    }
+
+    if (nthreads <= 1) {
+        for (int i=0; i<ntasks; ++i) {
+            pose_task(&tasks[i]);
+        }
+        return;
+    }
+
+    for (int i=0; i<ntasks; ++i) {
+        workerpool_add_task(wp, pose_task, &tasks[i]);
+    }
+    workerpool_run(wp);
+
+}
+
+void pose_from_detection_records(const apriltag_detection_record_t* dets, int n,
+                                 double fx, double fy, double cx, double cy,
+                                 double tagsize,
+                                 double z_sign,
+                                 int refine,
+                                 workerpool_t* wp,
+                                 double poses[][16],
+                                 double* initial_errors,
+                                 double* final_errors) {
+
+    struct pose_task proto = {
+        .dets = dets,
+        .fx = fx, .fy = fy, .cx = cx, .cy = cy,
+        .tagsize = tagsize,
+        .z_sign = z_sign,
+        .refine = refine,
+        .poses = poses,
+        .initial_errors = initial_errors,
+        .final_errors = final_errors
+    };
+
+    pose_tasks_run(&proto, n, wp);
+
+}
+
+struct pose_tracker_key
+{
+    const apriltag_family_t* family;
+    int id;
+};
+
+static uint32_t pose_tracker_key_hash(const void* a) {
+
+    const struct pose_tracker_key* key = a;
+
+    return zhash_ptr_hash(&key->family) ^ (uint32_t)key->id * 2654435761u;
+
+}
+
+static int pose_tracker_key_equals(const void* a, const void* b) {
+
+    const struct pose_tracker_key* ka = a;
+    const struct pose_tracker_key* kb = b;
+
+    return ka->family == kb->family && ka->id == kb->id;
+
+}
+
+pose_tracker_t* pose_tracker_create(void) {
+
+    pose_tracker_t* pt = calloc(1, sizeof(pose_tracker_t));
+
+    pt->max_iters = 10;
+    pt->noise_px = 0.05;
+
+    pt->poses = zhash_create(sizeof(struct pose_tracker_key), 6*sizeof(double),
+                             pose_tracker_key_hash, pose_tracker_key_equals);
+
+    return pt;
+
+}
+
+void pose_tracker_destroy(pose_tracker_t* pt) {
+
+    if (!pt) { return; }
+
+    zhash_destroy(pt->poses);
+    free(pt);
+
+}
+
+void pose_tracker_clear(pose_tracker_t* pt) {
+
+    zhash_clear(pt->poses);
+
+}
+
+// the objective (see reprojection_error) at which pt stops refining.
+static double pose_tracker_min_error(const pose_tracker_t* pt) {
+
+    double e = 0.5 * pt->noise_px;
+
+    return 8 * e * e;
+
+}
+
+matd_t* pose_tracker_update(pose_tracker_t* pt,
+                            const apriltag_family_t* family, int id,
+                            const matd_t* H,
+                            double fx, double fy, double cx, double cy,
+                            double tagsize,
+                            double z_sign,
+                            const double corners_meas[][2],
+                            double* initial_error,
+                            double* final_error) {
+
+    assert(H->nrows == 3 && H->ncols == 3);
+
+    struct pose_tracker_key key = { family, id };
+    double rt[6], M[16];
+
+    int seeded = zhash_get(pt->poses, &key, rt);
+
+    pose_compute(H->data, fx, fy, cx, cy, tagsize, z_sign, corners_meas,
+                 seeded ? rt : NULL, pt->max_iters, pose_tracker_min_error(pt),
+                 M, rt, initial_error, final_error);
+
+    zhash_put(pt->poses, &key, rt, NULL, NULL);
+
+    return matd_create_data(4, 4, M);
+
+}
+
+void pose_tracker_update_records(pose_tracker_t* pt,
+                                 const apriltag_detection_record_t* dets, int n,
+                                 double fx, double fy, double cx, double cy,
+                                 double tagsize,
+                                 double z_sign,
+                                 workerpool_t* wp,
+                                 double poses[][16],
+                                 double* initial_errors,
+                                 double* final_errors) {
+
+    if (n <= 0) { return; }
+
+    double rts[n][6];
+    int seeded[n];
+
+    for (int i=0; i<n; ++i) {
+        struct pose_tracker_key key = { dets[i].family, dets[i].id };
+        seeded[i] = zhash_get(pt->poses, &key, rts[i]);
+    }
+
+    struct pose_task proto = {
+        .dets = dets,
+        .fx = fx, .fy = fy, .cx = cx, .cy = cy,
+        .tagsize = tagsize,
+        .z_sign = z_sign,
+        .refine = 1,
+        .rts = rts,
+        .seeded = seeded,
+        .seed_max_iter = pt->max_iters,
+        .min_error = pose_tracker_min_error(pt),
+        .poses = poses,
+        .initial_errors = initial_errors,
+        .final_errors = final_errors
+    };
+
+    pose_tasks_run(&proto, n, wp);
+
+    for (int i=0; i<n; ++i) {
+        struct pose_tracker_key key = { dets[i].family, dets[i].id };
+        zhash_put(pt->poses, &key, rts[i], NULL, NULL);
+    }
+
+}
+
+void pose_bundle_tag_corners(double tagsize, const double M[16], double corners[4][3]) {
+
+    double corners_raw[4][3];
+    tag_corners(tagsize, corners_raw);
+
+    for (int i=0; i<4; ++i) {
+        for (int r=0; r<3; ++r) {
+            corners[i][r] = (M[4*r+0] * corners_raw[i][0] +
+                             M[4*r+1] * corners_raw[i][1] +
+                             M[4*r+2] * corners_raw[i][2] + M[4*r+3]);
+        }
+    }
+
+}
+
+// The frame of a tag of a layout, from its corners: its axes (as the
+// columns of R) and center o in the layout's frame, and (returned) its
+// size, the mean length of its sides.
+static double bundle_tag_frame(const double corners[4][3], double R[9], double o[3]) {
+
+    double x[3], y[3], z[3];
+
+    double size = 0;
+    for (int i=0; i<4; ++i) {
+        const double* c0 = corners[i];
+        const double* c1 = corners[(i+1)&3];
+        size += sqrt((c1[0]-c0[0])*(c1[0]-c0[0]) + (c1[1]-c0[1])*(c1[1]-c0[1]) +
+                     (c1[2]-c0[2])*(c1[2]-c0[2]));
+    }
+
+    for (int r=0; r<3; ++r) {
+        x[r] = corners[1][r] - corners[0][r] + corners[2][r] - corners[3][r];
+        y[r] = corners[3][r] - corners[0][r] + corners[2][r] - corners[1][r];
+        o[r] = 0.25 * (corners[0][r] + corners[1][r] + corners[2][r] + corners[3][r]);
+    }
+
+    // (Gram-Schmidt, in case the corners are not quite square.)
+    double xx = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+    for (int r=0; r<3; ++r) { x[r] /= xx; }
+
+    double xy = x[0]*y[0] + x[1]*y[1] + x[2]*y[2];
+    accum_vec(y, -xy, x);
+
+    double yy = sqrt(y[0]*y[0] + y[1]*y[1] + y[2]*y[2]);
+    for (int r=0; r<3; ++r) { y[r] /= yy; }
+
+    cross_prod(x, y, z);
+
+    for (int r=0; r<3; ++r) {
+        R[3*r+0] = x[r];
+        R[3*r+1] = y[r];
+        R[3*r+2] = z[r];
+    }
+
+    return 0.25 * size;
+
+}
+
+int pose_from_bundle(const pose_bundle_tag_t* layout, int nlayout,
+                     const apriltag_detection_record_t* dets, int n,
+                     double fx, double fy, double cx, double cy,
+                     double z_sign,
+                     double M[16],
+                     double* initial_error,
+                     double* final_error) {
+
+    if (n <= 0) { return 0; }
+
+    // (on the heap: a frame may hold any number of detections.)
+    double (*corners_obj)[4][3] = malloc(n * sizeof(*corners_obj));
+    double (*corners_meas)[4][2] = malloc(n * sizeof(*corners_meas));
+    int* used = malloc(n * sizeof(*used));
+
+    int m = 0;
+    for (int i=0; i<n; ++i) {
+        for (int j=0; j<nlayout; ++j) {
+            if (layout[j].id == dets[i].id &&
+                (!layout[j].family || layout[j].family == dets[i].family)) {
+                memcpy(corners_obj[m], layout[j].corners, sizeof(corners_obj[m]));
+                memcpy(corners_meas[m], dets[i].p, sizeof(corners_meas[m]));
+                used[m++] = i;
+                break;
+            }
+        }
+    }
+
+    if (m == 0) {
+        free(corners_obj);
+        free(corners_meas);
+        free(used);
+        return 0;
+    }
+
+    // start from the pose of the layout that the homography of one of
+    // its tags gives, of the tag whose pose fits all of the corners
+    // best.
+    double rvec[3], tvec[3];
+    double best_e = DBL_MAX;
+
+    for (int k=0; k<m; ++k) {
+
+        double RB[9], oB[3];
+        double size = bundle_tag_frame((const double (*)[3])corners_obj[k], RB, oB);
+
+        double Mt[16];
+        pose_from_homography_fixed(dets[used[k]].H, fx, fy, cx, cy, size, z_sign, Mt);
+
+        // the layout's pose, Mt*B^-1: R = Rt*RB', t = tt - R*oB.
+        matd_9_t R = { 3, 3, { 0 } };
+        double t[3];
+
+        for (int i=0; i<3; ++i) {
+            for (int j=0; j<3; ++j) {
+                double acc = 0;
+                for (int l=0; l<3; ++l) { acc += Mt[4*i+l] * RB[3*j+l]; }
+                R.data[3*i+j] = acc;
+            }
+        }
+
+        for (int i=0; i<3; ++i) {
+            t[i] = Mt[4*i+3];
+            for (int l=0; l<3; ++l) { t[i] -= R.data[3*i+l] * oB[l]; }
+        }
+
+        double r[3];
+        rvec_from_matrix((const matd_t*)&R, r);
+
+        double e = corners_error((const double (*)[4][3])corners_obj,
+                                 (const double (*)[4][2])corners_meas, m,
+                                 fx, fy, cx, cy, r, t, NULL, NULL);
+
+        if (e < best_e) {
+            best_e = e;
+            memcpy(rvec, r, sizeof(rvec));
+            memcpy(tvec, t, sizeof(tvec));
+        }
+
+    }
+
+    pose_refine_fixed((const double (*)[4][3])corners_obj,
+                      (const double (*)[4][2])corners_meas, m,
+                      fx, fy, cx, cy, POSE_MAX_ITER, 0,
+                      rvec, tvec, initial_error, final_error);
+
+    pose_matrix_fixed(rvec, tvec, M);
+
+    free(corners_obj);
+    free(corners_meas);
+    free(used);
+
+    return m;
+
+}
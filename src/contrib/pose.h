@@ -2,6 +2,8 @@
 #define _ROTATION_H_
 
 #include "matd.h"
+#include "apriltag.h"
+#include "zhash.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +44,110 @@ matd_t* pose_from_homography(const matd_t* H,
                              double* initial_error,
                              double* final_error);
 
+// The poses of the n detections dets (e.g. from
+// apriltag_detector_detect_into) as pose_from_homography gives them
+// for their homographies, refined to their corners if refine is set,
+// into poses (the 4x4 matrices, row major), and, if refine is set and
+// they are not NULL, their errors before and after into initial_errors
+// and final_errors. The poses are computed on the threads of wp, unless
+// it is NULL, and without allocating anything.
+void pose_from_detection_records(const apriltag_detection_record_t* dets, int n,
+                                 double fx, double fy, double cx, double cy,
+                                 double tagsize,
+                                 double z_sign,
+                                 int refine,
+                                 workerpool_t* wp,
+                                 double poses[][16],
+                                 double* initial_errors,
+                                 double* final_errors);
+
+// Tracks the poses of tags from frame to frame: the refinement of each
+// tag's pose starts from the pose it had the last time it was seen
+// (if that fits its corners better than the pose of its homography
+// does), which usually takes far fewer iterations than starting over.
+// Tags are told apart by their family and id.
+typedef struct pose_tracker pose_tracker_t;
+struct pose_tracker
+{
+    // the most iterations the refinement from a previous pose takes
+    // (10 by default.)
+    int max_iters;
+
+    // the refinement stops once the corners are reprojected to within
+    // this many pixels (per coordinate, as a root mean square) of
+    // where they were detected: the noise level of the corners. (0.05
+    // by default.)
+    double noise_px;
+
+    // the last rvec and tvec of each tag, by family and id.
+    zhash_t* poses;
+};
+
+pose_tracker_t* pose_tracker_create(void);
+void pose_tracker_destroy(pose_tracker_t* pt);
+
+// forget all of the poses, e.g. when the camera has moved.
+void pose_tracker_clear(pose_tracker_t* pt);
+
+// pose_from_homography for the detection of the tag id of family, with
+// H and corners_meas, starting from its pose in the previous call.
+matd_t* pose_tracker_update(pose_tracker_t* pt,
+                            const apriltag_family_t* family, int id,
+                            const matd_t* H,
+                            double fx, double fy, double cx, double cy,
+                            double tagsize,
+                            double z_sign,
+                            const double corners_meas[][2],
+                            double* initial_error,
+                            double* final_error);
+
+// pose_from_detection_records (refined) for the n detections dets,
+// starting from their poses in the previous call.
+void pose_tracker_update_records(pose_tracker_t* pt,
+                                 const apriltag_detection_record_t* dets, int n,
+                                 double fx, double fy, double cx, double cy,
+                                 double tagsize,
+                                 double z_sign,
+                                 workerpool_t* wp,
+                                 double poses[][16],
+                                 double* initial_errors,
+                                 double* final_errors);
+
+
+// A tag of a rigid layout of tags (e.g. a board): its family (or NULL,
+// for a tag of any family) and id, and the positions of its four
+// corners in the layout's frame, in the order of the corners of its
+// detections (see pose_bundle_tag_corners).
+typedef struct pose_bundle_tag pose_bundle_tag_t;
+struct pose_bundle_tag
+{
+    const apriltag_family_t* family;
+    int id;
+    double corners[4][3];
+};
+
+// The corners of a square tag of tagsize, whose pose in the layout's
+// frame (a 4x4 row major matrix, from the tag's frame, as
+// pose_from_homography gives it from the tag's frame to the camera's)
+// is M.
+void pose_bundle_tag_corners(double tagsize, const double M[16], double corners[4][3]);
+
+// The pose of a layout of nlayout tags (the 4x4 row major matrix from
+// the layout's frame to the camera's) into M, from those of the n
+// detections dets that are of tags of the layout: one
+// Levenberg-Marquardt refinement over all of their corners, starting
+// from the pose of the layout that one of their homographies gives,
+// and the errors before and after (the reprojection_error of every
+// tag, summed) into initial_error and final_error, if not NULL.
+// Returns the number of detections used, or zero (leaving M as it is)
+// if none is of a tag of the layout.
+int pose_from_bundle(const pose_bundle_tag_t* layout, int nlayout,
+                     const apriltag_detection_record_t* dets, int n,
+                     double fx, double fy, double cx, double cy,
+                     double z_sign,
+                     double M[16],
+                     double* initial_error,
+                     double* final_error);
 
 void project_points(double fx, double fy, double cx, double cy,
                     double tagsize,
@@ -1,10 +1,12 @@
 #include "pose.h"
 #include "zarray.h"
 #include "homography.h"
+#include "workerpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -629,6 +631,289 @@ void test_pose_from_homograpy_refine_plausible() {
 }
 
 
+void test_pose_from_detection_records() {
+
+    enum { NDETS = 37 };
+
+    apriltag_detection_record_t dets[NDETS];
+
+    memset(dets, 0, sizeof(dets));
+
+    for (int i=0; i<NDETS; ++i) {
+
+        double r[3], t[3];
+        random_vec3(r, 0.5);
+        random_vec3(t, 0.2);
+        t[2] += 1.0;
+
+        project_points(fx, fy, cx, cy, tagsize, r, t, dets[i].p, 0);
+
+        // perturb the corners, so that there is something to refine
+        for (int j=0; j<4; ++j) {
+            dets[i].p[j][0] += 2*rand_double() - 1;
+            dets[i].p[j][1] += 2*rand_double() - 1;
+        }
+
+        matd_t* H = homography_from_corners(dets[i].p);
+        memcpy(dets[i].H, H->data, sizeof(dets[i].H));
+        matd_destroy(H);
+
+    }
+
+    workerpool_t* wp = workerpool_create(3);
+
+    for (int refine=0; refine<2; ++refine) {
+
+        double poses[NDETS][16], poses_mt[NDETS][16];
+        double e0[NDETS], e1[NDETS], e0_mt[NDETS], e1_mt[NDETS];
+
+        pose_from_detection_records(dets, NDETS, fx, fy, cx, cy, tagsize, 1.0,
+                                    refine, NULL, poses, e0, e1);
+
+        pose_from_detection_records(dets, NDETS, fx, fy, cx, cy, tagsize, 1.0,
+                                    refine, wp, poses_mt, e0_mt, e1_mt);
+
+        for (int i=0; i<NDETS; ++i) {
+
+            matd_t* H = matd_create_data(3, 3, dets[i].H);
+
+            double e_init, e_final;
+
+            matd_t* M = pose_from_homography(H, fx, fy, cx, cy, tagsize, 1.0,
+                                             refine ? dets[i].p : NULL,
+                                             &e_init, &e_final);
+
+            verify(M->data, poses[i], 4, 4);
+            verify(M->data, poses_mt[i], 4, 4);
+
+            if (refine) {
+                verify(&e_init, &e0[i], 1, 1);
+                verify(&e_final, &e1[i], 1, 1);
+                verify(&e_final, &e1_mt[i], 1, 1);
+            }
+
+            matd_destroy(M);
+            matd_destroy(H);
+
+        }
+
+    }
+
+    workerpool_destroy(wp);
+
+    printf("%s: PASS\n\n", __FUNCTION__);
+
+}
+
+
+void test_pose_tracker() {
+
+    pose_tracker_t* pt = pose_tracker_create();
+
+    // the error at which the tracker stops refining
+    double e_noise = 8 * (0.5*pt->noise_px) * (0.5*pt->noise_px);
+
+    double r[3] = { rvec[0], rvec[1], rvec[2] };
+    double t[3] = { tvec[0], tvec[1], tvec[2] };
+
+    for (int frame=0; frame<20; ++frame) {
+
+        // a tag drifting slowly across the view
+        r[1] += 0.01;
+        t[0] += 0.002;
+
+        apriltag_detection_record_t det;
+        memset(&det, 0, sizeof(det));
+        det.id = 7;
+
+        project_points(fx, fy, cx, cy, tagsize, r, t, det.p, 0);
+
+        for (int j=0; j<4; ++j) {
+            det.p[j][0] += 0.05 * (2*rand_double() - 1);
+            det.p[j][1] += 0.05 * (2*rand_double() - 1);
+        }
+
+        matd_t* H = homography_from_corners(det.p);
+        memcpy(det.H, H->data, sizeof(det.H));
+
+        double e_cold, e_tracked, pose[16];
+
+        matd_t* M = pose_from_homography(H, fx, fy, cx, cy, tagsize, 1.0,
+                                         det.p, NULL, &e_cold);
+
+        pose_tracker_update_records(pt, &det, 1, fx, fy, cx, cy, tagsize, 1.0,
+                                    NULL, &pose, NULL, &e_tracked);
+
+        double rvec2[3], tvec2[3];
+        matd_t* M2 = matd_create_data(4, 4, pose);
+        mat4_to_rvec_tvec(M2, rvec2, tvec2);
+
+        double e_tracked2 = reprojection_objective(det.p, fx, fy, cx, cy, tagsize,
+                                                   rvec2, tvec2, NULL, NULL);
+
+        verify(&e_tracked, &e_tracked2, 1, 1);
+
+        if (e_tracked > e_noise && e_tracked > e_cold * (1 + EPS)) {
+            fprintf(stderr, "%s:%d error: tracked error %g worse than %g in %s\n",
+                    __FILE__, __LINE__, e_tracked, e_cold, __FUNCTION__);
+            exit(1);
+        }
+
+        matd_destroy(M2);
+        matd_destroy(M);
+        matd_destroy(H);
+
+    }
+
+    if (zhash_size(pt->poses) != 1) {
+        fprintf(stderr, "%s:%d error: expect one tracked tag in %s\n",
+                __FILE__, __LINE__, __FUNCTION__);
+        exit(1);
+    }
+
+    pose_tracker_destroy(pt);
+
+    printf("%s: PASS\n\n", __FUNCTION__);
+
+}
+
+
+void test_pose_from_bundle() {
+
+    // a board of 2x3 tags, 0.2 apart, in the board's z = 0 plane
+    enum { NTAGS = 6 };
+
+    pose_bundle_tag_t layout[NTAGS];
+
+    for (int i=0; i<NTAGS; ++i) {
+        const double B[16] = { 1, 0, 0, 0.2*(i%3) - 0.2,
+                               0, 1, 0, 0.2*(i/3) - 0.1,
+                               0, 0, 1, 0,
+                               0, 0, 0, 1 };
+        layout[i].family = NULL;
+        layout[i].id = 10 + i;
+        pose_bundle_tag_corners(tagsize, B, layout[i].corners);
+    }
+
+    const double r[3] = { 0.3, -0.2, 0.1 };
+    const double t[3] = { 0.05, 0.02, 1.5 };
+
+    matd_t* R = rvec_to_matrix(r);
+
+    apriltag_detection_record_t dets[NTAGS + 1];
+    memset(dets, 0, sizeof(dets));
+
+    for (int i=0; i<NTAGS; ++i) {
+
+        dets[i].id = layout[i].id;
+
+        for (int j=0; j<4; ++j) {
+            const double* v = layout[i].corners[j];
+            double g[3];
+            for (int k=0; k<3; ++k) {
+                g[k] = t[k];
+                for (int l=0; l<3; ++l) { g[k] += MATD_EL(R, k, l) * v[l]; }
+            }
+            dets[i].p[j][0] = fx * g[0] / g[2] + cx + 0.5 * (2*rand_double() - 1);
+            dets[i].p[j][1] = fy * g[1] / g[2] + cy + 0.5 * (2*rand_double() - 1);
+        }
+
+        matd_t* H = homography_from_corners(dets[i].p);
+        memcpy(dets[i].H, H->data, sizeof(dets[i].H));
+        matd_destroy(H);
+
+    }
+
+    // a tag that isn't on the board
+    dets[NTAGS] = dets[0];
+    dets[NTAGS].id = 99;
+
+    double M[16], e_init, e_final;
+
+    int used = pose_from_bundle(layout, NTAGS, dets, NTAGS + 1, fx, fy, cx, cy, 1.0,
+                                M, &e_init, &e_final);
+
+    if (used != NTAGS || e_final > e_init) {
+        fprintf(stderr, "%s:%d error: used %d tags, error %g -> %g in %s\n",
+                __FILE__, __LINE__, used, e_init, e_final, __FUNCTION__);
+        exit(1);
+    }
+
+    // the final error is that of the pose
+    double rvec2[3], tvec2[3];
+    matd_t* M2 = matd_create_data(4, 4, M);
+    mat4_to_rvec_tvec(M2, rvec2, tvec2);
+
+    double e_final2 = 0;
+    for (int i=0; i<NTAGS; ++i) {
+        double corners_reproj[4][2];
+        for (int j=0; j<4; ++j) {
+            const double* v = layout[i].corners[j];
+            double g[3];
+            for (int k=0; k<3; ++k) {
+                g[k] = M[4*k+3];
+                for (int l=0; l<3; ++l) { g[k] += M[4*k+l] * v[l]; }
+            }
+            corners_reproj[j][0] = fx * g[0] / g[2] + cx;
+            corners_reproj[j][1] = fy * g[1] / g[2] + cy;
+        }
+        e_final2 += reprojection_error(dets[i].p, corners_reproj, NULL, NULL);
+    }
+
+    verify(&e_final, &e_final2, 1, 1);
+
+    // the board's pose is closer to the truth than that of a tag of it
+    // alone (whose own offset on the board is known).
+    double tag_err = 0, bundle_err = 0;
+    for (int k=0; k<3; ++k) { bundle_err += (tvec2[k] - t[k]) * (tvec2[k] - t[k]); }
+
+    for (int i=0; i<NTAGS; ++i) {
+        matd_t* H = matd_create_data(3, 3, dets[i].H);
+        matd_t* Mt = pose_from_homography(H, fx, fy, cx, cy, tagsize, 1.0, dets[i].p, NULL, NULL);
+
+        double o[3] = { layout[i].corners[0][0] + 0.5*tagsize, layout[i].corners[0][1] + 0.5*tagsize, 0 };
+        for (int k=0; k<3; ++k) {
+            double tk = MATD_EL(Mt, k, 3);
+            for (int l=0; l<3; ++l) { tk -= MATD_EL(Mt, k, l) * o[l]; }
+            tag_err += (tk - t[k]) * (tk - t[k]) / NTAGS;
+        }
+
+        matd_destroy(Mt);
+        matd_destroy(H);
+    }
+
+    printf("translation error: bundle %g, tags %g (mean)\n", sqrt(bundle_err), sqrt(tag_err));
+
+    if (bundle_err >= tag_err) {
+        fprintf(stderr, "%s:%d error: expect bundle error < tag error in %s\n",
+                __FILE__, __LINE__, __FUNCTION__);
+        exit(1);
+    }
+
+    // a layout of one tag, at the origin, is pose_from_homography.
+    pose_bundle_tag_t one = { NULL, dets[2].id, { { 0 } } };
+    const double I[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    pose_bundle_tag_corners(tagsize, I, one.corners);
+
+    double e_one;
+    pose_from_bundle(&one, 1, dets, NTAGS, fx, fy, cx, cy, 1.0, M, NULL, &e_one);
+
+    matd_t* H = matd_create_data(3, 3, dets[2].H);
+    double e_tag;
+    matd_t* Mt = pose_from_homography(H, fx, fy, cx, cy, tagsize, 1.0, dets[2].p, NULL, &e_tag);
+
+    verify(Mt->data, M, 4, 4);
+    verify(&e_tag, &e_one, 1, 1);
+
+    matd_destroy(Mt);
+    matd_destroy(H);
+    matd_destroy(M2);
+    matd_destroy(R);
+
+    printf("%s: PASS\n\n", __FUNCTION__);
+
+}
+
 int main(int argc, char** argv) {
 
     test_basics();
@@ -639,6 +924,9 @@ int main(int argc, char** argv) {
     test_pose_from_homograpy();
     test_pose_from_homograpy_refine_contrived();
     test_pose_from_homograpy_refine_plausible();
+    test_pose_from_detection_records();
+    test_pose_tracker();
+    test_pose_from_bundle();
     
     return 0;
 
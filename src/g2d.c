@@ -622,6 +622,55 @@ int g2d_polygon_overlaps_polygon(const zarray_t *polya, const zarray_t *polyb)
     return 0;
 }
 
+int g2d_quad_is_convex(const double q[4][2])
+{
+    int npos = 0, nneg = 0;
+
+    for (int i = 0; i < 4; i++) {
+        const double *p0 = q[i], *p1 = q[(i+1)&3], *p2 = q[(i+2)&3];
+
+        double cross = (p1[0] - p0[0])*(p2[1] - p1[1]) - (p1[1] - p0[1])*(p2[0] - p1[0]);
+
+        npos += cross > 0;
+        nneg += cross < 0;
+    }
+
+    return npos == 4 || nneg == 4;
+}
+
+// Is there an edge of a whose normal separates a from b?
+static int quad_separating_edge(const double a[4][2], const double b[4][2])
+{
+    for (int i = 0; i < 4; i++) {
+        double nx = a[(i+1)&3][1] - a[i][1];
+        double ny = a[i][0] - a[(i+1)&3][0];
+
+        double amin = HUGE_VAL, amax = -HUGE_VAL, bmin = HUGE_VAL, bmax = -HUGE_VAL;
+
+        for (int k = 0; k < 4; k++) {
+            double pa = nx*a[k][0] + ny*a[k][1];
+            double pb = nx*b[k][0] + ny*b[k][1];
+
+            amin = fmin(amin, pa);
+            amax = fmax(amax, pa);
+            bmin = fmin(bmin, pb);
+            bmax = fmax(bmax, pb);
+        }
+
+        if (amax < bmin || bmax < amin)
+            return 1;
+    }
+
+    return 0;
+}
+
+int g2d_convex_quad_overlaps_quad(const double a[4][2], const double b[4][2])
+{
+    // separating axis theorem: two convex polygons are disjoint if and
+    // only if the normal of one of their edges separates them.
+    return !quad_separating_edge(a, b) && !quad_separating_edge(b, a);
+}
+
 static int double_sort_up(const void *_a, const void *_b)
 {
     double a = *((double*) _a);
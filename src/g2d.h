@@ -117,6 +117,16 @@ int g2d_polygon_contains_polygon(const zarray_t *polya, const zarray_t *polyb);
 // Is there some point which is in both polya and polyb?
 int g2d_polygon_overlaps_polygon(const zarray_t *polya, const zarray_t *polyb);
 
+// Is the quadrilateral with corners q (in order, with either winding)
+// strictly convex?
+int g2d_quad_is_convex(const double q[4][2]);
+
+// Is there some point which is in both of the convex quadrilaterals
+// a and b (corners in order, with either winding)? The same answer as
+// g2d_polygon_overlaps_polygon, without building polygons. Not valid
+// for quads that are not convex.
+int g2d_convex_quad_overlaps_quad(const double a[4][2], const double b[4][2]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,277 @@
+#ifndef _APRILTAG_CXX_H_
+#define _APRILTAG_CXX_H_
+
+/* Owners of the detector's C objects, and views of its results, for
+   C++ callers: nothing here copies a detection or a pixel.
+
+   A detector, family or detections object owns its C object, which it
+   destroys; it can be moved, but not copied. Detecting into a
+   record_buffer writes records (see apriltag_detection_record_t) into
+   the buffer's own storage, allocated once, and gives a span of them:
+   with those, a steady stream of frames allocates nothing, on either
+   side. Images are always borrowed: the raw buffer and cv::Mat
+   overloads detect the caller's pixels in place (which the detector
+   may blur, see quad_sigma).
+
+   Header only. Define APRILTAG_CXX_NO_OPENCV before including it to
+   leave out the cv::Mat overloads (and OpenCV). */
+
+#include "apriltag.h"
+#include "apriltag_family.h"
+#include "image_u8.h"
+#include "zarray.h"
+#include "matd.h"
+
+#include <stddef.h>
+#include <vector>
+
+#ifndef APRILTAG_CXX_NO_OPENCV
+#include "apriltag_opencv.h"
+#endif
+
+namespace apriltag {
+
+/* A view of n contiguous T, owned by someone else. */
+template <class T>
+class span {
+public:
+
+  span() : ptr(NULL), n(0) {}
+  span(T* ptr, size_t n) : ptr(ptr), n(n) {}
+
+  T* data() const { return ptr; }
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+
+  T& operator[](size_t i) const { return ptr[i]; }
+  T* begin() const { return ptr; }
+  T* end() const { return ptr + n; }
+
+private:
+
+  T* ptr;
+  size_t n;
+
+};
+
+/* A tag family (see apriltag_family_create), which must outlive every
+   detector it is added to. */
+class family {
+public:
+
+  /* Evaluates to false if name is not a family. */
+  explicit family(const char* name) : tf(apriltag_family_create(name)) {}
+  ~family() { if (tf) { apriltag_family_destroy(tf); } }
+
+  family(family&& other) : tf(other.tf) { other.tf = NULL; }
+  family& operator=(family&& other) {
+    if (this != &other) {
+      if (tf) { apriltag_family_destroy(tf); }
+      tf = other.tf;
+      other.tf = NULL;
+    }
+    return *this;
+  }
+
+  family(const family&) = delete;
+  family& operator=(const family&) = delete;
+
+  explicit operator bool() const { return tf != NULL; }
+  apriltag_family_t* get() const { return tf; }
+  apriltag_family_t* operator->() const { return tf; }
+
+private:
+
+  apriltag_family_t* tf;
+
+};
+
+/* The detections of apriltag_detector_detect and friends: iterates
+   over them (as const apriltag_detection_t&), in the array itself,
+   and frees them all at once. */
+class detections {
+public:
+
+  class iterator {
+  public:
+
+    explicit iterator(apriltag_detection_t* const* p) : p(p) {}
+
+    const apriltag_detection_t& operator*() const { return **p; }
+    const apriltag_detection_t* operator->() const { return *p; }
+    iterator& operator++() { ++p; return *this; }
+    bool operator==(const iterator& other) const { return p == other.p; }
+    bool operator!=(const iterator& other) const { return p != other.p; }
+
+  private:
+
+    apriltag_detection_t* const* p;
+
+  };
+
+  detections() : za(NULL) {}
+  explicit detections(zarray_t* za) : za(za) {}
+  ~detections() { if (za) { apriltag_detections_destroy(za); } }
+
+  detections(detections&& other) : za(other.za) { other.za = NULL; }
+  detections& operator=(detections&& other) {
+    if (this != &other) {
+      if (za) { apriltag_detections_destroy(za); }
+      za = other.za;
+      other.za = NULL;
+    }
+    return *this;
+  }
+
+  detections(const detections&) = delete;
+  detections& operator=(const detections&) = delete;
+
+  size_t size() const { return za ? za->size : 0; }
+  bool empty() const { return size() == 0; }
+
+  /* The pointers to the detections, as the array holds them. */
+  span<apriltag_detection_t* const> pointers() const {
+    return span<apriltag_detection_t* const>(
+      za ? (apriltag_detection_t* const*)za->data : NULL, size());
+  }
+
+  const apriltag_detection_t& operator[](size_t i) const { return *pointers()[i]; }
+  iterator begin() const { return iterator(pointers().begin()); }
+  iterator end() const { return iterator(pointers().end()); }
+
+  zarray_t* get() const { return za; }
+
+  /* Give up the array, which the caller then frees. */
+  zarray_t* release() { zarray_t* rval = za; za = NULL; return rval; }
+
+private:
+
+  zarray_t* za;
+
+};
+
+/* Storage for the records of up to capacity detections a frame (see
+   apriltag_detector_detect_into), reused from frame to frame. */
+class record_buffer {
+public:
+
+  explicit record_buffer(int capacity = 64) : records(capacity), ntotal(0) {}
+
+  int capacity() const { return (int)records.size(); }
+
+  /* The number of detections of the last frame, which is more than
+     capacity() if some of them didn't fit. */
+  int total() const { return ntotal; }
+
+  /* The records of the last frame. */
+  span<const apriltag_detection_record_t> view() const {
+    int n = ntotal < capacity() ? ntotal : capacity();
+    return span<const apriltag_detection_record_t>(records.data(), n);
+  }
+
+private:
+
+  friend class detector;
+
+  std::vector<apriltag_detection_record_t> records;
+  int ntotal;
+
+};
+
+/* A detector (see apriltag_detector_create), whose options are set
+   through ->. */
+class detector {
+public:
+
+  detector() : td(apriltag_detector_create()) {}
+  ~detector() { if (td) { apriltag_detector_destroy(td); } }
+
+  detector(detector&& other) : td(other.td) { other.td = NULL; }
+  detector& operator=(detector&& other) {
+    if (this != &other) {
+      if (td) { apriltag_detector_destroy(td); }
+      td = other.td;
+      other.td = NULL;
+    }
+    return *this;
+  }
+
+  detector(const detector&) = delete;
+  detector& operator=(const detector&) = delete;
+
+  apriltag_detector_t* get() const { return td; }
+  apriltag_detector_t* operator->() const { return td; }
+
+  void add_family(const family& fam) { apriltag_detector_add_family(td, fam.get()); }
+
+  const apriltag_stats_t& stats() const { return *apriltag_detector_stats(td); }
+
+  detections detect(image_u8_t* im) {
+    return detections(apriltag_detector_detect(td, im));
+  }
+
+  detections detect(const apriltag_image_t& img) {
+    return detections(apriltag_detector_detect_image(td, &img));
+  }
+
+  /* The 8 bit gray image of width x height pixels whose rows are
+     stride bytes apart, starting at buf. */
+  detections detect(uint8_t* buf, int width, int height, int stride) {
+    image_u8_t im = { width, height, stride, buf };
+    return detections(apriltag_detector_detect(td, &im));
+  }
+
+  span<const apriltag_detection_record_t> detect(image_u8_t* im, record_buffer& out) {
+    out.ntotal = apriltag_detector_detect_into(td, im, out.records.data(), out.capacity());
+    return out.view();
+  }
+
+  span<const apriltag_detection_record_t> detect(uint8_t* buf, int width, int height, int stride,
+                                                 record_buffer& out) {
+    out.ntotal = apriltag_detector_detect_buffer(td, buf, width, height, stride,
+                                                 out.records.data(), out.capacity());
+    return out.view();
+  }
+
+#ifndef APRILTAG_CXX_NO_OPENCV
+
+  /* m may be 8UC1, 8UC3 or 8UC4 (see cv2image), and a ROI. */
+  detections detect(const cv::Mat& m) {
+    if (m.type() == CV_8UC1) {
+      image_u8_t im = cv2im8(m);
+      return detect(&im);
+    }
+    apriltag_image_t img = cv2image(m);
+    return detect(img);
+  }
+
+  /* m must be 8UC1. */
+  span<const apriltag_detection_record_t> detect(const cv::Mat& m, record_buffer& out) {
+    image_u8_t im = cv2im8(m);
+    return detect(&im, out);
+  }
+
+#endif
+
+private:
+
+  apriltag_detector_t* td;
+
+};
+
+#ifndef APRILTAG_CXX_NO_OPENCV
+
+/* The homography of a detection, as a view of its matrix. */
+inline cv::Mat_<double> homography(const apriltag_detection_t& det) {
+  return cv::Mat_<double>(3, 3, det.H->data);
+}
+
+inline cv::Mat_<double> homography(const apriltag_detection_record_t& rec) {
+  return cv::Mat_<double>(3, 3, const_cast<double*>(rec.H));
+}
+
+#endif
+
+}
+
+#endif
@@ -78,18 +78,10 @@ int main(int argc, char** argv) {
 
   cv::namedWindow(window);
 
-  Mat8uc1 gray;
+  cv::Mat input = detection_input(frame);
+  apriltag_image_t img = cv2image(input);
 
-  if (frame.channels() == 3) {
-    cv::cvtColor(frame, gray, cv::COLOR_RGB2GRAY);
-  }
-  else {
-    frame.copyTo(gray);
-  }
-
-  image_u8_t* im8 = cv2im8_copy(gray);
-
-  zarray_t *detections = apriltag_detector_detect(td, im8);
+  zarray_t *detections = apriltag_detector_detect_image(td, &img);
 
   printf("Detected %d tags.\n", zarray_size(detections));
 
@@ -122,7 +114,6 @@ int main(int argc, char** argv) {
 
   display = 0.5*display + 0.5*frame;
   cv::imshow(window, display);
-  image_u8_destroy(im8);
 
   cv::waitKey(0);
 
@@ -33,8 +33,8 @@ inline Mat32sc1 im2cv(image_u32_t* im) {
 
 inline image_u8_t* cv2im8_copy(cv::Mat m) {
   
-  if (!m.isContinuous() || m.type() != CV_8UC1) {
-    fprintf(stderr, "not continuous 8UC1\n");
+  if (m.type() != CV_8UC1) {
+    fprintf(stderr, "not 8UC1\n");
     exit(1);
   }
 
@@ -50,8 +50,8 @@ inline image_u8_t* cv2im8_copy(cv::Mat m) {
 
 inline image_u32_t* cv2im32_copy(cv::Mat m) {
   
-  if (!m.isContinuous() || m.type() != CV_32SC1) {
-    fprintf(stderr, "not continuous 32SC1\n");
+  if (m.type() != CV_32SC1) {
+    fprintf(stderr, "not 32SC1\n");
     exit(1);
   }
 
@@ -65,27 +65,61 @@ inline image_u32_t* cv2im32_copy(cv::Mat m) {
 }
 
 
+/* A view of m, sharing its pixels: m may be any 8UC1 matrix,
+   including a row or column range (ROI) of a bigger one. */
 inline image_u8_t cv2im8(cv::Mat m) {
   
-  if (!m.isContinuous() || m.type() != CV_8UC1) {
-    fprintf(stderr, "not continuous 8UC1\n");
+  if (m.type() != CV_8UC1) {
+    fprintf(stderr, "not 8UC1\n");
     exit(1);
   }
   
-  image_u8_t tmp = { m.cols, m.rows, m.cols, (uint8_t*)m.data };
+  image_u8_t tmp = { m.cols, m.rows, (int)m.step[0], (uint8_t*)m.data };
 
   return tmp;
 
 }
 
+/* A frame of m, sharing its pixels, for
+   apriltag_detector_detect_image: m may be 8UC1 (gray), or 8UC3 or
+   8UC4 (BGR or BGRA, as OpenCV loads and captures them), whose gray
+   the detector writes into its own buffer. */
+inline apriltag_image_t cv2image(cv::Mat m) {
+
+  int format;
+  switch (m.type()) {
+    case CV_8UC1: format = APRILTAG_FORMAT_GRAY8; break;
+    case CV_8UC3: format = APRILTAG_FORMAT_BGR; break;
+    case CV_8UC4: format = APRILTAG_FORMAT_BGRA; break;
+    default:
+      fprintf(stderr, "not 8UC1, 8UC3 or 8UC4\n");
+      exit(1);
+  }
+
+  apriltag_image_t tmp = { format, m.cols, m.rows, (int)m.step[0], (uint8_t*)m.data };
+
+  return tmp;
+
+}
+
+/* The matrix to pass (through cv2image) to
+   apriltag_detector_detect_image for frame, alive until it returns: a
+   gray frame is copied, since detection may blur it in place; the
+   gray of a color one is written into the detector's own buffer, so
+   the frame itself will do. */
+inline cv::Mat detection_input(const cv::Mat& frame) {
+  return frame.channels() == 1 ? frame.clone() : frame;
+}
+
+/* The same as cv2image, for 32SC1 (whose stride is in pixels). */
 inline image_u32_t cv2im32(cv::Mat m) {
   
-  if (!m.isContinuous() || m.type() != CV_32SC1) {
-    fprintf(stderr, "not continuous 32SC1\n");
+  if (m.type() != CV_32SC1 || m.step[0] % sizeof(uint32_t)) {
+    fprintf(stderr, "not 32SC1\n");
     exit(1);
   }
 
-  image_u32_t tmp = { m.cols, m.rows, m.cols, (uint32_t*)m.data };
+  image_u32_t tmp = { m.cols, m.rows, (int)(m.step[0] / sizeof(uint32_t)), (uint32_t*)m.data };
 
   return tmp;
 
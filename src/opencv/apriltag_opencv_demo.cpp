@@ -100,22 +100,15 @@ int main(int argc, char *argv[])
 
         cv::Mat orig = cv::imread(path);
             
-        Mat8uc1 gray;
-
-        if (orig.channels() == 3) {
-          cv::cvtColor(orig, gray, cv::COLOR_RGB2GRAY);
-        } else {
-          orig.copyTo(gray);
-        }
-
-        image_u8_t* im8 = cv2im8_copy(gray);
-
-        if (gray.empty()) {
+        if (orig.empty()) {
           fprintf(stderr, "Error loading %s\n", path);
           continue;
         }
 
-        zarray_t *detections = apriltag_detector_detect(td, im8);
+        cv::Mat input = detection_input(orig);
+        apriltag_image_t img = cv2image(input);
+
+        zarray_t *detections = apriltag_detector_detect_image(td, &img);
       
         cv::Mat display;
 
@@ -176,7 +169,6 @@ int main(int argc, char *argv[])
           cv::waitKey();
         }
 
-        image_u8_destroy(im8);
         total_time += timeprofile_total_utime(td->tp);
 
       }
@@ -3,8 +3,177 @@
 #include "getopt.h"
 #include "homography.h"
 #include "pose.h"
+#include "time_util.h"
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+
+/* The capture, detection and display of the frames run in threads of
+   their own, connected by bounded queues. When a stage falls behind,
+   the oldest frame waiting for it is dropped, rather than letting the
+   frames back up: what is shown is always as recent as the detector
+   allows. */
+
+struct frame_item {
+  cv::Mat frame;
+  int seq;
+  int64_t utime_captured;
+  int64_t utime_detected;
+  zarray_t* detections;
+
+  frame_item() : seq(0), utime_captured(0), utime_detected(0), detections(NULL) {}
+  ~frame_item() { if (detections) { apriltag_detections_destroy(detections); } }
+};
+
+/* A queue of up to capacity frames. push drops the oldest frame if the
+   queue is full; pop waits for a frame. Once closed, push refuses
+   frames, and pop returns NULL when the queue is empty. */
+class frame_queue {
+public:
+
+  frame_queue(int capacity) : capacity(capacity), closed(false), ndropped(0) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~frame_queue() {
+    while (!items.empty()) {
+      delete items.front();
+      items.pop_front();
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Takes ownership of item (deleting it if closed). Returns false if
+  // closed.
+  bool push(frame_item* item) {
+    pthread_mutex_lock(&mutex);
+    if (closed) {
+      pthread_mutex_unlock(&mutex);
+      delete item;
+      return false;
+    }
+    if ((int)items.size() >= capacity) {
+      delete items.front();
+      items.pop_front();
+      ndropped++;
+    }
+    items.push_back(item);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    return true;
+  }
+
+  frame_item* pop() {
+    pthread_mutex_lock(&mutex);
+    while (items.empty() && !closed) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+    frame_item* item = NULL;
+    if (!items.empty()) {
+      item = items.front();
+      items.pop_front();
+    }
+    pthread_mutex_unlock(&mutex);
+    return item;
+  }
+
+  void close() {
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  int dropped() {
+    pthread_mutex_lock(&mutex);
+    int n = ndropped;
+    pthread_mutex_unlock(&mutex);
+    return n;
+  }
+
+private:
+
+  int capacity;
+  bool closed;
+  int ndropped;
+  std::deque<frame_item*> items;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+};
+
+struct video_state {
+  cv::VideoCapture* cap;
+  double pace_fps; // > 0 to read a movie file at its own rate
+  apriltag_detector_t* td;
+  frame_queue* captured;
+  frame_queue* detected;
+  int ncaptured;
+};
+
+void* capture_run(void* p) {
+
+  video_state* s = (video_state*)p;
+  int64_t utime_start = utime_now();
+
+  while (1) {
+
+    frame_item* item = new frame_item();
+    if (!s->cap->read(item->frame)) {
+      delete item;
+      break;
+    }
+
+    // a camera delivers frames at its own rate; a movie file is read
+    // at its frame rate, as if it were one.
+    if (s->pace_fps > 0) {
+      int64_t due = utime_start + (int64_t)(1e6 * s->ncaptured / s->pace_fps);
+      int64_t now = utime_now();
+      if (due > now) {
+        usleep(due - now);
+      }
+    }
+
+    item->seq = s->ncaptured++;
+    item->utime_captured = utime_now();
+
+    if (!s->captured->push(item)) {
+      break;
+    }
+
+  }
+
+  s->captured->close();
+  return NULL;
+
+}
+
+void* detect_run(void* p) {
+
+  video_state* s = (video_state*)p;
+
+  while (frame_item* item = s->captured->pop()) {
+
+    cv::Mat input = detection_input(item->frame);
+    apriltag_image_t img = cv2image(input);
+
+    item->detections = apriltag_detector_detect_image(s->td, &img);
+    item->utime_detected = utime_now();
+
+    if (!s->detected->push(item)) {
+      break;
+    }
+
+  }
+
+  s->detected->close();
+  return NULL;
+
+}
 
 int main(int argc, char** argv) {
 
@@ -21,6 +190,8 @@ int main(int argc, char** argv) {
   getopt_add_bool(getopt, '1', "refine-decode", 0, "Spend more time decoding tags");
   getopt_add_bool(getopt, '2', "refine-pose", 0, "Spend more time computing pose of tags");
   getopt_add_bool(getopt, 'c', "contours", 0, "Use new contour-based quad detection");
+  getopt_add_int(getopt, '\0', "queue", "1", "Frames waiting for each stage before the oldest is dropped");
+  getopt_add_bool(getopt, '\0', "unpaced", 0, "Read movie files as fast as possible, not at their frame rate");
 
   if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
     printf("Usage: %s [options] <camera index or path to movie file>\n", argv[0]);
@@ -88,38 +259,62 @@ int main(int argc, char** argv) {
 
   const char* window = "AprilTag";
 
-  cv::Mat frame;
+  const bool quiet = getopt_get_bool(getopt, "quiet");
+  const int depth = std::max(1, getopt_get_int(getopt, "queue"));
+
+  video_state s;
+  s.cap = cap;
+  s.pace_fps = 0;
+  if (movie_file && !getopt_get_bool(getopt, "unpaced")) {
+    s.pace_fps = cap->get(cv::CAP_PROP_FPS);
+  }
+  s.td = td;
+  s.captured = new frame_queue(depth);
+  s.detected = new frame_queue(depth);
+  s.ncaptured = 0;
+
+  // successive frames see much the same poses, so each tag's pose is
+  // refined from where it was in the previous frame.
+  pose_tracker_t* tracker = pose_tracker_create();
 
   cv::namedWindow(window);
 
-  while (1) {
-    bool ok = cap->read(frame);
-    if (!ok) { break; }
-    cv::imshow(window, frame);
+  pthread_t capture_thread, detect_thread;
+  pthread_create(&capture_thread, NULL, capture_run, &s);
+  pthread_create(&detect_thread, NULL, detect_run, &s);
 
-    Mat8uc1 gray;
+  int nshown = 0;
+  int64_t utime_first = 0, latency_sum = 0, latency_max = 0;
 
-    if (frame.channels() == 3) {
-      cv::cvtColor(frame, gray, cv::COLOR_RGB2GRAY);
-    }
-    else {
-      frame.copyTo(gray);
-    }
+  while (frame_item* item = s.detected->pop()) {
 
-    image_u8_t* im8 = cv2im8_copy(gray);
+    zarray_t* detections = item->detections;
 
-    zarray_t *detections = apriltag_detector_detect(td, im8);
+    int64_t now = utime_now();
+    int64_t latency = now - item->utime_captured;
 
-    printf("Detected %d tags.\n", zarray_size(detections));
+    if (nshown == 0) {
+      utime_first = now;
+    }
+    nshown++;
+    latency_sum += latency;
+    latency_max = std::max(latency_max, latency);
+
+    double fps = nshown > 1 ? (nshown - 1) / ((now - utime_first) * 1e-6) : 0;
 
-    cv::Mat display = detectionsImage(detections, frame.size(), frame.type());
+    printf("Frame %d: %d tags, latency %.1f ms (detect %.1f ms), %.1f fps\n",
+           item->seq, zarray_size(detections), latency * 1e-3,
+           (item->utime_detected - item->utime_captured) * 1e-3, fps);
 
-    for (int i = 0; i < zarray_size(detections); i++) {
+    cv::Mat display = detectionsImage(detections, item->frame.size(), item->frame.type());
+
+    for (int i = 0; !quiet && i < zarray_size(detections); i++) {
       apriltag_detection_t *det;
       zarray_get(detections, i, &det);
 
-      matd_t* M = pose_from_homography(det->H, fx, fy, cx, cy,
-                                       tagsize, z_sign, det->p, NULL, NULL);
+      matd_t* M = pose_tracker_update(tracker, det->family, det->id, det->H,
+                                      fx, fy, cx, cy, tagsize, z_sign,
+                                      det->p, NULL, NULL);
 
       printf("Detection %d of %d:\n \tFamily: tag%2dh%2d\n \tID: %d\n \tHamming: %d\n"
              "\tGoodness: %.3f\n \tMargin: %.3f\n \tCenter: (%.3f,%.3f)\n"
@@ -132,21 +327,47 @@ int main(int argc, char** argv) {
       matd_print(det->H, MAT_FMT);
       printf("\tPose:\n");
       matd_print(M, MAT_FMT);
+      matd_destroy(M);
     }
 
-    printf("\n");
-
-    apriltag_detections_destroy(detections);
+    if (!quiet) {
+      printf("\n");
+    }
 
-    display = 0.5*display + 0.5*frame;
+    display = 0.5*display + 0.5*item->frame;
     cv::imshow(window, display);
-    image_u8_destroy(im8);
+
+    delete item;
 
     int k = cv::waitKey(1);
-    if (k == 27) { break; }
+    if (k == 27) {
+      // stop the other threads (the capture thread once its current
+      // read returns).
+      s.captured->close();
+      s.detected->close();
+      break;
+    }
 
   }
 
+  pthread_join(capture_thread, NULL);
+  pthread_join(detect_thread, NULL);
+
+  double elapsed = (utime_now() - utime_first) * 1e-6;
+
+  printf("%d frames captured, %d shown (%d dropped before detection, %d before display), "
+         "%.1f fps shown; latency mean %.1f ms, max %.1f ms\n",
+         s.ncaptured, nshown, s.captured->dropped(), s.detected->dropped(),
+         nshown > 1 ? (nshown - 1) / elapsed : 0,
+         nshown ? latency_sum * 1e-3 / nshown : 0, latency_max * 1e-3);
+
+  delete s.captured;
+  delete s.detected;
+  delete cap;
+
+  pose_tracker_destroy(tracker);
+  apriltag_detector_destroy(td);
+
   return 0;
 
 }
@@ -0,0 +1,609 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "apriltag.h"
+#include "apriltag_family.h"
+#include "common/image_u8.h"
+#include "common/zarray.h"
+
+// The native module of scripts/apriltag.py: a detector that detects
+// with the GIL released (so that the other Python threads run
+// meanwhile), and a worker that detects the frames submitted to it on
+// a thread of its own, the newest first, so that neither capturing
+// nor detecting waits for the other. Detections are returned as the
+// bytes of their apriltag_detection_record_t (DETECTION_DTYPE, in
+// apriltag.py), one per detection.
+
+#define MAX_FAMILIES 16
+
+typedef struct
+{
+    PyObject_HEAD
+
+    apriltag_detector_t *td;
+    apriltag_family_t *families[MAX_FAMILIES];
+    int nfamilies;
+
+    // (held while detecting: the detector detects one frame at a
+    // time, and is used without the GIL.)
+    PyThread_type_lock lock;
+
+    // the records of detect, and the copy of the frames the detector
+    // blurs in place (see apriltag_detector_t.quad_sigma).
+    apriltag_detection_record_t *records;
+    int capacity;
+    image_u8_t *copy;
+} DetectorObject;
+
+// Detect im with the detector's lock held (and the GIL released) into
+// *records, growing them (their capacity in *capacity) until they
+// hold every detection. Returns the number of detections.
+static int detect_records(DetectorObject *self, image_u8_t *im,
+                          apriltag_detection_record_t **records, int *capacity)
+{
+    while (1) {
+        int n = apriltag_detector_detect_into(self->td, im, *records, *capacity);
+        if (n <= *capacity)
+            return n;
+
+        free(*records);
+        *capacity = 2 * n;
+        *records = calloc(*capacity, sizeof(apriltag_detection_record_t));
+    }
+}
+
+// A 2D buffer of bytes, whose rows are contiguous, as an image_u8
+// (view); 0, or -1 having raised an exception.
+static int get_image(PyObject *obj, Py_buffer *view)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_RECORDS_RO) != 0)
+        return -1;
+
+    if (view->ndim != 2 || view->itemsize != 1 || view->strides[1] != 1 || view->strides[0] < view->shape[1] ||
+        view->shape[0] > INT32_MAX || view->shape[1] > INT32_MAX || view->strides[0] > INT32_MAX) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "the image must be 2D, of 8 bit pixels in rows of consecutive bytes");
+        return -1;
+    }
+
+    return 0;
+}
+
+static image_u8_t image_of(const Py_buffer *view)
+{
+    image_u8_t im = { .width = view->shape[1], .height = view->shape[0], .stride = view->strides[0],
+                      .buf = view->buf };
+    return im;
+}
+
+////////////////////////////////////////////////////////////////////
+// Detector
+
+static int Detector_init(DetectorObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = { "families", "border", "nthreads", "quad_decimate", "quad_sigma",
+                                "refine_edges", "refine_decode", "refine_pose", NULL };
+
+    const char *families = "tag36h11";
+    int border = 1, nthreads = 4, refine_edges = 1, refine_decode = 0, refine_pose = 0;
+    float quad_decimate = 1, quad_sigma = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|siiffiii", keywords, &families, &border, &nthreads,
+                                     &quad_decimate, &quad_sigma, &refine_edges, &refine_decode, &refine_pose))
+        return -1;
+
+    if (self->td) {
+        PyErr_SetString(PyExc_RuntimeError, "the detector is already initialized");
+        return -1;
+    }
+
+    self->lock = PyThread_allocate_lock();
+    self->td = apriltag_detector_create();
+    self->td->nthreads = nthreads;
+    self->td->quad_decimate = quad_decimate;
+    self->td->quad_sigma = quad_sigma;
+    self->td->refine_edges = refine_edges;
+    self->td->refine_decode = refine_decode;
+    self->td->refine_pose = refine_pose;
+
+    self->capacity = 64;
+    self->records = calloc(self->capacity, sizeof(apriltag_detection_record_t));
+
+    // (separated by anything but letters and digits, as in apriltag.py;
+    // "all" is every family.)
+    char all[1024] = "";
+    if (!strcmp(families, "all")) {
+        zarray_t *names = apriltag_family_list();
+        for (int i = 0; i < zarray_size(names); i++) {
+            char *name;
+            zarray_get(names, i, &name);
+            snprintf(all + strlen(all), sizeof(all) - strlen(all), "%s,", name);
+        }
+        apriltag_family_list_destroy(names);
+        families = all;
+    }
+
+    char name[64];
+    for (const char *p = families; *p; ) {
+        int len = 0;
+        while (*p && !isalnum((unsigned char) *p))
+            p++;
+        while (*p && isalnum((unsigned char) *p)) {
+            if (len < (int) sizeof(name) - 1)
+                name[len++] = *p;
+            p++;
+        }
+        name[len] = 0;
+        if (!len)
+            break;
+
+        if (self->nfamilies == MAX_FAMILIES) {
+            PyErr_Format(PyExc_ValueError, "at most %d families can be used", MAX_FAMILIES);
+            return -1;
+        }
+
+        apriltag_family_t *tf = apriltag_family_create(name);
+        if (!tf) {
+            PyErr_Format(PyExc_ValueError, "unrecognized tag family name %s (e.g. tag36h11)", name);
+            return -1;
+        }
+
+        tf->black_border = border;
+
+        // (building the family's decode table may take a while.)
+        Py_BEGIN_ALLOW_THREADS
+        apriltag_detector_add_family(self->td, tf);
+        Py_END_ALLOW_THREADS
+
+        self->families[self->nfamilies++] = tf;
+    }
+
+    return 0;
+}
+
+static void Detector_dealloc(DetectorObject *self)
+{
+    if (self->td)
+        apriltag_detector_destroy(self->td);
+    for (int i = 0; i < self->nfamilies; i++)
+        apriltag_family_destroy(self->families[i]);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    free(self->records);
+    image_u8_destroy(self->copy);
+
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int check_detector(DetectorObject *self)
+{
+    if (!self->td) {
+        PyErr_SetString(PyExc_RuntimeError, "the detector is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *Detector_detect(DetectorObject *self, PyObject *arg)
+{
+    if (check_detector(self) != 0)
+        return NULL;
+
+    Py_buffer view;
+    if (get_image(arg, &view) != 0)
+        return NULL;
+
+    image_u8_t im = image_of(&view);
+    int n;
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+
+    image_u8_t *detected = &im;
+    if (self->td->quad_sigma != 0) {
+        if (!self->copy || self->copy->width != im.width || self->copy->height != im.height) {
+            image_u8_destroy(self->copy);
+            self->copy = image_u8_create(im.width, im.height);
+        }
+        for (int y = 0; y < im.height; y++)
+            memcpy(&self->copy->buf[y*self->copy->stride], &im.buf[y*im.stride], im.width);
+        detected = self->copy;
+    }
+
+    n = detect_records(self, detected, &self->records, &self->capacity);
+
+    Py_END_ALLOW_THREADS
+
+    // (with the lock still held, so that no other call detects into
+    // the records meanwhile.)
+    PyObject *records = PyBytes_FromStringAndSize((const char*) self->records,
+                                                  (Py_ssize_t) n * sizeof(apriltag_detection_record_t));
+    PyThread_release_lock(self->lock);
+
+    PyBuffer_Release(&view);
+    return records;
+}
+
+static PyObject *Detector_family_name(DetectorObject *self, PyObject *arg)
+{
+    uintptr_t address = PyLong_AsSize_t(arg);
+    if (PyErr_Occurred())
+        return NULL;
+
+    for (int i = 0; i < self->nfamilies; i++) {
+        if ((uintptr_t) self->families[i] == address)
+            return PyUnicode_FromString(self->families[i]->name);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Detector_methods[] = {
+    { "detect", (PyCFunction) Detector_detect, METH_O,
+      "detect(image) -> bytes\n\n"
+      "The detections of a 2D uint8 image (e.g. a numpy array, detected in place), as the bytes of\n"
+      "their records (see apriltag.DETECTION_DTYPE). Releases the GIL while detecting." },
+    { "family_name", (PyCFunction) Detector_family_name, METH_O,
+      "family_name(family) -> str\n\nThe name of the family of a record (its 'family' field), or None." },
+    { NULL }
+};
+
+static PyTypeObject DetectorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_apriltag.Detector",
+    .tp_doc = "Detector(families='tag36h11', border=1, nthreads=4, quad_decimate=1.0, quad_sigma=0.0,\n"
+              "         refine_edges=1, refine_decode=0, refine_pose=0)\n\n"
+              "An apriltag_detector, kept for every frame it detects (with its decode tables and threads).",
+    .tp_basicsize = sizeof(DetectorObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Detector_init,
+    .tp_dealloc = (destructor) Detector_dealloc,
+    .tp_methods = Detector_methods,
+};
+
+////////////////////////////////////////////////////////////////////
+// VideoWorker
+
+typedef struct
+{
+    PyObject_HEAD
+
+    DetectorObject *detector;
+
+    pthread_t thread;
+    int running;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+
+    // the newest frame submitted, which is detected next unless
+    // another comes first (frame_seq is 0 once it has been taken),
+    // and the one being detected.
+    image_u8_t *frame, *detecting;
+    uint64_t frame_seq, next_seq;
+    int64_t ndropped;
+
+    // the detections of the newest frame detected (results_seq), and
+    // the records the thread detects into.
+    apriltag_detection_record_t *results, *records;
+    int nresults, results_capacity, capacity;
+    uint64_t results_seq;
+} WorkerObject;
+
+static void *worker_thread(void *p)
+{
+    WorkerObject *self = p;
+
+    pthread_mutex_lock(&self->mutex);
+
+    while (1) {
+        while (!self->stop && !self->frame_seq)
+            pthread_cond_wait(&self->cond, &self->mutex);
+        if (self->stop)
+            break;
+
+        image_u8_t *im = self->frame;
+        self->frame = self->detecting;
+        self->detecting = im;
+        uint64_t seq = self->frame_seq;
+        self->frame_seq = 0;
+
+        pthread_mutex_unlock(&self->mutex);
+
+        PyThread_acquire_lock(self->detector->lock, WAIT_LOCK);
+        int n = detect_records(self->detector, im, &self->records, &self->capacity);
+        PyThread_release_lock(self->detector->lock);
+
+        pthread_mutex_lock(&self->mutex);
+
+        // (the results swap with the records, keeping the larger
+        // capacity with the records.)
+        apriltag_detection_record_t *results = self->results;
+        int results_capacity = self->results_capacity;
+        self->results = self->records;
+        self->results_capacity = self->capacity;
+        self->nresults = n;
+        self->results_seq = seq;
+
+        if (results_capacity < self->capacity) {
+            free(results);
+            results = calloc(self->capacity, sizeof(apriltag_detection_record_t));
+            results_capacity = self->capacity;
+        }
+        self->records = results;
+        self->capacity = results_capacity;
+
+        pthread_cond_broadcast(&self->cond);
+    }
+
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+static int Worker_init(WorkerObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = { "detector", NULL };
+
+    DetectorObject *detector;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!", keywords, &DetectorType, &detector))
+        return -1;
+    if (check_detector(detector) != 0)
+        return -1;
+
+    if (self->detector) {
+        PyErr_SetString(PyExc_RuntimeError, "the worker is already initialized");
+        return -1;
+    }
+
+    Py_INCREF(detector);
+    self->detector = detector;
+
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+
+    self->capacity = self->results_capacity = 64;
+    self->records = calloc(self->capacity, sizeof(apriltag_detection_record_t));
+    self->results = calloc(self->results_capacity, sizeof(apriltag_detection_record_t));
+
+    if (pthread_create(&self->thread, NULL, worker_thread, self) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "couldn't start the worker thread");
+        return -1;
+    }
+    self->running = 1;
+
+    return 0;
+}
+
+static void worker_stop(WorkerObject *self)
+{
+    if (!self->running)
+        return;
+
+    pthread_mutex_lock(&self->mutex);
+    self->stop = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS
+
+    self->running = 0;
+}
+
+static void Worker_dealloc(WorkerObject *self)
+{
+    worker_stop(self);
+
+    if (self->detector) {
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->cond);
+    }
+
+    image_u8_destroy(self->frame);
+    image_u8_destroy(self->detecting);
+    free(self->records);
+    free(self->results);
+    Py_XDECREF(self->detector);
+
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject *Worker_submit(WorkerObject *self, PyObject *arg)
+{
+    if (!self->running) {
+        PyErr_SetString(PyExc_RuntimeError, "the worker is closed");
+        return NULL;
+    }
+
+    Py_buffer view;
+    if (get_image(arg, &view) != 0)
+        return NULL;
+
+    image_u8_t im = image_of(&view);
+    uint64_t seq;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->mutex);
+
+    image_u8_t *frame = self->frame;
+    if (!frame || frame->width != im.width || frame->height != im.height) {
+        image_u8_destroy(frame);
+        frame = self->frame = image_u8_create(im.width, im.height);
+    }
+    for (int y = 0; y < im.height; y++)
+        memcpy(&frame->buf[y*frame->stride], &im.buf[y*im.stride], im.width);
+
+    // (a frame not yet taken is never detected.)
+    if (self->frame_seq)
+        self->ndropped++;
+    seq = self->frame_seq = ++self->next_seq;
+
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
+
+    return PyLong_FromUnsignedLongLong(seq);
+}
+
+static PyObject *Worker_latest(WorkerObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = { "after", "timeout", NULL };
+
+    unsigned long long after = 0;
+    double timeout = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Kd", keywords, &after, &timeout))
+        return NULL;
+
+    if (!self->detector) {
+        PyErr_SetString(PyExc_RuntimeError, "the worker is not initialized");
+        return NULL;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    uint64_t seq;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->mutex);
+
+    while (self->results_seq <= after && timeout > 0 && self->running &&
+           pthread_cond_timedwait(&self->cond, &self->mutex, &deadline) == 0)
+        ;
+
+    seq = self->results_seq;
+    pthread_mutex_unlock(&self->mutex);
+    Py_END_ALLOW_THREADS
+
+    if (seq <= after)
+        Py_RETURN_NONE;
+
+    // (the results may have been replaced by newer ones meanwhile.)
+    pthread_mutex_lock(&self->mutex);
+    PyObject *records = PyBytes_FromStringAndSize((const char*) self->results,
+                                                  (Py_ssize_t) self->nresults * sizeof(apriltag_detection_record_t));
+    seq = self->results_seq;
+    pthread_mutex_unlock(&self->mutex);
+
+    if (!records)
+        return NULL;
+    return Py_BuildValue("(KN)", (unsigned long long) seq, records);
+}
+
+static PyObject *Worker_close(WorkerObject *self, PyObject *unused)
+{
+    (void) unused;
+    worker_stop(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Worker_get_ndropped(WorkerObject *self, void *closure)
+{
+    (void) closure;
+    if (!self->detector)
+        return PyLong_FromLong(0);
+
+    pthread_mutex_lock(&self->mutex);
+    int64_t n = self->ndropped;
+    pthread_mutex_unlock(&self->mutex);
+
+    return PyLong_FromLongLong(n);
+}
+
+static PyObject *Worker_get_pending(WorkerObject *self, void *closure)
+{
+    (void) closure;
+    if (!self->detector)
+        return PyBool_FromLong(0);
+
+    // (submitted, and either not taken yet or being detected.)
+    pthread_mutex_lock(&self->mutex);
+    int pending = self->results_seq < self->next_seq;
+    pthread_mutex_unlock(&self->mutex);
+
+    return PyBool_FromLong(pending);
+}
+
+static PyMethodDef Worker_methods[] = {
+    { "submit", (PyCFunction) Worker_submit, METH_O,
+      "submit(image) -> int\n\n"
+      "Copy a 2D uint8 image to be detected next (instead of any frame submitted before it that\n"
+      "hasn't started), and return its sequence number (from 1)." },
+    { "latest", (PyCFunction) Worker_latest, METH_VARARGS | METH_KEYWORDS,
+      "latest(after=0, timeout=0.0) -> (int, bytes)\n\n"
+      "The sequence number and detections (as from Detector.detect) of the newest frame detected,\n"
+      "if its number is more than after, waiting up to timeout seconds for one; otherwise None." },
+    { "close", (PyCFunction) Worker_close, METH_NOARGS,
+      "close()\n\nStop the worker (once it has detected the frame it is detecting)." },
+    { NULL }
+};
+
+static PyGetSetDef Worker_getset[] = {
+    { "ndropped", (getter) Worker_get_ndropped, NULL,
+      "The number of frames submitted that were replaced before they were detected.", NULL },
+    { "pending", (getter) Worker_get_pending, NULL,
+      "Whether a frame submitted hasn't been detected yet.", NULL },
+    { NULL }
+};
+
+static PyTypeObject WorkerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_apriltag.VideoWorker",
+    .tp_doc = "VideoWorker(detector)\n\n"
+              "Detects, on a thread of its own, the newest of the frames submitted to it, with detector.",
+    .tp_basicsize = sizeof(WorkerObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Worker_init,
+    .tp_dealloc = (destructor) Worker_dealloc,
+    .tp_methods = Worker_methods,
+    .tp_getset = Worker_getset,
+};
+
+////////////////////////////////////////////////////////////////////
+
+static struct PyModuleDef apriltag_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_apriltag",
+    .m_doc = "The native part of apriltag.py: detection with the GIL released, and a video worker.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__apriltag(void)
+{
+    if (PyType_Ready(&DetectorType) < 0 || PyType_Ready(&WorkerType) < 0)
+        return NULL;
+
+    PyObject *m = PyModule_Create(&apriltag_module);
+    if (!m)
+        return NULL;
+
+    Py_INCREF(&DetectorType);
+    Py_INCREF(&WorkerType);
+    if (PyModule_AddObject(m, "Detector", (PyObject*) &DetectorType) < 0 ||
+        PyModule_AddObject(m, "VideoWorker", (PyObject*) &WorkerType) < 0 ||
+        PyModule_AddIntConstant(m, "RECORD_SIZE", sizeof(apriltag_detection_record_t)) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
+}